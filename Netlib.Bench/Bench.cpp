@@ -0,0 +1,363 @@
+// Bench.cpp : Runs one of the native benchmarks, which are only built into this project so they never ship in
+// the DLLs. The first argument names the benchmark, the rest are its parameters, missing ones take the defaults.
+//
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include "Raslib.h"
+#include "Executor.h"
+#include "FlightRecorder.h"
+#include "Metrics.h"
+#include "RasSimBench.h"
+#include "Backend.h"
+#include "DnsForwarder.h"
+#include "KillswitchPolicy.h"
+#include "ManagementParser.h"
+#include "ManagementTransport.h"
+#include "PortPolicy.h"
+#include "RouteSet.h"
+#include "StatusPage.h"
+#include "Supervisor.h"
+#include "UsageJournal.h"
+
+#define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
+
+typedef DWORD(*BenchFuncType)(int argc, wchar_t** argv);
+
+typedef struct _Bench
+{
+	LPCWSTR Name;
+	LPCWSTR Usage;
+	BenchFuncType Func;
+} Bench;
+
+static UINT64 Number(int argc, wchar_t** argv, int index, UINT64 fallback)
+{
+	return index < argc ? _wcstoui64(argv[index], NULL, 0) : fallback;
+}
+
+static LPCWSTR Text(int argc, wchar_t** argv, int index, LPCWSTR fallback)
+{
+	return index < argc ? argv[index] : fallback;
+}
+
+static void PrintRasSimLatency(LPCSTR name, const RasSimLatency* latency)
+{
+	printf("%-12s samples %lu errors %lu mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus allocs/op %.2f\n",
+		name, latency->Samples, latency->Errors, latency->MeanUs, latency->P50Us, latency->P90Us, latency->P99Us,
+		latency->MaxUs, latency->AllocsPerOp);
+}
+
+static DWORD RunExecutor(int argc, wchar_t** argv)
+{
+	ExecutorBenchReport report;
+
+	DWORD result = ExecutorRunBenchmark((UINT)Number(argc, argv, 0, 100000), (UINT)Number(argc, argv, 1, 1000), (DWORD)Number(argc, argv, 2, 2000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("workers %u\n", report.Workers);
+		printf("dispatch samples %lu mean %.1fus p50 %.1fus p99 %.1fus max %.1fus\n", report.Dispatch.Samples,
+			report.Dispatch.MeanUs, report.Dispatch.P50Us, report.Dispatch.P99Us, report.Dispatch.MaxUs);
+		printf("fan out %.0f tasks/s, %llu steals\n", report.FanOutPerSecond, report.Steals);
+		printf("timer lateness samples %lu mean %.1fus p50 %.1fus p99 %.1fus max %.1fus\n", report.TimerLateness.Samples,
+			report.TimerLateness.MeanUs, report.TimerLateness.P50Us, report.TimerLateness.P99Us, report.TimerLateness.MaxUs);
+		printf("wakeups idle %.1f/s, periodic %.1f/s\n", report.IdleWakeupsPerSecond, report.PeriodicWakeupsPerSecond);
+	}
+
+	return result;
+}
+
+static DWORD RunFlightRecorder(int argc, wchar_t** argv)
+{
+	FlightBenchReport report;
+
+	DWORD result = FlightRecorderRunBenchmark((UINT)Number(argc, argv, 0, 1000000), (UINT)Number(argc, argv, 1, 4), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("threads %u events %llu\n", report.Threads, report.Events);
+		printf("record %.1fns, shared ring %.1fns\n", report.RecordNs, report.SharedRecordNs);
+	}
+
+	return result;
+}
+
+static DWORD RunMetrics(int argc, wchar_t** argv)
+{
+	MetricsBenchReport report;
+
+	DWORD result = MetricsRunBenchmark((UINT)Number(argc, argv, 0, 4), Number(argc, argv, 1, 1000000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("threads %u increments %llu\n", report.Threads, report.Increments);
+		printf("counter %.1fns, observe %.1fns, render %.1fus\n", report.CounterNsMean, report.ObserveNsMean, report.RenderUsMean);
+	}
+
+	return result;
+}
+
+static DWORD RunRasSim(int argc, wchar_t** argv)
+{
+	RasSimBenchReport report;
+
+	DWORD result = RasSimRunBenchmark((UINT)Number(argc, argv, 0, 1000), (DWORD)Number(argc, argv, 1, 0), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		PrintRasSimLatency("dial", &report.Dial);
+		PrintRasSimLatency("abort", &report.Abort);
+		PrintRasSimLatency("disconnect", &report.Disconnect);
+		PrintRasSimLatency("stats", &report.Stats);
+	}
+
+	return result;
+}
+
+static DWORD RunRasSimStats(int argc, wchar_t** argv)
+{
+	RasSimLatency single;
+	RasSimLatency batched;
+
+	DWORD result = RasSimRunStatsBenchmark((UINT)Number(argc, argv, 0, 16), (UINT)Number(argc, argv, 1, 1000), &single, &batched);
+	if (result == ERROR_SUCCESS)
+	{
+		PrintRasSimLatency("single", &single);
+		PrintRasSimLatency("batched", &batched);
+	}
+
+	return result;
+}
+
+static DWORD RunReconnect(int argc, wchar_t** argv)
+{
+	RasSimReconnectScenario scenario;
+	RasSimReconnectReport report;
+
+	ZeroMemory(&scenario, sizeof(scenario));
+	scenario.Drops = (UINT)Number(argc, argv, 0, 20);
+	scenario.FailuresPerDrop = (UINT)Number(argc, argv, 1, 0);
+	scenario.OfflineMs = (DWORD)Number(argc, argv, 2, 0);
+	scenario.NotifyNetworkChange = Number(argc, argv, 3, 0) != 0;
+	scenario.Seed = GetTickCount64();
+
+	DWORD result = RasSimRunReconnectBenchmark(&scenario, &report);
+	if (result == ERROR_SUCCESS)
+	{
+		PrintRasSimLatency("outage", &report.Outage);
+		PrintRasSimLatency("recovery", &report.Recovery);
+		printf("dials %llu breaker trips %llu failovers %u\n", report.Dials, report.BreakerTrips, report.Failovers);
+	}
+
+	return result;
+}
+
+static DWORD RunBackendStartup(int argc, wchar_t** argv)
+{
+	static const LPCSTR Names[BackendCount] = { "ras", "wfp", "iphlpapi" };
+	BackendStartupReport report;
+
+	DWORD result = BackendRunStartupBenchmark(&report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("start working set %llukB private %llukB\n", report.StartWorkingSetKb, report.StartPrivateKb);
+		for (UINT i = 0; i < BackendCount; i++)
+		{
+			printf("%-9s loaded %d first %.1fus second %.1fus working set %+lldkB private %+lldkB\n", Names[i],
+				report.LoadedAtStart[i], report.FirstCallUs[i], report.SecondCallUs[i], report.WorkingSetDeltaKb[i],
+				report.PrivateDeltaKb[i]);
+		}
+	}
+
+	return result;
+}
+
+static DWORD RunDnsForwarder(int argc, wchar_t** argv)
+{
+	DnsForwarderBenchReport report;
+
+	DWORD result = DnsForwarderRunBenchmark((UINT)Number(argc, argv, 0, 10000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("miss %.0f queries/s, hit %.0f queries/s\n", report.MissQueriesPerSecond, report.HitQueriesPerSecond);
+		printf("hit latency samples %lu mean %.1fus p50 %.1fus p99 %.1fus max %.1fus\n", report.HitLatency.Samples,
+			report.HitLatency.MeanUs, report.HitLatency.P50Us, report.HitLatency.P99Us, report.HitLatency.MaxUs);
+		printf("lookup %.1fns\n", report.LookupNs);
+	}
+
+	return result;
+}
+
+static DWORD RunKillswitchPolicy(int argc, wchar_t** argv)
+{
+	KillswitchPolicyBenchReport report;
+
+	DWORD result = KillswitchPolicyRunBenchmark(Text(argc, argv, 0, L"killswitch-bench.policy"), (UINT)Number(argc, argv, 1, 64),
+		(ULONG)Number(argc, argv, 2, 0), (UINT)Number(argc, argv, 3, 1000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("policy %lu bytes, %u filters\n", report.PolicyBytes, report.Filters);
+		printf("build %.1fus, mapped %.1fus, save %.1fus\n", report.BuildUsMean, report.MappedUsMean, report.SaveUs);
+	}
+
+	return result;
+}
+
+static DWORD RunManagementParser(int argc, wchar_t** argv)
+{
+	ManagementParserBenchReport report;
+
+	DWORD result = ManagementParserRunBenchmark(Number(argc, argv, 0, 1000000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("lines %llu bytes %llu events %llu\n", report.Lines, report.Bytes, report.Events);
+		printf("%.0f lines/s, %.1f MB/s\n", report.LinesPerSecond, report.MegabytesPerSecond);
+	}
+
+	return result;
+}
+
+static DWORD RunManagementTransport(int argc, wchar_t** argv)
+{
+	ManagementTransportBenchReport report;
+
+	DWORD result = ManagementTransportRunBenchmark((UINT)Number(argc, argv, 0, 10000), (UINT)Number(argc, argv, 1, 16), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("commands %u max in flight %u\n", report.Commands, report.MaxInFlight);
+		printf("serial %.0f/s round trip %.1fus\n", report.SerialPerSecond, report.SerialRoundTripUsMean);
+		printf("pipelined %.0f/s round trip %.1fus max %luus\n", report.PipelinedPerSecond, report.PipelinedRoundTripUsMean,
+			report.PipelinedRoundTripUsMax);
+		printf("busy %llu notifications %llu\n", report.Busy, report.Notifications);
+	}
+
+	return result;
+}
+
+static DWORD RunPortPolicy(int argc, wchar_t** argv)
+{
+	PortPolicyBenchReport report;
+
+	DWORD result = PortPolicyRunBenchmark((UINT)Number(argc, argv, 0, 64), (UINT)Number(argc, argv, 1, 1000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("rules %u, %u conditions as given\n", report.Rules, report.RuleConditions);
+		printf("compiled %u conditions in %u filters, %.1fus\n", report.Conditions, report.Filters, report.CompileUsMean);
+	}
+
+	return result;
+}
+
+static DWORD RunRouteSet(int argc, wchar_t** argv)
+{
+	RouteSetBenchReport report;
+
+	DWORD result = RouteSetRunBenchmark((UINT)Number(argc, argv, 0, 10000), (ULONG)Number(argc, argv, 1, 0), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("routes %u diff %.2fms\n", report.Routes, report.DiffMsMean);
+		printf("apply all %.1fms churn %.1fms clear %.1fms\n", report.ApplyAllMs, report.ApplyChurnMs, report.ClearMs);
+	}
+
+	return result;
+}
+
+static DWORD RunStatusPage(int argc, wchar_t** argv)
+{
+	StatusPageBenchReport report;
+
+	DWORD result = StatusPageRunBenchmark((UINT)Number(argc, argv, 0, 4), (DWORD)Number(argc, argv, 1, 2000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("readers %lu reads %llu writes %llu retries %llu torn %llu\n", report.Readers, report.Reads, report.Writes,
+			report.Retries, report.TornReads);
+		printf("read %.1fns write %.1fns\n", report.ReadNsMean, report.WriteNsMean);
+	}
+
+	return result;
+}
+
+static DWORD RunSupervisor(int argc, wchar_t** argv)
+{
+	SupervisorBenchReport report;
+
+	if (argc < 1)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DWORD result = SupervisorRunBenchmark(argv[0], Text(argc, argv, 1, L""), (UINT)Number(argc, argv, 2, 20), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("spawns %u\n", report.Spawns);
+		printf("spawn to ready mean %.1fus min %luus max %luus\n", report.SpawnToReadyUsMean, report.SpawnToReadyUsMin,
+			report.SpawnToReadyUsMax);
+		printf("exit to ready mean %.1fus\n", report.ExitToReadyUsMean);
+	}
+
+	return result;
+}
+
+static DWORD RunUsageJournal(int argc, wchar_t** argv)
+{
+	UsageJournalBenchReport report;
+
+	DWORD result = UsageJournalRunBenchmark(Text(argc, argv, 0, L"journal-bench"), Number(argc, argv, 1, 1000000),
+		(UINT)Number(argc, argv, 2, 10000), &report);
+	if (result == ERROR_SUCCESS)
+	{
+		printf("samples %llu segments %u\n", report.Samples, report.Segments);
+		printf("append %.1fns query %.1fns open %.2fms\n", report.AppendNsMean, report.QueryNsMean, report.OpenMs);
+	}
+
+	return result;
+}
+
+static const Bench Benches[] =
+{
+	{ L"executor", L"[tasks] [timers] [idleMs]", RunExecutor },
+	{ L"flightrecorder", L"[eventsPerThread] [threads]", RunFlightRecorder },
+	{ L"metrics", L"[threads] [increments]", RunMetrics },
+	{ L"rassim", L"[iterations] [dialLatencyMs]", RunRasSim },
+	{ L"rassimstats", L"[devices] [iterations]", RunRasSimStats },
+	{ L"reconnect", L"[drops] [failuresPerDrop] [offlineMs] [notifyNetworkChange]", RunReconnect },
+	{ L"backend", L"", RunBackendStartup },
+	{ L"dnsforwarder", L"[queries]", RunDnsForwarder },
+	{ L"killswitchpolicy", L"[path] [remoteAddresses] [tapAdapterIndex] [iterations]", RunKillswitchPolicy },
+	{ L"mgmtparser", L"[lines]", RunManagementParser },
+	{ L"mgmttransport", L"[commands] [maxInFlight]", RunManagementTransport },
+	{ L"portpolicy", L"[rules] [iterations]", RunPortPolicy },
+	{ L"routeset", L"[routes] [interfaceIndex]", RunRouteSet },
+	{ L"statuspage", L"[readers] [durationMs]", RunStatusPage },
+	{ L"supervisor", L"imagePath [arguments] [spawns]", RunSupervisor },
+	{ L"usagejournal", L"[directory] [samples] [queries]", RunUsageJournal },
+};
+
+int wmain(int argc, wchar_t** argv)
+{
+	for (UINT i = 0; argc > 1 && i < CELEMS(Benches); i++)
+	{
+		if (_wcsicmp(argv[1], Benches[i].Name) != 0)
+		{
+			continue;
+		}
+
+		DWORD result = Benches[i].Func(argc - 2, argv + 2);
+		if (result != ERROR_SUCCESS)
+		{
+			printf("%ls failed with %lu\n", Benches[i].Name, result);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	printf("usage: Netlib.Bench <benchmark> [parameters]\n");
+	for (UINT i = 0; i < CELEMS(Benches); i++)
+	{
+		printf("  %ls %ls\n", Benches[i].Name, Benches[i].Usage);
+	}
+
+	return 1;
+}
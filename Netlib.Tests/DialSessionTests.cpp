@@ -0,0 +1,400 @@
+#include <windows.h>
+#include <Ras.h>
+#include <RasError.h>
+#include "Raslib.h"
+#include "RasApi.h"
+#include "RasSim.h"
+#include "Tests.h"
+
+TEST_SUITE(DialSessionTests);
+
+#define TEST_DEVICE L"RaslibTests"
+#define FAST_HOST L"fast.rassim"
+#define SLOW_HOST L"slow.rassim"
+#define STALL_HOST L"stall.rassim"
+#define DOWN_HOST L"down.rassim"
+
+// Dials to the stall host sit in RASCS_ConnectDevice until they are hung up
+static const RasSimStep StallScript[] =
+{
+	{ RASCS_OpenPort, 0, ERROR_SUCCESS },
+	{ RASCS_PortOpened, 0, ERROR_SUCCESS },
+	{ RASCS_ConnectDevice, 0, ERROR_SUCCESS },
+};
+
+typedef enum _Outcome
+{
+	OutcomeNone = 0,
+	OutcomeComplete,
+	OutcomeError,
+	OutcomeAbort,
+} Outcome;
+
+typedef struct _DialResult
+{
+	volatile LONG Outcome;
+	volatile LONG Calls;
+	UINT Winner;
+	DWORD Error;
+} DialResult;
+
+static void Finish(DialResult* result, Outcome outcome, UINT winner, DWORD error)
+{
+	result->Winner = winner;
+	result->Error = error;
+	InterlockedIncrement(&result->Calls);
+	InterlockedExchange(&result->Outcome, outcome);
+}
+
+static void _cdecl SessionComplete(HDIALSESSION session, LPVOID context)
+{
+	Finish((DialResult*)context, OutcomeComplete, 0, ERROR_SUCCESS);
+}
+
+static void _cdecl SessionError(HDIALSESSION session, DWORD error, LPVOID context)
+{
+	Finish((DialResult*)context, OutcomeError, 0, error);
+}
+
+static void _cdecl SessionAbort(HDIALSESSION session, LPVOID context)
+{
+	Finish((DialResult*)context, OutcomeAbort, 0, ERROR_CANCELLED);
+}
+
+static void _cdecl RaceComplete(HDIALRACE race, UINT winner, LPVOID context)
+{
+	Finish((DialResult*)context, OutcomeComplete, winner, ERROR_SUCCESS);
+}
+
+static void _cdecl RaceError(HDIALRACE race, DWORD error, LPVOID context)
+{
+	Finish((DialResult*)context, OutcomeError, 0, error);
+}
+
+static void _cdecl RaceAbort(HDIALRACE race, LPVOID context)
+{
+	Finish((DialResult*)context, OutcomeAbort, 0, ERROR_CANCELLED);
+}
+
+static void _cdecl LegacyComplete()
+{
+}
+
+static void _cdecl LegacyError(DWORD error)
+{
+}
+
+static void UseSimulator()
+{
+	RasSimEnable(TRUE);
+	RasSimReset();
+	RasSimSetHost(FAST_HOST, 20, ERROR_SUCCESS);
+	RasSimSetHost(SLOW_HOST, 2000, ERROR_SUCCESS);
+	RasSimSetHost(DOWN_HOST, 20, ERROR_SERVER_NOT_RESPONDING);
+	RasSimSetHostScript(STALL_HOST, StallScript, CELEMS(StallScript));
+}
+
+static void StopSimulator()
+{
+	RasSimReset();
+	RasSimEnable(FALSE);
+}
+
+static UINT CountConnections()
+{
+	RASCONN connections[RASLIB_MAX_RACE_SLOTS * 2];
+	DWORD size = sizeof(connections);
+	DWORD count = 0;
+
+	connections[0].dwSize = sizeof(RASCONN);
+	if (RaslibGetApi()->EnumConnections(connections, &size, &count) != ERROR_SUCCESS)
+	{
+		return MAXDWORD;
+	}
+
+	return count;
+}
+
+static void SessionConnects()
+{
+	DialResult result = {};
+	DialSessionCallbacks callbacks = { SessionComplete, SessionError, SessionAbort, &result };
+	HDIALSESSION session = 0;
+	DialSessionState state;
+	DWORD error;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionCreate(&callbacks, &session));
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionDial(session, TEST_DEVICE, FAST_HOST, L"user", L"pass"));
+	CHECK(TestWaitFor(&result.Outcome, OutcomeComplete, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionGetState(session, &state, &error));
+	CHECK_RESULT(DialSessionConnected, state);
+
+	// A session is only dialed once
+	CHECK_RESULT(ERROR_INVALID_STATE, DialSessionDial(session, TEST_DEVICE, FAST_HOST, L"user", L"pass"));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionHangUp(session));
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionClose(session));
+	CHECK_RESULT(1, result.Calls);
+
+	StopSimulator();
+}
+
+static void SessionAbortCancelsDial()
+{
+	DialResult result = {};
+	DialSessionCallbacks callbacks = { SessionComplete, SessionError, SessionAbort, &result };
+	HDIALSESSION session = 0;
+	DialSessionState state;
+	DWORD error;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionCreate(&callbacks, &session));
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionDial(session, TEST_DEVICE, STALL_HOST, L"user", L"pass"));
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionAbort(session));
+	CHECK(TestWaitFor(&result.Outcome, OutcomeAbort, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionGetState(session, &state, &error));
+	CHECK_RESULT(DialSessionAborted, state);
+	CHECK_RESULT(ERROR_INVALID_STATE, DialSessionAbort(session));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionClose(session));
+
+	// Nothing else fires once the abort has been reported
+	Sleep(100);
+	CHECK_RESULT(1, result.Calls);
+	CHECK_RESULT(0, CountConnections());
+
+	StopSimulator();
+}
+
+static void SessionClosedHandleIsInvalid()
+{
+	DialSessionCallbacks callbacks = {};
+	HDIALSESSION session = 0;
+	HDIALSESSION reused = 0;
+	DialSessionState state;
+	DWORD error;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionCreate(&callbacks, &session));
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionClose(session));
+
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialSessionGetState(session, &state, &error));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialSessionAbort(session));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialSessionClose(session));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialSessionGetState(0, &state, &error));
+
+	// The freed slot is handed out again under a new generation, the old handle still doesn't resolve
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionCreate(&callbacks, &reused));
+	CHECK((reused & 0xFFFF) == (session & 0xFFFF));
+	CHECK(reused != session);
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialSessionGetState(session, &state, &error));
+	CHECK_RESULT(ERROR_SUCCESS, DialSessionClose(reused));
+
+	StopSimulator();
+}
+
+static void RaceFastestWins()
+{
+	LPCWSTR hostnames[] = { SLOW_HOST, FAST_HOST, SLOW_HOST };
+	DialResult result = {};
+	DialRaceCallbacks callbacks = { RaceComplete, RaceError, RaceAbort, &result };
+	HDIALRACE race = 0;
+	UINT winner = MAXUINT;
+	WCHAR entryName[RAS_MaxEntryName + 1];
+	WCHAR expected[RAS_MaxEntryName + 1];
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, CELEMS(hostnames), CELEMS(hostnames), L"user", L"pass", &callbacks, &race));
+	CHECK(TestWaitFor(&result.Outcome, OutcomeComplete, TEST_TIMEOUT_MS));
+	CHECK_RESULT(1, result.Winner);
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceGetWinner(race, &winner, entryName, CELEMS(entryName)));
+	CHECK_RESULT(1, winner);
+	GetVpnDeviceSlotName(TEST_DEVICE, 1, expected, CELEMS(expected));
+	CHECK(lstrcmpW(entryName, expected) == 0);
+
+	// The slower attempts are hung up, leaving the winner's connection
+	Sleep(200);
+	CHECK_RESULT(1, CountConnections());
+	CHECK_RESULT(ERROR_INVALID_STATE, DialRaceAbort(race));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(race));
+	CHECK_RESULT(1, CountConnections());
+	CHECK_RESULT(1, result.Calls);
+
+	StopSimulator();
+}
+
+static void RaceFailsOverToNextCandidate()
+{
+	LPCWSTR hostnames[] = { DOWN_HOST, DOWN_HOST, FAST_HOST };
+	DialResult result = {};
+	DialRaceCallbacks callbacks = { RaceComplete, RaceError, RaceAbort, &result };
+	HDIALRACE race = 0;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, CELEMS(hostnames), 1, L"user", L"pass", &callbacks, &race));
+	CHECK(TestWaitFor(&result.Outcome, OutcomeComplete, TEST_TIMEOUT_MS));
+	CHECK_RESULT(2, result.Winner);
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(race));
+	CHECK_RESULT(1, result.Calls);
+
+	StopSimulator();
+}
+
+static void RaceFailsWhenEveryCandidateFails()
+{
+	LPCWSTR hostnames[] = { DOWN_HOST, DOWN_HOST, DOWN_HOST };
+	DialResult result = {};
+	DialRaceCallbacks callbacks = { RaceComplete, RaceError, RaceAbort, &result };
+	HDIALRACE race = 0;
+	UINT winner;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, CELEMS(hostnames), 2, L"user", L"pass", &callbacks, &race));
+	CHECK(TestWaitFor(&result.Outcome, OutcomeError, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_SERVER_NOT_RESPONDING, result.Error);
+	CHECK_RESULT(ERROR_NOT_FOUND, DialRaceGetWinner(race, &winner, NULL, 0));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(race));
+	CHECK_RESULT(1, result.Calls);
+
+	StopSimulator();
+}
+
+static void RaceAbortHangsUpEverySlot()
+{
+	LPCWSTR hostnames[] = { STALL_HOST, STALL_HOST, STALL_HOST };
+	DialResult result = {};
+	DialRaceCallbacks callbacks = { RaceComplete, RaceError, RaceAbort, &result };
+	HDIALRACE race = 0;
+	UINT winner;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, CELEMS(hostnames), CELEMS(hostnames), L"user", L"pass", &callbacks, &race));
+
+	// Let every slot get as far as the stall
+	Sleep(200);
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceAbort(race));
+	CHECK_RESULT(OutcomeAbort, result.Outcome);
+	CHECK_RESULT(ERROR_INVALID_STATE, DialRaceAbort(race));
+	CHECK_RESULT(ERROR_NOT_FOUND, DialRaceGetWinner(race, &winner, NULL, 0));
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(race));
+
+	Sleep(200);
+	CHECK_RESULT(0, CountConnections());
+	CHECK_RESULT(1, result.Calls);
+
+	StopSimulator();
+}
+
+static void RaceCloseWhileDialingCancels()
+{
+	LPCWSTR hostnames[] = { STALL_HOST, SLOW_HOST };
+	DialResult result = {};
+	DialRaceCallbacks callbacks = { RaceComplete, RaceError, RaceAbort, &result };
+	HDIALRACE race = 0;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, CELEMS(hostnames), CELEMS(hostnames), L"user", L"pass", &callbacks, &race));
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(race));
+
+	// The slow host would have connected by now had its dial been left running
+	Sleep(2500);
+	CHECK_RESULT(0, CountConnections());
+	CHECK(result.Outcome != OutcomeComplete);
+
+	StopSimulator();
+}
+
+static void RaceClosedHandleIsInvalid()
+{
+	LPCWSTR hostnames[] = { FAST_HOST };
+	DialResult result = {};
+	DialRaceCallbacks callbacks = { RaceComplete, RaceError, RaceAbort, &result };
+	HDIALRACE race = 0;
+	HDIALRACE reused = 0;
+	UINT winner;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, 1, 1, L"user", L"pass", &callbacks, &race));
+	CHECK(TestWaitFor(&result.Outcome, OutcomeComplete, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(race));
+
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialRaceAbort(race));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialRaceGetWinner(race, &winner, NULL, 0));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialRaceClose(race));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialRaceAbort(0));
+
+	// Close the first race's connection so the next one can dial the same entry
+	CHECK_RESULT(ERROR_SUCCESS, DisconnectVpnDevice(TEST_DEVICE));
+
+	result.Outcome = OutcomeNone;
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceStart(TEST_DEVICE, hostnames, 1, 1, L"user", L"pass", &callbacks, &reused));
+	CHECK((reused & 0xFFFF) == (race & 0xFFFF));
+	CHECK(reused != race);
+	CHECK(TestWaitFor(&result.Outcome, OutcomeComplete, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, DialRaceGetWinner(race, &winner, NULL, 0));
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceGetWinner(reused, &winner, NULL, 0));
+	CHECK_RESULT(ERROR_SUCCESS, DialRaceClose(reused));
+
+	StopSimulator();
+}
+
+static void LegacyDisconnectFreesSession()
+{
+	HDIALSESSION sessions[RASLIB_MAX_DIAL_SESSIONS];
+	DialSessionCallbacks callbacks = {};
+	UINT created = 0;
+
+	UseSimulator();
+
+	CHECK_RESULT(ERROR_SUCCESS, ConnectVpnDevice(TEST_DEVICE, FAST_HOST, L"user", L"pass", LegacyComplete, LegacyError, LegacyComplete));
+	Sleep(200);
+	CHECK_RESULT(ERROR_SUCCESS, DisconnectVpnDevice(TEST_DEVICE));
+
+	// Every slot is free again once the legacy connection is gone
+	while (created < CELEMS(sessions) && DialSessionCreate(&callbacks, &sessions[created]) == ERROR_SUCCESS)
+	{
+		created++;
+	}
+
+	CHECK_RESULT(RASLIB_MAX_DIAL_SESSIONS, created);
+
+	for (UINT i = 0; i < created; i++)
+	{
+		DialSessionClose(sessions[i]);
+	}
+
+	StopSimulator();
+}
+
+const TestCase DialSessionTests[] =
+{
+	{ "SessionConnects", SessionConnects },
+	{ "SessionAbortCancelsDial", SessionAbortCancelsDial },
+	{ "SessionClosedHandleIsInvalid", SessionClosedHandleIsInvalid },
+	{ "RaceFastestWins", RaceFastestWins },
+	{ "RaceFailsOverToNextCandidate", RaceFailsOverToNextCandidate },
+	{ "RaceFailsWhenEveryCandidateFails", RaceFailsWhenEveryCandidateFails },
+	{ "RaceAbortHangsUpEverySlot", RaceAbortHangsUpEverySlot },
+	{ "RaceCloseWhileDialingCancels", RaceCloseWhileDialingCancels },
+	{ "RaceClosedHandleIsInvalid", RaceClosedHandleIsInvalid },
+	{ "LegacyDisconnectFreesSession", LegacyDisconnectFreesSession },
+};
+
+const UINT DialSessionTestsCount = CELEMS(DialSessionTests);
@@ -0,0 +1,533 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <string.h>
+#include "DnsCache.h"
+#include "Tests.h"
+
+TEST_SUITE(DnsCacheTests);
+
+#define TEST_PACKET_LENGTH 512
+#define TEST_HEADER_LENGTH 12
+#define TEST_RCODE_SERVER_FAILURE 2
+#define TEST_RCODE_REFUSED 5
+#define TEST_MAX_STUBS 2
+#define TEST_DEADLINE_MS 2000
+#define TEST_RETRY_MS 100
+// Longer than a lookup's deadline, so each lookup sends once unless a server fails
+#define TEST_SLOW_RETRY_MS 5000
+#define TEST_LATENCY_MS 300
+// A second on a tick count that moves every 16 ms or so
+#define TEST_SECOND_MS 1200
+// Entries are gone the moment their TTL runs out
+#define TEST_NO_STALE_MS 1
+#define TEST_STALE_MS 5000
+
+// What a stub server answers, picked by the first label of the name
+typedef enum _StubName
+{
+	// 10.0.0.1 for 300 seconds
+	StubFresh,
+	// 10.0.1.1 with a TTL of 0
+	StubZero,
+	// 10.0.2.1 for an hour
+	StubLong,
+	// 10.0.3.<queries so far> for a second, after TEST_LATENCY_MS
+	StubChanging,
+	// 10.0.4.1 for a second the first time, SERVFAIL after that
+	StubFlaky,
+	// SERVFAIL from the first server, 10.0.5.1 from the others
+	StubServfail,
+	// REFUSED from the first server, 10.0.6.1 from the others
+	StubRefused,
+	// 10.0.7.1
+	StubTwinA,
+	// 10.0.7.1 and 10.0.7.2
+	StubTwinB,
+	StubNameCount
+} StubName;
+
+static const LPCSTR StubLabels[StubNameCount] = { "fresh", "zero", "long", "changing", "flaky", "servfail", "refused", "twin-a", "twin-b" };
+
+typedef struct _Stub
+{
+	SOCKET Socket;
+	HANDLE Thread;
+	SOCKADDR_IN Address;
+	// The first server fails the servfail and refused names
+	BOOL First;
+	volatile LONG Queries[StubNameCount];
+} Stub;
+
+// The stub threads can outlive a failed test's stack, so the stubs live here
+static Stub Stubs[TEST_MAX_STUBS];
+
+static void WriteBE16(BYTE* p, USHORT value)
+{
+	p[0] = (BYTE)(value >> 8);
+	p[1] = (BYTE)value;
+}
+
+static void WriteBE32(BYTE* p, DWORD value)
+{
+	WriteBE16(p, (USHORT)(value >> 16));
+	WriteBE16(p + 2, (USHORT)value);
+}
+
+static int WriteAddress(BYTE* p, DWORD ttl, BYTE b, BYTE c, BYTE d)
+{
+	// Owned by the name in the question
+	p[0] = 0xC0;
+	p[1] = TEST_HEADER_LENGTH;
+	WriteBE16(p + 2, 1);
+	WriteBE16(p + 4, 1);
+	WriteBE32(p + 6, ttl);
+	WriteBE16(p + 10, 4);
+	p[12] = 10;
+	p[13] = b;
+	p[14] = c;
+	p[15] = d;
+
+	return 16;
+}
+
+// The name's index in StubLabels, and where the question ends in questionEnd
+static int StubNameFor(const BYTE* query, int length, int* questionEnd)
+{
+	CHAR label[64];
+	int offset = TEST_HEADER_LENGTH;
+	BYTE labelLength = query[offset];
+
+	if (offset + 1 + labelLength > length || labelLength >= sizeof(label))
+	{
+		return -1;
+	}
+
+	for (BYTE i = 0; i < labelLength; i++)
+	{
+		BYTE c = query[offset + 1 + i];
+		label[i] = (CHAR)(c >= 'A' && c <= 'Z' ? c + 32 : c);
+	}
+	label[labelLength] = 0;
+
+	while (offset < length && query[offset] != 0)
+	{
+		offset += 1 + query[offset];
+	}
+
+	*questionEnd = offset + 1 + 4;
+	if (*questionEnd > length)
+	{
+		return -1;
+	}
+
+	for (int i = 0; i < StubNameCount; i++)
+	{
+		if (strcmp(label, StubLabels[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Answers each query as its first label says until a datagram too short to be one arrives
+static DWORD WINAPI StubFunc(LPVOID parameter)
+{
+	Stub* stub = (Stub*)parameter;
+	BYTE packet[TEST_PACKET_LENGTH];
+
+	for (;;)
+	{
+		SOCKADDR_IN from;
+		int fromLength = sizeof(from);
+		int length = recvfrom(stub->Socket, (char*)packet, TEST_PACKET_LENGTH / 2, 0, (SOCKADDR*)&from, &fromLength);
+		int questionEnd = 0;
+
+		if (length < TEST_HEADER_LENGTH)
+		{
+			break;
+		}
+
+		int name = StubNameFor(packet, length, &questionEnd);
+		if (name < 0)
+		{
+			continue;
+		}
+
+		LONG queries = InterlockedIncrement(&stub->Queries[name]);
+		BYTE rcode = 0;
+		UINT answers = 1;
+
+		length = questionEnd;
+		switch (name)
+		{
+		case StubFresh:
+			length += WriteAddress(packet + length, 300, 0, 0, 1);
+			break;
+		case StubZero:
+			length += WriteAddress(packet + length, 0, 1, 1, 1);
+			break;
+		case StubLong:
+			length += WriteAddress(packet + length, 3600, 2, 1, 1);
+			break;
+		case StubChanging:
+			Sleep(TEST_LATENCY_MS);
+			length += WriteAddress(packet + length, 1, 3, 1, (BYTE)queries);
+			break;
+		case StubFlaky:
+			rcode = queries == 1 ? 0 : TEST_RCODE_SERVER_FAILURE;
+			length += queries == 1 ? WriteAddress(packet + length, 1, 4, 1, 1) : 0;
+			break;
+		case StubServfail:
+		case StubRefused:
+			rcode = stub->First ? (name == StubServfail ? TEST_RCODE_SERVER_FAILURE : TEST_RCODE_REFUSED) : 0;
+			length += stub->First ? 0 : WriteAddress(packet + length, 300, (BYTE)name, 1, 1);
+			break;
+		case StubTwinA:
+			length += WriteAddress(packet + length, 300, 7, 1, 1);
+			break;
+		case StubTwinB:
+			length += WriteAddress(packet + length, 300, 7, 1, 1);
+			length += WriteAddress(packet + length, 300, 7, 1, 2);
+			answers = 2;
+			break;
+		}
+
+		packet[2] = 0x80 | (packet[2] & 0x01);
+		packet[3] = 0x80 | rcode;
+		WriteBE16(packet + 6, rcode == 0 ? (USHORT)answers : 0);
+		WriteBE16(packet + 8, 0);
+		WriteBE16(packet + 10, 0);
+
+		sendto(stub->Socket, (const char*)packet, length, 0, (const SOCKADDR*)&from, fromLength);
+	}
+
+	return 0;
+}
+
+static void StopStubs()
+{
+	DnsCacheOptions defaults;
+
+	for (UINT i = 0; i < TEST_MAX_STUBS; i++)
+	{
+		Stub* stub = &Stubs[i];
+
+		if (stub->Thread != NULL)
+		{
+			BYTE stop = 0;
+
+			sendto(stub->Socket, (const char*)&stop, sizeof(stop), 0, (const SOCKADDR*)&stub->Address, sizeof(stub->Address));
+			WaitForSingleObject(stub->Thread, TEST_TIMEOUT_MS);
+			CloseHandle(stub->Thread);
+		}
+
+		if (stub->Address.sin_port != 0)
+		{
+			closesocket(stub->Socket);
+		}
+
+		ZeroMemory(stub, sizeof(*stub));
+	}
+
+	// Back to the defaults and the adapter servers for whatever runs next
+	ZeroMemory(&defaults, sizeof(defaults));
+	DnsCacheSetOptions(&defaults);
+	DnsCacheSetServers(NULL, 0, 0);
+	DnsCacheFlush();
+
+	WSACleanup();
+}
+
+// Starts stubCount stub servers sharing one port on 127.0.0.1, 127.0.0.2 and on, and points the cache at them
+static BOOL StartStubs(UINT stubCount, DWORD retryMs, DWORD staleMs, DWORD minTtlSeconds, DWORD maxTtlSeconds)
+{
+	LPCWSTR servers[TEST_MAX_STUBS] = { L"127.0.0.1", L"127.0.0.2" };
+	DnsCacheOptions options;
+	WSADATA wsaData;
+	USHORT port = 0;
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	CHECK_RESULT(ERROR_SUCCESS, result);
+	if (result != ERROR_SUCCESS)
+	{
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < stubCount; i++)
+	{
+		Stub* stub = &Stubs[i];
+		SOCKADDR_IN address;
+		int addressLength = sizeof(address);
+
+		ZeroMemory(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i);
+		address.sin_port = port;
+
+		stub->First = i == 0;
+		stub->Socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (stub->Socket == INVALID_SOCKET || bind(stub->Socket, (const SOCKADDR*)&address, sizeof(address)) != 0
+			|| getsockname(stub->Socket, (SOCKADDR*)&stub->Address, &addressLength) != 0)
+		{
+			CHECK_RESULT(ERROR_SUCCESS, WSAGetLastError());
+			if (stub->Socket != INVALID_SOCKET)
+			{
+				closesocket(stub->Socket);
+			}
+			stub->Socket = INVALID_SOCKET;
+			StopStubs();
+			return FALSE;
+		}
+
+		port = stub->Address.sin_port;
+		stub->Thread = CreateThread(NULL, 0, StubFunc, stub, 0, NULL);
+		CHECK(stub->Thread != NULL);
+		if (stub->Thread == NULL)
+		{
+			StopStubs();
+			return FALSE;
+		}
+	}
+
+	ZeroMemory(&options, sizeof(options));
+	options.RetryMs = retryMs;
+	options.StaleMs = staleMs;
+	options.MinTtlSeconds = minTtlSeconds;
+	options.MaxTtlSeconds = maxTtlSeconds;
+
+	DnsCacheFlush();
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheSetOptions(&options));
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheSetServers(servers, stubCount, ntohs(port)));
+
+	return TRUE;
+}
+
+static DWORD Resolve(LPCWSTR hostname)
+{
+	DWORD result = MAXDWORD;
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheResolve(&hostname, 1, TEST_DEADLINE_MS, &result));
+
+	return result;
+}
+
+// The first cached address of hostname as text, empty when it has none that can be served
+static void CachedAddress(LPCWSTR hostname, CHAR* address, size_t addressLength)
+{
+	WFPKS_ADDR_AND_MASK allowed[DNS_CACHE_MAX_ADDRESSES];
+	CHAR text[256];
+	UINT count = 0;
+
+	address[0] = '\0';
+
+	if (DnsCacheGetAllowlist(&hostname, 1, allowed, CELEMS(allowed), &count, text, sizeof(text)) == ERROR_SUCCESS && count > 0)
+	{
+		strncpy(address, allowed[0].szIpAddr, addressLength - 1);
+		address[addressLength - 1] = '\0';
+	}
+}
+
+static void AnswersAreCached()
+{
+	LPCWSTR hostnames[] = { L"fresh.test", L"Twin-A.Test.", L"10.9.8.7", L"bad..name" };
+	DWORD results[CELEMS(hostnames)];
+
+	if (!StartStubs(1, TEST_RETRY_MS, TEST_NO_STALE_MS, 0, 0))
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheResolve(hostnames, CELEMS(hostnames), TEST_DEADLINE_MS, results));
+	CHECK_RESULT(ERROR_SUCCESS, results[0]);
+	CHECK_RESULT(ERROR_SUCCESS, results[1]);
+	// Literals never go to a server, malformed names never leave the process
+	CHECK_RESULT(ERROR_SUCCESS, results[2]);
+	CHECK_RESULT(ERROR_INVALID_NAME, results[3]);
+	CHECK_RESULT(1, Stubs[0].Queries[StubFresh]);
+	CHECK_RESULT(1, Stubs[0].Queries[StubTwinA]);
+
+	// Names match whatever their case and a trailing dot
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"FRESH.test"));
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"twin-a.test."));
+	CHECK_RESULT(1, Stubs[0].Queries[StubFresh]);
+	CHECK_RESULT(1, Stubs[0].Queries[StubTwinA]);
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheFlush());
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"fresh.test"));
+	CHECK_RESULT(2, Stubs[0].Queries[StubFresh]);
+
+	StopStubs();
+}
+
+static void TtlsAreClamped()
+{
+	if (!StartStubs(1, TEST_RETRY_MS, TEST_NO_STALE_MS, 1, 2))
+	{
+		return;
+	}
+
+	// A TTL of 0 still lasts MinTtlSeconds, an hour only MaxTtlSeconds
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"zero.test"));
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"long.test"));
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"zero.test"));
+	CHECK_RESULT(1, Stubs[0].Queries[StubZero]);
+
+	Sleep(TEST_SECOND_MS);
+
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"zero.test"));
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"long.test"));
+	CHECK_RESULT(2, Stubs[0].Queries[StubZero]);
+	CHECK_RESULT(1, Stubs[0].Queries[StubLong]);
+
+	Sleep(TEST_SECOND_MS);
+
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"long.test"));
+	CHECK_RESULT(2, Stubs[0].Queries[StubLong]);
+
+	StopStubs();
+}
+
+static void StaleEntriesAreServedWhileRefreshing()
+{
+	CHAR address[16];
+
+	// No retransmits while the stub sits on the refresh
+	if (!StartStubs(1, TEST_SLOW_RETRY_MS, TEST_STALE_MS, 1, 0))
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"changing.test"));
+	CachedAddress(L"changing.test", address, sizeof(address));
+	CHECK(strcmp(address, "10.3.1.1") == 0);
+
+	Sleep(TEST_SECOND_MS);
+
+	// Past its TTL the old address goes out straight away, the stub takes TEST_LATENCY_MS to answer the refresh
+	ULONGLONG started = GetTickCount64();
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"changing.test"));
+	CHECK(GetTickCount64() - started < TEST_LATENCY_MS);
+	CachedAddress(L"changing.test", address, sizeof(address));
+	CHECK(strcmp(address, "10.3.1.1") == 0);
+
+	// Only the one refresh while it runs
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"changing.test"));
+	CHECK(TestWaitFor(&Stubs[0].Queries[StubChanging], 2, TEST_TIMEOUT_MS));
+
+	ULONGLONG deadline = GetTickCount64() + TEST_TIMEOUT_MS;
+	do
+	{
+		Sleep(10);
+		CachedAddress(L"changing.test", address, sizeof(address));
+	} while (strcmp(address, "10.3.1.2") != 0 && GetTickCount64() < deadline);
+
+	CHECK(strcmp(address, "10.3.1.2") == 0);
+	CHECK_RESULT(2, Stubs[0].Queries[StubChanging]);
+
+	StopStubs();
+}
+
+static void FailedRefreshKeepsAddresses()
+{
+	CHAR address[16];
+
+	if (!StartStubs(1, TEST_RETRY_MS, TEST_STALE_MS, 1, 0))
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"flaky.test"));
+
+	Sleep(TEST_SECOND_MS);
+
+	// The refresh gets SERVFAIL, the address it had stays until StaleMs is up
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"flaky.test"));
+	CHECK(TestWaitFor(&Stubs[0].Queries[StubFlaky], 2, TEST_TIMEOUT_MS));
+	Sleep(TEST_RETRY_MS);
+
+	CachedAddress(L"flaky.test", address, sizeof(address));
+	CHECK(strcmp(address, "10.4.1.1") == 0);
+
+	// The failed refresh is over, so the next lookup starts another
+	CHECK_RESULT(ERROR_SUCCESS, Resolve(L"flaky.test"));
+	CHECK(TestWaitFor(&Stubs[0].Queries[StubFlaky], 3, TEST_TIMEOUT_MS));
+
+	StopStubs();
+}
+
+static void FailingServersAreSkipped()
+{
+	LPCWSTR hostnames[] = { L"servfail.test", L"refused.test" };
+	DWORD results[CELEMS(hostnames)];
+
+	if (!StartStubs(TEST_MAX_STUBS, TEST_SLOW_RETRY_MS, TEST_NO_STALE_MS, 0, 0))
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheResolve(hostnames, CELEMS(hostnames), TEST_DEADLINE_MS, results));
+	CHECK_RESULT(ERROR_SUCCESS, results[0]);
+	CHECK_RESULT(ERROR_SUCCESS, results[1]);
+
+	for (UINT i = 0; i < TEST_MAX_STUBS; i++)
+	{
+		CHECK_RESULT(1, Stubs[i].Queries[StubServfail]);
+		CHECK_RESULT(1, Stubs[i].Queries[StubRefused]);
+	}
+
+	// With nobody else to ask the failure is the answer
+	LPCWSTR first[] = { L"127.0.0.1" };
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheSetServers(first, 1, ntohs(Stubs[0].Address.sin_port)));
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheFlush());
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheResolve(hostnames, CELEMS(hostnames), TEST_DEADLINE_MS, results));
+	CHECK_RESULT(DNS_ERROR_RESPONSE_CODES_BASE + TEST_RCODE_SERVER_FAILURE, results[0]);
+	CHECK_RESULT(DNS_ERROR_RESPONSE_CODES_BASE + TEST_RCODE_REFUSED, results[1]);
+
+	StopStubs();
+}
+
+static void AllowlistDropsDuplicates()
+{
+	LPCWSTR hostnames[] = { L"twin-a.test", L"twin-b.test", L"10.7.1.2", L"fresh.test" };
+	DWORD results[CELEMS(hostnames)];
+	WFPKS_ADDR_AND_MASK allowed[8];
+	CHAR text[256];
+	UINT count = 0;
+
+	if (!StartStubs(1, TEST_RETRY_MS, TEST_NO_STALE_MS, 0, 0))
+	{
+		return;
+	}
+
+	// fresh.test is never resolved, so it has nothing to add
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheResolve(hostnames, 3, TEST_DEADLINE_MS, results));
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsCacheGetAllowlist(hostnames, CELEMS(hostnames), allowed, CELEMS(allowed), &count, text, sizeof(text)));
+	CHECK_RESULT(2, count);
+	if (count == 2)
+	{
+		CHECK(strcmp(allowed[0].szIpAddr, "10.7.1.1") == 0);
+		CHECK(strcmp(allowed[1].szIpAddr, "10.7.1.2") == 0);
+		CHECK(strcmp(allowed[0].szMask, "255.255.255.255") == 0);
+		CHECK(allowed[0].szMask == allowed[1].szMask);
+	}
+
+	CHECK_RESULT(ERROR_MORE_DATA, DnsCacheGetAllowlist(hostnames, CELEMS(hostnames), allowed, 1, &count, text, sizeof(text)));
+	CHECK_RESULT(1, count);
+
+	StopStubs();
+}
+
+const TestCase DnsCacheTests[] =
+{
+	{ "AnswersAreCached", AnswersAreCached },
+	{ "TtlsAreClamped", TtlsAreClamped },
+	{ "StaleEntriesAreServedWhileRefreshing", StaleEntriesAreServedWhileRefreshing },
+	{ "FailedRefreshKeepsAddresses", FailedRefreshKeepsAddresses },
+	{ "FailingServersAreSkipped", FailingServersAreSkipped },
+	{ "AllowlistDropsDuplicates", AllowlistDropsDuplicates },
+};
+
+const UINT DnsCacheTestsCount = CELEMS(DnsCacheTests);
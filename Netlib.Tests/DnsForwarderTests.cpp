@@ -0,0 +1,509 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <string.h>
+#include "DnsForwarder.h"
+#include "Tests.h"
+
+TEST_SUITE(DnsForwarderTests);
+
+#define TEST_PACKET_LENGTH 512
+#define TEST_HEADER_LENGTH 12
+#define TEST_TYPE_A 1
+#define TEST_TYPE_SOA 6
+#define TEST_CLASS_IN 1
+#define TEST_FLAG_RESPONSE 0x80
+#define TEST_FLAG_TRUNCATED 0x02
+#define TEST_FLAG_RECURSION_DESIRED 0x01
+#define TEST_RCODE_NAME_ERROR 3
+#define TEST_ANSWER_TTL 300
+// The SOA's own TTL is the smaller of its two, so that's how long its negative answer lasts
+#define TEST_SOA_TTL 60
+#define TEST_SOA_MINIMUM 3600
+// Long enough for a one second TTL to run out on a tick count that moves every 16 ms or so
+#define TEST_EXPIRY_MS 1200
+
+// What the stub upstream answers, picked by the first label of the name
+typedef enum _StubAnswer
+{
+	// An address lasting TEST_ANSWER_TTL
+	StubAddress,
+	// An address lasting a second
+	StubBrief,
+	// NXDOMAIN with an SOA whose minimum is a second
+	StubMissing,
+	// No data with an SOA lasting TEST_SOA_TTL
+	StubNoData,
+	// NXDOMAIN with nothing to say how long it holds
+	StubNoSoa,
+	// An address with the truncated flag set
+	StubTruncated,
+	StubAnswerCount
+} StubAnswer;
+
+static const LPCSTR StubLabels[StubAnswerCount] = { "address", "brief", "missing", "nodata", "nosoa", "truncated" };
+static const BYTE StubSuffix[] = { 4, 't', 'e', 's', 't', 0, 0, TEST_TYPE_A, 0, TEST_CLASS_IN };
+
+// The stub upstream thread keeps counting after a failed test returns, so what it writes lives here
+static volatile LONG UpstreamQueries[StubAnswerCount];
+static SOCKET Upstream = INVALID_SOCKET;
+static HANDLE UpstreamThread;
+static SOCKET Client = INVALID_SOCKET;
+static SOCKADDR_IN Forwarder;
+
+static USHORT ReadBE16(const BYTE* p)
+{
+	return (USHORT)((p[0] << 8) | p[1]);
+}
+
+static DWORD ReadBE32(const BYTE* p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static void WriteBE16(BYTE* p, USHORT value)
+{
+	p[0] = (BYTE)(value >> 8);
+	p[1] = (BYTE)value;
+}
+
+static void WriteBE32(BYTE* p, DWORD value)
+{
+	WriteBE16(p, (USHORT)(value >> 16));
+	WriteBE16(p + 2, (USHORT)value);
+}
+
+// A record owned by the name in the question, type, class, TTL and the length of data the caller writes after it
+static int WriteRecord(BYTE* p, USHORT type, DWORD ttl, USHORT dataLength)
+{
+	p[0] = 0xC0;
+	p[1] = TEST_HEADER_LENGTH;
+	WriteBE16(p + 2, type);
+	WriteBE16(p + 4, TEST_CLASS_IN);
+	WriteBE32(p + 6, ttl);
+	WriteBE16(p + 10, dataLength);
+
+	return 12;
+}
+
+// Root mname and rname, then serial, refresh, retry, expire and minimum
+static int WriteSoa(BYTE* p, DWORD ttl, DWORD minimum)
+{
+	int length = WriteRecord(p, TEST_TYPE_SOA, ttl, 22);
+
+	memset(p + length, 0, 18);
+	WriteBE32(p + length + 18, minimum);
+
+	return length + 22;
+}
+
+static int WriteAddress(BYTE* p, DWORD ttl)
+{
+	static const BYTE address[] = { 192, 0, 2, 1 };
+	int length = WriteRecord(p, TEST_TYPE_A, ttl, sizeof(address));
+
+	memcpy(p + length, address, sizeof(address));
+
+	return length + sizeof(address);
+}
+
+static int StubAnswerFor(const BYTE* query, int length)
+{
+	CHAR label[64];
+	BYTE labelLength = query[TEST_HEADER_LENGTH];
+
+	if (TEST_HEADER_LENGTH + 1 + labelLength > length || labelLength >= sizeof(label))
+	{
+		return -1;
+	}
+
+	for (BYTE i = 0; i < labelLength; i++)
+	{
+		BYTE c = query[TEST_HEADER_LENGTH + 1 + i];
+		label[i] = (CHAR)(c >= 'A' && c <= 'Z' ? c + 32 : c);
+	}
+	label[labelLength] = 0;
+
+	for (int i = 0; i < StubAnswerCount; i++)
+	{
+		if (strcmp(label, StubLabels[i]) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Answers each query as its first label says until a datagram too short to be one arrives
+static DWORD WINAPI UpstreamFunc(LPVOID parameter)
+{
+	BYTE packet[TEST_PACKET_LENGTH];
+
+	for (;;)
+	{
+		SOCKADDR_IN from;
+		int fromLength = sizeof(from);
+
+		int length = recvfrom(Upstream, (char*)packet, TEST_PACKET_LENGTH / 2, 0, (SOCKADDR*)&from, &fromLength);
+		if (length < TEST_HEADER_LENGTH)
+		{
+			break;
+		}
+
+		int answer = StubAnswerFor(packet, length);
+		if (answer < 0)
+		{
+			continue;
+		}
+
+		InterlockedIncrement(&UpstreamQueries[answer]);
+
+		// The forwarder's queries carry no EDNS record, so the question runs to the end
+		BYTE rcode = answer == StubMissing || answer == StubNoSoa ? TEST_RCODE_NAME_ERROR : 0;
+		packet[2] = TEST_FLAG_RESPONSE | (packet[2] & TEST_FLAG_RECURSION_DESIRED) | (answer == StubTruncated ? TEST_FLAG_TRUNCATED : 0);
+		packet[3] = 0x80 | rcode;
+		WriteBE16(packet + 6, answer == StubAddress || answer == StubBrief || answer == StubTruncated ? 1 : 0);
+		WriteBE16(packet + 8, answer == StubMissing || answer == StubNoData ? 1 : 0);
+		WriteBE16(packet + 10, 0);
+
+		switch (answer)
+		{
+		case StubAddress:
+		case StubTruncated:
+			length += WriteAddress(packet + length, TEST_ANSWER_TTL);
+			break;
+		case StubBrief:
+			length += WriteAddress(packet + length, 1);
+			break;
+		case StubMissing:
+			length += WriteSoa(packet + length, TEST_SOA_TTL, 1);
+			break;
+		case StubNoData:
+			length += WriteSoa(packet + length, TEST_SOA_TTL, TEST_SOA_MINIMUM);
+			break;
+		}
+
+		sendto(Upstream, (const char*)packet, length, 0, (const SOCKADDR*)&from, fromLength);
+	}
+
+	return 0;
+}
+
+static void StopForwarder()
+{
+	DnsForwarderStop();
+
+	if (UpstreamThread != NULL)
+	{
+		SOCKADDR_IN address;
+		int addressLength = sizeof(address);
+		BYTE stop = 0;
+
+		if (getsockname(Upstream, (SOCKADDR*)&address, &addressLength) == 0)
+		{
+			sendto(Client, (const char*)&stop, sizeof(stop), 0, (const SOCKADDR*)&address, addressLength);
+		}
+
+		WaitForSingleObject(UpstreamThread, TEST_TIMEOUT_MS);
+		CloseHandle(UpstreamThread);
+		UpstreamThread = NULL;
+	}
+
+	if (Upstream != INVALID_SOCKET)
+	{
+		closesocket(Upstream);
+		Upstream = INVALID_SOCKET;
+	}
+
+	if (Client != INVALID_SOCKET)
+	{
+		closesocket(Client);
+		Client = INVALID_SOCKET;
+	}
+
+	WSACleanup();
+}
+
+// Starts the stub upstream on a free loopback port and a forwarder sending to it, options may be NULL
+static BOOL StartForwarder(DnsForwarderOptions* options)
+{
+	LPCWSTR upstreams[] = { L"127.0.0.1" };
+	DnsForwarderOptions defaults;
+	SOCKADDR_IN address;
+	int addressLength = sizeof(address);
+	USHORT boundPort = 0;
+	WSADATA wsaData;
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	CHECK_RESULT(ERROR_SUCCESS, result);
+	if (result != ERROR_SUCCESS)
+	{
+		return FALSE;
+	}
+
+	if (options == NULL)
+	{
+		ZeroMemory(&defaults, sizeof(defaults));
+		options = &defaults;
+	}
+
+	for (int i = 0; i < StubAnswerCount; i++)
+	{
+		InterlockedExchange(&UpstreamQueries[i], 0);
+	}
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	Upstream = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	Client = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (Upstream == INVALID_SOCKET || Client == INVALID_SOCKET
+		|| bind(Upstream, (const SOCKADDR*)&address, sizeof(address)) != 0
+		|| bind(Client, (const SOCKADDR*)&address, sizeof(address)) != 0
+		|| getsockname(Upstream, (SOCKADDR*)&address, &addressLength) != 0)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, WSAGetLastError());
+		StopForwarder();
+		return FALSE;
+	}
+
+	UpstreamThread = CreateThread(NULL, 0, UpstreamFunc, NULL, 0, NULL);
+	options->UpstreamPort = ntohs(address.sin_port);
+
+	result = UpstreamThread != NULL ? DnsForwarderStart(upstreams, CELEMS(upstreams), 0, options, &boundPort) : ERROR_NOT_ENOUGH_MEMORY;
+	CHECK_RESULT(ERROR_SUCCESS, result);
+	if (result != ERROR_SUCCESS)
+	{
+		StopForwarder();
+		return FALSE;
+	}
+
+	Forwarder.sin_family = AF_INET;
+	Forwarder.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	Forwarder.sin_port = htons(boundPort);
+
+	return TRUE;
+}
+
+// Sends an A query for <label>.test through the forwarder and waits for the reply, its length or 0 when none came.
+// The query's length is where the first record starts in the reply.
+static int Ask(LPCSTR label, USHORT id, BYTE* reply, int* queryLength)
+{
+	BYTE query[TEST_PACKET_LENGTH];
+	BYTE labelLength = (BYTE)strlen(label);
+	WSAPOLLFD pollFd;
+
+	memset(query, 0, TEST_HEADER_LENGTH);
+	WriteBE16(query, id);
+	query[2] = TEST_FLAG_RECURSION_DESIRED;
+	WriteBE16(query + 4, 1);
+	query[TEST_HEADER_LENGTH] = labelLength;
+	memcpy(query + TEST_HEADER_LENGTH + 1, label, labelLength);
+	memcpy(query + TEST_HEADER_LENGTH + 1 + labelLength, StubSuffix, sizeof(StubSuffix));
+	*queryLength = TEST_HEADER_LENGTH + 1 + labelLength + sizeof(StubSuffix);
+
+	sendto(Client, (const char*)query, *queryLength, 0, (const SOCKADDR*)&Forwarder, sizeof(Forwarder));
+
+	pollFd.fd = Client;
+	pollFd.events = POLLRDNORM;
+	pollFd.revents = 0;
+
+	if (WSAPoll(&pollFd, 1, TEST_TIMEOUT_MS) <= 0)
+	{
+		return 0;
+	}
+
+	int length = recv(Client, (char*)reply, TEST_PACKET_LENGTH, 0);
+	if (length < *queryLength || ReadBE16(reply) != id || memcmp(reply + TEST_HEADER_LENGTH, query + TEST_HEADER_LENGTH, *queryLength - TEST_HEADER_LENGTH) != 0)
+	{
+		return 0;
+	}
+
+	return length;
+}
+
+// Asks for label and checks the reply has rcode and answers, returning the TTL of its first record or 0 without one
+static DWORD AskFor(LPCSTR label, USHORT id, BYTE rcode, USHORT answers)
+{
+	BYTE reply[TEST_PACKET_LENGTH];
+	int queryLength = 0;
+
+	int length = Ask(label, id, reply, &queryLength);
+	CHECK(length > 0);
+	if (length == 0)
+	{
+		return 0;
+	}
+
+	CHECK_RESULT(rcode, reply[3] & 0x0F);
+	CHECK_RESULT(answers, ReadBE16(reply + 6));
+
+	return length >= queryLength + 10 ? ReadBE32(reply + queryLength + 6) : 0;
+}
+
+static void AnswersAreServedFromTheCache()
+{
+	DnsForwarderStats before;
+	DnsForwarderStats after;
+
+	if (!StartForwarder(NULL))
+	{
+		return;
+	}
+
+	CHECK_RESULT(TEST_ANSWER_TTL, AskFor("address", 1, 0, 1));
+	CHECK_RESULT(1, UpstreamQueries[StubAddress]);
+
+	// Another ID and the name in another case is still the same question, the reply carries the client's own
+	CHECK_RESULT(ERROR_SUCCESS, DnsForwarderGetStats(&before));
+	CHECK(AskFor("ADDress", 2, 0, 1) > 0);
+	CHECK(AskFor("address", 3, 0, 1) > 0);
+	CHECK_RESULT(ERROR_SUCCESS, DnsForwarderGetStats(&after));
+
+	CHECK_RESULT(1, UpstreamQueries[StubAddress]);
+	CHECK_RESULT(2, after.CacheHits - before.CacheHits);
+	CHECK_RESULT(0, after.NegativeHits - before.NegativeHits);
+	CHECK_RESULT(1, after.CacheEntries);
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsForwarderFlush());
+	CHECK(AskFor("address", 4, 0, 1) > 0);
+	CHECK_RESULT(2, UpstreamQueries[StubAddress]);
+
+	StopForwarder();
+}
+
+static void NegativeAnswersAreCached()
+{
+	DnsForwarderStats before;
+	DnsForwarderStats after;
+
+	if (!StartForwarder(NULL))
+	{
+		return;
+	}
+
+	CHECK_RESULT(TEST_SOA_TTL, AskFor("missing", 1, TEST_RCODE_NAME_ERROR, 0));
+	CHECK_RESULT(TEST_SOA_TTL, AskFor("nodata", 2, 0, 0));
+
+	CHECK_RESULT(ERROR_SUCCESS, DnsForwarderGetStats(&before));
+	CHECK(AskFor("missing", 3, TEST_RCODE_NAME_ERROR, 0) > 0);
+	CHECK(AskFor("nodata", 4, 0, 0) > 0);
+	CHECK_RESULT(ERROR_SUCCESS, DnsForwarderGetStats(&after));
+
+	CHECK_RESULT(1, UpstreamQueries[StubMissing]);
+	CHECK_RESULT(1, UpstreamQueries[StubNoData]);
+	CHECK_RESULT(2, after.CacheHits - before.CacheHits);
+	CHECK_RESULT(2, after.NegativeHits - before.NegativeHits);
+
+	StopForwarder();
+}
+
+static void UncacheableAnswersAreForwardedEveryTime()
+{
+	DnsForwarderStats stats;
+
+	if (!StartForwarder(NULL))
+	{
+		return;
+	}
+
+	// Nothing to say how long the NXDOMAIN holds, and a truncated answer has the client retry over TCP
+	for (USHORT id = 1; id <= 2; id++)
+	{
+		AskFor("nosoa", id, TEST_RCODE_NAME_ERROR, 0);
+		AskFor("truncated", id, 0, 1);
+	}
+
+	CHECK_RESULT(2, UpstreamQueries[StubNoSoa]);
+	CHECK_RESULT(2, UpstreamQueries[StubTruncated]);
+	CHECK_RESULT(ERROR_SUCCESS, DnsForwarderGetStats(&stats));
+	CHECK_RESULT(0, stats.CacheHits);
+	CHECK_RESULT(0, stats.CacheEntries);
+
+	StopForwarder();
+}
+
+static void CachedAnswersCountDownAndExpire()
+{
+	if (!StartForwarder(NULL))
+	{
+		return;
+	}
+
+	AskFor("address", 1, 0, 1);
+	AskFor("brief", 2, 0, 1);
+	AskFor("missing", 3, TEST_RCODE_NAME_ERROR, 0);
+	AskFor("nodata", 4, 0, 0);
+
+	Sleep(TEST_EXPIRY_MS);
+
+	// The TTLs handed out from the cache are what's left of them
+	CHECK_RESULT(TEST_ANSWER_TTL - 1, AskFor("address", 5, 0, 1));
+	CHECK_RESULT(TEST_SOA_TTL - 1, AskFor("nodata", 6, 0, 0));
+	CHECK_RESULT(1, UpstreamQueries[StubAddress]);
+	CHECK_RESULT(1, UpstreamQueries[StubNoData]);
+
+	// A second was all the brief answer and the SOA minimum gave
+	CHECK_RESULT(1, AskFor("brief", 7, 0, 1));
+	CHECK_RESULT(TEST_SOA_TTL, AskFor("missing", 8, TEST_RCODE_NAME_ERROR, 0));
+	CHECK_RESULT(2, UpstreamQueries[StubBrief]);
+	CHECK_RESULT(2, UpstreamQueries[StubMissing]);
+
+	StopForwarder();
+}
+
+// Starts a forwarder with the caps given, caches an answer and a no data answer, then checks only the capped one
+// is asked for again once its second is up
+static void CheckTtlCap(DWORD maxTtlSeconds, DWORD maxNegativeTtlSeconds)
+{
+	DnsForwarderOptions options;
+
+	ZeroMemory(&options, sizeof(options));
+	options.MaxTtlSeconds = maxTtlSeconds;
+	options.MaxNegativeTtlSeconds = maxNegativeTtlSeconds;
+
+	if (!StartForwarder(&options))
+	{
+		return;
+	}
+
+	// The records keep the TTLs the upstream gave, the cap is only how long they're kept
+	CHECK_RESULT(TEST_ANSWER_TTL, AskFor("address", 1, 0, 1));
+	CHECK_RESULT(TEST_SOA_TTL, AskFor("nodata", 2, 0, 0));
+	AskFor("address", 3, 0, 1);
+	AskFor("nodata", 4, 0, 0);
+	CHECK_RESULT(1, UpstreamQueries[StubAddress]);
+	CHECK_RESULT(1, UpstreamQueries[StubNoData]);
+
+	Sleep(TEST_EXPIRY_MS);
+
+	AskFor("address", 5, 0, 1);
+	AskFor("nodata", 6, 0, 0);
+	CHECK_RESULT(maxTtlSeconds == 1 ? 2 : 1, UpstreamQueries[StubAddress]);
+	CHECK_RESULT(maxNegativeTtlSeconds == 1 ? 2 : 1, UpstreamQueries[StubNoData]);
+
+	StopForwarder();
+}
+
+static void TtlCapShortensAnswers()
+{
+	CheckTtlCap(1, 0);
+}
+
+static void NegativeTtlCapShortensNegativeAnswers()
+{
+	CheckTtlCap(0, 1);
+}
+
+const TestCase DnsForwarderTests[] =
+{
+	{ "AnswersAreServedFromTheCache", AnswersAreServedFromTheCache },
+	{ "NegativeAnswersAreCached", NegativeAnswersAreCached },
+	{ "UncacheableAnswersAreForwardedEveryTime", UncacheableAnswersAreForwardedEveryTime },
+	{ "CachedAnswersCountDownAndExpire", CachedAnswersCountDownAndExpire },
+	{ "TtlCapShortensAnswers", TtlCapShortensAnswers },
+	{ "NegativeTtlCapShortensNegativeAnswers", NegativeTtlCapShortensNegativeAnswers },
+};
+
+const UINT DnsForwarderTestsCount = CELEMS(DnsForwarderTests);
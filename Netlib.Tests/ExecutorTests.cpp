@@ -0,0 +1,264 @@
+#include <windows.h>
+#include "Executor.h"
+#include "Tests.h"
+
+TEST_SUITE(ExecutorTests);
+
+#define TEST_TASKS 10000
+// More than one worker's deque holds, the rest go to the shared queue
+#define TEST_FAN_OUT (EXECUTOR_DEQUE_CAPACITY * 4)
+#define TEST_PERIOD_MS 5
+#define TEST_PERIODIC_FIRINGS 10
+#define TEST_CANCELLED_DELAY_MS 50
+#define TEST_RUNNING_MS 100
+#define TEST_SETTLE_MS 150
+
+// Scheduled in this order, they cover all three levels of the wheel a timer goes through in a few seconds and
+// are far enough apart that no two race each other to the workers
+static const DWORD TimerDelaysMs[] = { 300, 1, 4200, 60, 25, 1000, 90, 150 };
+
+typedef struct _OrderedTimer
+{
+	DWORD DelayMs;
+	LONGLONG ScheduledAt;
+	LONGLONG FiredAt;
+	LONG Order;
+} OrderedTimer;
+
+typedef struct _Periodic
+{
+	HEXECTOKEN Token;
+	volatile LONG Firings;
+} Periodic;
+
+typedef struct _Running
+{
+	volatile LONG Started;
+	volatile LONG Finished;
+} Running;
+
+// Callbacks can still be running when a failed test returns, so what they write lives here rather than on its
+// stack
+static volatile LONG TasksRun;
+static volatile LONG TimersFired;
+static OrderedTimer Timers[CELEMS(TimerDelaysMs)];
+static Periodic Repeating;
+static volatile LONG CancelledRun;
+static Running Cancelling;
+
+static LONGLONG NowMs()
+{
+	LARGE_INTEGER now;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+
+	return now.QuadPart * 1000 / frequency.QuadPart;
+}
+
+static void CALLBACK CountTask(PVOID context)
+{
+	InterlockedIncrement(&TasksRun);
+}
+
+static void CALLBACK FanOutTask(PVOID context)
+{
+	for (UINT i = 0; i < TEST_FAN_OUT; i++)
+	{
+		if (ExecutorSubmit(CountTask, NULL, NULL) != ERROR_SUCCESS)
+		{
+			break;
+		}
+	}
+}
+
+static void CALLBACK OrderedTimerFired(PVOID context)
+{
+	OrderedTimer* timer = (OrderedTimer*)context;
+
+	timer->FiredAt = NowMs();
+	timer->Order = InterlockedIncrement(&TimersFired) - 1;
+}
+
+static void CALLBACK PeriodicFired(PVOID context)
+{
+	Periodic* periodic = (Periodic*)context;
+
+	// Cancelling its own token from inside the callback stops the timer coming round again
+	if (InterlockedIncrement(&periodic->Firings) == TEST_PERIODIC_FIRINGS)
+	{
+		ExecutorCancel(periodic->Token, TRUE);
+	}
+}
+
+static void CALLBACK CancelledTask(PVOID context)
+{
+	InterlockedIncrement(&CancelledRun);
+}
+
+static void CALLBACK SlowTask(PVOID context)
+{
+	Running* running = (Running*)context;
+
+	InterlockedExchange(&running->Started, TRUE);
+	Sleep(TEST_RUNNING_MS);
+	InterlockedExchange(&running->Finished, TRUE);
+}
+
+static void SubmittedTasksAllRun()
+{
+	UINT submitted = 0;
+
+	InterlockedExchange(&TasksRun, 0);
+
+	for (UINT i = 0; i < TEST_TASKS; i++)
+	{
+		if (ExecutorSubmit(CountTask, NULL, NULL) == ERROR_SUCCESS)
+		{
+			submitted++;
+		}
+	}
+
+	CHECK_RESULT(TEST_TASKS, submitted);
+	CHECK(TestWaitFor(&TasksRun, TEST_TASKS, TEST_TIMEOUT_MS));
+}
+
+static void TasksQueuedFromAWorkerAllRun()
+{
+	ExecutorStats before;
+	ExecutorStats after;
+
+	InterlockedExchange(&TasksRun, 0);
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorGetStats(&before));
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorSubmit(FanOutTask, NULL, NULL));
+	CHECK(TestWaitFor(&TasksRun, TEST_FAN_OUT, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorGetStats(&after));
+	CHECK(after.Workers > 0);
+	CHECK(after.TasksRun - before.TasksRun >= TEST_FAN_OUT + 1);
+}
+
+static void TimersFireInDeadlineOrder()
+{
+	InterlockedExchange(&TimersFired, 0);
+
+	for (UINT i = 0; i < CELEMS(TimerDelaysMs); i++)
+	{
+		Timers[i].DelayMs = TimerDelaysMs[i];
+		Timers[i].ScheduledAt = NowMs();
+		Timers[i].Order = -1;
+		CHECK_RESULT(ERROR_SUCCESS, ExecutorSchedule(TimerDelaysMs[i], 0, OrderedTimerFired, &Timers[i], NULL));
+	}
+
+	CHECK(TestWaitFor(&TimersFired, CELEMS(TimerDelaysMs), TEST_TIMEOUT_MS));
+
+	for (UINT i = 0; i < CELEMS(Timers); i++)
+	{
+		// Never early, timers fire on the first tick at or after their delay
+		CHECK(Timers[i].Order >= 0);
+		CHECK(Timers[i].FiredAt - Timers[i].ScheduledAt >= Timers[i].DelayMs);
+
+		for (UINT j = 0; j < CELEMS(Timers); j++)
+		{
+			if (Timers[i].DelayMs < Timers[j].DelayMs)
+			{
+				CHECK(Timers[i].Order < Timers[j].Order);
+			}
+		}
+	}
+}
+
+static void PeriodicTimerStopsWhenCancelled()
+{
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorCreateToken(&Repeating.Token));
+	if (Repeating.Token == NULL)
+	{
+		return;
+	}
+
+	InterlockedExchange(&Repeating.Firings, 0);
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorSchedule(TEST_PERIOD_MS, TEST_PERIOD_MS, PeriodicFired, &Repeating, Repeating.Token));
+	CHECK(TestWaitFor(&Repeating.Firings, TEST_PERIODIC_FIRINGS, TEST_TIMEOUT_MS));
+
+	Sleep(TEST_SETTLE_MS);
+	CHECK_RESULT(TEST_PERIODIC_FIRINGS, Repeating.Firings);
+	CHECK(ExecutorIsCancelled(Repeating.Token));
+
+	ExecutorCloseToken(Repeating.Token);
+	Repeating.Token = NULL;
+}
+
+static void CancelledWorkNeverRuns()
+{
+	HEXECTOKEN token = NULL;
+
+	InterlockedExchange(&CancelledRun, 0);
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorCreateToken(&token));
+	if (token == NULL)
+	{
+		return;
+	}
+
+	// Armed before the cancel, dropped when it comes due
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorSchedule(TEST_CANCELLED_DELAY_MS, 0, CancelledTask, NULL, token));
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorCancel(token, FALSE));
+
+	CHECK_RESULT(ERROR_CANCELLED, ExecutorSubmit(CancelledTask, NULL, token));
+	CHECK_RESULT(ERROR_CANCELLED, ExecutorSchedule(TEST_CANCELLED_DELAY_MS, 0, CancelledTask, NULL, token));
+
+	Sleep(TEST_CANCELLED_DELAY_MS + TEST_SETTLE_MS);
+	CHECK_RESULT(0, CancelledRun);
+
+	ExecutorCloseToken(token);
+}
+
+static void CancelWaitsForRunningCallback()
+{
+	HEXECTOKEN token = NULL;
+
+	InterlockedExchange(&Cancelling.Started, FALSE);
+	InterlockedExchange(&Cancelling.Finished, FALSE);
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorCreateToken(&token));
+	if (token == NULL)
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorSubmit(SlowTask, &Cancelling, token));
+	CHECK(TestWaitFor(&Cancelling.Started, TRUE, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ExecutorCancel(token, TRUE));
+	CHECK_RESULT(TRUE, Cancelling.Finished);
+
+	ExecutorCloseToken(token);
+}
+
+static void BadArgumentsAreRejected()
+{
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorSubmit(NULL, NULL, NULL));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorSchedule(TEST_PERIOD_MS, 0, NULL, NULL, NULL));
+	// A periodic timer could never be stopped without a token
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorSchedule(TEST_PERIOD_MS, TEST_PERIOD_MS, CountTask, NULL, NULL));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorCreateToken(NULL));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorCancel(NULL, FALSE));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorCloseToken(NULL));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ExecutorGetStats(NULL));
+}
+
+const TestCase ExecutorTests[] =
+{
+	{ "SubmittedTasksAllRun", SubmittedTasksAllRun },
+	{ "TasksQueuedFromAWorkerAllRun", TasksQueuedFromAWorkerAllRun },
+	{ "TimersFireInDeadlineOrder", TimersFireInDeadlineOrder },
+	{ "PeriodicTimerStopsWhenCancelled", PeriodicTimerStopsWhenCancelled },
+	{ "CancelledWorkNeverRuns", CancelledWorkNeverRuns },
+	{ "CancelWaitsForRunningCallback", CancelWaitsForRunningCallback },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT ExecutorTestsCount = CELEMS(ExecutorTests);
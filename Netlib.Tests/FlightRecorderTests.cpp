@@ -0,0 +1,387 @@
+#include <windows.h>
+#include <string.h>
+#include <strsafe.h>
+#include "FlightRecorder.h"
+#include "Tests.h"
+
+TEST_SUITE(FlightRecorderTests);
+
+#define TEST_RINGS 8
+#define TEST_EVENTS 256
+#define TEST_WRITERS 4
+#define TEST_DUMPS 200
+#define TEST_MIN_EVENTS (TEST_EVENTS * 8)
+#define TEST_STALE_RUN "left by the last run"
+#define TEST_CRASH_CODE 0xE0464C54
+
+#define TEST_FILE_LENGTH FLIGHT_FILE_LENGTH(TEST_RINGS, TEST_EVENTS)
+
+typedef struct _Writer
+{
+	HANDLE Thread;
+	DWORD ThreadId;
+	volatile LONG Recorded;
+} Writer;
+
+// The recorder is started once per process and never stops, every test shares the one recording
+static BOOL Started;
+static WCHAR RecordingPath[MAX_PATH];
+static Writer Writers[TEST_WRITERS];
+static volatile LONG StopWriters;
+static BYTE CrashAddress;
+
+// Everything about a writer's event follows from its position, so a torn one shows
+static UINT64 WriterArgument(UINT32 index)
+{
+	return ((UINT64)(index ^ 0xA5A5A5A5) << 32) | (UINT64)(index * 2654435761u);
+}
+
+static DWORD WINAPI WriterFunc(LPVOID parameter)
+{
+	Writer* writer = (Writer*)parameter;
+
+	writer->ThreadId = GetCurrentThreadId();
+
+	// A new thread claims a ring of its own on its first event, so its positions count from 0
+	for (UINT32 index = 0; StopWriters == 0; index++)
+	{
+		FlightRecorderMark(index, WriterArgument(index));
+		InterlockedExchange(&writer->Recorded, (LONG)(index + 1));
+	}
+
+	return 0;
+}
+
+static void TestPath(LPCWSTR suffix, LPWSTR path, DWORD pathLength)
+{
+	WCHAR temp[MAX_PATH];
+
+	GetTempPathW(CELEMS(temp), temp);
+	StringCchPrintfW(path, pathLength, L"%sUtilizrFlightTests.flight%s", temp, suffix);
+}
+
+static BOOL ReadWholeFile(LPCWSTR path, BYTE* buffer, DWORD length, DWORD* read)
+{
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return FALSE;
+	}
+
+	BOOL ok = ReadFile(file, buffer, length, read, NULL);
+	CloseHandle(file);
+
+	return ok;
+}
+
+static BOOL WriteWholeFile(LPCWSTR path, const void* data, DWORD length)
+{
+	DWORD written = 0;
+
+	HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return FALSE;
+	}
+
+	BOOL ok = WriteFile(file, data, length, &written, NULL) && written == length;
+	CloseHandle(file);
+
+	return ok;
+}
+
+// The recording's file stays mapped until the process exits, the next run moves it to <path>.previous. A stale
+// file is put in its place first, as a run before this one would have left.
+static BOOL StartRecording()
+{
+	WCHAR previousPath[MAX_PATH];
+
+	if (Started)
+	{
+		return TRUE;
+	}
+
+	TestPath(L".previous", previousPath, CELEMS(previousPath));
+	DeleteFileW(previousPath);
+
+	TestPath(L"", RecordingPath, CELEMS(RecordingPath));
+	CHECK(WriteWholeFile(RecordingPath, TEST_STALE_RUN, sizeof(TEST_STALE_RUN)));
+
+	DWORD result = FlightRecorderStart(RecordingPath, TEST_RINGS, TEST_EVENTS);
+	CHECK_RESULT(ERROR_SUCCESS, result);
+
+	Started = result == ERROR_SUCCESS;
+
+	return Started;
+}
+
+static FlightRing* RingAt(FlightHeader* header, UINT index)
+{
+	return (FlightRing*)((BYTE*)header + sizeof(FlightHeader) + index * FLIGHT_RING_LENGTH(header->EventsPerRing));
+}
+
+static const Writer* RingWriter(const FlightRing* ring)
+{
+	for (UINT i = 0; i < TEST_WRITERS; i++)
+	{
+		if (ring->ThreadId != 0 && ring->ThreadId == Writers[i].ThreadId)
+		{
+			return &Writers[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Checks a dump taken while the writers ran and counts the writers' events in it
+static UINT CheckDump(FlightHeader* header, DWORD length)
+{
+	UINT writerEvents = 0;
+	UINT writerRings = 0;
+
+	CHECK_RESULT(TEST_FILE_LENGTH, length);
+	CHECK_RESULT(FLIGHT_MAGIC, header->Magic);
+	CHECK_RESULT(FLIGHT_VERSION, header->Version);
+	CHECK_RESULT(TEST_RINGS, header->RingCount);
+	CHECK_RESULT(TEST_EVENTS, header->EventsPerRing);
+	CHECK_RESULT(GetCurrentProcessId(), header->ProcessId);
+	CHECK(header->RingsClaimed >= TEST_WRITERS && header->RingsClaimed <= TEST_RINGS);
+
+	if (length != TEST_FILE_LENGTH || header->RingCount != TEST_RINGS || header->EventsPerRing != TEST_EVENTS)
+	{
+		return 0;
+	}
+
+	for (UINT i = 0; i < TEST_RINGS; i++)
+	{
+		FlightRing* ring = RingAt(header, i);
+		FlightEvent* events = (FlightEvent*)(ring + 1);
+		const Writer* writer = RingWriter(ring);
+
+		if (writer != NULL)
+		{
+			writerRings++;
+		}
+
+		for (UINT slot = 0; slot < TEST_EVENTS; slot++)
+		{
+			FlightEvent* event = &events[slot];
+
+			// Left out, or never written
+			if (event->Sequence == 0)
+			{
+				CHECK(event->Ticks == 0 && event->Argument == 0 && event->ThreadId == 0 && event->Value == 0);
+				continue;
+			}
+
+			// Each event sits at its position in the ring
+			CHECK_RESULT(slot, (event->Sequence - 1) % TEST_EVENTS);
+			CHECK(event->Ticks >= header->StartTicks);
+			CHECK(event->Type < FlightEventTypeCount);
+
+			if (writer == NULL)
+			{
+				continue;
+			}
+
+			// Every field from the same write
+			CHECK_RESULT(FlightMark, event->Type);
+			CHECK_RESULT(writer->ThreadId, event->ThreadId);
+			CHECK_RESULT(event->Sequence - 1, event->Value);
+			CHECK(event->Argument == WriterArgument(event->Value));
+			writerEvents++;
+		}
+	}
+
+	CHECK_RESULT(TEST_WRITERS, writerRings);
+
+	return writerEvents;
+}
+
+static void PreviousRecordingIsKept()
+{
+	WCHAR previousPath[MAX_PATH];
+	CHAR stale[sizeof(TEST_STALE_RUN) + 16];
+	FlightHeader header;
+	DWORD read = 0;
+
+	if (!StartRecording())
+	{
+		return;
+	}
+
+	TestPath(L".previous", previousPath, CELEMS(previousPath));
+
+	CHECK(ReadWholeFile(previousPath, (BYTE*)stale, sizeof(stale), &read));
+	CHECK_RESULT(sizeof(TEST_STALE_RUN), read);
+	CHECK(read == sizeof(TEST_STALE_RUN) && memcmp(stale, TEST_STALE_RUN, read) == 0);
+
+	// The file in its place is the new recording
+	CHECK(ReadWholeFile(RecordingPath, (BYTE*)&header, sizeof(header), &read));
+	CHECK_RESULT(sizeof(header), read);
+	CHECK_RESULT(FLIGHT_MAGIC, header.Magic);
+	CHECK_RESULT(TEST_RINGS, header.RingCount);
+
+	CHECK_RESULT(ERROR_ALREADY_EXISTS, FlightRecorderStart(RecordingPath, TEST_RINGS, TEST_EVENTS));
+}
+
+static void DumpsWhileRecordingAreWhole()
+{
+	WCHAR dumpPath[MAX_PATH];
+	UINT started = 0;
+
+	if (!StartRecording())
+	{
+		return;
+	}
+
+	TestPath(L".dump", dumpPath, CELEMS(dumpPath));
+
+	BYTE* dump = (BYTE*)HeapAlloc(GetProcessHeap(), 0, TEST_FILE_LENGTH);
+	CHECK(dump != NULL);
+	if (dump == NULL)
+	{
+		return;
+	}
+
+	ZeroMemory(Writers, sizeof(Writers));
+	StopWriters = 0;
+
+	for (; started < TEST_WRITERS; started++)
+	{
+		Writers[started].Thread = CreateThread(NULL, 0, WriterFunc, &Writers[started], 0, NULL);
+		if (Writers[started].Thread == NULL)
+		{
+			break;
+		}
+	}
+
+	CHECK_RESULT(TEST_WRITERS, started);
+
+	// Each ring laps a few times before the first dump
+	for (UINT i = 0; i < started; i++)
+	{
+		ULONGLONG deadline = GetTickCount64() + TEST_TIMEOUT_MS;
+		while (Writers[i].Recorded < TEST_MIN_EVENTS && GetTickCount64() < deadline)
+		{
+			Sleep(1);
+		}
+
+		CHECK(Writers[i].Recorded >= TEST_MIN_EVENTS);
+	}
+
+	for (UINT i = 0; i < TEST_DUMPS && started == TEST_WRITERS; i++)
+	{
+		DWORD read = 0;
+
+		CHECK_RESULT(ERROR_SUCCESS, FlightRecorderDump(dumpPath));
+		CHECK(ReadWholeFile(dumpPath, dump, TEST_FILE_LENGTH, &read));
+
+		// Most of what the rings hold makes it in, the events being written are all that's left out
+		UINT writerEvents = CheckDump((FlightHeader*)dump, read);
+		CHECK(writerEvents > TEST_WRITERS * TEST_EVENTS / 2);
+	}
+
+	InterlockedExchange(&StopWriters, 1);
+
+	for (UINT i = 0; i < started; i++)
+	{
+		CHECK_RESULT(WAIT_OBJECT_0, WaitForSingleObject(Writers[i].Thread, TEST_TIMEOUT_MS));
+		CloseHandle(Writers[i].Thread);
+	}
+
+	// Once they're still every slot of their rings is in the dump
+	if (started == TEST_WRITERS)
+	{
+		DWORD read = 0;
+
+		CHECK_RESULT(ERROR_SUCCESS, FlightRecorderDump(dumpPath));
+		CHECK(ReadWholeFile(dumpPath, dump, TEST_FILE_LENGTH, &read));
+		CHECK_RESULT(TEST_WRITERS * TEST_EVENTS, CheckDump((FlightHeader*)dump, read));
+	}
+
+	HeapFree(GetProcessHeap(), 0, dump);
+	DeleteFileW(dumpPath);
+}
+
+static void CrashFilterStampsTheRecording()
+{
+	EXCEPTION_RECORD record;
+	EXCEPTION_POINTERS pointers;
+	DWORD read = 0;
+	BOOL found = FALSE;
+
+	if (!StartRecording())
+	{
+		return;
+	}
+
+	BYTE* recording = (BYTE*)HeapAlloc(GetProcessHeap(), 0, TEST_FILE_LENGTH);
+	CHECK(recording != NULL);
+	if (recording == NULL)
+	{
+		return;
+	}
+
+	// The recorder's filter is the one installed, it's put back straight away
+	LPTOP_LEVEL_EXCEPTION_FILTER filter = SetUnhandledExceptionFilter(NULL);
+	SetUnhandledExceptionFilter(filter);
+	CHECK(filter != NULL);
+
+	ZeroMemory(&record, sizeof(record));
+	record.ExceptionCode = TEST_CRASH_CODE;
+	record.ExceptionAddress = &CrashAddress;
+	pointers.ExceptionRecord = &record;
+	pointers.ContextRecord = NULL;
+
+	if (filter != NULL)
+	{
+		CHECK_RESULT(EXCEPTION_CONTINUE_SEARCH, filter(&pointers));
+	}
+
+	// Read back from the file, which is all a crashed process leaves
+	CHECK(ReadWholeFile(RecordingPath, recording, TEST_FILE_LENGTH, &read));
+	CHECK_RESULT(TEST_FILE_LENGTH, read);
+
+	FlightHeader* header = (FlightHeader*)recording;
+	CHECK_RESULT(TEST_CRASH_CODE, header->CrashCode);
+
+	for (UINT i = 0; i < TEST_RINGS && read == TEST_FILE_LENGTH; i++)
+	{
+		FlightRing* ring = RingAt(header, i);
+		FlightEvent* events = (FlightEvent*)(ring + 1);
+
+		for (UINT slot = 0; slot < TEST_EVENTS; slot++)
+		{
+			if (events[slot].Sequence != 0 && events[slot].Type == FlightCrash)
+			{
+				CHECK_RESULT(TEST_CRASH_CODE, events[slot].Value);
+				CHECK(events[slot].Argument == (UINT64)(ULONG_PTR)&CrashAddress);
+				CHECK_RESULT(GetCurrentThreadId(), events[slot].ThreadId);
+				found = TRUE;
+			}
+		}
+	}
+
+	CHECK(found);
+
+	HeapFree(GetProcessHeap(), 0, recording);
+}
+
+static void BadArgumentsAreRejected()
+{
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, FlightRecorderStart(NULL, FLIGHT_MAX_RINGS + 1, TEST_EVENTS));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, FlightRecorderStart(NULL, TEST_RINGS, FLIGHT_MAX_EVENTS * 2));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, FlightRecorderStart(NULL, TEST_RINGS, TEST_EVENTS + 1));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, FlightRecorderDump(NULL));
+}
+
+const TestCase FlightRecorderTests[] =
+{
+	{ "PreviousRecordingIsKept", PreviousRecordingIsKept },
+	{ "DumpsWhileRecordingAreWhole", DumpsWhileRecordingAreWhole },
+	{ "CrashFilterStampsTheRecording", CrashFilterStampsTheRecording },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT FlightRecorderTestsCount = CELEMS(FlightRecorderTests);
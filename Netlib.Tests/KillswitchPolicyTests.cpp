@@ -0,0 +1,318 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <iphlpapi.h>
+#include <stddef.h>
+#include <strsafe.h>
+#include "KillswitchPolicy.h"
+#include "Helpers.h"
+#include "Tests.h"
+
+TEST_SUITE(KillswitchPolicyTests);
+
+// Below KILLSWITCH_TAP_INDEX_LIMIT, so it's looked up, and far above any index an adapter gets
+#define TEST_MISSING_TAP_INDEX (KILLSWITCH_TAP_INDEX_LIMIT - 1)
+#define TEST_DISPLAY_NAME L"Utilizr killswitch tests"
+
+static WFPKS_ADDR_AND_MASK TestRemote[] = {
+	{ "185.1.2.3", "255.255.255.255" },
+	{ "10.8.0.0", "255.255.0.0" },
+	{ "1.1.1.1", "255.255.255.255" },
+};
+
+static WFPKS_ADDR_AND_MASK TestLocal[] = {
+	{ "192.168.0.0", "255.255.0.0" },
+	{ "172.16.0.0", "255.240.0.0" },
+};
+
+static const UINT32 TestRemoteParsed[][2] = {
+	{ 0xB9010203, 0xFFFFFFFF },
+	{ 0x0A080000, 0xFFFF0000 },
+	{ 0x01010101, 0xFFFFFFFF },
+};
+
+static const WFPKS_PORT_RULE TestRules[] = {
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 67, 68 },
+	{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 443, 0 },
+	{ 0, WFPKS_PORT_LOCAL, 5000, 5100 },
+	{ IPPROTO_TCP, WFPKS_PORT_LOCAL, 22, 0 },
+};
+
+static void PolicyPath(LPCWSTR test, LPWSTR path, DWORD pathLength)
+{
+	WCHAR temp[MAX_PATH];
+
+	GetTempPathW(CELEMS(temp), temp);
+	StringCchPrintfW(path, pathLength, L"%sUtilizrPolicyTests-%lu-%s.policy", temp, GetCurrentProcessId(), test);
+}
+
+// The test binary stands in for OpenVPN's, it's a file that exists wherever the tests run
+static DWORD Compile(ULONG tapAdapterIndex, KillswitchPolicy** policy)
+{
+	WCHAR binary[MAX_PATH];
+
+	GetModuleFileNameW(NULL, binary, CELEMS(binary));
+
+	return KillswitchPolicyCompile(TestRemote, CELEMS(TestRemote), TestLocal, CELEMS(TestLocal), TestRules, CELEMS(TestRules),
+		tapAdapterIndex, binary, TRUE, TEST_DISPLAY_NAME, policy);
+}
+
+// Checksums a policy that's been tampered with, so only the section checks are left to catch it
+static void Rechecksum(KillswitchPolicy* policy)
+{
+	policy->Checksum = Crc32((const BYTE*)policy + offsetof(KillswitchPolicy, Flags), policy->Length - offsetof(KillswitchPolicy, Flags));
+}
+
+// An interface every machine has, with the LUID patching should come up with
+static BOOL LoopbackInterface(ULONG* index, NET_LUID* luid)
+{
+	return GetBestInterface(htonl(INADDR_LOOPBACK), (PDWORD)index) == NO_ERROR && ConvertInterfaceIndexToLuid(*index, luid) == NO_ERROR;
+}
+
+static void RoundTripKeepsEverySection()
+{
+	WCHAR path[MAX_PATH];
+	WCHAR binary[MAX_PATH];
+	KillswitchPolicy* compiled = NULL;
+	KillswitchPolicy* mapped = NULL;
+	PortPolicy ports;
+
+	PolicyPath(L"RoundTrip", path, CELEMS(path));
+	GetModuleFileNameW(NULL, binary, CELEMS(binary));
+
+	CHECK_RESULT(ERROR_SUCCESS, Compile(KILLSWITCH_TAP_INDEX_LIMIT, &compiled));
+	if (compiled == NULL)
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyValidate(compiled, compiled->Length));
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicySave(compiled, path));
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyMap(path, &mapped));
+	if (mapped == NULL)
+	{
+		goto Cleanup;
+	}
+
+	CHECK_RESULT(compiled->Length, mapped->Length);
+	CHECK(memcmp(mapped, compiled, compiled->Length) == 0);
+
+	CHECK_RESULT(KILLSWITCH_POLICY_PERSIST, mapped->Flags);
+	CHECK(mapped->TapLuid == 0);
+	CHECK_RESULT(0, mapped->TapIndex);
+
+	CHECK_RESULT(CELEMS(TestRemote), mapped->RemoteAddresses.Count);
+	for (UINT i = 0; i < mapped->RemoteAddresses.Count && i < CELEMS(TestRemoteParsed); i++)
+	{
+		const KillswitchAddrMask* address = &KILLSWITCH_POLICY_SECTION(mapped, RemoteAddresses, const KillswitchAddrMask)[i];
+		CHECK_RESULT(TestRemoteParsed[i][0], address->Address);
+		CHECK_RESULT(TestRemoteParsed[i][1], address->Mask);
+	}
+	CHECK_RESULT(CELEMS(TestLocal), mapped->LocalAddresses.Count);
+
+	// The port sections are what compiling the rules on their own gives
+	CHECK_RESULT(ERROR_SUCCESS, PortPolicyCompile(TestRules, CELEMS(TestRules), &ports));
+	CHECK_RESULT(ports.GroupCount, mapped->PortGroups.Count);
+	CHECK_RESULT(ports.RangeCount, mapped->PortRanges.Count);
+	if (ports.GroupCount == mapped->PortGroups.Count && ports.RangeCount == mapped->PortRanges.Count)
+	{
+		CHECK(memcmp(KILLSWITCH_POLICY_SECTION(mapped, PortGroups, PortPolicyGroup), ports.Groups, ports.GroupCount * sizeof(PortPolicyGroup)) == 0);
+		CHECK(memcmp(KILLSWITCH_POLICY_SECTION(mapped, PortRanges, PortRange), ports.Ranges, ports.RangeCount * sizeof(PortRange)) == 0);
+	}
+	PortPolicyFree(&ports);
+
+	CHECK(mapped->AppPath.Count > 0 && wcscmp(KILLSWITCH_POLICY_SECTION(mapped, AppPath, const WCHAR), binary) == 0);
+	CHECK(mapped->DisplayName.Count > 0 && wcscmp(KILLSWITCH_POLICY_SECTION(mapped, DisplayName, const WCHAR), TEST_DISPLAY_NAME) == 0);
+
+	// Every section starts on the boundary the engine is pointed into
+	CHECK(mapped->RemoteAddresses.Offset % KILLSWITCH_POLICY_ALIGN == 0);
+	CHECK(mapped->PortRanges.Offset % KILLSWITCH_POLICY_ALIGN == 0);
+	CHECK(mapped->AppPath.Offset % KILLSWITCH_POLICY_ALIGN == 0);
+
+Cleanup:
+	KillswitchPolicyUnmap(mapped);
+	KillswitchPolicyFree(compiled);
+	DeleteFileW(path);
+}
+
+static void PatchingTheTapLeavesTheFileAlone()
+{
+	WCHAR path[MAX_PATH];
+	KillswitchPolicy* compiled = NULL;
+	KillswitchPolicy* mapped = NULL;
+	ULONG loopback = 0;
+	NET_LUID loopbackLuid = {};
+
+	PolicyPath(L"PatchTap", path, CELEMS(path));
+
+	CHECK(LoopbackInterface(&loopback, &loopbackLuid));
+	CHECK_RESULT(ERROR_SUCCESS, Compile(KILLSWITCH_TAP_INDEX_LIMIT, &compiled));
+	if (compiled == NULL)
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicySave(compiled, path));
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyMap(path, &mapped));
+	if (mapped == NULL)
+	{
+		goto Cleanup;
+	}
+
+	// The tap fields are outside the checksum, a patched policy is still valid
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyPatchTap(mapped, loopback));
+	CHECK(mapped->TapLuid == loopbackLuid.Value);
+	CHECK_RESULT(loopback, mapped->TapIndex);
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyValidate(mapped, mapped->Length));
+	CHECK(memcmp((const BYTE*)mapped + offsetof(KillswitchPolicy, Flags), (const BYTE*)compiled + offsetof(KillswitchPolicy, Flags),
+		compiled->Length - offsetof(KillswitchPolicy, Flags)) == 0);
+
+	// 0 keeps the adapter, the managed layer's no adapter index drops it
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyPatchTap(mapped, 0));
+	CHECK(mapped->TapLuid == loopbackLuid.Value);
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyPatchTap(mapped, KILLSWITCH_TAP_INDEX_LIMIT));
+	CHECK(mapped->TapLuid == 0);
+	CHECK_RESULT(0, mapped->TapIndex);
+
+	// An adapter that's gone fails the patch and leaves what was there
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyPatchTap(mapped, loopback));
+	CHECK(KillswitchPolicyPatchTap(mapped, TEST_MISSING_TAP_INDEX) != ERROR_SUCCESS);
+	CHECK(mapped->TapLuid == loopbackLuid.Value);
+
+	// The view is copy on write, the saved policy never saw any of it
+	KillswitchPolicyUnmap(mapped);
+	mapped = NULL;
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyMap(path, &mapped));
+	if (mapped != NULL)
+	{
+		CHECK(mapped->TapLuid == 0);
+		CHECK_RESULT(0, mapped->TapIndex);
+	}
+
+Cleanup:
+	KillswitchPolicyUnmap(mapped);
+	KillswitchPolicyFree(compiled);
+	DeleteFileW(path);
+}
+
+static void CompileLooksUpTheTap()
+{
+	KillswitchPolicy* policy = NULL;
+	ULONG loopback = 0;
+	NET_LUID loopbackLuid = {};
+
+	CHECK(LoopbackInterface(&loopback, &loopbackLuid));
+
+	CHECK_RESULT(ERROR_SUCCESS, Compile(loopback, &policy));
+	if (policy != NULL)
+	{
+		CHECK(policy->TapLuid == loopbackLuid.Value);
+		CHECK_RESULT(loopback, policy->TapIndex);
+		KillswitchPolicyFree(policy);
+		policy = NULL;
+	}
+
+	CHECK(Compile(TEST_MISSING_TAP_INDEX, &policy) != ERROR_SUCCESS);
+	CHECK(policy == NULL);
+}
+
+static void DamagedPoliciesAreRejected()
+{
+	WCHAR path[MAX_PATH];
+	KillswitchPolicy* compiled = NULL;
+	KillswitchPolicy* mapped = NULL;
+	KillswitchPolicy* copy = NULL;
+
+	PolicyPath(L"Damaged", path, CELEMS(path));
+
+	CHECK_RESULT(ERROR_SUCCESS, Compile(KILLSWITCH_TAP_INDEX_LIMIT, &compiled));
+	if (compiled == NULL)
+	{
+		return;
+	}
+
+	copy = (KillswitchPolicy*)HeapAlloc(GetProcessHeap(), 0, compiled->Length);
+	if (copy == NULL)
+	{
+		goto Cleanup;
+	}
+
+	// Any byte the checksum covers
+	for (UINT32 offset = offsetof(KillswitchPolicy, Flags); offset < compiled->Length; offset += 7)
+	{
+		memcpy(copy, compiled, compiled->Length);
+		((BYTE*)copy)[offset] ^= 0x5A;
+		CHECK_RESULT(ERROR_FILE_CORRUPT, KillswitchPolicyValidate(copy, copy->Length));
+	}
+
+	// Sections reaching past the end, or two groups wanting the same filter, even with a good checksum
+	memcpy(copy, compiled, compiled->Length);
+	copy->RemoteAddresses.Count = copy->Length;
+	Rechecksum(copy);
+	CHECK_RESULT(ERROR_FILE_CORRUPT, KillswitchPolicyValidate(copy, copy->Length));
+
+	memcpy(copy, compiled, compiled->Length);
+	copy->AppPath.Offset += 1;
+	Rechecksum(copy);
+	CHECK_RESULT(ERROR_FILE_CORRUPT, KillswitchPolicyValidate(copy, copy->Length));
+
+	memcpy(copy, compiled, compiled->Length);
+	KILLSWITCH_POLICY_SECTION(copy, PortGroups, PortPolicyGroup)[1] = KILLSWITCH_POLICY_SECTION(copy, PortGroups, PortPolicyGroup)[0];
+	Rechecksum(copy);
+	CHECK_RESULT(ERROR_FILE_CORRUPT, KillswitchPolicyValidate(copy, copy->Length));
+
+	memcpy(copy, compiled, compiled->Length);
+	copy->Version++;
+	CHECK_RESULT(ERROR_REVISION_MISMATCH, KillswitchPolicyValidate(copy, copy->Length));
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicySave(copy, path));
+	CHECK_RESULT(ERROR_REVISION_MISMATCH, KillswitchPolicyMap(path, &mapped));
+
+	// Cut short, as a copy that never finished would be
+	CHECK_RESULT(ERROR_FILE_CORRUPT, KillswitchPolicyValidate(compiled, compiled->Length - 1));
+	CHECK_RESULT(ERROR_FILE_CORRUPT, KillswitchPolicyValidate(compiled, sizeof(KillswitchPolicy) - 1));
+
+	DeleteFileW(path);
+	CHECK_RESULT(ERROR_FILE_NOT_FOUND, KillswitchPolicyMap(path, &mapped));
+	CHECK(mapped == NULL);
+
+Cleanup:
+	if (copy != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, copy);
+	}
+	KillswitchPolicyFree(compiled);
+	DeleteFileW(path);
+}
+
+static void BadArgumentsAreRejected()
+{
+	static WFPKS_ADDR_AND_MASK missing[] = { { "10.0.0.1", NULL } };
+	KillswitchPolicy* policy = NULL;
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, KillswitchPolicyCompile(TestRemote, -1, NULL, 0, NULL, 0, 0, NULL, FALSE, NULL, &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, KillswitchPolicyCompile(NULL, 1, NULL, 0, NULL, 0, 0, NULL, FALSE, NULL, &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, KillswitchPolicyCompile(TestRemote, 1, missing, 1, NULL, 0, 0, NULL, FALSE, NULL, &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, KillswitchPolicyCompile(TestRemote, 1, NULL, 0, TestRules, -1, 0, NULL, FALSE, NULL, &policy));
+	CHECK(policy == NULL);
+
+	// Nothing optional given still makes a policy, blocking everything but the one address
+	CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyCompile(TestRemote, 1, NULL, 0, NULL, 0, 0, NULL, FALSE, NULL, &policy));
+	if (policy != NULL)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, KillswitchPolicyValidate(policy, policy->Length));
+		CHECK_RESULT(0, policy->PortGroups.Count);
+		CHECK_RESULT(0, policy->AppPath.Count);
+		CHECK_RESULT(0, policy->Flags);
+		KillswitchPolicyFree(policy);
+	}
+}
+
+const TestCase KillswitchPolicyTests[] =
+{
+	{ "RoundTripKeepsEverySection", RoundTripKeepsEverySection },
+	{ "PatchingTheTapLeavesTheFileAlone", PatchingTheTapLeavesTheFileAlone },
+	{ "CompileLooksUpTheTap", CompileLooksUpTheTap },
+	{ "DamagedPoliciesAreRejected", DamagedPoliciesAreRejected },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT KillswitchPolicyTestsCount = CELEMS(KillswitchPolicyTests);
@@ -0,0 +1,413 @@
+#include <windows.h>
+#include <string.h>
+#include "ManagementParser.h"
+#include "ManagementRecording.h"
+#include "Tests.h"
+
+TEST_SUITE(ManagementParserTests);
+
+#define TEST_MAX_EVENTS 64
+#define TEST_TEXT_LENGTH 256
+#define TEST_RECORDING_EVENTS 32
+#define TEST_CHUNK_SEEDS 8
+#define TEST_MAX_CHUNK 96
+
+typedef struct _RecordedEvent
+{
+	MgmtEvent Event;
+	// The start of the text, the whole of it for everything but the long lines
+	CHAR Text[TEST_TEXT_LENGTH];
+} RecordedEvent;
+
+typedef struct _Recording
+{
+	UINT Count;
+	RecordedEvent Events[TEST_MAX_EVENTS];
+} Recording;
+
+// Too big for the stack with a few of them about
+static Recording Whole;
+static Recording Fed;
+static CHAR LongLines[MGMT_MAX_LINE * 2 + 64];
+
+static void CALLBACK RecordEvent(const MgmtEvent* event, const CHAR* text, PVOID context)
+{
+	Recording* recording = (Recording*)context;
+
+	if (recording->Count >= TEST_MAX_EVENTS)
+	{
+		recording->Count++;
+		return;
+	}
+
+	RecordedEvent* recorded = &recording->Events[recording->Count++];
+	UINT32 length = min(event->TextLength, (UINT32)TEST_TEXT_LENGTH - 1);
+
+	recorded->Event = *event;
+	memcpy(recorded->Text, text, length);
+	recorded->Text[length] = '\0';
+}
+
+// A parser that hands every event to recording as it is parsed
+static HMGMTPARSER CreateRecorder(Recording* recording)
+{
+	HMGMTPARSER parser = NULL;
+
+	ZeroMemory(recording, sizeof(*recording));
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserCreate(&parser));
+	for (int type = MgmtUnknown + 1; parser != NULL && type < MgmtEventTypeCount; type++)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, ManagementParserSetHandler(parser, (MgmtEventType)type, RecordEvent, recording));
+	}
+
+	return parser;
+}
+
+// Feeds data in chunks of 1 to maxChunk bytes picked by seed, a maxChunk of 1 goes a byte at a time
+static void FeedChunked(const CHAR* data, SIZE_T length, UINT seed, SIZE_T maxChunk, Recording* recording)
+{
+	HMGMTPARSER parser = CreateRecorder(recording);
+	UINT random = seed;
+
+	if (parser == NULL)
+	{
+		return;
+	}
+
+	for (SIZE_T offset = 0; offset < length;)
+	{
+		random = random * 1103515245 + 12345;
+
+		SIZE_T chunk = min(1 + (SIZE_T)(random >> 16) % maxChunk, length - offset);
+
+		CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, data + offset, chunk));
+		offset += chunk;
+	}
+
+	ManagementParserClose(parser);
+}
+
+static void FeedWhole(const CHAR* data, SIZE_T length, Recording* recording)
+{
+	HMGMTPARSER parser = CreateRecorder(recording);
+
+	if (parser != NULL)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, data, length));
+		ManagementParserClose(parser);
+	}
+}
+
+static BOOL SameEvents(const Recording* expected, const Recording* actual)
+{
+	if (expected->Count != actual->Count)
+	{
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < expected->Count && i < TEST_MAX_EVENTS; i++)
+	{
+		if (memcmp(&expected->Events[i].Event, &actual->Events[i].Event, sizeof(MgmtEvent)) != 0
+			|| strcmp(expected->Events[i].Text, actual->Events[i].Text) != 0)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOL SameAddress(UINT32 address, BYTE a, BYTE b, BYTE c, BYTE d)
+{
+	const BYTE octets[4] = { a, b, c, d };
+
+	return memcmp(&address, octets, sizeof(octets)) == 0;
+}
+
+static BOOL HasText(const RecordedEvent* recorded, UINT16 offset, UINT16 length, const CHAR* expected)
+{
+	return length == strlen(expected) && strncmp(recorded->Text + offset, expected, length) == 0;
+}
+
+static void RecordingIsParsed()
+{
+	static const UINT16 expected[TEST_RECORDING_EVENTS] =
+	{
+		MgmtInfo, MgmtHold, MgmtSuccess, MgmtSuccess, MgmtSuccess, MgmtSuccess, MgmtLog, MgmtState,
+		MgmtState, MgmtPassword, MgmtSuccess, MgmtLog, MgmtEcho, MgmtState, MgmtState, MgmtState,
+		MgmtState, MgmtState, MgmtByteCount, MgmtByteCount, MgmtByteCountClient, MgmtByteCount, MgmtNeedOk, MgmtPassword,
+		MgmtFatal, MgmtError, MgmtState, MgmtState, MgmtLine, MgmtLine, MgmtState, MgmtPasswordPrompt,
+	};
+
+	FeedWhole(ManagementRecording, sizeof(ManagementRecording) - 1, &Whole);
+
+	CHECK_RESULT(TEST_RECORDING_EVENTS, Whole.Count);
+	if (Whole.Count != TEST_RECORDING_EVENTS)
+	{
+		return;
+	}
+
+	for (UINT i = 0; i < TEST_RECORDING_EVENTS; i++)
+	{
+		CHECK_RESULT(expected[i], Whole.Events[i].Event.Type);
+	}
+
+	const RecordedEvent* events = Whole.Events;
+
+	CHECK(strcmp(events[0].Text, "OpenVPN Management Interface Version 3 -- type 'help' for more info") == 0);
+	CHECK_RESULT(0, events[4].Event.Flags);
+	CHECK_RESULT(MGMT_FLAG_SUCCESS_HOLD_RELEASED, events[5].Event.Flags);
+
+	CHECK_RESULT(1700000000, events[6].Event.Log.Time);
+	CHECK_RESULT(MGMT_LOG_INFO, events[6].Event.Log.Flags);
+	CHECK_RESULT(MGMT_FLAG_PASSWORD_NEED_AUTH, events[9].Event.Flags);
+	// The message keeps its commas
+	CHECK_RESULT(MGMT_LOG_WARNING, events[11].Event.Log.Flags);
+	CHECK(HasText(&events[11], events[11].Event.Log.MessageOffset, events[11].Event.Log.MessageLength, "WARNING: cipher, with commas, in message"));
+	CHECK(HasText(&events[12], events[12].Event.Log.MessageOffset, events[12].Event.Log.MessageLength, "forget-passwords"));
+
+	const MgmtStateData* connected = &events[17].Event.State;
+	CHECK_RESULT(MgmtStateConnected, connected->State);
+	CHECK_RESULT(1700000007, connected->Time);
+	CHECK(SameAddress(connected->LocalIp, 10, 8, 0, 6));
+	CHECK(SameAddress(connected->RemoteIp, 185, 7, 12, 7));
+	CHECK_RESULT(1194, connected->RemotePort);
+	CHECK(HasText(&events[17], connected->DescriptionOffset, connected->DescriptionLength, "SUCCESS"));
+	CHECK_RESULT(0, events[17].Event.Flags);
+	CHECK_RESULT(MgmtStateAssignIp, events[15].Event.State.State);
+	CHECK(SameAddress(events[15].Event.State.LocalIp, 10, 8, 0, 6));
+	CHECK_RESULT(0, events[15].Event.State.RemoteIp);
+
+	CHECK_RESULT(10240, events[19].Event.ByteCount.BytesIn);
+	CHECK_RESULT(4096, events[19].Event.ByteCount.BytesOut);
+	CHECK_RESULT(7, events[20].Event.ByteCount.ClientId);
+	CHECK_RESULT(100, events[20].Event.ByteCount.BytesIn);
+	CHECK_RESULT(200, events[20].Event.ByteCount.BytesOut);
+	CHECK_RESULT(MGMT_FLAG_MALFORMED, events[21].Event.Flags);
+
+	CHECK_RESULT(MGMT_FLAG_PASSWORD_VERIFICATION_FAILED, events[23].Event.Flags);
+	CHECK_RESULT(MGMT_FLAG_STATE_ERROR, events[26].Event.Flags);
+	CHECK_RESULT(MgmtStateReconnecting, events[27].Event.State.State);
+	// Unknown notifications come through whole
+	CHECK(strcmp(events[28].Text, ">SOMETHING_NEW:hello") == 0);
+	CHECK(strcmp(events[29].Text, "END") == 0);
+	CHECK_RESULT(MgmtStateExiting, events[30].Event.State.State);
+	CHECK_RESULT(0, events[31].Event.TextLength);
+}
+
+static void ChunkingDoesNotMatter()
+{
+	const SIZE_T length = sizeof(ManagementRecording) - 1;
+
+	FeedWhole(ManagementRecording, length, &Whole);
+	CHECK_RESULT(TEST_RECORDING_EVENTS, Whole.Count);
+
+	FeedChunked(ManagementRecording, length, 0, 1, &Fed);
+	CHECK(SameEvents(&Whole, &Fed));
+
+	for (UINT seed = 1; seed <= TEST_CHUNK_SEEDS; seed++)
+	{
+		FeedChunked(ManagementRecording, length, seed, TEST_MAX_CHUNK, &Fed);
+		CHECK(SameEvents(&Whole, &Fed));
+	}
+}
+
+static void LongLinesAreCut()
+{
+	const CHAR prefix[] = ">LOG:1,I,";
+	const CHAR next[] = ">BYTECOUNT:1,2\r\n";
+	SIZE_T length = 0;
+
+	// One line a byte too long, then one exactly MGMT_MAX_LINE long, then a short one
+	memcpy(LongLines, prefix, sizeof(prefix) - 1);
+	length += sizeof(prefix) - 1;
+	memset(LongLines + length, 'x', MGMT_MAX_LINE + 1 - length);
+	length = MGMT_MAX_LINE + 1;
+	LongLines[length++] = '\n';
+
+	memcpy(LongLines + length, prefix, sizeof(prefix) - 1);
+	memset(LongLines + length + sizeof(prefix) - 1, 'y', MGMT_MAX_LINE - (sizeof(prefix) - 1));
+	length += MGMT_MAX_LINE;
+	LongLines[length++] = '\n';
+
+	memcpy(LongLines + length, next, sizeof(next) - 1);
+	length += sizeof(next) - 1;
+
+	FeedWhole(LongLines, length, &Whole);
+
+	CHECK_RESULT(3, Whole.Count);
+	if (Whole.Count != 3)
+	{
+		return;
+	}
+
+	CHECK_RESULT(MgmtLog, Whole.Events[0].Event.Type);
+	CHECK_RESULT(MGMT_FLAG_TRUNCATED, Whole.Events[0].Event.Flags);
+	CHECK_RESULT(MGMT_MAX_LINE - 5, Whole.Events[0].Event.TextLength);
+	CHECK_RESULT(MgmtLog, Whole.Events[1].Event.Type);
+	CHECK_RESULT(0, Whole.Events[1].Event.Flags);
+	CHECK_RESULT(MGMT_MAX_LINE - 5, Whole.Events[1].Event.TextLength);
+	CHECK_RESULT(MgmtByteCount, Whole.Events[2].Event.Type);
+	CHECK_RESULT(2, Whole.Events[2].Event.ByteCount.BytesOut);
+
+	// Through the carry buffer the cut lands in the same place
+	FeedChunked(LongLines, length, 0, 1, &Fed);
+	CHECK(SameEvents(&Whole, &Fed));
+	FeedChunked(LongLines, length, 1, MGMT_MAX_LINE / 3, &Fed);
+	CHECK(SameEvents(&Whole, &Fed));
+}
+
+static void SplitLinesAreJoined()
+{
+	const CHAR* pieces[] = { ">STATE:1700000007,CONN", "ECTED,SUCCESS,10.8.0.6,", "185.7.12.7,1194,,\r", "\n>HOLD:x\r\n" };
+	HMGMTPARSER parser = CreateRecorder(&Fed);
+
+	if (parser == NULL)
+	{
+		return;
+	}
+
+	for (UINT i = 0; i < CELEMS(pieces) - 1; i++)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, pieces[i], strlen(pieces[i])));
+		CHECK_RESULT(0, Fed.Count);
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, pieces[3], strlen(pieces[3])));
+	CHECK_RESULT(2, Fed.Count);
+	CHECK_RESULT(MgmtState, Fed.Events[0].Event.Type);
+	CHECK_RESULT(MgmtStateConnected, Fed.Events[0].Event.State.State);
+	CHECK(SameAddress(Fed.Events[0].Event.State.RemoteIp, 185, 7, 12, 7));
+	CHECK_RESULT(1194, Fed.Events[0].Event.State.RemotePort);
+	CHECK_RESULT(MgmtHold, Fed.Events[1].Event.Type);
+
+	// A new connection starts clean
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, ">STATE:17", 9));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserReset(parser));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, ">HOLD:y\r\n", 9));
+	CHECK_RESULT(3, Fed.Count);
+	CHECK_RESULT(MgmtHold, Fed.Events[2].Event.Type);
+	CHECK(strcmp(Fed.Events[2].Text, "y") == 0);
+
+	ManagementParserClose(parser);
+}
+
+static void PasswordPromptNeedsNoLineEnd()
+{
+	HMGMTPARSER parser = CreateRecorder(&Fed);
+
+	if (parser == NULL)
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, "ENTER PASS", 10));
+	CHECK_RESULT(0, Fed.Count);
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, "WORD:", 5));
+	CHECK_RESULT(1, Fed.Count);
+	CHECK_RESULT(MgmtPasswordPrompt, Fed.Events[0].Event.Type);
+
+	// Nothing of the prompt is left to spoil the next line
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, "SUCCESS: password is correct\r\n", 30));
+	CHECK_RESULT(2, Fed.Count);
+	CHECK_RESULT(MgmtSuccess, Fed.Events[1].Event.Type);
+	CHECK(strcmp(Fed.Events[1].Text, "password is correct") == 0);
+
+	ManagementParserClose(parser);
+}
+
+static void DrainCoalescesByteCounts()
+{
+	const CHAR stream[] = ">BYTECOUNT:1,10\r\n>LOG:5,I,hello\r\n>BYTECOUNT:2,20\r\n>BYTECOUNT:3,30\r\n>BYTECOUNT:bad\r\n";
+	HMGMTPARSER parser = NULL;
+
+	MgmtBatch* batch = (MgmtBatch*)HeapAlloc(GetProcessHeap(), 0, sizeof(MgmtBatch));
+	CHECK(batch != NULL);
+	if (batch == NULL)
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserCreate(&parser));
+	if (parser == NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, batch);
+		return;
+	}
+
+	// The newest totals take the place of the first, a malformed one can't
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, stream, sizeof(stream) - 1));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserDrain(parser, batch));
+	CHECK_RESULT(3, batch->Count);
+	CHECK_RESULT(2, batch->Coalesced);
+	CHECK_RESULT(0, batch->Dropped);
+	CHECK_RESULT(MgmtByteCount, batch->Events[0].Type);
+	CHECK_RESULT(3, batch->Events[0].ByteCount.BytesIn);
+	CHECK_RESULT(30, batch->Events[0].ByteCount.BytesOut);
+	CHECK(batch->Events[0].TextLength == 4 && strncmp(batch->Text + batch->Events[0].TextOffset, "3,30", 4) == 0);
+	CHECK_RESULT(MgmtLog, batch->Events[1].Type);
+	CHECK(batch->Events[1].TextLength == 9 && strncmp(batch->Text + batch->Events[1].TextOffset, "5,I,hello", 9) == 0);
+	CHECK_RESULT(MgmtByteCount, batch->Events[2].Type);
+	CHECK_RESULT(MGMT_FLAG_MALFORMED, batch->Events[2].Flags);
+
+	// A drain starts the next batch afresh
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, ">BYTECOUNT:4,40\r\n", 17));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserDrain(parser, batch));
+	CHECK_RESULT(1, batch->Count);
+	CHECK_RESULT(0, batch->Coalesced);
+	CHECK_RESULT(4, batch->Events[0].ByteCount.BytesIn);
+
+	// Totals still land in a full batch, other events are counted as dropped
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, ">BYTECOUNT:0,0\r\n", 16));
+	for (UINT i = 0; i < MGMT_BATCH_EVENTS + 1; i++)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, ">HOLD:x\r\n", 9));
+	}
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, ">BYTECOUNT:5,50\r\n", 17));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserDrain(parser, batch));
+	CHECK_RESULT(MGMT_BATCH_EVENTS, batch->Count);
+	CHECK_RESULT(2, batch->Dropped);
+	CHECK_RESULT(1, batch->Coalesced);
+	CHECK_RESULT(5, batch->Events[0].ByteCount.BytesIn);
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserDrain(parser, batch));
+	CHECK_RESULT(0, batch->Count);
+
+	ManagementParserClose(parser);
+	HeapFree(GetProcessHeap(), 0, batch);
+}
+
+static void BadArgumentsAreRejected()
+{
+	HMGMTPARSER parser = NULL;
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementParserCreate(NULL));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserCreate(&parser));
+	if (parser == NULL)
+	{
+		return;
+	}
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementParserSetHandler(parser, MgmtUnknown, RecordEvent, &Fed));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementParserSetHandler(parser, MgmtEventTypeCount, RecordEvent, &Fed));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementParserFeed(parser, NULL, 1));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementParserFeed(parser, NULL, 0));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementParserDrain(parser, NULL));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementParserFeed(NULL, "x", 1));
+
+	ManagementParserClose(parser);
+}
+
+const TestCase ManagementParserTests[] =
+{
+	{ "RecordingIsParsed", RecordingIsParsed },
+	{ "ChunkingDoesNotMatter", ChunkingDoesNotMatter },
+	{ "LongLinesAreCut", LongLinesAreCut },
+	{ "SplitLinesAreJoined", SplitLinesAreJoined },
+	{ "PasswordPromptNeedsNoLineEnd", PasswordPromptNeedsNoLineEnd },
+	{ "DrainCoalescesByteCounts", DrainCoalescesByteCounts },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT ManagementParserTestsCount = CELEMS(ManagementParserTests);
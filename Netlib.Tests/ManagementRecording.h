@@ -0,0 +1,38 @@
+#pragma once
+
+// A management session as OpenVPN 2.6 sends it, replies and notifications interleaved, ending on the password
+// prompt that has no line end. Some lines are bent to cover what the parser has to survive: commas inside a
+// LOG message, a BYTECOUNT that does not parse, a notification nobody knows.
+static const CHAR ManagementRecording[] =
+	">INFO:OpenVPN Management Interface Version 3 -- type 'help' for more info\r\n"
+	">HOLD:Waiting for hold release:0\r\n"
+	"SUCCESS: real-time state notification set to ON\r\n"
+	"SUCCESS: real-time log notification set to ON\r\n"
+	"SUCCESS: bytecount interval changed\r\n"
+	"SUCCESS: hold release succeeded\r\n"
+	">LOG:1700000000,I,OpenVPN 2.6.8 x86_64-w64-mingw32 [SSL (OpenSSL)] [LZO] [LZ4]\r\n"
+	">STATE:1700000001,RESOLVE,,,,,,\r\n"
+	">STATE:1700000001,TCP_CONNECT,,,,,,\r\n"
+	">PASSWORD:Need 'Auth' username/password\r\n"
+	"SUCCESS: 'Auth' username entered, but not yet verified\r\n"
+	">LOG:1700000002,W,WARNING: cipher, with commas, in message\r\n"
+	">ECHO:1700000002,forget-passwords\r\n"
+	">STATE:1700000003,AUTH,,,,,,\r\n"
+	">STATE:1700000004,GET_CONFIG,,,,,,\r\n"
+	">STATE:1700000005,ASSIGN_IP,,10.8.0.6,,,,\r\n"
+	">STATE:1700000006,ADD_ROUTES,,,,,,\r\n"
+	">STATE:1700000007,CONNECTED,SUCCESS,10.8.0.6,185.7.12.7,1194,,\r\n"
+	">BYTECOUNT:5120,2048\r\n"
+	">BYTECOUNT:10240,4096\r\n"
+	">BYTECOUNT_CLI:7,100,200\r\n"
+	">BYTECOUNT:bad,4096\r\n"
+	">NEED-OK:Need 'token-insertion-request' confirmation MSG:Please insert your cryptographic token\r\n"
+	">PASSWORD:Verification Failed: 'Auth'\r\n"
+	">FATAL:ERROR: Cannot open TUN/TAP dev\r\n"
+	"ERROR: unknown command, enter 'help' for more options\r\n"
+	">STATE:1700000008,CONNECTED,ERROR,10.8.0.6,185.7.12.7,1194,,\r\n"
+	">STATE:1700000009,RECONNECTING,ping-restart,,,,,\r\n"
+	">SOMETHING_NEW:hello\r\n"
+	"END\r\n"
+	">STATE:1700000010,EXITING,SIGTERM,,,,,\r\n"
+	"ENTER PASSWORD:";
@@ -0,0 +1,570 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <string.h>
+#include "ManagementTransport.h"
+#include "Tests.h"
+
+TEST_SUITE(ManagementTransportTests);
+
+#define TEST_MAX_REPLIES 16
+#define TEST_MAX_TEXT 256
+#define TEST_LINE_LENGTH 1100
+#define TEST_QUIET_MS 200
+#define TEST_PASSWORD "correct horse"
+
+typedef struct _RecordedReply
+{
+	UINT64 CommandId;
+	DWORD Result;
+	UINT16 Flags;
+	CHAR Text[TEST_MAX_TEXT];
+} RecordedReply;
+
+// Written by the transport thread, a reply is filled in before the count takes it in
+static RecordedReply Replies[TEST_MAX_REPLIES];
+static volatile LONG ReplyCount;
+
+// The test plays OpenVPN, it connects to the transport and reads the commands off this socket
+static SOCKET Client = INVALID_SOCKET;
+static CHAR Received[TEST_LINE_LENGTH * 4];
+static UINT ReceivedLength;
+
+static void CALLBACK RecordReply(const MgmtReply* reply, const CHAR* text, PVOID context)
+{
+	LONG index = ReplyCount;
+
+	if (index >= TEST_MAX_REPLIES)
+	{
+		return;
+	}
+
+	RecordedReply* recorded = &Replies[index];
+	recorded->CommandId = reply->CommandId;
+	recorded->Result = reply->Result;
+	recorded->Flags = reply->Flags;
+
+	UINT32 length = min(reply->TextLength, (UINT32)TEST_MAX_TEXT - 1);
+	memcpy(recorded->Text, text, length);
+	recorded->Text[length] = '\0';
+
+	InterlockedIncrement(&ReplyCount);
+}
+
+static HMGMTTRANSPORT StartTransport(UINT maxInFlight, UINT maxQueued, LPCSTR password, HANDLE connectEvent)
+{
+	MgmtTransportOptions options;
+	HMGMTTRANSPORT transport = NULL;
+	WSADATA wsaData;
+
+	ZeroMemory(Replies, sizeof(Replies));
+	ReplyCount = 0;
+	ReceivedLength = 0;
+
+	CHECK_RESULT(ERROR_SUCCESS, WSAStartup(MAKEWORD(2, 2), &wsaData));
+
+	ZeroMemory(&options, sizeof(options));
+	options.MaxInFlight = maxInFlight;
+	options.MaxQueued = maxQueued;
+	options.Password = password;
+	options.ConnectEvent = connectEvent;
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportCreate(&options, RecordReply, NULL, &transport));
+
+	return transport;
+}
+
+static void CloseClient()
+{
+	if (Client != INVALID_SOCKET)
+	{
+		closesocket(Client);
+		Client = INVALID_SOCKET;
+	}
+
+	ReceivedLength = 0;
+}
+
+static void StopTransport(HMGMTTRANSPORT transport)
+{
+	CloseClient();
+
+	if (transport != NULL)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, ManagementTransportClose(transport));
+	}
+
+	WSACleanup();
+}
+
+// Connects to the transport's port as OpenVPN's --management-client does
+static SOCKET ConnectTo(HMGMTTRANSPORT transport)
+{
+	SOCKADDR_IN address;
+	USHORT port = 0;
+	BOOL noDelay = TRUE;
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportGetPort(transport, &port));
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	if (connect(s, (const SOCKADDR*)&address, sizeof(address)) != 0)
+	{
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	return s;
+}
+
+static BOOL Connect(HMGMTTRANSPORT transport)
+{
+	Client = ConnectTo(transport);
+	CHECK(Client != INVALID_SOCKET);
+
+	return Client != INVALID_SOCKET;
+}
+
+static BOOL SendText(const CHAR* text)
+{
+	int length = (int)strlen(text);
+
+	while (length > 0)
+	{
+		int sent = send(Client, text, length, 0);
+		if (sent <= 0)
+		{
+			return FALSE;
+		}
+
+		text += sent;
+		length -= sent;
+	}
+
+	return TRUE;
+}
+
+// FALSE when nothing arrives within timeoutMs or the transport hung up
+static BOOL ReceiveMore(DWORD timeoutMs)
+{
+	WSAPOLLFD poll;
+
+	poll.fd = Client;
+	poll.events = POLLRDNORM;
+	poll.revents = 0;
+
+	if (ReceivedLength == sizeof(Received) || WSAPoll(&poll, 1, (INT)timeoutMs) <= 0)
+	{
+		return FALSE;
+	}
+
+	int received = recv(Client, Received + ReceivedLength, (int)(sizeof(Received) - ReceivedLength), 0);
+	if (received <= 0)
+	{
+		return FALSE;
+	}
+
+	ReceivedLength += (UINT)received;
+
+	return TRUE;
+}
+
+// TRUE when the transport closes s within the timeout
+static BOOL HungUp(SOCKET s)
+{
+	WSAPOLLFD poll;
+	CHAR byte;
+
+	poll.fd = s;
+	poll.events = POLLRDNORM;
+	poll.revents = 0;
+
+	return WSAPoll(&poll, 1, TEST_TIMEOUT_MS) > 0 && recv(s, &byte, sizeof(byte), 0) <= 0;
+}
+
+// Takes the next command line the transport wrote, without its line end
+static BOOL ReadCommand(CHAR* line, UINT size)
+{
+	for (;;)
+	{
+		CHAR* end = (CHAR*)memchr(Received, '\n', ReceivedLength);
+		if (end != NULL)
+		{
+			UINT length = (UINT)(end - Received);
+			if (length >= size)
+			{
+				return FALSE;
+			}
+
+			memcpy(line, Received, length);
+			line[length] = '\0';
+			ReceivedLength -= length + 1;
+			memmove(Received, end + 1, ReceivedLength);
+			return TRUE;
+		}
+
+		if (!ReceiveMore(TEST_TIMEOUT_MS))
+		{
+			return FALSE;
+		}
+	}
+}
+
+static BOOL ExpectCommand(LPCSTR expected)
+{
+	CHAR line[TEST_LINE_LENGTH];
+
+	BOOL read = ReadCommand(line, sizeof(line));
+	CHECK(read);
+	CHECK(read && strcmp(line, expected) == 0);
+
+	return read;
+}
+
+// TRUE when the transport wrote nothing more for a while
+static BOOL NothingMoreSent()
+{
+	return ReceivedLength == 0 && !ReceiveMore(TEST_QUIET_MS);
+}
+
+static void PipelinedRepliesFollowTheCommands()
+{
+	UINT64 ids[4] = { 0 };
+
+	HMGMTTRANSPORT transport = StartTransport(8, 16, NULL, NULL);
+	if (transport == NULL || !Connect(transport))
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportWaitConnected(transport, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "hold release", MgmtReplySingle, &ids[0]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "state", MgmtReplyList, &ids[1]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "bytecount 5", MgmtReplySingle, &ids[2]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "version", MgmtReplyList, &ids[3]));
+
+	CHECK(ids[0] != 0 && ids[0] < ids[1] && ids[1] < ids[2] && ids[2] < ids[3]);
+
+	// All four are written ahead of any reply
+	ExpectCommand("hold release");
+	ExpectCommand("state");
+	ExpectCommand("bytecount 5");
+	ExpectCommand("version");
+	CHECK_RESULT(0, ReplyCount);
+
+	// A notification in between is no reply
+	CHECK(SendText(
+		"SUCCESS: hold release succeeded\r\n"
+		"1700000000,CONNECTED,SUCCESS,10.8.0.2,198.51.100.7,1194,,\r\n"
+		">BYTECOUNT:1024,2048\r\n"
+		"END\r\n"
+		"SUCCESS: bytecount interval changed\r\n"
+		"OpenVPN Version: OpenVPN 2.6.8\r\n"
+		"Management Version: 5\r\n"
+		"END\r\n"));
+
+	CHECK(TestWaitFor(&ReplyCount, 4, TEST_TIMEOUT_MS));
+
+	for (UINT i = 0; i < 4; i++)
+	{
+		CHECK(Replies[i].CommandId == ids[i]);
+		CHECK_RESULT(ERROR_SUCCESS, Replies[i].Result);
+		CHECK_RESULT(0, Replies[i].Flags);
+	}
+
+	CHECK(strcmp(Replies[0].Text, "hold release succeeded") == 0);
+	CHECK(strcmp(Replies[1].Text, "1700000000,CONNECTED,SUCCESS,10.8.0.2,198.51.100.7,1194,,\n") == 0);
+	CHECK(strcmp(Replies[2].Text, "bytecount interval changed") == 0);
+	CHECK(strcmp(Replies[3].Text, "OpenVPN Version: OpenVPN 2.6.8\nManagement Version: 5\n") == 0);
+
+	StopTransport(transport);
+}
+
+static void ErrorRepliesAreRefused()
+{
+	UINT64 ids[3] = { 0 };
+
+	HMGMTTRANSPORT transport = StartTransport(8, 16, NULL, NULL);
+	if (transport == NULL || !Connect(transport))
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "signal SIGBOGUS", MgmtReplySingle, &ids[0]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "status 9", MgmtReplyList, &ids[1]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "log on all", MgmtReplyList, &ids[2]));
+
+	ExpectCommand("signal SIGBOGUS");
+	ExpectCommand("status 9");
+	ExpectCommand("log on all");
+
+	// An ERROR: line ends a list early, a SUCCESS: line ahead of one is skipped
+	CHECK(SendText(
+		"ERROR: signal SIGBOGUS is not a valid signal\r\n"
+		"ERROR: status version must be 1, 2 or 3\r\n"
+		"SUCCESS: real-time log notification set to ON\r\n"
+		"1700000000,I,Initialization Sequence Completed\r\n"
+		"END\r\n"));
+
+	CHECK(TestWaitFor(&ReplyCount, 3, TEST_TIMEOUT_MS));
+
+	CHECK(Replies[0].CommandId == ids[0]);
+	CHECK_RESULT(ERROR_REQUEST_REFUSED, Replies[0].Result);
+	CHECK(strcmp(Replies[0].Text, "signal SIGBOGUS is not a valid signal") == 0);
+
+	CHECK(Replies[1].CommandId == ids[1]);
+	CHECK_RESULT(ERROR_REQUEST_REFUSED, Replies[1].Result);
+	CHECK(strcmp(Replies[1].Text, "status version must be 1, 2 or 3") == 0);
+
+	CHECK(Replies[2].CommandId == ids[2]);
+	CHECK_RESULT(ERROR_SUCCESS, Replies[2].Result);
+	CHECK(strcmp(Replies[2].Text, "1700000000,I,Initialization Sequence Completed\n") == 0);
+
+	StopTransport(transport);
+}
+
+static void QueueIsBoundedAndWindowed()
+{
+	UINT64 ids[5] = { 0 };
+	UINT64 busy = 0;
+
+	HMGMTTRANSPORT transport = StartTransport(2, 4, NULL, NULL);
+	if (transport == NULL)
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	// Queued while nothing is connected, up to MaxQueued
+	for (UINT i = 0; i < 4; i++)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "bytecount 1", MgmtReplySingle, &ids[i]));
+	}
+
+	CHECK_RESULT(ERROR_BUSY, ManagementTransportSend(transport, "bytecount 1", MgmtReplySingle, &busy));
+	CHECK(busy == 0);
+
+	if (!Connect(transport))
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	// Only MaxInFlight are written ahead of their replies
+	ExpectCommand("bytecount 1");
+	ExpectCommand("bytecount 1");
+	CHECK(NothingMoreSent());
+
+	CHECK(SendText("SUCCESS: bytecount interval changed\r\n"));
+	CHECK(TestWaitFor(&ReplyCount, 1, TEST_TIMEOUT_MS));
+	CHECK(Replies[0].CommandId == ids[0]);
+
+	// The reply made room in the queue and in the window
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "bytecount 2", MgmtReplySingle, &ids[4]));
+	ExpectCommand("bytecount 1");
+	CHECK(NothingMoreSent());
+
+	CHECK(SendText("SUCCESS: bytecount interval changed\r\nSUCCESS: bytecount interval changed\r\n"));
+	ExpectCommand("bytecount 1");
+	ExpectCommand("bytecount 2");
+	CHECK(SendText("SUCCESS: bytecount interval changed\r\nSUCCESS: bytecount interval changed\r\n"));
+	CHECK(TestWaitFor(&ReplyCount, 5, TEST_TIMEOUT_MS));
+
+	for (UINT i = 0; i < 5; i++)
+	{
+		CHECK(Replies[i].CommandId == ids[i]);
+		CHECK_RESULT(ERROR_SUCCESS, Replies[i].Result);
+	}
+
+	StopTransport(transport);
+}
+
+static void DisconnectFailsWaitingCommands()
+{
+	UINT64 ids[4] = { 0 };
+
+	HMGMTTRANSPORT transport = StartTransport(1, 8, NULL, NULL);
+	if (transport == NULL || !Connect(transport))
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportWaitConnected(transport, TEST_TIMEOUT_MS));
+
+	// A second connection is refused while the first is up
+	SOCKET second = ConnectTo(transport);
+	CHECK(second != INVALID_SOCKET);
+	if (second != INVALID_SOCKET)
+	{
+		CHECK(HungUp(second));
+		closesocket(second);
+	}
+
+	// One in flight, two still queued behind it
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "state", MgmtReplyList, &ids[0]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "hold release", MgmtReplySingle, &ids[1]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "version", MgmtReplyList, &ids[2]));
+	ExpectCommand("state");
+
+	// Half a list doesn't leak into the next connection
+	CHECK(SendText("1700000000,CONNECTING,,,,,,\r\n"));
+	Sleep(TEST_QUIET_MS);
+	CloseClient();
+
+	CHECK(TestWaitFor(&ReplyCount, 3, TEST_TIMEOUT_MS));
+
+	for (UINT i = 0; i < 3; i++)
+	{
+		CHECK(Replies[i].CommandId == ids[i]);
+		CHECK_RESULT(ERROR_CONNECTION_ABORTED, Replies[i].Result);
+		CHECK(Replies[i].Text[0] == '\0');
+	}
+
+	CHECK_RESULT(ERROR_TIMEOUT, ManagementTransportWaitConnected(transport, 0));
+
+	// OpenVPN coming back gets a fresh start
+	if (!Connect(transport))
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportWaitConnected(transport, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "state", MgmtReplyList, &ids[3]));
+	ExpectCommand("state");
+	CHECK(SendText("1700000001,CONNECTED,SUCCESS,10.8.0.2,198.51.100.7,1194,,\r\nEND\r\n"));
+
+	CHECK(TestWaitFor(&ReplyCount, 4, TEST_TIMEOUT_MS));
+	CHECK(Replies[3].CommandId == ids[3]);
+	CHECK_RESULT(ERROR_SUCCESS, Replies[3].Result);
+	CHECK(strcmp(Replies[3].Text, "1700000001,CONNECTED,SUCCESS,10.8.0.2,198.51.100.7,1194,,\n") == 0);
+
+	StopTransport(transport);
+}
+
+static void PasswordIsAnswered()
+{
+	UINT64 id = 0;
+
+	HANDLE connectEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	CHECK(connectEvent != NULL);
+	if (connectEvent == NULL)
+	{
+		return;
+	}
+
+	HMGMTTRANSPORT transport = StartTransport(8, 16, TEST_PASSWORD, connectEvent);
+	if (transport == NULL || !Connect(transport))
+	{
+		StopTransport(transport);
+		CloseHandle(connectEvent);
+		return;
+	}
+
+	// Nothing is written until the password is accepted
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "hold release", MgmtReplySingle, &id));
+	CHECK_RESULT(ERROR_TIMEOUT, ManagementTransportWaitConnected(transport, TEST_QUIET_MS));
+	CHECK(NothingMoreSent());
+
+	CHECK(SendText("ENTER PASSWORD:"));
+	ExpectCommand(TEST_PASSWORD);
+	CHECK(NothingMoreSent());
+
+	// The password's SUCCESS: is no reply to the queued command
+	CHECK(SendText("SUCCESS: password is correct\r\n"));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportWaitConnected(transport, TEST_TIMEOUT_MS));
+	CHECK_RESULT(WAIT_OBJECT_0, WaitForSingleObject(connectEvent, TEST_TIMEOUT_MS));
+
+	ExpectCommand("hold release");
+	CHECK_RESULT(0, ReplyCount);
+
+	CHECK(SendText("SUCCESS: hold release succeeded\r\n"));
+	CHECK(TestWaitFor(&ReplyCount, 1, TEST_TIMEOUT_MS));
+	CHECK(Replies[0].CommandId == id);
+	CHECK_RESULT(ERROR_SUCCESS, Replies[0].Result);
+
+	StopTransport(transport);
+	CloseHandle(connectEvent);
+}
+
+static void CloseCancelsWaitingCommands()
+{
+	UINT64 ids[2] = { 0 };
+
+	HMGMTTRANSPORT transport = StartTransport(8, 16, NULL, NULL);
+	if (transport == NULL)
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "hold release", MgmtReplySingle, &ids[0]));
+	CHECK_RESULT(ERROR_SUCCESS, ManagementTransportSend(transport, "state", MgmtReplyList, &ids[1]));
+
+	// The replies come from the transport thread before Close returns
+	StopTransport(transport);
+
+	CHECK_RESULT(2, ReplyCount);
+	CHECK(Replies[0].CommandId == ids[0]);
+	CHECK_RESULT(ERROR_CANCELLED, Replies[0].Result);
+	CHECK(Replies[1].CommandId == ids[1]);
+	CHECK_RESULT(ERROR_CANCELLED, Replies[1].Result);
+}
+
+static void BadArgumentsAreRejected()
+{
+	MgmtTransportOptions options;
+	HMGMTTRANSPORT rejected = NULL;
+	UINT64 id = 0;
+
+	ZeroMemory(&options, sizeof(options));
+	options.Password = "two\nlines";
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportCreate(&options, RecordReply, NULL, &rejected));
+	CHECK(rejected == NULL);
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportCreate(NULL, RecordReply, NULL, NULL));
+
+	HMGMTTRANSPORT transport = StartTransport(0, 0, NULL, NULL);
+	if (transport == NULL)
+	{
+		StopTransport(transport);
+		return;
+	}
+
+	// A line end would pass a second command by the reply matching
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportSend(transport, "state\nsignal SIGTERM", MgmtReplyList, &id));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportSend(transport, "", MgmtReplySingle, &id));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportSend(transport, "state", MgmtReplyKindCount, &id));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportSend(NULL, "state", MgmtReplyList, &id));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ManagementTransportSetHandler(transport, MgmtSuccess, NULL, NULL));
+	CHECK(id == 0);
+
+	StopTransport(transport);
+	CHECK_RESULT(0, ReplyCount);
+}
+
+const TestCase ManagementTransportTests[] =
+{
+	{ "PipelinedRepliesFollowTheCommands", PipelinedRepliesFollowTheCommands },
+	{ "ErrorRepliesAreRefused", ErrorRepliesAreRefused },
+	{ "QueueIsBoundedAndWindowed", QueueIsBoundedAndWindowed },
+	{ "DisconnectFailsWaitingCommands", DisconnectFailsWaitingCommands },
+	{ "PasswordIsAnswered", PasswordIsAnswered },
+	{ "CloseCancelsWaitingCommands", CloseCancelsWaitingCommands },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT ManagementTransportTestsCount = CELEMS(ManagementTransportTests);
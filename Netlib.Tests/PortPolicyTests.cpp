@@ -0,0 +1,217 @@
+#include <winsock2.h>
+#include <windows.h>
+#include "PortPolicy.h"
+#include "Helpers.h"
+#include "Tests.h"
+
+TEST_SUITE(PortPolicyTests);
+
+#define TEST_RANDOM_ROUNDS 40
+#define TEST_RANDOM_RULES 200
+// Random rules stay below this so every port either side of them gets checked
+#define TEST_RANDOM_PORTS 2000
+#define TEST_RANDOM_SPAN 50
+
+static const UINT8 RuleProtocols[] = { 0, IPPROTO_TCP, IPPROTO_UDP };
+// Any protocol rules let ICMP out too
+static const UINT8 TestProtocols[] = { IPPROTO_ICMP, IPPROTO_TCP, IPPROTO_UDP };
+
+// Whether the compiled group at index has protocol and direction and exactly the expected ranges, low and high
+// pairs in order
+static BOOL GroupIs(const PortPolicy* policy, UINT index, UINT8 protocol, UINT8 direction, const UINT16* expected, UINT expectedCount)
+{
+	if (index >= policy->GroupCount)
+	{
+		return FALSE;
+	}
+
+	const PortPolicyGroup* group = &policy->Groups[index];
+	if (group->Protocol != protocol || group->Direction != direction || group->Count != expectedCount)
+	{
+		return FALSE;
+	}
+
+	for (UINT i = 0; i < expectedCount; i++)
+	{
+		const PortRange* range = &policy->Ranges[group->First + i];
+		if (range->Low != expected[i * 2] || range->High != expected[i * 2 + 1])
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+// What the rules allow taken one at a time, for comparing the compiled policy against
+static BOOL RulesAllow(const WFPKS_PORT_RULE* rules, UINT ruleCount, UINT8 protocol, UINT8 direction, USHORT port)
+{
+	for (UINT i = 0; i < ruleCount; i++)
+	{
+		UINT16 high = rules[i].portHigh != 0 ? rules[i].portHigh : rules[i].portLow;
+		if (rules[i].direction == direction && (rules[i].protocol == 0 || rules[i].protocol == protocol) && port >= rules[i].portLow && port <= high)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void DefaultRulesLowerToOneUdpFilter()
+{
+	static const UINT16 expected[] = { 67, 68, 500, 500, 1900, 1900, 4500, 4500, 5350, 5351, 5353, 5353 };
+	PortPolicy policy;
+
+	CHECK_RESULT(ERROR_SUCCESS, PortPolicyCompile(PortPolicyDefaultRules, PORT_POLICY_DEFAULT_RULE_COUNT, &policy));
+	CHECK_RESULT(1, policy.GroupCount);
+	CHECK(GroupIs(&policy, 0, IPPROTO_UDP, WFPKS_PORT_REMOTE, expected, CELEMS(expected) / 2));
+	CHECK_RESULT(CELEMS(expected) / 2, policy.RangeCount);
+
+	// Nothing but UDP out to those ports, the rules used to be open to every protocol
+	CHECK(PortPolicyAllows(&policy, IPPROTO_UDP, 67, 0));
+	CHECK(PortPolicyAllows(&policy, IPPROTO_UDP, 5351, 0));
+	CHECK(!PortPolicyAllows(&policy, IPPROTO_TCP, 67, 0));
+	CHECK(!PortPolicyAllows(&policy, IPPROTO_UDP, 5352, 0));
+	CHECK(!PortPolicyAllows(&policy, IPPROTO_UDP, 1, 67));
+
+	PortPolicyFree(&policy);
+}
+
+static void TouchingAndOverlappingRangesMerge()
+{
+	static const WFPKS_PORT_RULE rules[] = {
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 1500, 1600 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 443, 0 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 440, 445 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 446, 450 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 1000, 2000 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 2001, 0 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 2003, 0 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 65530, 65535 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 65535, 0 },
+	};
+	static const UINT16 expected[] = { 440, 450, 1000, 2001, 2003, 2003, 65530, 65535 };
+	PortPolicy policy;
+
+	CHECK_RESULT(ERROR_SUCCESS, PortPolicyCompile(rules, CELEMS(rules), &policy));
+	CHECK_RESULT(1, policy.GroupCount);
+	CHECK(GroupIs(&policy, 0, IPPROTO_TCP, WFPKS_PORT_REMOTE, expected, CELEMS(expected) / 2));
+
+	PortPolicyFree(&policy);
+}
+
+static void AnyProtocolCoversTcpAndUdp()
+{
+	static const WFPKS_PORT_RULE rules[] = {
+		{ IPPROTO_UDP, WFPKS_PORT_LOCAL, 150, 160 },
+		{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 51820, 0 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 1000, 2000 },
+		{ 0, WFPKS_PORT_REMOTE, 900, 3000 },
+		{ IPPROTO_TCP, WFPKS_PORT_REMOTE, 2990, 3005 },
+		{ IPPROTO_UDP, WFPKS_PORT_LOCAL, 68, 0 },
+		{ 0, WFPKS_PORT_LOCAL, 100, 200 },
+		{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 1194, 0 },
+	};
+	static const UINT16 anyRemote[] = { 900, 3000 };
+	// Only partly covered, splitting it would add a condition rather than save one
+	static const UINT16 tcpRemote[] = { 2990, 3005 };
+	static const UINT16 udpRemote[] = { 51820, 51820 };
+	static const UINT16 anyLocal[] = { 100, 200 };
+	static const UINT16 udpLocal[] = { 68, 68 };
+	PortPolicy policy;
+
+	CHECK_RESULT(ERROR_SUCCESS, PortPolicyCompile(rules, CELEMS(rules), &policy));
+	CHECK_RESULT(5, policy.GroupCount);
+	CHECK(GroupIs(&policy, 0, 0, WFPKS_PORT_REMOTE, anyRemote, 1));
+	CHECK(GroupIs(&policy, 1, IPPROTO_TCP, WFPKS_PORT_REMOTE, tcpRemote, 1));
+	CHECK(GroupIs(&policy, 2, IPPROTO_UDP, WFPKS_PORT_REMOTE, udpRemote, 1));
+	CHECK(GroupIs(&policy, 3, 0, WFPKS_PORT_LOCAL, anyLocal, 1));
+	CHECK(GroupIs(&policy, 4, IPPROTO_UDP, WFPKS_PORT_LOCAL, udpLocal, 1));
+	CHECK_RESULT(5, policy.RangeCount);
+
+	PortPolicyFree(&policy);
+}
+
+static void InvalidRulesAreRejected()
+{
+	static const WFPKS_PORT_RULE icmp[] = { { IPPROTO_ICMP, WFPKS_PORT_REMOTE, 1, 0 } };
+	static const WFPKS_PORT_RULE direction[] = { { IPPROTO_TCP, WFPKS_PORT_LOCAL + 1, 1, 0 } };
+	static const WFPKS_PORT_RULE reversed[] = { { IPPROTO_TCP, WFPKS_PORT_REMOTE, 10, 5 } };
+	PortPolicy policy;
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, PortPolicyCompile(icmp, CELEMS(icmp), &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, PortPolicyCompile(direction, CELEMS(direction), &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, PortPolicyCompile(reversed, CELEMS(reversed), &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, PortPolicyCompile(NULL, 1, &policy));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, PortPolicyCompile(NULL, PORT_POLICY_MAX_RULES + 1, &policy));
+
+	// No rules lets no ports out
+	CHECK_RESULT(ERROR_SUCCESS, PortPolicyCompile(NULL, 0, &policy));
+	CHECK_RESULT(0, policy.GroupCount);
+	CHECK(!PortPolicyAllows(&policy, IPPROTO_UDP, 67, 67));
+	PortPolicyFree(&policy);
+}
+
+static void CompiledPolicyAllowsWhatTheRulesDo()
+{
+	WFPKS_PORT_RULE rules[TEST_RANDOM_RULES];
+	UINT64 state = 0x9E3779B97F4A7C15ULL;
+	UINT wrong = 0;
+
+	for (UINT round = 0; round < TEST_RANDOM_ROUNDS; round++)
+	{
+		UINT ruleCount = 1 + round * (TEST_RANDOM_RULES - 1) / (TEST_RANDOM_ROUNDS - 1);
+		PortPolicy policy;
+
+		for (UINT i = 0; i < ruleCount; i++)
+		{
+			UINT64 random = NextRandom(&state);
+			rules[i].protocol = RuleProtocols[random % CELEMS(RuleProtocols)];
+			rules[i].direction = (UINT8)((random >> 4) & 1);
+			rules[i].portLow = (UINT16)(1 + (random >> 8) % TEST_RANDOM_PORTS);
+			rules[i].portHigh = (random >> 32) & 1 ? (UINT16)(rules[i].portLow + (random >> 40) % TEST_RANDOM_SPAN) : 0;
+		}
+
+		CHECK_RESULT(ERROR_SUCCESS, PortPolicyCompile(rules, ruleCount, &policy));
+
+		for (UINT port = 1; port < TEST_RANDOM_PORTS + TEST_RANDOM_SPAN + 2; port++)
+		{
+			for (UINT p = 0; p < CELEMS(TestProtocols); p++)
+			{
+				// The other end's port is 0, which no rule covers
+				UINT8 protocol = TestProtocols[p];
+				if (PortPolicyAllows(&policy, protocol, (USHORT)port, 0) != RulesAllow(rules, ruleCount, protocol, WFPKS_PORT_REMOTE, (USHORT)port) ||
+					PortPolicyAllows(&policy, protocol, 0, (USHORT)port) != RulesAllow(rules, ruleCount, protocol, WFPKS_PORT_LOCAL, (USHORT)port))
+				{
+					wrong++;
+				}
+			}
+		}
+
+		// Groups stay sorted and disjoint, with nothing between touching ranges left unmerged
+		for (UINT g = 0; g < policy.GroupCount; g++)
+		{
+			const PortPolicyGroup* group = &policy.Groups[g];
+			for (UINT r = group->First + 1; r < group->First + group->Count; r++)
+			{
+				CHECK((UINT)policy.Ranges[r - 1].High + 1 < policy.Ranges[r].Low);
+			}
+		}
+
+		PortPolicyFree(&policy);
+	}
+
+	CHECK_RESULT(0, wrong);
+}
+
+const TestCase PortPolicyTests[] =
+{
+	{ "DefaultRulesLowerToOneUdpFilter", DefaultRulesLowerToOneUdpFilter },
+	{ "TouchingAndOverlappingRangesMerge", TouchingAndOverlappingRangesMerge },
+	{ "AnyProtocolCoversTcpAndUdp", AnyProtocolCoversTcpAndUdp },
+	{ "InvalidRulesAreRejected", InvalidRulesAreRejected },
+	{ "CompiledPolicyAllowsWhatTheRulesDo", CompiledPolicyAllowsWhatTheRulesDo },
+};
+
+const UINT PortPolicyTestsCount = CELEMS(PortPolicyTests);
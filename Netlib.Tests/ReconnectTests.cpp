@@ -0,0 +1,453 @@
+#include <windows.h>
+#include <Ras.h>
+#include <RasError.h>
+#include "Raslib.h"
+#include "RasSim.h"
+#include "Reconnect.h"
+#include "Tests.h"
+
+TEST_SUITE(ReconnectTests);
+
+#define TEST_DEVICE L"RaslibTests"
+#define PRIMARY_HOST L"primary.rassim"
+#define BACKUP_HOST L"backup.rassim"
+#define TEST_DIAL_MS 20
+#define TEST_MAX_CHANGES 64
+#define TEST_SEED 7
+// GetTickCount64 moves in steps of up to 16 ms
+#define TEST_TICK_SLACK_MS 20
+#define TEST_BASE_DELAY_MS 100
+#define TEST_MAX_DELAY_MS 400
+#define TEST_FAILURES 5
+#define TEST_COOLDOWN_MS 600
+// Long enough that a dial sooner than this was not the backoff's doing
+#define TEST_LONG_DELAY_MS 5000
+
+typedef struct _Change
+{
+	ReconnectState State;
+	ReconnectStatus Status;
+	ULONGLONG At;
+} Change;
+
+// The callback runs on executor workers, one at a time
+static Change Changes[TEST_MAX_CHANGES];
+static volatile LONG ChangeCount;
+static volatile LONG StateCounts[ReconnectGaveUp + 1];
+
+static void CALLBACK RecordChange(HRECONNECT reconnector, ReconnectState state, const ReconnectStatus* status, PVOID context)
+{
+	LONG change = ChangeCount;
+
+	if (change < TEST_MAX_CHANGES)
+	{
+		Changes[change].State = state;
+		Changes[change].Status = *status;
+		Changes[change].At = GetTickCount64();
+	}
+
+	InterlockedIncrement(&ChangeCount);
+	InterlockedIncrement(&StateCounts[state]);
+}
+
+static void UseSimulator()
+{
+	ChangeCount = 0;
+	ZeroMemory((PVOID)StateCounts, sizeof(StateCounts));
+
+	RasSimEnable(TRUE);
+	RasSimReset();
+	RasSimSetHost(PRIMARY_HOST, TEST_DIAL_MS, ERROR_SUCCESS);
+	RasSimSetHost(BACKUP_HOST, TEST_DIAL_MS, ERROR_SUCCESS);
+}
+
+static void StopSimulator()
+{
+	RasSimReset();
+	RasSimEnable(FALSE);
+}
+
+static void TestOptions(ReconnectOptions* options, LPCWSTR* hostnames, UINT hostnameCount)
+{
+	ZeroMemory(options, sizeof(*options));
+	options->DeviceName = TEST_DEVICE;
+	options->Hostnames = hostnames;
+	options->HostnameCount = hostnameCount;
+	options->Username = L"user";
+	options->Password = L"pass";
+	options->BaseDelayMs = TEST_BASE_DELAY_MS;
+	options->MaxDelayMs = TEST_MAX_DELAY_MS;
+	options->BreakerThreshold = 100;
+	options->Seed = TEST_SEED;
+}
+
+// Index of the nth change to state, counting from 1, or -1
+static int FindChange(ReconnectState state, UINT nth)
+{
+	for (LONG i = 0; i < ChangeCount && i < TEST_MAX_CHANGES; i++)
+	{
+		if (Changes[i].State == state && --nth == 0)
+		{
+			return (int)i;
+		}
+	}
+
+	return -1;
+}
+
+static UINT CountDials(int from, int to)
+{
+	UINT dials = 0;
+
+	for (int i = from; i < to; i++)
+	{
+		dials += Changes[i].State == ReconnectDialing ? 1 : 0;
+	}
+
+	return dials;
+}
+
+static void ReconnectsAfterDrop()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	UseSimulator();
+
+	// A drop redials at once, never after the backoff
+	TestOptions(&options, hostnames, CELEMS(hostnames));
+	options.BaseDelayMs = TEST_LONG_DELAY_MS;
+	options.MaxDelayMs = TEST_LONG_DELAY_MS;
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStart(&options, RecordChange, NULL, &reconnector));
+	if (reconnector == NULL)
+	{
+		StopSimulator();
+		return;
+	}
+
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 1, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(ReconnectConnected, status.State);
+	CHECK_RESULT(1, status.Dials);
+	CHECK_RESULT(0, status.Reconnects);
+
+	ULONGLONG droppedAt = GetTickCount64();
+	CHECK_RESULT(ERROR_SUCCESS, RasSimDropConnections(PRIMARY_HOST));
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 2, TEST_TIMEOUT_MS));
+	CHECK(GetTickCount64() - droppedAt < TEST_LONG_DELAY_MS / 2);
+
+	// Waiting while RAS lets the port go, then straight to dialing
+	int waiting = FindChange(ReconnectWaiting, 1);
+	int dialing = FindChange(ReconnectDialing, 2);
+	int connected = FindChange(ReconnectConnected, 2);
+	CHECK(waiting >= 0 && waiting < dialing && dialing < connected);
+	if (waiting >= 0)
+	{
+		CHECK_RESULT(ERROR_REMOTE_DISCONNECTION, Changes[waiting].Status.LastError);
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(ReconnectConnected, status.State);
+	CHECK_RESULT(2, status.Dials);
+	CHECK_RESULT(1, status.Reconnects);
+	CHECK_RESULT(0, status.Attempts);
+	CHECK(status.LastOutageMs < TEST_LONG_DELAY_MS / 2);
+	CHECK_RESULT(INFINITE, status.NextDialMs);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStop(reconnector));
+	CHECK_RESULT(ERROR_INVALID_HANDLE, ReconnectGetStatus(reconnector, &status));
+
+	StopSimulator();
+}
+
+static void BackoffDoublesUpToTheCap()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	UseSimulator();
+	RasSimFailHost(PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, TEST_FAILURES);
+
+	TestOptions(&options, hostnames, CELEMS(hostnames));
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStart(&options, RecordChange, NULL, &reconnector));
+	if (reconnector == NULL)
+	{
+		StopSimulator();
+		return;
+	}
+
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 1, TEST_TIMEOUT_MS));
+
+	// The n-th failure waits between half and all of min(MaxDelayMs, BaseDelayMs * 2^(n-1))
+	for (UINT n = 1; n <= TEST_FAILURES; n++)
+	{
+		int waiting = FindChange(ReconnectWaiting, n);
+		int next = FindChange(ReconnectDialing, n + 1);
+		DWORD cap = min((DWORD)TEST_BASE_DELAY_MS << (n - 1), (DWORD)TEST_MAX_DELAY_MS);
+
+		CHECK(waiting >= 0 && next > waiting);
+		if (waiting < 0 || next <= waiting)
+		{
+			break;
+		}
+
+		const ReconnectStatus* backoff = &Changes[waiting].Status;
+		CHECK_RESULT(n, backoff->Attempts);
+		CHECK_RESULT(ERROR_SERVER_NOT_RESPONDING, backoff->LastError);
+		CHECK(backoff->NextDialMs + TEST_TICK_SLACK_MS >= cap / 2);
+		CHECK(backoff->NextDialMs <= cap);
+		CHECK(Changes[next].At - Changes[waiting].At + TEST_TICK_SLACK_MS >= backoff->NextDialMs);
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(TEST_FAILURES + 1, status.Dials);
+	CHECK_RESULT(0, status.Attempts);
+	CHECK_RESULT(0, status.BreakerTrips);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStop(reconnector));
+
+	StopSimulator();
+}
+
+static void BreakerOpensAndHalfOpens()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	UseSimulator();
+	RasSimFailHost(PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, INFINITE);
+
+	TestOptions(&options, hostnames, CELEMS(hostnames));
+	options.BaseDelayMs = TEST_DIAL_MS;
+	options.MaxDelayMs = TEST_DIAL_MS;
+	options.BreakerThreshold = 2;
+	options.BreakerCooldownMs = TEST_COOLDOWN_MS;
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStart(&options, RecordChange, NULL, &reconnector));
+	if (reconnector == NULL)
+	{
+		StopSimulator();
+		return;
+	}
+
+	// Two failures open the breaker, then nothing is dialed until the cooldown is over
+	CHECK(TestWaitFor(&StateCounts[ReconnectDialing], 3, TEST_TIMEOUT_MS));
+	int opened = FindChange(ReconnectWaiting, 2);
+	int cooling = FindChange(ReconnectWaiting, 3);
+	int trial = FindChange(ReconnectDialing, 3);
+	CHECK(opened >= 0 && cooling > opened && trial > cooling);
+	if (opened < 0 || cooling <= opened || trial <= cooling)
+	{
+		ReconnectStop(reconnector);
+		StopSimulator();
+		return;
+	}
+
+	CHECK_RESULT(1, Changes[opened].Status.BreakerTrips);
+	CHECK_RESULT(1, Changes[opened].Status.OpenBreakers);
+	CHECK_RESULT(1, Changes[cooling].Status.OpenBreakers);
+	CHECK(Changes[cooling].Status.NextDialMs + TEST_DIAL_MS + TEST_TICK_SLACK_MS >= TEST_COOLDOWN_MS);
+	CHECK(Changes[trial].At - Changes[opened].At + TEST_TICK_SLACK_MS >= TEST_COOLDOWN_MS);
+
+	// Half open the one trial decides: it fails, so the breaker opens again on a single failure
+	CHECK(TestWaitFor(&StateCounts[ReconnectWaiting], 5, TEST_TIMEOUT_MS));
+	int reopened = FindChange(ReconnectWaiting, 5);
+	CHECK(reopened > trial);
+	if (reopened > trial)
+	{
+		CHECK_RESULT(2, Changes[reopened].Status.BreakerTrips);
+		CHECK_RESULT(1, Changes[reopened].Status.OpenBreakers);
+		CHECK_RESULT(1, CountDials(trial, reopened + 1));
+	}
+
+	// The next trial connects and closes the breaker
+	RasSimFailHost(PRIMARY_HOST, ERROR_SUCCESS, 0);
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 1, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(ReconnectConnected, status.State);
+	CHECK_RESULT(0, status.OpenBreakers);
+	CHECK_RESULT(4, status.Dials);
+	CHECK_RESULT(2, status.BreakerTrips);
+
+	// Closed means the failures are forgotten, one more after a drop is short of the threshold again
+	RasSimFailHost(PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, 1);
+	CHECK_RESULT(ERROR_SUCCESS, RasSimDropConnections(PRIMARY_HOST));
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 2, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(6, status.Dials);
+	CHECK_RESULT(2, status.BreakerTrips);
+	CHECK(status.LastOutageMs < TEST_COOLDOWN_MS);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStop(reconnector));
+
+	StopSimulator();
+}
+
+static void OpenBreakerMovesToTheNextServer()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST, BACKUP_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	UseSimulator();
+	RasSimFailHost(PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, INFINITE);
+
+	TestOptions(&options, hostnames, CELEMS(hostnames));
+	options.BaseDelayMs = TEST_DIAL_MS;
+	options.MaxDelayMs = TEST_DIAL_MS;
+	options.BreakerThreshold = 2;
+	options.BreakerCooldownMs = TEST_LONG_DELAY_MS;
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStart(&options, RecordChange, NULL, &reconnector));
+	if (reconnector == NULL)
+	{
+		StopSimulator();
+		return;
+	}
+
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 1, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(1, status.Server);
+	CHECK_RESULT(3, status.Dials);
+	CHECK_RESULT(1, status.BreakerTrips);
+	CHECK_RESULT(1, status.OpenBreakers);
+
+	// The reconnector stays with the server that works
+	CHECK_RESULT(ERROR_SUCCESS, RasSimDropConnections(NULL));
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 2, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(1, status.Server);
+	CHECK_RESULT(4, status.Dials);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStop(reconnector));
+
+	StopSimulator();
+}
+
+static void NetworkChangeSkipsTheBackoff()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	UseSimulator();
+	RasSimFailHost(PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, 1);
+
+	// One failure opens the breaker and the backoff is long, only the network change can bring it back soon
+	TestOptions(&options, hostnames, CELEMS(hostnames));
+	options.BaseDelayMs = TEST_LONG_DELAY_MS;
+	options.MaxDelayMs = TEST_LONG_DELAY_MS;
+	options.BreakerThreshold = 1;
+	options.BreakerCooldownMs = TEST_LONG_DELAY_MS * 4;
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStart(&options, RecordChange, NULL, &reconnector));
+	if (reconnector == NULL)
+	{
+		StopSimulator();
+		return;
+	}
+
+	CHECK(TestWaitFor(&StateCounts[ReconnectWaiting], 1, TEST_TIMEOUT_MS));
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(ReconnectWaiting, status.State);
+	CHECK_RESULT(1, status.OpenBreakers);
+	CHECK(status.NextDialMs + TEST_TICK_SLACK_MS >= TEST_LONG_DELAY_MS / 2);
+
+	ULONGLONG notifiedAt = GetTickCount64();
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectNotifyNetworkChange());
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 1, TEST_TIMEOUT_MS));
+	CHECK(GetTickCount64() - notifiedAt < TEST_LONG_DELAY_MS / 2);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(2, status.Dials);
+	CHECK_RESULT(0, status.OpenBreakers);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStop(reconnector));
+
+	StopSimulator();
+}
+
+static void GaveUpWaitsForANetworkChange()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	UseSimulator();
+	RasSimFailHost(PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, 2);
+
+	TestOptions(&options, hostnames, CELEMS(hostnames));
+	options.BaseDelayMs = TEST_DIAL_MS;
+	options.MaxDelayMs = TEST_DIAL_MS;
+	options.MaxAttempts = 2;
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStart(&options, RecordChange, NULL, &reconnector));
+	if (reconnector == NULL)
+	{
+		StopSimulator();
+		return;
+	}
+
+	CHECK(TestWaitFor(&StateCounts[ReconnectGaveUp], 1, TEST_TIMEOUT_MS));
+	Sleep(TEST_BASE_DELAY_MS);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectGetStatus(reconnector, &status));
+	CHECK_RESULT(ReconnectGaveUp, status.State);
+	CHECK_RESULT(2, status.Dials);
+	CHECK_RESULT(INFINITE, status.NextDialMs);
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectNotifyNetworkChange());
+	CHECK(TestWaitFor(&StateCounts[ReconnectConnected], 1, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(ERROR_SUCCESS, ReconnectStop(reconnector));
+
+	StopSimulator();
+}
+
+static void BadArgumentsAreRejected()
+{
+	LPCWSTR hostnames[] = { PRIMARY_HOST, NULL };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	HRECONNECT reconnector = NULL;
+
+	TestOptions(&options, hostnames, 1);
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectStart(NULL, NULL, NULL, &reconnector));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectStart(&options, NULL, NULL, NULL));
+	options.HostnameCount = 2;
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectStart(&options, NULL, NULL, &reconnector));
+	options.HostnameCount = 0;
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectStart(&options, NULL, NULL, &reconnector));
+	options.HostnameCount = RECONNECT_MAX_SERVERS + 1;
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectStart(&options, NULL, NULL, &reconnector));
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectGetStatus(NULL, &status));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ReconnectStop(NULL));
+}
+
+const TestCase ReconnectTests[] =
+{
+	{ "ReconnectsAfterDrop", ReconnectsAfterDrop },
+	{ "BackoffDoublesUpToTheCap", BackoffDoublesUpToTheCap },
+	{ "BreakerOpensAndHalfOpens", BreakerOpensAndHalfOpens },
+	{ "OpenBreakerMovesToTheNextServer", OpenBreakerMovesToTheNextServer },
+	{ "NetworkChangeSkipsTheBackoff", NetworkChangeSkipsTheBackoff },
+	{ "GaveUpWaitsForANetworkChange", GaveUpWaitsForANetworkChange },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT ReconnectTestsCount = CELEMS(ReconnectTests);
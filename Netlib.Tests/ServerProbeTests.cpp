@@ -0,0 +1,400 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <strsafe.h>
+#include "ServerProbe.h"
+#include "Tests.h"
+
+TEST_SUITE(ServerProbeTests);
+
+#define TEST_IKE_HEADER_LENGTH 28
+#define TEST_PACKET_LENGTH 2048
+#define TEST_ATTEMPTS 3
+#define TEST_INTERVAL_MS 50
+#define TEST_PROBE_TIMEOUT_MS 500
+#define TEST_SLOW_MS 40
+#define TEST_ALL_ATTEMPTS 0xFFFF
+#define TEST_MAX_RESPONDERS 4
+
+// A loopback IKE responder, it echoes each IKE_SA_INIT back, which quotes the SPI as a real answer would
+typedef struct _Responder
+{
+	SOCKET Socket;
+	HANDLE Thread;
+	USHORT Port;
+	// Replies to the attempts in DelayMask wait DelayMs, those in DropMask are never sent
+	DWORD DelayMs;
+	UINT DelayMask;
+	UINT DropMask;
+	volatile LONG Probes;
+} Responder;
+
+// The responder threads can outlive a failed test's stack, so the responders live here
+static Responder Responders[TEST_MAX_RESPONDERS];
+
+// Answers until a datagram too short to be a probe arrives
+static DWORD WINAPI ResponderFunc(LPVOID parameter)
+{
+	Responder* responder = (Responder*)parameter;
+	BYTE packet[TEST_PACKET_LENGTH];
+
+	for (;;)
+	{
+		SOCKADDR_IN from;
+		int fromLength = sizeof(from);
+
+		int length = recvfrom(responder->Socket, (char*)packet, sizeof(packet), 0, (SOCKADDR*)&from, &fromLength);
+		if (length < TEST_IKE_HEADER_LENGTH)
+		{
+			break;
+		}
+
+		InterlockedIncrement(&responder->Probes);
+
+		// The low byte of the initiator SPI is which attempt the probe is
+		UINT attempt = packet[7];
+		if (attempt < 16 && (responder->DropMask & (1 << attempt)) != 0)
+		{
+			continue;
+		}
+
+		if (attempt < 16 && (responder->DelayMask & (1 << attempt)) != 0)
+		{
+			Sleep(responder->DelayMs);
+		}
+
+		sendto(responder->Socket, (const char*)packet, length, 0, (const SOCKADDR*)&from, fromLength);
+	}
+
+	return 0;
+}
+
+static void StopResponders()
+{
+	for (UINT i = 0; i < TEST_MAX_RESPONDERS; i++)
+	{
+		Responder* responder = &Responders[i];
+
+		if (responder->Thread != NULL)
+		{
+			SOCKADDR_IN address;
+			BYTE stop = 0;
+
+			ZeroMemory(&address, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			address.sin_port = htons(responder->Port);
+
+			sendto(responder->Socket, (const char*)&stop, sizeof(stop), 0, (const SOCKADDR*)&address, sizeof(address));
+			WaitForSingleObject(responder->Thread, TEST_TIMEOUT_MS);
+			CloseHandle(responder->Thread);
+		}
+
+		if (responder->Port != 0)
+		{
+			closesocket(responder->Socket);
+		}
+
+		ZeroMemory(responder, sizeof(*responder));
+	}
+
+	WSACleanup();
+}
+
+// Binds a loopback socket of type on a free port, SOCK_STREAM ones listen when listening is set
+static SOCKET OpenLoopback(int type, BOOL listening, USHORT* port)
+{
+	SOCKADDR_IN address;
+	int addressLength = sizeof(address);
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	SOCKET s = socket(AF_INET, type, type == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP);
+	if (s == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	if (bind(s, (const SOCKADDR*)&address, sizeof(address)) != 0
+		|| getsockname(s, (SOCKADDR*)&address, &addressLength) != 0
+		|| (listening && listen(s, SOMAXCONN) != 0))
+	{
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	*port = ntohs(address.sin_port);
+
+	return s;
+}
+
+static BOOL StartWinsock()
+{
+	WSADATA wsaData;
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	CHECK_RESULT(ERROR_SUCCESS, result);
+
+	return result == ERROR_SUCCESS;
+}
+
+static BOOL StartResponder(UINT index, DWORD delayMs, UINT delayMask, UINT dropMask)
+{
+	Responder* responder = &Responders[index];
+
+	responder->DelayMs = delayMs;
+	responder->DelayMask = delayMask;
+	responder->DropMask = dropMask;
+	responder->Probes = 0;
+	responder->Socket = OpenLoopback(SOCK_DGRAM, FALSE, &responder->Port);
+	if (responder->Socket != INVALID_SOCKET)
+	{
+		responder->Thread = CreateThread(NULL, 0, ResponderFunc, responder, 0, NULL);
+	}
+
+	CHECK(responder->Thread != NULL);
+
+	return responder->Thread != NULL;
+}
+
+static void SetTarget(ServerProbeTarget* target, USHORT port, ServerProbeProtocol protocol)
+{
+	target->Address = L"127.0.0.1";
+	target->Port = port;
+	target->Protocol = protocol;
+}
+
+static void ProbeOptions(ServerProbeOptions* options)
+{
+	ZeroMemory(options, sizeof(*options));
+	options->Attempts = TEST_ATTEMPTS;
+	options->IntervalMs = TEST_INTERVAL_MS;
+	options->TimeoutMs = TEST_PROBE_TIMEOUT_MS;
+	options->DeadlineMs = TEST_TIMEOUT_MS;
+}
+
+static void EveryProbeIsAnswered()
+{
+	ServerProbeTarget target;
+	ServerProbeOptions options;
+	ServerProbeResult result;
+	UINT ranking = MAXUINT;
+
+	if (!StartWinsock())
+	{
+		return;
+	}
+
+	if (!StartResponder(0, 0, 0, 0))
+	{
+		StopResponders();
+		return;
+	}
+
+	SetTarget(&target, Responders[0].Port, ServerProbeIke);
+	ProbeOptions(&options);
+
+	CHECK_RESULT(ERROR_SUCCESS, ServerProbeRun(&target, 1, &options, &result, &ranking));
+	CHECK_RESULT(TEST_ATTEMPTS, result.Sent);
+	CHECK_RESULT(TEST_ATTEMPTS, result.Received);
+	CHECK_RESULT(TEST_ATTEMPTS, Responders[0].Probes);
+	CHECK_RESULT(ERROR_SUCCESS, result.Error);
+	CHECK(result.RttMinUs <= result.RttAvgUs);
+	CHECK_RESULT(0, ranking);
+
+	StopResponders();
+}
+
+static void RankingPutsLossBeforeRttAndSilentLast()
+{
+	ServerProbeTarget targets[TEST_MAX_RESPONDERS];
+	ServerProbeOptions options;
+	ServerProbeResult results[TEST_MAX_RESPONDERS];
+	UINT ranking[TEST_MAX_RESPONDERS];
+
+	if (!StartWinsock())
+	{
+		return;
+	}
+
+	// Silent, slow, lossy and clean, so the ranking is the reverse of the order they're given in
+	if (!StartResponder(0, 0, 0, TEST_ALL_ATTEMPTS) || !StartResponder(1, TEST_SLOW_MS, TEST_ALL_ATTEMPTS, 0)
+		|| !StartResponder(2, 0, 0, 1 << 1) || !StartResponder(3, 0, 0, 0))
+	{
+		StopResponders();
+		return;
+	}
+
+	for (UINT i = 0; i < TEST_MAX_RESPONDERS; i++)
+	{
+		SetTarget(&targets[i], Responders[i].Port, ServerProbeIke);
+	}
+	ProbeOptions(&options);
+
+	CHECK_RESULT(ERROR_SUCCESS, ServerProbeRun(targets, TEST_MAX_RESPONDERS, &options, results, ranking));
+
+	for (UINT i = 0; i < TEST_MAX_RESPONDERS; i++)
+	{
+		CHECK_RESULT(TEST_ATTEMPTS, results[i].Sent);
+		CHECK_RESULT(TEST_ATTEMPTS, Responders[i].Probes);
+	}
+
+	CHECK_RESULT(0, results[0].Received);
+	CHECK_RESULT(TEST_ATTEMPTS, results[1].Received);
+	CHECK_RESULT(TEST_ATTEMPTS - 1, results[2].Received);
+	CHECK_RESULT(TEST_ATTEMPTS, results[3].Received);
+	CHECK(results[1].RttMinUs >= TEST_SLOW_MS * 1000);
+	CHECK(results[3].RttAvgUs < results[1].RttAvgUs);
+
+	CHECK_RESULT(3, ranking[0]);
+	CHECK_RESULT(1, ranking[1]);
+	CHECK_RESULT(2, ranking[2]);
+	CHECK_RESULT(0, ranking[3]);
+
+	StopResponders();
+}
+
+static void LateRepliesCountAsLost()
+{
+	ServerProbeTarget target;
+	ServerProbeOptions options;
+	ServerProbeResult result;
+	UINT ranking;
+
+	if (!StartWinsock())
+	{
+		return;
+	}
+
+	if (!StartResponder(0, 300, 1 << 0, 0))
+	{
+		StopResponders();
+		return;
+	}
+
+	// The first reply comes back after its timeout, the other two well inside theirs
+	SetTarget(&target, Responders[0].Port, ServerProbeIke);
+	ProbeOptions(&options);
+	options.IntervalMs = 400;
+	options.TimeoutMs = 200;
+
+	CHECK_RESULT(ERROR_SUCCESS, ServerProbeRun(&target, 1, &options, &result, &ranking));
+	CHECK_RESULT(TEST_ATTEMPTS, result.Sent);
+	CHECK_RESULT(TEST_ATTEMPTS - 1, result.Received);
+	CHECK(result.RttAvgUs < options.TimeoutMs * 1000);
+
+	StopResponders();
+}
+
+static void DeadlineEndsTheRun()
+{
+	ServerProbeTarget target;
+	ServerProbeOptions options;
+	ServerProbeResult result;
+	UINT ranking;
+
+	if (!StartWinsock())
+	{
+		return;
+	}
+
+	if (!StartResponder(0, 0, 0, TEST_ALL_ATTEMPTS))
+	{
+		StopResponders();
+		return;
+	}
+
+	// Ten probes would take a second, the deadline leaves time for three
+	SetTarget(&target, Responders[0].Port, ServerProbeIke);
+	ZeroMemory(&options, sizeof(options));
+	options.Attempts = 10;
+	options.IntervalMs = 100;
+	options.TimeoutMs = 1000;
+	options.DeadlineMs = 250;
+
+	ULONGLONG started = GetTickCount64();
+	CHECK_RESULT(ERROR_SUCCESS, ServerProbeRun(&target, 1, &options, &result, &ranking));
+	ULONGLONG elapsed = GetTickCount64() - started;
+
+	CHECK_RESULT(3, result.Sent);
+	CHECK_RESULT(0, result.Received);
+	// Tick counts move in steps of up to 16 ms
+	CHECK(elapsed + 16 >= options.DeadlineMs);
+	CHECK(elapsed < options.DeadlineMs + 500);
+
+	StopResponders();
+}
+
+static void TcpConnectsAreProbes()
+{
+	ServerProbeTarget targets[2];
+	ServerProbeOptions options;
+	ServerProbeResult results[2];
+	UINT ranking[2];
+	USHORT listeningPort = 0;
+	USHORT closedPort = 0;
+
+	if (!StartWinsock())
+	{
+		return;
+	}
+
+	// Connects complete in the listen backlog without anything accepting them, the other port refuses them
+	SOCKET listening = OpenLoopback(SOCK_STREAM, TRUE, &listeningPort);
+	SOCKET closed = OpenLoopback(SOCK_STREAM, FALSE, &closedPort);
+	CHECK(listening != INVALID_SOCKET && closed != INVALID_SOCKET);
+
+	if (listening != INVALID_SOCKET && closed != INVALID_SOCKET)
+	{
+		SetTarget(&targets[0], closedPort, ServerProbeTcp);
+		SetTarget(&targets[1], listeningPort, ServerProbeTcp);
+		ProbeOptions(&options);
+		options.TimeoutMs = 200;
+
+		CHECK_RESULT(ERROR_SUCCESS, ServerProbeRun(targets, CELEMS(targets), &options, results, ranking));
+		CHECK_RESULT(TEST_ATTEMPTS, results[1].Sent);
+		CHECK_RESULT(TEST_ATTEMPTS, results[1].Received);
+		CHECK_RESULT(0, results[0].Received);
+		CHECK_RESULT(1, ranking[0]);
+		CHECK_RESULT(0, ranking[1]);
+	}
+
+	if (listening != INVALID_SOCKET)
+	{
+		closesocket(listening);
+	}
+	if (closed != INVALID_SOCKET)
+	{
+		closesocket(closed);
+	}
+
+	WSACleanup();
+}
+
+static void BadArgumentsAreRejected()
+{
+	ServerProbeTarget target;
+	ServerProbeResult result;
+	UINT ranking;
+
+	SetTarget(&target, 500, ServerProbeIke);
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ServerProbeRun(NULL, 1, NULL, &result, &ranking));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ServerProbeRun(&target, 0, NULL, &result, &ranking));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ServerProbeRun(&target, SERVER_PROBE_MAX_TARGETS + 1, NULL, &result, &ranking));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ServerProbeRun(&target, 1, NULL, NULL, &ranking));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, ServerProbeRun(&target, 1, NULL, &result, NULL));
+}
+
+const TestCase ServerProbeTests[] =
+{
+	{ "EveryProbeIsAnswered", EveryProbeIsAnswered },
+	{ "RankingPutsLossBeforeRttAndSilentLast", RankingPutsLossBeforeRttAndSilentLast },
+	{ "LateRepliesCountAsLost", LateRepliesCountAsLost },
+	{ "DeadlineEndsTheRun", DeadlineEndsTheRun },
+	{ "TcpConnectsAreProbes", TcpConnectsAreProbes },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT ServerProbeTestsCount = CELEMS(ServerProbeTests);
@@ -0,0 +1,310 @@
+#include <windows.h>
+#include <strsafe.h>
+#include "Raslib.h"
+#include "StatusPage.h"
+#include "Tests.h"
+
+TEST_SUITE(StatusPageTests);
+
+#define TEST_READERS 4
+#define TEST_PUBLISH_MS 500
+
+typedef struct _Publisher
+{
+	HSTATUSPAGE Page;
+	volatile LONG Stop;
+	LONG Published;
+} Publisher;
+
+typedef struct _Reader
+{
+	HSTATUSPAGE Page;
+	volatile LONG* Stop;
+	ULONGLONG Reads;
+	ULONGLONG TornReads;
+	ULONGLONG Backwards;
+	DWORD Error;
+} Reader;
+
+// Every page gets its own name so a test never sees what an earlier one left behind
+static void PageName(LPCWSTR test, LPWSTR name, DWORD nameLength)
+{
+	StringCchPrintfW(name, nameLength, L"Local\\UtilizrStatusTests-%lu-%s", GetCurrentProcessId(), test);
+}
+
+// Every field the publisher writes comes from one counter, so a snapshot mixing two updates can't match
+static void DerivedStats(INT64 generation, VpnDeviceStats* stats, LPWSTR hostname, DWORD hostnameLength)
+{
+	StringCchPrintfW(hostname, hostnameLength, L"host-%lld.test", generation);
+
+	stats->Status = (INT)(generation & 1);
+	stats->BytesTransmitted = generation;
+	stats->BytesReceived = generation * 3;
+	stats->Bps = generation ^ 0x5A5A5A5A;
+	stats->ConnectDuration = generation + 7;
+	stats->Hostname = hostname;
+}
+
+static BOOL Consistent(const StatusPageData* data)
+{
+	WCHAR hostname[STATUS_PAGE_HOSTNAME_LENGTH];
+	VpnDeviceStats expected;
+
+	DerivedStats(data->BytesTransmitted, &expected, hostname, CELEMS(hostname));
+
+	return data->ConnectionStatus == expected.Status
+		&& data->BytesReceived == expected.BytesReceived
+		&& data->Bps == expected.Bps
+		&& data->ConnectDuration == expected.ConnectDuration
+		&& wcscmp(data->Hostname, hostname) == 0;
+}
+
+static DWORD WINAPI PublishThread(LPVOID parameter)
+{
+	Publisher* publisher = (Publisher*)parameter;
+	WCHAR hostname[STATUS_PAGE_HOSTNAME_LENGTH];
+	VpnDeviceStats stats;
+
+	while (!publisher->Stop)
+	{
+		DerivedStats(publisher->Published + 1, &stats, hostname, CELEMS(hostname));
+		if (StatusPageSetConnection(publisher->Page, &stats) != ERROR_SUCCESS)
+		{
+			break;
+		}
+		publisher->Published++;
+	}
+
+	return 0;
+}
+
+static DWORD WINAPI ReadThread(LPVOID parameter)
+{
+	Reader* reader = (Reader*)parameter;
+	StatusPageData data;
+	DWORD last = 0;
+
+	while (!*reader->Stop)
+	{
+		DWORD sequence = 0;
+
+		reader->Error = StatusPageRead(reader->Page, &data, &sequence);
+		if (reader->Error != ERROR_SUCCESS)
+		{
+			break;
+		}
+
+		reader->Reads++;
+		if (sequence > 0 && !Consistent(&data))
+		{
+			reader->TornReads++;
+		}
+		if (sequence < last)
+		{
+			reader->Backwards++;
+		}
+		last = sequence;
+	}
+
+	return 0;
+}
+
+static void OpenBeforeCreateNotFound()
+{
+	WCHAR name[MAX_PATH];
+	HSTATUSPAGE page = NULL;
+
+	PageName(L"NotCreated", name, CELEMS(name));
+
+	CHECK_RESULT(ERROR_FILE_NOT_FOUND, StatusPageOpen(name, &page));
+	CHECK(page == NULL);
+}
+
+static void ReaderSeesPublishedState()
+{
+	WCHAR name[MAX_PATH];
+	WCHAR hostname[STATUS_PAGE_HOSTNAME_LENGTH];
+	HSTATUSPAGE writer = NULL;
+	HSTATUSPAGE reader = NULL;
+	StatusPageData data;
+	VpnDeviceStats stats;
+	DWORD sequence = 0;
+
+	PageName(L"Published", name, CELEMS(name));
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageCreate(name, &writer));
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageOpen(name, &reader));
+	if (writer == NULL || reader == NULL)
+	{
+		goto Cleanup;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageRead(reader, &data, &sequence));
+	CHECK_RESULT(0, sequence);
+	CHECK_RESULT(0, data.KillswitchEngaged);
+
+	DerivedStats(42, &stats, hostname, CELEMS(hostname));
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageSetKillswitch(writer, TRUE));
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageSetConnection(writer, &stats));
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageRead(reader, &data, &sequence));
+	CHECK_RESULT(2, sequence);
+	CHECK_RESULT(1, data.KillswitchEngaged);
+	CHECK_RESULT(1, data.PolicyGeneration);
+	CHECK(data.BytesTransmitted == 42);
+	CHECK(Consistent(&data));
+	CHECK(data.KillswitchChangedAt != 0);
+	CHECK(data.UpdatedAt >= data.KillswitchChangedAt);
+
+Cleanup:
+	if (reader != NULL)
+	{
+		StatusPageClose(reader);
+	}
+	if (writer != NULL)
+	{
+		StatusPageClose(writer);
+	}
+}
+
+static void ReaderCannotPublish()
+{
+	WCHAR name[MAX_PATH];
+	HSTATUSPAGE writer = NULL;
+	HSTATUSPAGE reader = NULL;
+
+	PageName(L"ReadOnly", name, CELEMS(name));
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageCreate(name, &writer));
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageOpen(name, &reader));
+	if (writer == NULL || reader == NULL)
+	{
+		goto Cleanup;
+	}
+
+	CHECK_RESULT(ERROR_ACCESS_DENIED, StatusPageSetKillswitch(reader, TRUE));
+
+Cleanup:
+	if (reader != NULL)
+	{
+		StatusPageClose(reader);
+	}
+	if (writer != NULL)
+	{
+		StatusPageClose(writer);
+	}
+}
+
+static void SecondWriterIsBusy()
+{
+	WCHAR name[MAX_PATH];
+	HSTATUSPAGE first = NULL;
+	HSTATUSPAGE second = NULL;
+
+	PageName(L"SecondWriter", name, CELEMS(name));
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageCreate(name, &first));
+	CHECK_RESULT(ERROR_BUSY, StatusPageCreate(name, &second));
+	CHECK(second == NULL);
+
+	// Closing the writer frees the slot for the next one, the section lives on while a handle is open
+	if (first != NULL)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, StatusPageOpen(name, &second));
+		StatusPageClose(first);
+		first = NULL;
+		StatusPageClose(second);
+		second = NULL;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageCreate(name, &first));
+
+	if (first != NULL)
+	{
+		StatusPageClose(first);
+	}
+}
+
+static void ReadersNeverSeeTornSnapshots()
+{
+	WCHAR name[MAX_PATH];
+	Publisher publisher = { NULL, FALSE, 0 };
+	Reader readers[TEST_READERS] = {};
+	HANDLE threads[TEST_READERS + 1] = {};
+	UINT started = 0;
+
+	PageName(L"Torn", name, CELEMS(name));
+
+	CHECK_RESULT(ERROR_SUCCESS, StatusPageCreate(name, &publisher.Page));
+	if (publisher.Page == NULL)
+	{
+		return;
+	}
+
+	// Each reader maps its own view, as separate processes would
+	for (UINT i = 0; i < TEST_READERS; i++)
+	{
+		readers[i].Stop = &publisher.Stop;
+		CHECK_RESULT(ERROR_SUCCESS, StatusPageOpen(name, &readers[i].Page));
+		if (readers[i].Page == NULL)
+		{
+			goto Cleanup;
+		}
+	}
+
+	for (UINT i = 0; i < TEST_READERS; i++)
+	{
+		threads[started] = CreateThread(NULL, 0, ReadThread, &readers[i], 0, NULL);
+		if (threads[started] == NULL)
+		{
+			break;
+		}
+		started++;
+	}
+	threads[started] = CreateThread(NULL, 0, PublishThread, &publisher, 0, NULL);
+	if (threads[started] != NULL)
+	{
+		started++;
+	}
+
+	Sleep(TEST_PUBLISH_MS);
+	InterlockedExchange(&publisher.Stop, TRUE);
+
+	for (UINT i = 0; i < started; i++)
+	{
+		CHECK_RESULT(WAIT_OBJECT_0, WaitForSingleObject(threads[i], TEST_TIMEOUT_MS));
+		CloseHandle(threads[i]);
+	}
+
+	CHECK_RESULT(TEST_READERS + 1, started);
+	CHECK(publisher.Published > 0);
+
+	for (UINT i = 0; i < TEST_READERS; i++)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, readers[i].Error);
+		CHECK(readers[i].Reads > 0);
+		CHECK(readers[i].TornReads == 0);
+		CHECK(readers[i].Backwards == 0);
+	}
+
+Cleanup:
+	for (UINT i = 0; i < TEST_READERS; i++)
+	{
+		if (readers[i].Page != NULL)
+		{
+			StatusPageClose(readers[i].Page);
+		}
+	}
+	StatusPageClose(publisher.Page);
+}
+
+const TestCase StatusPageTests[] =
+{
+	{ "OpenBeforeCreateNotFound", OpenBeforeCreateNotFound },
+	{ "ReaderSeesPublishedState", ReaderSeesPublishedState },
+	{ "ReaderCannotPublish", ReaderCannotPublish },
+	{ "SecondWriterIsBusy", SecondWriterIsBusy },
+	{ "ReadersNeverSeeTornSnapshots", ReadersNeverSeeTornSnapshots },
+};
+
+const UINT StatusPageTestsCount = CELEMS(StatusPageTests);
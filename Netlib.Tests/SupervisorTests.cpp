@@ -0,0 +1,431 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strsafe.h>
+#include "Supervisor.h"
+#include "Tests.h"
+
+TEST_SUITE(SupervisorTests);
+
+#define TEST_MAX_EVENTS 32
+// GetTickCount64 moves in steps of up to this much
+#define TEST_TICK_MS 16
+#define TEST_READY_TIMEOUT_MS 300
+#define TEST_STOP_TIMEOUT_MS 300
+#define TEST_RESTART_DELAY_MS 50
+#define TEST_MAX_RESTART_DELAY_MS 120
+#define TEST_FLAP_RESTART_DELAY_MS 20
+#define TEST_FLAP_UP_MS L"300"
+#define TEST_FLAP_STABLE_MS 150
+#define TEST_FLAP_UNSTABLE_MS 5000
+
+static SupervisorEvent Events[TEST_MAX_EVENTS];
+static ULONGLONG EventTicks[TEST_MAX_EVENTS];
+static volatile LONG EventCount;
+static volatile LONG TypeCounts[SupervisorEventTypeCount];
+
+// Runs on the supervisor thread, an event is filled in before the counts take it in
+static void CALLBACK RecordEvent(HSUPERVISOR supervisor, const SupervisorEvent* event, PVOID context)
+{
+	LONG index = EventCount;
+
+	if (index >= TEST_MAX_EVENTS || event->Type >= SupervisorEventTypeCount)
+	{
+		return;
+	}
+
+	Events[index] = *event;
+	EventTicks[index] = GetTickCount64();
+	InterlockedIncrement(&TypeCounts[event->Type]);
+	InterlockedIncrement(&EventCount);
+}
+
+// The test binary stands in for OpenVPN, started with TEST_CHILD_ARGUMENT and a mode ahead of the options the
+// supervisor adds
+static void ChildOptions(LPCWSTR arguments, SupervisorRestart restart, SupervisorOptions* options, LPWSTR imagePath, DWORD imagePathLength)
+{
+	GetModuleFileNameW(NULL, imagePath, imagePathLength);
+
+	ZeroMemory(options, sizeof(*options));
+	options->ImagePath = imagePath;
+	options->Arguments = arguments;
+	options->Restart = restart;
+	options->ReadyTimeoutMs = TEST_TIMEOUT_MS;
+	options->StopTimeoutMs = TEST_TIMEOUT_MS;
+}
+
+static HSUPERVISOR StartSupervisor(const SupervisorOptions* options)
+{
+	HSUPERVISOR supervisor = NULL;
+
+	ZeroMemory(Events, sizeof(Events));
+	ZeroMemory(EventTicks, sizeof(EventTicks));
+	ZeroMemory((PVOID)TypeCounts, sizeof(TypeCounts));
+	EventCount = 0;
+
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStart(options, RecordEvent, NULL, &supervisor));
+
+	return supervisor;
+}
+
+static BOOL CheckEvent(LONG index, SupervisorEventType type, UINT attempt)
+{
+	BOOL matches = index < EventCount && Events[index].Type == type && Events[index].Attempt == attempt;
+
+	CHECK(index < EventCount);
+	CHECK_RESULT(type, Events[index].Type);
+	CHECK_RESULT(attempt, Events[index].Attempt);
+
+	return matches;
+}
+
+static void ReadyChildStopsWhenAsked()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" ready", SupervisorRestartAlways, &options, imagePath, CELEMS(imagePath));
+
+	HSUPERVISOR supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	CHECK(TestWaitFor(&TypeCounts[SupervisorReady], 1, TEST_TIMEOUT_MS));
+
+	// Asked over the management channel, it exits well inside the stop timeout
+	ULONGLONG stopping = GetTickCount64();
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+	CHECK(GetTickCount64() - stopping < TEST_TIMEOUT_MS / 2);
+
+	CHECK_RESULT(4, EventCount);
+	CheckEvent(0, SupervisorStarted, 1);
+	CheckEvent(1, SupervisorReady, 1);
+	CheckEvent(2, SupervisorExited, 1);
+	CheckEvent(3, SupervisorStopped, 1);
+
+	CHECK(Events[0].ProcessId != 0);
+	CHECK(Events[1].ProcessId == Events[0].ProcessId);
+	CHECK(Events[1].ElapsedUs > 0);
+	CHECK_RESULT(0, Events[2].ExitCode);
+	CHECK_RESULT(ERROR_SUCCESS, Events[3].Result);
+}
+
+static void ReadyTimeoutKillsTheChild()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" hang", SupervisorRestartNever, &options, imagePath, CELEMS(imagePath));
+	options.ReadyTimeoutMs = TEST_READY_TIMEOUT_MS;
+
+	HSUPERVISOR supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	CHECK(TestWaitFor(&TypeCounts[SupervisorStopped], 1, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(3, EventCount);
+	CheckEvent(0, SupervisorStarted, 1);
+	CheckEvent(1, SupervisorExited, 1);
+	CheckEvent(2, SupervisorStopped, 1);
+
+	CHECK_RESULT(ERROR_TIMEOUT, Events[1].ExitCode);
+	CHECK(Events[1].ElapsedUs >= TEST_READY_TIMEOUT_MS * 1000ULL);
+	CHECK_RESULT(ERROR_PROCESS_ABORTED, Events[2].Result);
+
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+	CHECK_RESULT(3, EventCount);
+}
+
+static void FailuresBackOffUntilTheLimit()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+	const DWORD delays[] = { TEST_RESTART_DELAY_MS, TEST_RESTART_DELAY_MS * 2, TEST_MAX_RESTART_DELAY_MS };
+
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" exit 3", SupervisorRestartOnFailure, &options, imagePath, CELEMS(imagePath));
+	options.MaxRestarts = CELEMS(delays);
+	options.RestartDelayMs = TEST_RESTART_DELAY_MS;
+	options.MaxRestartDelayMs = TEST_MAX_RESTART_DELAY_MS;
+
+	HSUPERVISOR supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	CHECK(TestWaitFor(&TypeCounts[SupervisorStopped], 1, TEST_TIMEOUT_MS));
+
+	// Started, Exited and Restarting for each restart, then the last process and the give up
+	CHECK_RESULT(CELEMS(delays) * 3 + 3, EventCount);
+
+	for (UINT i = 0; i < CELEMS(delays); i++)
+	{
+		LONG first = (LONG)i * 3;
+
+		CheckEvent(first, SupervisorStarted, i + 1);
+		CheckEvent(first + 1, SupervisorExited, i + 1);
+		CheckEvent(first + 2, SupervisorRestarting, i + 1);
+		CheckEvent(first + 3, SupervisorStarted, i + 2);
+
+		CHECK_RESULT(3, Events[first + 1].ExitCode);
+		CHECK_RESULT(delays[i], Events[first + 2].DelayMs);
+		CHECK(EventTicks[first + 3] - EventTicks[first + 2] + TEST_TICK_MS >= delays[i]);
+	}
+
+	LONG last = CELEMS(delays) * 3;
+	CheckEvent(last + 1, SupervisorExited, CELEMS(delays) + 1);
+	CheckEvent(last + 2, SupervisorStopped, CELEMS(delays) + 1);
+	CHECK_RESULT(ERROR_PROCESS_ABORTED, Events[last + 2].Result);
+
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+}
+
+static void CleanExitIsNotAFailure()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" exit 0", SupervisorRestartOnFailure, &options, imagePath, CELEMS(imagePath));
+
+	HSUPERVISOR supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	CHECK(TestWaitFor(&TypeCounts[SupervisorStopped], 1, TEST_TIMEOUT_MS));
+
+	CHECK_RESULT(3, EventCount);
+	CheckEvent(1, SupervisorExited, 1);
+	CheckEvent(2, SupervisorStopped, 1);
+	CHECK_RESULT(0, Events[1].ExitCode);
+	CHECK_RESULT(ERROR_SUCCESS, Events[2].Result);
+
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+}
+
+static void StableRunsResetTheRestartCount()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+
+	// Each process gets ready, stays up a while and fails
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" flap " TEST_FLAP_UP_MS L" 5", SupervisorRestartOnFailure, &options, imagePath, CELEMS(imagePath));
+	options.MaxRestarts = 2;
+	options.RestartDelayMs = TEST_FLAP_RESTART_DELAY_MS;
+	options.MaxRestartDelayMs = TEST_TIMEOUT_MS;
+	options.StableMs = TEST_FLAP_UNSTABLE_MS;
+
+	HSUPERVISOR supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	// Not up for StableMs, so the restarts count up, back off and run out
+	CHECK(TestWaitFor(&TypeCounts[SupervisorStopped], 1, TEST_TIMEOUT_MS));
+	CHECK_RESULT(12, EventCount);
+	CheckEvent(3, SupervisorRestarting, 1);
+	CheckEvent(7, SupervisorRestarting, 2);
+	CheckEvent(11, SupervisorStopped, 3);
+	CHECK_RESULT(TEST_FLAP_RESTART_DELAY_MS, Events[3].DelayMs);
+	CHECK_RESULT(TEST_FLAP_RESTART_DELAY_MS * 2, Events[7].DelayMs);
+	CHECK_RESULT(ERROR_PROCESS_ABORTED, Events[11].Result);
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+
+	// Up for StableMs each time, every restart is the first in a row
+	options.StableMs = TEST_FLAP_STABLE_MS;
+
+	supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	CHECK(TestWaitFor(&TypeCounts[SupervisorStarted], 4, TEST_TIMEOUT_MS));
+	CHECK_RESULT(0, TypeCounts[SupervisorStopped]);
+
+	for (LONG i = 0; i < 3; i++)
+	{
+		CheckEvent(i * 4 + 1, SupervisorReady, (UINT)i + 1);
+		CheckEvent(i * 4 + 3, SupervisorRestarting, (UINT)i + 1);
+		CHECK_RESULT(TEST_FLAP_RESTART_DELAY_MS, Events[i * 4 + 3].DelayMs);
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+	CHECK(EventCount > 0 && Events[EventCount - 1].Type == SupervisorStopped);
+	CHECK_RESULT(ERROR_SUCCESS, Events[EventCount - 1].Result);
+}
+
+static void StopKillsAChildThatWontExit()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" deaf", SupervisorRestartAlways, &options, imagePath, CELEMS(imagePath));
+	options.StopTimeoutMs = TEST_STOP_TIMEOUT_MS;
+
+	HSUPERVISOR supervisor = StartSupervisor(&options);
+	if (supervisor == NULL)
+	{
+		return;
+	}
+
+	CHECK(TestWaitFor(&TypeCounts[SupervisorReady], 1, TEST_TIMEOUT_MS));
+
+	// It ignores signal SIGTERM, the job is killed once the stop timeout runs out
+	ULONGLONG stopping = GetTickCount64();
+	CHECK_RESULT(ERROR_SUCCESS, SupervisorStop(supervisor));
+	ULONGLONG stopMs = GetTickCount64() - stopping;
+	CHECK(stopMs + TEST_TICK_MS >= TEST_STOP_TIMEOUT_MS);
+	CHECK(stopMs < TEST_TIMEOUT_MS / 2);
+
+	CHECK_RESULT(4, EventCount);
+	CheckEvent(2, SupervisorExited, 1);
+	CheckEvent(3, SupervisorStopped, 1);
+	CHECK_RESULT(ERROR_TIMEOUT, Events[2].ExitCode);
+	CHECK_RESULT(ERROR_SUCCESS, Events[3].Result);
+	CHECK_RESULT(0, TypeCounts[SupervisorRestarting]);
+}
+
+static void BadArgumentsAreRejected()
+{
+	SupervisorOptions options;
+	WCHAR imagePath[MAX_PATH];
+	HSUPERVISOR supervisor = NULL;
+
+	ChildOptions(TEST_CHILD_ARGUMENT_W L" ready", SupervisorRestartNever, &options, imagePath, CELEMS(imagePath));
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, SupervisorStart(NULL, RecordEvent, NULL, &supervisor));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, SupervisorStart(&options, RecordEvent, NULL, NULL));
+
+	options.Restart = (SupervisorRestart)(SupervisorRestartAlways + 1);
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, SupervisorStart(&options, RecordEvent, NULL, &supervisor));
+	options.Restart = SupervisorRestartNever;
+
+	options.CpuRatePercent = 101;
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, SupervisorStart(&options, RecordEvent, NULL, &supervisor));
+	options.CpuRatePercent = 0;
+
+	// A password file without the password to answer it with
+	options.ManagementPasswordFile = L"management.pass";
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, SupervisorStart(&options, RecordEvent, NULL, &supervisor));
+	options.ManagementPasswordFile = NULL;
+
+	// The first process is started by the call, a bad path fails it
+	StringCchCatW(imagePath, CELEMS(imagePath), L".missing");
+	CHECK_RESULT(ERROR_FILE_NOT_FOUND, SupervisorStart(&options, RecordEvent, NULL, &supervisor));
+
+	CHECK(supervisor == NULL);
+}
+
+// The stand in for OpenVPN. "ready" answers every command and exits on signal SIGTERM, "deaf" reads and ignores
+// them, "flap <ms> <code>" exits with code ms after connecting, "exit <code>" exits straight away and "hang"
+// never connects.
+int TestChildMain(int argc, char** argv)
+{
+	WSADATA wsaData;
+	SOCKADDR_IN address;
+	CHAR buffer[1024];
+	UINT used = 0;
+	LPCSTR mode = argc > 2 ? argv[2] : "";
+
+	if (strcmp(mode, "exit") == 0)
+	{
+		return argc > 3 ? atoi(argv[3]) : 0;
+	}
+
+	if (strcmp(mode, "hang") == 0)
+	{
+		Sleep(INFINITE);
+	}
+
+	USHORT port = 0;
+	for (int i = 3; i + 2 < argc; i++)
+	{
+		if (strcmp(argv[i], "--management") == 0)
+		{
+			port = (USHORT)atoi(argv[i + 2]);
+		}
+	}
+
+	if (port == 0 || WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	SOCKET management = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (management == INVALID_SOCKET || connect(management, (const SOCKADDR*)&address, sizeof(address)) != 0)
+	{
+		return ERROR_CONNECTION_REFUSED;
+	}
+
+	if (strcmp(mode, "flap") == 0)
+	{
+		Sleep(argc > 3 ? (DWORD)atoi(argv[3]) : 0);
+		return argc > 4 ? atoi(argv[4]) : 0;
+	}
+
+	for (;;)
+	{
+		int received = recv(management, buffer + used, (int)(sizeof(buffer) - used), 0);
+		if (received <= 0)
+		{
+			return 0;
+		}
+
+		used += (UINT)received;
+
+		CHAR* end;
+		while ((end = (CHAR*)memchr(buffer, '\n', used)) != NULL)
+		{
+			BOOL terminate = end - buffer >= 14 && memcmp(buffer, "signal SIGTERM", 14) == 0;
+
+			used -= (UINT)(end - buffer) + 1;
+			memmove(buffer, end + 1, used);
+
+			if (strcmp(mode, "ready") != 0)
+			{
+				continue;
+			}
+
+			if (terminate)
+			{
+				send(management, "SUCCESS: signal SIGTERM thrown\r\n", 32, 0);
+				closesocket(management);
+				return 0;
+			}
+
+			send(management, "SUCCESS: done\r\n", 15, 0);
+		}
+
+		if (used == sizeof(buffer))
+		{
+			used = 0;
+		}
+	}
+}
+
+const TestCase SupervisorTests[] =
+{
+	{ "ReadyChildStopsWhenAsked", ReadyChildStopsWhenAsked },
+	{ "ReadyTimeoutKillsTheChild", ReadyTimeoutKillsTheChild },
+	{ "FailuresBackOffUntilTheLimit", FailuresBackOffUntilTheLimit },
+	{ "CleanExitIsNotAFailure", CleanExitIsNotAFailure },
+	{ "StableRunsResetTheRestartCount", StableRunsResetTheRestartCount },
+	{ "StopKillsAChildThatWontExit", StopKillsAChildThatWontExit },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT SupervisorTestsCount = CELEMS(SupervisorTests);
@@ -0,0 +1,133 @@
+// Tests.cpp : Runs the native tests, or those whose "Suite.Case" name contains the first argument
+//
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <strsafe.h>
+#include "Tests.h"
+
+TEST_SUITE(DialSessionTests);
+TEST_SUITE(StatusPageTests);
+TEST_SUITE(UsageJournalTests);
+TEST_SUITE(PortPolicyTests);
+TEST_SUITE(KillswitchPolicyTests);
+TEST_SUITE(ExecutorTests);
+TEST_SUITE(DnsForwarderTests);
+TEST_SUITE(ServerProbeTests);
+TEST_SUITE(DnsCacheTests);
+TEST_SUITE(ManagementParserTests);
+TEST_SUITE(TunnelMonitorTests);
+TEST_SUITE(ReconnectTests);
+TEST_SUITE(ManagementTransportTests);
+TEST_SUITE(SupervisorTests);
+TEST_SUITE(FlightRecorderTests);
+
+typedef struct _TestSuite
+{
+	LPCSTR Name;
+	const TestCase* Cases;
+	const UINT* Count;
+} TestSuite;
+
+static const TestSuite Suites[] =
+{
+	{ "DialSession", DialSessionTests, &DialSessionTestsCount },
+	{ "StatusPage", StatusPageTests, &StatusPageTestsCount },
+	{ "UsageJournal", UsageJournalTests, &UsageJournalTestsCount },
+	{ "PortPolicy", PortPolicyTests, &PortPolicyTestsCount },
+	{ "KillswitchPolicy", KillswitchPolicyTests, &KillswitchPolicyTestsCount },
+	{ "Executor", ExecutorTests, &ExecutorTestsCount },
+	{ "DnsForwarder", DnsForwarderTests, &DnsForwarderTestsCount },
+	{ "ServerProbe", ServerProbeTests, &ServerProbeTestsCount },
+	{ "DnsCache", DnsCacheTests, &DnsCacheTestsCount },
+	{ "ManagementParser", ManagementParserTests, &ManagementParserTestsCount },
+	{ "TunnelMonitor", TunnelMonitorTests, &TunnelMonitorTestsCount },
+	{ "Reconnect", ReconnectTests, &ReconnectTestsCount },
+	{ "ManagementTransport", ManagementTransportTests, &ManagementTransportTestsCount },
+	{ "Supervisor", SupervisorTests, &SupervisorTestsCount },
+	{ "FlightRecorder", FlightRecorderTests, &FlightRecorderTestsCount },
+};
+
+static volatile LONG Failures = 0;
+
+void TestCheck(BOOL passed, LPCSTR expression, LPCSTR file, INT line)
+{
+	if (!passed)
+	{
+		InterlockedIncrement(&Failures);
+		printf("  %s(%d): CHECK(%s) failed\n", file, line, expression);
+	}
+}
+
+void TestCheckResult(DWORD expected, DWORD actual, LPCSTR expression, LPCSTR file, INT line)
+{
+	if (expected != actual)
+	{
+		InterlockedIncrement(&Failures);
+		printf("  %s(%d): %s returned %lu, expected %lu\n", file, line, expression, (unsigned long)actual, (unsigned long)expected);
+	}
+}
+
+BOOL TestWaitFor(volatile LONG* value, LONG expected, DWORD timeoutMs)
+{
+	ULONGLONG deadline = GetTickCount64() + timeoutMs;
+
+	while (InterlockedCompareExchange(value, expected, expected) != expected)
+	{
+		if (GetTickCount64() >= deadline)
+		{
+			return FALSE;
+		}
+
+		Sleep(1);
+	}
+
+	return TRUE;
+}
+
+int main(int argc, char** argv)
+{
+	LPCSTR filter = argc > 1 ? argv[1] : NULL;
+	UINT run = 0;
+	UINT failed = 0;
+	CHAR name[128];
+
+	if (argc > 1 && strcmp(argv[1], TEST_CHILD_ARGUMENT) == 0)
+	{
+		return TestChildMain(argc, argv);
+	}
+
+	for (UINT i = 0; i < CELEMS(Suites); i++)
+	{
+		for (UINT j = 0; j < *Suites[i].Count; j++)
+		{
+			const TestCase* test = &Suites[i].Cases[j];
+
+			StringCchPrintfA(name, CELEMS(name), "%s.%s", Suites[i].Name, test->Name);
+			if (filter != NULL && strstr(name, filter) == NULL)
+			{
+				continue;
+			}
+
+			printf("%s\n", name);
+			fflush(stdout);
+
+			LONG before = Failures;
+			ULONGLONG started = GetTickCount64();
+
+			test->Func();
+
+			run++;
+			if (Failures != before)
+			{
+				failed++;
+				printf("  FAILED (%llu ms)\n", GetTickCount64() - started);
+			}
+		}
+	}
+
+	printf("%u tests, %u failed\n", run, failed);
+
+	return failed == 0 ? 0 : 1;
+}
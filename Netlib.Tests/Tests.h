@@ -0,0 +1,33 @@
+#pragma once
+#include <windows.h>
+
+#define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
+
+// Longest a test waits on a callback or a background thread before failing
+#define TEST_TIMEOUT_MS 10000
+
+typedef void(*TestFuncType)();
+
+typedef struct _TestCase
+{
+	LPCSTR Name;
+	TestFuncType Func;
+} TestCase;
+
+// Each *Tests.cpp defines a table of its cases and their count, Tests.cpp lists the tables
+#define TEST_SUITE(name) extern const TestCase name[]; extern const UINT name##Count
+
+// A failed check is reported and fails the running test, which carries on so one run shows every failed check
+extern void TestCheck(BOOL passed, LPCSTR expression, LPCSTR file, INT line);
+extern void TestCheckResult(DWORD expected, DWORD actual, LPCSTR expression, LPCSTR file, INT line);
+
+#define CHECK(expression) TestCheck((expression) ? TRUE : FALSE, #expression, __FILE__, __LINE__)
+#define CHECK_RESULT(expected, expression) TestCheckResult((DWORD)(expected), (DWORD)(expression), #expression, __FILE__, __LINE__)
+
+// Polls until *value is expected, FALSE when timeoutMs passes first. For results callbacks leave from other threads.
+extern BOOL TestWaitFor(volatile LONG* value, LONG expected, DWORD timeoutMs);
+
+// "Tests.exe --child <mode> ..." runs TestChildMain in place of the tests, for tests that need a process to start
+#define TEST_CHILD_ARGUMENT "--child"
+#define TEST_CHILD_ARGUMENT_W L"--child"
+extern int TestChildMain(int argc, char** argv);
@@ -0,0 +1,319 @@
+#include <winsock2.h>
+#include <windows.h>
+#include <string.h>
+#include "TunnelMonitor.h"
+#include "Tests.h"
+
+TEST_SUITE(TunnelMonitorTests);
+
+#define TEST_PACKET_LENGTH 512
+#define TEST_PROBE_LENGTH 16
+#define TEST_MAX_TRANSITIONS 16
+// Every probe is answered or written off before the next goes out, so replies and losses never interleave
+#define TEST_INTERVAL_MS 100
+#define TEST_TIMEOUT_PROBE_MS 80
+#define TEST_RTT_LIMIT_MS 25
+#define TEST_SLOW_MS 40
+#define TEST_STALLED_MS 400
+// Replies in a row a stalled tunnel needs before it is healthy again
+#define TEST_RECOVER_PROBES 3
+#define TEST_HISTOGRAM_PROBES 24
+
+typedef enum _EchoMode
+{
+	EchoAll,
+	EchoNone,
+	// Per eight probes: the 3rd and 4th are dropped, the 1st and 5th answered TEST_SLOW_MS late
+	EchoPattern,
+} EchoMode;
+
+// The responder thread and the monitor callback write these
+static SOCKET EchoSocket = INVALID_SOCKET;
+static HANDLE EchoThread;
+static SOCKADDR_IN EchoAddress;
+static volatile LONG Mode;
+static volatile LONG DelayMs;
+static volatile LONG Transitions;
+static TunnelHealth Healths[TEST_MAX_TRANSITIONS];
+static TunnelMonitorSnapshot Snapshots[TEST_MAX_TRANSITIONS];
+
+static UINT32 ReadBE32(const BYTE* p)
+{
+	return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+// Echoes datagrams as Mode and DelayMs say until one too short to be a probe arrives
+static DWORD WINAPI EchoFunc(LPVOID parameter)
+{
+	BYTE packet[TEST_PACKET_LENGTH];
+
+	for (;;)
+	{
+		SOCKADDR_IN from;
+		int fromLength = sizeof(from);
+		int length = recvfrom(EchoSocket, (char*)packet, sizeof(packet), 0, (SOCKADDR*)&from, &fromLength);
+
+		if (length < TEST_PROBE_LENGTH)
+		{
+			break;
+		}
+
+		LONG delayMs = DelayMs;
+		UINT32 place = (ReadBE32(packet + 8) - 1) % 8;
+
+		switch (Mode)
+		{
+		case EchoNone:
+			continue;
+		case EchoPattern:
+			if (place == 2 || place == 3)
+			{
+				continue;
+			}
+			delayMs = place == 0 || place == 4 ? TEST_SLOW_MS : 0;
+			break;
+		}
+
+		if (delayMs > 0)
+		{
+			Sleep(delayMs);
+		}
+
+		sendto(EchoSocket, (const char*)packet, length, 0, (const SOCKADDR*)&from, fromLength);
+	}
+
+	return 0;
+}
+
+static void StopEcho()
+{
+	if (EchoThread != NULL)
+	{
+		BYTE stop = 0;
+
+		sendto(EchoSocket, (const char*)&stop, sizeof(stop), 0, (const SOCKADDR*)&EchoAddress, sizeof(EchoAddress));
+		WaitForSingleObject(EchoThread, TEST_TIMEOUT_MS);
+		CloseHandle(EchoThread);
+		EchoThread = NULL;
+	}
+
+	if (EchoSocket != INVALID_SOCKET)
+	{
+		closesocket(EchoSocket);
+		EchoSocket = INVALID_SOCKET;
+	}
+
+	WSACleanup();
+}
+
+static BOOL StartEcho(EchoMode mode)
+{
+	WSADATA wsaData;
+	int addressLength = sizeof(EchoAddress);
+
+	Mode = mode;
+	DelayMs = 0;
+	Transitions = 0;
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	CHECK_RESULT(ERROR_SUCCESS, result);
+	if (result != ERROR_SUCCESS)
+	{
+		return FALSE;
+	}
+
+	ZeroMemory(&EchoAddress, sizeof(EchoAddress));
+	EchoAddress.sin_family = AF_INET;
+	EchoAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	EchoSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (EchoSocket == INVALID_SOCKET || bind(EchoSocket, (const SOCKADDR*)&EchoAddress, sizeof(EchoAddress)) != 0
+		|| getsockname(EchoSocket, (SOCKADDR*)&EchoAddress, &addressLength) != 0)
+	{
+		CHECK_RESULT(ERROR_SUCCESS, WSAGetLastError());
+		StopEcho();
+		return FALSE;
+	}
+
+	EchoThread = CreateThread(NULL, 0, EchoFunc, NULL, 0, NULL);
+	CHECK(EchoThread != NULL);
+	if (EchoThread == NULL)
+	{
+		StopEcho();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void CALLBACK RecordTransition(HTUNNELMONITOR monitor, TunnelHealth health, const TunnelMonitorSnapshot* snapshot, PVOID context)
+{
+	LONG transition = Transitions;
+
+	if (transition < TEST_MAX_TRANSITIONS)
+	{
+		Healths[transition] = health;
+		Snapshots[transition] = *snapshot;
+	}
+
+	InterlockedIncrement(&Transitions);
+}
+
+static void TestOptions(TunnelMonitorOptions* options)
+{
+	ZeroMemory(options, sizeof(*options));
+	options->Target = L"127.0.0.1";
+	options->Port = ntohs(EchoAddress.sin_port);
+	options->IntervalMs = TEST_INTERVAL_MS;
+	options->TimeoutMs = TEST_TIMEOUT_PROBE_MS;
+	options->WindowProbes = 4;
+	options->DegradedRttMs = TEST_RTT_LIMIT_MS;
+	// Only a window with nothing but losses counts against the loss limit, latency drives degrading here
+	options->DegradedLossPermille = 1000;
+	options->DegradedJitterMs = 1000;
+	options->StalledMs = TEST_STALLED_MS;
+}
+
+static void HealthFollowsTheReplies()
+{
+	TunnelMonitorOptions options;
+	HTUNNELMONITOR monitor = NULL;
+
+	if (!StartEcho(EchoAll))
+	{
+		return;
+	}
+
+	TestOptions(&options);
+	CHECK_RESULT(ERROR_SUCCESS, TunnelMonitorStart(&options, RecordTransition, NULL, &monitor));
+	if (monitor == NULL)
+	{
+		StopEcho();
+		return;
+	}
+
+	CHECK(TestWaitFor(&Transitions, 1, TEST_TIMEOUT_MS));
+	CHECK_RESULT(TunnelHealthHealthy, Healths[0]);
+	CHECK_RESULT(TunnelHealthHealthy, Snapshots[0].Health);
+	CHECK_RESULT(1, Snapshots[0].Received);
+
+	// Slow replies push the window's average RTT over the limit
+	DelayMs = TEST_SLOW_MS;
+	CHECK(TestWaitFor(&Transitions, 2, TEST_TIMEOUT_MS));
+	CHECK_RESULT(TunnelHealthDegraded, Healths[1]);
+	CHECK_RESULT(TunnelHealthDegraded, Snapshots[1].Health);
+	CHECK(Snapshots[1].WindowRttAvgUs >= TEST_RTT_LIMIT_MS * 1000);
+	CHECK_RESULT(0, Snapshots[1].Lost);
+
+	// Silence for StalledMs once probes go missing
+	Mode = EchoNone;
+	CHECK(TestWaitFor(&Transitions, 3, TEST_TIMEOUT_MS));
+	CHECK_RESULT(TunnelHealthStalled, Healths[2]);
+	CHECK(Snapshots[2].Lost > 0);
+	CHECK(Snapshots[2].LastReplyAgeMs >= TEST_STALLED_MS);
+	CHECK_RESULT(Snapshots[1].Received, Snapshots[2].Received);
+
+	// Fast replies again, healthy only after TEST_RECOVER_PROBES of them in a row
+	DelayMs = 0;
+	Mode = EchoAll;
+	CHECK(TestWaitFor(&Transitions, 4, TEST_TIMEOUT_MS));
+	CHECK_RESULT(TunnelHealthHealthy, Healths[3]);
+	CHECK_RESULT(Snapshots[2].Received + TEST_RECOVER_PROBES, Snapshots[3].Received);
+	// The whole silence is one burst
+	CHECK(Snapshots[3].Lost >= (TEST_STALLED_MS - TEST_TIMEOUT_PROBE_MS) / TEST_INTERVAL_MS);
+	CHECK_RESULT(Snapshots[3].Lost, Snapshots[3].LossBurstMax);
+
+	TunnelMonitorSnapshot snapshot;
+	CHECK_RESULT(ERROR_SUCCESS, TunnelMonitorGetSnapshot(monitor, &snapshot));
+	CHECK_RESULT(TunnelHealthHealthy, snapshot.Health);
+
+	CHECK_RESULT(ERROR_SUCCESS, TunnelMonitorStop(monitor));
+	CHECK_RESULT(4, Transitions);
+
+	StopEcho();
+}
+
+static void HistogramsCountEveryProbe()
+{
+	TunnelMonitorOptions options;
+	TunnelMonitorSnapshot snapshot;
+	HTUNNELMONITOR monitor = NULL;
+	BOOL settled = FALSE;
+
+	if (!StartEcho(EchoPattern))
+	{
+		return;
+	}
+
+	TestOptions(&options);
+	CHECK_RESULT(ERROR_SUCCESS, TunnelMonitorStart(&options, NULL, NULL, &monitor));
+	if (monitor == NULL)
+	{
+		StopEcho();
+		return;
+	}
+
+	// Catch the moment a whole number of rounds of eight has been sent and every probe answered or written off
+	ULONGLONG deadline = GetTickCount64() + TEST_TIMEOUT_MS;
+	while (!settled && GetTickCount64() < deadline)
+	{
+		Sleep(5);
+		CHECK_RESULT(ERROR_SUCCESS, TunnelMonitorGetSnapshot(monitor, &snapshot));
+		settled = snapshot.Sent >= TEST_HISTOGRAM_PROBES && snapshot.Sent % 8 == 0 && snapshot.Received + snapshot.Lost == snapshot.Sent;
+	}
+
+	CHECK_RESULT(ERROR_SUCCESS, TunnelMonitorStop(monitor));
+	StopEcho();
+
+	CHECK(settled);
+	if (!settled)
+	{
+		return;
+	}
+
+	UINT64 rounds = snapshot.Sent / 8;
+
+	CHECK_RESULT(rounds * 6, snapshot.Received);
+	CHECK_RESULT(rounds * 2, snapshot.Lost);
+	CHECK_RESULT(0, snapshot.Late);
+
+	// A third of the replies are slow, so the median is fast and the 90th percentile slow
+	CHECK(snapshot.RttP50Us < TEST_SLOW_MS * 1000 / 2);
+	CHECK(snapshot.RttP90Us >= (TEST_SLOW_MS - 5) * 1000);
+	CHECK(snapshot.RttP99Us >= snapshot.RttP90Us);
+	CHECK(snapshot.RttMaxUs >= snapshot.RttP99Us);
+	CHECK(snapshot.RttMaxUs < TEST_TIMEOUT_PROBE_MS * 1000);
+
+	// Four of every six RTT changes go between fast and slow
+	CHECK(snapshot.JitterP50Us >= (TEST_SLOW_MS - 5) * 1000);
+	CHECK(snapshot.JitterP99Us >= snapshot.JitterP50Us);
+
+	// Every loss comes in a pair
+	CHECK_RESULT(2, snapshot.LossBurstP99);
+	CHECK_RESULT(2, snapshot.LossBurstMax);
+}
+
+static void BadArgumentsAreRejected()
+{
+	TunnelMonitorOptions options;
+	TunnelMonitorSnapshot snapshot;
+	HTUNNELMONITOR monitor = NULL;
+
+	ZeroMemory(&options, sizeof(options));
+
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, TunnelMonitorStart(NULL, NULL, NULL, &monitor));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, TunnelMonitorStart(&options, NULL, NULL, &monitor));
+	options.Target = L"127.0.0.1";
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, TunnelMonitorStart(&options, NULL, NULL, NULL));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, TunnelMonitorGetSnapshot(NULL, &snapshot));
+	CHECK_RESULT(ERROR_INVALID_PARAMETER, TunnelMonitorStop(NULL));
+}
+
+const TestCase TunnelMonitorTests[] =
+{
+	{ "HealthFollowsTheReplies", HealthFollowsTheReplies },
+	{ "HistogramsCountEveryProbe", HistogramsCountEveryProbe },
+	{ "BadArgumentsAreRejected", BadArgumentsAreRejected },
+};
+
+const UINT TunnelMonitorTestsCount = CELEMS(TunnelMonitorTests);
@@ -0,0 +1,318 @@
+#include <windows.h>
+#include <strsafe.h>
+#include "UsageJournal.h"
+#include "Tests.h"
+
+TEST_SUITE(UsageJournalTests);
+
+// 2020-01-01, samples are a minute apart so a run of them spans several hourly buckets
+#define TEST_BASE_TIME 1577836800
+#define TEST_SAMPLE_SECONDS 60
+#define TEST_SAMPLES 200
+
+// Offsets into the files, both start with one 32 byte header and hold 32 byte entries after it
+#define TEST_ENTRY_SIZE 32
+#define TEST_RECORD_CHECKSUM_OFFSET 28
+#define TEST_FIRST_SEGMENT L"usage-00000000.seg"
+#define TEST_INDEX L"usage.idx"
+
+static UINT32 SampleTime(UINT sample)
+{
+	return TEST_BASE_TIME + sample * TEST_SAMPLE_SECONDS;
+}
+
+static UINT64 SampleTx(UINT sample)
+{
+	return 1000 + (sample * 7919) % 4001;
+}
+
+static UINT64 SampleRx(UINT sample)
+{
+	return 3 * (sample % 97);
+}
+
+// Totals of samples first up to but not including last
+static void Expected(UINT first, UINT last, UsageTotals* totals)
+{
+	ZeroMemory(totals, sizeof(UsageTotals));
+
+	for (UINT sample = first; sample < last; sample++)
+	{
+		totals->TxBytes += SampleTx(sample);
+		totals->RxBytes += SampleRx(sample);
+		totals->Records++;
+	}
+}
+
+static BOOL SameTotals(const UsageTotals* a, const UsageTotals* b)
+{
+	return a->TxBytes == b->TxBytes && a->RxBytes == b->RxBytes && a->Records == b->Records;
+}
+
+static void JournalDirectory(LPCWSTR test, LPWSTR directory, DWORD directoryLength)
+{
+	WCHAR temp[MAX_PATH];
+
+	GetTempPathW(CELEMS(temp), temp);
+	StringCchPrintfW(directory, directoryLength, L"%sUtilizrJournalTests-%lu-%s", temp, GetCurrentProcessId(), test);
+}
+
+static void RemoveJournal(LPCWSTR directory)
+{
+	WCHAR path[MAX_PATH];
+	WIN32_FIND_DATAW found;
+
+	StringCchPrintfW(path, CELEMS(path), L"%s\\usage-*.seg", directory);
+
+	HANDLE find = FindFirstFileW(path, &found);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			StringCchPrintfW(path, CELEMS(path), L"%s\\%s", directory, found.cFileName);
+			DeleteFileW(path);
+		} while (FindNextFileW(find, &found));
+
+		FindClose(find);
+	}
+
+	StringCchPrintfW(path, CELEMS(path), L"%s\\%s", directory, TEST_INDEX);
+	DeleteFileW(path);
+	RemoveDirectoryW(directory);
+}
+
+// Overwrites part of a closed journal's file, standing in for a write the crash cut short
+static BOOL PatchFile(LPCWSTR directory, LPCWSTR name, LONGLONG offset, const void* data, DWORD size)
+{
+	WCHAR path[MAX_PATH];
+	LARGE_INTEGER position;
+	DWORD written = 0;
+
+	StringCchPrintfW(path, CELEMS(path), L"%s\\%s", directory, name);
+
+	HANDLE file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return FALSE;
+	}
+
+	position.QuadPart = offset;
+	BOOL ok = SetFilePointerEx(file, position, NULL, FILE_BEGIN) && WriteFile(file, data, size, &written, NULL) && written == size;
+
+	CloseHandle(file);
+
+	return ok;
+}
+
+// Reads a whole file, the caller frees the contents with HeapFree
+static BYTE* ReadWholeFile(LPCWSTR directory, LPCWSTR name, DWORD* size)
+{
+	WCHAR path[MAX_PATH];
+	LARGE_INTEGER length;
+	DWORD read = 0;
+	BYTE* contents = NULL;
+
+	StringCchPrintfW(path, CELEMS(path), L"%s\\%s", directory, name);
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return NULL;
+	}
+
+	if (GetFileSizeEx(file, &length) && length.QuadPart > 0 && length.QuadPart < MAXDWORD)
+	{
+		contents = (BYTE*)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)length.QuadPart);
+	}
+
+	if (contents != NULL && (!ReadFile(file, contents, (DWORD)length.QuadPart, &read, NULL) || read != (DWORD)length.QuadPart))
+	{
+		HeapFree(GetProcessHeap(), 0, contents);
+		contents = NULL;
+	}
+
+	CloseHandle(file);
+
+	*size = read;
+
+	return contents;
+}
+
+static BOOL WriteWholeFile(LPCWSTR directory, LPCWSTR name, const BYTE* contents, DWORD size)
+{
+	WCHAR path[MAX_PATH];
+	DWORD written = 0;
+
+	StringCchPrintfW(path, CELEMS(path), L"%s\\%s", directory, name);
+
+	HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return FALSE;
+	}
+
+	BOOL ok = WriteFile(file, contents, size, &written, NULL) && written == size;
+
+	CloseHandle(file);
+
+	return ok;
+}
+
+static DWORD AppendSamples(LPCWSTR directory, UINT first, UINT last)
+{
+	HUSAGEJOURNAL journal = NULL;
+
+	DWORD result = UsageJournalOpen(directory, 0, &journal);
+
+	for (UINT sample = first; sample < last && result == ERROR_SUCCESS; sample++)
+	{
+		result = UsageJournalAppend(journal, SampleTime(sample), 1, SampleTx(sample), SampleRx(sample));
+	}
+
+	if (journal != NULL)
+	{
+		UsageJournalClose(journal);
+	}
+
+	return result;
+}
+
+// Reopens the journal and checks everything in it and a range ending partway through an hour
+static void CheckReopened(LPCWSTR directory, UINT samples)
+{
+	HUSAGEJOURNAL journal = NULL;
+	UsageTotals totals;
+	UsageTotals expected;
+
+	CHECK_RESULT(ERROR_SUCCESS, UsageJournalOpen(directory, 0, &journal));
+	if (journal == NULL)
+	{
+		return;
+	}
+
+	Expected(0, samples, &expected);
+	CHECK_RESULT(ERROR_SUCCESS, UsageJournalQuery(journal, 0, 0xFFFFFFFF, &totals));
+	CHECK(SameTotals(&totals, &expected));
+
+	Expected(7, samples - 3, &expected);
+	CHECK_RESULT(ERROR_SUCCESS, UsageJournalQuery(journal, SampleTime(7), SampleTime(samples - 3), &totals));
+	CHECK(SameTotals(&totals, &expected));
+
+	UsageJournalClose(journal);
+}
+
+static void ReopenKeepsEverySample()
+{
+	WCHAR directory[MAX_PATH];
+
+	JournalDirectory(L"Reopen", directory, CELEMS(directory));
+	RemoveJournal(directory);
+
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, 0, TEST_SAMPLES / 2));
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, TEST_SAMPLES / 2, TEST_SAMPLES));
+	CheckReopened(directory, TEST_SAMPLES);
+
+	RemoveJournal(directory);
+}
+
+static void TornRecordIsDropped()
+{
+	WCHAR directory[MAX_PATH];
+	UINT32 torn = 0xDEAD;
+
+	JournalDirectory(L"Torn", directory, CELEMS(directory));
+	RemoveJournal(directory);
+
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, 0, TEST_SAMPLES));
+
+	// The last record's checksum never made it to disk
+	LONGLONG offset = TEST_ENTRY_SIZE + (LONGLONG)(TEST_SAMPLES - 1) * TEST_ENTRY_SIZE + TEST_RECORD_CHECKSUM_OFFSET;
+	CHECK(PatchFile(directory, TEST_FIRST_SEGMENT, offset, &torn, sizeof(torn)));
+
+	CheckReopened(directory, TEST_SAMPLES - 1);
+
+	// Appending carries on in the slot the torn record held
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, TEST_SAMPLES - 1, TEST_SAMPLES));
+	CheckReopened(directory, TEST_SAMPLES);
+
+	RemoveJournal(directory);
+}
+
+static void UnindexedRecordIsIndexed()
+{
+	WCHAR directory[MAX_PATH];
+	DWORD size = 0;
+
+	JournalDirectory(L"Unindexed", directory, CELEMS(directory));
+	RemoveJournal(directory);
+
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, 0, TEST_SAMPLES - 1));
+
+	BYTE* index = ReadWholeFile(directory, TEST_INDEX, &size);
+	CHECK(index != NULL);
+	if (index == NULL)
+	{
+		RemoveJournal(directory);
+		return;
+	}
+
+	// Putting the old index back leaves the last record as a crash between writing and indexing it would
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, TEST_SAMPLES - 1, TEST_SAMPLES));
+	CHECK(WriteWholeFile(directory, TEST_INDEX, index, size));
+	HeapFree(GetProcessHeap(), 0, index);
+
+	CheckReopened(directory, TEST_SAMPLES);
+
+	RemoveJournal(directory);
+}
+
+static void CorruptBucketIsRepaired()
+{
+	WCHAR directory[MAX_PATH];
+	UINT64 garbage = 12345;
+
+	JournalDirectory(L"Bucket", directory, CELEMS(directory));
+	RemoveJournal(directory);
+
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, 0, TEST_SAMPLES));
+
+	// The second hour's transmitted bytes, its checksum no longer matches
+	CHECK(PatchFile(directory, TEST_INDEX, TEST_ENTRY_SIZE + TEST_ENTRY_SIZE, &garbage, sizeof(garbage)));
+
+	CheckReopened(directory, TEST_SAMPLES);
+
+	RemoveJournal(directory);
+}
+
+static void MissingIndexIsRebuilt()
+{
+	WCHAR directory[MAX_PATH];
+	WCHAR path[MAX_PATH];
+
+	JournalDirectory(L"Rebuild", directory, CELEMS(directory));
+	RemoveJournal(directory);
+
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, 0, TEST_SAMPLES));
+
+	StringCchPrintfW(path, CELEMS(path), L"%s\\%s", directory, TEST_INDEX);
+	CHECK(DeleteFileW(path));
+
+	CheckReopened(directory, TEST_SAMPLES);
+
+	// The rebuilt index is used as is on the next open
+	CHECK_RESULT(ERROR_SUCCESS, AppendSamples(directory, TEST_SAMPLES, TEST_SAMPLES + 10));
+	CheckReopened(directory, TEST_SAMPLES + 10);
+
+	RemoveJournal(directory);
+}
+
+const TestCase UsageJournalTests[] =
+{
+	{ "ReopenKeepsEverySample", ReopenKeepsEverySample },
+	{ "TornRecordIsDropped", TornRecordIsDropped },
+	{ "UnindexedRecordIsIndexed", UnindexedRecordIsIndexed },
+	{ "CorruptBucketIsRepaired", CorruptBucketIsRepaired },
+	{ "MissingIndexIsRebuilt", MissingIndexIsRebuilt },
+};
+
+const UINT UsageJournalTestsCount = CELEMS(UsageJournalTests);
@@ -0,0 +1,119 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <iphlpapi.h>
+#include <psapi.h>
+#include <Ras.h>
+#include "Backend.h"
+#include "WfpApi.h"
+#include "RasApi.h"
+#include "NativeLog.h"
+
+static const LPCWSTR BackendModules[BackendCount] = {
+	L"rasapi32.dll",
+	L"fwpuclnt.dll",
+	L"iphlpapi.dll",
+};
+
+BOOL BackendIsLoaded(BackendId backend)
+{
+	switch (backend)
+	{
+	case BackendRas:
+		return RaslibNativeLoaded();
+	case BackendWfp:
+		return WfpApiLoaded();
+	case BackendIpHelper:
+		return GetModuleHandleW(BackendModules[BackendIpHelper]) != NULL;
+	default:
+		return FALSE;
+	}
+}
+
+UINT BackendUnloadIdle(DWORD idleMs)
+{
+	return WfpApiUnloadIdle(idleMs) ? 1 : 0;
+}
+
+#ifdef NATIVE_BENCH
+static void CallBackend(BackendId backend)
+{
+	switch (backend)
+	{
+	case BackendRas:
+	{
+		RASCONN connection;
+		ZeroMemory(&connection, sizeof(connection));
+		connection.dwSize = sizeof(connection);
+		DWORD size = sizeof(connection);
+		DWORD connections = 0;
+		RaslibGetApi()->EnumConnections(&connection, &size, &connections);
+		break;
+	}
+	case BackendWfp:
+		WfpksIsEnabled();
+		break;
+	case BackendIpHelper:
+	{
+		DWORD interfaces = 0;
+		GetNumberOfInterfaces(&interfaces);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static BOOL GetMemory(PROCESS_MEMORY_COUNTERS_EX* counters)
+{
+	ZeroMemory(counters, sizeof(*counters));
+	counters->cb = sizeof(*counters);
+	return K32GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)counters, sizeof(*counters));
+}
+
+DWORD BackendRunStartupBenchmark(BackendStartupReport* report)
+{
+	if (report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(BackendStartupReport));
+
+	PROCESS_MEMORY_COUNTERS_EX before, after;
+	if (!GetMemory(&before))
+	{
+		return GetLastError();
+	}
+
+	report->StartWorkingSetKb = before.WorkingSetSize / 1024;
+	report->StartPrivateKb = before.PrivateUsage / 1024;
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+
+	for (UINT i = 0; i < BackendCount; i++)
+	{
+		BackendId backend = (BackendId)i;
+		report->LoadedAtStart[i] = GetModuleHandleW(BackendModules[i]) != NULL;
+
+		GetMemory(&before);
+		QueryPerformanceCounter(&start);
+		CallBackend(backend);
+		QueryPerformanceCounter(&end);
+		GetMemory(&after);
+
+		report->FirstCallUs[i] = (DOUBLE)(end.QuadPart - start.QuadPart) * 1000000.0 / (DOUBLE)frequency.QuadPart;
+		report->WorkingSetDeltaKb[i] = ((INT64)after.WorkingSetSize - (INT64)before.WorkingSetSize) / 1024;
+		report->PrivateDeltaKb[i] = ((INT64)after.PrivateUsage - (INT64)before.PrivateUsage) / 1024;
+
+		QueryPerformanceCounter(&start);
+		CallBackend(backend);
+		QueryPerformanceCounter(&end);
+		report->SecondCallUs[i] = (DOUBLE)(end.QuadPart - start.QuadPart) * 1000000.0 / (DOUBLE)frequency.QuadPart;
+	}
+
+	NATIVELOG_INFO("backend startup: ras %.0fus wfp %.0fus iphlpapi %.0fus\n", report->FirstCallUs[BackendRas], report->FirstCallUs[BackendWfp], report->FirstCallUs[BackendIpHelper]);
+
+	return ERROR_SUCCESS;
+}
+#endif
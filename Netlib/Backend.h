@@ -0,0 +1,41 @@
+#pragma once
+#include <windows.h>
+
+// The system libraries Netlib calls into. None of them load with Netlib: RAS comes in through the first call
+// into Raslib's native table (see RasApi.h), WFP through WfpApi.h, and IP Helper is delay loaded by the linker.
+typedef enum _BackendId
+{
+	BackendRas = 0,
+	BackendWfp,
+	BackendIpHelper,
+	BackendCount
+} BackendId;
+
+extern BOOL BackendIsLoaded(BackendId backend);
+
+// Unloads the backends nothing has called into for idleMs and returns how many it unloaded. Only WFP goes, RAS
+// and IP Helper call back on threads they own for as long as a dial or a change notification is registered.
+extern UINT BackendUnloadIdle(DWORD idleMs);
+
+#ifdef NATIVE_BENCH
+typedef struct _BackendStartupReport
+{
+	// Whether the backend's library was already in the process, in which case the first call didn't load it
+	BOOL LoadedAtStart[BackendCount];
+	// The first call into each backend, loading it included
+	DOUBLE FirstCallUs[BackendCount];
+	// The same call again, what's left once it's loaded
+	DOUBLE SecondCallUs[BackendCount];
+	// What the first call added to the working set and private bytes
+	INT64 WorkingSetDeltaKb[BackendCount];
+	INT64 PrivateDeltaKb[BackendCount];
+	// The process as the benchmark found it
+	UINT64 StartWorkingSetKb;
+	UINT64 StartPrivateKb;
+} BackendStartupReport;
+
+// Makes a cheap call into each backend in turn, RAS enumerating connections, WFP checking the killswitch and IP
+// Helper counting interfaces, timing it and measuring resident memory around it. Meant to be the first thing a
+// process calls after loading Netlib.
+extern DWORD BackendRunStartupBenchmark(BackendStartupReport* report);
+#endif
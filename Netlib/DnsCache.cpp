@@ -0,0 +1,975 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <strsafe.h>
+#include "DnsCache.h"
+#include "NativeLog.h"
+#include "Executor.h"
+
+#define DNS_DEFAULT_PORT 53
+#define DNS_DEFAULT_RETRY_MS 400
+#define DNS_DEFAULT_STALE_MS (60 * 60 * 1000)
+#define DNS_DEFAULT_MIN_TTL_SECONDS 30
+#define DNS_DEFAULT_MAX_TTL_SECONDS (24 * 60 * 60)
+#define DNS_REFRESH_DEADLINE_MS 5000
+
+#define DNS_HEADER_LENGTH 12
+#define DNS_MAX_NAME_LENGTH 255
+#define DNS_QUERY_MAX_LENGTH (DNS_HEADER_LENGTH + DNS_MAX_NAME_LENGTH + 4)
+#define DNS_RECV_BUFFER 1500
+#define DNS_TYPE_A 1
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NAME_ERROR 3
+#define DNS_RCODE_SERVER_FAILURE 2
+#define DNS_RCODE_REFUSED 5
+
+#define DNS_HOST_MASK "255.255.255.255"
+
+typedef struct _DnsCacheEntry
+{
+	WCHAR Hostname[DNS_CACHE_HOSTNAME_LENGTH];
+	IN_ADDR Addresses[DNS_CACHE_MAX_ADDRESSES];
+	UINT AddressCount;
+	ULONGLONG ExpiresMs;
+	ULONGLONG StaleUntilMs;
+	BOOL Refreshing;
+	// IP literal passed in as a hostname, allowlisted but never written to hosts
+	BOOL Literal;
+} DnsCacheEntry;
+
+typedef struct _DnsQuery
+{
+	LPCWSTR Hostname;
+	BYTE Packet[DNS_QUERY_MAX_LENGTH];
+	int Length;
+	UINT Sent;
+	ULONGLONG NextSendMs;
+	BOOL Done;
+	DWORD Error;
+	IN_ADDR Addresses[DNS_CACHE_MAX_ADDRESSES];
+	UINT AddressCount;
+	DWORD TtlSeconds;
+	BOOL Literal;
+} DnsQuery;
+
+typedef struct _DnsRefresh
+{
+	UINT Count;
+	WCHAR Hostnames[1][DNS_CACHE_HOSTNAME_LENGTH];
+} DnsRefresh;
+
+static SRWLOCK CacheLock = SRWLOCK_INIT;
+static DnsCacheEntry Entries[DNS_CACHE_MAX_HOSTS];
+static UINT EntryCount = 0;
+static SOCKADDR_STORAGE Servers[DNS_CACHE_MAX_SERVERS];
+static int ServerLengths[DNS_CACHE_MAX_SERVERS];
+static UINT ServerCount = 0;
+static DnsCacheOptions Options = { DNS_DEFAULT_RETRY_MS, DNS_DEFAULT_STALE_MS, DNS_DEFAULT_MIN_TTL_SECONDS, DNS_DEFAULT_MAX_TTL_SECONDS };
+static volatile LONG QueryId = 0;
+
+static USHORT ReadBE16(const BYTE* p)
+{
+	return (USHORT)((p[0] << 8) | p[1]);
+}
+
+static void WriteBE16(BYTE* p, USHORT value)
+{
+	p[0] = (BYTE)(value >> 8);
+	p[1] = (BYTE)value;
+}
+
+static DWORD ParseAddress(LPCWSTR text, int family, USHORT port, SOCKADDR_STORAGE* address, int* addressLength)
+{
+	ADDRINFOW hints;
+	ADDRINFOW* addresses = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	int rc = GetAddrInfoW(text, NULL, &hints, &addresses);
+	if (rc != 0)
+	{
+		return (DWORD)rc;
+	}
+
+	memcpy(address, addresses->ai_addr, addresses->ai_addrlen);
+	*addressLength = (int)addresses->ai_addrlen;
+	FreeAddrInfoW(addresses);
+
+	if (address->ss_family == AF_INET)
+	{
+		((SOCKADDR_IN*)address)->sin_port = htons(port);
+	}
+	else
+	{
+		((SOCKADDR_IN6*)address)->sin6_port = htons(port);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static BOOL SameServer(const SOCKADDR_STORAGE* a, const SOCKADDR_STORAGE* b)
+{
+	if (a->ss_family != b->ss_family)
+	{
+		return FALSE;
+	}
+
+	if (a->ss_family == AF_INET)
+	{
+		const SOCKADDR_IN* x = (const SOCKADDR_IN*)a;
+		const SOCKADDR_IN* y = (const SOCKADDR_IN*)b;
+		return x->sin_port == y->sin_port && memcmp(&x->sin_addr, &y->sin_addr, sizeof(IN_ADDR)) == 0;
+	}
+
+	const SOCKADDR_IN6* x = (const SOCKADDR_IN6*)a;
+	const SOCKADDR_IN6* y = (const SOCKADDR_IN6*)b;
+	return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(IN6_ADDR)) == 0;
+}
+
+// Falls back to the adapter DNS servers, IPv4 only as that's all GetNetworkParams reports
+static UINT LoadSystemServers(SOCKADDR_STORAGE* servers, int* lengths)
+{
+	ULONG size = 0;
+	UINT count = 0;
+
+	if (GetNetworkParams(NULL, &size) != ERROR_BUFFER_OVERFLOW)
+	{
+		return 0;
+	}
+
+	FIXED_INFO* info = (FIXED_INFO*)HeapAlloc(GetProcessHeap(), 0, size);
+	if (info == NULL)
+	{
+		return 0;
+	}
+
+	if (GetNetworkParams(info, &size) == ERROR_SUCCESS)
+	{
+		for (IP_ADDR_STRING* server = &info->DnsServerList; server != NULL && count < DNS_CACHE_MAX_SERVERS; server = server->Next)
+		{
+			WCHAR text[16];
+			if (MultiByteToWideChar(CP_ACP, 0, server->IpAddress.String, -1, text, 16) == 0)
+			{
+				continue;
+			}
+
+			if (ParseAddress(text, AF_INET, DNS_DEFAULT_PORT, &servers[count], &lengths[count]) == ERROR_SUCCESS)
+			{
+				count++;
+			}
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, info);
+
+	return count;
+}
+
+// Builds a recursive A query, hostnames are expected to be ASCII already (punycode for IDNs)
+static DWORD BuildQuery(DnsQuery* query, USHORT id)
+{
+	BYTE* p = query->Packet;
+	int label = DNS_HEADER_LENGTH;
+	int length = DNS_HEADER_LENGTH + 1;
+
+	memset(p, 0, DNS_HEADER_LENGTH);
+	WriteBE16(p, id);
+	p[2] = 0x01;	// recursion desired
+	WriteBE16(p + 4, 1);
+
+	for (LPCWSTR c = query->Hostname; *c != L'\0'; c++)
+	{
+		if (*c >= 0x80 || *c <= L' ')
+		{
+			return ERROR_INVALID_NAME;
+		}
+
+		if (*c == L'.')
+		{
+			if (length - label - 1 == 0)
+			{
+				// Only a single trailing dot is allowed
+				if (c[1] != L'\0' || label == DNS_HEADER_LENGTH)
+				{
+					return ERROR_INVALID_NAME;
+				}
+				break;
+			}
+
+			p[label] = (BYTE)(length - label - 1);
+			label = length++;
+			continue;
+		}
+
+		if (length - label - 1 >= 63 || length >= DNS_HEADER_LENGTH + DNS_MAX_NAME_LENGTH - 1)
+		{
+			return ERROR_INVALID_NAME;
+		}
+
+		p[length++] = (BYTE)*c;
+	}
+
+	if (length - label - 1 == 0)
+	{
+		// Empty hostname, or the trailing dot already closed the last label
+		if (label == DNS_HEADER_LENGTH)
+		{
+			return ERROR_INVALID_NAME;
+		}
+		length--;
+	}
+	else
+	{
+		p[label] = (BYTE)(length - label - 1);
+	}
+
+	p[length++] = 0;
+	WriteBE16(p + length, DNS_TYPE_A);
+	WriteBE16(p + length + 2, DNS_CLASS_IN);
+	query->Length = length + 4;
+
+	return ERROR_SUCCESS;
+}
+
+static int SkipName(const BYTE* p, int length, int offset)
+{
+	while (offset < length)
+	{
+		BYTE b = p[offset];
+		if ((b & 0xC0) == 0xC0)
+		{
+			return offset + 2 <= length ? offset + 2 : -1;
+		}
+		if (b == 0)
+		{
+			return offset + 1;
+		}
+		offset += 1 + b;
+	}
+
+	return -1;
+}
+
+// Returns FALSE when the packet isn't an answer to query at all, otherwise fills in Error or the addresses
+static BOOL ParseResponse(const BYTE* p, int length, DnsQuery* query)
+{
+	if (length < query->Length || (p[2] & 0x80) == 0)
+	{
+		return FALSE;
+	}
+
+	// The question has to echo ours, compared case insensitively as servers may change the case
+	for (int i = DNS_HEADER_LENGTH; i < query->Length; i++)
+	{
+		BYTE a = p[i];
+		BYTE b = query->Packet[i];
+		if (a != b && !(a >= 'A' && a <= 'Z' && a + 32 == b) && !(a >= 'a' && a <= 'z' && a - 32 == b))
+		{
+			return FALSE;
+		}
+	}
+
+	BYTE rcode = p[3] & 0x0F;
+	if (rcode != 0)
+	{
+		query->Error = DNS_ERROR_RESPONSE_CODES_BASE + rcode;
+		return TRUE;
+	}
+
+	USHORT answers = ReadBE16(p + 6);
+	int offset = query->Length;
+	DWORD ttl = MAXDWORD;
+
+	query->AddressCount = 0;
+
+	for (USHORT i = 0; i < answers; i++)
+	{
+		offset = SkipName(p, length, offset);
+		if (offset < 0 || offset + 10 > length)
+		{
+			break;
+		}
+
+		USHORT type = ReadBE16(p + offset);
+		USHORT rclass = ReadBE16(p + offset + 2);
+		DWORD recordTtl = ((DWORD)ReadBE16(p + offset + 4) << 16) | ReadBE16(p + offset + 6);
+		USHORT dataLength = ReadBE16(p + offset + 8);
+		offset += 10;
+
+		if (offset + dataLength > length)
+		{
+			break;
+		}
+
+		// CNAMEs in the chain are skipped, their TTL still bounds how long the addresses are good for
+		if (type == DNS_TYPE_A && rclass == DNS_CLASS_IN && dataLength == 4 && query->AddressCount < DNS_CACHE_MAX_ADDRESSES)
+		{
+			memcpy(&query->Addresses[query->AddressCount++], p + offset, 4);
+		}
+		ttl = min(ttl, recordTtl);
+
+		offset += dataLength;
+	}
+
+	if (query->AddressCount == 0)
+	{
+		query->Error = DNS_INFO_NO_RECORDS;
+		return TRUE;
+	}
+
+	query->Error = ERROR_SUCCESS;
+	query->TtlSeconds = ttl;
+
+	return TRUE;
+}
+
+static void ReceiveResponses(SOCKET udp, DnsQuery* queries, UINT count, USHORT firstId, const SOCKADDR_STORAGE* servers, UINT serverCount, ULONGLONG now)
+{
+	BYTE buffer[DNS_RECV_BUFFER];
+	SOCKADDR_STORAGE from;
+
+	for (;;)
+	{
+		int fromLength = sizeof(from);
+		int length = recvfrom(udp, (char*)buffer, sizeof(buffer), 0, (SOCKADDR*)&from, &fromLength);
+		if (length == SOCKET_ERROR)
+		{
+			if (WSAGetLastError() == WSAECONNRESET)
+			{
+				continue;
+			}
+			return;
+		}
+
+		if (length < DNS_HEADER_LENGTH)
+		{
+			continue;
+		}
+
+		BOOL known = FALSE;
+		for (UINT i = 0; i < serverCount && !known; i++)
+		{
+			known = SameServer(&from, &servers[i]);
+		}
+
+		UINT index = (USHORT)(ReadBE16(buffer) - firstId);
+		if (!known || index >= count || queries[index].Done)
+		{
+			continue;
+		}
+
+		DnsQuery* query = &queries[index];
+		if (!ParseResponse(buffer, length, query))
+		{
+			continue;
+		}
+
+		// A server that failed or refused gets skipped straight away, the answer stays if no other server helps
+		USHORT rcode = buffer[3] & 0x0F;
+		if ((rcode == DNS_RCODE_SERVER_FAILURE || rcode == DNS_RCODE_REFUSED) && serverCount > 1)
+		{
+			query->NextSendMs = now;
+			continue;
+		}
+
+		query->Done = TRUE;
+	}
+}
+
+// Sends every query at once and collects answers from one WSAPoll loop until all are done or the deadline
+static DWORD RunQueries(DnsQuery* queries, UINT count, const SOCKADDR_STORAGE* servers, const int* serverLengths, UINT serverCount, DWORD deadlineMs, DWORD retryMs)
+{
+	DWORD result = ERROR_SUCCESS;
+	SOCKET udp[2] = { INVALID_SOCKET, INVALID_SOCKET };
+	WSAPOLLFD pollFds[2];
+	UINT pending = 0;
+
+	USHORT firstId = (USHORT)InterlockedExchangeAdd(&QueryId, (LONG)count);
+	if (firstId == 0 && count > 0)
+	{
+		firstId = (USHORT)(GetTickCount() ^ GetCurrentProcessId());
+		InterlockedExchange(&QueryId, firstId + count);
+	}
+
+	for (UINT i = 0; i < count; i++)
+	{
+		if (!queries[i].Done)
+		{
+			queries[i].Error = BuildQuery(&queries[i], (USHORT)(firstId + i));
+			queries[i].Done = queries[i].Error != ERROR_SUCCESS;
+			pending += queries[i].Done ? 0 : 1;
+		}
+	}
+
+	if (pending == 0)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	if (serverCount == 0)
+	{
+		result = ERROR_NOT_READY;
+	}
+
+	for (UINT i = 0; i < serverCount; i++)
+	{
+		UINT family = servers[i].ss_family == AF_INET ? 0 : 1;
+		if (udp[family] != INVALID_SOCKET)
+		{
+			continue;
+		}
+
+		udp[family] = socket(servers[i].ss_family, SOCK_DGRAM, IPPROTO_UDP);
+		u_long nonBlocking = 1;
+		if (udp[family] != INVALID_SOCKET && ioctlsocket(udp[family], FIONBIO, &nonBlocking) != 0)
+		{
+			closesocket(udp[family]);
+			udp[family] = INVALID_SOCKET;
+		}
+	}
+
+	ULONGLONG deadline = GetTickCount64() + deadlineMs;
+
+	while (result == ERROR_SUCCESS)
+	{
+		ULONGLONG now = GetTickCount64();
+		ULONGLONG wakeMs = deadline;
+		BOOL waiting = FALSE;
+
+		if (now >= deadline)
+		{
+			break;
+		}
+
+		for (UINT i = 0; i < count; i++)
+		{
+			DnsQuery* query = &queries[i];
+			if (query->Done)
+			{
+				continue;
+			}
+
+			if (now >= query->NextSendMs)
+			{
+				UINT server = query->Sent++ % serverCount;
+				SOCKET s = udp[servers[server].ss_family == AF_INET ? 0 : 1];
+
+				query->NextSendMs = now + retryMs;
+				if (s != INVALID_SOCKET)
+				{
+					sendto(s, (const char*)query->Packet, query->Length, 0, (const SOCKADDR*)&servers[server], serverLengths[server]);
+				}
+			}
+
+			waiting = TRUE;
+			wakeMs = min(wakeMs, query->NextSendMs);
+		}
+
+		if (!waiting)
+		{
+			break;
+		}
+
+		UINT fdCount = 0;
+		for (UINT i = 0; i < 2; i++)
+		{
+			if (udp[i] != INVALID_SOCKET)
+			{
+				pollFds[fdCount].fd = udp[i];
+				pollFds[fdCount].events = POLLRDNORM;
+				pollFds[fdCount++].revents = 0;
+			}
+		}
+
+		if (fdCount == 0)
+		{
+			result = WSAEAFNOSUPPORT;
+			break;
+		}
+
+		int ready = WSAPoll(pollFds, fdCount, wakeMs > now ? (INT)(wakeMs - now) : 0);
+		if (ready == SOCKET_ERROR)
+		{
+			result = WSAGetLastError();
+			break;
+		}
+
+		now = GetTickCount64();
+		for (UINT i = 0; i < fdCount; i++)
+		{
+			if (pollFds[i].revents != 0)
+			{
+				ReceiveResponses(pollFds[i].fd, queries, count, firstId, servers, serverCount, now);
+			}
+		}
+	}
+
+	for (UINT i = 0; i < count; i++)
+	{
+		if (!queries[i].Done && (queries[i].Error == ERROR_SUCCESS || queries[i].Sent == 0))
+		{
+			queries[i].Error = result != ERROR_SUCCESS ? result : ERROR_TIMEOUT;
+		}
+	}
+
+	for (UINT i = 0; i < 2; i++)
+	{
+		if (udp[i] != INVALID_SOCKET)
+		{
+			closesocket(udp[i]);
+		}
+	}
+
+	return result;
+}
+
+// Call with CacheLock held
+static DnsCacheEntry* FindEntry(LPCWSTR hostname)
+{
+	for (UINT i = 0; i < EntryCount; i++)
+	{
+		if (lstrcmpiW(Entries[i].Hostname, hostname) == 0)
+		{
+			return &Entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Call with CacheLock held exclusively. A full cache gives up the entry that went stale first.
+static DnsCacheEntry* AddEntry(LPCWSTR hostname)
+{
+	DnsCacheEntry* entry;
+
+	if (EntryCount < DNS_CACHE_MAX_HOSTS)
+	{
+		entry = &Entries[EntryCount++];
+	}
+	else
+	{
+		entry = &Entries[0];
+		for (UINT i = 1; i < EntryCount; i++)
+		{
+			if (Entries[i].StaleUntilMs < entry->StaleUntilMs)
+			{
+				entry = &Entries[i];
+			}
+		}
+	}
+
+	memset(entry, 0, sizeof(DnsCacheEntry));
+	StringCchCopyW(entry->Hostname, DNS_CACHE_HOSTNAME_LENGTH, hostname);
+
+	return entry;
+}
+
+static BOOL Servable(const DnsCacheEntry* entry, ULONGLONG now)
+{
+	return entry != NULL && entry->AddressCount > 0 && now < entry->StaleUntilMs;
+}
+
+static void StoreResults(const DnsQuery* queries, UINT count)
+{
+	AcquireSRWLockExclusive(&CacheLock);
+
+	ULONGLONG now = GetTickCount64();
+
+	for (UINT i = 0; i < count; i++)
+	{
+		const DnsQuery* query = &queries[i];
+		DnsCacheEntry* entry = FindEntry(query->Hostname);
+
+		// A failed lookup never replaces addresses that can still be served
+		if (query->Error != ERROR_SUCCESS || query->AddressCount == 0)
+		{
+			continue;
+		}
+
+		if (entry == NULL)
+		{
+			entry = AddEntry(query->Hostname);
+		}
+
+		DWORD ttl = max(Options.MinTtlSeconds, min(query->TtlSeconds, Options.MaxTtlSeconds));
+		memcpy(entry->Addresses, query->Addresses, query->AddressCount * sizeof(IN_ADDR));
+		entry->AddressCount = query->AddressCount;
+		entry->Literal = query->Literal;
+		entry->ExpiresMs = now + ttl * 1000ULL;
+		entry->StaleUntilMs = entry->ExpiresMs + Options.StaleMs;
+	}
+
+	ReleaseSRWLockExclusive(&CacheLock);
+}
+
+static DWORD SnapshotServers(SOCKADDR_STORAGE* servers, int* lengths, DWORD* retryMs)
+{
+	AcquireSRWLockShared(&CacheLock);
+	UINT count = ServerCount;
+	memcpy(servers, Servers, sizeof(Servers));
+	memcpy(lengths, ServerLengths, sizeof(ServerLengths));
+	*retryMs = Options.RetryMs;
+	ReleaseSRWLockShared(&CacheLock);
+
+	if (count == 0)
+	{
+		count = LoadSystemServers(servers, lengths);
+	}
+
+	return count;
+}
+
+static DWORD ResolveQueries(DnsQuery* queries, UINT count, DWORD deadlineMs)
+{
+	SOCKADDR_STORAGE servers[DNS_CACHE_MAX_SERVERS];
+	int lengths[DNS_CACHE_MAX_SERVERS];
+	DWORD retryMs;
+	WSADATA wsaData;
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	UINT serverCount = SnapshotServers(servers, lengths, &retryMs);
+
+	// IP literals never go to the wire
+	for (UINT i = 0; i < count; i++)
+	{
+		SOCKADDR_STORAGE literal;
+		int literalLength;
+
+		if (ParseAddress(queries[i].Hostname, AF_INET, 0, &literal, &literalLength) == ERROR_SUCCESS)
+		{
+			queries[i].Addresses[0] = ((SOCKADDR_IN*)&literal)->sin_addr;
+			queries[i].AddressCount = 1;
+			queries[i].TtlSeconds = MAXDWORD;
+			queries[i].Literal = TRUE;
+			queries[i].Done = TRUE;
+		}
+	}
+
+	result = RunQueries(queries, count, servers, lengths, serverCount, deadlineMs, retryMs);
+	WSACleanup();
+
+	StoreResults(queries, count);
+
+	return result;
+}
+
+static void EndRefresh(DnsRefresh* refresh)
+{
+	AcquireSRWLockExclusive(&CacheLock);
+	for (UINT i = 0; i < refresh->Count; i++)
+	{
+		DnsCacheEntry* entry = FindEntry(refresh->Hostnames[i]);
+		if (entry != NULL)
+		{
+			entry->Refreshing = FALSE;
+		}
+	}
+	ReleaseSRWLockExclusive(&CacheLock);
+
+	HeapFree(GetProcessHeap(), 0, refresh);
+}
+
+static void CALLBACK RefreshWorker(PVOID context)
+{
+	DnsRefresh* refresh = (DnsRefresh*)context;
+	DnsQuery* queries = (DnsQuery*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, refresh->Count * sizeof(DnsQuery));
+
+	if (queries != NULL)
+	{
+		for (UINT i = 0; i < refresh->Count; i++)
+		{
+			queries[i].Hostname = refresh->Hostnames[i];
+		}
+
+		DWORD result = ResolveQueries(queries, refresh->Count, DNS_REFRESH_DEADLINE_MS);
+		if (result != ERROR_SUCCESS)
+		{
+			NATIVELOG_WARNING("dns refresh of %u hosts failed, error %lu\n", refresh->Count, result);
+		}
+
+		HeapFree(GetProcessHeap(), 0, queries);
+	}
+
+	EndRefresh(refresh);
+}
+
+DWORD DnsCacheSetOptions(const DnsCacheOptions* options)
+{
+	if (options == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&CacheLock);
+	Options.RetryMs = options->RetryMs != 0 ? options->RetryMs : DNS_DEFAULT_RETRY_MS;
+	Options.StaleMs = options->StaleMs != 0 ? options->StaleMs : DNS_DEFAULT_STALE_MS;
+	Options.MinTtlSeconds = options->MinTtlSeconds != 0 ? options->MinTtlSeconds : DNS_DEFAULT_MIN_TTL_SECONDS;
+	Options.MaxTtlSeconds = options->MaxTtlSeconds != 0 ? options->MaxTtlSeconds : DNS_DEFAULT_MAX_TTL_SECONDS;
+	Options.MaxTtlSeconds = max(Options.MaxTtlSeconds, Options.MinTtlSeconds);
+	ReleaseSRWLockExclusive(&CacheLock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DnsCacheSetServers(LPCWSTR* servers, UINT serverCount, USHORT port)
+{
+	SOCKADDR_STORAGE parsed[DNS_CACHE_MAX_SERVERS];
+	int lengths[DNS_CACHE_MAX_SERVERS];
+
+	if (serverCount > DNS_CACHE_MAX_SERVERS || (serverCount > 0 && servers == NULL))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	WSADATA wsaData;
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	for (UINT i = 0; i < serverCount && result == ERROR_SUCCESS; i++)
+	{
+		result = servers[i] != NULL ? ParseAddress(servers[i], AF_UNSPEC, port != 0 ? port : DNS_DEFAULT_PORT, &parsed[i], &lengths[i]) : ERROR_INVALID_PARAMETER;
+	}
+
+	WSACleanup();
+
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	AcquireSRWLockExclusive(&CacheLock);
+	memcpy(Servers, parsed, serverCount * sizeof(SOCKADDR_STORAGE));
+	memcpy(ServerLengths, lengths, serverCount * sizeof(int));
+	ServerCount = serverCount;
+	ReleaseSRWLockExclusive(&CacheLock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DnsCacheResolve(LPCWSTR* hostnames, UINT hostnameCount, DWORD deadlineMs, DWORD* results)
+{
+	if (hostnames == NULL || results == NULL || hostnameCount == 0 || hostnameCount > DNS_CACHE_MAX_HOSTS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	for (UINT i = 0; i < hostnameCount; i++)
+	{
+		if (hostnames[i] == NULL || hostnames[i][0] == L'\0' || wcslen(hostnames[i]) >= DNS_CACHE_HOSTNAME_LENGTH)
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	DnsQuery* queries = (DnsQuery*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, hostnameCount * sizeof(DnsQuery));
+	DnsRefresh* refresh = (DnsRefresh*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DnsRefresh) + hostnameCount * sizeof(refresh->Hostnames[0]));
+	UINT* slots = (UINT*)HeapAlloc(GetProcessHeap(), 0, hostnameCount * sizeof(UINT));
+
+	if (queries == NULL || refresh == NULL || slots == NULL)
+	{
+		LPVOID blocks[] = { queries, refresh, slots };
+		for (UINT i = 0; i < 3; i++)
+		{
+			if (blocks[i] != NULL)
+			{
+				HeapFree(GetProcessHeap(), 0, blocks[i]);
+			}
+		}
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	UINT queryCount = 0;
+
+	AcquireSRWLockExclusive(&CacheLock);
+
+	ULONGLONG now = GetTickCount64();
+
+	for (UINT i = 0; i < hostnameCount; i++)
+	{
+		DnsCacheEntry* entry = FindEntry(hostnames[i]);
+
+		if (!Servable(entry, now))
+		{
+			slots[queryCount] = i;
+			queries[queryCount++].Hostname = hostnames[i];
+			continue;
+		}
+
+		results[i] = ERROR_SUCCESS;
+
+		if (now >= entry->ExpiresMs && !entry->Refreshing)
+		{
+			entry->Refreshing = TRUE;
+			StringCchCopyW(refresh->Hostnames[refresh->Count++], DNS_CACHE_HOSTNAME_LENGTH, entry->Hostname);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&CacheLock);
+
+	if (refresh->Count > 0)
+	{
+		// Never hold the caller up for a refresh, the stale addresses go out either way
+		if (ExecutorSubmit(RefreshWorker, refresh, NULL) != ERROR_SUCCESS)
+		{
+			EndRefresh(refresh);
+		}
+		refresh = NULL;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	if (queryCount > 0)
+	{
+		result = ResolveQueries(queries, queryCount, deadlineMs);
+
+		for (UINT i = 0; i < queryCount; i++)
+		{
+			results[slots[i]] = queries[i].Error;
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, queries);
+	HeapFree(GetProcessHeap(), 0, slots);
+	if (refresh != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, refresh);
+	}
+
+	return result;
+}
+
+DWORD DnsCacheGetAllowlist(
+	LPCWSTR* hostnames,
+	UINT hostnameCount,
+	WFPKS_ADDR_AND_MASK* addresses,
+	UINT addressesLength,
+	UINT* addressCount,
+	CHAR* text,
+	DWORD textLength
+)
+{
+	if (hostnames == NULL || addresses == NULL || addressCount == NULL || text == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*addressCount = 0;
+
+	// Every entry shares the one mask string at the start of text
+	if (FAILED(StringCchCopyA(text, textLength, DNS_HOST_MASK)))
+	{
+		return ERROR_MORE_DATA;
+	}
+
+	DWORD used = sizeof(DNS_HOST_MASK);
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockShared(&CacheLock);
+
+	ULONGLONG now = GetTickCount64();
+
+	for (UINT i = 0; i < hostnameCount && result == ERROR_SUCCESS; i++)
+	{
+		DnsCacheEntry* entry = hostnames[i] != NULL ? FindEntry(hostnames[i]) : NULL;
+		if (!Servable(entry, now))
+		{
+			continue;
+		}
+
+		for (UINT a = 0; a < entry->AddressCount && result == ERROR_SUCCESS; a++)
+		{
+			const BYTE* octets = (const BYTE*)&entry->Addresses[a];
+			CHAR address[16];
+
+			StringCchPrintfA(address, sizeof(address), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+
+			BOOL duplicate = FALSE;
+			for (UINT d = 0; d < *addressCount && !duplicate; d++)
+			{
+				duplicate = strcmp(addresses[d].szIpAddr, address) == 0;
+			}
+
+			if (duplicate)
+			{
+				continue;
+			}
+
+			size_t length = strlen(address) + 1;
+			if (*addressCount >= addressesLength || used + length > textLength)
+			{
+				result = ERROR_MORE_DATA;
+				break;
+			}
+
+			memcpy(text + used, address, length);
+			addresses[*addressCount].szIpAddr = text + used;
+			addresses[*addressCount].szMask = text;
+			(*addressCount)++;
+			used += (DWORD)length;
+		}
+	}
+
+	ReleaseSRWLockShared(&CacheLock);
+
+	return result;
+}
+
+DWORD DnsCacheGetHostsEntries(LPCWSTR* hostnames, UINT hostnameCount, LPWSTR buffer, DWORD bufferLength)
+{
+	if (hostnames == NULL || buffer == NULL || bufferLength == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	LPWSTR end = buffer;
+	size_t remaining = bufferLength;
+	DWORD result = ERROR_SUCCESS;
+
+	buffer[0] = L'\0';
+
+	AcquireSRWLockShared(&CacheLock);
+
+	ULONGLONG now = GetTickCount64();
+
+	for (UINT i = 0; i < hostnameCount; i++)
+	{
+		DnsCacheEntry* entry = hostnames[i] != NULL ? FindEntry(hostnames[i]) : NULL;
+		if (!Servable(entry, now) || entry->Literal)
+		{
+			continue;
+		}
+
+		// Only whole lines go in, STRSAFE_NO_TRUNCATION leaves the buffer untouched when one doesn't fit
+		const BYTE* octets = (const BYTE*)&entry->Addresses[0];
+		if (FAILED(StringCchPrintfExW(end, remaining, &end, &remaining, STRSAFE_NO_TRUNCATION, L"%s%u.%u.%u.%u %s", end == buffer ? L"" : L"\n", octets[0], octets[1], octets[2], octets[3], entry->Hostname)))
+		{
+			result = ERROR_MORE_DATA;
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&CacheLock);
+
+	return result;
+}
+
+DWORD DnsCacheFlush()
+{
+	AcquireSRWLockExclusive(&CacheLock);
+	memset(Entries, 0, sizeof(Entries));
+	EntryCount = 0;
+	ReleaseSRWLockExclusive(&CacheLock);
+
+	return ERROR_SUCCESS;
+}
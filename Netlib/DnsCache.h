@@ -0,0 +1,52 @@
+#pragma once
+#include <winsock2.h>
+#include <windows.h>
+#include "wfp_killswitch.h"
+
+// Hostnames the cache holds, also the most one DnsCacheResolve call takes
+#define DNS_CACHE_MAX_HOSTS 256
+// IPv4 addresses kept per hostname, the killswitch allowlist is IPv4 only
+#define DNS_CACHE_MAX_ADDRESSES 8
+#define DNS_CACHE_MAX_SERVERS 4
+#define DNS_CACHE_HOSTNAME_LENGTH 256
+
+// Zero fields take the defaults in DnsCache.cpp
+typedef struct _DnsCacheOptions
+{
+	// Gap before a query is resent, each retry goes to the next server
+	DWORD RetryMs;
+	// How long past its TTL an entry is still handed out while a background refresh runs
+	DWORD StaleMs;
+	DWORD MinTtlSeconds;
+	DWORD MaxTtlSeconds;
+} DnsCacheOptions;
+
+extern DWORD DnsCacheSetOptions(const DnsCacheOptions* options);
+
+// Sets the servers queried directly over UDP, port 0 means 53. With no servers the adapter DNS servers from
+// GetNetworkParams are used, which should be done before the killswitch starts blocking them.
+extern DWORD DnsCacheSetServers(LPCWSTR* servers, UINT serverCount, USHORT port);
+
+// Resolves every hostname that has no usable entry concurrently and waits at most deadlineMs. Fresh entries
+// are answered from the cache, entries past their TTL but inside StaleMs are answered from the cache and
+// refreshed in the background. results[i] is ERROR_SUCCESS when hostnames[i] has addresses, otherwise the
+// DNS error, ERROR_TIMEOUT when the deadline passed first.
+extern DWORD DnsCacheResolve(LPCWSTR* hostnames, UINT hostnameCount, DWORD deadlineMs, DWORD* results);
+
+// Writes the cached addresses of hostnames as a /32 allowlist ready for WfpksEnable2, duplicates removed.
+// The strings the entries point to live in text. Hostnames without an entry are skipped, ERROR_MORE_DATA
+// means addresses or text filled up first.
+extern DWORD DnsCacheGetAllowlist(
+	LPCWSTR* hostnames,
+	UINT hostnameCount,
+	WFPKS_ADDR_AND_MASK* addresses,
+	UINT addressesLength,
+	UINT* addressCount,
+	CHAR* text,
+	DWORD textLength
+);
+
+// Writes one "address hostname" hosts file line per cached hostname, newline separated
+extern DWORD DnsCacheGetHostsEntries(LPCWSTR* hostnames, UINT hostnameCount, LPWSTR buffer, DWORD bufferLength);
+
+extern DWORD DnsCacheFlush();
@@ -0,0 +1,1671 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <bcrypt.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <strsafe.h>
+#include "DnsForwarder.h"
+#include "NativeLog.h"
+#include "Helpers.h"
+
+#define DNS_FORWARDER_DEFAULT_RETRY_MS 500
+#define DNS_FORWARDER_DEFAULT_ATTEMPTS 3
+#define DNS_FORWARDER_DEFAULT_CACHE_ENTRIES 4096
+#define DNS_FORWARDER_DEFAULT_MAX_TTL_SECONDS (24 * 60 * 60)
+#define DNS_FORWARDER_DEFAULT_MAX_NEGATIVE_TTL_SECONDS (15 * 60)
+#define DNS_FORWARDER_DEFAULT_PIN_TTL_SECONDS 60
+// Datagrams read from one socket before the loop looks at the others
+#define DNS_FORWARDER_BATCH 64
+#define DNS_FORWARDER_RANDOM_IDS 64
+
+#define DNS_UPSTREAM_PORT 53
+#define DNS_HEADER_LENGTH 12
+#define DNS_MAX_NAME_LENGTH 255
+// Lowercased name, type and class
+#define DNS_KEY_LENGTH (DNS_MAX_NAME_LENGTH + 4)
+// Largest query forwarded, far more than a question and an EDNS record take
+#define DNS_QUERY_LENGTH 512
+// What a client without EDNS takes over UDP
+#define DNS_CLASSIC_UDP_LENGTH 512
+#define DNS_PACKET_LENGTH 4096
+// Larger responses are relayed but not cached
+#define DNS_CACHE_PACKET_LENGTH 1232
+#define DNS_CACHE_MAX_RECORDS 64
+#define DNS_ANSWER_LENGTH 16
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_OPT 41
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_RESPONSE 0x80
+#define DNS_FLAG_AUTHORITATIVE 0x04
+#define DNS_FLAG_TRUNCATED 0x02
+#define DNS_FLAG_RECURSION_DESIRED 0x01
+#define DNS_FLAG_RECURSION_AVAILABLE 0x80
+#define DNS_OPCODE_MASK 0x78
+#define DNS_RCODE_MASK 0x0F
+#define DNS_RCODE_FORMAT_ERROR 1
+#define DNS_RCODE_SERVER_FAILURE 2
+#define DNS_RCODE_NAME_ERROR 3
+#define DNS_RCODE_NOT_IMPLEMENTED 4
+#define DNS_RCODE_REFUSED 5
+
+#define BENCH_WINDOW 64
+#define BENCH_TIMEOUT_MS 2000
+#define BENCH_TTL_SECONDS 300
+#define BENCH_LOOKUP_ROUNDS 10
+
+typedef struct _DnsQuestion
+{
+	BYTE Key[DNS_KEY_LENGTH];
+	UINT KeyLength;
+	UINT32 Hash;
+	// Bytes the question takes after the header
+	UINT Length;
+	USHORT Type;
+	USHORT Class;
+	// Largest response the client takes over UDP
+	UINT UdpLength;
+} DnsQuestion;
+
+typedef struct _DnsPin
+{
+	// Lowercased, in wire format
+	BYTE Name[DNS_MAX_NAME_LENGTH];
+	UINT NameLength;
+	UINT32 Hash;
+	IN_ADDR Addresses[DNS_FORWARDER_MAX_PIN_ADDRESSES];
+	UINT AddressCount;
+} DnsPin;
+
+typedef struct _ForwarderCacheItem
+{
+	struct _ForwarderCacheItem* HashNext;
+	// Neighbours in the shard's LRU list
+	struct _ForwarderCacheItem* Newer;
+	struct _ForwarderCacheItem* Older;
+	UINT32 Hash;
+	UINT16 KeyLength;
+	UINT16 PacketLength;
+	UINT16 TtlCount;
+	BOOL Negative;
+	ULONGLONG StoredMs;
+	ULONGLONG ExpiresMs;
+	// Where each record's TTL is in Packet, counted down on the way out
+	UINT16 TtlOffsets[DNS_CACHE_MAX_RECORDS];
+	BYTE Key[DNS_KEY_LENGTH];
+	BYTE Packet[1];
+} ForwarderCacheItem;
+
+typedef struct _ForwarderShard
+{
+	SRWLOCK Lock;
+	ForwarderCacheItem** Buckets;
+	UINT BucketMask;
+	ForwarderCacheItem* Newest;
+	ForwarderCacheItem* Oldest;
+	UINT Count;
+	UINT Capacity;
+	UINT64 Evictions;
+} ForwarderShard;
+
+typedef struct _ForwarderPending
+{
+	// Neighbours in send order, which is deadline order as every send waits RetryMs
+	struct _ForwarderPending* Earlier;
+	struct _ForwarderPending* Later;
+	SOCKADDR_IN Client;
+	USHORT ClientId;
+	USHORT Id;
+	UINT Upstream;
+	UINT Attempts;
+	ULONGLONG DeadlineMs;
+	DnsQuestion Question;
+	// As the client sent it other than the ID
+	BYTE Query[DNS_QUERY_LENGTH];
+	int Length;
+} ForwarderPending;
+
+typedef struct _DnsForwarder
+{
+	SOCKET Listen;
+	// For the upstreams of each address family, IPv4 then IPv6
+	SOCKET Upstream[2];
+	SOCKADDR_STORAGE Upstreams[DNS_FORWARDER_MAX_UPSTREAMS];
+	int UpstreamLengths[DNS_FORWARDER_MAX_UPSTREAMS];
+	UINT UpstreamCount;
+	UINT NextUpstream;
+	SOCKADDR_IN Address;
+	DnsForwarderOptions Options;
+	volatile LONG Stopping;
+	HANDLE Thread;
+	// Written by the forwarder thread alone
+	DnsForwarderStats Stats;
+	ForwarderShard Shards[DNS_FORWARDER_CACHE_SHARDS];
+	ForwarderPending* Earliest;
+	ForwarderPending* Latest;
+	UINT FreeCount;
+	UINT16 FreeSlots[DNS_FORWARDER_MAX_PENDING];
+	USHORT RandomIds[DNS_FORWARDER_RANDOM_IDS];
+	UINT RandomIdsLeft;
+	// Pending slot + 1 by the ID it went upstream with, 0 for IDs not in use
+	UINT16 SlotsById[65536];
+	ForwarderPending Pending[DNS_FORWARDER_MAX_PENDING];
+} DnsForwarder;
+
+static SRWLOCK ForwarderLock = SRWLOCK_INIT;
+static DnsForwarder* Running;
+
+static SRWLOCK PinLock = SRWLOCK_INIT;
+static DnsPin* Pins;
+static UINT PinCount;
+
+static USHORT ReadBE16(const BYTE* p)
+{
+	return (USHORT)((p[0] << 8) | p[1]);
+}
+
+static DWORD ReadBE32(const BYTE* p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static void WriteBE16(BYTE* p, USHORT value)
+{
+	p[0] = (BYTE)(value >> 8);
+	p[1] = (BYTE)value;
+}
+
+static void WriteBE32(BYTE* p, DWORD value)
+{
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+// FNV-1a
+static UINT32 HashBytes(const BYTE* p, UINT length)
+{
+	UINT32 hash = 2166136261U;
+
+	for (UINT i = 0; i < length; i++)
+	{
+		hash = (hash ^ p[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+static int SkipName(const BYTE* p, int length, int offset)
+{
+	while (offset < length)
+	{
+		BYTE b = p[offset];
+		if ((b & 0xC0) == 0xC0)
+		{
+			return offset + 2 <= length ? offset + 2 : -1;
+		}
+		if (b == 0)
+		{
+			return offset + 1;
+		}
+		offset += 1 + b;
+	}
+
+	return -1;
+}
+
+// Reads the one question of a query or response into its cache key, the rcode to answer with when it's no good
+static BYTE ParseQuestion(const BYTE* p, int length, DnsQuestion* question)
+{
+	UINT keyLength = 0;
+	int offset = DNS_HEADER_LENGTH;
+
+	if (length < DNS_HEADER_LENGTH || ReadBE16(p + 4) != 1)
+	{
+		return DNS_RCODE_FORMAT_ERROR;
+	}
+
+	for (;;)
+	{
+		if (offset >= length)
+		{
+			return DNS_RCODE_FORMAT_ERROR;
+		}
+
+		BYTE label = p[offset++];
+		if (label == 0)
+		{
+			break;
+		}
+
+		// Compression has nothing to point back to in a question
+		if (label > 63 || offset + label > length || keyLength + label + 2 > DNS_MAX_NAME_LENGTH)
+		{
+			return DNS_RCODE_FORMAT_ERROR;
+		}
+
+		question->Key[keyLength++] = label;
+		for (BYTE i = 0; i < label; i++)
+		{
+			BYTE c = p[offset++];
+			question->Key[keyLength++] = c >= 'A' && c <= 'Z' ? c + 32 : c;
+		}
+	}
+
+	if (offset + 4 > length)
+	{
+		return DNS_RCODE_FORMAT_ERROR;
+	}
+
+	question->Key[keyLength++] = 0;
+	memcpy(question->Key + keyLength, p + offset, 4);
+	question->KeyLength = keyLength + 4;
+	question->Hash = HashBytes(question->Key, question->KeyLength);
+	question->Type = ReadBE16(p + offset);
+	question->Class = ReadBE16(p + offset + 2);
+	offset += 4;
+	question->Length = offset - DNS_HEADER_LENGTH;
+	question->UdpLength = DNS_CLASSIC_UDP_LENGTH;
+
+	// An EDNS record straight after the question raises the UDP limit
+	if (ReadBE16(p + 6) == 0 && ReadBE16(p + 8) == 0 && ReadBE16(p + 10) > 0 && offset + 11 <= length
+		&& p[offset] == 0 && ReadBE16(p + offset + 1) == DNS_TYPE_OPT)
+	{
+		question->UdpLength = max(question->UdpLength, (UINT)ReadBE16(p + offset + 3));
+	}
+
+	return 0;
+}
+
+// Lowercased wire format of an ASCII hostname (punycode for IDNs), one trailing dot allowed
+static DWORD EncodeName(LPCWSTR hostname, BYTE* name, UINT* nameLength)
+{
+	UINT label = 0;
+	UINT length = 1;
+	BOOL closed = FALSE;
+
+	for (LPCWSTR c = hostname; *c != L'\0' && !closed; c++)
+	{
+		if (*c >= 0x80 || *c <= L' ')
+		{
+			return ERROR_INVALID_NAME;
+		}
+
+		if (*c == L'.')
+		{
+			if (length - label - 1 == 0)
+			{
+				return ERROR_INVALID_NAME;
+			}
+
+			name[label] = (BYTE)(length - label - 1);
+			closed = c[1] == L'\0';
+			if (!closed)
+			{
+				label = length++;
+			}
+			continue;
+		}
+
+		if (length - label - 1 >= 63 || length >= DNS_MAX_NAME_LENGTH - 1)
+		{
+			return ERROR_INVALID_NAME;
+		}
+
+		name[length++] = (BYTE)(*c >= L'A' && *c <= L'Z' ? *c + 32 : *c);
+	}
+
+	if (!closed)
+	{
+		if (length - label - 1 == 0)
+		{
+			return ERROR_INVALID_NAME;
+		}
+		name[label] = (BYTE)(length - label - 1);
+	}
+
+	name[length++] = 0;
+	*nameLength = length;
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD ParseUpstream(LPCWSTR text, USHORT port, SOCKADDR_STORAGE* address, int* addressLength)
+{
+	ADDRINFOW hints;
+	ADDRINFOW* addresses = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	int rc = GetAddrInfoW(text, NULL, &hints, &addresses);
+	if (rc != 0)
+	{
+		return (DWORD)rc;
+	}
+
+	memcpy(address, addresses->ai_addr, addresses->ai_addrlen);
+	*addressLength = (int)addresses->ai_addrlen;
+	FreeAddrInfoW(addresses);
+
+	if (address->ss_family == AF_INET)
+	{
+		((SOCKADDR_IN*)address)->sin_port = htons(port);
+	}
+	else
+	{
+		((SOCKADDR_IN6*)address)->sin6_port = htons(port);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static BOOL SameAddress(const SOCKADDR_STORAGE* a, const SOCKADDR_STORAGE* b)
+{
+	if (a->ss_family != b->ss_family)
+	{
+		return FALSE;
+	}
+
+	if (a->ss_family == AF_INET)
+	{
+		const SOCKADDR_IN* x = (const SOCKADDR_IN*)a;
+		const SOCKADDR_IN* y = (const SOCKADDR_IN*)b;
+		return x->sin_port == y->sin_port && memcmp(&x->sin_addr, &y->sin_addr, sizeof(IN_ADDR)) == 0;
+	}
+
+	const SOCKADDR_IN6* x = (const SOCKADDR_IN6*)a;
+	const SOCKADDR_IN6* y = (const SOCKADDR_IN6*)b;
+	return x->sin6_port == y->sin6_port && memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(IN6_ADDR)) == 0;
+}
+
+// A response echoing the question, when there is one, with count A records
+static int BuildReply(const BYTE* query, const DnsQuestion* question, BYTE rcode, BOOL authoritative, const IN_ADDR* addresses, UINT count, DWORD ttl, BYTE* reply)
+{
+	int length = DNS_HEADER_LENGTH;
+
+	memcpy(reply, query, 2);
+	reply[2] = DNS_FLAG_RESPONSE | (query[2] & (DNS_OPCODE_MASK | DNS_FLAG_RECURSION_DESIRED)) | (authoritative ? DNS_FLAG_AUTHORITATIVE : 0);
+	reply[3] = DNS_FLAG_RECURSION_AVAILABLE | rcode;
+	WriteBE16(reply + 4, question != NULL ? 1 : 0);
+	WriteBE16(reply + 6, (USHORT)count);
+	WriteBE16(reply + 8, 0);
+	WriteBE16(reply + 10, 0);
+
+	if (question != NULL)
+	{
+		memcpy(reply + length, query + DNS_HEADER_LENGTH, question->Length);
+		length += question->Length;
+	}
+
+	for (UINT i = 0; i < count; i++)
+	{
+		// Pointer to the name in the question
+		reply[length] = 0xC0;
+		reply[length + 1] = DNS_HEADER_LENGTH;
+		WriteBE16(reply + length + 2, DNS_TYPE_A);
+		WriteBE16(reply + length + 4, DNS_CLASS_IN);
+		WriteBE32(reply + length + 6, ttl);
+		WriteBE16(reply + length + 10, sizeof(IN_ADDR));
+		memcpy(reply + length + 12, &addresses[i], sizeof(IN_ADDR));
+		length += DNS_ANSWER_LENGTH;
+	}
+
+	return length;
+}
+
+// Answers from the pin table, FALSE when the name isn't pinned
+static BOOL AnswerPinned(const DnsForwarder* forwarder, const BYTE* query, const DnsQuestion* question, BYTE* reply, int* replyLength)
+{
+	BOOL pinned = FALSE;
+
+	AcquireSRWLockShared(&PinLock);
+
+	if (PinCount > 0)
+	{
+		UINT nameLength = question->KeyLength - 4;
+		UINT32 hash = HashBytes(question->Key, nameLength);
+
+		for (UINT i = 0; i < PinCount && !pinned; i++)
+		{
+			const DnsPin* pin = &Pins[i];
+			if (pin->Hash != hash || pin->NameLength != nameLength || memcmp(pin->Name, question->Key, nameLength) != 0)
+			{
+				continue;
+			}
+
+			// Other types get an empty answer rather than going upstream about a pinned name
+			BOOL addresses = question->Type == DNS_TYPE_A && question->Class == DNS_CLASS_IN;
+			*replyLength = BuildReply(query, question, 0, TRUE, pin->Addresses, addresses ? pin->AddressCount : 0, forwarder->Options.PinTtlSeconds, reply);
+			pinned = TRUE;
+		}
+	}
+
+	ReleaseSRWLockShared(&PinLock);
+
+	return pinned;
+}
+
+static ForwarderShard* ShardFor(DnsForwarder* forwarder, UINT32 hash)
+{
+	// The top bits, the bottom ones pick the bucket
+	return &forwarder->Shards[hash >> 28];
+}
+
+static_assert(DNS_FORWARDER_CACHE_SHARDS == 16, "ShardFor takes 4 bits of the hash");
+
+// Call with the shard's lock held
+static ForwarderCacheItem* FindItem(ForwarderShard* shard, const BYTE* key, UINT keyLength, UINT32 hash)
+{
+	for (ForwarderCacheItem* item = shard->Buckets[hash & shard->BucketMask]; item != NULL; item = item->HashNext)
+	{
+		if (item->Hash == hash && item->KeyLength == keyLength && memcmp(item->Key, key, keyLength) == 0)
+		{
+			return item;
+		}
+	}
+
+	return NULL;
+}
+
+// Call with the shard's lock held
+static void UnlinkLru(ForwarderShard* shard, ForwarderCacheItem* item)
+{
+	if (item->Newer != NULL)
+	{
+		item->Newer->Older = item->Older;
+	}
+	else
+	{
+		shard->Newest = item->Older;
+	}
+
+	if (item->Older != NULL)
+	{
+		item->Older->Newer = item->Newer;
+	}
+	else
+	{
+		shard->Oldest = item->Newer;
+	}
+}
+
+// Call with the shard's lock held
+static void UnlinkItem(ForwarderShard* shard, ForwarderCacheItem* item)
+{
+	ForwarderCacheItem** link = &shard->Buckets[item->Hash & shard->BucketMask];
+	while (*link != item)
+	{
+		link = &(*link)->HashNext;
+	}
+	*link = item->HashNext;
+
+	UnlinkLru(shard, item);
+	shard->Count--;
+}
+
+// Call with the shard's lock held
+static void PushNewest(ForwarderShard* shard, ForwarderCacheItem* item)
+{
+	item->Newer = NULL;
+	item->Older = shard->Newest;
+
+	if (shard->Newest != NULL)
+	{
+		shard->Newest->Newer = item;
+	}
+	else
+	{
+		shard->Oldest = item;
+	}
+
+	shard->Newest = item;
+}
+
+// Copies the cached response into packet with its TTLs counted down, 0 when there's none that fits length
+static int CacheLookup(DnsForwarder* forwarder, const DnsQuestion* question, ULONGLONG now, BYTE* packet, UINT length, BOOL* negative)
+{
+	ForwarderShard* shard = ShardFor(forwarder, question->Hash);
+	int found = 0;
+
+	AcquireSRWLockExclusive(&shard->Lock);
+
+	ForwarderCacheItem* item = FindItem(shard, question->Key, question->KeyLength, question->Hash);
+	if (item != NULL && now >= item->ExpiresMs)
+	{
+		UnlinkItem(shard, item);
+		HeapFree(GetProcessHeap(), 0, item);
+		item = NULL;
+	}
+
+	if (item != NULL && item->PacketLength <= length)
+	{
+		if (shard->Newest != item)
+		{
+			UnlinkLru(shard, item);
+			PushNewest(shard, item);
+		}
+
+		DWORD elapsed = (DWORD)((now - item->StoredMs) / 1000);
+
+		memcpy(packet, item->Packet, item->PacketLength);
+		for (UINT i = 0; i < item->TtlCount; i++)
+		{
+			BYTE* ttl = packet + item->TtlOffsets[i];
+			DWORD remaining = ReadBE32(ttl);
+			WriteBE32(ttl, remaining > elapsed ? remaining - elapsed : 0);
+		}
+
+		*negative = item->Negative;
+		found = item->PacketLength;
+	}
+
+	ReleaseSRWLockExclusive(&shard->Lock);
+
+	return found;
+}
+
+// Works out whether an upstream response can be cached and for how long, and where its TTLs are
+static BOOL AnalyseResponse(const BYTE* p, int length, const DnsQuestion* question, ForwarderCacheItem* item, DWORD* ttl)
+{
+	BYTE rcode = p[3] & DNS_RCODE_MASK;
+
+	if (length > DNS_CACHE_PACKET_LENGTH || (p[2] & DNS_FLAG_TRUNCATED) != 0 || (rcode != 0 && rcode != DNS_RCODE_NAME_ERROR))
+	{
+		return FALSE;
+	}
+
+	UINT answers = ReadBE16(p + 6);
+	UINT authority = ReadBE16(p + 8);
+	UINT records = answers + authority + ReadBE16(p + 10);
+	int offset = DNS_HEADER_LENGTH + question->Length;
+	DWORD recordsTtl = MAXDWORD;
+	DWORD negativeTtl = MAXDWORD;
+
+	item->TtlCount = 0;
+
+	for (UINT i = 0; i < records; i++)
+	{
+		offset = SkipName(p, length, offset);
+		if (offset < 0 || offset + 10 > length)
+		{
+			return FALSE;
+		}
+
+		USHORT type = ReadBE16(p + offset);
+		DWORD recordTtl = ReadBE32(p + offset + 4);
+		USHORT dataLength = ReadBE16(p + offset + 8);
+
+		if (offset + 10 + dataLength > length)
+		{
+			return FALSE;
+		}
+
+		// The OPT record's TTL field holds EDNS flags
+		if (type != DNS_TYPE_OPT)
+		{
+			if (item->TtlCount >= DNS_CACHE_MAX_RECORDS)
+			{
+				return FALSE;
+			}
+
+			item->TtlOffsets[item->TtlCount++] = (UINT16)(offset + 4);
+			recordsTtl = min(recordsTtl, recordTtl);
+
+			// RFC 2308, a negative answer lasts the lesser of the SOA's TTL and its MINIMUM, the last field
+			if (type == DNS_TYPE_SOA && i >= answers && i < answers + authority && dataLength >= 22)
+			{
+				negativeTtl = min(negativeTtl, min(recordTtl, ReadBE32(p + offset + 10 + dataLength - 4)));
+			}
+		}
+
+		offset += 10 + dataLength;
+	}
+
+	// Without an SOA there's nothing to say how long a negative answer holds, so it isn't cached
+	item->Negative = rcode == DNS_RCODE_NAME_ERROR || answers == 0;
+	*ttl = item->Negative ? negativeTtl : recordsTtl;
+
+	return *ttl != 0 && *ttl != MAXDWORD;
+}
+
+static void CacheStore(DnsForwarder* forwarder, const DnsQuestion* question, const BYTE* packet, int length, ULONGLONG now)
+{
+	DWORD ttl;
+
+	if (length > DNS_CACHE_PACKET_LENGTH)
+	{
+		return;
+	}
+
+	ForwarderCacheItem* item = (ForwarderCacheItem*)HeapAlloc(GetProcessHeap(), 0, offsetof(ForwarderCacheItem, Packet) + length);
+	if (item == NULL)
+	{
+		return;
+	}
+
+	if (!AnalyseResponse(packet, length, question, item, &ttl))
+	{
+		HeapFree(GetProcessHeap(), 0, item);
+		return;
+	}
+
+	ttl = min(ttl, item->Negative ? forwarder->Options.MaxNegativeTtlSeconds : forwarder->Options.MaxTtlSeconds);
+	item->Hash = question->Hash;
+	item->KeyLength = (UINT16)question->KeyLength;
+	item->PacketLength = (UINT16)length;
+	item->StoredMs = now;
+	item->ExpiresMs = now + ttl * 1000ULL;
+	memcpy(item->Key, question->Key, question->KeyLength);
+	memcpy(item->Packet, packet, length);
+
+	ForwarderShard* shard = ShardFor(forwarder, question->Hash);
+	ForwarderCacheItem* evicted = NULL;
+
+	AcquireSRWLockExclusive(&shard->Lock);
+
+	ForwarderCacheItem* existing = FindItem(shard, question->Key, question->KeyLength, question->Hash);
+	if (existing != NULL)
+	{
+		UnlinkItem(shard, existing);
+		evicted = existing;
+	}
+	else if (shard->Count >= shard->Capacity)
+	{
+		evicted = shard->Oldest;
+		UnlinkItem(shard, evicted);
+		shard->Evictions++;
+	}
+
+	item->HashNext = shard->Buckets[item->Hash & shard->BucketMask];
+	shard->Buckets[item->Hash & shard->BucketMask] = item;
+	PushNewest(shard, item);
+	shard->Count++;
+
+	ReleaseSRWLockExclusive(&shard->Lock);
+
+	if (evicted != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, evicted);
+	}
+}
+
+static void CacheClear(ForwarderShard* shard)
+{
+	AcquireSRWLockExclusive(&shard->Lock);
+
+	ForwarderCacheItem* item = shard->Newest;
+	while (item != NULL)
+	{
+		ForwarderCacheItem* older = item->Older;
+		HeapFree(GetProcessHeap(), 0, item);
+		item = older;
+	}
+
+	memset(shard->Buckets, 0, (shard->BucketMask + 1) * sizeof(ForwarderCacheItem*));
+	shard->Newest = NULL;
+	shard->Oldest = NULL;
+	shard->Count = 0;
+
+	ReleaseSRWLockExclusive(&shard->Lock);
+}
+
+static void SendTo(SOCKET s, const BYTE* packet, int length, const SOCKADDR* address, int addressLength)
+{
+	// Lost like any datagram when it fails, the client retries
+	sendto(s, (const char*)packet, length, 0, address, addressLength);
+}
+
+static void UnlinkPending(DnsForwarder* forwarder, ForwarderPending* pending)
+{
+	if (pending->Earlier != NULL)
+	{
+		pending->Earlier->Later = pending->Later;
+	}
+	else
+	{
+		forwarder->Earliest = pending->Later;
+	}
+
+	if (pending->Later != NULL)
+	{
+		pending->Later->Earlier = pending->Earlier;
+	}
+	else
+	{
+		forwarder->Latest = pending->Earlier;
+	}
+}
+
+static void SendPending(DnsForwarder* forwarder, ForwarderPending* pending, ULONGLONG now)
+{
+	const SOCKADDR_STORAGE* upstream = &forwarder->Upstreams[pending->Upstream];
+
+	SendTo(forwarder->Upstream[upstream->ss_family == AF_INET ? 0 : 1], pending->Query, pending->Length, (const SOCKADDR*)upstream, forwarder->UpstreamLengths[pending->Upstream]);
+
+	if (pending->Attempts++ > 0)
+	{
+		UnlinkPending(forwarder, pending);
+	}
+
+	pending->DeadlineMs = now + forwarder->Options.RetryMs;
+	pending->Later = NULL;
+	pending->Earlier = forwarder->Latest;
+
+	if (forwarder->Latest != NULL)
+	{
+		forwarder->Latest->Later = pending;
+	}
+	else
+	{
+		forwarder->Earliest = pending;
+	}
+
+	forwarder->Latest = pending;
+}
+
+static void FreePending(DnsForwarder* forwarder, ForwarderPending* pending)
+{
+	UnlinkPending(forwarder, pending);
+	forwarder->SlotsById[pending->Id] = 0;
+	forwarder->FreeSlots[forwarder->FreeCount++] = (UINT16)(pending - forwarder->Pending);
+}
+
+static void ReplyFailed(DnsForwarder* forwarder, ForwarderPending* pending, BYTE* reply)
+{
+	WriteBE16(pending->Query, pending->ClientId);
+
+	int length = BuildReply(pending->Query, &pending->Question, DNS_RCODE_SERVER_FAILURE, FALSE, NULL, 0, 0, reply);
+	SendTo(forwarder->Listen, reply, length, (const SOCKADDR*)&pending->Client, sizeof(pending->Client));
+}
+
+// A random ID not in use, so an off-path answer has to guess it as well as the port
+static USHORT NextQueryId(DnsForwarder* forwarder)
+{
+	for (;;)
+	{
+		if (forwarder->RandomIdsLeft == 0)
+		{
+			// Doesn't fail with the system RNG, the IDs left over from before would do if it did
+			BCryptGenRandom(NULL, (PUCHAR)forwarder->RandomIds, sizeof(forwarder->RandomIds), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+			forwarder->RandomIdsLeft = DNS_FORWARDER_RANDOM_IDS;
+		}
+
+		USHORT id = forwarder->RandomIds[--forwarder->RandomIdsLeft];
+		if (forwarder->SlotsById[id] == 0)
+		{
+			return id;
+		}
+	}
+}
+
+static void Forward(DnsForwarder* forwarder, const BYTE* query, int length, const DnsQuestion* question, const SOCKADDR_IN* client, ULONGLONG now, BYTE* reply)
+{
+	if (length > DNS_QUERY_LENGTH || forwarder->FreeCount == 0)
+	{
+		forwarder->Stats.Dropped++;
+		int replyLength = BuildReply(query, question, DNS_RCODE_SERVER_FAILURE, FALSE, NULL, 0, 0, reply);
+		SendTo(forwarder->Listen, reply, replyLength, (const SOCKADDR*)client, sizeof(*client));
+		return;
+	}
+
+	ForwarderPending* pending = &forwarder->Pending[forwarder->FreeSlots[--forwarder->FreeCount]];
+
+	pending->Id = NextQueryId(forwarder);
+	pending->ClientId = ReadBE16(query);
+	pending->Client = *client;
+	pending->Question = *question;
+	pending->Attempts = 0;
+	pending->Length = length;
+	pending->Upstream = forwarder->NextUpstream++ % forwarder->UpstreamCount;
+	memcpy(pending->Query, query, length);
+	WriteBE16(pending->Query, pending->Id);
+	forwarder->SlotsById[pending->Id] = (UINT16)(pending - forwarder->Pending + 1);
+
+	forwarder->Stats.Forwarded++;
+	SendPending(forwarder, pending, now);
+}
+
+static void HandleQuery(DnsForwarder* forwarder, const BYTE* query, int length, const SOCKADDR_IN* client, ULONGLONG now, BYTE* reply)
+{
+	DnsQuestion question;
+	BOOL negative;
+	int replyLength;
+
+	if (length < DNS_HEADER_LENGTH || (query[2] & DNS_FLAG_RESPONSE) != 0)
+	{
+		forwarder->Stats.Dropped++;
+		return;
+	}
+
+	forwarder->Stats.Queries++;
+
+	BYTE rcode = (query[2] & DNS_OPCODE_MASK) != 0 ? DNS_RCODE_NOT_IMPLEMENTED : ParseQuestion(query, length, &question);
+	if (rcode != 0)
+	{
+		forwarder->Stats.Dropped++;
+		replyLength = BuildReply(query, NULL, rcode, FALSE, NULL, 0, 0, reply);
+		SendTo(forwarder->Listen, reply, replyLength, (const SOCKADDR*)client, sizeof(*client));
+		return;
+	}
+
+	if (AnswerPinned(forwarder, query, &question, reply, &replyLength))
+	{
+		forwarder->Stats.PinnedAnswers++;
+		SendTo(forwarder->Listen, reply, replyLength, (const SOCKADDR*)client, sizeof(*client));
+		return;
+	}
+
+	replyLength = CacheLookup(forwarder, &question, now, reply, question.UdpLength, &negative);
+	if (replyLength > 0)
+	{
+		// The client's ID and question, it may have mixed the case of the name on purpose
+		memcpy(reply, query, 2);
+		memcpy(reply + DNS_HEADER_LENGTH, query + DNS_HEADER_LENGTH, question.Length);
+
+		forwarder->Stats.CacheHits++;
+		forwarder->Stats.NegativeHits += negative ? 1 : 0;
+		SendTo(forwarder->Listen, reply, replyLength, (const SOCKADDR*)client, sizeof(*client));
+		return;
+	}
+
+	Forward(forwarder, query, length, &question, client, now, reply);
+}
+
+static void HandleResponse(DnsForwarder* forwarder, BYTE* response, int length, const SOCKADDR_STORAGE* from, ULONGLONG now)
+{
+	DnsQuestion question;
+	BOOL known = FALSE;
+
+	for (UINT i = 0; i < forwarder->UpstreamCount && !known; i++)
+	{
+		known = SameAddress(from, &forwarder->Upstreams[i]);
+	}
+
+	UINT16 slot = known && length >= DNS_HEADER_LENGTH && (response[2] & DNS_FLAG_RESPONSE) != 0 ? forwarder->SlotsById[ReadBE16(response)] : 0;
+	ForwarderPending* pending = slot != 0 ? &forwarder->Pending[slot - 1] : NULL;
+
+	if (pending == NULL || ParseQuestion(response, length, &question) != 0
+		|| question.KeyLength != pending->Question.KeyLength || memcmp(question.Key, pending->Question.Key, question.KeyLength) != 0)
+	{
+		forwarder->Stats.Dropped++;
+		return;
+	}
+
+	// An upstream that failed or refused gets skipped straight away while there are sends left
+	BYTE rcode = response[3] & DNS_RCODE_MASK;
+	if ((rcode == DNS_RCODE_SERVER_FAILURE || rcode == DNS_RCODE_REFUSED) && forwarder->UpstreamCount > 1 && pending->Attempts < forwarder->Options.Attempts)
+	{
+		pending->Upstream = (pending->Upstream + 1) % forwarder->UpstreamCount;
+		forwarder->Stats.Retries++;
+		SendPending(forwarder, pending, now);
+		return;
+	}
+
+	CacheStore(forwarder, &question, response, length, now);
+
+	WriteBE16(response, pending->ClientId);
+	memcpy(response + DNS_HEADER_LENGTH, pending->Query + DNS_HEADER_LENGTH, question.Length);
+	FreePending(forwarder, pending);
+	SendTo(forwarder->Listen, response, length, (const SOCKADDR*)&pending->Client, sizeof(pending->Client));
+}
+
+// Resends the queries whose upstream is taking too long to the next one, fails those out of sends
+static void ExpirePending(DnsForwarder* forwarder, ULONGLONG now, BYTE* reply)
+{
+	while (forwarder->Earliest != NULL && forwarder->Earliest->DeadlineMs <= now)
+	{
+		ForwarderPending* pending = forwarder->Earliest;
+
+		if (pending->Attempts < forwarder->Options.Attempts)
+		{
+			pending->Upstream = (pending->Upstream + 1) % forwarder->UpstreamCount;
+			forwarder->Stats.Retries++;
+			SendPending(forwarder, pending, now);
+			continue;
+		}
+
+		// Freed first so the counts are settled by the time the client hears, the slot keeps its contents
+		forwarder->Stats.Timeouts++;
+		FreePending(forwarder, pending);
+		ReplyFailed(forwarder, pending, reply);
+	}
+}
+
+static void Drain(DnsForwarder* forwarder, SOCKET s, BOOL clients, BYTE* packet, BYTE* reply)
+{
+	for (UINT i = 0; i < DNS_FORWARDER_BATCH; i++)
+	{
+		SOCKADDR_STORAGE from;
+		int fromLength = sizeof(from);
+
+		int length = recvfrom(s, (char*)packet, DNS_PACKET_LENGTH, 0, (SOCKADDR*)&from, &fromLength);
+		if (length == SOCKET_ERROR)
+		{
+			// The ICMP error of an earlier send, the next datagram may be waiting behind it
+			if (WSAGetLastError() == WSAECONNRESET)
+			{
+				continue;
+			}
+			return;
+		}
+
+		if (forwarder->Stopping)
+		{
+			return;
+		}
+
+		ULONGLONG now = GetTickCount64();
+
+		if (!clients)
+		{
+			HandleResponse(forwarder, packet, length, &from, now);
+		}
+		else if (from.ss_family == AF_INET)
+		{
+			HandleQuery(forwarder, packet, length, (const SOCKADDR_IN*)&from, now, reply);
+		}
+	}
+}
+
+static DWORD WINAPI ForwarderThreadFunc(LPVOID parameter)
+{
+	DnsForwarder* forwarder = (DnsForwarder*)parameter;
+	BYTE* packet = (BYTE*)HeapAlloc(GetProcessHeap(), 0, DNS_PACKET_LENGTH * 2);
+	WSAPOLLFD pollFds[3];
+
+	if (packet == NULL)
+	{
+		NATIVELOG_ERROR("dns forwarder out of memory\n");
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	while (!forwarder->Stopping)
+	{
+		ULONGLONG now = GetTickCount64();
+		ExpirePending(forwarder, now, packet + DNS_PACKET_LENGTH);
+
+		SOCKET sockets[3] = { forwarder->Listen, forwarder->Upstream[0], forwarder->Upstream[1] };
+		UINT fdCount = 0;
+
+		for (UINT i = 0; i < 3; i++)
+		{
+			if (sockets[i] != INVALID_SOCKET)
+			{
+				pollFds[fdCount].fd = sockets[i];
+				pollFds[fdCount].events = POLLRDNORM;
+				pollFds[fdCount++].revents = 0;
+			}
+		}
+
+		// Waits for a datagram or the earliest retry, nothing wakes the thread otherwise
+		INT timeout = forwarder->Earliest != NULL ? (INT)(forwarder->Earliest->DeadlineMs - now) : -1;
+		if (WSAPoll(pollFds, fdCount, timeout) == SOCKET_ERROR)
+		{
+			NATIVELOG_ERROR("WSAPoll failed in the dns forwarder: %d\n", WSAGetLastError());
+			break;
+		}
+
+		for (UINT i = 0; i < fdCount; i++)
+		{
+			if (pollFds[i].revents != 0)
+			{
+				Drain(forwarder, pollFds[i].fd, pollFds[i].fd == forwarder->Listen, packet, packet + DNS_PACKET_LENGTH);
+			}
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, packet);
+
+	return 0;
+}
+
+static void DestroyForwarder(DnsForwarder* forwarder)
+{
+	if (forwarder->Thread != NULL)
+	{
+		// Woken by a datagram to itself
+		BYTE wake = 0;
+		InterlockedExchange(&forwarder->Stopping, TRUE);
+		SendTo(forwarder->Listen, &wake, 1, (const SOCKADDR*)&forwarder->Address, sizeof(forwarder->Address));
+
+		WaitForSingleObject(forwarder->Thread, INFINITE);
+		CloseHandle(forwarder->Thread);
+	}
+
+	SOCKET sockets[3] = { forwarder->Listen, forwarder->Upstream[0], forwarder->Upstream[1] };
+	for (UINT i = 0; i < 3; i++)
+	{
+		if (sockets[i] != INVALID_SOCKET)
+		{
+			closesocket(sockets[i]);
+		}
+	}
+
+	for (UINT i = 0; i < DNS_FORWARDER_CACHE_SHARDS; i++)
+	{
+		if (forwarder->Shards[i].Buckets != NULL)
+		{
+			CacheClear(&forwarder->Shards[i]);
+			HeapFree(GetProcessHeap(), 0, forwarder->Shards[i].Buckets);
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, forwarder);
+}
+
+static SOCKET OpenSocket(int family, const SOCKADDR* address, int addressLength)
+{
+	u_long nonBlocking = 1;
+
+	SOCKET s = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	if (s != INVALID_SOCKET && (bind(s, address, addressLength) != 0 || ioctlsocket(s, FIONBIO, &nonBlocking) != 0))
+	{
+		closesocket(s);
+		s = INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+// Call with Winsock started
+static DWORD CreateForwarder(const SOCKADDR_STORAGE* upstreams, const int* upstreamLengths, UINT upstreamCount, USHORT port, const DnsForwarderOptions* options, DnsForwarder** created)
+{
+	DnsForwarder* forwarder = (DnsForwarder*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DnsForwarder));
+	int addressLength = sizeof(SOCKADDR_IN);
+	DWORD result = ERROR_SUCCESS;
+
+	if (forwarder == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	forwarder->Listen = INVALID_SOCKET;
+	forwarder->Upstream[0] = INVALID_SOCKET;
+	forwarder->Upstream[1] = INVALID_SOCKET;
+	forwarder->Options.RetryMs = options != NULL && options->RetryMs != 0 ? options->RetryMs : DNS_FORWARDER_DEFAULT_RETRY_MS;
+	forwarder->Options.Attempts = options != NULL && options->Attempts != 0 ? options->Attempts : DNS_FORWARDER_DEFAULT_ATTEMPTS;
+	forwarder->Options.CacheEntries = options != NULL && options->CacheEntries != 0 ? options->CacheEntries : DNS_FORWARDER_DEFAULT_CACHE_ENTRIES;
+	forwarder->Options.MaxTtlSeconds = options != NULL && options->MaxTtlSeconds != 0 ? options->MaxTtlSeconds : DNS_FORWARDER_DEFAULT_MAX_TTL_SECONDS;
+	forwarder->Options.MaxNegativeTtlSeconds = options != NULL && options->MaxNegativeTtlSeconds != 0 ? options->MaxNegativeTtlSeconds : DNS_FORWARDER_DEFAULT_MAX_NEGATIVE_TTL_SECONDS;
+	forwarder->Options.PinTtlSeconds = options != NULL && options->PinTtlSeconds != 0 ? options->PinTtlSeconds : DNS_FORWARDER_DEFAULT_PIN_TTL_SECONDS;
+
+	memcpy(forwarder->Upstreams, upstreams, upstreamCount * sizeof(SOCKADDR_STORAGE));
+	memcpy(forwarder->UpstreamLengths, upstreamLengths, upstreamCount * sizeof(int));
+	forwarder->UpstreamCount = upstreamCount;
+
+	for (UINT i = 0; i < DNS_FORWARDER_MAX_PENDING; i++)
+	{
+		forwarder->FreeSlots[i] = (UINT16)(DNS_FORWARDER_MAX_PENDING - 1 - i);
+	}
+	forwarder->FreeCount = DNS_FORWARDER_MAX_PENDING;
+
+	UINT capacity = max(forwarder->Options.CacheEntries / DNS_FORWARDER_CACHE_SHARDS, 1U);
+	UINT buckets = 1;
+	while (buckets < capacity)
+	{
+		buckets <<= 1;
+	}
+
+	for (UINT i = 0; i < DNS_FORWARDER_CACHE_SHARDS; i++)
+	{
+		ForwarderShard* shard = &forwarder->Shards[i];
+
+		InitializeSRWLock(&shard->Lock);
+		shard->Capacity = capacity;
+		shard->BucketMask = buckets - 1;
+		shard->Buckets = (ForwarderCacheItem**)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, buckets * sizeof(ForwarderCacheItem*));
+		if (shard->Buckets == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+			goto Cleanup;
+		}
+	}
+
+	forwarder->Address.sin_family = AF_INET;
+	forwarder->Address.sin_port = htons(port);
+	forwarder->Address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	forwarder->Listen = OpenSocket(AF_INET, (const SOCKADDR*)&forwarder->Address, sizeof(forwarder->Address));
+	if (forwarder->Listen == INVALID_SOCKET || getsockname(forwarder->Listen, (SOCKADDR*)&forwarder->Address, &addressLength) != 0)
+	{
+		result = (DWORD)WSAGetLastError();
+		goto Cleanup;
+	}
+
+	for (UINT i = 0; i < upstreamCount; i++)
+	{
+		UINT family = upstreams[i].ss_family == AF_INET ? 0 : 1;
+		SOCKADDR_STORAGE any;
+
+		if (forwarder->Upstream[family] != INVALID_SOCKET)
+		{
+			continue;
+		}
+
+		// Bound up front to a port of its own for WSAPoll to wait on
+		memset(&any, 0, sizeof(any));
+		any.ss_family = upstreams[i].ss_family;
+
+		forwarder->Upstream[family] = OpenSocket(any.ss_family, (const SOCKADDR*)&any, family == 0 ? sizeof(SOCKADDR_IN) : sizeof(SOCKADDR_IN6));
+		if (forwarder->Upstream[family] == INVALID_SOCKET)
+		{
+			result = (DWORD)WSAGetLastError();
+			goto Cleanup;
+		}
+	}
+
+	forwarder->Thread = CreateThread(NULL, 0, ForwarderThreadFunc, forwarder, 0, NULL);
+	if (forwarder->Thread == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	*created = forwarder;
+	forwarder = NULL;
+
+Cleanup:
+	if (forwarder != NULL)
+	{
+		DestroyForwarder(forwarder);
+	}
+
+	return result;
+}
+
+DWORD DnsForwarderStart(LPCWSTR* upstreams, UINT upstreamCount, USHORT port, const DnsForwarderOptions* options, USHORT* boundPort)
+{
+	SOCKADDR_STORAGE parsed[DNS_FORWARDER_MAX_UPSTREAMS];
+	int lengths[DNS_FORWARDER_MAX_UPSTREAMS];
+	DnsForwarder* forwarder = NULL;
+	USHORT upstreamPort = options != NULL && options->UpstreamPort != 0 ? options->UpstreamPort : DNS_UPSTREAM_PORT;
+	WSADATA wsaData;
+
+	if (upstreams == NULL || upstreamCount == 0 || upstreamCount > DNS_FORWARDER_MAX_UPSTREAMS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&ForwarderLock);
+
+	if (Running != NULL)
+	{
+		ReleaseSRWLockExclusive(&ForwarderLock);
+		return ERROR_ALREADY_EXISTS;
+	}
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		ReleaseSRWLockExclusive(&ForwarderLock);
+		return result;
+	}
+
+	for (UINT i = 0; i < upstreamCount && result == ERROR_SUCCESS; i++)
+	{
+		result = upstreams[i] != NULL ? ParseUpstream(upstreams[i], upstreamPort, &parsed[i], &lengths[i]) : ERROR_INVALID_PARAMETER;
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = CreateForwarder(parsed, lengths, upstreamCount, port, options, &forwarder);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		Running = forwarder;
+
+		if (boundPort != NULL)
+		{
+			*boundPort = ntohs(forwarder->Address.sin_port);
+		}
+
+		NATIVELOG_INFO("dns forwarder on 127.0.0.1:%u, %u upstreams\n", ntohs(forwarder->Address.sin_port), upstreamCount);
+	}
+	else
+	{
+		WSACleanup();
+	}
+
+	ReleaseSRWLockExclusive(&ForwarderLock);
+	return result;
+}
+
+DWORD DnsForwarderStop()
+{
+	AcquireSRWLockExclusive(&ForwarderLock);
+
+	if (Running == NULL)
+	{
+		ReleaseSRWLockExclusive(&ForwarderLock);
+		return ERROR_NOT_FOUND;
+	}
+
+	DestroyForwarder(Running);
+	Running = NULL;
+	WSACleanup();
+
+	ReleaseSRWLockExclusive(&ForwarderLock);
+	return ERROR_SUCCESS;
+}
+
+DWORD DnsForwarderSetPins(LPCWSTR* hostnames, LPCWSTR* addresses, UINT count)
+{
+	DnsPin* pins = NULL;
+	UINT pinCount = 0;
+
+	if (count > 0 && (hostnames == NULL || addresses == NULL))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (count > 0)
+	{
+		pins = (DnsPin*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, min(count, (UINT)DNS_FORWARDER_MAX_PINS) * sizeof(DnsPin));
+		if (pins == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	for (UINT i = 0; i < count; i++)
+	{
+		BYTE name[DNS_MAX_NAME_LENGTH];
+		UINT nameLength;
+		IN_ADDR address;
+		DnsPin* pin = NULL;
+
+		if (hostnames[i] == NULL || addresses[i] == NULL || EncodeName(hostnames[i], name, &nameLength) != ERROR_SUCCESS
+			|| InetPtonW(AF_INET, addresses[i], &address) != 1)
+		{
+			HeapFree(GetProcessHeap(), 0, pins);
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		UINT32 hash = HashBytes(name, nameLength);
+		for (UINT p = 0; p < pinCount && pin == NULL; p++)
+		{
+			if (pins[p].Hash == hash && pins[p].NameLength == nameLength && memcmp(pins[p].Name, name, nameLength) == 0)
+			{
+				pin = &pins[p];
+			}
+		}
+
+		if (pin == NULL)
+		{
+			if (pinCount >= DNS_FORWARDER_MAX_PINS)
+			{
+				HeapFree(GetProcessHeap(), 0, pins);
+				return ERROR_INVALID_PARAMETER;
+			}
+
+			pin = &pins[pinCount++];
+			memcpy(pin->Name, name, nameLength);
+			pin->NameLength = nameLength;
+			pin->Hash = hash;
+		}
+
+		if (pin->AddressCount >= DNS_FORWARDER_MAX_PIN_ADDRESSES)
+		{
+			HeapFree(GetProcessHeap(), 0, pins);
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		pin->Addresses[pin->AddressCount++] = address;
+	}
+
+	AcquireSRWLockExclusive(&PinLock);
+	DnsPin* previous = Pins;
+	Pins = pins;
+	PinCount = pinCount;
+	ReleaseSRWLockExclusive(&PinLock);
+
+	if (previous != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, previous);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DnsForwarderFlush()
+{
+	AcquireSRWLockShared(&ForwarderLock);
+
+	if (Running != NULL)
+	{
+		for (UINT i = 0; i < DNS_FORWARDER_CACHE_SHARDS; i++)
+		{
+			CacheClear(&Running->Shards[i]);
+		}
+	}
+
+	ReleaseSRWLockShared(&ForwarderLock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DnsForwarderGetStats(DnsForwarderStats* stats)
+{
+	if (stats == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(stats, sizeof(*stats));
+
+	AcquireSRWLockShared(&ForwarderLock);
+
+	if (Running != NULL)
+	{
+		// The forwarder thread's counters, read while they may be moving
+		*stats = Running->Stats;
+		stats->Pending = DNS_FORWARDER_MAX_PENDING - Running->FreeCount;
+
+		for (UINT i = 0; i < DNS_FORWARDER_CACHE_SHARDS; i++)
+		{
+			AcquireSRWLockShared(&Running->Shards[i].Lock);
+			stats->CacheEntries += Running->Shards[i].Count;
+			stats->Evictions += Running->Shards[i].Evictions;
+			ReleaseSRWLockShared(&Running->Shards[i].Lock);
+		}
+	}
+
+	ReleaseSRWLockShared(&ForwarderLock);
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+static void Summarise(LONGLONG* ticks, DWORD samples, INT64 ticksPerSecond, DnsForwarderLatency* latency)
+{
+	TickSummary summary;
+	SummariseTicks(ticks, samples, ticksPerSecond, &summary);
+
+	latency->Samples = summary.Samples;
+	latency->MeanUs = summary.MeanUs;
+	latency->P50Us = summary.P50Us;
+	latency->P99Us = summary.P99Us;
+	latency->MaxUs = summary.MaxUs;
+}
+
+static INT64 BenchNow()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+// An A query for q<index>.bench.invalid
+static int BuildBenchQuery(UINT index, BYTE* packet)
+{
+	CHAR label[16];
+	static const BYTE suffix[] = { 5, 'b', 'e', 'n', 'c', 'h', 7, 'i', 'n', 'v', 'a', 'l', 'i', 'd', 0, 0, DNS_TYPE_A, 0, DNS_CLASS_IN };
+
+	memset(packet, 0, DNS_HEADER_LENGTH);
+	WriteBE16(packet, (USHORT)index);
+	packet[2] = DNS_FLAG_RECURSION_DESIRED;
+	WriteBE16(packet + 4, 1);
+
+	StringCchPrintfA(label, ARRAYSIZE(label), "q%u", index);
+	BYTE length = (BYTE)strlen(label);
+
+	packet[DNS_HEADER_LENGTH] = length;
+	memcpy(packet + DNS_HEADER_LENGTH + 1, label, length);
+	memcpy(packet + DNS_HEADER_LENGTH + 1 + length, suffix, sizeof(suffix));
+
+	return DNS_HEADER_LENGTH + 1 + length + sizeof(suffix);
+}
+
+// Answers every query with an address until a datagram too short to be one arrives
+static DWORD WINAPI BenchUpstreamFunc(LPVOID parameter)
+{
+	SOCKET s = (SOCKET)parameter;
+	BYTE* packet = (BYTE*)HeapAlloc(GetProcessHeap(), 0, DNS_PACKET_LENGTH * 2);
+
+	while (packet != NULL)
+	{
+		SOCKADDR_STORAGE from;
+		int fromLength = sizeof(from);
+		DnsQuestion question;
+
+		int length = recvfrom(s, (char*)packet, DNS_PACKET_LENGTH, 0, (SOCKADDR*)&from, &fromLength);
+		if (length == SOCKET_ERROR && WSAGetLastError() == WSAECONNRESET)
+		{
+			continue;
+		}
+
+		if (length < DNS_HEADER_LENGTH)
+		{
+			break;
+		}
+
+		if (ParseQuestion(packet, length, &question) == 0)
+		{
+			IN_ADDR address;
+			address.s_addr = question.Hash;
+
+			int replyLength = BuildReply(packet, &question, 0, TRUE, &address, 1, BENCH_TTL_SECONDS, packet + DNS_PACKET_LENGTH);
+			SendTo(s, packet + DNS_PACKET_LENGTH, replyLength, (const SOCKADDR*)&from, fromLength);
+		}
+	}
+
+	if (packet != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, packet);
+	}
+
+	return 0;
+}
+
+static DWORD WaitReadable(SOCKET s)
+{
+	WSAPOLLFD pollFd;
+
+	pollFd.fd = s;
+	pollFd.events = POLLRDNORM;
+	pollFd.revents = 0;
+
+	int ready = WSAPoll(&pollFd, 1, BENCH_TIMEOUT_MS);
+	return ready > 0 ? ERROR_SUCCESS : (ready == 0 ? ERROR_TIMEOUT : (DWORD)WSAGetLastError());
+}
+
+// Sends every query keeping BENCH_WINDOW of them in flight
+static DWORD BenchPipelined(SOCKET client, const SOCKADDR_IN* forwarder, UINT queries, INT64 ticksPerSecond, BYTE* packet, DOUBLE* perSecond)
+{
+	UINT sent = 0;
+	UINT received = 0;
+	INT64 started = BenchNow();
+
+	while (received < queries)
+	{
+		for (; sent < queries && sent - received < BENCH_WINDOW; sent++)
+		{
+			SendTo(client, packet, BuildBenchQuery(sent, packet), (const SOCKADDR*)forwarder, sizeof(*forwarder));
+		}
+
+		DWORD result = WaitReadable(client);
+		if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+
+		while (recv(client, (char*)packet, DNS_PACKET_LENGTH, 0) > 0)
+		{
+			received++;
+		}
+	}
+
+	*perSecond = queries / ((DOUBLE)(BenchNow() - started) / ticksPerSecond);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DnsForwarderRunBenchmark(UINT queries, DnsForwarderBenchReport* report)
+{
+	DnsForwarderOptions options;
+	DnsForwarder* forwarder = NULL;
+	SOCKET upstream = INVALID_SOCKET;
+	SOCKET client = INVALID_SOCKET;
+	HANDLE upstreamThread = NULL;
+	BYTE* packet = NULL;
+	LONGLONG* samples = NULL;
+	DnsQuestion* questions = NULL;
+	SOCKADDR_STORAGE upstreamAddress;
+	int upstreamLength = sizeof(SOCKADDR_IN);
+	SOCKADDR_IN loopback;
+	LARGE_INTEGER frequency;
+	WSADATA wsaData;
+	BOOL negative;
+	ULONGLONG now;
+	INT64 started;
+
+	if (queries == 0 || queries > MAXUINT16 || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(*report));
+	QueryPerformanceFrequency(&frequency);
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	packet = (BYTE*)HeapAlloc(GetProcessHeap(), 0, DNS_PACKET_LENGTH);
+	samples = (LONGLONG*)HeapAlloc(GetProcessHeap(), 0, queries * sizeof(LONGLONG));
+	questions = (DnsQuestion*)HeapAlloc(GetProcessHeap(), 0, queries * sizeof(DnsQuestion));
+	if (packet == NULL || samples == NULL || questions == NULL)
+	{
+		result = ERROR_NOT_ENOUGH_MEMORY;
+		goto Cleanup;
+	}
+
+	ZeroMemory(&loopback, sizeof(loopback));
+	loopback.sin_family = AF_INET;
+	loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// The stub upstream blocks in recvfrom, the client stays non-blocking
+	upstream = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	client = OpenSocket(AF_INET, (const SOCKADDR*)&loopback, sizeof(loopback));
+	if (upstream == INVALID_SOCKET || client == INVALID_SOCKET
+		|| bind(upstream, (const SOCKADDR*)&loopback, sizeof(loopback)) != 0
+		|| getsockname(upstream, (SOCKADDR*)&upstreamAddress, &upstreamLength) != 0)
+	{
+		result = (DWORD)WSAGetLastError();
+		goto Cleanup;
+	}
+
+	upstreamThread = CreateThread(NULL, 0, BenchUpstreamFunc, (LPVOID)upstream, 0, NULL);
+	if (upstreamThread == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	ZeroMemory(&options, sizeof(options));
+	options.CacheEntries = max(queries * 2, (UINT)DNS_FORWARDER_DEFAULT_CACHE_ENTRIES);
+
+	result = CreateForwarder(&upstreamAddress, &upstreamLength, 1, 0, &options, &forwarder);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	result = BenchPipelined(client, &forwarder->Address, queries, frequency.QuadPart, packet, &report->MissQueriesPerSecond);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	result = BenchPipelined(client, &forwarder->Address, queries, frequency.QuadPart, packet, &report->HitQueriesPerSecond);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	for (UINT i = 0; i < queries; i++)
+	{
+		INT64 sentAt = BenchNow();
+
+		SendTo(client, packet, BuildBenchQuery(i, packet), (const SOCKADDR*)&forwarder->Address, sizeof(forwarder->Address));
+
+		result = WaitReadable(client);
+		if (result != ERROR_SUCCESS)
+		{
+			goto Cleanup;
+		}
+
+		recv(client, (char*)packet, DNS_PACKET_LENGTH, 0);
+		samples[i] = BenchNow() - sentAt;
+	}
+
+	Summarise(samples, queries, frequency.QuadPart, &report->HitLatency);
+
+	for (UINT i = 0; i < queries; i++)
+	{
+		ParseQuestion(packet, BuildBenchQuery(i, packet), &questions[i]);
+	}
+
+	now = GetTickCount64();
+	started = BenchNow();
+	for (UINT round = 0; round < BENCH_LOOKUP_ROUNDS; round++)
+	{
+		for (UINT i = 0; i < queries; i++)
+		{
+			CacheLookup(forwarder, &questions[i], now, packet, DNS_PACKET_LENGTH, &negative);
+		}
+	}
+	report->LookupNs = (DOUBLE)(BenchNow() - started) * 1000000000.0 / frequency.QuadPart / ((DOUBLE)queries * BENCH_LOOKUP_ROUNDS);
+
+Cleanup:
+	if (forwarder != NULL)
+	{
+		DestroyForwarder(forwarder);
+	}
+
+	if (upstreamThread != NULL)
+	{
+		BYTE stop = 0;
+		SendTo(client, &stop, 1, (const SOCKADDR*)&upstreamAddress, upstreamLength);
+		WaitForSingleObject(upstreamThread, INFINITE);
+		CloseHandle(upstreamThread);
+	}
+
+	if (upstream != INVALID_SOCKET)
+	{
+		closesocket(upstream);
+	}
+
+	if (client != INVALID_SOCKET)
+	{
+		closesocket(client);
+	}
+
+	if (questions != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, questions);
+	}
+
+	if (samples != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, samples);
+	}
+
+	if (packet != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, packet);
+	}
+
+	WSACleanup();
+
+	return result;
+}
+#endif
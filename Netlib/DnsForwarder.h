@@ -0,0 +1,90 @@
+#pragma once
+#include <windows.h>
+
+#define DNS_FORWARDER_MAX_UPSTREAMS 4
+#define DNS_FORWARDER_MAX_PINS 256
+// IPv4 addresses a pinned hostname answers with, the killswitch allowlist is IPv4 only
+#define DNS_FORWARDER_MAX_PIN_ADDRESSES 8
+// Queries waiting on an upstream at once, past that clients get SERVFAIL straight away
+#define DNS_FORWARDER_MAX_PENDING 1024
+#define DNS_FORWARDER_CACHE_SHARDS 16
+
+// Zero fields take the defaults in DnsForwarder.cpp
+typedef struct _DnsForwarderOptions
+{
+	// Gap before a query is resent, each retry goes to the next upstream
+	DWORD RetryMs;
+	// Sends to the upstreams before the client gets SERVFAIL
+	DWORD Attempts;
+	// Responses cached over all the shards, the least recently used go first
+	DWORD CacheEntries;
+	DWORD MaxTtlSeconds;
+	// Caps how long NXDOMAIN and no data answers are cached, otherwise the SOA minimum of the answer
+	DWORD MaxNegativeTtlSeconds;
+	DWORD PinTtlSeconds;
+	// Port every upstream is sent to, 53 unless they're stubs on loopback
+	USHORT UpstreamPort;
+} DnsForwarderOptions;
+
+// Serves DNS over UDP on 127.0.0.1 from one thread of its own. Pinned hostnames are answered from the pin table,
+// everything else from the cache or forwarded to the upstreams, which are all the forwarder ever sends to, so
+// they're what the killswitch has to allow. port 0 picks a free port, boundPort receives the one in use, resolvers
+// pointed at 127.0.0.1 expect 53. One forwarder per process.
+extern DWORD DnsForwarderStart(LPCWSTR* upstreams, UINT upstreamCount, USHORT port, const DnsForwarderOptions* options, USHORT* boundPort);
+
+// Waits for the forwarder thread to finish and drops the cache, the pins are kept
+extern DWORD DnsForwarderStop();
+
+// Replaces the pinned hostnames, addresses[i] being an IPv4 address hostnames[i] answers with. A hostname given
+// more than once answers with each of its addresses. A/IN queries for a pinned hostname get its addresses,
+// other types an empty answer so nothing about it is asked upstream. Works whether or not the forwarder runs.
+extern DWORD DnsForwarderSetPins(LPCWSTR* hostnames, LPCWSTR* addresses, UINT count);
+
+extern DWORD DnsForwarderFlush();
+
+typedef struct _DnsForwarderStats
+{
+	UINT64 Queries;
+	UINT64 PinnedAnswers;
+	UINT64 CacheHits;
+	// Of CacheHits, those answered with a cached NXDOMAIN or no data
+	UINT64 NegativeHits;
+	UINT64 Forwarded;
+	UINT64 Retries;
+	// Queries the upstreams didn't answer in Attempts sends, the client got SERVFAIL
+	UINT64 Timeouts;
+	// Malformed queries, those turned away with too many pending, and upstream responses matching no query
+	UINT64 Dropped;
+	UINT64 Evictions;
+	UINT CacheEntries;
+	UINT Pending;
+} DnsForwarderStats;
+
+extern DWORD DnsForwarderGetStats(DnsForwarderStats* stats);
+
+#ifdef NATIVE_BENCH
+typedef struct _DnsForwarderLatency
+{
+	DWORD Samples;
+	DOUBLE MeanUs;
+	DOUBLE P50Us;
+	DOUBLE P99Us;
+	DOUBLE MaxUs;
+} DnsForwarderLatency;
+
+typedef struct _DnsForwarderBenchReport
+{
+	// Over loopback with 64 queries in flight, each name the first time through a stub upstream, then again from
+	// the cache
+	DOUBLE MissQueriesPerSecond;
+	DOUBLE HitQueriesPerSecond;
+	// One query at a time answered from the cache, from send to the answer arriving
+	DnsForwarderLatency HitLatency;
+	// A cache lookup on its own, in process
+	DOUBLE LookupNs;
+} DnsForwarderBenchReport;
+
+// Runs queries distinct names through a forwarder of its own and a stub upstream it starts on loopback, the
+// running forwarder is left alone
+extern DWORD DnsForwarderRunBenchmark(UINT queries, DnsForwarderBenchReport* report);
+#endif
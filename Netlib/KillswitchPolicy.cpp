@@ -0,0 +1,515 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <fwpmu.h>
+#include <strsafe.h>
+#include <stddef.h>
+#include <wchar.h>
+#include "KillswitchPolicy.h"
+#include "WfpApi.h"
+#include "NativeLog.h"
+#include "Trace.h"
+#include "Helpers.h"
+
+#define KILLSWITCH_POLICY_TEMP_SUFFIX L".tmp"
+
+static UINT32 Checksum(const KillswitchPolicy* policy)
+{
+	return Crc32((const BYTE*)policy + offsetof(KillswitchPolicy, Flags), policy->Length - offsetof(KillswitchPolicy, Flags));
+}
+
+// Lays the section out at length and moves length past it, to the next boundary
+static void PlaceSection(KillswitchPolicySection* section, SIZE_T count, SIZE_T size, UINT64* length)
+{
+	section->Offset = (UINT32)*length;
+	section->Count = (UINT32)count;
+	*length = (*length + (UINT64)count * size + KILLSWITCH_POLICY_ALIGN - 1) & ~(UINT64)(KILLSWITCH_POLICY_ALIGN - 1);
+}
+
+static BOOL SectionValid(const KillswitchPolicySection* section, SIZE_T size, UINT32 length)
+{
+	return section->Offset >= sizeof(KillswitchPolicy) && section->Offset % KILLSWITCH_POLICY_ALIGN == 0 &&
+		section->Offset <= length && (UINT64)section->Count * size <= length - section->Offset;
+}
+
+// Empty, or a string ending at the last character
+static BOOL StringValid(const KillswitchPolicy* policy, const KillswitchPolicySection* section)
+{
+	const WCHAR* string = (const WCHAR*)((const BYTE*)policy + section->Offset);
+	return section->Count == 0 || (string[section->Count - 1] == L'\0' && wcslen(string) == section->Count - 1);
+}
+
+static BOOL AddressesValid(WFPKS_ADDR_AND_MASK* addresses, int count)
+{
+	if (count < 0 || (addresses == NULL && count > 0))
+	{
+		return FALSE;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (addresses[i].szIpAddr == NULL || addresses[i].szMask == NULL)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void ParseAddresses(WFPKS_ADDR_AND_MASK* addresses, int count, KillswitchAddrMask* parsed)
+{
+	for (int i = 0; i < count; i++)
+	{
+		parsed[i].Address = htonl(inet_addr(addresses[i].szIpAddr));
+		parsed[i].Mask = htonl(inet_addr(addresses[i].szMask));
+	}
+}
+
+DWORD KillswitchPolicyCompile(
+	WFPKS_ADDR_AND_MASK* remoteAddresses,
+	int addrCount,
+	WFPKS_ADDR_AND_MASK* localAddresses,
+	int localAddrCount,
+	const WFPKS_PORT_RULE* portRules,
+	int portRuleCount,
+	ULONG tapAdapterIndex,
+	const wchar_t* ovpnBinaryPath,
+	BOOL persistReboot,
+	const wchar_t* displayName,
+	KillswitchPolicy** policy
+)
+{
+	if (policy == NULL || !AddressesValid(remoteAddresses, addrCount) || !AddressesValid(localAddresses, localAddrCount) || portRuleCount < 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*policy = NULL;
+
+	PortPolicy ports;
+	DWORD result = PortPolicyCompile(portRules, (UINT)portRuleCount, &ports);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	NET_LUID tapLuid;
+	tapLuid.Value = 0;
+	if (tapAdapterIndex > 0 && tapAdapterIndex < KILLSWITCH_TAP_INDEX_LIMIT)
+	{
+		result = ConvertInterfaceIndexToLuid(tapAdapterIndex, &tapLuid);
+	}
+
+	// A binary that doesn't resolve leaves the policy without an app id, the killswitch has never failed over it
+	FWP_BYTE_BLOB* appId = NULL;
+	SIZE_T pathLength = ovpnBinaryPath != NULL ? wcslen(ovpnBinaryPath) : 0;
+	BOOL wfpAcquired = FALSE;
+	if (result == ERROR_SUCCESS && pathLength > 0)
+	{
+		result = WfpApiAcquire();
+		wfpAcquired = result == ERROR_SUCCESS;
+	}
+
+	if (wfpAcquired && TRACE_CALL(TraceProbeAppId, WfpGetApi()->GetAppIdFromFileName0(ovpnBinaryPath, &appId)) != ERROR_SUCCESS)
+	{
+		appId = NULL;
+	}
+
+	SIZE_T nameLength = displayName != NULL ? wcslen(displayName) : 0;
+
+	KillswitchPolicy layout;
+	ZeroMemory(&layout, sizeof(layout));
+	UINT64 length = sizeof(KillswitchPolicy);
+	PlaceSection(&layout.RemoteAddresses, addrCount, sizeof(KillswitchAddrMask), &length);
+	PlaceSection(&layout.LocalAddresses, localAddrCount, sizeof(KillswitchAddrMask), &length);
+	PlaceSection(&layout.PortGroups, ports.GroupCount, sizeof(PortPolicyGroup), &length);
+	PlaceSection(&layout.PortRanges, ports.RangeCount, sizeof(PortRange), &length);
+	PlaceSection(&layout.AppId, appId != NULL ? appId->size : 0, 1, &length);
+	PlaceSection(&layout.AppPath, pathLength > 0 ? pathLength + 1 : 0, sizeof(WCHAR), &length);
+	PlaceSection(&layout.DisplayName, nameLength > 0 ? nameLength + 1 : 0, sizeof(WCHAR), &length);
+
+	KillswitchPolicy* compiled = NULL;
+	if (result == ERROR_SUCCESS && length > KILLSWITCH_POLICY_MAX_LENGTH)
+	{
+		result = ERROR_INVALID_PARAMETER;
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		compiled = (KillswitchPolicy*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (SIZE_T)length);
+		if (compiled == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		*compiled = layout;
+		compiled->Magic = KILLSWITCH_POLICY_MAGIC;
+		compiled->Version = KILLSWITCH_POLICY_VERSION;
+		compiled->Length = (UINT32)length;
+		compiled->TapLuid = tapLuid.Value;
+		compiled->TapIndex = tapLuid.Value != 0 ? tapAdapterIndex : 0;
+		compiled->Flags = persistReboot ? KILLSWITCH_POLICY_PERSIST : 0;
+
+		ParseAddresses(remoteAddresses, addrCount, KILLSWITCH_POLICY_SECTION(compiled, RemoteAddresses, KillswitchAddrMask));
+		ParseAddresses(localAddresses, localAddrCount, KILLSWITCH_POLICY_SECTION(compiled, LocalAddresses, KillswitchAddrMask));
+		memcpy(KILLSWITCH_POLICY_SECTION(compiled, PortGroups, PortPolicyGroup), ports.Groups, ports.GroupCount * sizeof(PortPolicyGroup));
+		memcpy(KILLSWITCH_POLICY_SECTION(compiled, PortRanges, PortRange), ports.Ranges, ports.RangeCount * sizeof(PortRange));
+		if (appId != NULL)
+		{
+			memcpy(KILLSWITCH_POLICY_SECTION(compiled, AppId, BYTE), appId->data, appId->size);
+		}
+		memcpy(KILLSWITCH_POLICY_SECTION(compiled, AppPath, WCHAR), ovpnBinaryPath, compiled->AppPath.Count * sizeof(WCHAR));
+		memcpy(KILLSWITCH_POLICY_SECTION(compiled, DisplayName, WCHAR), displayName, compiled->DisplayName.Count * sizeof(WCHAR));
+
+		compiled->Checksum = Checksum(compiled);
+		*policy = compiled;
+	}
+
+	if (appId != NULL)
+	{
+		WfpGetApi()->FreeMemory0((void**)&appId);
+	}
+
+	if (wfpAcquired)
+	{
+		WfpApiRelease();
+	}
+
+	PortPolicyFree(&ports);
+
+	return result;
+}
+
+void KillswitchPolicyFree(KillswitchPolicy* policy)
+{
+	if (policy != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, policy);
+	}
+}
+
+DWORD KillswitchPolicyValidate(const KillswitchPolicy* policy, SIZE_T length)
+{
+	if (policy == NULL || length < sizeof(KillswitchPolicy))
+	{
+		return ERROR_FILE_CORRUPT;
+	}
+
+	if (policy->Magic != KILLSWITCH_POLICY_MAGIC)
+	{
+		return ERROR_FILE_CORRUPT;
+	}
+
+	if (policy->Version != KILLSWITCH_POLICY_VERSION)
+	{
+		return ERROR_REVISION_MISMATCH;
+	}
+
+	if (policy->Length < sizeof(KillswitchPolicy) || policy->Length > length || policy->Checksum != Checksum(policy))
+	{
+		return ERROR_FILE_CORRUPT;
+	}
+
+	if (!SectionValid(&policy->RemoteAddresses, sizeof(KillswitchAddrMask), policy->Length) ||
+		!SectionValid(&policy->LocalAddresses, sizeof(KillswitchAddrMask), policy->Length) ||
+		!SectionValid(&policy->PortGroups, sizeof(PortPolicyGroup), policy->Length) ||
+		!SectionValid(&policy->PortRanges, sizeof(PortRange), policy->Length) ||
+		!SectionValid(&policy->AppId, 1, policy->Length) ||
+		!SectionValid(&policy->AppPath, sizeof(WCHAR), policy->Length) ||
+		!SectionValid(&policy->DisplayName, sizeof(WCHAR), policy->Length))
+	{
+		return ERROR_FILE_CORRUPT;
+	}
+
+	if (!StringValid(policy, &policy->AppPath) || !StringValid(policy, &policy->DisplayName) || policy->PortGroups.Count > PORT_POLICY_MAX_GROUPS)
+	{
+		return ERROR_FILE_CORRUPT;
+	}
+
+	// Each group gets its own filter key, so no two may share a protocol and direction
+	const PortPolicyGroup* groups = KILLSWITCH_POLICY_SECTION(policy, PortGroups, const PortPolicyGroup);
+	UINT seen = 0;
+	for (UINT i = 0; i < policy->PortGroups.Count; i++)
+	{
+		UINT protocol = groups[i].Protocol == 0 ? 0 : groups[i].Protocol == IPPROTO_TCP ? 1 : groups[i].Protocol == IPPROTO_UDP ? 2 : 3;
+		UINT bit = 1 << (groups[i].Direction * 3 + protocol);
+		if (protocol == 3 || groups[i].Direction > WFPKS_PORT_LOCAL || (seen & bit) != 0 || groups[i].Count == 0 ||
+			groups[i].First > policy->PortRanges.Count || groups[i].Count > policy->PortRanges.Count - groups[i].First)
+		{
+			return ERROR_FILE_CORRUPT;
+		}
+
+		seen |= bit;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD KillswitchPolicyPatchTap(KillswitchPolicy* policy, ULONG tapAdapterIndex)
+{
+	if (policy == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (tapAdapterIndex == 0)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	// Indexes are handed out again across reboots, the LUID is looked up even when the index hasn't changed
+	NET_LUID luid;
+	luid.Value = 0;
+	if (tapAdapterIndex < KILLSWITCH_TAP_INDEX_LIMIT)
+	{
+		DWORD result = ConvertInterfaceIndexToLuid(tapAdapterIndex, &luid);
+		if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+	}
+
+	policy->TapLuid = luid.Value;
+	policy->TapIndex = luid.Value != 0 ? tapAdapterIndex : 0;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD KillswitchPolicySave(const KillswitchPolicy* policy, LPCWSTR path)
+{
+	if (policy == NULL || path == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	WCHAR tempPath[MAX_PATH];
+	if (FAILED(StringCchPrintfW(tempPath, MAX_PATH, L"%s" KILLSWITCH_POLICY_TEMP_SUFFIX, path)))
+	{
+		return ERROR_FILENAME_EXCED_RANGE;
+	}
+
+	HANDLE file = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD written = 0;
+	DWORD result = ERROR_SUCCESS;
+	if (!WriteFile(file, policy, policy->Length, &written, NULL) || !FlushFileBuffers(file))
+	{
+		result = GetLastError();
+	}
+	else if (written != policy->Length)
+	{
+		result = ERROR_WRITE_FAULT;
+	}
+
+	CloseHandle(file);
+
+	if (result == ERROR_SUCCESS && !MoveFileExW(tempPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		result = GetLastError();
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		DeleteFileW(tempPath);
+		NATIVELOG_WARNING("failed to save killswitch policy: %lu\n", result);
+	}
+
+	return result;
+}
+
+DWORD KillswitchPolicyMap(LPCWSTR path, KillswitchPolicy** policy)
+{
+	if (path == NULL || policy == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*policy = NULL;
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	LARGE_INTEGER fileSize;
+	DWORD result = ERROR_SUCCESS;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		result = GetLastError();
+	}
+	else if (fileSize.QuadPart < (LONGLONG)sizeof(KillswitchPolicy) || fileSize.QuadPart > KILLSWITCH_POLICY_MAX_LENGTH)
+	{
+		result = ERROR_FILE_CORRUPT;
+	}
+
+	// The view holds the mapping open, neither handle is needed once it exists
+	HANDLE mapping = NULL;
+	KillswitchPolicy* mapped = NULL;
+	if (result == ERROR_SUCCESS)
+	{
+		mapping = CreateFileMappingW(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		mapped = mapping != NULL ? (KillswitchPolicy*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+		if (mapped == NULL)
+		{
+			result = GetLastError();
+		}
+	}
+
+	if (mapping != NULL)
+	{
+		CloseHandle(mapping);
+	}
+
+	CloseHandle(file);
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = KillswitchPolicyValidate(mapped, (SIZE_T)fileSize.QuadPart);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		if (mapped != NULL)
+		{
+			UnmapViewOfFile(mapped);
+		}
+
+		NATIVELOG_WARNING("failed to map killswitch policy: %lu\n", result);
+		return result;
+	}
+
+	*policy = mapped;
+
+	return ERROR_SUCCESS;
+}
+
+void KillswitchPolicyUnmap(KillswitchPolicy* policy)
+{
+	if (policy != NULL)
+	{
+		UnmapViewOfFile(policy);
+	}
+}
+
+#ifdef NATIVE_BENCH
+// The private subnets a real policy allows locally, the benchmark's servers come out of 100.64.0.0/10
+#define KILLSWITCH_BENCH_LOCAL_ADDRESSES 3
+
+static const char* const BenchLocalAddresses[KILLSWITCH_BENCH_LOCAL_ADDRESSES][2] = {
+	{ "10.0.0.0", "255.0.0.0" },
+	{ "172.16.0.0", "255.240.0.0" },
+	{ "192.168.0.0", "255.255.0.0" },
+};
+
+DWORD KillswitchPolicyRunBenchmark(LPCWSTR path, UINT remoteAddresses, ULONG tapAdapterIndex, UINT iterations, KillswitchPolicyBenchReport* report)
+{
+	if (path == NULL || report == NULL || remoteAddresses == 0 || remoteAddresses > 1 << 16 || iterations == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(KillswitchPolicyBenchReport));
+
+	// The arguments as the managed layer hands them over, strings and all
+	WFPKS_ADDR_AND_MASK* remote = (WFPKS_ADDR_AND_MASK*)HeapAlloc(GetProcessHeap(), 0, remoteAddresses * sizeof(WFPKS_ADDR_AND_MASK));
+	char* strings = (char*)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)remoteAddresses * INET_ADDRSTRLEN);
+	if (remote == NULL || strings == NULL)
+	{
+		if (remote != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, remote);
+		}
+
+		if (strings != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, strings);
+		}
+
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (UINT i = 0; i < remoteAddresses; i++)
+	{
+		char* address = &strings[(SIZE_T)i * INET_ADDRSTRLEN];
+		StringCchPrintfA(address, INET_ADDRSTRLEN, "100.%u.%u.%u", 64 + (i >> 16) % 64, (i >> 8) & 0xFF, i & 0xFF);
+		remote[i].szIpAddr = address;
+		remote[i].szMask = "255.255.255.255";
+	}
+
+	WFPKS_ADDR_AND_MASK local[KILLSWITCH_BENCH_LOCAL_ADDRESSES];
+	for (UINT i = 0; i < KILLSWITCH_BENCH_LOCAL_ADDRESSES; i++)
+	{
+		local[i].szIpAddr = BenchLocalAddresses[i][0];
+		local[i].szMask = BenchLocalAddresses[i][1];
+	}
+
+	WCHAR binaryPath[MAX_PATH];
+	DWORD pathLength = GetModuleFileNameW(NULL, binaryPath, MAX_PATH);
+	if (pathLength == 0 || pathLength == MAX_PATH)
+	{
+		binaryPath[0] = L'\0';
+	}
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+
+	KillswitchPolicy* policy = NULL;
+	DWORD result = KillswitchPolicyCompile(remote, (int)remoteAddresses, local, KILLSWITCH_BENCH_LOCAL_ADDRESSES, PortPolicyDefaultRules,
+		PORT_POLICY_DEFAULT_RULE_COUNT, tapAdapterIndex, binaryPath, FALSE, L"Killswitch benchmark", &policy);
+
+	if (result == ERROR_SUCCESS)
+	{
+		report->PolicyBytes = policy->Length;
+
+		QueryPerformanceCounter(&start);
+		result = KillswitchPolicySave(policy, path);
+		QueryPerformanceCounter(&end);
+		report->SaveUs = (DOUBLE)(end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart;
+
+		KillswitchPolicyFree(policy);
+	}
+
+	QueryPerformanceCounter(&start);
+	for (UINT i = 0; i < iterations && result == ERROR_SUCCESS; i++)
+	{
+		result = KillswitchPolicyCompile(remote, (int)remoteAddresses, local, KILLSWITCH_BENCH_LOCAL_ADDRESSES, PortPolicyDefaultRules,
+			PORT_POLICY_DEFAULT_RULE_COUNT, tapAdapterIndex, binaryPath, FALSE, L"Killswitch benchmark", &policy);
+		if (result == ERROR_SUCCESS)
+		{
+			result = WfpksPrepareFilters(policy, 0, &report->Filters);
+			KillswitchPolicyFree(policy);
+		}
+	}
+	QueryPerformanceCounter(&end);
+	report->BuildUsMean = (DOUBLE)(end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart / iterations;
+
+	QueryPerformanceCounter(&start);
+	for (UINT i = 0; i < iterations && result == ERROR_SUCCESS; i++)
+	{
+		result = KillswitchPolicyMap(path, &policy);
+		if (result == ERROR_SUCCESS)
+		{
+			result = WfpksPrepareFilters(policy, tapAdapterIndex, &report->Filters);
+			KillswitchPolicyUnmap(policy);
+		}
+	}
+	QueryPerformanceCounter(&end);
+	report->MappedUsMean = (DOUBLE)(end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart / iterations;
+
+	DeleteFileW(path);
+	HeapFree(GetProcessHeap(), 0, remote);
+	HeapFree(GetProcessHeap(), 0, strings);
+
+	return result;
+}
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+#include <winsock2.h>
+#include <windows.h>
+#include "wfp_killswitch.h"
+#include "PortPolicy.h"
+
+#define KILLSWITCH_POLICY_MAGIC 0x50534B55
+#define KILLSWITCH_POLICY_VERSION 1
+#define KILLSWITCH_POLICY_MAX_LENGTH (16 << 20)
+// Sections start on this boundary, so the engine can be pointed straight into a mapped policy
+#define KILLSWITCH_POLICY_ALIGN 8
+// Tap indexes from here up mean there's no tap adapter, the managed layer passes 999999 when it finds none
+#define KILLSWITCH_TAP_INDEX_LIMIT 999999
+
+#define KILLSWITCH_POLICY_PERSIST 0x1
+
+// Offsets are from the start of the policy, so it means the same wherever it's loaded
+typedef struct _KillswitchPolicySection
+{
+	UINT32 Offset;
+	UINT32 Count;
+} KillswitchPolicySection;
+
+// Laid out as FWP_V4_ADDR_AND_MASK, host byte order
+typedef struct _KillswitchAddrMask
+{
+	UINT32 Address;
+	UINT32 Mask;
+} KillswitchAddrMask;
+
+// WfpksEnable3's arguments with the addresses parsed, the port rules compiled and the app id and tap LUID looked
+// up: everything applying it needs, and nothing it has to work out.
+typedef struct _KillswitchPolicy
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 Length;
+	// CRC-32 from Flags to Length. The tap fields are left out so they can be patched in place.
+	UINT32 Checksum;
+	// NET_LUID, 0 for no tap adapter
+	UINT64 TapLuid;
+	UINT32 TapIndex;
+	UINT32 Reserved;
+	UINT32 Flags;
+	UINT32 Reserved2;
+	// KillswitchAddrMask
+	KillswitchPolicySection RemoteAddresses;
+	KillswitchPolicySection LocalAddresses;
+	// PortPolicyGroup and PortRange, groups index into the ranges
+	KillswitchPolicySection PortGroups;
+	KillswitchPolicySection PortRanges;
+	// Bytes as FwpmGetAppIdFromFileName0 gives them, empty when the binary didn't resolve
+	KillswitchPolicySection AppId;
+	// WCHARs with the terminator. The app id is looked up from the path when a policy has none, as one shipped
+	// with an update won't, since it depends on the volume the binary is installed on.
+	KillswitchPolicySection AppPath;
+	KillswitchPolicySection DisplayName;
+} KillswitchPolicy;
+
+#define KILLSWITCH_POLICY_SECTION(policy, section, type) ((type*)((BYTE*)(policy) + (policy)->section.Offset))
+
+// Compiles WfpksEnable3's arguments into a policy. Free it with KillswitchPolicyFree.
+extern DWORD KillswitchPolicyCompile(
+	WFPKS_ADDR_AND_MASK* remoteAddresses,
+	int addrCount,
+	WFPKS_ADDR_AND_MASK* localAddresses,
+	int localAddrCount,
+	const WFPKS_PORT_RULE* portRules,
+	int portRuleCount,
+	ULONG tapAdapterIndex,
+	const wchar_t* ovpnBinaryPath,
+	BOOL persistReboot,
+	const wchar_t* displayName,
+	KillswitchPolicy** policy
+);
+
+extern void KillswitchPolicyFree(KillswitchPolicy* policy);
+
+// Checks the header, the checksum and that every section lies inside length and is well formed
+extern DWORD KillswitchPolicyValidate(const KillswitchPolicy* policy, SIZE_T length);
+
+// Points the policy at another tap adapter, in place. 0 keeps the adapter it has.
+extern DWORD KillswitchPolicyPatchTap(KillswitchPolicy* policy, ULONG tapAdapterIndex);
+
+// Writes the policy next to path and renames it over, so a crash never leaves half a policy behind
+extern DWORD KillswitchPolicySave(const KillswitchPolicy* policy, LPCWSTR path);
+
+// Maps a saved policy copy on write, so patching it leaves the file alone, and validates it. Release it with
+// KillswitchPolicyUnmap.
+extern DWORD KillswitchPolicyMap(LPCWSTR path, KillswitchPolicy** policy);
+
+extern void KillswitchPolicyUnmap(KillswitchPolicy* policy);
+
+#ifdef NATIVE_BENCH
+typedef struct _KillswitchPolicyBenchReport
+{
+	DWORD PolicyBytes;
+	UINT Filters;
+	// Compiling from the arguments, as WfpksEnable3 does, then building the filters
+	DOUBLE BuildUsMean;
+	// Mapping and validating the saved policy, patching the tap adapter, then building the filters
+	DOUBLE MappedUsMean;
+	DOUBLE SaveUs;
+} KillswitchPolicyBenchReport;
+
+// Times both ways of getting from a cold start to the filters the engine is given, for a policy allowing
+// remoteAddresses server addresses with this process as the exempt binary. Nothing is added to the engine. The
+// policy is saved at path.
+extern DWORD KillswitchPolicyRunBenchmark(LPCWSTR path, UINT remoteAddresses, ULONG tapAdapterIndex, UINT iterations, KillswitchPolicyBenchReport* report);
+#endif
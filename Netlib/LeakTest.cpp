@@ -0,0 +1,960 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <strsafe.h>
+#include <wchar.h>
+#include "LeakTest.h"
+#include "PortPolicy.h"
+#include "NativeLog.h"
+#include "Helpers.h"
+
+#define LEAK_DEFAULT_CONCURRENCY 512
+#define LEAK_DEFAULT_TIMEOUT_MS 1000
+#define LEAK_DEFAULT_DEADLINE_MS 30000
+#define LEAK_PAYLOAD_LENGTH 32
+#define LEAK_ADAPTERS_LENGTH 16384
+// The tap index range WfpksEnable2 accepts
+#define LEAK_TAP_INDEX_LIMIT 999999
+
+// RFC 5737 TEST-NET-1/2/3, routed like any other remote address but never assigned
+static const UINT32 TestNets[] = { 0xC0000200, 0xC6336400, 0xCB007100 };
+
+static const CHAR* ClassNames[LeakTestClassCount] = {
+	"v4-remote",
+	"v4-allowed",
+	"v4-lan",
+	"v4-multicast",
+	"v4-ports",
+	"v4-loopback",
+	"v4-tunnel",
+	"v6-remote",
+	"v6-link-local",
+	"v6-multicast",
+	"v6-loopback",
+};
+
+static const CHAR* VerdictNames[] = { "blocked", "passed", "undetermined" };
+
+typedef struct _LeakRange
+{
+	UINT32 Address;
+	UINT32 Mask;
+} LeakRange;
+
+typedef struct _LeakSlot
+{
+	SOCKET Socket;
+	UINT Probe;
+	ULONGLONG StartedUs;
+} LeakSlot;
+
+typedef struct _LeakRun
+{
+	LeakTestProbe* Probes;
+	UINT ProbeCount;
+	LeakTestReport* Report;
+	// The policy's address ranges in host byte order
+	LeakRange* Remote;
+	UINT RemoteCount;
+	LeakRange* Local;
+	UINT LocalCount;
+	// Compiled from the remote port rules alone
+	PortPolicy Ports;
+	ULONG TapIndex;
+	ULONG LinkLocalScope;
+	UINT Concurrency;
+	ULONGLONG TimeoutUs;
+	ULONGLONG DeadlineUs;
+	// Connected, never sent on, to learn the source address the stack picks for an IPv4 destination
+	SOCKET Route4;
+	LeakSlot* Slots;
+	WSAPOLLFD* PollFds;
+	UINT InFlight;
+	BYTE Payload[LEAK_PAYLOAD_LENGTH];
+} LeakRun;
+
+static ULONGLONG NowUs()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+
+	return (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 1000000ULL + (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 1000000ULL / frequency.QuadPart;
+}
+
+static SOCKET OpenNonBlocking(int family, int type, int protocol)
+{
+	SOCKET s = socket(family, type, protocol);
+	if (s == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	u_long nonBlocking = 1;
+	if (ioctlsocket(s, FIONBIO, &nonBlocking) != 0)
+	{
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+static int AddressLength(const SOCKADDR_INET* address)
+{
+	return address->si_family == AF_INET ? (int)sizeof(SOCKADDR_IN) : (int)sizeof(SOCKADDR_IN6);
+}
+
+static USHORT AddressPort(const SOCKADDR_INET* address)
+{
+	return ntohs(address->si_family == AF_INET ? address->Ipv4.sin_port : address->Ipv6.sin6_port);
+}
+
+static DWORD ParseRanges(const WFPKS_ADDR_AND_MASK* addresses, int count, LeakRange** ranges, UINT* rangeCount)
+{
+	*ranges = NULL;
+	*rangeCount = 0;
+
+	if (addresses == NULL || count <= 0)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	*ranges = (LeakRange*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, count * sizeof(LeakRange));
+	if (*ranges == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// Parsed the way WfpksEnable2 parses them
+	for (int i = 0; i < count; i++)
+	{
+		if (addresses[i].szIpAddr == NULL || addresses[i].szMask == NULL)
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		(*ranges)[i].Address = ntohl(inet_addr(addresses[i].szIpAddr));
+		(*ranges)[i].Mask = ntohl(inet_addr(addresses[i].szMask));
+	}
+
+	*rangeCount = (UINT)count;
+	return ERROR_SUCCESS;
+}
+
+static DWORD CompileRemotePorts(const LeakTestPolicy* policy, PortPolicy* ports)
+{
+	const WFPKS_PORT_RULE* rules = policy->PortRules != NULL ? policy->PortRules : PortPolicyDefaultRules;
+	int count = policy->PortRules != NULL ? policy->PortRuleCount : PORT_POLICY_DEFAULT_RULE_COUNT;
+
+	if (count < 0 || count > PORT_POLICY_MAX_RULES)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	WFPKS_PORT_RULE* remote = count > 0 ? (WFPKS_PORT_RULE*)HeapAlloc(GetProcessHeap(), 0, count * sizeof(WFPKS_PORT_RULE)) : NULL;
+	if (count > 0 && remote == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	UINT remoteCount = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (rules[i].direction == WFPKS_PORT_REMOTE)
+		{
+			remote[remoteCount++] = rules[i];
+		}
+	}
+
+	DWORD result = PortPolicyCompile(remote, remoteCount, ports);
+
+	if (remote != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, remote);
+	}
+
+	return result;
+}
+
+static BOOL InRanges(const LeakRange* ranges, UINT count, UINT32 address)
+{
+	for (UINT i = 0; i < count; i++)
+	{
+		if ((address & ranges[i].Mask) == (ranges[i].Address & ranges[i].Mask))
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+// WfpksEnable2 only adds the app id condition when the binary resolves, our own image always does
+static BOOL IsExemptProcess(LPCWSTR ovpnBinaryPath)
+{
+	WCHAR path[MAX_PATH];
+
+	if (ovpnBinaryPath == NULL || ovpnBinaryPath[0] == L'\0')
+	{
+		return FALSE;
+	}
+
+	DWORD length = GetModuleFileNameW(NULL, path, MAX_PATH);
+	if (length == 0 || length >= MAX_PATH)
+	{
+		return FALSE;
+	}
+
+	return _wcsicmp(path, ovpnBinaryPath) == 0;
+}
+
+// Link-local and multicast v6 need a scope, take the first interface that's up and has a link-local address
+static ULONG FindLinkLocalScope()
+{
+	ULONG length = LEAK_ADAPTERS_LENGTH;
+	ULONG scope = 0;
+	IP_ADAPTER_ADDRESSES* adapters = (IP_ADAPTER_ADDRESSES*)HeapAlloc(GetProcessHeap(), 0, length);
+
+	if (adapters == NULL)
+	{
+		return 0;
+	}
+
+	ULONG flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+	ULONG result = GetAdaptersAddresses(AF_INET6, flags, NULL, adapters, &length);
+	if (result == ERROR_BUFFER_OVERFLOW)
+	{
+		HeapFree(GetProcessHeap(), 0, adapters);
+		adapters = (IP_ADAPTER_ADDRESSES*)HeapAlloc(GetProcessHeap(), 0, length);
+		result = adapters != NULL ? GetAdaptersAddresses(AF_INET6, flags, NULL, adapters, &length) : ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (IP_ADAPTER_ADDRESSES* adapter = result == ERROR_SUCCESS ? adapters : NULL; adapter != NULL && scope == 0; adapter = adapter->Next)
+	{
+		if (adapter->OperStatus != IfOperStatusUp || adapter->IfType == IF_TYPE_SOFTWARE_LOOPBACK)
+		{
+			continue;
+		}
+
+		for (IP_ADAPTER_UNICAST_ADDRESS* unicast = adapter->FirstUnicastAddress; unicast != NULL; unicast = unicast->Next)
+		{
+			const SOCKADDR_IN6* address = (const SOCKADDR_IN6*)unicast->Address.lpSockaddr;
+			if (address->sin6_family == AF_INET6 && IN6_IS_ADDR_LINKLOCAL(&address->sin6_addr))
+			{
+				scope = adapter->Ipv6IfIndex;
+				break;
+			}
+		}
+	}
+
+	if (adapters != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, adapters);
+	}
+
+	return scope;
+}
+
+static BOOL ClassAvailable(const LeakRun* run, LeakTestClass testClass)
+{
+	switch (testClass)
+	{
+	case LeakTestV4Allowed:
+		return run->RemoteCount > 0;
+	case LeakTestV4Lan:
+		return run->LocalCount > 0;
+	case LeakTestV4Ports:
+		return run->Ports.RangeCount > 0;
+	case LeakTestV4Tunnel:
+		return run->TapIndex > 0 && run->TapIndex < LEAK_TAP_INDEX_LIMIT;
+	case LeakTestV6LinkLocal:
+	case LeakTestV6Multicast:
+		return run->LinkLocalScope != 0;
+	default:
+		return TRUE;
+	}
+}
+
+static UINT32 RandomInRange(const LeakRange* range, UINT64* random)
+{
+	return (range->Address & range->Mask) | ((UINT32)NextRandom(random) & ~range->Mask);
+}
+
+// Picks a range, then a port in it, so single ports turn up as often as wide ranges
+static USHORT RandomAllowedPort(const PortPolicy* ports, UINT64* random)
+{
+	const PortRange* range = &ports->Ranges[NextRandom(random) % ports->RangeCount];
+	return (USHORT)(range->Low + NextRandom(random) % ((UINT)range->High - range->Low + 1));
+}
+
+static void GenerateTarget(const LeakRun* run, LeakTestProbe* probe, UINT64* random)
+{
+	SOCKADDR_INET* address = &probe->Address;
+	USHORT port = (USHORT)(1024 + NextRandom(random) % (65536 - 1024));
+	UINT32 v4 = 0;
+	BYTE* v6 = address->Ipv6.sin6_addr.s6_addr;
+
+	memset(address, 0, sizeof(*address));
+
+	switch (probe->Class)
+	{
+	case LeakTestV4Remote:
+	case LeakTestV4Tunnel:
+		v4 = TestNets[NextRandom(random) % ARRAYSIZE(TestNets)] | (UINT32)(1 + NextRandom(random) % 254);
+		break;
+	case LeakTestV4Allowed:
+		v4 = RandomInRange(&run->Remote[NextRandom(random) % run->RemoteCount], random);
+		break;
+	case LeakTestV4Lan:
+		v4 = RandomInRange(&run->Local[NextRandom(random) % run->LocalCount], random);
+		break;
+	case LeakTestV4Multicast:
+		// Stay out of 224.0.0.0/24, the stack treats local network control groups specially
+		v4 = 0xE0000000 | (UINT32)(0x100 + NextRandom(random) % 0x0FFFFE00);
+		break;
+	case LeakTestV4Ports:
+		v4 = TestNets[NextRandom(random) % ARRAYSIZE(TestNets)] | (UINT32)(1 + NextRandom(random) % 254);
+		port = RandomAllowedPort(&run->Ports, random);
+		break;
+	case LeakTestV4Loopback:
+		v4 = INADDR_LOOPBACK;
+		break;
+	case LeakTestV6Remote:
+		v6[0] = 0x20;
+		v6[1] = 0x01;
+		v6[2] = 0x0D;
+		v6[3] = 0xB8;
+		for (UINT i = 4; i < 16; i++)
+		{
+			v6[i] = (BYTE)NextRandom(random);
+		}
+		break;
+	case LeakTestV6LinkLocal:
+		// fe80::/64, the range WfpksEnable2 allows
+		v6[0] = 0xFE;
+		v6[1] = 0x80;
+		for (UINT i = 8; i < 16; i++)
+		{
+			v6[i] = (BYTE)NextRandom(random);
+		}
+		address->Ipv6.sin6_scope_id = run->LinkLocalScope;
+		break;
+	case LeakTestV6Multicast:
+		// Link-local scope groups, ff02::/16
+		v6[0] = 0xFF;
+		v6[1] = 0x02;
+		for (UINT i = 12; i < 16; i++)
+		{
+			v6[i] = (BYTE)NextRandom(random);
+		}
+		address->Ipv6.sin6_scope_id = run->LinkLocalScope;
+		break;
+	case LeakTestV6Loopback:
+		v6[15] = 1;
+		break;
+	default:
+		break;
+	}
+
+	if (probe->Class < LeakTestV6Remote)
+	{
+		address->Ipv4.sin_family = AF_INET;
+		address->Ipv4.sin_addr.s_addr = htonl(v4);
+		address->Ipv4.sin_port = htons(port);
+	}
+	else
+	{
+		address->Ipv6.sin6_family = AF_INET6;
+		address->Ipv6.sin6_port = htons(port);
+	}
+}
+
+// The source address the stack picks for a destination, 0 when it has no route
+static UINT32 SourceAddress(LeakRun* run, const SOCKADDR_INET* destination)
+{
+	SOCKADDR_IN source;
+	int sourceLength = sizeof(source);
+
+	if (run->Route4 == INVALID_SOCKET
+		|| connect(run->Route4, (const SOCKADDR*)&destination->Ipv4, sizeof(SOCKADDR_IN)) != 0
+		|| getsockname(run->Route4, (SOCKADDR*)&source, &sourceLength) != 0)
+	{
+		return 0;
+	}
+
+	return ntohl(source.sin_addr.s_addr);
+}
+
+// The WfpksEnable2 filters evaluated by hand: the block all filters at weight 0 lose to any permit that matches,
+// and the block all filters themselves skip loopback traffic and the tap adapter, and for IPv4 the exempt binary
+static LeakTestVerdict ExpectedVerdict(LeakRun* run, const LeakTestProbe* probe)
+{
+	BOOL tunnel = run->TapIndex > 0 && run->TapIndex < LEAK_TAP_INDEX_LIMIT && probe->InterfaceIndex == run->TapIndex;
+
+	if (probe->Address.si_family == AF_INET)
+	{
+		UINT32 remote = ntohl(probe->Address.Ipv4.sin_addr.s_addr);
+		USHORT port = AddressPort(&probe->Address);
+
+		if ((remote >> 24) == 127 || tunnel || run->Report->Exempt)
+		{
+			return LeakTestPassed;
+		}
+
+		if (remote >= 0xE0000000 && remote <= 0xEFFFFFFF)
+		{
+			return LeakTestPassed;
+		}
+
+		if (PortPolicyAllows(&run->Ports, probe->Protocol == LeakTestTcp ? IPPROTO_TCP : IPPROTO_UDP, port, 0))
+		{
+			return LeakTestPassed;
+		}
+
+		if (InRanges(run->Remote, run->RemoteCount, remote))
+		{
+			return LeakTestPassed;
+		}
+
+		if (run->LocalCount > 0 && InRanges(run->Local, run->LocalCount, SourceAddress(run, &probe->Address)))
+		{
+			return LeakTestPassed;
+		}
+
+		return LeakTestBlocked;
+	}
+
+	const IN6_ADDR* remote = &probe->Address.Ipv6.sin6_addr;
+	static const BYTE linkLocalPrefix[8] = { 0xFE, 0x80 };
+
+	if (IN6_IS_ADDR_LOOPBACK(remote) || tunnel)
+	{
+		return LeakTestPassed;
+	}
+
+	if (remote->s6_addr[0] == 0xFF || memcmp(remote->s6_addr, linkLocalPrefix, sizeof(linkLocalPrefix)) == 0)
+	{
+		return LeakTestPassed;
+	}
+
+	return LeakTestBlocked;
+}
+
+static DWORD PlanProbes(LeakRun* run, DWORD classes, UINT64 seed)
+{
+	LeakTestClass enabled[LeakTestClassCount];
+	UINT enabledCount = 0;
+	UINT64 random = seed;
+
+	for (UINT i = 0; i < LeakTestClassCount; i++)
+	{
+		if ((classes & (1 << i)) != 0 && ClassAvailable(run, (LeakTestClass)i))
+		{
+			enabled[enabledCount++] = (LeakTestClass)i;
+		}
+	}
+
+	if (enabledCount == 0)
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	for (UINT i = 0; i < run->ProbeCount; i++)
+	{
+		LeakTestProbe* probe = &run->Probes[i];
+
+		memset(probe, 0, sizeof(*probe));
+		probe->Class = enabled[i % enabledCount];
+		probe->Observed = LeakTestUndetermined;
+
+		// Multicast has no TCP, everything else alternates each time round the classes
+		BOOL multicast = probe->Class == LeakTestV4Multicast || probe->Class == LeakTestV6Multicast;
+		probe->Protocol = !multicast && (i / enabledCount) % 2 == 1 ? LeakTestTcp : LeakTestUdp;
+
+		GenerateTarget(run, probe, &random);
+
+		DWORD interfaceIndex = 0;
+		if (probe->Class == LeakTestV4Tunnel)
+		{
+			interfaceIndex = run->TapIndex;
+		}
+		else if (probe->Address.si_family == AF_INET6 && probe->Address.Ipv6.sin6_scope_id != 0)
+		{
+			interfaceIndex = probe->Address.Ipv6.sin6_scope_id;
+		}
+		else if (GetBestInterfaceEx((SOCKADDR*)&probe->Address, &interfaceIndex) != NO_ERROR)
+		{
+			interfaceIndex = 0;
+		}
+
+		probe->InterfaceIndex = interfaceIndex;
+		probe->Expected = ExpectedVerdict(run, probe);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static void FinishProbe(LeakRun* run, UINT index, LeakTestVerdict observed, DWORD error, ULONGLONG startedUs, ULONGLONG now)
+{
+	LeakTestProbe* probe = &run->Probes[index];
+
+	probe->Observed = observed;
+	probe->Error = error;
+	probe->LatencyUs = (DWORD)min(now - startedUs, (ULONGLONG)MAXDWORD);
+}
+
+// WSAEACCES is the filters, anything else failing before the packet is handed to them leaves the probe undetermined
+static LeakTestVerdict ImmediateVerdict(DWORD error)
+{
+	return error == WSAEACCES ? LeakTestBlocked : LeakTestUndetermined;
+}
+
+static void LaunchProbe(LeakRun* run, UINT index)
+{
+	LeakTestProbe* probe = &run->Probes[index];
+	const SOCKADDR* address = (const SOCKADDR*)&probe->Address;
+	int addressLength = AddressLength(&probe->Address);
+	ULONGLONG started = NowUs();
+
+	SOCKET s = probe->Protocol == LeakTestTcp
+		? OpenNonBlocking(probe->Address.si_family, SOCK_STREAM, IPPROTO_TCP)
+		: OpenNonBlocking(probe->Address.si_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == INVALID_SOCKET)
+	{
+		FinishProbe(run, index, LeakTestUndetermined, WSAGetLastError(), started, NowUs());
+		return;
+	}
+
+	if (probe->Class == LeakTestV4Tunnel)
+	{
+		// IP_UNICAST_IF takes the IPv4 index in network byte order
+		DWORD tapIndex = htonl(run->TapIndex);
+		if (setsockopt(s, IPPROTO_IP, IP_UNICAST_IF, (const char*)&tapIndex, sizeof(tapIndex)) != 0)
+		{
+			FinishProbe(run, index, LeakTestUndetermined, WSAGetLastError(), started, NowUs());
+			closesocket(s);
+			return;
+		}
+	}
+
+	if (probe->Protocol == LeakTestUdp)
+	{
+		// The filters classify a UDP flow on its first send, connect only picks the route
+		memcpy(run->Payload + LEAK_PAYLOAD_LENGTH - sizeof(index), &index, sizeof(index));
+
+		if (connect(s, address, addressLength) != 0)
+		{
+			DWORD error = WSAGetLastError();
+			FinishProbe(run, index, ImmediateVerdict(error), error, started, NowUs());
+		}
+		else if (send(s, (const char*)run->Payload, LEAK_PAYLOAD_LENGTH, 0) == SOCKET_ERROR)
+		{
+			DWORD error = WSAGetLastError();
+			FinishProbe(run, index, ImmediateVerdict(error), error, started, NowUs());
+		}
+		else
+		{
+			FinishProbe(run, index, LeakTestPassed, ERROR_SUCCESS, started, NowUs());
+		}
+
+		closesocket(s);
+		return;
+	}
+
+	if (connect(s, address, addressLength) == 0)
+	{
+		FinishProbe(run, index, LeakTestPassed, ERROR_SUCCESS, started, NowUs());
+		closesocket(s);
+		return;
+	}
+
+	DWORD error = WSAGetLastError();
+	if (error != WSAEWOULDBLOCK)
+	{
+		FinishProbe(run, index, ImmediateVerdict(error), error, started, NowUs());
+		closesocket(s);
+		return;
+	}
+
+	LeakSlot* slot = &run->Slots[run->InFlight++];
+	slot->Socket = s;
+	slot->Probe = index;
+	slot->StartedUs = started;
+	run->Report->MaxInFlight = max(run->Report->MaxInFlight, (DWORD)run->InFlight);
+}
+
+// The SYN got past the filters once connect went pending, only WSAEACCES coming back means they stopped it
+static void CompleteSlot(LeakRun* run, UINT slotIndex, ULONGLONG now, BOOL timedOut)
+{
+	LeakSlot* slot = &run->Slots[slotIndex];
+	int error = 0;
+	int errorLength = sizeof(error);
+
+	if (timedOut)
+	{
+		error = WSAETIMEDOUT;
+	}
+	else
+	{
+		getsockopt(slot->Socket, SOL_SOCKET, SO_ERROR, (char*)&error, &errorLength);
+	}
+
+	FinishProbe(run, slot->Probe, error == WSAEACCES ? LeakTestBlocked : LeakTestPassed, (DWORD)error, slot->StartedUs, now);
+	closesocket(slot->Socket);
+
+	*slot = run->Slots[--run->InFlight];
+}
+
+static DWORD RunLoop(LeakRun* run)
+{
+	UINT next = 0;
+
+	for (;;)
+	{
+		ULONGLONG now = NowUs();
+		ULONGLONG wakeUs = run->DeadlineUs;
+
+		if (now >= run->DeadlineUs)
+		{
+			// Connects still pending made it past the filters, probes never launched stay undetermined
+			while (run->InFlight > 0)
+			{
+				CompleteSlot(run, run->InFlight - 1, now, TRUE);
+			}
+
+			for (; next < run->ProbeCount; next++)
+			{
+				run->Probes[next].Error = ERROR_TIMEOUT;
+			}
+
+			return ERROR_SUCCESS;
+		}
+
+		for (UINT i = run->InFlight; i > 0; i--)
+		{
+			if (now - run->Slots[i - 1].StartedUs >= run->TimeoutUs)
+			{
+				CompleteSlot(run, i - 1, now, TRUE);
+			}
+		}
+
+		while (next < run->ProbeCount && run->InFlight < run->Concurrency)
+		{
+			LaunchProbe(run, next++);
+
+			// A long run of UDP probes mustn't starve the connects already in flight
+			if ((next & 0xFF) == 0 && run->InFlight > 0)
+			{
+				break;
+			}
+		}
+
+		if (run->InFlight == 0)
+		{
+			if (next == run->ProbeCount)
+			{
+				return ERROR_SUCCESS;
+			}
+			continue;
+		}
+
+		for (UINT i = 0; i < run->InFlight; i++)
+		{
+			run->PollFds[i].fd = run->Slots[i].Socket;
+			run->PollFds[i].events = POLLWRNORM;
+			run->PollFds[i].revents = 0;
+			wakeUs = min(wakeUs, run->Slots[i].StartedUs + run->TimeoutUs);
+		}
+
+		now = NowUs();
+		INT timeoutMs = next < run->ProbeCount && run->InFlight < run->Concurrency ? 0 : (wakeUs > now ? (INT)((wakeUs - now + 999) / 1000) : 0);
+		int ready = WSAPoll(run->PollFds, run->InFlight, timeoutMs);
+		if (ready == SOCKET_ERROR)
+		{
+			return WSAGetLastError();
+		}
+
+		if (ready == 0)
+		{
+			continue;
+		}
+
+		// Backwards, completing a slot moves the last one into its place
+		now = NowUs();
+		for (UINT i = run->InFlight; i > 0; i--)
+		{
+			if (run->PollFds[i - 1].revents != 0)
+			{
+				CompleteSlot(run, i - 1, now, FALSE);
+			}
+		}
+	}
+}
+
+static void Summarise(LeakRun* run)
+{
+	LeakTestReport* report = run->Report;
+	ULONGLONG latencyTotals[LeakTestClassCount];
+
+	memset(latencyTotals, 0, sizeof(latencyTotals));
+
+	for (UINT i = 0; i < run->ProbeCount; i++)
+	{
+		const LeakTestProbe* probe = &run->Probes[i];
+		LeakTestClassReport* classReport = &report->Classes[probe->Class];
+
+		report->Probes++;
+		classReport->Probes++;
+
+		if (probe->Observed == LeakTestUndetermined)
+		{
+			report->Undetermined++;
+			classReport->Undetermined++;
+			continue;
+		}
+
+		if (probe->Observed == LeakTestBlocked)
+		{
+			report->Blocked++;
+		}
+		else
+		{
+			report->Passed++;
+		}
+
+		if (probe->Expected == LeakTestBlocked && probe->Observed == LeakTestPassed)
+		{
+			report->Escaped++;
+			classReport->Escaped++;
+		}
+		else if (probe->Expected == LeakTestPassed && probe->Observed == LeakTestBlocked)
+		{
+			report->Overblocked++;
+			classReport->Overblocked++;
+		}
+
+		latencyTotals[probe->Class] += probe->LatencyUs;
+		classReport->LatencyMaxUs = max(classReport->LatencyMaxUs, probe->LatencyUs);
+	}
+
+	for (UINT i = 0; i < LeakTestClassCount; i++)
+	{
+		DWORD measured = report->Classes[i].Probes - report->Classes[i].Undetermined;
+		report->Classes[i].LatencyAvgUs = measured > 0 ? (DWORD)(latencyTotals[i] / measured) : 0;
+	}
+}
+
+static void FreeRun(LeakRun* run)
+{
+	for (UINT i = 0; i < run->InFlight; i++)
+	{
+		closesocket(run->Slots[i].Socket);
+	}
+
+	if (run->Route4 != INVALID_SOCKET)
+	{
+		closesocket(run->Route4);
+	}
+
+	PortPolicyFree(&run->Ports);
+
+	LPVOID blocks[] = { run->Remote, run->Local, run->Slots, run->PollFds };
+	for (UINT i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+	{
+		if (blocks[i] != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, blocks[i]);
+		}
+	}
+}
+
+DWORD LeakTestRun(
+	const LeakTestPolicy* policy,
+	const LeakTestOptions* options,
+	LeakTestProbe* probes,
+	UINT probeCount,
+	LeakTestReport* report
+)
+{
+	LeakRun run;
+	WSADATA wsaData;
+
+	if (policy == NULL || probes == NULL || report == NULL || probeCount == 0 || probeCount > LEAK_TEST_MAX_PROBES)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(&run, 0, sizeof(run));
+	memset(report, 0, sizeof(*report));
+	run.Probes = probes;
+	run.ProbeCount = probeCount;
+	run.Report = report;
+	run.Route4 = INVALID_SOCKET;
+	run.TapIndex = policy->TapAdapterIndex;
+	run.Concurrency = options != NULL && options->Concurrency != 0 ? min(options->Concurrency, (UINT)LEAK_TEST_MAX_CONCURRENCY) : LEAK_DEFAULT_CONCURRENCY;
+	run.TimeoutUs = (options != NULL && options->TimeoutMs != 0 ? options->TimeoutMs : LEAK_DEFAULT_TIMEOUT_MS) * 1000ULL;
+
+	DWORD classes = options != NULL && options->Classes != 0 ? options->Classes : LEAK_TEST_ALL_CLASSES;
+	report->Seed = options != NULL && options->Seed != 0 ? options->Seed : (NowUs() ^ ((UINT64)GetCurrentProcessId() << 32) ^ 0x9E3779B97F4A7C15ULL);
+	report->Exempt = IsExemptProcess(policy->OvpnBinaryPath);
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	result = ParseRanges(policy->RemoteAddresses, policy->RemoteAddressCount, &run.Remote, &run.RemoteCount);
+	if (result == ERROR_SUCCESS)
+	{
+		result = ParseRanges(policy->LocalAddresses, policy->LocalAddressCount, &run.Local, &run.LocalCount);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = CompileRemotePorts(policy, &run.Ports);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		run.Slots = (LeakSlot*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, run.Concurrency * sizeof(LeakSlot));
+		run.PollFds = (WSAPOLLFD*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, run.Concurrency * sizeof(WSAPOLLFD));
+		if (run.Slots == NULL || run.PollFds == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		run.Route4 = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		run.LinkLocalScope = FindLinkLocalScope();
+
+		// The marker shows up in captures, the last bytes carry the probe index
+		memcpy(run.Payload, "utilizr-leak-test", 17);
+
+		result = PlanProbes(&run, classes, report->Seed);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		ULONGLONG start = NowUs();
+		run.DeadlineUs = start + (options != NULL && options->DeadlineMs != 0 ? options->DeadlineMs : LEAK_DEFAULT_DEADLINE_MS) * 1000ULL;
+
+		result = RunLoop(&run);
+
+		report->ElapsedUs = (DWORD)min(NowUs() - start, (ULONGLONG)MAXDWORD);
+		Summarise(&run);
+	}
+
+	FreeRun(&run);
+	WSACleanup();
+
+	if (result == ERROR_SUCCESS)
+	{
+		NATIVELOG_INFO("leak test: %lu probes, %lu escaped, %lu overblocked, %lu undetermined in %lu us\n",
+			report->Probes, report->Escaped, report->Overblocked, report->Undetermined, report->ElapsedUs);
+	}
+	else
+	{
+		NATIVELOG_ERROR("leak test failed: %lu\n", result);
+	}
+
+	return result;
+}
+
+static void FormatAddress(const SOCKADDR_INET* address, CHAR* text, DWORD length)
+{
+	const void* raw = address->si_family == AF_INET ? (const void*)&address->Ipv4.sin_addr : (const void*)&address->Ipv6.sin6_addr;
+
+	if (inet_ntop(address->si_family, raw, text, length) == NULL)
+	{
+		StringCchCopyA(text, length, "?");
+	}
+}
+
+DWORD LeakTestFormatReport(
+	const LeakTestReport* report,
+	const LeakTestProbe* probes,
+	UINT probeCount,
+	CHAR* buffer,
+	DWORD length,
+	DWORD* written
+)
+{
+	CHAR* end = buffer;
+	size_t remaining = length;
+	HRESULT hr;
+
+	if (report == NULL || (probes == NULL && probeCount > 0) || buffer == NULL || written == NULL || length == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	hr = StringCchPrintfExA(end, remaining, &end, &remaining, STRSAFE_NO_TRUNCATION,
+		"{\"probes\":%lu,\"blocked\":%lu,\"passed\":%lu,\"escaped\":%lu,\"overblocked\":%lu,\"undetermined\":%lu,"
+		"\"exempt\":%s,\"seed\":%llu,\"max_in_flight\":%lu,\"elapsed_us\":%lu,\"classes\":[",
+		report->Probes, report->Blocked, report->Passed, report->Escaped, report->Overblocked, report->Undetermined,
+		report->Exempt ? "true" : "false", report->Seed, report->MaxInFlight, report->ElapsedUs);
+
+	for (UINT i = 0; i < LeakTestClassCount && SUCCEEDED(hr); i++)
+	{
+		const LeakTestClassReport* classReport = &report->Classes[i];
+		if (classReport->Probes == 0)
+		{
+			continue;
+		}
+
+		hr = StringCchPrintfExA(end, remaining, &end, &remaining, STRSAFE_NO_TRUNCATION,
+			"%s{\"class\":\"%s\",\"probes\":%lu,\"escaped\":%lu,\"overblocked\":%lu,\"undetermined\":%lu,\"latency_avg_us\":%lu,\"latency_max_us\":%lu}",
+			end[-1] == '[' ? "" : ",", ClassNames[i], classReport->Probes, classReport->Escaped, classReport->Overblocked,
+			classReport->Undetermined, classReport->LatencyAvgUs, classReport->LatencyMaxUs);
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = StringCchPrintfExA(end, remaining, &end, &remaining, STRSAFE_NO_TRUNCATION, "],\"mismatches\":[");
+	}
+
+	DWORD mismatches = 0;
+	for (UINT i = 0; i < probeCount && SUCCEEDED(hr); i++)
+	{
+		const LeakTestProbe* probe = &probes[i];
+		CHAR address[INET6_ADDRSTRLEN];
+
+		if (probe->Observed == LeakTestUndetermined || probe->Observed == probe->Expected)
+		{
+			continue;
+		}
+
+		FormatAddress(&probe->Address, address, ARRAYSIZE(address));
+		hr = StringCchPrintfExA(end, remaining, &end, &remaining, STRSAFE_NO_TRUNCATION,
+			"%s{\"probe\":%u,\"class\":\"%s\",\"protocol\":\"%s\",\"address\":\"%s\",\"port\":%u,\"interface\":%lu,"
+			"\"expected\":\"%s\",\"observed\":\"%s\",\"error\":%lu,\"latency_us\":%lu}",
+			mismatches == 0 ? "" : ",", i, ClassNames[probe->Class], probe->Protocol == LeakTestTcp ? "tcp" : "udp", address,
+			AddressPort(&probe->Address), probe->InterfaceIndex, VerdictNames[probe->Expected], VerdictNames[probe->Observed],
+			probe->Error, probe->LatencyUs);
+		mismatches++;
+	}
+
+	if (SUCCEEDED(hr))
+	{
+		hr = StringCchPrintfExA(end, remaining, &end, &remaining, STRSAFE_NO_TRUNCATION, "]}\n");
+	}
+
+	if (FAILED(hr))
+	{
+		*written = LEAK_TEST_REPORT_BASE_LENGTH + (report->Escaped + report->Overblocked) * LEAK_TEST_REPORT_ENTRY_LENGTH;
+		return ERROR_INSUFFICIENT_BUFFER;
+	}
+
+	*written = (DWORD)(end - buffer);
+	return ERROR_SUCCESS;
+}
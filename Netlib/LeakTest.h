@@ -0,0 +1,141 @@
+#pragma once
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include "wfp_killswitch.h"
+
+#define LEAK_TEST_MAX_PROBES 65536
+#define LEAK_TEST_MAX_CONCURRENCY 4096
+// Summary and per class counters, FormatLeakTestReport adds LEAK_TEST_REPORT_ENTRY_LENGTH per mismatch
+#define LEAK_TEST_REPORT_BASE_LENGTH 4096
+#define LEAK_TEST_REPORT_ENTRY_LENGTH 192
+
+// Each class aims at one rule of the WfpksEnable3 policy, or at what it should still block
+typedef enum _LeakTestClass
+{
+	// TEST-NET destinations outside every allowed range
+	LeakTestV4Remote = 0,
+	// Inside the policy's remote addresses, the VPN servers
+	LeakTestV4Allowed,
+	// Inside the policy's local address ranges
+	LeakTestV4Lan,
+	LeakTestV4Multicast,
+	// TEST-NET destinations on the ports the remote port rules allow, probed over TCP and UDP whatever the rule's protocol
+	LeakTestV4Ports,
+	LeakTestV4Loopback,
+	// TEST-NET destinations sent out the tunnel adapter with IP_UNICAST_IF
+	LeakTestV4Tunnel,
+	// 2001:db8::/32 destinations
+	LeakTestV6Remote,
+	LeakTestV6LinkLocal,
+	LeakTestV6Multicast,
+	LeakTestV6Loopback,
+	LeakTestClassCount,
+} LeakTestClass;
+
+#define LEAK_TEST_ALL_CLASSES ((1 << LeakTestClassCount) - 1)
+
+typedef enum _LeakTestProtocol
+{
+	LeakTestUdp = 0,
+	LeakTestTcp = 1,
+} LeakTestProtocol;
+
+typedef enum _LeakTestVerdict
+{
+	LeakTestBlocked = 0,
+	LeakTestPassed,
+	// The stack refused the probe before the filters saw it, no route for example, or it never ran
+	LeakTestUndetermined,
+} LeakTestVerdict;
+
+// The arguments WfpksEnable3 was given, the expected verdicts are worked out from them
+typedef struct _LeakTestPolicy
+{
+	WFPKS_ADDR_AND_MASK* RemoteAddresses;
+	int RemoteAddressCount;
+	WFPKS_ADDR_AND_MASK* LocalAddresses;
+	int LocalAddressCount;
+	ULONG TapAdapterIndex;
+	LPCWSTR OvpnBinaryPath;
+	// NULL for WfpksEnable2's rules. Local port rules aren't checked, the probes' source ports are the stack's pick.
+	const WFPKS_PORT_RULE* PortRules;
+	int PortRuleCount;
+} LeakTestPolicy;
+
+// Zero fields take the defaults in LeakTest.cpp
+typedef struct _LeakTestOptions
+{
+	// LEAK_TEST_ALL_CLASSES when 0, classes the policy gives no targets for are skipped
+	DWORD Classes;
+	// TCP connects in flight at once, UDP probes finish as they are sent
+	UINT Concurrency;
+	DWORD TimeoutMs;
+	DWORD DeadlineMs;
+	// Same seed, same targets
+	UINT64 Seed;
+} LeakTestOptions;
+
+typedef struct _LeakTestProbe
+{
+	LeakTestClass Class;
+	LeakTestProtocol Protocol;
+	SOCKADDR_INET Address;
+	ULONG InterfaceIndex;
+	LeakTestVerdict Expected;
+	LeakTestVerdict Observed;
+	DWORD Error;
+	DWORD LatencyUs;
+} LeakTestProbe;
+
+typedef struct _LeakTestClassReport
+{
+	DWORD Probes;
+	// Expected blocked, got through
+	DWORD Escaped;
+	// Expected to get through, blocked
+	DWORD Overblocked;
+	DWORD Undetermined;
+	DWORD LatencyAvgUs;
+	DWORD LatencyMaxUs;
+} LeakTestClassReport;
+
+typedef struct _LeakTestReport
+{
+	DWORD Probes;
+	DWORD Blocked;
+	DWORD Passed;
+	DWORD Escaped;
+	DWORD Overblocked;
+	DWORD Undetermined;
+	// This process is the policy's exempt binary, IPv4 is expected to pass everywhere
+	BOOL Exempt;
+	UINT64 Seed;
+	DWORD MaxInFlight;
+	DWORD ElapsedUs;
+	LeakTestClassReport Classes[LeakTestClassCount];
+} LeakTestReport;
+
+// Fans probeCount probes out across the enabled classes, alternating UDP datagrams and TCP connects, and compares
+// what the filters did with what policy says they should do. A probe counts as blocked when the connect or send
+// fails with WSAEACCES, which is how an ALE block surfaces, and as passed once the stack has let it out, whether
+// or not anything answers. Run it with the killswitch engaged on policy, from a machine whose traffic may be
+// dropped. probes receives every probe, mismatches and timings included.
+extern DWORD LeakTestRun(
+	const LeakTestPolicy* policy,
+	const LeakTestOptions* options,
+	LeakTestProbe* probes,
+	UINT probeCount,
+	LeakTestReport* report
+);
+
+// Writes the report as JSON: the summary, the per class counters and every escaped or overblocked probe. On
+// ERROR_INSUFFICIENT_BUFFER written is a length that fits.
+extern DWORD LeakTestFormatReport(
+	const LeakTestReport* report,
+	const LeakTestProbe* probes,
+	UINT probeCount,
+	CHAR* buffer,
+	DWORD length,
+	DWORD* written
+);
@@ -0,0 +1,725 @@
+#include "stdafx.h"
+#include <string.h>
+#include <strsafe.h>
+#include "ManagementParser.h"
+
+// Slots for the message and state name perfect hashes, see NameHash
+#define MGMT_TYPE_SLOTS 32
+#define MGMT_STATE_SLOTS 16
+#define MGMT_PASSWORD_PROMPT "ENTER PASSWORD:"
+#define MGMT_BENCH_CHUNK 1460
+
+typedef struct _MgmtName
+{
+	const CHAR* Name;
+	UINT16 Value;
+	// Notifications start with '>', command replies such as SUCCESS: don't
+	BOOL Notification;
+} MgmtName;
+
+static const MgmtName TypeNames[] =
+{
+	{ "ECHO", MgmtEcho, TRUE },
+	{ "LOG", MgmtLog, TRUE },
+	{ "INFO", MgmtInfo, TRUE },
+	{ "FATAL", MgmtFatal, TRUE },
+	{ "BYTECOUNT", MgmtByteCount, TRUE },
+	{ "BYTECOUNT_CLI", MgmtByteCountClient, TRUE },
+	{ "HOLD", MgmtHold, TRUE },
+	{ "PASSWORD", MgmtPassword, TRUE },
+	{ "STATE", MgmtState, TRUE },
+	{ "NEED-OK", MgmtNeedOk, TRUE },
+	{ "NEED-STR", MgmtNeedStr, TRUE },
+	{ "REMOTE", MgmtRemote, TRUE },
+	{ "PROXY", MgmtProxy, TRUE },
+	{ "CLIENT", MgmtClient, TRUE },
+	{ "RSA_SIGN", MgmtRsaSign, TRUE },
+	{ "PK_SIGN", MgmtPkSign, TRUE },
+	{ "INFOMSG", MgmtInfoMessage, TRUE },
+	{ "NOTIFY", MgmtNotify, TRUE },
+	{ "SUCCESS", MgmtSuccess, FALSE },
+	{ "ERROR", MgmtError, FALSE },
+};
+
+static const MgmtName StateNames[] =
+{
+	{ "RESOLVE", MgmtStateResolve },
+	{ "CONNECTING", MgmtStateConnecting },
+	{ "WAIT", MgmtStateWait },
+	{ "AUTH", MgmtStateAuth },
+	{ "GET_CONFIG", MgmtStateGetConfig },
+	{ "ASSIGN_IP", MgmtStateAssignIp },
+	{ "ADD_ROUTES", MgmtStateAddRoutes },
+	{ "CONNECTED", MgmtStateConnected },
+	{ "RECONNECTING", MgmtStateReconnecting },
+	{ "EXITING", MgmtStateExiting },
+	{ "TCP_CONNECT", MgmtStateTcpConnect },
+	{ "AUTH_PENDING", MgmtStateAuthPending },
+};
+
+// Each slot holds a name index + 1, 0 for empty
+static INIT_ONCE NamesInit = INIT_ONCE_STATIC_INIT;
+static BYTE TypeSlots[MGMT_TYPE_SLOTS];
+static BYTE StateSlots[MGMT_STATE_SLOTS];
+
+typedef struct _MgmtHandler
+{
+	MgmtEventCallback Callback;
+	PVOID Context;
+} MgmtHandler;
+
+typedef struct _ManagementParser
+{
+	MgmtHandler Handlers[MgmtEventTypeCount];
+	// Start of a line split across Feed calls
+	CHAR Carry[MGMT_MAX_LINE];
+	UINT32 CarryLength;
+	BOOL CarryTruncated;
+	// Events for the managed side, guarded by Lock
+	SRWLOCK Lock;
+	MgmtBatch Pending;
+	// Index of the queued BYTECOUNT newer totals overwrite, -1 for none
+	INT PendingByteCount;
+} ManagementParser;
+
+// First and last character and length pick a unique slot for every known name, the multipliers were searched
+// for offline. A hit is confirmed by comparing the whole name.
+static UINT NameHash(const CHAR* name, UINT32 length, UINT first, UINT last, UINT slots)
+{
+	return ((BYTE)name[0] * first + (BYTE)name[length - 1] * last + length) & (slots - 1);
+}
+
+static UINT TypeHash(const CHAR* name, UINT32 length)
+{
+	return NameHash(name, length, 5, 16, MGMT_TYPE_SLOTS);
+}
+
+static UINT StateHash(const CHAR* name, UINT32 length)
+{
+	return NameHash(name, length, 5, 1, MGMT_STATE_SLOTS);
+}
+
+static BOOL CALLBACK BuildNameSlots(PINIT_ONCE initOnce, PVOID parameter, PVOID* context)
+{
+	for (UINT i = 0; i < ARRAYSIZE(TypeNames); i++)
+	{
+		TypeSlots[TypeHash(TypeNames[i].Name, (UINT32)strlen(TypeNames[i].Name))] = (BYTE)(i + 1);
+	}
+	for (UINT i = 0; i < ARRAYSIZE(StateNames); i++)
+	{
+		StateSlots[StateHash(StateNames[i].Name, (UINT32)strlen(StateNames[i].Name))] = (BYTE)(i + 1);
+	}
+
+	return TRUE;
+}
+
+static const MgmtName* LookupName(const MgmtName* names, const BYTE* slots, UINT slot, const CHAR* name, UINT32 length)
+{
+	if (slots[slot] == 0)
+	{
+		return NULL;
+	}
+
+	const MgmtName* entry = &names[slots[slot] - 1];
+	if (strncmp(entry->Name, name, length) != 0 || entry->Name[length] != '\0')
+	{
+		return NULL;
+	}
+
+	return entry;
+}
+
+typedef struct _MgmtCursor
+{
+	const CHAR* At;
+	const CHAR* End;
+	BOOL Done;
+} MgmtCursor;
+
+// Splits off the next comma separated field, FALSE once the text is used up
+static BOOL NextField(MgmtCursor* cursor, const CHAR** field, UINT32* length)
+{
+	if (cursor->Done)
+	{
+		return FALSE;
+	}
+
+	const CHAR* comma = (const CHAR*)memchr(cursor->At, ',', cursor->End - cursor->At);
+
+	*field = cursor->At;
+	if (comma == NULL)
+	{
+		*length = (UINT32)(cursor->End - cursor->At);
+		cursor->At = cursor->End;
+		cursor->Done = TRUE;
+	}
+	else
+	{
+		*length = (UINT32)(comma - cursor->At);
+		cursor->At = comma + 1;
+	}
+
+	return TRUE;
+}
+
+static BOOL ParseNumber(const CHAR* text, UINT32 length, UINT64 limit, UINT64* value)
+{
+	UINT64 parsed = 0;
+
+	if (length == 0)
+	{
+		return FALSE;
+	}
+
+	for (UINT32 i = 0; i < length; i++)
+	{
+		UINT digit = (UINT)(text[i] - '0');
+		if (digit > 9 || parsed > (limit - digit) / 10)
+		{
+			return FALSE;
+		}
+		parsed = parsed * 10 + digit;
+	}
+
+	*value = parsed;
+
+	return TRUE;
+}
+
+static BOOL NextNumber(MgmtCursor* cursor, UINT64 limit, UINT64* value)
+{
+	const CHAR* field;
+	UINT32 length;
+
+	return NextField(cursor, &field, &length) && ParseNumber(field, length, limit, value);
+}
+
+// Dotted quad to network order, an empty or IPv6 field leaves 0
+static void ParseIpv4(const CHAR* text, UINT32 length, UINT32* address)
+{
+	BYTE octets[4];
+	UINT count = 0;
+	MgmtCursor cursor = { text, text + length, FALSE };
+
+	*address = 0;
+
+	while (count < 4 && cursor.At < cursor.End)
+	{
+		const CHAR* dot = (const CHAR*)memchr(cursor.At, '.', cursor.End - cursor.At);
+		const CHAR* end = dot != NULL ? dot : cursor.End;
+		UINT64 octet;
+
+		if (!ParseNumber(cursor.At, (UINT32)(end - cursor.At), 255, &octet))
+		{
+			return;
+		}
+
+		octets[count++] = (BYTE)octet;
+		cursor.At = dot != NULL ? dot + 1 : cursor.End;
+	}
+
+	if (count == 4 && cursor.At == cursor.End)
+	{
+		memcpy(address, octets, sizeof(octets));
+	}
+}
+
+static BOOL StartsWithNoCase(const CHAR* text, UINT32 length, const CHAR* prefix)
+{
+	UINT32 i;
+
+	for (i = 0; prefix[i] != '\0'; i++)
+	{
+		if (i >= length || (text[i] | 0x20) != (prefix[i] | 0x20))
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void ParseByteCount(MgmtEvent* event, const CHAR* text, BOOL client)
+{
+	MgmtCursor cursor = { text, text + event->TextLength, FALSE };
+	UINT64 clientId = 0;
+
+	if ((client && !NextNumber(&cursor, MAXUINT32, &clientId))
+		|| !NextNumber(&cursor, MAXUINT64, &event->ByteCount.BytesIn)
+		|| !NextNumber(&cursor, MAXUINT64, &event->ByteCount.BytesOut))
+	{
+		event->Flags |= MGMT_FLAG_MALFORMED;
+	}
+
+	event->ByteCount.ClientId = (UINT32)clientId;
+}
+
+static void ParseState(MgmtEvent* event, const CHAR* text)
+{
+	MgmtCursor cursor = { text, text + event->TextLength, FALSE };
+	const CHAR* field;
+	UINT32 length;
+	UINT64 number;
+
+	event->State.State = MgmtStateUnknown;
+
+	if (!NextNumber(&cursor, MAXUINT32, &number))
+	{
+		event->Flags |= MGMT_FLAG_MALFORMED;
+		return;
+	}
+	event->State.Time = (UINT32)number;
+
+	if (NextField(&cursor, &field, &length) && length > 0)
+	{
+		const MgmtName* state = LookupName(StateNames, StateSlots, StateHash(field, length), field, length);
+		if (state != NULL)
+		{
+			event->State.State = state->Value;
+		}
+	}
+
+	if (NextField(&cursor, &field, &length))
+	{
+		event->State.DescriptionOffset = (UINT16)(field - text);
+		event->State.DescriptionLength = (UINT16)length;
+		if (length == 5 && memcmp(field, "ERROR", 5) == 0)
+		{
+			event->Flags |= MGMT_FLAG_STATE_ERROR;
+		}
+	}
+
+	if (NextField(&cursor, &field, &length))
+	{
+		ParseIpv4(field, length, &event->State.LocalIp);
+	}
+	if (NextField(&cursor, &field, &length))
+	{
+		ParseIpv4(field, length, &event->State.RemoteIp);
+	}
+	if (NextField(&cursor, &field, &length) && ParseNumber(field, length, MAXUINT16, &number))
+	{
+		event->State.RemotePort = (UINT16)number;
+	}
+}
+
+// LOG is time,flags,message and ECHO time,command. The message keeps any commas it has.
+static void ParseLog(MgmtEvent* event, const CHAR* text, BOOL flags)
+{
+	MgmtCursor cursor = { text, text + event->TextLength, FALSE };
+	const CHAR* field;
+	UINT32 length;
+	UINT64 number;
+
+	if (!NextNumber(&cursor, MAXUINT32, &number))
+	{
+		event->Flags |= MGMT_FLAG_MALFORMED;
+		return;
+	}
+	event->Log.Time = (UINT32)number;
+
+	if (flags && NextField(&cursor, &field, &length))
+	{
+		for (UINT32 i = 0; i < length; i++)
+		{
+			switch (field[i])
+			{
+			case 'I': event->Log.Flags |= MGMT_LOG_INFO; break;
+			case 'F': event->Log.Flags |= MGMT_LOG_FATAL; break;
+			case 'N': event->Log.Flags |= MGMT_LOG_NONFATAL; break;
+			case 'W': event->Log.Flags |= MGMT_LOG_WARNING; break;
+			case 'D': event->Log.Flags |= MGMT_LOG_DEBUG; break;
+			}
+		}
+	}
+
+	event->Log.MessageOffset = (UINT16)(cursor.At - text);
+	event->Log.MessageLength = (UINT16)(cursor.End - cursor.At);
+}
+
+// Hands the event to its handler or queues it with a copy of its text
+static void Emit(ManagementParser* parser, MgmtEvent* event, const CHAR* text)
+{
+	const MgmtHandler* handler = &parser->Handlers[event->Type];
+
+	if (handler->Callback != NULL)
+	{
+		event->TextOffset = 0;
+		handler->Callback(event, text, handler->Context);
+		return;
+	}
+
+	AcquireSRWLockExclusive(&parser->Lock);
+
+	MgmtBatch* pending = &parser->Pending;
+	MgmtEvent* slot = NULL;
+
+	BOOL totals = event->Type == MgmtByteCount && (event->Flags & MGMT_FLAG_MALFORMED) == 0;
+
+	if (pending->TextUsed + event->TextLength <= MGMT_BATCH_TEXT)
+	{
+		if (totals && parser->PendingByteCount >= 0)
+		{
+			// Totals are cumulative, the newer ones replace the queued ones
+			slot = &pending->Events[parser->PendingByteCount];
+			pending->Coalesced++;
+		}
+		else if (pending->Count < MGMT_BATCH_EVENTS)
+		{
+			if (totals)
+			{
+				parser->PendingByteCount = pending->Count;
+			}
+			slot = &pending->Events[pending->Count++];
+		}
+	}
+
+	if (slot != NULL)
+	{
+		memcpy(pending->Text + pending->TextUsed, text, event->TextLength);
+		*slot = *event;
+		slot->TextOffset = pending->TextUsed;
+		pending->TextUsed += event->TextLength;
+	}
+	else
+	{
+		pending->Dropped++;
+	}
+
+	ReleaseSRWLockExclusive(&parser->Lock);
+}
+
+static void DispatchLine(ManagementParser* parser, const CHAR* line, UINT32 length, BOOL truncated)
+{
+	MgmtEvent event;
+	const CHAR* text = line;
+
+	while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' '))
+	{
+		length--;
+	}
+
+	if (length == 0)
+	{
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.Type = MgmtLine;
+	event.Flags = truncated ? MGMT_FLAG_TRUNCATED : 0;
+
+	BOOL notification = line[0] == '>';
+	const CHAR* name = line + (notification ? 1 : 0);
+	const CHAR* colon = (const CHAR*)memchr(name, ':', length - (name - line));
+
+	if (colon != NULL && colon > name)
+	{
+		UINT32 nameLength = (UINT32)(colon - name);
+		const MgmtName* type = LookupName(TypeNames, TypeSlots, TypeHash(name, nameLength), name, nameLength);
+
+		if (type != NULL && type->Notification == notification)
+		{
+			event.Type = type->Value;
+			text = colon + 1;
+			while (text < line + length && *text == ' ')
+			{
+				text++;
+			}
+		}
+	}
+
+	event.TextLength = (UINT32)(line + length - text);
+
+	switch (event.Type)
+	{
+	case MgmtByteCount:
+	case MgmtByteCountClient:
+		ParseByteCount(&event, text, event.Type == MgmtByteCountClient);
+		break;
+	case MgmtState:
+		ParseState(&event, text);
+		break;
+	case MgmtLog:
+	case MgmtEcho:
+		ParseLog(&event, text, event.Type == MgmtLog);
+		break;
+	case MgmtPassword:
+		if (StartsWithNoCase(text, event.TextLength, "need 'auth'"))
+		{
+			event.Flags |= MGMT_FLAG_PASSWORD_NEED_AUTH;
+		}
+		else if (StartsWithNoCase(text, event.TextLength, "need 'private key'"))
+		{
+			event.Flags |= MGMT_FLAG_PASSWORD_NEED_PRIVATE_KEY;
+		}
+		else if (StartsWithNoCase(text, event.TextLength, "verification failed"))
+		{
+			event.Flags |= MGMT_FLAG_PASSWORD_VERIFICATION_FAILED;
+		}
+		break;
+	case MgmtSuccess:
+		if (event.TextLength == 22 && StartsWithNoCase(text, event.TextLength, "hold release succeeded"))
+		{
+			event.Flags |= MGMT_FLAG_SUCCESS_HOLD_RELEASED;
+		}
+		break;
+	}
+
+	Emit(parser, &event, text);
+}
+
+DWORD ManagementParserCreate(HMGMTPARSER* parser)
+{
+	if (parser == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	InitOnceExecuteOnce(&NamesInit, BuildNameSlots, NULL, NULL);
+
+	ManagementParser* created = (ManagementParser*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ManagementParser));
+	if (created == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	InitializeSRWLock(&created->Lock);
+	created->PendingByteCount = -1;
+	*parser = created;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementParserSetHandler(HMGMTPARSER parser, MgmtEventType type, MgmtEventCallback callback, PVOID context)
+{
+	if (parser == NULL || type <= MgmtUnknown || type >= MgmtEventTypeCount)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	parser->Handlers[type].Callback = callback;
+	parser->Handlers[type].Context = context;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementParserFeed(HMGMTPARSER parser, const CHAR* data, SIZE_T length)
+{
+	if (parser == NULL || (data == NULL && length > 0))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	while (length > 0)
+	{
+		const CHAR* newline = (const CHAR*)memchr(data, '\n', length);
+		SIZE_T lineLength = newline != NULL ? (SIZE_T)(newline - data) : length;
+
+		if (parser->CarryLength > 0 || parser->CarryTruncated || newline == NULL)
+		{
+			// Finish or start a line that spans calls
+			SIZE_T room = MGMT_MAX_LINE - parser->CarryLength;
+			SIZE_T copied = min(lineLength, room);
+
+			memcpy(parser->Carry + parser->CarryLength, data, copied);
+			parser->CarryLength += (UINT32)copied;
+			parser->CarryTruncated |= copied < lineLength;
+
+			if (newline == NULL)
+			{
+				break;
+			}
+
+			DispatchLine(parser, parser->Carry, parser->CarryLength, parser->CarryTruncated);
+			parser->CarryLength = 0;
+			parser->CarryTruncated = FALSE;
+		}
+		else if (lineLength <= MGMT_MAX_LINE)
+		{
+			DispatchLine(parser, data, (UINT32)lineLength, FALSE);
+		}
+		else
+		{
+			DispatchLine(parser, data, MGMT_MAX_LINE, TRUE);
+		}
+
+		data += lineLength + 1;
+		length -= lineLength + 1;
+	}
+
+	// The password prompt is the one message without a line end
+	if (parser->CarryLength == sizeof(MGMT_PASSWORD_PROMPT) - 1 && memcmp(parser->Carry, MGMT_PASSWORD_PROMPT, parser->CarryLength) == 0)
+	{
+		MgmtEvent event;
+
+		memset(&event, 0, sizeof(event));
+		event.Type = MgmtPasswordPrompt;
+		parser->CarryLength = 0;
+
+		Emit(parser, &event, parser->Carry);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementParserDrain(HMGMTPARSER parser, MgmtBatch* batch)
+{
+	if (parser == NULL || batch == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&parser->Lock);
+
+	MgmtBatch* pending = &parser->Pending;
+
+	batch->Count = pending->Count;
+	batch->Dropped = pending->Dropped;
+	batch->Coalesced = pending->Coalesced;
+	batch->TextUsed = pending->TextUsed;
+	memcpy(batch->Events, pending->Events, pending->Count * sizeof(MgmtEvent));
+	memcpy(batch->Text, pending->Text, pending->TextUsed);
+
+	pending->Count = 0;
+	pending->Dropped = 0;
+	pending->Coalesced = 0;
+	pending->TextUsed = 0;
+	parser->PendingByteCount = -1;
+
+	ReleaseSRWLockExclusive(&parser->Lock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementParserReset(HMGMTPARSER parser)
+{
+	MgmtBatch* discarded;
+
+	if (parser == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	parser->CarryLength = 0;
+	parser->CarryTruncated = FALSE;
+
+	discarded = (MgmtBatch*)HeapAlloc(GetProcessHeap(), 0, sizeof(MgmtBatch));
+	if (discarded == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	ManagementParserDrain(parser, discarded);
+	HeapFree(GetProcessHeap(), 0, discarded);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementParserClose(HMGMTPARSER parser)
+{
+	if (parser == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	HeapFree(GetProcessHeap(), 0, parser);
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+// Appends the benchmark's idea of a busy connection: mostly BYTECOUNT and LOG with the odd STATE
+static SIZE_T WriteBenchLine(CHAR* buffer, SIZE_T capacity, UINT64 line)
+{
+	UINT32 time = 1700000000 + (UINT32)(line / 8);
+	CHAR* end = buffer;
+	HRESULT result;
+
+	switch (line % 8)
+	{
+	case 0:
+	case 3:
+	case 6:
+		result = StringCchPrintfExA(buffer, capacity, &end, NULL, 0, ">BYTECOUNT:%llu,%llu\r\n", line * 1337, line * 7331);
+		break;
+	case 7:
+		result = StringCchPrintfExA(buffer, capacity, &end, NULL, 0, ">STATE:%u,CONNECTED,SUCCESS,10.8.%u.%u,185.%u.12.7,1194,,\r\n",
+			time, (UINT)(line % 250), (UINT)(line % 200) + 2, (UINT)(line % 200));
+		break;
+	default:
+		result = StringCchPrintfExA(buffer, capacity, &end, NULL, 0, ">LOG:%u,I,Data Channel: sent %llu bytes, cipher AES-256-GCM, peer-id %u\r\n",
+			time, line * 97, (UINT)(line % 64));
+		break;
+	}
+
+	return SUCCEEDED(result) ? (SIZE_T)(end - buffer) : 0;
+}
+
+DWORD ManagementParserRunBenchmark(UINT64 lines, ManagementParserBenchReport* report)
+{
+	// A stream of this many lines is generated once and fed round until lines have gone through
+	const UINT64 streamLines = 4096;
+	const SIZE_T streamCapacity = (SIZE_T)streamLines * 128;
+	HMGMTPARSER parser = NULL;
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+
+	if (report == NULL || lines == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(report, 0, sizeof(ManagementParserBenchReport));
+
+	CHAR* stream = (CHAR*)HeapAlloc(GetProcessHeap(), 0, streamCapacity);
+	MgmtBatch* batch = (MgmtBatch*)HeapAlloc(GetProcessHeap(), 0, sizeof(MgmtBatch));
+	DWORD result = stream != NULL && batch != NULL ? ManagementParserCreate(&parser) : ERROR_NOT_ENOUGH_MEMORY;
+
+	if (result == ERROR_SUCCESS)
+	{
+		SIZE_T streamLength = 0;
+		for (UINT64 line = 0; line < streamLines; line++)
+		{
+			streamLength += WriteBenchLine(stream + streamLength, streamCapacity - streamLength, line);
+		}
+
+		UINT64 passes = (lines + streamLines - 1) / streamLines;
+
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+
+		for (UINT64 pass = 0; pass < passes; pass++)
+		{
+			for (SIZE_T offset = 0; offset < streamLength; offset += MGMT_BENCH_CHUNK)
+			{
+				ManagementParserFeed(parser, stream + offset, min((SIZE_T)MGMT_BENCH_CHUNK, streamLength - offset));
+				ManagementParserDrain(parser, batch);
+				report->Events += batch->Count;
+			}
+		}
+
+		QueryPerformanceCounter(&end);
+
+		DOUBLE seconds = (DOUBLE)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+		report->Lines = passes * streamLines;
+		report->Bytes = passes * streamLength;
+		report->LinesPerSecond = seconds > 0 ? report->Lines / seconds : 0;
+		report->MegabytesPerSecond = seconds > 0 ? report->Bytes / seconds / (1024 * 1024) : 0;
+
+		ManagementParserClose(parser);
+	}
+
+	if (stream != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, stream);
+	}
+	if (batch != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, batch);
+	}
+
+	return result;
+}
+#endif
@@ -0,0 +1,167 @@
+#pragma once
+#include <windows.h>
+
+// Longest line kept whole, the rest of a longer line is dropped and the event flagged MGMT_FLAG_TRUNCATED
+#define MGMT_MAX_LINE 8192
+#define MGMT_BATCH_EVENTS 128
+#define MGMT_BATCH_TEXT 32768
+
+typedef enum _MgmtEventType
+{
+	MgmtUnknown = 0,
+	MgmtEcho,
+	MgmtLog,
+	MgmtInfo,
+	MgmtFatal,
+	MgmtByteCount,
+	MgmtByteCountClient,
+	MgmtHold,
+	MgmtPassword,
+	MgmtState,
+	MgmtNeedOk,
+	MgmtNeedStr,
+	MgmtRemote,
+	MgmtProxy,
+	MgmtClient,
+	MgmtRsaSign,
+	MgmtPkSign,
+	MgmtInfoMessage,
+	MgmtNotify,
+	MgmtSuccess,
+	MgmtError,
+	// "ENTER PASSWORD:", sent without a line end
+	MgmtPasswordPrompt,
+	// Any other line, usually part of a command's reply
+	MgmtLine,
+	MgmtEventTypeCount,
+} MgmtEventType;
+
+// Same order as OVPNState on the managed side
+typedef enum _MgmtOvpnState
+{
+	MgmtStateResolve = 0,
+	MgmtStateConnecting,
+	MgmtStateWait,
+	MgmtStateAuth,
+	MgmtStateGetConfig,
+	MgmtStateAssignIp,
+	MgmtStateAddRoutes,
+	MgmtStateConnected,
+	MgmtStateReconnecting,
+	MgmtStateExiting,
+	MgmtStateTcpConnect,
+	MgmtStateAuthPending,
+	MgmtStateUnknown = 0xFFFF,
+} MgmtOvpnState;
+
+#define MGMT_FLAG_TRUNCATED 0x0001
+// The numeric fields didn't parse, only the text is usable
+#define MGMT_FLAG_MALFORMED 0x0002
+// STATE whose description is ERROR, CONNECTED with errors
+#define MGMT_FLAG_STATE_ERROR 0x0010
+#define MGMT_FLAG_PASSWORD_NEED_AUTH 0x0010
+#define MGMT_FLAG_PASSWORD_NEED_PRIVATE_KEY 0x0020
+#define MGMT_FLAG_PASSWORD_VERIFICATION_FAILED 0x0040
+#define MGMT_FLAG_SUCCESS_HOLD_RELEASED 0x0010
+
+// LOG flag letters
+#define MGMT_LOG_INFO 0x01
+#define MGMT_LOG_FATAL 0x02
+#define MGMT_LOG_NONFATAL 0x04
+#define MGMT_LOG_WARNING 0x08
+#define MGMT_LOG_DEBUG 0x10
+
+typedef struct _MgmtByteCountData
+{
+	UINT64 BytesIn;
+	UINT64 BytesOut;
+	// BYTECOUNT_CLI only
+	UINT32 ClientId;
+} MgmtByteCountData;
+
+// Offsets and lengths are into the event's text
+typedef struct _MgmtStateData
+{
+	UINT32 Time;
+	UINT16 State;
+	UINT16 RemotePort;
+	// IPv4 addresses in network order, 0 when absent
+	UINT32 LocalIp;
+	UINT32 RemoteIp;
+	UINT16 DescriptionOffset;
+	UINT16 DescriptionLength;
+} MgmtStateData;
+
+// LOG and ECHO
+typedef struct _MgmtLogData
+{
+	UINT32 Time;
+	UINT16 Flags;
+	UINT16 MessageOffset;
+	UINT16 MessageLength;
+} MgmtLogData;
+
+// Fixed size and pointer free so a batch crosses to managed code in one copy
+typedef struct _MgmtEvent
+{
+	UINT16 Type;
+	UINT16 Flags;
+	// Text after the "TYPE:" prefix, relative to the text base handed over with the event
+	UINT32 TextOffset;
+	UINT32 TextLength;
+	union
+	{
+		MgmtByteCountData ByteCount;
+		MgmtStateData State;
+		MgmtLogData Log;
+	};
+} MgmtEvent;
+
+typedef struct _MgmtBatch
+{
+	UINT Count;
+	// Events lost to a full batch since the last drain
+	UINT Dropped;
+	// BYTECOUNT events folded into a later one since the last drain, only the newest totals are kept
+	UINT Coalesced;
+	UINT TextUsed;
+	MgmtEvent Events[MGMT_BATCH_EVENTS];
+	CHAR Text[MGMT_BATCH_TEXT];
+} MgmtBatch;
+
+// text is only valid during the call
+typedef void (CALLBACK* MgmtEventCallback)(const MgmtEvent* event, const CHAR* text, PVOID context);
+
+typedef struct _ManagementParser* HMGMTPARSER;
+
+extern DWORD ManagementParserCreate(HMGMTPARSER* parser);
+
+// Routes one event type to callback, which runs on the thread calling ManagementParserFeed. Types without a
+// callback are queued for ManagementParserDrain. Set handlers before feeding.
+extern DWORD ManagementParserSetHandler(HMGMTPARSER parser, MgmtEventType type, MgmtEventCallback callback, PVOID context);
+
+// Consumes raw bytes off the management socket. Complete lines are parsed where they lie in data, only a line
+// split across calls is copied. Feed from one thread at a time.
+extern DWORD ManagementParserFeed(HMGMTPARSER parser, const CHAR* data, SIZE_T length);
+
+// Moves the queued events into batch, text offsets are into batch->Text. Safe alongside ManagementParserFeed.
+extern DWORD ManagementParserDrain(HMGMTPARSER parser, MgmtBatch* batch);
+
+// Forgets a partial line and the queued events, for a new connection
+extern DWORD ManagementParserReset(HMGMTPARSER parser);
+extern DWORD ManagementParserClose(HMGMTPARSER parser);
+
+#ifdef NATIVE_BENCH
+typedef struct _ManagementParserBenchReport
+{
+	UINT64 Lines;
+	UINT64 Bytes;
+	UINT64 Events;
+	DOUBLE LinesPerSecond;
+	DOUBLE MegabytesPerSecond;
+} ManagementParserBenchReport;
+
+// Feeds a synthetic stream of BYTECOUNT, LOG and STATE lines in TCP segment sized chunks, draining after each
+// chunk as the managed side would after each socket read
+extern DWORD ManagementParserRunBenchmark(UINT64 lines, ManagementParserBenchReport* report);
+#endif
@@ -0,0 +1,1174 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <string.h>
+#include <strsafe.h>
+#include "ManagementTransport.h"
+#include "NativeLog.h"
+
+#define TRANSPORT_DEFAULT_IN_FLIGHT 32
+#define TRANSPORT_DEFAULT_QUEUED 128
+#define TRANSPORT_MAX_QUEUED 4096
+#define TRANSPORT_RECV_BUFFER 16384
+// Room for a window of short commands, so a pipelined burst leaves in one send
+#define TRANSPORT_SEND_BUFFER 16384
+#define TRANSPORT_BENCH_NOTIFY_EVERY 8
+#define TRANSPORT_BENCH_CONNECT_MS 5000
+#define TRANSPORT_BENCH_REPLY_MS 30000
+#define TRANSPORT_BENCH_GREETING ">INFO:OpenVPN Management Interface Version 5 -- type 'help' for more info\r\n"
+#define TRANSPORT_BENCH_VERSION "OpenVPN Version: OpenVPN 2.6.8 x86_64-w64-mingw32\r\nManagement Version: 5\r\nEND\r\n"
+#define TRANSPORT_BENCH_SUCCESS "SUCCESS: bytecount interval changed\r\n"
+#define TRANSPORT_BENCH_BYTECOUNT ">BYTECOUNT:104857600,52428800\r\n"
+
+typedef enum _TransportState
+{
+	TransportListening = 0,
+	// Connected, waiting for the password to be asked for and accepted
+	TransportAuthenticating,
+	TransportConnected,
+} TransportState;
+
+typedef struct _MgmtCommand
+{
+	UINT64 Id;
+	INT64 QueuedTicks;
+	MgmtReplyKind Kind;
+	UINT32 Length;
+	// With its line end
+	CHAR Text[MGMT_TRANSPORT_MAX_COMMAND + 1];
+} MgmtCommand;
+
+typedef struct _ManagementTransport
+{
+	SOCKET ListenSocket;
+	WSAEVENT ListenEvent;
+	WSAEVENT ClientEvent;
+	// Auto reset, set by ManagementTransportSend and ManagementTransportClose
+	HANDLE WakeEvent;
+	// Manual reset, set while OpenVPN is connected and past the password
+	HANDLE ConnectedEvent;
+	// The caller's, set on every connection
+	HANDLE ConnectEvent;
+	HANDLE Thread;
+	HMGMTPARSER Parser;
+	MgmtReplyCallback Callback;
+	PVOID Context;
+	USHORT Port;
+	BOOL HavePassword;
+	CHAR Password[MGMT_TRANSPORT_MAX_COMMAND + 1];
+	UINT32 PasswordLength;
+	INT64 TicksPerSecond;
+	volatile LONG ClientProcessId;
+	volatile LONG Stopping;
+	// A ring of commands, in flight ones first, guarded by Lock. Only the transport thread removes them.
+	SRWLOCK Lock;
+	MgmtCommand* Commands;
+	UINT Capacity;
+	UINT Head;
+	UINT Count;
+	UINT64 NextId;
+	// Everything below belongs to the transport thread
+	UINT MaxInFlight;
+	UINT InFlight;
+	SOCKET Client;
+	TransportState State;
+	// Cleared when a send would block, set again by FD_WRITE
+	BOOL Writable;
+	CHAR* In;
+	CHAR* Out;
+	UINT OutUsed;
+	UINT OutSent;
+	// The list reply being gathered for the command at the head
+	CHAR* Reply;
+	UINT32 ReplyLength;
+	UINT16 ReplyFlags;
+} ManagementTransport;
+
+static INT64 NowTicks()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static void MarkConnected(ManagementTransport* transport)
+{
+	transport->State = TransportConnected;
+	SetEvent(transport->ConnectedEvent);
+
+	if (transport->ConnectEvent != NULL)
+	{
+		SetEvent(transport->ConnectEvent);
+	}
+}
+
+// Takes the command at the head out of the ring and hands its reply over
+static void Complete(ManagementTransport* transport, DWORD result, const CHAR* text, UINT32 length, UINT16 flags)
+{
+	MgmtReply reply;
+	INT64 queuedTicks;
+
+	AcquireSRWLockExclusive(&transport->Lock);
+	MgmtCommand* command = &transport->Commands[transport->Head];
+	reply.CommandId = command->Id;
+	queuedTicks = command->QueuedTicks;
+	transport->Head = (transport->Head + 1) % transport->Capacity;
+	transport->Count--;
+	ReleaseSRWLockExclusive(&transport->Lock);
+
+	if (transport->InFlight > 0)
+	{
+		transport->InFlight--;
+	}
+
+	reply.Result = result;
+	reply.Flags = flags;
+	reply.Reserved = 0;
+	reply.TextLength = length;
+	reply.RoundTripUs = (UINT32)min((NowTicks() - queuedTicks) * 1000000 / transport->TicksPerSecond, (INT64)MAXUINT32);
+
+	if (transport->Callback != NULL)
+	{
+		transport->Callback(&reply, text != NULL ? text : "", transport->Context);
+	}
+}
+
+// Commands queued from the callbacks while this runs are left for later
+static void FailAll(ManagementTransport* transport, DWORD result)
+{
+	AcquireSRWLockShared(&transport->Lock);
+	UINT pending = transport->Count;
+	ReleaseSRWLockShared(&transport->Lock);
+
+	transport->ReplyLength = 0;
+	transport->ReplyFlags = 0;
+
+	for (UINT i = 0; i < pending; i++)
+	{
+		Complete(transport, result, NULL, 0, 0);
+	}
+
+	transport->InFlight = 0;
+}
+
+static MgmtReplyKind HeadKind(ManagementTransport* transport)
+{
+	// The head can only be taken out by this thread, it's safe to look at once it's in flight
+	return transport->Commands[transport->Head].Kind;
+}
+
+static void CALLBACK OnSuccess(const MgmtEvent* event, const CHAR* text, PVOID context)
+{
+	ManagementTransport* transport = (ManagementTransport*)context;
+
+	if (transport->State == TransportAuthenticating)
+	{
+		MarkConnected(transport);
+		NATIVELOG_INFO("management password accepted\n");
+		return;
+	}
+
+	if (transport->InFlight == 0)
+	{
+		NATIVELOG_WARNING("management SUCCESS with no command waiting: %.*s\n", (int)event->TextLength, text);
+		return;
+	}
+
+	// A SUCCESS: line ahead of a list only says the list is coming
+	if (HeadKind(transport) == MgmtReplySingle)
+	{
+		Complete(transport, ERROR_SUCCESS, text, event->TextLength, event->Flags & MGMT_FLAG_TRUNCATED ? MGMT_REPLY_TRUNCATED : 0);
+	}
+}
+
+static void CALLBACK OnError(const MgmtEvent* event, const CHAR* text, PVOID context)
+{
+	ManagementTransport* transport = (ManagementTransport*)context;
+
+	if (transport->State == TransportAuthenticating)
+	{
+		// OpenVPN hangs up after a wrong password, FD_CLOSE follows
+		NATIVELOG_ERROR("management password refused: %.*s\n", (int)event->TextLength, text);
+		return;
+	}
+
+	if (transport->InFlight == 0)
+	{
+		NATIVELOG_WARNING("management ERROR with no command waiting: %.*s\n", (int)event->TextLength, text);
+		return;
+	}
+
+	transport->ReplyLength = 0;
+	transport->ReplyFlags = 0;
+	Complete(transport, ERROR_REQUEST_REFUSED, text, event->TextLength, event->Flags & MGMT_FLAG_TRUNCATED ? MGMT_REPLY_TRUNCATED : 0);
+}
+
+static void CALLBACK OnLine(const MgmtEvent* event, const CHAR* text, PVOID context)
+{
+	ManagementTransport* transport = (ManagementTransport*)context;
+
+	if (transport->InFlight == 0 || HeadKind(transport) != MgmtReplyList)
+	{
+		NATIVELOG_WARNING("management line with no list command waiting: %.*s\n", (int)event->TextLength, text);
+		return;
+	}
+
+	if (event->TextLength == 3 && memcmp(text, "END", 3) == 0)
+	{
+		UINT32 length = transport->ReplyLength;
+		UINT16 flags = transport->ReplyFlags;
+
+		transport->ReplyLength = 0;
+		transport->ReplyFlags = 0;
+		Complete(transport, ERROR_SUCCESS, transport->Reply, length, flags);
+		return;
+	}
+
+	UINT32 room = MGMT_TRANSPORT_MAX_REPLY - transport->ReplyLength;
+	if (event->TextLength + 1 > room || (event->Flags & MGMT_FLAG_TRUNCATED) != 0)
+	{
+		transport->ReplyFlags |= MGMT_REPLY_TRUNCATED;
+	}
+
+	if (event->TextLength + 1 <= room)
+	{
+		memcpy(transport->Reply + transport->ReplyLength, text, event->TextLength);
+		transport->ReplyLength += event->TextLength;
+		transport->Reply[transport->ReplyLength++] = '\n';
+	}
+}
+
+static void CALLBACK OnPasswordPrompt(const MgmtEvent* event, const CHAR* text, PVOID context)
+{
+	ManagementTransport* transport = (ManagementTransport*)context;
+
+	if (transport->State != TransportAuthenticating)
+	{
+		NATIVELOG_ERROR("OpenVPN asked for a management password but none was given\n");
+		return;
+	}
+
+	// Nothing else is written before the password is accepted, the buffer is empty
+	memcpy(transport->Out, transport->Password, transport->PasswordLength);
+	transport->OutUsed = transport->PasswordLength;
+	transport->OutSent = 0;
+}
+
+// Moves as many commands as the window and the buffer allow into Out
+static void Fill(ManagementTransport* transport)
+{
+	AcquireSRWLockShared(&transport->Lock);
+
+	while (transport->InFlight < transport->MaxInFlight && transport->InFlight < transport->Count)
+	{
+		const MgmtCommand* command = &transport->Commands[(transport->Head + transport->InFlight) % transport->Capacity];
+		if (transport->OutUsed + command->Length > TRANSPORT_SEND_BUFFER)
+		{
+			break;
+		}
+
+		memcpy(transport->Out + transport->OutUsed, command->Text, command->Length);
+		transport->OutUsed += command->Length;
+		transport->InFlight++;
+	}
+
+	ReleaseSRWLockShared(&transport->Lock);
+}
+
+// FALSE when the connection failed
+static BOOL Flush(ManagementTransport* transport)
+{
+	for (;;)
+	{
+		if (transport->OutSent == transport->OutUsed)
+		{
+			transport->OutUsed = 0;
+			transport->OutSent = 0;
+
+			if (transport->State == TransportConnected)
+			{
+				Fill(transport);
+			}
+
+			if (transport->OutUsed == 0)
+			{
+				return TRUE;
+			}
+		}
+
+		if (!transport->Writable)
+		{
+			return TRUE;
+		}
+
+		int sent = send(transport->Client, transport->Out + transport->OutSent, (int)(transport->OutUsed - transport->OutSent), 0);
+		if (sent == SOCKET_ERROR)
+		{
+			int error = WSAGetLastError();
+			if (error == WSAEWOULDBLOCK)
+			{
+				transport->Writable = FALSE;
+				return TRUE;
+			}
+
+			NATIVELOG_WARNING("management send failed: %d\n", error);
+			return FALSE;
+		}
+
+		transport->OutSent += (UINT)sent;
+	}
+}
+
+// Reads until the socket runs dry, FALSE when the connection closed or failed
+static BOOL ReadAvailable(ManagementTransport* transport)
+{
+	for (;;)
+	{
+		int received = recv(transport->Client, transport->In, TRANSPORT_RECV_BUFFER, 0);
+		if (received == 0)
+		{
+			return FALSE;
+		}
+
+		if (received == SOCKET_ERROR)
+		{
+			int error = WSAGetLastError();
+			if (error == WSAEWOULDBLOCK)
+			{
+				return TRUE;
+			}
+
+			NATIVELOG_WARNING("management recv failed: %d\n", error);
+			return FALSE;
+		}
+
+		ManagementParserFeed(transport->Parser, transport->In, (SIZE_T)received);
+	}
+}
+
+// The process at the other end of a loopback connection, 0 when it can't be found
+static DWORD PeerProcessId(ManagementTransport* transport, const SOCKADDR_IN* peer)
+{
+	MIB_TCPTABLE_OWNER_PID* table = NULL;
+	DWORD size = 0;
+	DWORD result = ERROR_INSUFFICIENT_BUFFER;
+	DWORD processId = 0;
+
+	// The table can grow between the two calls
+	for (UINT attempt = 0; attempt < 3 && result == ERROR_INSUFFICIENT_BUFFER; attempt++)
+	{
+		if (table != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, table);
+			table = NULL;
+		}
+
+		if (size > 0)
+		{
+			table = (MIB_TCPTABLE_OWNER_PID*)HeapAlloc(GetProcessHeap(), 0, size);
+			if (table == NULL)
+			{
+				return 0;
+			}
+		}
+
+		result = GetExtendedTcpTable(table, &size, FALSE, AF_INET, TCP_TABLE_OWNER_PID_CONNECTIONS, 0);
+	}
+
+	for (DWORD i = 0; result == NO_ERROR && i < table->dwNumEntries; i++)
+	{
+		const MIB_TCPROW_OWNER_PID* row = &table->table[i];
+
+		if (row->dwLocalAddr == peer->sin_addr.s_addr && (USHORT)row->dwLocalPort == peer->sin_port
+			&& (USHORT)row->dwRemotePort == htons(transport->Port))
+		{
+			processId = row->dwOwningPid;
+			break;
+		}
+	}
+
+	if (table != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, table);
+	}
+
+	return processId;
+}
+
+static void Accept(ManagementTransport* transport)
+{
+	SOCKADDR_IN peer;
+	int peerLength = sizeof(peer);
+	BOOL noDelay = TRUE;
+
+	SOCKET client = accept(transport->ListenSocket, (SOCKADDR*)&peer, &peerLength);
+	if (client == INVALID_SOCKET)
+	{
+		if (WSAGetLastError() != WSAEWOULDBLOCK)
+		{
+			NATIVELOG_WARNING("management accept failed: %d\n", WSAGetLastError());
+		}
+		return;
+	}
+
+	if (transport->Client != INVALID_SOCKET)
+	{
+		NATIVELOG_WARNING("refused a second management connection\n");
+		closesocket(client);
+		return;
+	}
+
+	DWORD expected = (DWORD)transport->ClientProcessId;
+	if (expected != 0)
+	{
+		DWORD actual = PeerProcessId(transport, &peer);
+		if (actual != expected)
+		{
+			NATIVELOG_WARNING("refused a management connection from process %lu, expected %lu\n", actual, expected);
+			closesocket(client);
+			return;
+		}
+	}
+
+	// The accepted socket would otherwise share the listening socket's FD_ACCEPT selection
+	if (WSAEventSelect(client, transport->ClientEvent, FD_READ | FD_WRITE | FD_CLOSE) != 0)
+	{
+		NATIVELOG_WARNING("management WSAEventSelect failed: %d\n", WSAGetLastError());
+		closesocket(client);
+		return;
+	}
+
+	// Replies are waited on one window at a time, Nagle would hold a window back for the previous one's ACK
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	ManagementParserReset(transport->Parser);
+	transport->Client = client;
+	transport->Writable = TRUE;
+	transport->OutUsed = 0;
+	transport->OutSent = 0;
+	transport->State = TransportAuthenticating;
+
+	if (!transport->HavePassword)
+	{
+		MarkConnected(transport);
+	}
+
+	NATIVELOG_INFO("OpenVPN connected to management port %u\n", transport->Port);
+}
+
+static void Disconnect(ManagementTransport* transport)
+{
+	closesocket(transport->Client);
+	transport->Client = INVALID_SOCKET;
+	transport->State = TransportListening;
+	transport->OutUsed = 0;
+	transport->OutSent = 0;
+	ResetEvent(transport->ConnectedEvent);
+
+	NATIVELOG_INFO("OpenVPN disconnected from management port %u\n", transport->Port);
+
+	FailAll(transport, ERROR_CONNECTION_ABORTED);
+}
+
+static DWORD WINAPI TransportThreadFunc(LPVOID parameter)
+{
+	ManagementTransport* transport = (ManagementTransport*)parameter;
+	WSAEVENT events[3] = { transport->WakeEvent, transport->ListenEvent, transport->ClientEvent };
+	WSANETWORKEVENTS network;
+
+	while (!transport->Stopping)
+	{
+		DWORD eventCount = transport->Client != INVALID_SOCKET ? 3 : 2;
+		DWORD wait = WSAWaitForMultipleEvents(eventCount, events, FALSE, WSA_INFINITE, FALSE);
+		if (wait == WSA_WAIT_FAILED)
+		{
+			NATIVELOG_WARNING("WSAWaitForMultipleEvents failed in the management transport: %d\n", WSAGetLastError());
+			Sleep(100);
+			continue;
+		}
+
+		// Only the first signalled event is reported, the sockets are checked whichever it was
+		if (WSAEnumNetworkEvents(transport->ListenSocket, transport->ListenEvent, &network) == 0 && (network.lNetworkEvents & FD_ACCEPT) != 0)
+		{
+			Accept(transport);
+		}
+
+		if (transport->Client == INVALID_SOCKET)
+		{
+			continue;
+		}
+
+		BOOL open = TRUE;
+		if (WSAEnumNetworkEvents(transport->Client, transport->ClientEvent, &network) == 0)
+		{
+			if ((network.lNetworkEvents & FD_WRITE) != 0)
+			{
+				transport->Writable = TRUE;
+			}
+
+			if ((network.lNetworkEvents & (FD_READ | FD_CLOSE)) != 0)
+			{
+				open = ReadAvailable(transport) && (network.lNetworkEvents & FD_CLOSE) == 0;
+			}
+		}
+
+		if (open)
+		{
+			open = Flush(transport);
+		}
+
+		if (!open)
+		{
+			Disconnect(transport);
+		}
+	}
+
+	if (transport->Client != INVALID_SOCKET)
+	{
+		closesocket(transport->Client);
+		transport->Client = INVALID_SOCKET;
+	}
+
+	FailAll(transport, ERROR_CANCELLED);
+
+	return 0;
+}
+
+static void Destroy(ManagementTransport* transport)
+{
+	if (transport->ListenSocket != INVALID_SOCKET)
+	{
+		closesocket(transport->ListenSocket);
+	}
+
+	if (transport->ListenEvent != WSA_INVALID_EVENT)
+	{
+		WSACloseEvent(transport->ListenEvent);
+	}
+
+	if (transport->ClientEvent != WSA_INVALID_EVENT)
+	{
+		WSACloseEvent(transport->ClientEvent);
+	}
+
+	if (transport->WakeEvent != NULL)
+	{
+		CloseHandle(transport->WakeEvent);
+	}
+
+	if (transport->ConnectedEvent != NULL)
+	{
+		CloseHandle(transport->ConnectedEvent);
+	}
+
+	if (transport->Parser != NULL)
+	{
+		ManagementParserClose(transport->Parser);
+	}
+
+	if (transport->Commands != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, transport->Commands);
+	}
+
+	if (transport->In != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, transport->In);
+	}
+
+	if (transport->Out != NULL)
+	{
+		SecureZeroMemory(transport->Out, TRANSPORT_SEND_BUFFER);
+		HeapFree(GetProcessHeap(), 0, transport->Out);
+	}
+
+	if (transport->Reply != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, transport->Reply);
+	}
+
+	SecureZeroMemory(transport->Password, sizeof(transport->Password));
+	HeapFree(GetProcessHeap(), 0, transport);
+}
+
+DWORD ManagementTransportCreate(const MgmtTransportOptions* options, MgmtReplyCallback callback, PVOID context, HMGMTTRANSPORT* transport)
+{
+	MgmtTransportOptions defaults;
+	SOCKADDR_IN address;
+	int addressLength = sizeof(address);
+	BOOL exclusive = TRUE;
+	WSADATA wsaData;
+	LARGE_INTEGER frequency;
+	DWORD result;
+
+	if (transport == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (options == NULL)
+	{
+		ZeroMemory(&defaults, sizeof(defaults));
+		options = &defaults;
+	}
+
+	UINT maxQueued = options->MaxQueued != 0 ? options->MaxQueued : TRANSPORT_DEFAULT_QUEUED;
+	UINT maxInFlight = options->MaxInFlight != 0 ? options->MaxInFlight : TRANSPORT_DEFAULT_IN_FLIGHT;
+	SIZE_T passwordLength = 0;
+
+	if (maxQueued > TRANSPORT_MAX_QUEUED
+		|| (options->Password != NULL && (FAILED(StringCchLengthA(options->Password, MGMT_TRANSPORT_MAX_COMMAND + 1, &passwordLength))
+			|| passwordLength == 0 || strpbrk(options->Password, "\r\n") != NULL)))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	ManagementTransport* created = (ManagementTransport*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ManagementTransport));
+	if (created == NULL)
+	{
+		WSACleanup();
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	InitializeSRWLock(&created->Lock);
+	created->ListenSocket = INVALID_SOCKET;
+	created->Client = INVALID_SOCKET;
+	created->ListenEvent = WSA_INVALID_EVENT;
+	created->ClientEvent = WSA_INVALID_EVENT;
+	created->Callback = callback;
+	created->Context = context;
+	created->ConnectEvent = options->ConnectEvent;
+	created->Capacity = maxQueued;
+	created->MaxInFlight = min(maxInFlight, maxQueued);
+	created->TicksPerSecond = frequency.QuadPart;
+
+	if (options->Password != NULL)
+	{
+		memcpy(created->Password, options->Password, passwordLength);
+		created->Password[passwordLength] = '\n';
+		created->PasswordLength = (UINT32)passwordLength + 1;
+		created->HavePassword = TRUE;
+	}
+
+	created->Commands = (MgmtCommand*)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)maxQueued * sizeof(MgmtCommand));
+	created->In = (CHAR*)HeapAlloc(GetProcessHeap(), 0, TRANSPORT_RECV_BUFFER);
+	created->Out = (CHAR*)HeapAlloc(GetProcessHeap(), 0, TRANSPORT_SEND_BUFFER);
+	created->Reply = (CHAR*)HeapAlloc(GetProcessHeap(), 0, MGMT_TRANSPORT_MAX_REPLY);
+	if (created->Commands == NULL || created->In == NULL || created->Out == NULL || created->Reply == NULL)
+	{
+		result = ERROR_NOT_ENOUGH_MEMORY;
+		goto Cleanup;
+	}
+
+	result = ManagementParserCreate(&created->Parser);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	ManagementParserSetHandler(created->Parser, MgmtSuccess, OnSuccess, created);
+	ManagementParserSetHandler(created->Parser, MgmtError, OnError, created);
+	ManagementParserSetHandler(created->Parser, MgmtLine, OnLine, created);
+	ManagementParserSetHandler(created->Parser, MgmtPasswordPrompt, OnPasswordPrompt, created);
+
+	created->WakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	created->ConnectedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	created->ListenEvent = WSACreateEvent();
+	created->ClientEvent = WSACreateEvent();
+	if (created->WakeEvent == NULL || created->ConnectedEvent == NULL || created->ListenEvent == WSA_INVALID_EVENT || created->ClientEvent == WSA_INVALID_EVENT)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = 0;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// The port stays bound from here until the transport closes, nothing else can take it before OpenVPN connects.
+	// Exclusive use stops another process binding the same port with SO_REUSEADDR and taking the connection
+	created->ListenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (created->ListenSocket == INVALID_SOCKET
+		|| setsockopt(created->ListenSocket, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof(exclusive)) != 0
+		|| bind(created->ListenSocket, (SOCKADDR*)&address, sizeof(address)) != 0
+		|| listen(created->ListenSocket, SOMAXCONN) != 0
+		|| getsockname(created->ListenSocket, (SOCKADDR*)&address, &addressLength) != 0
+		|| WSAEventSelect(created->ListenSocket, created->ListenEvent, FD_ACCEPT) != 0)
+	{
+		result = (DWORD)WSAGetLastError();
+		goto Cleanup;
+	}
+
+	created->Port = ntohs(address.sin_port);
+
+	created->Thread = CreateThread(NULL, 0, TransportThreadFunc, created, 0, NULL);
+	if (created->Thread == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	NATIVELOG_INFO("management transport listening on port %u\n", created->Port);
+
+	*transport = created;
+	return ERROR_SUCCESS;
+
+Cleanup:
+	NATIVELOG_ERROR("management transport could not start: %lu\n", result);
+	Destroy(created);
+	WSACleanup();
+
+	return result;
+}
+
+DWORD ManagementTransportGetPort(HMGMTTRANSPORT transport, USHORT* port)
+{
+	if (transport == NULL || port == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*port = transport->Port;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementTransportSetClientProcess(HMGMTTRANSPORT transport, DWORD processId)
+{
+	if (transport == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	InterlockedExchange(&transport->ClientProcessId, (LONG)processId);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ManagementTransportSetHandler(HMGMTTRANSPORT transport, MgmtEventType type, MgmtEventCallback callback, PVOID context)
+{
+	if (transport == NULL || type == MgmtSuccess || type == MgmtError || type == MgmtLine || type == MgmtPasswordPrompt)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return ManagementParserSetHandler(transport->Parser, type, callback, context);
+}
+
+DWORD ManagementTransportSend(HMGMTTRANSPORT transport, LPCSTR command, MgmtReplyKind kind, UINT64* commandId)
+{
+	SIZE_T length = 0;
+	DWORD result = ERROR_SUCCESS;
+
+	// A line end would smuggle a second command past the reply matching
+	if (transport == NULL || command == NULL || kind < MgmtReplySingle || kind >= MgmtReplyKindCount
+		|| FAILED(StringCchLengthA(command, MGMT_TRANSPORT_MAX_COMMAND + 1, &length))
+		|| length == 0 || strpbrk(command, "\r\n") != NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	INT64 queuedTicks = NowTicks();
+
+	AcquireSRWLockExclusive(&transport->Lock);
+
+	if (transport->Stopping)
+	{
+		result = ERROR_CANCELLED;
+	}
+	else if (transport->Count == transport->Capacity)
+	{
+		result = ERROR_BUSY;
+	}
+	else
+	{
+		MgmtCommand* slot = &transport->Commands[(transport->Head + transport->Count) % transport->Capacity];
+		slot->Id = ++transport->NextId;
+		slot->QueuedTicks = queuedTicks;
+		slot->Kind = kind;
+		slot->Length = (UINT32)length + 1;
+		memcpy(slot->Text, command, length);
+		slot->Text[length] = '\n';
+		transport->Count++;
+
+		if (commandId != NULL)
+		{
+			*commandId = slot->Id;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&transport->Lock);
+
+	if (result == ERROR_SUCCESS)
+	{
+		SetEvent(transport->WakeEvent);
+	}
+
+	return result;
+}
+
+DWORD ManagementTransportDrain(HMGMTTRANSPORT transport, MgmtBatch* batch)
+{
+	if (transport == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return ManagementParserDrain(transport->Parser, batch);
+}
+
+DWORD ManagementTransportWaitConnected(HMGMTTRANSPORT transport, DWORD timeoutMs)
+{
+	if (transport == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	switch (WaitForSingleObject(transport->ConnectedEvent, timeoutMs))
+	{
+	case WAIT_OBJECT_0:
+		return ERROR_SUCCESS;
+	case WAIT_TIMEOUT:
+		return ERROR_TIMEOUT;
+	default:
+		return GetLastError();
+	}
+}
+
+DWORD ManagementTransportClose(HMGMTTRANSPORT transport)
+{
+	if (transport == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&transport->Lock);
+	InterlockedExchange(&transport->Stopping, 1);
+	ReleaseSRWLockExclusive(&transport->Lock);
+
+	SetEvent(transport->WakeEvent);
+	WaitForSingleObject(transport->Thread, INFINITE);
+	CloseHandle(transport->Thread);
+
+	Destroy(transport);
+	WSACleanup();
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+typedef struct _BenchServer
+{
+	USHORT Port;
+	HANDLE Thread;
+} BenchServer;
+
+typedef struct _BenchPass
+{
+	UINT Commands;
+	HANDLE Space;
+	HANDLE Done;
+	UINT Completed;
+	UINT Failed;
+	UINT64 RoundTripUsTotal;
+	DWORD RoundTripUsMax;
+	volatile LONG Notifications;
+} BenchPass;
+
+static BOOL BenchSendAll(SOCKET connection, const CHAR* data, int length)
+{
+	while (length > 0)
+	{
+		int sent = send(connection, data, length, 0);
+		if (sent <= 0)
+		{
+			return FALSE;
+		}
+
+		data += sent;
+		length -= sent;
+	}
+
+	return TRUE;
+}
+
+// Plays OpenVPN in --management-client mode: connects, greets, then answers each line as it arrives
+static DWORD WINAPI BenchServerFunc(LPVOID parameter)
+{
+	BenchServer* server = (BenchServer*)parameter;
+	SOCKADDR_IN address;
+	BOOL noDelay = TRUE;
+	UINT replies = 0;
+	UINT carry = 0;
+
+	CHAR* in = (CHAR*)HeapAlloc(GetProcessHeap(), 0, TRANSPORT_RECV_BUFFER);
+	CHAR* out = (CHAR*)HeapAlloc(GetProcessHeap(), 0, TRANSPORT_SEND_BUFFER);
+	SOCKET connection = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(server->Port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (in == NULL || out == NULL || connection == INVALID_SOCKET || connect(connection, (SOCKADDR*)&address, sizeof(address)) != 0)
+	{
+		NATIVELOG_WARNING("management benchmark server could not connect: %d\n", WSAGetLastError());
+		goto Cleanup;
+	}
+
+	setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	if (!BenchSendAll(connection, TRANSPORT_BENCH_GREETING, (int)sizeof(TRANSPORT_BENCH_GREETING) - 1))
+	{
+		goto Cleanup;
+	}
+
+	for (;;)
+	{
+		int received = recv(connection, in + carry, (int)(TRANSPORT_RECV_BUFFER - carry), 0);
+		if (received <= 0)
+		{
+			break;
+		}
+
+		UINT length = carry + (UINT)received;
+		UINT start = 0;
+		UINT used = 0;
+
+		for (UINT i = 0; i < length; i++)
+		{
+			if (in[i] != '\n')
+			{
+				continue;
+			}
+
+			// Room for the longest reply and a notification
+			if (used + sizeof(TRANSPORT_BENCH_VERSION) + sizeof(TRANSPORT_BENCH_BYTECOUNT) > TRANSPORT_SEND_BUFFER)
+			{
+				if (!BenchSendAll(connection, out, (int)used))
+				{
+					goto Cleanup;
+				}
+				used = 0;
+			}
+
+			const CHAR* reply = TRANSPORT_BENCH_SUCCESS;
+			UINT replyLength = sizeof(TRANSPORT_BENCH_SUCCESS) - 1;
+			if (i - start >= 7 && memcmp(in + start, "version", 7) == 0)
+			{
+				reply = TRANSPORT_BENCH_VERSION;
+				replyLength = sizeof(TRANSPORT_BENCH_VERSION) - 1;
+			}
+
+			memcpy(out + used, reply, replyLength);
+			used += replyLength;
+
+			if (++replies % TRANSPORT_BENCH_NOTIFY_EVERY == 0)
+			{
+				memcpy(out + used, TRANSPORT_BENCH_BYTECOUNT, sizeof(TRANSPORT_BENCH_BYTECOUNT) - 1);
+				used += sizeof(TRANSPORT_BENCH_BYTECOUNT) - 1;
+			}
+
+			start = i + 1;
+		}
+
+		carry = length - start;
+		memmove(in, in + start, carry);
+
+		if (used > 0 && !BenchSendAll(connection, out, (int)used))
+		{
+			break;
+		}
+	}
+
+Cleanup:
+	if (connection != INVALID_SOCKET)
+	{
+		closesocket(connection);
+	}
+
+	if (out != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, out);
+	}
+
+	if (in != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, in);
+	}
+
+	return 0;
+}
+
+static void CALLBACK BenchReply(const MgmtReply* reply, const CHAR* text, PVOID context)
+{
+	BenchPass* pass = (BenchPass*)context;
+
+	if (reply->Result != ERROR_SUCCESS)
+	{
+		pass->Failed++;
+	}
+
+	pass->RoundTripUsTotal += reply->RoundTripUs;
+	pass->RoundTripUsMax = max(pass->RoundTripUsMax, (DWORD)reply->RoundTripUs);
+
+	SetEvent(pass->Space);
+	if (++pass->Completed == pass->Commands)
+	{
+		SetEvent(pass->Done);
+	}
+}
+
+static void CALLBACK BenchNotification(const MgmtEvent* event, const CHAR* text, PVOID context)
+{
+	InterlockedIncrement(&((BenchPass*)context)->Notifications);
+}
+
+static DWORD RunBenchPass(UINT commands, UINT maxInFlight, DOUBLE* perSecond, DOUBLE* roundTripUsMean, DWORD* roundTripUsMax, UINT64* busy, UINT64* notifications)
+{
+	MgmtTransportOptions options;
+	BenchPass pass;
+	BenchServer server;
+	HMGMTTRANSPORT transport = NULL;
+	LARGE_INTEGER frequency, start, end;
+	DWORD result;
+
+	ZeroMemory(&pass, sizeof(pass));
+	ZeroMemory(&server, sizeof(server));
+	pass.Commands = commands;
+	pass.Space = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pass.Done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (pass.Space == NULL || pass.Done == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	// Pipelined, room for one window being answered while the next is queued. Serially, each send waits for the
+	// reply before it.
+	ZeroMemory(&options, sizeof(options));
+	options.MaxInFlight = maxInFlight;
+	options.MaxQueued = maxInFlight > 1 ? min(maxInFlight * 2, (UINT)TRANSPORT_MAX_QUEUED) : 1;
+
+	result = ManagementTransportCreate(&options, BenchReply, &pass, &transport);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	ManagementTransportSetHandler(transport, MgmtByteCount, BenchNotification, &pass);
+	ManagementTransportGetPort(transport, &server.Port);
+
+	server.Thread = CreateThread(NULL, 0, BenchServerFunc, &server, 0, NULL);
+	if (server.Thread == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	result = ManagementTransportWaitConnected(transport, TRANSPORT_BENCH_CONNECT_MS);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (UINT i = 0; i < commands && result == ERROR_SUCCESS; i++)
+	{
+		const CHAR* command = i % 4 == 0 ? "version" : "bytecount 5";
+		MgmtReplyKind kind = i % 4 == 0 ? MgmtReplyList : MgmtReplySingle;
+
+		while ((result = ManagementTransportSend(transport, command, kind, NULL)) == ERROR_BUSY)
+		{
+			(*busy)++;
+			WaitForSingleObject(pass.Space, TRANSPORT_BENCH_REPLY_MS);
+		}
+	}
+
+	if (result == ERROR_SUCCESS && WaitForSingleObject(pass.Done, TRANSPORT_BENCH_REPLY_MS) != WAIT_OBJECT_0)
+	{
+		result = ERROR_TIMEOUT;
+	}
+
+	QueryPerformanceCounter(&end);
+
+	if (result == ERROR_SUCCESS && pass.Failed > 0)
+	{
+		result = ERROR_REQUEST_REFUSED;
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		DOUBLE seconds = (DOUBLE)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+		*perSecond = seconds > 0 ? commands / seconds : 0;
+		*roundTripUsMean = (DOUBLE)pass.RoundTripUsTotal / commands;
+		*roundTripUsMax = pass.RoundTripUsMax;
+	}
+
+Cleanup:
+	// Closing hangs up on the server, which then finishes
+	if (transport != NULL)
+	{
+		ManagementTransportClose(transport);
+	}
+
+	if (server.Thread != NULL)
+	{
+		WaitForSingleObject(server.Thread, INFINITE);
+		CloseHandle(server.Thread);
+	}
+
+	*notifications += (UINT64)pass.Notifications;
+
+	if (pass.Done != NULL)
+	{
+		CloseHandle(pass.Done);
+	}
+
+	if (pass.Space != NULL)
+	{
+		CloseHandle(pass.Space);
+	}
+
+	return result;
+}
+
+DWORD ManagementTransportRunBenchmark(UINT commands, UINT maxInFlight, ManagementTransportBenchReport* report)
+{
+	DWORD serialMax = 0;
+	DWORD result;
+
+	if (commands == 0 || maxInFlight == 0 || maxInFlight > TRANSPORT_MAX_QUEUED || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(*report));
+	report->Commands = commands;
+	report->MaxInFlight = maxInFlight;
+
+	result = RunBenchPass(commands, 1, &report->SerialPerSecond, &report->SerialRoundTripUsMean, &serialMax, &report->Busy, &report->Notifications);
+	if (result == ERROR_SUCCESS)
+	{
+		result = RunBenchPass(commands, maxInFlight, &report->PipelinedPerSecond, &report->PipelinedRoundTripUsMean, &report->PipelinedRoundTripUsMax, &report->Busy, &report->Notifications);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_WARNING("management transport benchmark failed: %lu\n", result);
+	}
+
+	return result;
+}
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+#include <windows.h>
+#include "ManagementParser.h"
+
+// Longest command line, without its line end
+#define MGMT_TRANSPORT_MAX_COMMAND 1024
+// Reply text kept per command, the rest of a longer reply is dropped and the reply flagged MGMT_REPLY_TRUNCATED
+#define MGMT_TRANSPORT_MAX_REPLY 262144
+
+#define MGMT_REPLY_TRUNCATED 0x0001
+
+typedef struct _ManagementTransport* HMGMTTRANSPORT;
+
+typedef enum _MgmtReplyKind
+{
+	// One SUCCESS: or ERROR: line, as hold release, signal, bytecount and username / password answer with
+	MgmtReplySingle = 0,
+	// Lines up to END, as status, version and state answer with. An ERROR: line ends the reply early, a
+	// SUCCESS: line ahead of the list, as "log on all" sends, is skipped.
+	MgmtReplyList,
+	MgmtReplyKindCount,
+} MgmtReplyKind;
+
+typedef struct _MgmtReply
+{
+	// What ManagementTransportSend returned for the command
+	UINT64 CommandId;
+	// ERROR_SUCCESS, ERROR_REQUEST_REFUSED for an ERROR: reply, ERROR_CONNECTION_ABORTED when OpenVPN went away
+	// before answering, ERROR_CANCELLED when the transport closed first
+	DWORD Result;
+	UINT16 Flags;
+	UINT16 Reserved;
+	// Text after the SUCCESS: or ERROR: prefix, or the list lines each ended with '\n'
+	UINT32 TextLength;
+	// From the command being queued to its reply
+	UINT32 RoundTripUs;
+} MgmtReply;
+
+// text is only valid during the call, which runs on the transport thread. It may send further commands but
+// must not close the transport.
+typedef void (CALLBACK* MgmtReplyCallback)(const MgmtReply* reply, const CHAR* text, PVOID context);
+
+// Zero fields take the defaults in ManagementTransport.cpp
+typedef struct _MgmtTransportOptions
+{
+	// Commands written ahead of their replies, at most
+	UINT MaxInFlight;
+	// Commands queued and in flight together, at most. ManagementTransportSend fails with ERROR_BUSY past it.
+	UINT MaxQueued;
+	// Answers ENTER PASSWORD: when OpenVPN was given a management password file, NULL when it wasn't
+	LPCSTR Password;
+	// Set, when given, each time OpenVPN connects and gets past the password, to wait on alongside other handles
+	HANDLE ConnectEvent;
+} MgmtTransportOptions;
+
+// Listens on 127.0.0.1 at a port the system picks and serves it from a single event loop thread. Start OpenVPN
+// with "--management 127.0.0.1 <port> --management-client" so it connects to the socket this process already
+// holds, rather than binding a port picked beforehand that something else can take in the meantime.
+extern DWORD ManagementTransportCreate(const MgmtTransportOptions* options, MgmtReplyCallback callback, PVOID context, HMGMTTRANSPORT* transport);
+
+extern DWORD ManagementTransportGetPort(HMGMTTRANSPORT transport, USHORT* port);
+
+// Connections from any process other than processId are closed as soon as they're accepted, 0 accepts any.
+// Call it once OpenVPN is created, before resuming it.
+extern DWORD ManagementTransportSetClientProcess(HMGMTTRANSPORT transport, DWORD processId);
+
+// Routes a notification to callback on the transport thread, as ManagementParserSetHandler does. SUCCESS:,
+// ERROR: and the other reply lines always go to the reply callback. Set handlers before OpenVPN connects.
+extern DWORD ManagementTransportSetHandler(HMGMTTRANSPORT transport, MgmtEventType type, MgmtEventCallback callback, PVOID context);
+
+// Queues command, a single line without its line end, and returns straight away. Commands are written in
+// order, up to MaxInFlight ahead of their replies, as soon as OpenVPN is connected. The reply callback gets
+// commandId with the reply.
+extern DWORD ManagementTransportSend(HMGMTTRANSPORT transport, LPCSTR command, MgmtReplyKind kind, UINT64* commandId);
+
+// Moves the notifications without a handler into batch
+extern DWORD ManagementTransportDrain(HMGMTTRANSPORT transport, MgmtBatch* batch);
+
+// Waits for OpenVPN to connect and, when there's a password, be answered. ERROR_TIMEOUT when it hasn't by then.
+extern DWORD ManagementTransportWaitConnected(HMGMTTRANSPORT transport, DWORD timeoutMs);
+
+// Fails the commands still waiting with ERROR_CANCELLED. The callbacks have returned for the last time once
+// this returns.
+extern DWORD ManagementTransportClose(HMGMTTRANSPORT transport);
+
+#ifdef NATIVE_BENCH
+typedef struct _ManagementTransportBenchReport
+{
+	UINT Commands;
+	UINT MaxInFlight;
+	// One command at a time, as the managed client sends them, then pipelined
+	DOUBLE SerialPerSecond;
+	DOUBLE PipelinedPerSecond;
+	DOUBLE SerialRoundTripUsMean;
+	DOUBLE PipelinedRoundTripUsMean;
+	DWORD PipelinedRoundTripUsMax;
+	// Sends turned away by MaxQueued and retried
+	UINT64 Busy;
+	UINT64 Notifications;
+} ManagementTransportBenchReport;
+
+// Runs commands through a transport connected to a fake management server on loopback, which answers every
+// command and sends a BYTECOUNT notification every few replies, once serially and once maxInFlight deep
+extern DWORD ManagementTransportRunBenchmark(UINT commands, UINT maxInFlight, ManagementTransportBenchReport* report);
+#endif
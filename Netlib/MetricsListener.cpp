@@ -0,0 +1,240 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <string.h>
+#include <strsafe.h>
+#include "MetricsListener.h"
+#include "Metrics.h"
+#include "NativeLog.h"
+
+#define METRICS_LISTENER_REQUEST_LENGTH 2048
+#define METRICS_LISTENER_HEADER_LENGTH 256
+// A scraper that stalls mid-request mustn't hold up the next one for long
+#define METRICS_LISTENER_TIMEOUT_MS 2000
+
+static SRWLOCK ListenerLock = SRWLOCK_INIT;
+static SOCKET ListenSocket = INVALID_SOCKET;
+static HANDLE ListenerThread;
+static volatile LONG Stopping;
+
+static void SendAll(SOCKET client, const CHAR* data, int length)
+{
+	while (length > 0)
+	{
+		int sent = send(client, data, length, 0);
+		if (sent <= 0)
+		{
+			return;
+		}
+
+		data += sent;
+		length -= sent;
+	}
+}
+
+static void SendResponse(SOCKET client, const CHAR* status, const CHAR* body, DWORD bodyLength)
+{
+	CHAR header[METRICS_LISTENER_HEADER_LENGTH];
+	CHAR* end = header;
+
+	if (SUCCEEDED(StringCchPrintfExA(header, ARRAYSIZE(header), &end, NULL, 0,
+		"HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+		status, bodyLength)))
+	{
+		SendAll(client, header, (int)(end - header));
+		SendAll(client, body, (int)bodyLength);
+	}
+}
+
+// Reads until the end of the request headers, the request line is all that matters
+static BOOL ReadRequest(SOCKET client, CHAR* request, int length)
+{
+	int used = 0;
+
+	while (used < length - 1)
+	{
+		int received = recv(client, request + used, length - 1 - used, 0);
+		if (received <= 0)
+		{
+			return FALSE;
+		}
+
+		used += received;
+		request[used] = '\0';
+
+		if (strstr(request, "\r\n\r\n") != NULL)
+		{
+			return TRUE;
+		}
+	}
+
+	// Headers too long to keep, the request line still fits
+	return TRUE;
+}
+
+static void ServeClient(SOCKET client, CHAR* request, CHAR* body)
+{
+	DWORD timeout = METRICS_LISTENER_TIMEOUT_MS;
+	DWORD written = 0;
+
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	if (!ReadRequest(client, request, METRICS_LISTENER_REQUEST_LENGTH))
+	{
+		return;
+	}
+
+	if (strncmp(request, "GET /metrics", 12) != 0 || (request[12] != ' ' && request[12] != '?'))
+	{
+		static const CHAR notFound[] = "not found\n";
+		SendResponse(client, "404 Not Found", notFound, sizeof(notFound) - 1);
+		return;
+	}
+
+	DWORD result = MetricsRender(body, METRICS_RENDER_LENGTH, &written);
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("MetricsRender failed in the metrics listener: %lu\n", result);
+		static const CHAR failed[] = "render failed\n";
+		SendResponse(client, "500 Internal Server Error", failed, sizeof(failed) - 1);
+		return;
+	}
+
+	SendResponse(client, "200 OK", body, written);
+}
+
+static DWORD WINAPI ListenerThreadFunc(LPVOID parameter)
+{
+	SOCKET listenSocket = (SOCKET)parameter;
+	CHAR* request = (CHAR*)HeapAlloc(GetProcessHeap(), 0, METRICS_LISTENER_REQUEST_LENGTH);
+	CHAR* body = (CHAR*)HeapAlloc(GetProcessHeap(), 0, METRICS_RENDER_LENGTH);
+
+	while (request != NULL && body != NULL)
+	{
+		SOCKET client = accept(listenSocket, NULL, NULL);
+		if (client == INVALID_SOCKET)
+		{
+			// MetricsListenerStop closing the socket is the only way out
+			if (Stopping)
+			{
+				break;
+			}
+
+			NATIVELOG_WARNING("accept failed in the metrics listener: %d\n", WSAGetLastError());
+			Sleep(100);
+			continue;
+		}
+
+		ServeClient(client, request, body);
+		shutdown(client, SD_SEND);
+		closesocket(client);
+	}
+
+	if (body != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, body);
+	}
+
+	if (request != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, request);
+	}
+
+	return 0;
+}
+
+DWORD MetricsListenerStart(USHORT port, USHORT* boundPort)
+{
+	SOCKADDR_IN address;
+	int addressLength = sizeof(address);
+	WSADATA wsaData;
+	SOCKET listenSocket = INVALID_SOCKET;
+	DWORD result;
+
+	AcquireSRWLockExclusive(&ListenerLock);
+
+	if (ListenerThread != NULL)
+	{
+		ReleaseSRWLockExclusive(&ListenerLock);
+		return ERROR_ALREADY_EXISTS;
+	}
+
+	result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		ReleaseSRWLockExclusive(&ListenerLock);
+		return result;
+	}
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listenSocket == INVALID_SOCKET
+		|| bind(listenSocket, (SOCKADDR*)&address, sizeof(address)) != 0
+		|| listen(listenSocket, SOMAXCONN) != 0
+		|| getsockname(listenSocket, (SOCKADDR*)&address, &addressLength) != 0)
+	{
+		result = (DWORD)WSAGetLastError();
+		goto Cleanup;
+	}
+
+	Stopping = FALSE;
+	ListenerThread = CreateThread(NULL, 0, ListenerThreadFunc, (LPVOID)listenSocket, 0, NULL);
+	if (ListenerThread == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	ListenSocket = listenSocket;
+	listenSocket = INVALID_SOCKET;
+
+	if (boundPort != NULL)
+	{
+		*boundPort = ntohs(address.sin_port);
+	}
+
+	NATIVELOG_INFO("metrics listener on 127.0.0.1:%u\n", ntohs(address.sin_port));
+
+Cleanup:
+	if (listenSocket != INVALID_SOCKET)
+	{
+		closesocket(listenSocket);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		WSACleanup();
+	}
+
+	ReleaseSRWLockExclusive(&ListenerLock);
+	return result;
+}
+
+DWORD MetricsListenerStop()
+{
+	AcquireSRWLockExclusive(&ListenerLock);
+
+	if (ListenerThread == NULL)
+	{
+		ReleaseSRWLockExclusive(&ListenerLock);
+		return ERROR_NOT_FOUND;
+	}
+
+	InterlockedExchange(&Stopping, TRUE);
+	closesocket(ListenSocket);
+	ListenSocket = INVALID_SOCKET;
+
+	WaitForSingleObject(ListenerThread, INFINITE);
+	CloseHandle(ListenerThread);
+	ListenerThread = NULL;
+
+	WSACleanup();
+
+	ReleaseSRWLockExclusive(&ListenerLock);
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <windows.h>
+
+// Serves GET /metrics in the Prometheus text format on 127.0.0.1 from a thread of its own, one request per
+// connection. port 0 picks a free port, boundPort receives the one in use. One listener per process.
+extern DWORD MetricsListenerStart(USHORT port, USHORT* boundPort);
+
+// Closes the socket and waits for the listener thread to finish the request in flight
+extern DWORD MetricsListenerStop();
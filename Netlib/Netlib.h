@@ -1,28 +1,389 @@
 #pragma once
 #include <Windows.h>
 #include <stdio.h>
+#include "ServerProbe.h"
+#include "LeakTest.h"
+#include "PortPolicy.h"
+#include "KillswitchPolicy.h"
+#include "Backend.h"
+#include "Replay.h"
+#include "TunnelMonitor.h"
+#include "DnsCache.h"
+#include "DnsForwarder.h"
+#include "StatusPage.h"
+#include "UsageJournal.h"
+#include "ManagementParser.h"
+#include "ManagementTransport.h"
+#include "Supervisor.h"
+#include "MetricsListener.h"
+#include "RouteSet.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "FlightRecorder.h"
+#include "Executor.h"
 #define export __declspec(dllexport)
 
 DEFINE_GUID(WFPKS_FILTER_GUID, 0x3b2c7dfd, 0x7dd9, 0x4193, 0xad, 0x0c, 0x6a, 0xf7, 0x49, 0xa1, 0x4a, 0xa5);
 
 extern "C" {
+	// NULL portRules takes PortPolicyDefaultRules, as KillswitchEngage2 has, whatever portRuleCount says. An empty
+	// array lets no ports out.
+	__declspec(dllexport) DWORD KillswitchEngage3(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, const WFPKS_PORT_RULE* portRules, int portRuleCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName)
+	{
+		if (portRules == NULL)
+		{
+			portRules = PortPolicyDefaultRules;
+			portRuleCount = PORT_POLICY_DEFAULT_RULE_COUNT;
+		}
+
+		TraceScope trace;
+		TraceRequestBegin(TraceOpEngage, &trace);
+		INT64 started = MetricsTimerStart();
+		DWORD result = WfpksEnable3(remoteAddresses, addrCount, localAddresses, localAddrCount, portRules, portRuleCount, tapAdapterIndex, ovpnBinaryPath, persistReboot, displayName);
+		MetricsObserveSince(MetricKillswitchEngageSeconds, started);
+		TraceRequestEnd(&trace, result);
+		if (result == ERROR_SUCCESS)
+		{
+			StatusPageNotifyKillswitch(TRUE);
+		}
+		return result;
+	}
+
 	__declspec(dllexport) DWORD KillswitchEngage2(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName)
 	{
-		return WfpksEnable2(remoteAddresses, addrCount, localAddresses, localAddrCount, tapAdapterIndex, ovpnBinaryPath, persistReboot, displayName);
+		return KillswitchEngage3(remoteAddresses, addrCount, localAddresses, localAddrCount, PortPolicyDefaultRules, PORT_POLICY_DEFAULT_RULE_COUNT, tapAdapterIndex, ovpnBinaryPath, persistReboot, displayName);
+	}
+
+	// Compiles what KillswitchEngage3 would apply into a policy file at path, NULL portRules taking the defaults too
+	__declspec(dllexport) DWORD SaveKillswitchPolicy(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, const WFPKS_PORT_RULE* portRules, int portRuleCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName, LPCWSTR path)
+	{
+		if (portRules == NULL)
+		{
+			portRules = PortPolicyDefaultRules;
+			portRuleCount = PORT_POLICY_DEFAULT_RULE_COUNT;
+		}
+
+		KillswitchPolicy* policy = NULL;
+		DWORD result = KillswitchPolicyCompile(remoteAddresses, addrCount, localAddresses, localAddrCount, portRules, portRuleCount, tapAdapterIndex, ovpnBinaryPath, persistReboot, displayName, &policy);
+		if (result == ERROR_SUCCESS)
+		{
+			result = KillswitchPolicySave(policy, path);
+			KillswitchPolicyFree(policy);
+		}
+		return result;
+	}
+
+	__declspec(dllexport) DWORD KillswitchEngagePolicy(LPCWSTR path, ULONG tapAdapterIndex)
+	{
+		TraceScope trace;
+		TraceRequestBegin(TraceOpEngage, &trace);
+		INT64 started = MetricsTimerStart();
+		KillswitchPolicy* policy = NULL;
+		DWORD result = KillswitchPolicyMap(path, &policy);
+		if (result == ERROR_SUCCESS)
+		{
+			result = WfpksEnablePolicy(policy, tapAdapterIndex);
+			KillswitchPolicyUnmap(policy);
+		}
+		MetricsObserveSince(MetricKillswitchEngageSeconds, started);
+		TraceRequestEnd(&trace, result);
+		if (result == ERROR_SUCCESS)
+		{
+			StatusPageNotifyKillswitch(TRUE);
+		}
+		return result;
 	}
 
 	__declspec(dllexport) DWORD KillswitchDisengage() {
-		return WfpksDisable();
+		TraceScope trace;
+		TraceRequestBegin(TraceOpDisengage, &trace);
+		INT64 started = MetricsTimerStart();
+		DWORD result = WfpksDisable();
+		MetricsObserveSince(MetricKillswitchDisengageSeconds, started);
+		TraceRequestEnd(&trace, result);
+		if (result == ERROR_SUCCESS)
+		{
+			StatusPageNotifyKillswitch(FALSE);
+		}
+		return result;
 	}
 
 	__declspec(dllexport) BOOL KillswitchIsEngaged() {
 		return WfpksIsEnabled();
 	}
 
+	__declspec(dllexport) DWORD ProbeServers(const ServerProbeTarget* targets, UINT targetCount, const ServerProbeOptions* options, ServerProbeResult* results, UINT* ranking) {
+		return ServerProbeRun(targets, targetCount, options, results, ranking);
+	}
+
+	__declspec(dllexport) DWORD RunKillswitchLeakTest(const LeakTestPolicy* policy, const LeakTestOptions* options, LeakTestProbe* probes, UINT probeCount, LeakTestReport* report) {
+		return LeakTestRun(policy, options, probes, probeCount, report);
+	}
+
+	__declspec(dllexport) DWORD FormatLeakTestReport(const LeakTestReport* report, const LeakTestProbe* probes, UINT probeCount, CHAR* buffer, DWORD length, DWORD* written) {
+		return LeakTestFormatReport(report, probes, probeCount, buffer, length, written);
+	}
+
+	__declspec(dllexport) BOOL IsBackendLoaded(BackendId backend) {
+		return BackendIsLoaded(backend);
+	}
+
+	__declspec(dllexport) UINT UnloadIdleBackends(DWORD idleMs) {
+		return BackendUnloadIdle(idleMs);
+	}
+
+	__declspec(dllexport) DWORD StartPlatformRecording(LPCWSTR path, UINT capacity) {
+		return RecorderStart(path, capacity);
+	}
+
+	__declspec(dllexport) DWORD StopPlatformRecording(UINT* recorded) {
+		return RecorderStop(recorded);
+	}
+
+	__declspec(dllexport) DWORD StartFlightRecorder(LPCWSTR path, UINT rings, UINT eventsPerRing) {
+		return FlightRecorderStart(path, rings, eventsPerRing);
+	}
+
+	__declspec(dllexport) DWORD SetFlightRecorderEnabled(BOOL enabled) {
+		return FlightRecorderSetEnabled(enabled);
+	}
+
+	__declspec(dllexport) DWORD MarkFlightRecorder(UINT32 value, UINT64 argument) {
+		return FlightRecorderMark(value, argument);
+	}
+
+	__declspec(dllexport) DWORD DumpFlightRecorder(LPCWSTR path) {
+		return FlightRecorderDump(path);
+	}
+
+	__declspec(dllexport) DWORD StartExecutor(const ExecutorOptions* options) {
+		return ExecutorStart(options);
+	}
+
+	__declspec(dllexport) DWORD GetExecutorStats(ExecutorStats* stats) {
+		return ExecutorGetStats(stats);
+	}
+
+	__declspec(dllexport) DWORD StartPlatformReplay(LPCWSTR path, const ReplayOptions* options) {
+		return ReplayStart(path, options);
+	}
+
+	__declspec(dllexport) DWORD StopPlatformReplay(ReplayReport* report) {
+		return ReplayStop(report);
+	}
+
+	__declspec(dllexport) DWORD StartTunnelMonitor(const TunnelMonitorOptions* options, TunnelMonitorCallback callback, PVOID context, HTUNNELMONITOR* monitor) {
+		return TunnelMonitorStart(options, callback, context, monitor);
+	}
+
+	__declspec(dllexport) DWORD GetTunnelMonitorSnapshot(HTUNNELMONITOR monitor, TunnelMonitorSnapshot* snapshot) {
+		return TunnelMonitorGetSnapshot(monitor, snapshot);
+	}
+
+	__declspec(dllexport) DWORD StopTunnelMonitor(HTUNNELMONITOR monitor) {
+		return TunnelMonitorStop(monitor);
+	}
+
+	__declspec(dllexport) DWORD SetDnsCacheOptions(const DnsCacheOptions* options) {
+		return DnsCacheSetOptions(options);
+	}
+
+	__declspec(dllexport) DWORD SetDnsCacheServers(LPCWSTR* servers, UINT serverCount, USHORT port) {
+		return DnsCacheSetServers(servers, serverCount, port);
+	}
+
+	__declspec(dllexport) DWORD PreResolveHosts(LPCWSTR* hostnames, UINT hostnameCount, DWORD deadlineMs, DWORD* results) {
+		return DnsCacheResolve(hostnames, hostnameCount, deadlineMs, results);
+	}
+
+	__declspec(dllexport) DWORD GetResolvedAllowlist(LPCWSTR* hostnames, UINT hostnameCount, WFPKS_ADDR_AND_MASK* addresses, UINT addressesLength, UINT* addressCount, CHAR* text, DWORD textLength) {
+		return DnsCacheGetAllowlist(hostnames, hostnameCount, addresses, addressesLength, addressCount, text, textLength);
+	}
+
+	__declspec(dllexport) DWORD GetResolvedHostsEntries(LPCWSTR* hostnames, UINT hostnameCount, LPWSTR buffer, DWORD bufferLength) {
+		return DnsCacheGetHostsEntries(hostnames, hostnameCount, buffer, bufferLength);
+	}
+
+	__declspec(dllexport) DWORD FlushDnsCache() {
+		return DnsCacheFlush();
+	}
+
+	__declspec(dllexport) DWORD StartDnsForwarder(LPCWSTR* upstreams, UINT upstreamCount, USHORT port, const DnsForwarderOptions* options, USHORT* boundPort) {
+		return DnsForwarderStart(upstreams, upstreamCount, port, options, boundPort);
+	}
+
+	__declspec(dllexport) DWORD StopDnsForwarder() {
+		return DnsForwarderStop();
+	}
+
+	__declspec(dllexport) DWORD SetDnsForwarderPins(LPCWSTR* hostnames, LPCWSTR* addresses, UINT count) {
+		return DnsForwarderSetPins(hostnames, addresses, count);
+	}
+
+	__declspec(dllexport) DWORD FlushDnsForwarder() {
+		return DnsForwarderFlush();
+	}
+
+	__declspec(dllexport) DWORD GetDnsForwarderStats(DnsForwarderStats* stats) {
+		return DnsForwarderGetStats(stats);
+	}
+
+	__declspec(dllexport) DWORD CreateStatusPage(LPCWSTR name, HSTATUSPAGE* page) {
+		return StatusPageCreate(name, page);
+	}
+
+	__declspec(dllexport) DWORD OpenStatusPage(LPCWSTR name, HSTATUSPAGE* page) {
+		return StatusPageOpen(name, page);
+	}
+
+	__declspec(dllexport) DWORD ReadStatusPage(HSTATUSPAGE page, StatusPageData* data, DWORD* sequence) {
+		return StatusPageRead(page, data, sequence);
+	}
+
+	__declspec(dllexport) DWORD CloseStatusPage(HSTATUSPAGE page) {
+		return StatusPageClose(page);
+	}
+
+	__declspec(dllexport) DWORD OpenUsageJournal(LPCWSTR directory, UINT maxSegments, HUSAGEJOURNAL* journal) {
+		return UsageJournalOpen(directory, maxSegments, journal);
+	}
+
+	__declspec(dllexport) DWORD AppendUsage(HUSAGEJOURNAL journal, UINT32 time, UINT32 serverId, UINT64 txBytes, UINT64 rxBytes) {
+		return UsageJournalAppend(journal, time, serverId, txBytes, rxBytes);
+	}
+
+	__declspec(dllexport) DWORD QueryUsage(HUSAGEJOURNAL journal, UINT32 startTime, UINT32 endTime, UsageTotals* totals) {
+		return UsageJournalQuery(journal, startTime, endTime, totals);
+	}
+
+	__declspec(dllexport) DWORD FlushUsageJournal(HUSAGEJOURNAL journal) {
+		return UsageJournalFlush(journal);
+	}
+
+	__declspec(dllexport) DWORD CloseUsageJournal(HUSAGEJOURNAL journal) {
+		return UsageJournalClose(journal);
+	}
+
+	__declspec(dllexport) DWORD CreateManagementParser(HMGMTPARSER* parser) {
+		return ManagementParserCreate(parser);
+	}
+
+	__declspec(dllexport) DWORD SetManagementHandler(HMGMTPARSER parser, MgmtEventType type, MgmtEventCallback callback, PVOID context) {
+		return ManagementParserSetHandler(parser, type, callback, context);
+	}
+
+	__declspec(dllexport) DWORD FeedManagementData(HMGMTPARSER parser, const CHAR* data, SIZE_T length) {
+		return ManagementParserFeed(parser, data, length);
+	}
+
+	__declspec(dllexport) DWORD DrainManagementEvents(HMGMTPARSER parser, MgmtBatch* batch) {
+		return ManagementParserDrain(parser, batch);
+	}
+
+	__declspec(dllexport) DWORD ResetManagementParser(HMGMTPARSER parser) {
+		return ManagementParserReset(parser);
+	}
+
+	__declspec(dllexport) DWORD CloseManagementParser(HMGMTPARSER parser) {
+		return ManagementParserClose(parser);
+	}
+
+	__declspec(dllexport) DWORD CreateManagementTransport(const MgmtTransportOptions* options, MgmtReplyCallback callback, PVOID context, HMGMTTRANSPORT* transport) {
+		return ManagementTransportCreate(options, callback, context, transport);
+	}
+
+	__declspec(dllexport) DWORD GetManagementTransportPort(HMGMTTRANSPORT transport, USHORT* port) {
+		return ManagementTransportGetPort(transport, port);
+	}
+
+	__declspec(dllexport) DWORD SetManagementTransportClientProcess(HMGMTTRANSPORT transport, DWORD processId) {
+		return ManagementTransportSetClientProcess(transport, processId);
+	}
+
+	__declspec(dllexport) DWORD SetManagementTransportHandler(HMGMTTRANSPORT transport, MgmtEventType type, MgmtEventCallback callback, PVOID context) {
+		return ManagementTransportSetHandler(transport, type, callback, context);
+	}
+
+	__declspec(dllexport) DWORD SendManagementCommand(HMGMTTRANSPORT transport, LPCSTR command, MgmtReplyKind kind, UINT64* commandId) {
+		return ManagementTransportSend(transport, command, kind, commandId);
+	}
+
+	__declspec(dllexport) DWORD DrainManagementTransportEvents(HMGMTTRANSPORT transport, MgmtBatch* batch) {
+		return ManagementTransportDrain(transport, batch);
+	}
+
+	__declspec(dllexport) DWORD WaitManagementTransportConnected(HMGMTTRANSPORT transport, DWORD timeoutMs) {
+		return ManagementTransportWaitConnected(transport, timeoutMs);
+	}
+
+	__declspec(dllexport) DWORD CloseManagementTransport(HMGMTTRANSPORT transport) {
+		return ManagementTransportClose(transport);
+	}
+
+	__declspec(dllexport) DWORD StartSupervisor(const SupervisorOptions* options, SupervisorCallback callback, PVOID context, HSUPERVISOR* supervisor) {
+		return SupervisorStart(options, callback, context, supervisor);
+	}
+
+	__declspec(dllexport) DWORD GetSupervisorTransport(HSUPERVISOR supervisor, HMGMTTRANSPORT* transport) {
+		return SupervisorGetTransport(supervisor, transport);
+	}
+
+	__declspec(dllexport) DWORD StopSupervisor(HSUPERVISOR supervisor) {
+		return SupervisorStop(supervisor);
+	}
+
+	__declspec(dllexport) DWORD CreateRouteSet(const RouteSetOptions* options, HROUTESET* set) {
+		return RouteSetCreate(options, set);
+	}
+
+	__declspec(dllexport) DWORD ApplyRouteSet(HROUTESET set, const RouteSetPrefix* prefixes, UINT prefixCount, RouteSetApplyReport* report) {
+		return RouteSetApply(set, prefixes, prefixCount, report);
+	}
+
+	__declspec(dllexport) DWORD GetInstalledRoutes(HROUTESET set, RouteSetPrefix* prefixes, UINT prefixesLength, UINT* count) {
+		return RouteSetGetInstalled(set, prefixes, prefixesLength, count);
+	}
+
+	__declspec(dllexport) DWORD CloseRouteSet(HROUTESET set, BOOL keepRoutes) {
+		return RouteSetClose(set, keepRoutes);
+	}
+
+	__declspec(dllexport) DWORD RenderMetrics(CHAR* buffer, DWORD length, DWORD* written) {
+		return MetricsRender(buffer, length, written);
+	}
+
+	__declspec(dllexport) DWORD StartMetricsListener(USHORT port, USHORT* boundPort) {
+		return MetricsListenerStart(port, boundPort);
+	}
+
+	__declspec(dllexport) DWORD StopMetricsListener() {
+		return MetricsListenerStop();
+	}
+
+	__declspec(dllexport) DWORD EnableTraceSpans(BOOL enabled) {
+		return TraceSetSpansEnabled(enabled);
+	}
+
+	__declspec(dllexport) DWORD SetTraceProvider(TraceProviderCallback callback, PVOID context) {
+		return TraceSetProvider(callback, context);
+	}
+
+	__declspec(dllexport) DWORD FormatTraceTimeline(UINT32 requestId, CHAR* buffer, DWORD length, DWORD* written) {
+		return TraceFormatTimeline(requestId, buffer, length, written);
+	}
+
 	__declspec(dllexport) DWORD CreateIkevVpnDevice(LPCWSTR deviceName, LPCWSTR connectionHostname) {
 		return CreateVpnDevice(deviceName, connectionHostname);
 	}
 
+	__declspec(dllexport) DWORD PrepareIkevVpnDevices(LPCWSTR deviceName, LPCWSTR* hostnames, UINT hostnameCount) {
+		return PrepareVpnDevices(deviceName, hostnames, hostnameCount);
+	}
+
+	__declspec(dllexport) DWORD SetIkevDeviceCacheEnabled(BOOL enabled) {
+		return SetVpnDeviceCacheEnabled(enabled);
+	}
+
 	__declspec(dllexport) DWORD AbortIkevVpn() {
 		return AbortDialAttempt();
 	}
@@ -48,11 +409,98 @@ extern "C" {
 	}
 
 	__declspec(dllexport) DWORD GetIkevVpnStatistics(LPCWSTR deviceName, VpnDeviceStats* returnStats) {
-		return GetVpnDeviceStatistics(deviceName, returnStats);
+		DWORD result = GetVpnDeviceStatistics(deviceName, returnStats);
+		if (result == ERROR_SUCCESS)
+		{
+			StatusPageNotifyConnection(returnStats);
+		}
+		return result;
+	}
+
+	__declspec(dllexport) DWORD GetIkevVpnStatisticsBatch(LPCWSTR* deviceNames, UINT deviceCount, VpnDeviceStats* returnStats, DWORD* results, LPWSTR hostnames, DWORD hostnameLength) {
+		return GetVpnDeviceStatisticsBatch(deviceNames, deviceCount, returnStats, results, hostnames, hostnameLength);
 	}
 
 	__declspec(dllexport) DWORD RaslibSetLogCallback(PLogCallback logCallback)
 	{
 		return SetLogCallback(logCallback);
 	}
+
+	__declspec(dllexport) DWORD RaslibSetLogLevel(NativeLogLevel level)
+	{
+		return NativeLogSetLevel(level);
+	}
+
+	__declspec(dllexport) DWORD RaslibFlushLog(DWORD timeoutMs)
+	{
+		return NativeLogFlush(timeoutMs);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionCreate(const DialSessionCallbacks* callbacks, HDIALSESSION* session)
+	{
+		return DialSessionCreate(callbacks, session);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionDial(
+		HDIALSESSION session,
+		LPCWSTR deviceName,
+		LPCWSTR connectionHostname,
+		LPCWSTR username,
+		LPCWSTR password
+	) {
+		return DialSessionDial(session, deviceName, connectionHostname, username, password);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionAbort(HDIALSESSION session) {
+		return DialSessionAbort(session);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionGetState(HDIALSESSION session, DialSessionState* state, DWORD* error) {
+		return DialSessionGetState(session, state, error);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionClose(HDIALSESSION session) {
+		return DialSessionClose(session);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceStart(
+		LPCWSTR deviceName,
+		LPCWSTR* hostnames,
+		UINT hostnameCount,
+		UINT maxParallel,
+		LPCWSTR username,
+		LPCWSTR password,
+		const DialRaceCallbacks* callbacks,
+		HDIALRACE* race
+	) {
+		return DialRaceStart(deviceName, hostnames, hostnameCount, maxParallel, username, password, callbacks, race);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceAbort(HDIALRACE race) {
+		return DialRaceAbort(race);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceGetWinner(HDIALRACE race, UINT* winner, LPWSTR entryName, DWORD entryNameLength) {
+		return DialRaceGetWinner(race, winner, entryName, entryNameLength);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceClose(HDIALRACE race) {
+		return DialRaceClose(race);
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectStart(const ReconnectOptions* options, ReconnectCallback callback, PVOID context, HRECONNECT* reconnector) {
+		return ReconnectStart(options, callback, context, reconnector);
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectGetStatus(HRECONNECT reconnector, ReconnectStatus* status) {
+		return ReconnectGetStatus(reconnector, status);
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectNotifyNetworkChange() {
+		return ReconnectNotifyNetworkChange();
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectStop(HRECONNECT reconnector) {
+		return ReconnectStop(reconnector);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <stdlib.h>
+#include <string.h>
+#include "PortPolicy.h"
+#include "Helpers.h"
+
+#define PORT_BENCH_SEED 0x9E3779B97F4A7C15ULL
+// Longest range the benchmark's rules cover
+#define PORT_BENCH_SPAN 64
+
+// WfpksEnable2's ports, which used to be open to every protocol. Compiling merges them down to six ranges.
+const WFPKS_PORT_RULE PortPolicyDefaultRules[PORT_POLICY_DEFAULT_RULE_COUNT] = {
+	// DHCP server and client
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 67, 0 },
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 68, 0 },
+	// IKE and IKE over NAT-T
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 500, 0 },
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 4500, 0 },
+	// SSDP
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 1900, 0 },
+	// NAT-PMP and PCP, mDNS
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 5350, 0 },
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 5351, 0 },
+	{ IPPROTO_UDP, WFPKS_PORT_REMOTE, 5353, 0 },
+};
+
+// A rule with its group worked out, groups sort by direction then any, TCP, UDP
+typedef struct _PortKey
+{
+	UINT8 Group;
+	UINT16 Low;
+	UINT16 High;
+} PortKey;
+
+static const UINT8 GroupProtocols[] = { 0, IPPROTO_TCP, IPPROTO_UDP };
+
+static int CompareKeys(const void* left, const void* right)
+{
+	const PortKey* a = (const PortKey*)left;
+	const PortKey* b = (const PortKey*)right;
+
+	if (a->Group != b->Group)
+	{
+		return (int)a->Group - (int)b->Group;
+	}
+
+	if (a->Low != b->Low)
+	{
+		return (int)a->Low - (int)b->Low;
+	}
+
+	return (int)a->High - (int)b->High;
+}
+
+static BOOL ToKey(const WFPKS_PORT_RULE* rule, PortKey* key)
+{
+	UINT protocol = 0;
+	while (protocol < ARRAYSIZE(GroupProtocols) && GroupProtocols[protocol] != rule->protocol)
+	{
+		protocol++;
+	}
+
+	UINT16 high = rule->portHigh != 0 ? rule->portHigh : rule->portLow;
+	if (protocol == ARRAYSIZE(GroupProtocols) || rule->direction > WFPKS_PORT_LOCAL || high < rule->portLow)
+	{
+		return FALSE;
+	}
+
+	key->Group = (UINT8)(rule->direction * ARRAYSIZE(GroupProtocols) + protocol);
+	key->Low = rule->portLow;
+	key->High = high;
+
+	return TRUE;
+}
+
+// Drops the ranges in group that lie wholly inside one of covering's. Ranges only partly covered stay as they
+// are, cutting them down would split some in two and add conditions rather than remove them.
+static UINT DropCovered(const PortRange* covering, UINT coveringCount, PortRange* group, UINT groupCount)
+{
+	UINT kept = 0;
+	UINT j = 0;
+
+	for (UINT i = 0; i < groupCount; i++)
+	{
+		while (j < coveringCount && covering[j].High < group[i].Low)
+		{
+			j++;
+		}
+
+		if (j < coveringCount && covering[j].Low <= group[i].Low && covering[j].High >= group[i].High)
+		{
+			continue;
+		}
+
+		group[kept++] = group[i];
+	}
+
+	return kept;
+}
+
+DWORD PortPolicyCompile(const WFPKS_PORT_RULE* rules, UINT ruleCount, PortPolicy* policy)
+{
+	if (policy == NULL || (rules == NULL && ruleCount > 0) || ruleCount > PORT_POLICY_MAX_RULES)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(policy, sizeof(PortPolicy));
+	if (ruleCount == 0)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	PortKey* keys = (PortKey*)HeapAlloc(GetProcessHeap(), 0, ruleCount * sizeof(PortKey));
+	PortRange* ranges = (PortRange*)HeapAlloc(GetProcessHeap(), 0, ruleCount * sizeof(PortRange));
+	if (keys == NULL || ranges == NULL)
+	{
+		if (keys != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, keys);
+		}
+
+		if (ranges != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, ranges);
+		}
+
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (UINT i = 0; i < ruleCount; i++)
+	{
+		if (!ToKey(&rules[i], &keys[i]))
+		{
+			HeapFree(GetProcessHeap(), 0, keys);
+			HeapFree(GetProcessHeap(), 0, ranges);
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	qsort(keys, ruleCount, sizeof(PortKey), CompareKeys);
+
+	// Merge each group's sorted ranges, touching ranges included
+	UINT first[PORT_POLICY_MAX_GROUPS];
+	UINT count[PORT_POLICY_MAX_GROUPS] = { 0 };
+	UINT rangeCount = 0;
+	for (UINT i = 0; i < ruleCount; i++)
+	{
+		UINT group = keys[i].Group;
+		if (count[group] == 0)
+		{
+			first[group] = rangeCount;
+		}
+		else if ((UINT)ranges[rangeCount - 1].High + 1 >= keys[i].Low)
+		{
+			if (keys[i].High > ranges[rangeCount - 1].High)
+			{
+				ranges[rangeCount - 1].High = keys[i].High;
+			}
+
+			continue;
+		}
+
+		ranges[rangeCount].Low = keys[i].Low;
+		ranges[rangeCount].High = keys[i].High;
+		rangeCount++;
+		count[group]++;
+	}
+
+	HeapFree(GetProcessHeap(), 0, keys);
+
+	// Groups only shrink from here, so they're packed back down into the same array in order
+	UINT packed = 0;
+	for (UINT group = 0; group < PORT_POLICY_MAX_GROUPS; group++)
+	{
+		if (count[group] == 0)
+		{
+			continue;
+		}
+
+		UINT any = group - group % ARRAYSIZE(GroupProtocols);
+		UINT kept = count[group];
+		if (group != any && count[any] > 0)
+		{
+			kept = DropCovered(&ranges[first[any]], count[any], &ranges[first[group]], count[group]);
+		}
+
+		memmove(&ranges[packed], &ranges[first[group]], kept * sizeof(PortRange));
+		first[group] = packed;
+		count[group] = kept;
+		packed += kept;
+
+		if (kept > 0)
+		{
+			PortPolicyGroup* compiled = &policy->Groups[policy->GroupCount++];
+			compiled->Protocol = GroupProtocols[group % ARRAYSIZE(GroupProtocols)];
+			compiled->Direction = (UINT8)(group / ARRAYSIZE(GroupProtocols));
+			compiled->First = first[group];
+			compiled->Count = kept;
+		}
+	}
+
+	policy->Ranges = ranges;
+	policy->RangeCount = packed;
+
+	return ERROR_SUCCESS;
+}
+
+static BOOL InRanges(const PortRange* ranges, UINT count, USHORT port)
+{
+	UINT low = 0;
+	UINT high = count;
+
+	while (low < high)
+	{
+		UINT middle = low + (high - low) / 2;
+		if (ranges[middle].High < port)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low < count && ranges[low].Low <= port;
+}
+
+BOOL PortPolicyAllows(const PortPolicy* policy, UINT8 protocol, USHORT remotePort, USHORT localPort)
+{
+	for (UINT i = 0; i < policy->GroupCount; i++)
+	{
+		const PortPolicyGroup* group = &policy->Groups[i];
+		if (group->Protocol != 0 && group->Protocol != protocol)
+		{
+			continue;
+		}
+
+		if (InRanges(&policy->Ranges[group->First], group->Count, group->Direction == WFPKS_PORT_REMOTE ? remotePort : localPort))
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+void PortPolicyFree(PortPolicy* policy)
+{
+	if (policy->Ranges != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, policy->Ranges);
+	}
+
+	ZeroMemory(policy, sizeof(PortPolicy));
+}
+
+#ifdef NATIVE_BENCH
+DWORD PortPolicyRunBenchmark(UINT rules, UINT iterations, PortPolicyBenchReport* report)
+{
+	if (report == NULL || rules == 0 || rules > PORT_POLICY_MAX_RULES || iterations == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(PortPolicyBenchReport));
+	report->Rules = rules;
+	report->RuleConditions = rules;
+
+	WFPKS_PORT_RULE* generated = (WFPKS_PORT_RULE*)HeapAlloc(GetProcessHeap(), 0, rules * sizeof(WFPKS_PORT_RULE));
+	if (generated == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// Mostly UDP and mostly single remote ports, the shape of real allow lists
+	UINT64 random = PORT_BENCH_SEED;
+	for (UINT i = 0; i < rules; i++)
+	{
+		UINT64 draw = NextRandom(&random);
+		UINT protocolDraw = (UINT)(draw % 8);
+		generated[i].protocol = protocolDraw < 4 ? IPPROTO_UDP : protocolDraw < 7 ? IPPROTO_TCP : 0;
+		generated[i].direction = (draw >> 8) % 4 == 0 ? WFPKS_PORT_LOCAL : WFPKS_PORT_REMOTE;
+		generated[i].portLow = (UINT16)(1 + (draw >> 16) % (65535 - PORT_BENCH_SPAN));
+		generated[i].portHigh = (draw >> 40) % 4 == 0 ? (UINT16)(generated[i].portLow + (draw >> 48) % PORT_BENCH_SPAN) : 0;
+	}
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	DWORD result = ERROR_SUCCESS;
+	for (UINT i = 0; i < iterations && result == ERROR_SUCCESS; i++)
+	{
+		PortPolicy policy;
+		result = PortPolicyCompile(generated, rules, &policy);
+		if (result == ERROR_SUCCESS && i + 1 == iterations)
+		{
+			report->Filters = policy.GroupCount;
+			report->Conditions = policy.RangeCount;
+			for (UINT g = 0; g < policy.GroupCount; g++)
+			{
+				report->Conditions += policy.Groups[g].Protocol != 0 ? 1 : 0;
+			}
+		}
+
+		if (result == ERROR_SUCCESS)
+		{
+			PortPolicyFree(&policy);
+		}
+	}
+
+	QueryPerformanceCounter(&end);
+	report->CompileUsMean = (DOUBLE)(end.QuadPart - start.QuadPart) * 1e6 / frequency.QuadPart / iterations;
+
+	HeapFree(GetProcessHeap(), 0, generated);
+
+	return result;
+}
+#endif
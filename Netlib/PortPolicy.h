@@ -0,0 +1,62 @@
+#pragma once
+#include <windows.h>
+#include "wfp_killswitch.h"
+
+#define PORT_POLICY_MAX_RULES 65536
+// Any protocol, TCP and UDP for each direction, a filter each
+#define PORT_POLICY_MAX_GROUPS 6
+#define PORT_POLICY_DEFAULT_RULE_COUNT 8
+
+typedef struct _PortRange
+{
+	UINT16 Low;
+	UINT16 High;
+} PortRange;
+
+// One filter's worth of conditions: the protocol, unless it's any protocol, and a port condition per range
+typedef struct _PortPolicyGroup
+{
+	UINT8 Protocol;
+	UINT8 Direction;
+	// Into PortPolicy.Ranges, sorted and disjoint
+	UINT First;
+	UINT Count;
+} PortPolicyGroup;
+
+typedef struct _PortPolicy
+{
+	PortPolicyGroup Groups[PORT_POLICY_MAX_GROUPS];
+	UINT GroupCount;
+	PortRange* Ranges;
+	UINT RangeCount;
+} PortPolicy;
+
+// What WfpksEnable2 allows out: DHCP, IKE, SSDP, NAT-PMP and mDNS, all of them over UDP only
+extern const WFPKS_PORT_RULE PortPolicyDefaultRules[PORT_POLICY_DEFAULT_RULE_COUNT];
+
+// Merges overlapping and adjacent ranges within each protocol and direction, then drops TCP and UDP ranges the
+// any protocol group of the same direction already covers. Groups come out ordered by direction then protocol,
+// empty ones left out. Free the policy with PortPolicyFree.
+extern DWORD PortPolicyCompile(const WFPKS_PORT_RULE* rules, UINT ruleCount, PortPolicy* policy);
+
+// Whether a connection over protocol between the two ports matches a rule
+extern BOOL PortPolicyAllows(const PortPolicy* policy, UINT8 protocol, USHORT remotePort, USHORT localPort);
+
+extern void PortPolicyFree(PortPolicy* policy);
+
+#ifdef NATIVE_BENCH
+typedef struct _PortPolicyBenchReport
+{
+	UINT Rules;
+	// A condition per rule, what lowering the rules as given would add
+	UINT RuleConditions;
+	// Port and protocol conditions across the compiled filters
+	UINT Conditions;
+	UINT Filters;
+	DOUBLE CompileUsMean;
+} PortPolicyBenchReport;
+
+// Compiles rules random rules, single ports and short ranges across both directions and all three protocols,
+// iterations times
+extern DWORD PortPolicyRunBenchmark(UINT rules, UINT iterations, PortPolicyBenchReport* report);
+#endif
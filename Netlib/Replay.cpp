@@ -0,0 +1,421 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <fwpmu.h>
+#include <Ras.h>
+#include "Replay.h"
+#include "RasApi.h"
+#include "RasSim.h"
+#include "WfpApi.h"
+#include "NativeLog.h"
+
+#define REPLAY_DEFAULT_LATENCY_PERCENT 100
+
+// Held shared while a call looks up its recorded counterpart and exclusive to start and stop
+static SRWLOCK ReplayLock = SRWLOCK_INIT;
+static RecorderTrace* Trace = NULL;
+// Indexes into the trace grouped by probe, each group in recorded order
+static UINT32* Order = NULL;
+static UINT32 ProbeFirst[TraceProbeCount];
+static UINT32 ProbeCount[TraceProbeCount];
+static volatile LONG Cursor[TraceProbeCount];
+static UINT LatencyPercent = REPLAY_DEFAULT_LATENCY_PERCENT;
+static INT64 TicksPerSecond = 1;
+static const RASLIB_API* PreviousRasApi = NULL;
+static const RASLIB_API* SimApi = NULL;
+static volatile LONG64 NextFilterId = 0;
+
+// Waits out latencyUs from startTicks, sleeping through all but the last couple of milliseconds
+static void WaitUntil(INT64 startTicks, UINT64 latencyUs)
+{
+	INT64 endTicks = startTicks + (INT64)(latencyUs * TicksPerSecond / 1000000);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	while (now.QuadPart < endTicks)
+	{
+		INT64 remainingMs = (endTicks - now.QuadPart) * 1000 / TicksPerSecond;
+		if (remainingMs > 2)
+		{
+			Sleep((DWORD)(remainingMs - 2));
+		}
+		else
+		{
+			YieldProcessor();
+		}
+		QueryPerformanceCounter(&now);
+	}
+}
+
+// Matches a call with the next recorded one of its kind and waits out its latency. Returns the recorded result,
+// ERROR_SUCCESS when the call should be passed on to the simulators.
+static DWORD Replay(TraceProbe probe)
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	UINT64 latencyUs = 0;
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockShared(&ReplayLock);
+	if (Trace != NULL)
+	{
+		LONG i = InterlockedIncrement(&Cursor[probe]) - 1;
+		if ((UINT32)i < ProbeCount[probe])
+		{
+			const RecorderCall* call = &Trace->Calls[Order[ProbeFirst[probe] + i]];
+			latencyUs = (UINT64)call->LatencyUs * LatencyPercent / 100;
+			result = call->Result;
+		}
+	}
+	ReleaseSRWLockShared(&ReplayLock);
+
+	WaitUntil(start.QuadPart, latencyUs);
+
+	return result;
+}
+
+#define REPLAY_RAS(probe, call) do { DWORD result = Replay(probe); return result != ERROR_SUCCESS ? result : SimApi->call; } while (0)
+
+static DWORD APIENTRY ReplayGetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, LPDWORD entryInfoSize, LPBYTE deviceInfo, LPDWORD deviceInfoSize)
+{
+	REPLAY_RAS(TraceProbeRasGetEntryProperties, GetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize));
+}
+
+static DWORD APIENTRY ReplaySetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, DWORD entryInfoSize, LPBYTE deviceInfo, DWORD deviceInfoSize)
+{
+	REPLAY_RAS(TraceProbeRasSetEntryProperties, SetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize));
+}
+
+static DWORD APIENTRY ReplayValidateEntryName(LPCWSTR phonebook, LPCWSTR entryName)
+{
+	REPLAY_RAS(TraceProbeRasValidateEntryName, ValidateEntryName(phonebook, entryName));
+}
+
+static DWORD APIENTRY ReplayEnumDevices(LPRASDEVINFO rasDevInfo, LPDWORD size, LPDWORD devices)
+{
+	REPLAY_RAS(TraceProbeRasEnumDevices, EnumDevices(rasDevInfo, size, devices));
+}
+
+static DWORD APIENTRY ReplayEnumConnections(LPRASCONN rasConn, LPDWORD size, LPDWORD connections)
+{
+	REPLAY_RAS(TraceProbeRasEnumConnections, EnumConnections(rasConn, size, connections));
+}
+
+static DWORD APIENTRY ReplayGetEntryDialParams(LPCWSTR phonebook, LPRASDIALPARAMS dialParams, LPBOOL passwordReturned)
+{
+	REPLAY_RAS(TraceProbeRasGetEntryDialParams, GetEntryDialParams(phonebook, dialParams, passwordReturned));
+}
+
+static DWORD APIENTRY ReplayDial(LPRASDIALEXTENSIONS dialExtensions, LPCWSTR phonebook, LPRASDIALPARAMS dialParams, DWORD notifierType, LPVOID notifier, LPHRASCONN rasConn)
+{
+	REPLAY_RAS(TraceProbeRasDial, Dial(dialExtensions, phonebook, dialParams, notifierType, notifier, rasConn));
+}
+
+static DWORD APIENTRY ReplayHangUp(HRASCONN rasConn)
+{
+	REPLAY_RAS(TraceProbeRasHangUp, HangUp(rasConn));
+}
+
+static DWORD APIENTRY ReplayGetConnectStatus(HRASCONN rasConn, LPRASCONNSTATUS status)
+{
+	REPLAY_RAS(TraceProbeRasGetConnectStatus, GetConnectStatus(rasConn, status));
+}
+
+static DWORD APIENTRY ReplayGetConnectionStatistics(HRASCONN rasConn, RAS_STATS* stats)
+{
+	REPLAY_RAS(TraceProbeRasGetConnectionStatistics, GetConnectionStatistics(rasConn, stats));
+}
+
+static DWORD APIENTRY ReplayConnectionNotification(HRASCONN rasConn, HANDLE event, DWORD flags)
+{
+	REPLAY_RAS(TraceProbeRasConnectionNotification, ConnectionNotification(rasConn, event, flags));
+}
+
+static const RASLIB_API ReplayRasApi =
+{
+	ReplayGetEntryProperties,
+	ReplaySetEntryProperties,
+	ReplayValidateEntryName,
+	ReplayEnumDevices,
+	ReplayEnumConnections,
+	ReplayGetEntryDialParams,
+	ReplayDial,
+	ReplayHangUp,
+	ReplayGetConnectStatus,
+	ReplayGetConnectionStatistics,
+	ReplayConnectionNotification,
+};
+
+// The engine stand in keeps no state, what a call finds is down to the recorded result
+static DWORD WINAPI ReplayEngineOpen0(const wchar_t* serverName, UINT32 authnService, SEC_WINNT_AUTH_IDENTITY_W* authIdentity, const FWPM_SESSION0* session, HANDLE* engineHandle)
+{
+	DWORD result = Replay(TraceProbeEngineOpen);
+	*engineHandle = result == ERROR_SUCCESS ? (HANDLE)&ReplayLock : NULL;
+	return result;
+}
+
+static DWORD WINAPI ReplayEngineClose0(HANDLE engineHandle)
+{
+	return Replay(TraceProbeEngineClose);
+}
+
+static DWORD WINAPI ReplaySubLayerAdd0(HANDLE engineHandle, const FWPM_SUBLAYER0* subLayer, PSECURITY_DESCRIPTOR sd)
+{
+	return Replay(TraceProbeSubLayerAdd);
+}
+
+static DWORD WINAPI ReplaySubLayerDeleteByKey0(HANDLE engineHandle, const GUID* key)
+{
+	return Replay(TraceProbeSubLayerDelete);
+}
+
+static DWORD WINAPI ReplayFilterAdd0(HANDLE engineHandle, const FWPM_FILTER0* filter, PSECURITY_DESCRIPTOR sd, UINT64* id)
+{
+	DWORD result = Replay(TraceProbeFilterAdd);
+	if (result == ERROR_SUCCESS && id != NULL)
+	{
+		*id = (UINT64)InterlockedIncrement64(&NextFilterId);
+	}
+
+	return result;
+}
+
+static DWORD WINAPI ReplayFilterDeleteByKey0(HANDLE engineHandle, const GUID* key)
+{
+	return Replay(TraceProbeFilterDelete);
+}
+
+static DWORD WINAPI ReplayFilterGetByKey0(HANDLE engineHandle, const GUID* key, FWPM_FILTER0** filter)
+{
+	DWORD result = Replay(TraceProbeFilterGet);
+	if (result == ERROR_SUCCESS)
+	{
+		*filter = (FWPM_FILTER0*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(FWPM_FILTER0));
+		if (*filter == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		(*filter)->filterKey = *key;
+	}
+
+	return result;
+}
+
+static DWORD WINAPI ReplayGetAppIdFromFileName0(const wchar_t* fileName, FWP_BYTE_BLOB** appId)
+{
+	DWORD result = Replay(TraceProbeAppId);
+	if (result == ERROR_SUCCESS)
+	{
+		// The path stands in for the device path the engine would give back
+		SIZE_T size = wcslen(fileName) * sizeof(WCHAR);
+		*appId = (FWP_BYTE_BLOB*)HeapAlloc(GetProcessHeap(), 0, sizeof(FWP_BYTE_BLOB) + size);
+		if (*appId == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		(*appId)->size = (UINT32)size;
+		(*appId)->data = (UINT8*)(*appId + 1);
+		memcpy((*appId)->data, fileName, size);
+	}
+
+	return result;
+}
+
+static void WINAPI ReplayFreeMemory0(void** p)
+{
+	if (*p != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, *p);
+		*p = NULL;
+	}
+}
+
+static const WFP_API ReplayWfpApi =
+{
+	ReplayEngineOpen0,
+	ReplayEngineClose0,
+	ReplaySubLayerAdd0,
+	ReplaySubLayerDeleteByKey0,
+	ReplayFilterAdd0,
+	ReplayFilterDeleteByKey0,
+	ReplayFilterGetByKey0,
+	ReplayGetAppIdFromFileName0,
+	ReplayFreeMemory0,
+};
+
+static DWORD BuildOrder(const RecorderTrace* trace, UINT32** order)
+{
+	*order = (UINT32*)HeapAlloc(GetProcessHeap(), 0, (trace->Count > 0 ? trace->Count : 1) * sizeof(UINT32));
+	if (*order == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	UINT32 next[TraceProbeCount];
+	UINT32 first = 0;
+	ZeroMemory(ProbeCount, sizeof(ProbeCount));
+	for (UINT32 i = 0; i < trace->Count; i++)
+	{
+		ProbeCount[trace->Calls[i].Probe]++;
+	}
+
+	for (UINT probe = 0; probe < TraceProbeCount; probe++)
+	{
+		ProbeFirst[probe] = first;
+		next[probe] = first;
+		first += ProbeCount[probe];
+		Cursor[probe] = 0;
+	}
+
+	for (UINT32 i = 0; i < trace->Count; i++)
+	{
+		(*order)[next[trace->Calls[i].Probe]++] = i;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ReplayStart(LPCWSTR path, const ReplayOptions* options)
+{
+	RecorderTrace* trace = NULL;
+	DWORD result = RecorderLoad(path, &trace);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	AcquireSRWLockExclusive(&ReplayLock);
+	if (Trace != NULL)
+	{
+		result = ERROR_ALREADY_EXISTS;
+	}
+	else
+	{
+		result = BuildOrder(trace, &Order);
+	}
+
+	// The replayed calls are recorded to compare with the trace at the end
+	if (result == ERROR_SUCCESS)
+	{
+		result = RecorderStart(NULL, trace->Count > RECORDER_DEFAULT_CAPACITY / 2 ? trace->Count * 2 : 0);
+		if (result != ERROR_SUCCESS)
+		{
+			HeapFree(GetProcessHeap(), 0, Order);
+			Order = NULL;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		TicksPerSecond = frequency.QuadPart;
+		LatencyPercent = options != NULL && options->LatencyPercent != 0 ? options->LatencyPercent : REPLAY_DEFAULT_LATENCY_PERCENT;
+		Trace = trace;
+
+		PreviousRasApi = RaslibGetInstalledApi();
+		RasSimEnable(TRUE);
+		SimApi = RaslibGetInstalledApi();
+		RaslibSetApi(&ReplayRasApi);
+		WfpSetApi(&ReplayWfpApi);
+	}
+	ReleaseSRWLockExclusive(&ReplayLock);
+
+	if (result != ERROR_SUCCESS)
+	{
+		RecorderFree(trace);
+		return result;
+	}
+
+	NATIVELOG_INFO("replaying %u platform calls\n", trace->Count);
+
+	return ERROR_SUCCESS;
+}
+
+// First call to the end of the last, in microseconds
+static DOUBLE Span(const RecorderTrace* trace)
+{
+	if (trace->Count == 0)
+	{
+		return 0;
+	}
+
+	UINT64 first = trace->Calls[0].StartUs;
+	UINT64 last = 0;
+	for (UINT32 i = 0; i < trace->Count; i++)
+	{
+		UINT64 end = trace->Calls[i].StartUs + trace->Calls[i].LatencyUs;
+		first = min(first, trace->Calls[i].StartUs);
+		last = max(last, end);
+	}
+
+	return (DOUBLE)(last - first);
+}
+
+DWORD ReplayStop(ReplayReport* report)
+{
+	AcquireSRWLockExclusive(&ReplayLock);
+	RecorderTrace* trace = Trace;
+	UINT32* order = Order;
+	RecorderTrace* replayed = NULL;
+	DWORD result = ERROR_NOT_FOUND;
+	if (trace != NULL)
+	{
+		WfpSetApi(NULL);
+		RasSimReset();
+		RaslibSetApi(PreviousRasApi);
+		result = RecorderTake(&replayed);
+	}
+
+	if (result == ERROR_SUCCESS && report != NULL)
+	{
+		ZeroMemory(report, sizeof(ReplayReport));
+		report->RecordedCalls = trace->Count;
+		report->ReplayedCalls = replayed->Count;
+		report->RecordedUs = Span(trace);
+		report->ReplayedUs = Span(replayed);
+
+		// Each replayed call is matched with the recorded call at the same position among its kind
+		UINT32 made[TraceProbeCount];
+		ZeroMemory(made, sizeof(made));
+		for (UINT32 i = 0; i < replayed->Count; i++)
+		{
+			const RecorderCall* call = &replayed->Calls[i];
+			UINT32 n = made[call->Probe]++;
+			if (n >= ProbeCount[call->Probe])
+			{
+				report->UnmatchedCalls++;
+			}
+			else if (trace->Calls[order[ProbeFirst[call->Probe] + n]].ArgsDigest != call->ArgsDigest)
+			{
+				report->DigestMismatches++;
+			}
+		}
+
+		for (UINT probe = 0; probe < TraceProbeCount; probe++)
+		{
+			if (made[probe] < ProbeCount[probe])
+			{
+				report->UnusedCalls += ProbeCount[probe] - made[probe];
+			}
+		}
+	}
+
+	Trace = NULL;
+	Order = NULL;
+	ReleaseSRWLockExclusive(&ReplayLock);
+
+	if (trace == NULL)
+	{
+		return result;
+	}
+
+	NATIVELOG_INFO("replayed %u of %u platform calls\n", replayed != NULL ? replayed->Count : 0, trace->Count);
+
+	RecorderFree(replayed);
+	RecorderFree(trace);
+	HeapFree(GetProcessHeap(), 0, order);
+
+	return result;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <windows.h>
+#include "Recorder.h"
+
+typedef struct _ReplayOptions
+{
+	// How long each call takes as a percentage of its recorded latency, 100 when 0
+	UINT LatencyPercent;
+} ReplayOptions;
+
+typedef struct _ReplayReport
+{
+	UINT RecordedCalls;
+	UINT ReplayedCalls;
+	// Calls made past the last one of their kind in the trace, answered by the simulators straight away
+	UINT UnmatchedCalls;
+	// Calls in the trace that weren't made
+	UINT UnusedCalls;
+	// Calls made with arguments that digest differently from the call they were matched with
+	UINT DigestMismatches;
+	// From the first call to the end of the last, as recorded and as replayed. The calls take the same time in
+	// both, so what differs is the code making them.
+	DOUBLE RecordedUs;
+	DOUBLE ReplayedUs;
+} ReplayReport;
+
+// Answers RAS and engine calls from a trace RecorderStop wrote until ReplayStop. Calls are matched with the
+// recorded ones in order, by kind. Each waits out its recorded latency then fails with the recorded error, or,
+// when it succeeded, is passed on: RAS to RasSim, which is enabled for the replay, the engine to a stand in
+// that accepts everything. Make the calls the trace was recorded from, an engage or a dial, between the two.
+extern DWORD ReplayStart(LPCWSTR path, const ReplayOptions* options);
+
+// Stops answering, disables RasSim and compares the calls made with the trace
+extern DWORD ReplayStop(ReplayReport* report);
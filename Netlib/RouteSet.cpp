@@ -0,0 +1,636 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <stdlib.h>
+#include <string.h>
+#include "RouteSet.h"
+#include "Metrics.h"
+#include "NativeLog.h"
+#include "Helpers.h"
+
+#define ROUTE_SET_DEFAULT_METRIC 1
+#define ROUTE_BENCH_DIFF_ITERATIONS 10
+#define ROUTE_BENCH_BASE 0xC6120000
+#define ROUTE_BENCH_SEED 0x9E3779B97F4A7C15ULL
+
+// What an apply does to one prefix. Index is into the installed array for a removal, the desired one for an add.
+typedef struct _RouteOp
+{
+	UINT Index;
+	BOOL Remove;
+	// Added over a route already in the table, so a rollback leaves it there
+	BOOL Adopted;
+} RouteOp;
+
+typedef struct _RouteSet
+{
+	SRWLOCK Lock;
+	ULONG InterfaceIndex;
+	// Every route is a copy of one of these with its destination filled in
+	MIB_IPFORWARD_ROW2 TemplateV4;
+	MIB_IPFORWARD_ROW2 TemplateV6;
+	// Sorted and distinct, what the kernel was left with by the last apply
+	RouteSetPrefix* Installed;
+	UINT InstalledCount;
+} RouteSet;
+
+// Routes installed by every set, for the gauge
+static volatile LONG InstalledTotal = 0;
+
+static void UpdateInstalledTotal(INT delta)
+{
+	MetricsGaugeSet(MetricRoutesInstalled, InterlockedExchangeAdd(&InstalledTotal, delta) + delta);
+}
+
+static DWORD ElapsedUs(LARGE_INTEGER start, LARGE_INTEGER frequency)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (DWORD)((now.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart);
+}
+
+static int ComparePrefixes(const void* left, const void* right)
+{
+	const RouteSetPrefix* a = (const RouteSetPrefix*)left;
+	const RouteSetPrefix* b = (const RouteSetPrefix*)right;
+
+	if (a->Family != b->Family)
+	{
+		return a->Family < b->Family ? -1 : 1;
+	}
+
+	int order = memcmp(a->Address, b->Address, sizeof(a->Address));
+	if (order != 0)
+	{
+		return order;
+	}
+
+	return (int)a->PrefixLength - (int)b->PrefixLength;
+}
+
+// Copies prefix with its host bits and the bytes past its family's address cleared, so equal routes compare equal
+static BOOL NormalizePrefix(const RouteSetPrefix* prefix, RouteSetPrefix* normalized)
+{
+	UINT addressLength = prefix->Family == AF_INET ? 4 : prefix->Family == AF_INET6 ? 16 : 0;
+	if (addressLength == 0 || prefix->PrefixLength > addressLength * 8)
+	{
+		return FALSE;
+	}
+
+	ZeroMemory(normalized, sizeof(RouteSetPrefix));
+	normalized->Family = prefix->Family;
+	normalized->PrefixLength = prefix->PrefixLength;
+
+	UINT whole = prefix->PrefixLength / 8;
+	memcpy(normalized->Address, prefix->Address, whole);
+	if (prefix->PrefixLength % 8 != 0)
+	{
+		normalized->Address[whole] = prefix->Address[whole] & (BYTE)(0xFF << (8 - prefix->PrefixLength % 8));
+	}
+
+	return TRUE;
+}
+
+// Normalizes, sorts and drops duplicates, returning the distinct count. invalid is set to the first prefix that
+// doesn't validate, in which case 0 is returned.
+static UINT SortPrefixes(const RouteSetPrefix* prefixes, UINT count, RouteSetPrefix* sorted, RouteSetPrefix* invalid)
+{
+	for (UINT i = 0; i < count; i++)
+	{
+		if (!NormalizePrefix(&prefixes[i], &sorted[i]))
+		{
+			*invalid = prefixes[i];
+			return 0;
+		}
+	}
+
+	qsort(sorted, count, sizeof(RouteSetPrefix), ComparePrefixes);
+
+	UINT distinct = 0;
+	for (UINT i = 0; i < count; i++)
+	{
+		if (distinct == 0 || ComparePrefixes(&sorted[distinct - 1], &sorted[i]) != 0)
+		{
+			sorted[distinct++] = sorted[i];
+		}
+	}
+
+	return distinct;
+}
+
+// Merges two sorted arrays into the removals then the adds that turn installed into desired. ops needs room for
+// installedCount + desiredCount entries.
+static UINT DiffPrefixes(const RouteSetPrefix* installed, UINT installedCount, const RouteSetPrefix* desired, UINT desiredCount,
+	RouteOp* ops, UINT* removals)
+{
+	RouteOp* adds = ops + installedCount;
+	UINT removeCount = 0;
+	UINT addCount = 0;
+	UINT i = 0;
+	UINT j = 0;
+
+	while (i < installedCount || j < desiredCount)
+	{
+		int order = i == installedCount ? 1 : j == desiredCount ? -1 : ComparePrefixes(&installed[i], &desired[j]);
+		if (order < 0)
+		{
+			ops[removeCount].Index = i++;
+			ops[removeCount].Remove = TRUE;
+			ops[removeCount++].Adopted = FALSE;
+		}
+		else if (order > 0)
+		{
+			adds[addCount].Index = j++;
+			adds[addCount].Remove = FALSE;
+			adds[addCount++].Adopted = FALSE;
+		}
+		else
+		{
+			i++;
+			j++;
+		}
+	}
+
+	memmove(ops + removeCount, adds, addCount * sizeof(RouteOp));
+	*removals = removeCount;
+
+	return removeCount + addCount;
+}
+
+static void FillRow(const RouteSet* set, const RouteSetPrefix* prefix, MIB_IPFORWARD_ROW2* row)
+{
+	if (prefix->Family == AF_INET)
+	{
+		*row = set->TemplateV4;
+		memcpy(&row->DestinationPrefix.Prefix.Ipv4.sin_addr, prefix->Address, 4);
+	}
+	else
+	{
+		*row = set->TemplateV6;
+		memcpy(&row->DestinationPrefix.Prefix.Ipv6.sin6_addr, prefix->Address, 16);
+	}
+
+	row->DestinationPrefix.PrefixLength = prefix->PrefixLength;
+}
+
+static DWORD AddRoute(const RouteSet* set, const RouteSetPrefix* prefix, BOOL* adopted)
+{
+	MIB_IPFORWARD_ROW2 row;
+	FillRow(set, prefix, &row);
+
+	DWORD result = CreateIpForwardEntry2(&row);
+	*adopted = result == ERROR_OBJECT_ALREADY_EXISTS;
+
+	return *adopted ? ERROR_SUCCESS : result;
+}
+
+static DWORD RemoveRoute(const RouteSet* set, const RouteSetPrefix* prefix)
+{
+	MIB_IPFORWARD_ROW2 row;
+	FillRow(set, prefix, &row);
+
+	// Gone already, with the interface or by hand, is as good as removed
+	DWORD result = DeleteIpForwardEntry2(&row);
+
+	return result == ERROR_NOT_FOUND ? ERROR_SUCCESS : result;
+}
+
+static BOOL RowMatches(const MIB_IPFORWARD_ROW2* row, const MIB_IPFORWARD_ROW2* pattern)
+{
+	if (row->InterfaceIndex != pattern->InterfaceIndex || row->Metric != pattern->Metric || row->Protocol != pattern->Protocol
+		|| row->DestinationPrefix.Prefix.si_family != pattern->NextHop.si_family)
+	{
+		return FALSE;
+	}
+
+	return row->NextHop.si_family == AF_INET
+		? memcmp(&row->NextHop.Ipv4.sin_addr, &pattern->NextHop.Ipv4.sin_addr, sizeof(IN_ADDR)) == 0
+		: memcmp(&row->NextHop.Ipv6.sin6_addr, &pattern->NextHop.Ipv6.sin6_addr, sizeof(IN6_ADDR)) == 0;
+}
+
+// Reads the routes in the table that this set would have installed
+static DWORD AdoptRoutes(RouteSet* set)
+{
+	PMIB_IPFORWARD_TABLE2 table = NULL;
+	DWORD result = GetIpForwardTable2(AF_UNSPEC, &table);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	UINT count = 0;
+	for (ULONG i = 0; i < table->NumEntries; i++)
+	{
+		const MIB_IPFORWARD_ROW2* row = &table->Table[i];
+		if (RowMatches(row, row->DestinationPrefix.Prefix.si_family == AF_INET ? &set->TemplateV4 : &set->TemplateV6))
+		{
+			count++;
+		}
+	}
+
+	RouteSetPrefix* prefixes = count > 0 ? (RouteSetPrefix*)HeapAlloc(GetProcessHeap(), 0, count * sizeof(RouteSetPrefix)) : NULL;
+	if (count > 0 && prefixes == NULL)
+	{
+		FreeMibTable(table);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	UINT found = 0;
+	for (ULONG i = 0; i < table->NumEntries && found < count; i++)
+	{
+		const MIB_IPFORWARD_ROW2* row = &table->Table[i];
+		if (!RowMatches(row, row->DestinationPrefix.Prefix.si_family == AF_INET ? &set->TemplateV4 : &set->TemplateV6))
+		{
+			continue;
+		}
+
+		RouteSetPrefix* prefix = &prefixes[found++];
+		ZeroMemory(prefix, sizeof(RouteSetPrefix));
+		prefix->Family = row->DestinationPrefix.Prefix.si_family;
+		prefix->PrefixLength = row->DestinationPrefix.PrefixLength;
+		if (prefix->Family == AF_INET)
+		{
+			memcpy(prefix->Address, &row->DestinationPrefix.Prefix.Ipv4.sin_addr, 4);
+		}
+		else
+		{
+			memcpy(prefix->Address, &row->DestinationPrefix.Prefix.Ipv6.sin6_addr, 16);
+		}
+	}
+
+	FreeMibTable(table);
+
+	if (found > 0)
+	{
+		qsort(prefixes, found, sizeof(RouteSetPrefix), ComparePrefixes);
+		set->Installed = prefixes;
+		set->InstalledCount = found;
+		UpdateInstalledTotal((INT)found);
+		NATIVELOG_INFO("route set on interface %lu adopted %u routes\n", set->InterfaceIndex, found);
+	}
+	else if (prefixes != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, prefixes);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD RouteSetCreate(const RouteSetOptions* options, HROUTESET* set)
+{
+	if (options == NULL || set == NULL || options->InterfaceIndex == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*set = NULL;
+
+	RouteSet* created = (RouteSet*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(RouteSet));
+	if (created == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	InitializeSRWLock(&created->Lock);
+	created->InterfaceIndex = options->InterfaceIndex;
+
+	MIB_IPFORWARD_ROW2* templates[] = { &created->TemplateV4, &created->TemplateV6 };
+	for (UINT i = 0; i < 2; i++)
+	{
+		MIB_IPFORWARD_ROW2* row = templates[i];
+		InitializeIpForwardEntry(row);
+		row->InterfaceIndex = options->InterfaceIndex;
+		row->Metric = options->Metric != 0 ? options->Metric : ROUTE_SET_DEFAULT_METRIC;
+		row->Protocol = MIB_IPPROTO_NETMGMT;
+		row->DestinationPrefix.Prefix.si_family = i == 0 ? AF_INET : AF_INET6;
+		row->NextHop.si_family = i == 0 ? AF_INET : AF_INET6;
+	}
+
+	created->TemplateV4.NextHop.Ipv4.sin_addr = options->NextHopV4;
+	created->TemplateV6.NextHop.Ipv6.sin6_addr = options->NextHopV6;
+
+	if (options->Adopt)
+	{
+		DWORD result = AdoptRoutes(created);
+		if (result != ERROR_SUCCESS)
+		{
+			HeapFree(GetProcessHeap(), 0, created);
+			return result;
+		}
+	}
+
+	*set = created;
+
+	return ERROR_SUCCESS;
+}
+
+// Undoes ops[0, done) newest first. Errors are only logged, there's nothing better to do with them.
+static void RollBack(const RouteSet* set, const RouteSetPrefix* desired, const RouteOp* ops, UINT done)
+{
+	for (UINT i = done; i-- > 0;)
+	{
+		DWORD result = ERROR_SUCCESS;
+		if (ops[i].Remove)
+		{
+			BOOL adopted;
+			result = AddRoute(set, &set->Installed[ops[i].Index], &adopted);
+		}
+		else if (!ops[i].Adopted)
+		{
+			result = RemoveRoute(set, &desired[ops[i].Index]);
+		}
+
+		if (result != ERROR_SUCCESS)
+		{
+			NATIVELOG_WARNING("route set on interface %lu could not roll back a route: %lu\n", set->InterfaceIndex, result);
+		}
+	}
+}
+
+DWORD RouteSetApply(HROUTESET set, const RouteSetPrefix* prefixes, UINT prefixCount, RouteSetApplyReport* report)
+{
+	if (set == NULL || (prefixes == NULL && prefixCount > 0) || prefixCount > ROUTE_SET_MAX_ROUTES)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	RouteSetApplyReport local;
+	if (report == NULL)
+	{
+		report = &local;
+	}
+
+	ZeroMemory(report, sizeof(RouteSetApplyReport));
+
+	LARGE_INTEGER frequency, start;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	INT64 timer = MetricsTimerStart();
+
+	AcquireSRWLockExclusive(&set->Lock);
+
+	RouteSetPrefix* desired = prefixCount > 0 ? (RouteSetPrefix*)HeapAlloc(GetProcessHeap(), 0, prefixCount * sizeof(RouteSetPrefix)) : NULL;
+	RouteOp* ops = set->InstalledCount + prefixCount > 0
+		? (RouteOp*)HeapAlloc(GetProcessHeap(), 0, ((SIZE_T)set->InstalledCount + prefixCount) * sizeof(RouteOp))
+		: NULL;
+	if ((prefixCount > 0 && desired == NULL) || (set->InstalledCount + prefixCount > 0 && ops == NULL))
+	{
+		ReleaseSRWLockExclusive(&set->Lock);
+		if (desired != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, desired);
+		}
+
+		if (ops != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, ops);
+		}
+
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+	UINT desiredCount = SortPrefixes(prefixes, prefixCount, desired, &report->Failed);
+	if (desiredCount == 0 && prefixCount > 0)
+	{
+		result = ERROR_INVALID_PARAMETER;
+	}
+
+	UINT removals = 0;
+	UINT opCount = result == ERROR_SUCCESS ? DiffPrefixes(set->Installed, set->InstalledCount, desired, desiredCount, ops, &removals) : 0;
+	report->Desired = desiredCount;
+	report->DiffUs = ElapsedUs(start, frequency);
+
+	UINT done = 0;
+	for (; result == ERROR_SUCCESS && done < opCount; done++)
+	{
+		RouteOp* op = &ops[done];
+		const RouteSetPrefix* prefix = op->Remove ? &set->Installed[op->Index] : &desired[op->Index];
+		result = op->Remove ? RemoveRoute(set, prefix) : AddRoute(set, prefix, &op->Adopted);
+		if (result != ERROR_SUCCESS)
+		{
+			report->Failed = *prefix;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		UINT adds = opCount - removals;
+		report->Removed = removals;
+		report->Added = adds;
+		report->Unchanged = desiredCount - adds;
+		for (UINT i = removals; i < opCount; i++)
+		{
+			report->Adopted += ops[i].Adopted ? 1 : 0;
+		}
+
+		UpdateInstalledTotal((INT)desiredCount - (INT)set->InstalledCount);
+
+		HeapFree(GetProcessHeap(), 0, set->Installed);
+		set->Installed = desired;
+		set->InstalledCount = desiredCount;
+		desired = NULL;
+	}
+	else if (done > 0)
+	{
+		// done counts the op that failed, which changed nothing
+		RollBack(set, desired, ops, done - 1);
+		report->RolledBack = TRUE;
+		NATIVELOG_ERROR("route set on interface %lu failed to apply and rolled back %u routes: %lu\n", set->InterfaceIndex, done - 1, result);
+	}
+
+	ReleaseSRWLockExclusive(&set->Lock);
+
+	if (desired != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, desired);
+	}
+
+	if (ops != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, ops);
+	}
+
+	report->ApplyUs = ElapsedUs(start, frequency) - report->DiffUs;
+	if (result == ERROR_SUCCESS)
+	{
+		MetricsObserveSince(MetricRouteApplySeconds, timer);
+	}
+
+	return result;
+}
+
+DWORD RouteSetGetInstalled(HROUTESET set, RouteSetPrefix* prefixes, UINT prefixesLength, UINT* count)
+{
+	if (set == NULL || count == NULL || (prefixes == NULL && prefixesLength > 0))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockShared(&set->Lock);
+
+	*count = set->InstalledCount;
+	UINT copied = set->InstalledCount < prefixesLength ? set->InstalledCount : prefixesLength;
+	if (copied > 0)
+	{
+		memcpy(prefixes, set->Installed, copied * sizeof(RouteSetPrefix));
+	}
+
+	ReleaseSRWLockShared(&set->Lock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD RouteSetClose(HROUTESET set, BOOL keepRoutes)
+{
+	if (set == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+	if (!keepRoutes)
+	{
+		// Whatever fails to come out is still installed, keep the set so the caller can retry
+		result = RouteSetApply(set, NULL, 0, NULL);
+		if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+	}
+	else
+	{
+		UpdateInstalledTotal(-(INT)set->InstalledCount);
+	}
+
+	if (set->Installed != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, set->Installed);
+	}
+
+	HeapFree(GetProcessHeap(), 0, set);
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+// /32s out of the benchmarking range from offset on, shuffled so the sort has work to do
+static void FillBenchPrefixes(RouteSetPrefix* prefixes, UINT count, UINT offset, UINT64* random)
+{
+	for (UINT i = 0; i < count; i++)
+	{
+		UINT32 address = htonl(ROUTE_BENCH_BASE + offset + i);
+		ZeroMemory(&prefixes[i], sizeof(RouteSetPrefix));
+		prefixes[i].Family = AF_INET;
+		prefixes[i].PrefixLength = 32;
+		memcpy(prefixes[i].Address, &address, 4);
+	}
+
+	for (UINT i = count; i > 1; i--)
+	{
+		UINT j = (UINT)(NextRandom(random) % i);
+		RouteSetPrefix swap = prefixes[i - 1];
+		prefixes[i - 1] = prefixes[j];
+		prefixes[j] = swap;
+	}
+}
+
+static DOUBLE ElapsedMs(LARGE_INTEGER start, LARGE_INTEGER frequency)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (DOUBLE)(now.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+}
+
+DWORD RouteSetRunBenchmark(UINT routes, ULONG interfaceIndex, RouteSetBenchReport* report)
+{
+	// The churned set takes its 1% from past the end of the original
+	if (report == NULL || routes == 0 || routes + routes / 100 > ROUTE_SET_BENCH_MAX_ROUTES)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(RouteSetBenchReport));
+	report->Routes = routes;
+
+	UINT churn = routes / 100;
+	RouteSetPrefix* original = (RouteSetPrefix*)HeapAlloc(GetProcessHeap(), 0, routes * sizeof(RouteSetPrefix));
+	RouteSetPrefix* churned = (RouteSetPrefix*)HeapAlloc(GetProcessHeap(), 0, routes * sizeof(RouteSetPrefix));
+	RouteSetPrefix* installed = (RouteSetPrefix*)HeapAlloc(GetProcessHeap(), 0, routes * sizeof(RouteSetPrefix));
+	RouteSetPrefix* desired = (RouteSetPrefix*)HeapAlloc(GetProcessHeap(), 0, routes * sizeof(RouteSetPrefix));
+	RouteOp* ops = (RouteOp*)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)routes * 2 * sizeof(RouteOp));
+
+	DWORD result = original == NULL || churned == NULL || installed == NULL || desired == NULL || ops == NULL
+		? ERROR_NOT_ENOUGH_MEMORY
+		: ERROR_SUCCESS;
+
+	if (result == ERROR_SUCCESS)
+	{
+		UINT64 random = ROUTE_BENCH_SEED;
+		FillBenchPrefixes(original, routes, 0, &random);
+
+		// The same range moved along by churn, so churn routes go and as many new ones come in
+		random = ROUTE_BENCH_SEED;
+		FillBenchPrefixes(churned, routes, churn, &random);
+
+		RouteSetPrefix invalid;
+		UINT installedCount = SortPrefixes(original, routes, installed, &invalid);
+
+		LARGE_INTEGER frequency, start;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+
+		for (UINT i = 0; i < ROUTE_BENCH_DIFF_ITERATIONS; i++)
+		{
+			UINT removals;
+			UINT desiredCount = SortPrefixes(churned, routes, desired, &invalid);
+			DiffPrefixes(installed, installedCount, desired, desiredCount, ops, &removals);
+		}
+
+		report->DiffMsMean = ElapsedMs(start, frequency) / ROUTE_BENCH_DIFF_ITERATIONS;
+	}
+
+	if (result == ERROR_SUCCESS && interfaceIndex != 0)
+	{
+		RouteSetOptions options;
+		ZeroMemory(&options, sizeof(options));
+		options.InterfaceIndex = interfaceIndex;
+
+		HROUTESET set;
+		result = RouteSetCreate(&options, &set);
+		if (result == ERROR_SUCCESS)
+		{
+			LARGE_INTEGER frequency, start;
+			QueryPerformanceFrequency(&frequency);
+
+			QueryPerformanceCounter(&start);
+			result = RouteSetApply(set, original, routes, NULL);
+			report->ApplyAllMs = ElapsedMs(start, frequency);
+
+			if (result == ERROR_SUCCESS)
+			{
+				QueryPerformanceCounter(&start);
+				result = RouteSetApply(set, churned, routes, NULL);
+				report->ApplyChurnMs = ElapsedMs(start, frequency);
+			}
+
+			QueryPerformanceCounter(&start);
+			DWORD closed = RouteSetClose(set, FALSE);
+			report->ClearMs = ElapsedMs(start, frequency);
+			result = result != ERROR_SUCCESS ? result : closed;
+		}
+	}
+
+	PVOID buffers[] = { ops, desired, installed, churned, original };
+	for (UINT i = 0; i < ARRAYSIZE(buffers); i++)
+	{
+		if (buffers[i] != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, buffers[i]);
+		}
+	}
+
+	return result;
+}
+#endif
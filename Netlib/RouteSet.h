@@ -0,0 +1,81 @@
+#pragma once
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+#define ROUTE_SET_MAX_ROUTES (1 << 20)
+
+typedef struct _RouteSet* HROUTESET;
+
+// Address in network order, an IPv4 address takes the first 4 bytes. Host bits are ignored.
+typedef struct _RouteSetPrefix
+{
+	ADDRESS_FAMILY Family;
+	UINT8 PrefixLength;
+	BYTE Address[16];
+} RouteSetPrefix;
+
+// Zero fields take the defaults in RouteSet.cpp
+typedef struct _RouteSetOptions
+{
+	// Routes go out this interface: the tunnel adapter for routes forced into the tunnel, the physical adapter
+	// for routes bypassing it
+	ULONG InterfaceIndex;
+	// Gateways for each family, unspecified for on-link routes as on the tunnel adapter
+	IN_ADDR NextHopV4;
+	IN6_ADDR NextHopV6;
+	ULONG Metric;
+	// Takes over routes an earlier process left on the interface with the same next hop, metric and protocol,
+	// so they're diffed against rather than added again or leaked
+	BOOL Adopt;
+} RouteSetOptions;
+
+typedef struct _RouteSetApplyReport
+{
+	// Distinct prefixes asked for, once host bits are cleared and duplicates dropped
+	UINT Desired;
+	UINT Added;
+	UINT Removed;
+	UINT Unchanged;
+	// Added routes that were already in the table, the set owns them from now on
+	UINT Adopted;
+	BOOL RolledBack;
+	// The prefix that failed to add or remove, or didn't validate
+	RouteSetPrefix Failed;
+	DWORD DiffUs;
+	DWORD ApplyUs;
+} RouteSetApplyReport;
+
+extern DWORD RouteSetCreate(const RouteSetOptions* options, HROUTESET* set);
+
+// Makes prefixes the set's routes: works out what changed since the last apply and only removes and adds
+// that, one IP Helper call per route. If a call fails the changes already made are undone, the table is left
+// as the last successful apply left it and the error is returned. report may be NULL.
+extern DWORD RouteSetApply(HROUTESET set, const RouteSetPrefix* prefixes, UINT prefixCount, RouteSetApplyReport* report);
+
+// Copies up to prefixesLength of the installed routes, sorted. count is how many are installed.
+extern DWORD RouteSetGetInstalled(HROUTESET set, RouteSetPrefix* prefixes, UINT prefixesLength, UINT* count);
+
+// Releases the set, removing its routes first unless keepRoutes is set for a later Adopt
+extern DWORD RouteSetClose(HROUTESET set, BOOL keepRoutes);
+
+#ifdef NATIVE_BENCH
+// RouteSetRunBenchmark installs /32s out of 198.18.0.0/15, the RFC 2544 benchmarking range
+#define ROUTE_SET_BENCH_MAX_ROUTES (1 << 17)
+
+typedef struct _RouteSetBenchReport
+{
+	UINT Routes;
+	// Sorting the desired set and merging it against the installed one, with 1% of the routes changed
+	DOUBLE DiffMsMean;
+	// Applying against the kernel, all 0 without an interface
+	DOUBLE ApplyAllMs;
+	DOUBLE ApplyChurnMs;
+	DOUBLE ClearMs;
+} RouteSetBenchReport;
+
+// Times diffing routes /32s against a set differing by 1%. Given an interface it also times installing them
+// all, applying the 1% change and removing them again, which needs an elevated process. Use an interface
+// nothing depends on.
+extern DWORD RouteSetRunBenchmark(UINT routes, ULONG interfaceIndex, RouteSetBenchReport* report);
+#endif
@@ -0,0 +1,712 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdlib.h>
+#include "ServerProbe.h"
+#include "NativeLog.h"
+#include "Helpers.h"
+
+#define PROBE_DEFAULT_ATTEMPTS 3
+#define PROBE_DEFAULT_INTERVAL_MS 250
+#define PROBE_DEFAULT_TIMEOUT_MS 1000
+#define PROBE_DEFAULT_DEADLINE_MS 2500
+#define PROBE_NATT_PORT 4500
+#define PROBE_RECV_BUFFER 2048
+
+// Marks the UDP sockets in the poll set, anything else is a server index with a TCP connect in flight
+#define PROBE_OWNER_UDP 0xFFFFFFFF
+
+// IKE_SA_INIT offering AES-CBC-256 / HMAC-SHA2-256 / DH group 14, enough for a responder to answer
+#define IKE_HEADER_LENGTH 28
+#define IKE_SA_LENGTH 48
+#define IKE_KE_LENGTH 264
+#define IKE_NONCE_LENGTH 36
+#define IKE_SA_INIT_LENGTH (IKE_HEADER_LENGTH + IKE_SA_LENGTH + IKE_KE_LENGTH + IKE_NONCE_LENGTH)
+#define NATT_MARKER_LENGTH 4
+
+typedef struct _ProbeServer
+{
+	SOCKADDR_STORAGE Address;
+	int AddressLength;
+	UINT NextAttempt;
+	ULONGLONG NextSendUs;
+	SOCKET Tcp;
+	UINT TcpAttempt;
+	ULONGLONG TcpTimeoutUs;
+	ULONGLONG TotalRttUs;
+} ProbeServer;
+
+typedef struct _ProbeRun
+{
+	const ServerProbeTarget* Targets;
+	UINT TargetCount;
+	ServerProbeResult* Results;
+	ProbeServer* Servers;
+	// TargetCount * Attempts, indexed by server then attempt
+	ULONGLONG* SentAtUs;
+	BYTE* Answered;
+	UINT Attempts;
+	ULONGLONG IntervalUs;
+	ULONGLONG TimeoutUs;
+	ULONGLONG DeadlineUs;
+	SOCKET Udp4;
+	SOCKET Udp6;
+	UINT32 Salt;
+	// Room for the NAT-T marker in front, plain IKE sends from offset NATT_MARKER_LENGTH
+	BYTE Packet[NATT_MARKER_LENGTH + IKE_SA_INIT_LENGTH];
+	WSAPOLLFD* PollFds;
+	UINT* PollOwners;
+} ProbeRun;
+
+static ULONGLONG NowUs()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+
+	return (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 1000000ULL + (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 1000000ULL / frequency.QuadPart;
+}
+
+static void WriteBE16(BYTE* p, USHORT value)
+{
+	p[0] = (BYTE)(value >> 8);
+	p[1] = (BYTE)value;
+}
+
+static void WriteBE32(BYTE* p, UINT32 value)
+{
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+static UINT32 ReadBE32(const BYTE* p)
+{
+	return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+// Probe key material only has to look plausible, it is never used to finish an exchange
+static void BuildSaInit(BYTE* p, UINT64* random)
+{
+	memset(p, 0, IKE_SA_INIT_LENGTH);
+
+	// Header, the initiator SPI in bytes 0-7 is filled in per probe
+	p[16] = 33;		// next payload: SA
+	p[17] = 0x20;	// version 2.0
+	p[18] = 34;		// IKE_SA_INIT
+	p[19] = 0x08;	// initiator
+	WriteBE32(p + 24, IKE_SA_INIT_LENGTH);
+
+	BYTE* sa = p + IKE_HEADER_LENGTH;
+	sa[0] = 34;		// next payload: KE
+	WriteBE16(sa + 2, IKE_SA_LENGTH);
+
+	BYTE* proposal = sa + 4;
+	WriteBE16(proposal + 2, IKE_SA_LENGTH - 4);
+	proposal[4] = 1;	// proposal number
+	proposal[5] = 1;	// protocol: IKE
+	proposal[7] = 4;	// transforms
+
+	BYTE* transform = proposal + 8;
+	transform[0] = 3;
+	WriteBE16(transform + 2, 12);
+	transform[4] = 1;	// ENCR
+	WriteBE16(transform + 6, 12);	// AES-CBC
+	WriteBE16(transform + 8, 0x800E);	// key length attribute
+	WriteBE16(transform + 10, 256);
+	transform += 12;
+
+	transform[0] = 3;
+	WriteBE16(transform + 2, 8);
+	transform[4] = 2;	// PRF
+	WriteBE16(transform + 6, 5);	// HMAC-SHA2-256
+	transform += 8;
+
+	transform[0] = 3;
+	WriteBE16(transform + 2, 8);
+	transform[4] = 3;	// INTEG
+	WriteBE16(transform + 6, 12);	// HMAC-SHA2-256-128
+	transform += 8;
+
+	WriteBE16(transform + 2, 8);
+	transform[4] = 4;	// D-H
+	WriteBE16(transform + 6, 14);	// 2048-bit MODP
+
+	BYTE* ke = sa + IKE_SA_LENGTH;
+	ke[0] = 40;		// next payload: Nonce
+	WriteBE16(ke + 2, IKE_KE_LENGTH);
+	WriteBE16(ke + 4, 14);
+	for (UINT i = 8; i < IKE_KE_LENGTH; i++)
+	{
+		ke[i] = (BYTE)NextRandom(random);
+	}
+	// Keep the public value below the group prime
+	ke[8] &= 0x7F;
+
+	BYTE* nonce = ke + IKE_KE_LENGTH;
+	WriteBE16(nonce + 2, IKE_NONCE_LENGTH);
+	for (UINT i = 4; i < IKE_NONCE_LENGTH; i++)
+	{
+		nonce[i] = (BYTE)NextRandom(random);
+	}
+}
+
+static DWORD ResolveTarget(const ServerProbeTarget* target, ProbeServer* server)
+{
+	ADDRINFOW hints;
+	ADDRINFOW* addresses = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	// Literals never touch DNS, names fall back to a blocking lookup
+	int rc = GetAddrInfoW(target->Address, NULL, &hints, &addresses);
+	if (rc != 0)
+	{
+		hints.ai_flags = 0;
+		rc = GetAddrInfoW(target->Address, NULL, &hints, &addresses);
+	}
+
+	if (rc != 0)
+	{
+		return (DWORD)rc;
+	}
+
+	memcpy(&server->Address, addresses->ai_addr, addresses->ai_addrlen);
+	server->AddressLength = (int)addresses->ai_addrlen;
+	FreeAddrInfoW(addresses);
+
+	if (server->Address.ss_family == AF_INET)
+	{
+		((SOCKADDR_IN*)&server->Address)->sin_port = htons(target->Port);
+	}
+	else
+	{
+		((SOCKADDR_IN6*)&server->Address)->sin6_port = htons(target->Port);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static BOOL SameAddress(const SOCKADDR_STORAGE* a, const SOCKADDR_STORAGE* b)
+{
+	if (a->ss_family != b->ss_family)
+	{
+		return FALSE;
+	}
+
+	if (a->ss_family == AF_INET)
+	{
+		return memcmp(&((const SOCKADDR_IN*)a)->sin_addr, &((const SOCKADDR_IN*)b)->sin_addr, sizeof(IN_ADDR)) == 0;
+	}
+
+	return memcmp(&((const SOCKADDR_IN6*)a)->sin6_addr, &((const SOCKADDR_IN6*)b)->sin6_addr, sizeof(IN6_ADDR)) == 0;
+}
+
+static SOCKET OpenNonBlocking(int family, int type, int protocol)
+{
+	SOCKET s = socket(family, type, protocol);
+	if (s == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	u_long nonBlocking = 1;
+	if (ioctlsocket(s, FIONBIO, &nonBlocking) != 0)
+	{
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+static void RecordReply(ProbeRun* run, UINT index, UINT attempt, ULONGLONG rttUs)
+{
+	ServerProbeResult* result = &run->Results[index];
+
+	run->Answered[index * run->Attempts + attempt] = TRUE;
+	run->Servers[index].TotalRttUs += rttUs;
+
+	result->Received++;
+	result->RttAvgUs = (DWORD)(run->Servers[index].TotalRttUs / result->Received);
+	if (result->Received == 1 || rttUs < result->RttMinUs)
+	{
+		result->RttMinUs = (DWORD)rttUs;
+	}
+}
+
+static void SendProbe(ProbeRun* run, UINT index, ULONGLONG now)
+{
+	const ServerProbeTarget* target = &run->Targets[index];
+	ProbeServer* server = &run->Servers[index];
+	ServerProbeResult* result = &run->Results[index];
+	UINT attempt = server->NextAttempt++;
+
+	server->NextSendUs = now + run->IntervalUs;
+	run->SentAtUs[index * run->Attempts + attempt] = now;
+
+	if (target->Protocol == ServerProbeTcp)
+	{
+		SOCKET s = OpenNonBlocking(server->Address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+		if (s == INVALID_SOCKET)
+		{
+			result->Error = WSAGetLastError();
+			return;
+		}
+
+		result->Sent++;
+
+		if (connect(s, (SOCKADDR*)&server->Address, server->AddressLength) == 0)
+		{
+			RecordReply(run, index, attempt, NowUs() - now);
+			closesocket(s);
+			return;
+		}
+
+		DWORD error = WSAGetLastError();
+		if (error != WSAEWOULDBLOCK)
+		{
+			result->Error = error;
+			closesocket(s);
+			return;
+		}
+
+		server->Tcp = s;
+		server->TcpAttempt = attempt;
+		server->TcpTimeoutUs = now + run->TimeoutUs;
+		return;
+	}
+
+	SOCKET udp = server->Address.ss_family == AF_INET ? run->Udp4 : run->Udp6;
+	BYTE* packet = run->Packet + NATT_MARKER_LENGTH;
+	int length = IKE_SA_INIT_LENGTH;
+
+	if (target->Port == PROBE_NATT_PORT)
+	{
+		packet = run->Packet;
+		length += NATT_MARKER_LENGTH;
+	}
+
+	// The initiator SPI carries the run salt and which probe this is, replies echo it back
+	WriteBE32(run->Packet + NATT_MARKER_LENGTH, run->Salt);
+	WriteBE32(run->Packet + NATT_MARKER_LENGTH + 4, (index << 8) | attempt);
+
+	if (sendto(udp, (const char*)packet, length, 0, (SOCKADDR*)&server->Address, server->AddressLength) == SOCKET_ERROR)
+	{
+		result->Error = WSAGetLastError();
+		return;
+	}
+
+	result->Sent++;
+}
+
+static void ReceiveReplies(ProbeRun* run, SOCKET udp)
+{
+	BYTE buffer[PROBE_RECV_BUFFER];
+	SOCKADDR_STORAGE from;
+
+	for (;;)
+	{
+		int fromLength = sizeof(from);
+		int length = recvfrom(udp, (char*)buffer, sizeof(buffer), 0, (SOCKADDR*)&from, &fromLength);
+		if (length == SOCKET_ERROR)
+		{
+			// WSAEWOULDBLOCK once drained, ICMP unreachable shows up as WSAECONNRESET and just counts as loss
+			if (WSAGetLastError() == WSAECONNRESET)
+			{
+				continue;
+			}
+			return;
+		}
+
+		ULONGLONG now = NowUs();
+		const BYTE* ike = buffer;
+
+		// NAT-T replies start with the non-ESP marker, the salt always has its top bit set so can't look like one
+		if (length >= NATT_MARKER_LENGTH + IKE_HEADER_LENGTH && ReadBE32(buffer) == 0)
+		{
+			ike += NATT_MARKER_LENGTH;
+			length -= NATT_MARKER_LENGTH;
+		}
+
+		if (length < IKE_HEADER_LENGTH || ReadBE32(ike) != run->Salt)
+		{
+			continue;
+		}
+
+		UINT32 tag = ReadBE32(ike + 4);
+		UINT index = tag >> 8;
+		UINT attempt = tag & 0xFF;
+
+		if (index >= run->TargetCount || attempt >= run->Attempts || !SameAddress(&from, &run->Servers[index].Address))
+		{
+			continue;
+		}
+
+		ULONGLONG sentAt = run->SentAtUs[index * run->Attempts + attempt];
+		if (sentAt == 0 || run->Answered[index * run->Attempts + attempt] || now - sentAt > run->TimeoutUs)
+		{
+			continue;
+		}
+
+		RecordReply(run, index, attempt, now - sentAt);
+	}
+}
+
+static void CompleteTcp(ProbeRun* run, UINT index, SHORT events, ULONGLONG now)
+{
+	ProbeServer* server = &run->Servers[index];
+	int error = 0;
+	int errorLength = sizeof(error);
+
+	// Before Windows 10 2004 WSAPoll never flags a refused connect, those attempts end at their timeout instead
+	getsockopt(server->Tcp, SOL_SOCKET, SO_ERROR, (char*)&error, &errorLength);
+
+	if (error == 0 && (events & POLLWRNORM))
+	{
+		RecordReply(run, index, server->TcpAttempt, now - run->SentAtUs[index * run->Attempts + server->TcpAttempt]);
+	}
+	else
+	{
+		run->Results[index].Error = error != 0 ? (DWORD)error : WSAECONNREFUSED;
+	}
+
+	closesocket(server->Tcp);
+	server->Tcp = INVALID_SOCKET;
+}
+
+// Returns when the oldest unanswered probe still inside its timeout expires, 0 when nothing is outstanding
+static ULONGLONG OutstandingUntil(ProbeRun* run, UINT index, ULONGLONG now)
+{
+	ProbeServer* server = &run->Servers[index];
+
+	for (UINT attempt = 0; attempt < server->NextAttempt; attempt++)
+	{
+		ULONGLONG sentAt = run->SentAtUs[index * run->Attempts + attempt];
+		if (!run->Answered[index * run->Attempts + attempt] && now - sentAt < run->TimeoutUs)
+		{
+			return sentAt + run->TimeoutUs;
+		}
+	}
+
+	return 0;
+}
+
+static DWORD RunLoop(ProbeRun* run)
+{
+	for (;;)
+	{
+		ULONGLONG now = NowUs();
+		if (now >= run->DeadlineUs)
+		{
+			return ERROR_SUCCESS;
+		}
+
+		ULONGLONG wakeUs = run->DeadlineUs;
+		BOOL pending = FALSE;
+		UINT fdCount = 0;
+
+		SOCKET udp[] = { run->Udp4, run->Udp6 };
+		for (UINT i = 0; i < 2; i++)
+		{
+			if (udp[i] != INVALID_SOCKET)
+			{
+				run->PollFds[fdCount].fd = udp[i];
+				run->PollFds[fdCount].events = POLLRDNORM;
+				run->PollFds[fdCount].revents = 0;
+				run->PollOwners[fdCount++] = PROBE_OWNER_UDP;
+			}
+		}
+
+		for (UINT i = 0; i < run->TargetCount; i++)
+		{
+			ProbeServer* server = &run->Servers[i];
+
+			if (server->Tcp != INVALID_SOCKET && now >= server->TcpTimeoutUs)
+			{
+				closesocket(server->Tcp);
+				server->Tcp = INVALID_SOCKET;
+			}
+
+			// TCP runs one connect at a time per server, UDP probes go out on schedule regardless of replies
+			if (server->NextAttempt < run->Attempts && now >= server->NextSendUs && server->Tcp == INVALID_SOCKET)
+			{
+				SendProbe(run, i, now);
+			}
+
+			if (server->NextAttempt < run->Attempts)
+			{
+				pending = TRUE;
+				wakeUs = min(wakeUs, server->NextSendUs);
+			}
+
+			if (server->Tcp != INVALID_SOCKET)
+			{
+				pending = TRUE;
+				wakeUs = min(wakeUs, server->TcpTimeoutUs);
+				run->PollFds[fdCount].fd = server->Tcp;
+				run->PollFds[fdCount].events = POLLWRNORM;
+				run->PollFds[fdCount].revents = 0;
+				run->PollOwners[fdCount++] = i;
+			}
+			else if (run->Targets[i].Protocol == ServerProbeIke)
+			{
+				ULONGLONG expiresUs = OutstandingUntil(run, i, now);
+				if (expiresUs != 0)
+				{
+					pending = TRUE;
+					wakeUs = min(wakeUs, expiresUs);
+				}
+			}
+		}
+
+		if (!pending)
+		{
+			return ERROR_SUCCESS;
+		}
+
+		INT timeoutMs = wakeUs > now ? (INT)((wakeUs - now + 999) / 1000) : 0;
+		int ready = WSAPoll(run->PollFds, fdCount, timeoutMs);
+		if (ready == SOCKET_ERROR)
+		{
+			return WSAGetLastError();
+		}
+
+		if (ready == 0)
+		{
+			continue;
+		}
+
+		now = NowUs();
+		for (UINT i = 0; i < fdCount; i++)
+		{
+			if (run->PollFds[i].revents == 0)
+			{
+				continue;
+			}
+
+			if (run->PollOwners[i] == PROBE_OWNER_UDP)
+			{
+				ReceiveReplies(run, run->PollFds[i].fd);
+			}
+			else
+			{
+				CompleteTcp(run, run->PollOwners[i], run->PollFds[i].revents, now);
+			}
+		}
+	}
+}
+
+typedef struct _ProbeRank
+{
+	UINT Index;
+	BOOL Silent;
+	DWORD LossPermille;
+	DWORD RttAvgUs;
+} ProbeRank;
+
+static int CompareRanks(const void* a, const void* b)
+{
+	const ProbeRank* x = (const ProbeRank*)a;
+	const ProbeRank* y = (const ProbeRank*)b;
+
+	if (x->Silent != y->Silent)
+	{
+		return x->Silent ? 1 : -1;
+	}
+	if (x->LossPermille != y->LossPermille)
+	{
+		return x->LossPermille < y->LossPermille ? -1 : 1;
+	}
+	if (x->RttAvgUs != y->RttAvgUs)
+	{
+		return x->RttAvgUs < y->RttAvgUs ? -1 : 1;
+	}
+	return x->Index < y->Index ? -1 : (x->Index > y->Index ? 1 : 0);
+}
+
+static DWORD RankResults(const ServerProbeResult* results, UINT count, UINT* ranking)
+{
+	ProbeRank* ranks = (ProbeRank*)HeapAlloc(GetProcessHeap(), 0, count * sizeof(ProbeRank));
+	if (ranks == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (UINT i = 0; i < count; i++)
+	{
+		ranks[i].Index = i;
+		ranks[i].Silent = results[i].Received == 0;
+		ranks[i].LossPermille = results[i].Sent > 0 ? (results[i].Sent - results[i].Received) * 1000 / results[i].Sent : 1000;
+		ranks[i].RttAvgUs = results[i].RttAvgUs;
+	}
+
+	qsort(ranks, count, sizeof(ProbeRank), CompareRanks);
+
+	for (UINT i = 0; i < count; i++)
+	{
+		ranking[i] = ranks[i].Index;
+	}
+
+	HeapFree(GetProcessHeap(), 0, ranks);
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD AllocateRun(ProbeRun* run)
+{
+	SIZE_T probes = (SIZE_T)run->TargetCount * run->Attempts;
+
+	run->Servers = (ProbeServer*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, run->TargetCount * sizeof(ProbeServer));
+	run->SentAtUs = (ULONGLONG*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, probes * sizeof(ULONGLONG));
+	run->Answered = (BYTE*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, probes);
+	run->PollFds = (WSAPOLLFD*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (run->TargetCount + 2) * sizeof(WSAPOLLFD));
+	run->PollOwners = (UINT*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (run->TargetCount + 2) * sizeof(UINT));
+
+	if (run->Servers == NULL || run->SentAtUs == NULL || run->Answered == NULL || run->PollFds == NULL || run->PollOwners == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static void FreeRun(ProbeRun* run)
+{
+	if (run->Servers != NULL)
+	{
+		for (UINT i = 0; i < run->TargetCount; i++)
+		{
+			if (run->Servers[i].Tcp != INVALID_SOCKET)
+			{
+				closesocket(run->Servers[i].Tcp);
+			}
+		}
+	}
+
+	if (run->Udp4 != INVALID_SOCKET)
+	{
+		closesocket(run->Udp4);
+	}
+	if (run->Udp6 != INVALID_SOCKET)
+	{
+		closesocket(run->Udp6);
+	}
+
+	LPVOID blocks[] = { run->Servers, run->SentAtUs, run->Answered, run->PollFds, run->PollOwners };
+	for (UINT i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+	{
+		if (blocks[i] != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, blocks[i]);
+		}
+	}
+}
+
+DWORD ServerProbeRun(
+	const ServerProbeTarget* targets,
+	UINT targetCount,
+	const ServerProbeOptions* options,
+	ServerProbeResult* results,
+	UINT* ranking
+)
+{
+	ProbeRun run;
+	WSADATA wsaData;
+
+	if (targets == NULL || results == NULL || ranking == NULL || targetCount == 0 || targetCount > SERVER_PROBE_MAX_TARGETS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(&run, 0, sizeof(run));
+	memset(results, 0, targetCount * sizeof(ServerProbeResult));
+	run.Targets = targets;
+	run.TargetCount = targetCount;
+	run.Results = results;
+	run.Udp4 = INVALID_SOCKET;
+	run.Udp6 = INVALID_SOCKET;
+	run.Attempts = options != NULL && options->Attempts != 0 ? min(options->Attempts, (UINT)SERVER_PROBE_MAX_ATTEMPTS) : PROBE_DEFAULT_ATTEMPTS;
+	run.IntervalUs = (options != NULL && options->IntervalMs != 0 ? options->IntervalMs : PROBE_DEFAULT_INTERVAL_MS) * 1000ULL;
+	run.TimeoutUs = (options != NULL && options->TimeoutMs != 0 ? options->TimeoutMs : PROBE_DEFAULT_TIMEOUT_MS) * 1000ULL;
+
+	DWORD result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	result = AllocateRun(&run);
+
+	if (result == ERROR_SUCCESS)
+	{
+		ULONGLONG start = NowUs();
+		UINT64 random = start ^ ((UINT64)GetCurrentProcessId() << 32) ^ 0x9E3779B97F4A7C15ULL;
+
+		run.Salt = (UINT32)NextRandom(&random) | 0x80000000;
+		BuildSaInit(run.Packet + NATT_MARKER_LENGTH, &random);
+
+		for (UINT i = 0; i < targetCount; i++)
+		{
+			ProbeServer* server = &run.Servers[i];
+			server->Tcp = INVALID_SOCKET;
+
+			results[i].Error = targets[i].Address != NULL ? ResolveTarget(&targets[i], server) : ERROR_INVALID_PARAMETER;
+			if (results[i].Error != ERROR_SUCCESS)
+			{
+				server->NextAttempt = run.Attempts;
+				continue;
+			}
+
+			// Open the shared UDP socket for each family on first use
+			SOCKET* udp = server->Address.ss_family == AF_INET ? &run.Udp4 : &run.Udp6;
+			if (targets[i].Protocol == ServerProbeIke && *udp == INVALID_SOCKET)
+			{
+				*udp = OpenNonBlocking(server->Address.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+				if (*udp == INVALID_SOCKET)
+				{
+					results[i].Error = WSAGetLastError();
+					server->NextAttempt = run.Attempts;
+					continue;
+				}
+			}
+		}
+
+		// Resolving names may have eaten into the budget, the deadline counts from here
+		start = NowUs();
+		run.DeadlineUs = start + (options != NULL && options->DeadlineMs != 0 ? options->DeadlineMs : PROBE_DEFAULT_DEADLINE_MS) * 1000ULL;
+
+		// Spread the first wave over one interval instead of bursting every probe at once
+		for (UINT i = 0; i < targetCount; i++)
+		{
+			run.Servers[i].NextSendUs = start + run.IntervalUs * i / targetCount;
+		}
+
+		result = RunLoop(&run);
+	}
+
+	FreeRun(&run);
+	WSACleanup();
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = RankResults(results, targetCount, ranking);
+	}
+
+	UINT answered = 0;
+	for (UINT i = 0; i < targetCount; i++)
+	{
+		answered += results[i].Received > 0 ? 1 : 0;
+	}
+	NATIVELOG_INFO("probed %u servers, %u answered\n", targetCount, answered);
+
+	return result;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <winsock2.h>
+#include <windows.h>
+
+#define SERVER_PROBE_MAX_TARGETS 4096
+#define SERVER_PROBE_MAX_ATTEMPTS 16
+
+typedef enum _ServerProbeProtocol
+{
+	// IKEv2 IKE_SA_INIT request, any reply quoting our SPI counts. Port 4500 adds the NAT-T non-ESP marker.
+	ServerProbeIke = 0,
+	// Plain TCP connect, for OpenVPN over TCP
+	ServerProbeTcp = 1,
+} ServerProbeProtocol;
+
+typedef struct _ServerProbeTarget
+{
+	LPCWSTR Address;
+	USHORT Port;
+	ServerProbeProtocol Protocol;
+} ServerProbeTarget;
+
+// Zero fields take the defaults in ServerProbe.cpp
+typedef struct _ServerProbeOptions
+{
+	UINT Attempts;
+	DWORD IntervalMs;
+	DWORD TimeoutMs;
+	DWORD DeadlineMs;
+} ServerProbeOptions;
+
+typedef struct _ServerProbeResult
+{
+	DWORD Sent;
+	DWORD Received;
+	DWORD RttMinUs;
+	DWORD RttAvgUs;
+	DWORD Error;
+} ServerProbeResult;
+
+// Probes every target concurrently from one WSAPoll loop and returns once all probes are answered or timed out,
+// or DeadlineMs has passed. ranking receives the target indices best first: fewest lost probes, then lowest
+// average RTT, targets that never answered last.
+extern DWORD ServerProbeRun(
+	const ServerProbeTarget* targets,
+	UINT targetCount,
+	const ServerProbeOptions* options,
+	ServerProbeResult* results,
+	UINT* ranking
+);
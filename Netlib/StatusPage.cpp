@@ -0,0 +1,662 @@
+#include "stdafx.h"
+#include <aclapi.h>
+#include <sddl.h>
+#include <strsafe.h>
+#include "StatusPage.h"
+
+#define STATUS_PAGE_MAGIC 0x54535655	// "UVST"
+// Busy-wait this many rounds on an update in progress before yielding the CPU to the writer
+#define STATUS_PAGE_SPIN_LIMIT 256
+#define STATUS_PAGE_READ_TIMEOUT_MS 200
+#define STATUS_PAGE_BENCH_MAX_READERS 64
+
+// SYSTEM and administrators get full access, any signed in user can map the page for reading
+#define STATUS_PAGE_SDDL L"D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;AU)"
+
+// Layout of the mapping, shared by every process built against the same STATUS_PAGE_VERSION
+typedef struct _StatusPageShared
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 DataSize;
+	volatile LONG WriterPid;
+	// Keeps the sequence on its own cache line
+	BYTE Padding[48];
+	// Odd while the writer is in the middle of an update
+	volatile LONG Sequence;
+	UINT32 Reserved;
+	StatusPageData Data;
+} StatusPageShared;
+
+typedef struct _StatusPage
+{
+	HANDLE Mapping;
+	StatusPageShared* Shared;
+	BOOL Writer;
+	SRWLOCK WriteLock;
+} StatusPage;
+
+static SRWLOCK OwnedLock = SRWLOCK_INIT;
+static StatusPage* OwnedPage = NULL;
+
+static INT64 Now()
+{
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+
+	return ((INT64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+static BOOL ProcessAlive(DWORD processId)
+{
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, processId);
+	if (process == NULL)
+	{
+		// Running under an account we can't open
+		return GetLastError() == ERROR_ACCESS_DENIED;
+	}
+
+	BOOL alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+
+	return alive;
+}
+
+// A section anyone else created could carry whatever status they like, so only pages made by LocalSystem, an
+// administrator or this process's own user are written to or read
+static DWORD CheckOwner(HANDLE mapping)
+{
+	PSID owner = NULL;
+	PSECURITY_DESCRIPTOR descriptor = NULL;
+	HANDLE token = NULL;
+	DWORD_PTR user[(sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE) / sizeof(DWORD_PTR) + 1];
+	DWORD size = 0;
+
+	DWORD result = GetSecurityInfo(mapping, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL, &descriptor);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	if (IsWellKnownSid(owner, WinLocalSystemSid) || IsWellKnownSid(owner, WinBuiltinAdministratorsSid))
+	{
+		result = ERROR_SUCCESS;
+	}
+	else if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token) && GetTokenInformation(token, TokenUser, user, sizeof(user), &size))
+	{
+		result = EqualSid(owner, ((TOKEN_USER*)user)->User.Sid) ? ERROR_SUCCESS : ERROR_ACCESS_DENIED;
+	}
+	else
+	{
+		result = GetLastError();
+	}
+
+	if (token != NULL)
+	{
+		CloseHandle(token);
+	}
+	LocalFree(descriptor);
+
+	return result;
+}
+
+// Takes the writer slot if it's free or its owner has exited, PID reuse can make a dead owner look alive
+static DWORD ClaimWriter(StatusPageShared* shared)
+{
+	LONG self = (LONG)GetCurrentProcessId();
+
+	for (;;)
+	{
+		LONG owner = InterlockedCompareExchange(&shared->WriterPid, self, 0);
+		if (owner == 0)
+		{
+			return ERROR_SUCCESS;
+		}
+
+		if (owner == self || ProcessAlive((DWORD)owner))
+		{
+			return ERROR_BUSY;
+		}
+
+		if (InterlockedCompareExchange(&shared->WriterPid, self, owner) == owner)
+		{
+			return ERROR_SUCCESS;
+		}
+	}
+}
+
+static DWORD ReadSnapshot(StatusPage* page, StatusPageData* data, DWORD* sequence, ULONGLONG* retries)
+{
+	StatusPageShared* shared = page->Shared;
+
+	if (shared->Magic != STATUS_PAGE_MAGIC)
+	{
+		return ERROR_NOT_READY;
+	}
+
+	MemoryBarrier();
+
+	if (shared->Version != STATUS_PAGE_VERSION || shared->DataSize != sizeof(StatusPageData))
+	{
+		return ERROR_REVISION_MISMATCH;
+	}
+
+	ULONGLONG deadline = 0;
+
+	for (UINT spin = 0;; spin++)
+	{
+		LONG start = shared->Sequence;
+		MemoryBarrier();
+
+		if ((start & 1) == 0)
+		{
+			memcpy(data, &shared->Data, sizeof(StatusPageData));
+			MemoryBarrier();
+
+			if (shared->Sequence == start)
+			{
+				if (sequence != NULL)
+				{
+					*sequence = (DWORD)((ULONG)start / 2);
+				}
+				*retries += spin;
+				return ERROR_SUCCESS;
+			}
+		}
+
+		if (spin < STATUS_PAGE_SPIN_LIMIT)
+		{
+			YieldProcessor();
+			continue;
+		}
+
+		// The writer was preempted or died holding the sequence odd
+		if (deadline == 0)
+		{
+			deadline = GetTickCount64() + STATUS_PAGE_READ_TIMEOUT_MS;
+		}
+		else if (GetTickCount64() >= deadline)
+		{
+			*retries += spin;
+			return ERROR_BUSY;
+		}
+		Sleep(0);
+	}
+}
+
+static DWORD BeginUpdate(StatusPage* page)
+{
+	if (page == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (!page->Writer)
+	{
+		return ERROR_ACCESS_DENIED;
+	}
+
+	AcquireSRWLockExclusive(&page->WriteLock);
+	InterlockedIncrement(&page->Shared->Sequence);
+
+	return ERROR_SUCCESS;
+}
+
+static void EndUpdate(StatusPage* page, INT64 now)
+{
+	page->Shared->Data.UpdatedAt = now;
+	InterlockedIncrement(&page->Shared->Sequence);
+	ReleaseSRWLockExclusive(&page->WriteLock);
+}
+
+DWORD StatusPageCreate(LPCWSTR name, HSTATUSPAGE* page)
+{
+	PSECURITY_DESCRIPTOR descriptor = NULL;
+	SECURITY_ATTRIBUTES attributes = { sizeof(SECURITY_ATTRIBUTES), NULL, FALSE };
+
+	if (page == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*page = NULL;
+
+	// Without its descriptor the section would get the creator's default DACL, which readers in other
+	// sessions can't open
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(STATUS_PAGE_SDDL, SDDL_REVISION_1, &descriptor, NULL))
+	{
+		return GetLastError();
+	}
+
+	attributes.lpSecurityDescriptor = descriptor;
+
+	HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, sizeof(StatusPageShared), name != NULL ? name : STATUS_PAGE_DEFAULT_NAME);
+	DWORD result = GetLastError();
+
+	LocalFree(descriptor);
+
+	if (mapping == NULL)
+	{
+		return result;
+	}
+
+	// An existing section keeps the descriptor it was created with, only a trusted creator's is taken over
+	result = result == ERROR_ALREADY_EXISTS ? CheckOwner(mapping) : ERROR_SUCCESS;
+	if (result != ERROR_SUCCESS)
+	{
+		CloseHandle(mapping);
+		return result;
+	}
+
+	StatusPageShared* shared = (StatusPageShared*)MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(StatusPageShared));
+	StatusPage* created = (StatusPage*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(StatusPage));
+
+	if (shared == NULL || created == NULL)
+	{
+		result = shared == NULL ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+	}
+	else
+	{
+		result = ClaimWriter(shared);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		if (shared != NULL)
+		{
+			UnmapViewOfFile(shared);
+		}
+		if (created != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, created);
+		}
+		CloseHandle(mapping);
+		return result;
+	}
+
+	// A page left by a previous owner of the same version keeps its contents, anything else starts over
+	if (shared->Magic != STATUS_PAGE_MAGIC || shared->Version != STATUS_PAGE_VERSION || shared->DataSize != sizeof(StatusPageData))
+	{
+		shared->Magic = 0;
+		MemoryBarrier();
+		memset(&shared->Data, 0, sizeof(StatusPageData));
+		shared->Version = STATUS_PAGE_VERSION;
+		shared->DataSize = sizeof(StatusPageData);
+		MemoryBarrier();
+		shared->Magic = STATUS_PAGE_MAGIC;
+	}
+
+	// The previous owner died halfway through an update
+	if (shared->Sequence & 1)
+	{
+		InterlockedIncrement(&shared->Sequence);
+	}
+
+	created->Mapping = mapping;
+	created->Shared = shared;
+	created->Writer = TRUE;
+	InitializeSRWLock(&created->WriteLock);
+
+	AcquireSRWLockExclusive(&OwnedLock);
+	if (OwnedPage == NULL)
+	{
+		OwnedPage = created;
+	}
+	ReleaseSRWLockExclusive(&OwnedLock);
+
+	*page = created;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD StatusPageOpen(LPCWSTR name, HSTATUSPAGE* page)
+{
+	if (page == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*page = NULL;
+
+	HANDLE mapping = OpenFileMappingW(FILE_MAP_READ | READ_CONTROL, FALSE, name != NULL ? name : STATUS_PAGE_DEFAULT_NAME);
+	if (mapping == NULL)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = CheckOwner(mapping);
+	if (result != ERROR_SUCCESS)
+	{
+		CloseHandle(mapping);
+		return result;
+	}
+
+	// The whole section is mapped, its header says whether the layout is one we understand
+	StatusPageShared* shared = (StatusPageShared*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	StatusPage* opened = (StatusPage*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(StatusPage));
+
+	if (shared == NULL || opened == NULL)
+	{
+		result = shared == NULL ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+
+		if (shared != NULL)
+		{
+			UnmapViewOfFile(shared);
+		}
+		if (opened != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, opened);
+		}
+		CloseHandle(mapping);
+		return result;
+	}
+
+	opened->Mapping = mapping;
+	opened->Shared = shared;
+	InitializeSRWLock(&opened->WriteLock);
+
+	*page = opened;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD StatusPageRead(HSTATUSPAGE page, StatusPageData* data, DWORD* sequence)
+{
+	ULONGLONG retries = 0;
+
+	if (page == NULL || data == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return ReadSnapshot(page, data, sequence, &retries);
+}
+
+DWORD StatusPageSetKillswitch(HSTATUSPAGE page, BOOL engaged)
+{
+	DWORD result = BeginUpdate(page);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	INT64 now = Now();
+	StatusPageData* data = &page->Shared->Data;
+
+	data->KillswitchEngaged = engaged ? 1 : 0;
+	data->PolicyGeneration++;
+	data->KillswitchChangedAt = now;
+
+	EndUpdate(page, now);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD StatusPageSetConnection(HSTATUSPAGE page, const VpnDeviceStats* stats)
+{
+	if (stats == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DWORD result = BeginUpdate(page);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	INT64 now = Now();
+	StatusPageData* data = &page->Shared->Data;
+
+	if (data->ConnectionStatus != stats->Status)
+	{
+		data->ConnectionStatus = stats->Status;
+		data->ConnectionChangedAt = now;
+	}
+
+	data->BytesTransmitted = stats->BytesTransmitted;
+	data->BytesReceived = stats->BytesReceived;
+	data->Bps = stats->Bps;
+	data->ConnectDuration = stats->ConnectDuration;
+	StringCchCopyW(data->Hostname, STATUS_PAGE_HOSTNAME_LENGTH, stats->Hostname != NULL ? stats->Hostname : L"");
+
+	EndUpdate(page, now);
+
+	return ERROR_SUCCESS;
+}
+
+void StatusPageNotifyKillswitch(BOOL engaged)
+{
+	AcquireSRWLockShared(&OwnedLock);
+	if (OwnedPage != NULL)
+	{
+		StatusPageSetKillswitch(OwnedPage, engaged);
+	}
+	ReleaseSRWLockShared(&OwnedLock);
+}
+
+void StatusPageNotifyConnection(const VpnDeviceStats* stats)
+{
+	AcquireSRWLockShared(&OwnedLock);
+	if (OwnedPage != NULL)
+	{
+		StatusPageSetConnection(OwnedPage, stats);
+	}
+	ReleaseSRWLockShared(&OwnedLock);
+}
+
+DWORD StatusPageClose(HSTATUSPAGE page)
+{
+	if (page == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&OwnedLock);
+	if (OwnedPage == page)
+	{
+		OwnedPage = NULL;
+	}
+	ReleaseSRWLockExclusive(&OwnedLock);
+
+	// The contents stay for readers until the last handle to the mapping goes away
+	if (page->Writer)
+	{
+		InterlockedCompareExchange(&page->Shared->WriterPid, 0, (LONG)GetCurrentProcessId());
+	}
+
+	UnmapViewOfFile(page->Shared);
+	CloseHandle(page->Mapping);
+	HeapFree(GetProcessHeap(), 0, page);
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+typedef struct _StatusBench
+{
+	HSTATUSPAGE Writer;
+	volatile LONG Stop;
+	ULONGLONG Writes;
+	ULONGLONG WriteTicks;
+} StatusBench;
+
+typedef struct _StatusBenchReader
+{
+	StatusBench* Bench;
+	HSTATUSPAGE Page;
+	ULONGLONG Reads;
+	ULONGLONG Retries;
+	ULONGLONG TornReads;
+	ULONGLONG ReadTicks;
+} StatusBenchReader;
+
+// Every field the writer publishes is derived from one counter, so a mixed snapshot can't pass
+static void BenchStats(INT64 generation, VpnDeviceStats* stats)
+{
+	stats->Status = (INT)(generation & 1);
+	stats->BytesTransmitted = generation;
+	stats->BytesReceived = generation * 3;
+	stats->Bps = generation ^ 0x5A5A5A5A;
+	stats->ConnectDuration = generation + 7;
+	stats->Hostname = NULL;
+}
+
+static ULONGLONG Ticks()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+
+	return (ULONGLONG)counter.QuadPart;
+}
+
+static DWORD WINAPI BenchWriter(LPVOID parameter)
+{
+	StatusBench* bench = (StatusBench*)parameter;
+	VpnDeviceStats stats;
+	ULONGLONG start = Ticks();
+	INT64 generation = 0;
+
+	while (!bench->Stop)
+	{
+		BenchStats(++generation, &stats);
+		StatusPageSetConnection(bench->Writer, &stats);
+	}
+
+	bench->WriteTicks = Ticks() - start;
+	bench->Writes = (ULONGLONG)generation;
+
+	return 0;
+}
+
+static DWORD WINAPI BenchReader(LPVOID parameter)
+{
+	StatusBenchReader* reader = (StatusBenchReader*)parameter;
+	StatusPageData data;
+	VpnDeviceStats expected;
+	INT64 last = 0;
+	ULONGLONG start = Ticks();
+
+	while (!reader->Bench->Stop)
+	{
+		if (ReadSnapshot(reader->Page, &data, NULL, &reader->Retries) != ERROR_SUCCESS)
+		{
+			continue;
+		}
+
+		reader->Reads++;
+
+		BenchStats(data.BytesTransmitted, &expected);
+		if (data.BytesTransmitted < last || data.ConnectionStatus != expected.Status || data.BytesReceived != expected.BytesReceived
+			|| data.Bps != expected.Bps || data.ConnectDuration != expected.ConnectDuration)
+		{
+			reader->TornReads++;
+		}
+		last = data.BytesTransmitted;
+	}
+
+	reader->ReadTicks = Ticks() - start;
+
+	return 0;
+}
+
+DWORD StatusPageRunBenchmark(UINT readers, DWORD durationMs, StatusPageBenchReport* report)
+{
+	StatusBench bench;
+	StatusBenchReader benchReaders[STATUS_PAGE_BENCH_MAX_READERS];
+	HANDLE threads[STATUS_PAGE_BENCH_MAX_READERS + 1];
+	WCHAR name[64];
+	LARGE_INTEGER frequency;
+	UINT started = 0;
+
+	if (report == NULL || readers == 0 || readers > STATUS_PAGE_BENCH_MAX_READERS || durationMs == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(report, 0, sizeof(StatusPageBenchReport));
+	memset(&bench, 0, sizeof(bench));
+	memset(benchReaders, 0, sizeof(benchReaders));
+	QueryPerformanceFrequency(&frequency);
+
+	// A private page, the benchmark never touches the one this process publishes to
+	StringCchPrintfW(name, 64, L"Local\\UtilizrStatusBench-%lu", GetCurrentProcessId());
+
+	DWORD result = StatusPageCreate(name, &bench.Writer);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	AcquireSRWLockExclusive(&OwnedLock);
+	if (OwnedPage == bench.Writer)
+	{
+		OwnedPage = NULL;
+	}
+	ReleaseSRWLockExclusive(&OwnedLock);
+
+	for (UINT i = 0; i < readers && result == ERROR_SUCCESS; i++)
+	{
+		benchReaders[i].Bench = &bench;
+		result = StatusPageOpen(name, &benchReaders[i].Page);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		threads[started] = CreateThread(NULL, 0, BenchWriter, &bench, 0, NULL);
+		started += threads[started] != NULL ? 1 : 0;
+
+		for (UINT i = 0; i < readers && started == i + 1; i++)
+		{
+			threads[started] = CreateThread(NULL, 0, BenchReader, &benchReaders[i], 0, NULL);
+			started += threads[started] != NULL ? 1 : 0;
+		}
+
+		if (started == readers + 1)
+		{
+			Sleep(durationMs);
+		}
+		else
+		{
+			result = GetLastError();
+		}
+
+		InterlockedExchange(&bench.Stop, TRUE);
+		for (UINT i = 0; i < started; i++)
+		{
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		DOUBLE readNs = 0;
+
+		report->Readers = readers;
+		report->Writes = bench.Writes;
+		report->WriteNsMean = bench.Writes > 0 ? (DOUBLE)bench.WriteTicks * 1e9 / frequency.QuadPart / bench.Writes : 0;
+
+		for (UINT i = 0; i < readers; i++)
+		{
+			report->Reads += benchReaders[i].Reads;
+			report->Retries += benchReaders[i].Retries;
+			report->TornReads += benchReaders[i].TornReads;
+			readNs += (DOUBLE)benchReaders[i].ReadTicks * 1e9 / frequency.QuadPart;
+		}
+
+		report->ReadNsMean = report->Reads > 0 ? readNs / report->Reads : 0;
+	}
+
+	for (UINT i = 0; i < readers; i++)
+	{
+		if (benchReaders[i].Page != NULL)
+		{
+			StatusPageClose(benchReaders[i].Page);
+		}
+	}
+	StatusPageClose(bench.Writer);
+
+	return result;
+}
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+#include <windows.h>
+
+#define STATUS_PAGE_VERSION 1
+// Seen from every session, so desktop processes can read what the service in session 0 publishes. Creating a
+// Global\ page takes SeCreateGlobalPrivilege, which services and administrators have, otherwise pass a Local\ name.
+#define STATUS_PAGE_DEFAULT_NAME L"Global\\UtilizrVpnStatus"
+#define STATUS_PAGE_HOSTNAME_LENGTH 256
+
+typedef struct _StatusPage* HSTATUSPAGE;
+
+// Everything a reader gets from one consistent snapshot. Timestamps are UTC FILETIME ticks.
+typedef struct _StatusPageData
+{
+	UINT32 KillswitchEngaged;
+	// Bumped on every engage and disengage, lets readers spot a policy change they missed
+	UINT32 PolicyGeneration;
+	// VpnDeviceStats.Status of the last published statistics
+	INT32 ConnectionStatus;
+	UINT32 Reserved;
+	INT64 BytesTransmitted;
+	INT64 BytesReceived;
+	INT64 Bps;
+	INT64 ConnectDuration;
+	INT64 UpdatedAt;
+	INT64 KillswitchChangedAt;
+	INT64 ConnectionChangedAt;
+	WCHAR Hostname[STATUS_PAGE_HOSTNAME_LENGTH];
+} StatusPageData;
+
+// Creates or takes over the named page as its only writer. ERROR_BUSY when another live process owns it. A page
+// that already exists is only taken over when LocalSystem, an administrator or this process's user created it,
+// ERROR_ACCESS_DENIED otherwise.
+// Once created, this process's KillswitchEngage2 / KillswitchDisengage / GetIkevVpnStatistics calls publish
+// to it automatically.
+extern DWORD StatusPageCreate(LPCWSTR name, HSTATUSPAGE* page);
+
+// Opens the named page read only, ERROR_FILE_NOT_FOUND until a writer has created it. ERROR_ACCESS_DENIED when
+// someone other than LocalSystem, an administrator or this process's user created it.
+extern DWORD StatusPageOpen(LPCWSTR name, HSTATUSPAGE* page);
+
+// Copies a consistent snapshot without taking any lock. sequence, if given, receives the number of updates
+// published so far. ERROR_BUSY means the writer died mid-update and nothing consistent could be read.
+extern DWORD StatusPageRead(HSTATUSPAGE page, StatusPageData* data, DWORD* sequence);
+
+extern DWORD StatusPageSetKillswitch(HSTATUSPAGE page, BOOL engaged);
+extern DWORD StatusPageSetConnection(HSTATUSPAGE page, const VpnDeviceStats* stats);
+
+// Publish to the page this process created, if any, and do nothing otherwise
+extern void StatusPageNotifyKillswitch(BOOL engaged);
+extern void StatusPageNotifyConnection(const VpnDeviceStats* stats);
+
+extern DWORD StatusPageClose(HSTATUSPAGE page);
+
+#ifdef NATIVE_BENCH
+typedef struct _StatusPageBenchReport
+{
+	DWORD Readers;
+	ULONGLONG Reads;
+	ULONGLONG Writes;
+	// Reads that had to go round again because an update was in progress
+	ULONGLONG Retries;
+	// Snapshots that mixed two updates, anything but 0 is a bug
+	ULONGLONG TornReads;
+	DOUBLE ReadNsMean;
+	DOUBLE WriteNsMean;
+} StatusPageBenchReport;
+
+// One writer publishes back to back while reader threads, each with their own view of a private page,
+// read and check every snapshot for durationMs
+extern DWORD StatusPageRunBenchmark(UINT readers, DWORD durationMs, StatusPageBenchReport* report);
+#endif
@@ -0,0 +1,767 @@
+#include "stdafx.h"
+#include <strsafe.h>
+#include "Supervisor.h"
+#include "NativeLog.h"
+
+#define SUPERVISOR_DEFAULT_MAX_RESTARTS 5
+#define SUPERVISOR_DEFAULT_RESTART_DELAY_MS 1000
+#define SUPERVISOR_DEFAULT_MAX_RESTART_DELAY_MS 30000
+#define SUPERVISOR_DEFAULT_STABLE_MS 60000
+#define SUPERVISOR_DEFAULT_READY_TIMEOUT_MS 10000
+#define SUPERVISOR_DEFAULT_STOP_TIMEOUT_MS 10000
+// A few events can be raised by one wake, they're all delivered before the next wait
+#define SUPERVISOR_QUEUE 16
+#define SUPERVISOR_NO_DEADLINE MAXULONGLONG
+#define SUPERVISOR_BENCH_READY_MS 10000
+
+typedef enum _SupervisorState
+{
+	// No process, waiting for nothing
+	SupervisorIdle = 0,
+	// Process created, waiting for it to connect
+	SupervisorStarting,
+	SupervisorRunning,
+	// Waiting out the restart delay
+	SupervisorBackoff,
+	// Process asked to exit, waiting for it to
+	SupervisorStopping,
+} SupervisorState;
+
+typedef struct _Supervisor
+{
+	LPWSTR ImagePath;
+	LPWSTR Arguments;
+	LPWSTR WorkingDirectory;
+	LPWSTR PasswordFile;
+	SupervisorRestart Restart;
+	UINT MaxRestarts;
+	DWORD RestartDelayMs;
+	DWORD MaxRestartDelayMs;
+	ULONGLONG StableUs;
+	ULONGLONG ReadyTimeoutUs;
+	ULONGLONG StopTimeoutUs;
+	SIZE_T ProcessMemoryLimit;
+	DWORD CpuRatePercent;
+	SupervisorCallback Callback;
+	PVOID Context;
+	HMGMTTRANSPORT Transport;
+	USHORT Port;
+	// Auto reset, set by the transport on every connection
+	HANDLE ConnectEvent;
+	// Auto reset, set by SupervisorStop
+	HANDLE WakeEvent;
+	// The process's --service event, NULL when it's asked to exit over the management channel
+	HANDLE ExitEvent;
+	HANDLE Thread;
+	volatile LONG StopRequested;
+	// Everything below belongs to the supervisor thread
+	SupervisorState State;
+	HANDLE Job;
+	HANDLE Process;
+	DWORD ProcessId;
+	UINT Attempt;
+	UINT RestartsInRow;
+	ULONGLONG SpawnedUs;
+	ULONGLONG ReadyUs;
+	ULONGLONG DeadlineUs;
+	BOOL Finished;
+	SupervisorEvent Queue[SUPERVISOR_QUEUE];
+	UINT QueueHead;
+	UINT QueueCount;
+} Supervisor;
+
+static ULONGLONG NowUs()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+
+	return (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 1000000ULL + (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 1000000ULL / frequency.QuadPart;
+}
+
+static LPWSTR CopyString(LPCWSTR value, DWORD* result)
+{
+	SIZE_T length = 0;
+
+	if (value == NULL)
+	{
+		return NULL;
+	}
+
+	if (FAILED(StringCchLengthW(value, SUPERVISOR_MAX_COMMAND_LINE, &length)))
+	{
+		*result = ERROR_FILENAME_EXCED_RANGE;
+		return NULL;
+	}
+
+	LPWSTR copy = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, (length + 1) * sizeof(WCHAR));
+	if (copy == NULL)
+	{
+		*result = ERROR_NOT_ENOUGH_MEMORY;
+		return NULL;
+	}
+
+	memcpy(copy, value, (length + 1) * sizeof(WCHAR));
+	return copy;
+}
+
+static void FreeString(LPWSTR value)
+{
+	if (value != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, value);
+	}
+}
+
+// Events are raised while the state is changing and delivered once it's settled, at the top of the loop
+static void Post(Supervisor* supervisor, SupervisorEventType type, DWORD exitCode, DWORD result, DWORD delayMs, ULONGLONG elapsedUs)
+{
+	if (supervisor->QueueCount == SUPERVISOR_QUEUE)
+	{
+		NATIVELOG_WARNING("supervisor event queue full, dropped event %d\n", type);
+		return;
+	}
+
+	SupervisorEvent* event = &supervisor->Queue[(supervisor->QueueHead + supervisor->QueueCount++) % SUPERVISOR_QUEUE];
+	event->Type = (UINT16)type;
+	event->Reserved = 0;
+	event->ProcessId = supervisor->ProcessId;
+	event->Attempt = supervisor->Attempt;
+	event->ExitCode = exitCode;
+	event->Result = result;
+	event->DelayMs = delayMs;
+	event->ElapsedUs = elapsedUs;
+}
+
+static void Dispatch(Supervisor* supervisor)
+{
+	while (supervisor->QueueCount > 0)
+	{
+		SupervisorEvent event = supervisor->Queue[supervisor->QueueHead];
+		supervisor->QueueHead = (supervisor->QueueHead + 1) % SUPERVISOR_QUEUE;
+		supervisor->QueueCount--;
+
+		if (supervisor->Callback != NULL)
+		{
+			supervisor->Callback(supervisor, &event, supervisor->Context);
+		}
+	}
+}
+
+static DWORD CreateJob(Supervisor* supervisor, HANDLE* job)
+{
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+	DWORD result = ERROR_SUCCESS;
+
+	HANDLE created = CreateJobObjectW(NULL, NULL);
+	if (created == NULL)
+	{
+		return GetLastError();
+	}
+
+	// Closing the job, as the supervisor does after every exit and Windows does if this process dies, takes
+	// down whatever is left in it. No error dialog holds a crashed process up.
+	ZeroMemory(&limits, sizeof(limits));
+	limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | JOB_OBJECT_LIMIT_DIE_ON_UNHANDLED_EXCEPTION;
+	if (supervisor->ProcessMemoryLimit != 0)
+	{
+		limits.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+		limits.ProcessMemoryLimit = supervisor->ProcessMemoryLimit;
+	}
+
+	if (!SetInformationJobObject(created, JobObjectExtendedLimitInformation, &limits, sizeof(limits)))
+	{
+		result = GetLastError();
+	}
+
+	if (result == ERROR_SUCCESS && supervisor->CpuRatePercent != 0)
+	{
+		JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuRate;
+
+		ZeroMemory(&cpuRate, sizeof(cpuRate));
+		cpuRate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+		cpuRate.CpuRate = supervisor->CpuRatePercent * 100;
+
+		if (!SetInformationJobObject(created, JobObjectCpuRateControlInformation, &cpuRate, sizeof(cpuRate)))
+		{
+			result = GetLastError();
+		}
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		CloseHandle(created);
+		return result;
+	}
+
+	*job = created;
+	return ERROR_SUCCESS;
+}
+
+static DWORD Spawn(Supervisor* supervisor)
+{
+	STARTUPINFOW startupInfo;
+	PROCESS_INFORMATION processInfo;
+	HANDLE job = NULL;
+	DWORD result;
+
+	LPWSTR commandLine = (LPWSTR)HeapAlloc(GetProcessHeap(), 0, (SUPERVISOR_MAX_COMMAND_LINE + 1) * sizeof(WCHAR));
+	if (commandLine == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	HRESULT hr = supervisor->PasswordFile != NULL
+		? StringCchPrintfW(commandLine, SUPERVISOR_MAX_COMMAND_LINE + 1, L"\"%s\" %s --management 127.0.0.1 %u \"%s\" --management-client",
+			supervisor->ImagePath, supervisor->Arguments != NULL ? supervisor->Arguments : L"", supervisor->Port, supervisor->PasswordFile)
+		: StringCchPrintfW(commandLine, SUPERVISOR_MAX_COMMAND_LINE + 1, L"\"%s\" %s --management 127.0.0.1 %u --management-client",
+			supervisor->ImagePath, supervisor->Arguments != NULL ? supervisor->Arguments : L"", supervisor->Port);
+	if (FAILED(hr))
+	{
+		HeapFree(GetProcessHeap(), 0, commandLine);
+		return ERROR_FILENAME_EXCED_RANGE;
+	}
+
+	result = CreateJob(supervisor, &job);
+	if (result != ERROR_SUCCESS)
+	{
+		HeapFree(GetProcessHeap(), 0, commandLine);
+		return result;
+	}
+
+	// Left over from the last process, neither may be taken for this one's
+	ResetEvent(supervisor->ConnectEvent);
+	if (supervisor->ExitEvent != NULL)
+	{
+		ResetEvent(supervisor->ExitEvent);
+	}
+
+	ZeroMemory(&startupInfo, sizeof(startupInfo));
+	startupInfo.cb = sizeof(startupInfo);
+	ZeroMemory(&processInfo, sizeof(processInfo));
+
+	// Suspended until it's in the job and the transport knows to expect it. Nothing is inherited, least of all
+	// the listening socket.
+	ULONGLONG spawnedUs = NowUs();
+	if (!CreateProcessW(NULL, commandLine, NULL, NULL, FALSE, CREATE_SUSPENDED | CREATE_NO_WINDOW, NULL, supervisor->WorkingDirectory, &startupInfo, &processInfo))
+	{
+		result = GetLastError();
+	}
+	else if (!AssignProcessToJobObject(job, processInfo.hProcess))
+	{
+		result = GetLastError();
+		TerminateProcess(processInfo.hProcess, result);
+		CloseHandle(processInfo.hThread);
+		CloseHandle(processInfo.hProcess);
+	}
+
+	HeapFree(GetProcessHeap(), 0, commandLine);
+
+	if (result != ERROR_SUCCESS)
+	{
+		CloseHandle(job);
+		NATIVELOG_ERROR("supervisor could not start %S: %lu\n", supervisor->ImagePath, result);
+		return result;
+	}
+
+	ManagementTransportSetClientProcess(supervisor->Transport, processInfo.dwProcessId);
+	ResumeThread(processInfo.hThread);
+	CloseHandle(processInfo.hThread);
+
+	supervisor->Job = job;
+	supervisor->Process = processInfo.hProcess;
+	supervisor->ProcessId = processInfo.dwProcessId;
+	supervisor->Attempt++;
+	supervisor->SpawnedUs = spawnedUs;
+	supervisor->ReadyUs = 0;
+	supervisor->State = SupervisorStarting;
+	supervisor->DeadlineUs = spawnedUs + supervisor->ReadyTimeoutUs;
+
+	NATIVELOG_INFO("supervisor started process %lu, attempt %u\n", processInfo.dwProcessId, supervisor->Attempt);
+	Post(supervisor, SupervisorStarted, 0, ERROR_SUCCESS, 0, 0);
+
+	return ERROR_SUCCESS;
+}
+
+static void Finish(Supervisor* supervisor, DWORD result)
+{
+	supervisor->State = SupervisorIdle;
+	supervisor->DeadlineUs = SUPERVISOR_NO_DEADLINE;
+	supervisor->Finished = TRUE;
+	Post(supervisor, SupervisorStopped, 0, result, 0, 0);
+}
+
+static void OnExit(Supervisor* supervisor, ULONGLONG now)
+{
+	DWORD exitCode = 0;
+
+	if (!GetExitCodeProcess(supervisor->Process, &exitCode))
+	{
+		exitCode = GetLastError();
+	}
+
+	// Scripts it started go with the job
+	CloseHandle(supervisor->Process);
+	CloseHandle(supervisor->Job);
+	supervisor->Process = NULL;
+	supervisor->Job = NULL;
+
+	BOOL stable = supervisor->ReadyUs != 0 && now - supervisor->ReadyUs >= supervisor->StableUs;
+	BOOL requested = supervisor->State == SupervisorStopping;
+
+	NATIVELOG_INFO("supervised process %lu exited with %lu\n", supervisor->ProcessId, exitCode);
+	Post(supervisor, SupervisorExited, exitCode, ERROR_SUCCESS, 0, now - supervisor->SpawnedUs);
+
+	if (requested || supervisor->StopRequested)
+	{
+		Finish(supervisor, ERROR_SUCCESS);
+		return;
+	}
+
+	BOOL restart = supervisor->Restart == SupervisorRestartAlways || (supervisor->Restart == SupervisorRestartOnFailure && exitCode != 0);
+	if (!restart)
+	{
+		Finish(supervisor, exitCode == 0 ? ERROR_SUCCESS : ERROR_PROCESS_ABORTED);
+		return;
+	}
+
+	if (stable)
+	{
+		supervisor->RestartsInRow = 0;
+	}
+
+	if (supervisor->RestartsInRow >= supervisor->MaxRestarts)
+	{
+		NATIVELOG_ERROR("supervisor giving up after %u restarts in a row\n", supervisor->RestartsInRow);
+		Finish(supervisor, ERROR_PROCESS_ABORTED);
+		return;
+	}
+
+	ULONGLONG delayMs = supervisor->RestartDelayMs;
+	for (UINT i = 0; i < supervisor->RestartsInRow && delayMs < supervisor->MaxRestartDelayMs; i++)
+	{
+		delayMs *= 2;
+	}
+	delayMs = min(delayMs, (ULONGLONG)supervisor->MaxRestartDelayMs);
+
+	supervisor->RestartsInRow++;
+	supervisor->State = SupervisorBackoff;
+	supervisor->DeadlineUs = now + delayMs * 1000;
+	Post(supervisor, SupervisorRestarting, 0, ERROR_SUCCESS, (DWORD)delayMs, 0);
+}
+
+static void OnReady(Supervisor* supervisor, ULONGLONG now)
+{
+	supervisor->State = SupervisorRunning;
+	supervisor->ReadyUs = now;
+	supervisor->DeadlineUs = SUPERVISOR_NO_DEADLINE;
+	Post(supervisor, SupervisorReady, 0, ERROR_SUCCESS, 0, now - supervisor->SpawnedUs);
+}
+
+static void BeginStop(Supervisor* supervisor, ULONGLONG now)
+{
+	if (supervisor->Process == NULL)
+	{
+		Finish(supervisor, ERROR_SUCCESS);
+		return;
+	}
+
+	// A process that never connects can't be asked over the channel, it's killed at the deadline
+	if (supervisor->ExitEvent != NULL)
+	{
+		SetEvent(supervisor->ExitEvent);
+	}
+	else
+	{
+		ManagementTransportSend(supervisor->Transport, "signal SIGTERM", MgmtReplySingle, NULL);
+	}
+
+	supervisor->State = SupervisorStopping;
+	supervisor->DeadlineUs = now + supervisor->StopTimeoutUs;
+}
+
+static void OnDeadline(Supervisor* supervisor)
+{
+	DWORD result;
+
+	switch (supervisor->State)
+	{
+	case SupervisorStarting:
+	case SupervisorStopping:
+		NATIVELOG_WARNING("supervised process %lu didn't %s in time, killing it\n", supervisor->ProcessId, supervisor->State == SupervisorStarting ? "get ready" : "exit");
+		TerminateJobObject(supervisor->Job, ERROR_TIMEOUT);
+		// The exit is handled when the process handle is signalled
+		supervisor->DeadlineUs = SUPERVISOR_NO_DEADLINE;
+		break;
+	case SupervisorBackoff:
+		result = Spawn(supervisor);
+		if (result != ERROR_SUCCESS)
+		{
+			Finish(supervisor, result);
+		}
+		break;
+	default:
+		supervisor->DeadlineUs = SUPERVISOR_NO_DEADLINE;
+		break;
+	}
+}
+
+static DWORD WINAPI SupervisorThreadFunc(LPVOID parameter)
+{
+	Supervisor* supervisor = (Supervisor*)parameter;
+	HANDLE handles[3];
+
+	for (;;)
+	{
+		Dispatch(supervisor);
+
+		if (supervisor->Finished)
+		{
+			break;
+		}
+
+		ULONGLONG now = NowUs();
+
+		if (supervisor->StopRequested && supervisor->State != SupervisorStopping)
+		{
+			BeginStop(supervisor, now);
+			continue;
+		}
+
+		DWORD count = 0;
+		DWORD processIndex = MAXDWORD;
+		DWORD connectIndex = MAXDWORD;
+
+		if (supervisor->Process != NULL)
+		{
+			processIndex = count;
+			handles[count++] = supervisor->Process;
+		}
+
+		if (supervisor->State == SupervisorStarting)
+		{
+			connectIndex = count;
+			handles[count++] = supervisor->ConnectEvent;
+		}
+
+		handles[count++] = supervisor->WakeEvent;
+
+		DWORD timeoutMs = INFINITE;
+		if (supervisor->DeadlineUs != SUPERVISOR_NO_DEADLINE)
+		{
+			timeoutMs = supervisor->DeadlineUs > now ? (DWORD)min((supervisor->DeadlineUs - now + 999) / 1000, (ULONGLONG)INFINITE - 1) : 0;
+		}
+
+		DWORD wait = WaitForMultipleObjects(count, handles, FALSE, timeoutMs);
+		now = NowUs();
+
+		if (wait == WAIT_FAILED)
+		{
+			NATIVELOG_WARNING("WaitForMultipleObjects failed in the supervisor: %lu\n", GetLastError());
+			Sleep(100);
+		}
+		else if (wait == WAIT_OBJECT_0 + processIndex)
+		{
+			OnExit(supervisor, now);
+		}
+		else if (wait == WAIT_OBJECT_0 + connectIndex)
+		{
+			OnReady(supervisor, now);
+		}
+		else if (supervisor->DeadlineUs != SUPERVISOR_NO_DEADLINE && now >= supervisor->DeadlineUs)
+		{
+			OnDeadline(supervisor);
+		}
+	}
+
+	return 0;
+}
+
+static void Destroy(Supervisor* supervisor)
+{
+	if (supervisor->Transport != NULL)
+	{
+		ManagementTransportClose(supervisor->Transport);
+	}
+
+	if (supervisor->Process != NULL)
+	{
+		CloseHandle(supervisor->Process);
+	}
+
+	// Kills whatever is still running in it
+	if (supervisor->Job != NULL)
+	{
+		CloseHandle(supervisor->Job);
+	}
+
+	if (supervisor->ExitEvent != NULL)
+	{
+		CloseHandle(supervisor->ExitEvent);
+	}
+
+	if (supervisor->WakeEvent != NULL)
+	{
+		CloseHandle(supervisor->WakeEvent);
+	}
+
+	if (supervisor->ConnectEvent != NULL)
+	{
+		CloseHandle(supervisor->ConnectEvent);
+	}
+
+	FreeString(supervisor->ImagePath);
+	FreeString(supervisor->Arguments);
+	FreeString(supervisor->WorkingDirectory);
+	FreeString(supervisor->PasswordFile);
+	HeapFree(GetProcessHeap(), 0, supervisor);
+}
+
+DWORD SupervisorStart(const SupervisorOptions* options, SupervisorCallback callback, PVOID context, HSUPERVISOR* supervisor)
+{
+	MgmtTransportOptions management;
+	DWORD result = ERROR_SUCCESS;
+
+	if (options == NULL || options->ImagePath == NULL || supervisor == NULL || options->Restart > SupervisorRestartAlways
+		|| options->CpuRatePercent > 100 || (options->ManagementPasswordFile != NULL) != (options->Management.Password != NULL))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	Supervisor* created = (Supervisor*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Supervisor));
+	if (created == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	created->ImagePath = CopyString(options->ImagePath, &result);
+	created->Arguments = CopyString(options->Arguments, &result);
+	created->WorkingDirectory = CopyString(options->WorkingDirectory, &result);
+	created->PasswordFile = CopyString(options->ManagementPasswordFile, &result);
+	created->Restart = options->Restart;
+	created->MaxRestarts = options->MaxRestarts != 0 ? options->MaxRestarts : SUPERVISOR_DEFAULT_MAX_RESTARTS;
+	created->RestartDelayMs = options->RestartDelayMs != 0 ? options->RestartDelayMs : SUPERVISOR_DEFAULT_RESTART_DELAY_MS;
+	created->MaxRestartDelayMs = max(options->MaxRestartDelayMs != 0 ? options->MaxRestartDelayMs : SUPERVISOR_DEFAULT_MAX_RESTART_DELAY_MS, created->RestartDelayMs);
+	created->StableUs = (options->StableMs != 0 ? options->StableMs : SUPERVISOR_DEFAULT_STABLE_MS) * 1000ULL;
+	created->ReadyTimeoutUs = (options->ReadyTimeoutMs != 0 ? options->ReadyTimeoutMs : SUPERVISOR_DEFAULT_READY_TIMEOUT_MS) * 1000ULL;
+	created->StopTimeoutUs = (options->StopTimeoutMs != 0 ? options->StopTimeoutMs : SUPERVISOR_DEFAULT_STOP_TIMEOUT_MS) * 1000ULL;
+	created->ProcessMemoryLimit = options->ProcessMemoryLimit;
+	created->CpuRatePercent = options->CpuRatePercent;
+	created->Callback = callback;
+	created->Context = context;
+	created->State = SupervisorIdle;
+	created->DeadlineUs = SUPERVISOR_NO_DEADLINE;
+
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	created->ConnectEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	created->WakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (created->ConnectEvent == NULL || created->WakeEvent == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	if (options->ExitEventName != NULL)
+	{
+		// OpenVPN opens it by name, it has to exist first
+		created->ExitEvent = CreateEventW(NULL, TRUE, FALSE, options->ExitEventName);
+		if (created->ExitEvent == NULL)
+		{
+			result = GetLastError();
+			goto Cleanup;
+		}
+	}
+
+	management = options->Management;
+	management.ConnectEvent = created->ConnectEvent;
+
+	result = ManagementTransportCreate(&management, options->ReplyCallback, options->ReplyContext, &created->Transport);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	ManagementTransportGetPort(created->Transport, &created->Port);
+
+	// The first process is started here so a bad path or command line fails the call rather than the thread
+	result = Spawn(created);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	created->Thread = CreateThread(NULL, 0, SupervisorThreadFunc, created, 0, NULL);
+	if (created->Thread == NULL)
+	{
+		result = GetLastError();
+		goto Cleanup;
+	}
+
+	*supervisor = created;
+	return ERROR_SUCCESS;
+
+Cleanup:
+	Destroy(created);
+	return result;
+}
+
+DWORD SupervisorGetTransport(HSUPERVISOR supervisor, HMGMTTRANSPORT* transport)
+{
+	if (supervisor == NULL || transport == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*transport = supervisor->Transport;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD SupervisorStop(HSUPERVISOR supervisor)
+{
+	if (supervisor == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	InterlockedExchange(&supervisor->StopRequested, 1);
+	SetEvent(supervisor->WakeEvent);
+
+	WaitForSingleObject(supervisor->Thread, INFINITE);
+	CloseHandle(supervisor->Thread);
+
+	Destroy(supervisor);
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+typedef struct _SupervisorBench
+{
+	UINT Spawns;
+	UINT Ready;
+	HANDLE Done;
+	ULONGLONG ExitedUs;
+	UINT64 SpawnToReadyUsTotal;
+	DWORD SpawnToReadyUsMin;
+	DWORD SpawnToReadyUsMax;
+	UINT64 ExitToReadyUsTotal;
+	UINT Restarts;
+	DWORD Result;
+} SupervisorBench;
+
+static void CALLBACK BenchEvent(HSUPERVISOR supervisor, const SupervisorEvent* event, PVOID context)
+{
+	SupervisorBench* bench = (SupervisorBench*)context;
+	ULONGLONG now = NowUs();
+
+	switch (event->Type)
+	{
+	case SupervisorReady:
+		bench->SpawnToReadyUsTotal += event->ElapsedUs;
+		bench->SpawnToReadyUsMin = min(bench->SpawnToReadyUsMin, (DWORD)event->ElapsedUs);
+		bench->SpawnToReadyUsMax = max(bench->SpawnToReadyUsMax, (DWORD)event->ElapsedUs);
+
+		if (bench->ExitedUs != 0)
+		{
+			bench->ExitToReadyUsTotal += now - bench->ExitedUs;
+			bench->Restarts++;
+		}
+
+		if (++bench->Ready == bench->Spawns)
+		{
+			SetEvent(bench->Done);
+		}
+		else
+		{
+			HMGMTTRANSPORT transport;
+			SupervisorGetTransport(supervisor, &transport);
+			ManagementTransportSend(transport, "signal SIGTERM", MgmtReplySingle, NULL);
+		}
+		break;
+	case SupervisorExited:
+		bench->ExitedUs = now;
+		break;
+	case SupervisorStopped:
+		if (bench->Ready < bench->Spawns)
+		{
+			bench->Result = event->Result != ERROR_SUCCESS ? event->Result : ERROR_PROCESS_ABORTED;
+			SetEvent(bench->Done);
+		}
+		break;
+	}
+}
+
+DWORD SupervisorRunBenchmark(LPCWSTR imagePath, LPCWSTR arguments, UINT spawns, SupervisorBenchReport* report)
+{
+	SupervisorOptions options;
+	SupervisorBench bench;
+	HSUPERVISOR supervisor = NULL;
+	DWORD result;
+
+	if (imagePath == NULL || spawns == 0 || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(*report));
+	ZeroMemory(&bench, sizeof(bench));
+	bench.Spawns = spawns;
+	bench.SpawnToReadyUsMin = MAXDWORD;
+	bench.Done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (bench.Done == NULL)
+	{
+		return GetLastError();
+	}
+
+	ZeroMemory(&options, sizeof(options));
+	options.ImagePath = imagePath;
+	options.Arguments = arguments;
+	options.Restart = SupervisorRestartAlways;
+	options.MaxRestarts = spawns;
+	options.RestartDelayMs = 1;
+	options.MaxRestartDelayMs = 1;
+	options.ReadyTimeoutMs = SUPERVISOR_BENCH_READY_MS;
+
+	result = SupervisorStart(&options, BenchEvent, &bench, &supervisor);
+	if (result == ERROR_SUCCESS)
+	{
+		if (WaitForSingleObject(bench.Done, (DWORD)min((ULONGLONG)spawns * SUPERVISOR_BENCH_READY_MS, (ULONGLONG)INFINITE - 1)) != WAIT_OBJECT_0)
+		{
+			result = ERROR_TIMEOUT;
+		}
+
+		SupervisorStop(supervisor);
+	}
+
+	CloseHandle(bench.Done);
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = bench.Result;
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_WARNING("supervisor benchmark failed: %lu\n", result);
+		return result;
+	}
+
+	report->Spawns = bench.Ready;
+	report->SpawnToReadyUsMean = (DOUBLE)bench.SpawnToReadyUsTotal / bench.Ready;
+	report->SpawnToReadyUsMin = bench.SpawnToReadyUsMin;
+	report->SpawnToReadyUsMax = bench.SpawnToReadyUsMax;
+	report->ExitToReadyUsMean = bench.Restarts > 0 ? (DOUBLE)bench.ExitToReadyUsTotal / bench.Restarts : 0;
+
+	return ERROR_SUCCESS;
+}
+#endif
@@ -0,0 +1,114 @@
+#pragma once
+#include <windows.h>
+#include "ManagementTransport.h"
+
+// Longest command line CreateProcess takes, in characters
+#define SUPERVISOR_MAX_COMMAND_LINE 32767
+
+typedef struct _Supervisor* HSUPERVISOR;
+
+typedef enum _SupervisorEventType
+{
+	// The process was created and resumed
+	SupervisorStarted = 0,
+	// OpenVPN connected to the management transport. ElapsedUs is from the process being created.
+	SupervisorReady,
+	// ExitCode is the process's, ERROR_TIMEOUT when it was killed for not getting ready or not exiting in time.
+	// ElapsedUs is how long it ran.
+	SupervisorExited,
+	// Another process is started in DelayMs
+	SupervisorRestarting,
+	// The last event. Result is ERROR_SUCCESS after SupervisorStop or a clean exit that isn't restarted,
+	// ERROR_PROCESS_ABORTED after a failure that isn't, and the error when a process couldn't be started.
+	SupervisorStopped,
+	SupervisorEventTypeCount,
+} SupervisorEventType;
+
+typedef struct _SupervisorEvent
+{
+	UINT16 Type;
+	UINT16 Reserved;
+	DWORD ProcessId;
+	// Processes started so far, counting this one
+	UINT Attempt;
+	DWORD ExitCode;
+	DWORD Result;
+	DWORD DelayMs;
+	UINT64 ElapsedUs;
+} SupervisorEvent;
+
+// Every event of a supervisor runs through one queue and reaches the callback in order on the supervisor thread.
+// It may send management commands but must not call SupervisorStop.
+typedef void (CALLBACK* SupervisorCallback)(HSUPERVISOR supervisor, const SupervisorEvent* event, PVOID context);
+
+typedef enum _SupervisorRestart
+{
+	SupervisorRestartNever = 0,
+	// After an exit code other than 0
+	SupervisorRestartOnFailure,
+	// After any exit SupervisorStop didn't ask for
+	SupervisorRestartAlways,
+} SupervisorRestart;
+
+// Zero fields take the defaults in Supervisor.cpp
+typedef struct _SupervisorOptions
+{
+	LPCWSTR ImagePath;
+	// Everything but the --management options, which the supervisor adds
+	LPCWSTR Arguments;
+	// NULL for the supervisor's own
+	LPCWSTR WorkingDirectory;
+	// Given to OpenVPN's --management when the transport has a password
+	LPCWSTR ManagementPasswordFile;
+	// The event named in the process's "--service <name> 0", which the supervisor creates and sets to ask it to
+	// exit. NULL to send "signal SIGTERM" over the management channel instead.
+	LPCWSTR ExitEventName;
+	SupervisorRestart Restart;
+	// Restarts in a row before giving up. A process that stays up for StableMs after getting ready starts the
+	// count again.
+	UINT MaxRestarts;
+	// The first restart's delay, doubled for each one in a row up to MaxRestartDelayMs
+	DWORD RestartDelayMs;
+	DWORD MaxRestartDelayMs;
+	DWORD StableMs;
+	// A process not ready by then is killed and counts as having failed
+	DWORD ReadyTimeoutMs;
+	// How long a process asked to exit has before it's killed
+	DWORD StopTimeoutMs;
+	// Committed memory the process may use, in bytes, 0 for no limit
+	SIZE_T ProcessMemoryLimit;
+	// Hard cap on the CPU the process and its scripts use, in percent of the machine, 0 for no cap
+	DWORD CpuRatePercent;
+	// For the transport every process of the supervisor connects to. ConnectEvent is the supervisor's.
+	MgmtTransportOptions Management;
+	MgmtReplyCallback ReplyCallback;
+	PVOID ReplyContext;
+} SupervisorOptions;
+
+// Creates the management transport and starts the first process, then keeps one running under the restart
+// policy until SupervisorStop. Each process runs in a job object which holds the resource limits and takes the
+// process and its scripts down with the supervisor.
+extern DWORD SupervisorStart(const SupervisorOptions* options, SupervisorCallback callback, PVOID context, HSUPERVISOR* supervisor);
+
+// The transport the current process, and every one after it, connects to. It stays valid until SupervisorStop.
+extern DWORD SupervisorGetTransport(HSUPERVISOR supervisor, HMGMTTRANSPORT* transport);
+
+// Asks the process to exit, kills it after StopTimeoutMs and waits for SupervisorStopped to be delivered
+extern DWORD SupervisorStop(HSUPERVISOR supervisor);
+
+#ifdef NATIVE_BENCH
+typedef struct _SupervisorBenchReport
+{
+	UINT Spawns;
+	// From CreateProcess to the process connecting on the management channel
+	DOUBLE SpawnToReadyUsMean;
+	DWORD SpawnToReadyUsMin;
+	DWORD SpawnToReadyUsMax;
+	// From an exit being noticed to the next process being ready, 1ms of it the restart delay
+	DOUBLE ExitToReadyUsMean;
+} SupervisorBenchReport;
+
+// Supervises imagePath, a stand in for OpenVPN that connects to the port given by --management and exits on
+// "signal SIGTERM", sending that as soon as each process is ready so it's restarted until spawns have run
+extern DWORD SupervisorRunBenchmark(LPCWSTR imagePath, LPCWSTR arguments, UINT spawns, SupervisorBenchReport* report);
+#endif
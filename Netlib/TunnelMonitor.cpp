@@ -0,0 +1,801 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <string.h>
+#include "TunnelMonitor.h"
+#include "Metrics.h"
+#include "NativeLog.h"
+
+#define MONITOR_DEFAULT_PORT 7
+#define MONITOR_DEFAULT_INTERVAL_MS 1000
+#define MONITOR_DEFAULT_TIMEOUT_MS 2000
+#define MONITOR_DEFAULT_WINDOW 20
+#define MONITOR_DEFAULT_LOSS_PERMILLE 100
+#define MONITOR_DEFAULT_RTT_MS 400
+#define MONITOR_DEFAULT_JITTER_MS 100
+#define MONITOR_DEFAULT_STALLED_MS 6000
+// Replies in a row before a degraded or stalled tunnel counts as healthy again
+#define MONITOR_RECOVER_PROBES 3
+// Probes in flight at once, TimeoutMs is cut down to fit
+#define MONITOR_PENDING 64
+// Longest the thread sleeps, so a new or stopped monitor is noticed promptly
+#define MONITOR_TICK_MS 50
+#define MONITOR_PACKET_LENGTH 16
+#define MONITOR_RECV_BUFFER 512
+#define MONITOR_MAGIC 0x55544D31
+#define MONITOR_LOST MAXDWORD
+
+// Log-linear histogram in the HDR style: values below 128 get a bucket each, every doubling above that is split
+// into 64 buckets, so a recorded value is off by less than 1/64. Values past 2^27 us, about two minutes, land in
+// the last bucket.
+#define HDR_SUB_BUCKETS 128
+#define HDR_HALF_BUCKETS 64
+#define HDR_MAGNITUDES 20
+#define HDR_BUCKETS (HDR_SUB_BUCKETS + HDR_MAGNITUDES * HDR_HALF_BUCKETS)
+
+typedef struct _HdrHistogram
+{
+	UINT64 Total;
+	UINT64 Max;
+	UINT32 Counts[HDR_BUCKETS];
+} HdrHistogram;
+
+typedef struct _PendingProbe
+{
+	UINT32 Sequence;
+	BOOL Outstanding;
+	ULONGLONG SentUs;
+} PendingProbe;
+
+typedef struct _TunnelMonitor
+{
+	SRWLOCK Lock;
+	SOCKET Socket;
+	TunnelMonitorCallback Callback;
+	PVOID Context;
+	UINT32 Salt;
+	UINT32 Sequence;
+	ULONGLONG IntervalUs;
+	ULONGLONG TimeoutUs;
+	ULONGLONG StalledUs;
+	ULONGLONG RttLimitUs;
+	ULONGLONG JitterLimitUs;
+	DWORD LossLimitPermille;
+	UINT WindowProbes;
+	ULONGLONG NextSendUs;
+	ULONGLONG LastReplyUs;
+	PendingProbe Pending[MONITOR_PENDING];
+	// Everything below is guarded by Lock, only the monitor thread writes it
+	TunnelHealth Health;
+	UINT64 Sent;
+	UINT64 Received;
+	UINT64 Lost;
+	UINT64 Late;
+	DWORD Window[TUNNEL_MONITOR_MAX_WINDOW];
+	UINT WindowNext;
+	UINT WindowFill;
+	UINT WindowLost;
+	ULONGLONG WindowRttTotal;
+	DWORD LastRttUs;
+	BOOL HaveLastRtt;
+	LONGLONG JitterUs;
+	UINT LossRun;
+	UINT ReplyRun;
+	HdrHistogram Rtt;
+	HdrHistogram Jitter;
+	HdrHistogram LossBursts;
+} TunnelMonitor;
+
+// EngineLock guards the monitor list and is held while the thread works on the monitors, everywhere but the
+// wait. ControlLock orders starting and stopping the thread itself.
+static SRWLOCK ControlLock = SRWLOCK_INIT;
+static SRWLOCK EngineLock = SRWLOCK_INIT;
+static TunnelMonitor* Monitors[TUNNEL_MONITOR_MAX];
+static UINT MonitorCount;
+static HANDLE EngineThread;
+static volatile LONG EngineStopping;
+
+static ULONGLONG NowUs()
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+
+	return (ULONGLONG)(counter.QuadPart / frequency.QuadPart) * 1000000ULL + (ULONGLONG)(counter.QuadPart % frequency.QuadPart) * 1000000ULL / frequency.QuadPart;
+}
+
+static void WriteBE32(BYTE* p, UINT32 value)
+{
+	p[0] = (BYTE)(value >> 24);
+	p[1] = (BYTE)(value >> 16);
+	p[2] = (BYTE)(value >> 8);
+	p[3] = (BYTE)value;
+}
+
+static UINT32 ReadBE32(const BYTE* p)
+{
+	return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) | ((UINT32)p[2] << 8) | (UINT32)p[3];
+}
+
+static UINT HdrIndex(UINT64 value)
+{
+	if (value < HDR_SUB_BUCKETS)
+	{
+		return (UINT)value;
+	}
+
+	UINT magnitude = 1;
+	while ((value >> magnitude) >= HDR_SUB_BUCKETS)
+	{
+		magnitude++;
+	}
+
+	if (magnitude > HDR_MAGNITUDES)
+	{
+		return HDR_BUCKETS - 1;
+	}
+
+	return HDR_SUB_BUCKETS + (magnitude - 1) * HDR_HALF_BUCKETS + (UINT)((value >> magnitude) - HDR_HALF_BUCKETS);
+}
+
+// The largest value that lands in a bucket
+static UINT64 HdrHighest(UINT index)
+{
+	if (index < HDR_SUB_BUCKETS)
+	{
+		return index;
+	}
+
+	UINT magnitude = (index - HDR_SUB_BUCKETS) / HDR_HALF_BUCKETS + 1;
+	UINT64 subBucket = (index - HDR_SUB_BUCKETS) % HDR_HALF_BUCKETS + HDR_HALF_BUCKETS;
+
+	return ((subBucket + 1) << magnitude) - 1;
+}
+
+static void HdrRecord(HdrHistogram* histogram, UINT64 value)
+{
+	histogram->Counts[HdrIndex(value)]++;
+	histogram->Total++;
+	histogram->Max = max(histogram->Max, value);
+}
+
+static DWORD HdrPercentile(const HdrHistogram* histogram, UINT permille)
+{
+	if (histogram->Total == 0)
+	{
+		return 0;
+	}
+
+	UINT64 rank = (histogram->Total * permille + 999) / 1000;
+	UINT64 seen = 0;
+
+	for (UINT i = 0; i < HDR_BUCKETS; i++)
+	{
+		seen += histogram->Counts[i];
+		if (seen >= rank && seen > 0)
+		{
+			return (DWORD)min(min(HdrHighest(i), histogram->Max), (UINT64)MAXDWORD);
+		}
+	}
+
+	return (DWORD)min(histogram->Max, (UINT64)MAXDWORD);
+}
+
+static DWORD ResolveTarget(const TunnelMonitorOptions* options, SOCKADDR_STORAGE* address, int* addressLength)
+{
+	ADDRINFOW hints;
+	ADDRINFOW* addresses = NULL;
+	USHORT port = options->Port != 0 ? options->Port : MONITOR_DEFAULT_PORT;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	int rc = GetAddrInfoW(options->Target, NULL, &hints, &addresses);
+	if (rc != 0)
+	{
+		hints.ai_flags = 0;
+		rc = GetAddrInfoW(options->Target, NULL, &hints, &addresses);
+	}
+
+	if (rc != 0)
+	{
+		return (DWORD)rc;
+	}
+
+	memcpy(address, addresses->ai_addr, addresses->ai_addrlen);
+	*addressLength = (int)addresses->ai_addrlen;
+	FreeAddrInfoW(addresses);
+
+	if (address->ss_family == AF_INET)
+	{
+		((SOCKADDR_IN*)address)->sin_port = htons(port);
+	}
+	else
+	{
+		((SOCKADDR_IN6*)address)->sin6_port = htons(port);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD OpenProbeSocket(const TunnelMonitorOptions* options, SOCKET* probeSocket)
+{
+	SOCKADDR_STORAGE address;
+	int addressLength = 0;
+	u_long nonBlocking = 1;
+
+	DWORD result = ResolveTarget(options, &address, &addressLength);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	SOCKET s = socket(address.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (s == INVALID_SOCKET)
+	{
+		return WSAGetLastError();
+	}
+
+	if (ioctlsocket(s, FIONBIO, &nonBlocking) != 0)
+	{
+		result = WSAGetLastError();
+	}
+
+	if (result == ERROR_SUCCESS && options->InterfaceIndex != 0)
+	{
+		// IP_UNICAST_IF takes the index in network byte order, IPV6_UNICAST_IF in host byte order
+		DWORD index = address.ss_family == AF_INET ? htonl(options->InterfaceIndex) : options->InterfaceIndex;
+		int level = address.ss_family == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+		int name = address.ss_family == AF_INET ? IP_UNICAST_IF : IPV6_UNICAST_IF;
+
+		if (setsockopt(s, level, name, (const char*)&index, sizeof(index)) != 0)
+		{
+			result = WSAGetLastError();
+		}
+	}
+
+	// Connected, so only the target's datagrams are delivered
+	if (result == ERROR_SUCCESS && connect(s, (SOCKADDR*)&address, addressLength) != 0)
+	{
+		result = WSAGetLastError();
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		closesocket(s);
+		return result;
+	}
+
+	*probeSocket = s;
+	return ERROR_SUCCESS;
+}
+
+static void PushWindow(TunnelMonitor* monitor, DWORD rttUs)
+{
+	if (monitor->WindowFill == monitor->WindowProbes)
+	{
+		DWORD evicted = monitor->Window[monitor->WindowNext];
+		if (evicted == MONITOR_LOST)
+		{
+			monitor->WindowLost--;
+		}
+		else
+		{
+			monitor->WindowRttTotal -= evicted;
+		}
+	}
+	else
+	{
+		monitor->WindowFill++;
+	}
+
+	monitor->Window[monitor->WindowNext] = rttUs;
+	monitor->WindowNext = (monitor->WindowNext + 1) % monitor->WindowProbes;
+
+	if (rttUs == MONITOR_LOST)
+	{
+		monitor->WindowLost++;
+	}
+	else
+	{
+		monitor->WindowRttTotal += rttUs;
+	}
+}
+
+static void RecordLost(TunnelMonitor* monitor)
+{
+	AcquireSRWLockExclusive(&monitor->Lock);
+
+	monitor->Lost++;
+	monitor->LossRun++;
+	monitor->ReplyRun = 0;
+	PushWindow(monitor, MONITOR_LOST);
+
+	ReleaseSRWLockExclusive(&monitor->Lock);
+
+	MetricsAdd(MetricTunnelProbesLost, 1);
+}
+
+static void RecordReply(TunnelMonitor* monitor, ULONGLONG rttUs, ULONGLONG now)
+{
+	DWORD rtt = (DWORD)min(rttUs, (ULONGLONG)(MONITOR_LOST - 1));
+
+	AcquireSRWLockExclusive(&monitor->Lock);
+
+	monitor->Received++;
+	monitor->ReplyRun++;
+	monitor->LastReplyUs = now;
+	HdrRecord(&monitor->Rtt, rtt);
+	PushWindow(monitor, rtt);
+
+	// RFC 3550 section 6.4.1, with the probe spacing taken out the transit time difference is the RTT difference
+	if (monitor->HaveLastRtt)
+	{
+		LONGLONG difference = (LONGLONG)rtt - (LONGLONG)monitor->LastRttUs;
+		if (difference < 0)
+		{
+			difference = -difference;
+		}
+
+		monitor->JitterUs += (difference - monitor->JitterUs) / 16;
+		HdrRecord(&monitor->Jitter, (UINT64)difference);
+	}
+	monitor->LastRttUs = rtt;
+	monitor->HaveLastRtt = TRUE;
+
+	if (monitor->LossRun > 0)
+	{
+		HdrRecord(&monitor->LossBursts, monitor->LossRun);
+		monitor->LossRun = 0;
+	}
+
+	ReleaseSRWLockExclusive(&monitor->Lock);
+
+	MetricsObserveUs(MetricTunnelRttSeconds, rtt);
+}
+
+// Called with monitor->Lock held
+static void FillSnapshot(const TunnelMonitor* monitor, ULONGLONG now, TunnelMonitorSnapshot* snapshot)
+{
+	UINT replies = monitor->WindowFill - monitor->WindowLost;
+
+	snapshot->Health = monitor->Health;
+	snapshot->Sent = monitor->Sent;
+	snapshot->Received = monitor->Received;
+	snapshot->Lost = monitor->Lost;
+	snapshot->Late = monitor->Late;
+	snapshot->WindowLossPermille = monitor->WindowFill > 0 ? monitor->WindowLost * 1000 / monitor->WindowFill : 0;
+	snapshot->WindowRttAvgUs = replies > 0 ? (DWORD)(monitor->WindowRttTotal / replies) : 0;
+	snapshot->JitterUs = (DWORD)monitor->JitterUs;
+	snapshot->RttP50Us = HdrPercentile(&monitor->Rtt, 500);
+	snapshot->RttP90Us = HdrPercentile(&monitor->Rtt, 900);
+	snapshot->RttP99Us = HdrPercentile(&monitor->Rtt, 990);
+	snapshot->RttMaxUs = (DWORD)min(monitor->Rtt.Max, (UINT64)MAXDWORD);
+	snapshot->JitterP50Us = HdrPercentile(&monitor->Jitter, 500);
+	snapshot->JitterP99Us = HdrPercentile(&monitor->Jitter, 990);
+	snapshot->LossBurstP99 = HdrPercentile(&monitor->LossBursts, 990);
+	snapshot->LossBurstMax = (DWORD)max(monitor->LossBursts.Max, (UINT64)monitor->LossRun);
+	snapshot->LastReplyAgeMs = (DWORD)min((now - monitor->LastReplyUs) / 1000, (ULONGLONG)MAXDWORD);
+}
+
+// Degrading takes one bad window, recovering takes MONITOR_RECOVER_PROBES good replies in a row on top
+static TunnelHealth EvaluateHealth(const TunnelMonitor* monitor, ULONGLONG now)
+{
+	if (monitor->Lost > 0 && now - monitor->LastReplyUs >= monitor->StalledUs)
+	{
+		return TunnelHealthStalled;
+	}
+
+	if (monitor->Received == 0)
+	{
+		return monitor->Health;
+	}
+
+	UINT replies = monitor->WindowFill - monitor->WindowLost;
+	DWORD lossPermille = monitor->WindowFill > 0 ? monitor->WindowLost * 1000 / monitor->WindowFill : 0;
+	ULONGLONG rttAvgUs = replies > 0 ? monitor->WindowRttTotal / replies : 0;
+
+	if (lossPermille >= monitor->LossLimitPermille || rttAvgUs >= monitor->RttLimitUs || (ULONGLONG)monitor->JitterUs >= monitor->JitterLimitUs)
+	{
+		return TunnelHealthDegraded;
+	}
+
+	if (monitor->Health != TunnelHealthUnknown && monitor->Health != TunnelHealthHealthy && monitor->ReplyRun < MONITOR_RECOVER_PROBES)
+	{
+		return monitor->Health;
+	}
+
+	return TunnelHealthHealthy;
+}
+
+static void UpdateHealth(TunnelMonitor* monitor, ULONGLONG now)
+{
+	TunnelMonitorSnapshot snapshot;
+
+	AcquireSRWLockExclusive(&monitor->Lock);
+
+	TunnelHealth health = EvaluateHealth(monitor, now);
+	TunnelHealth previous = monitor->Health;
+	monitor->Health = health;
+
+	if (health != previous)
+	{
+		FillSnapshot(monitor, now, &snapshot);
+	}
+
+	ReleaseSRWLockExclusive(&monitor->Lock);
+
+	if (health == previous)
+	{
+		return;
+	}
+
+	NATIVELOG_INFO("tunnel monitor %p: health %d -> %d, loss %lu permille, rtt %lu us, jitter %lu us\n",
+		monitor, previous, health, snapshot.WindowLossPermille, snapshot.WindowRttAvgUs, snapshot.JitterUs);
+
+	if (monitor->Callback != NULL)
+	{
+		monitor->Callback(monitor, health, &snapshot, monitor->Context);
+	}
+}
+
+static void SendProbe(TunnelMonitor* monitor, ULONGLONG now)
+{
+	BYTE packet[MONITOR_PACKET_LENGTH];
+	UINT32 sequence = ++monitor->Sequence;
+	PendingProbe* pending = &monitor->Pending[sequence % MONITOR_PENDING];
+
+	// TimeoutMs is cut down to fit the ring, this only happens when the thread fell far behind
+	if (pending->Outstanding)
+	{
+		pending->Outstanding = FALSE;
+		RecordLost(monitor);
+	}
+
+	memset(packet, 0, sizeof(packet));
+	WriteBE32(packet, MONITOR_MAGIC);
+	WriteBE32(packet + 4, monitor->Salt);
+	WriteBE32(packet + 8, sequence);
+
+	// Keep to the schedule, unless the thread was held up long enough to owe more than one probe
+	monitor->NextSendUs += monitor->IntervalUs;
+	if (monitor->NextSendUs <= now)
+	{
+		monitor->NextSendUs = now + monitor->IntervalUs;
+	}
+
+	AcquireSRWLockExclusive(&monitor->Lock);
+	monitor->Sent++;
+	ReleaseSRWLockExclusive(&monitor->Lock);
+
+	// A send failing, say because the tunnel adapter went away, is a lost probe
+	if (send(monitor->Socket, (const char*)packet, sizeof(packet), 0) == SOCKET_ERROR)
+	{
+		RecordLost(monitor);
+		return;
+	}
+
+	pending->Sequence = sequence;
+	pending->SentUs = now;
+	pending->Outstanding = TRUE;
+}
+
+static void ReceiveReplies(TunnelMonitor* monitor)
+{
+	BYTE buffer[MONITOR_RECV_BUFFER];
+
+	for (;;)
+	{
+		int length = recv(monitor->Socket, (char*)buffer, sizeof(buffer), 0);
+		if (length == SOCKET_ERROR)
+		{
+			// WSAEWOULDBLOCK once drained, ICMP port unreachable shows up as WSAECONNRESET and the probe times out
+			if (WSAGetLastError() == WSAECONNRESET)
+			{
+				continue;
+			}
+			return;
+		}
+
+		ULONGLONG now = NowUs();
+
+		if (length < MONITOR_PACKET_LENGTH || ReadBE32(buffer) != MONITOR_MAGIC || ReadBE32(buffer + 4) != monitor->Salt)
+		{
+			continue;
+		}
+
+		UINT32 sequence = ReadBE32(buffer + 8);
+		PendingProbe* pending = &monitor->Pending[sequence % MONITOR_PENDING];
+
+		if (pending->Outstanding && pending->Sequence == sequence)
+		{
+			pending->Outstanding = FALSE;
+			RecordReply(monitor, now - pending->SentUs, now);
+		}
+		else if (sequence <= monitor->Sequence && monitor->Sequence - sequence < MONITOR_PENDING)
+		{
+			// Already written off as lost, or a duplicate
+			AcquireSRWLockExclusive(&monitor->Lock);
+			monitor->Late++;
+			ReleaseSRWLockExclusive(&monitor->Lock);
+		}
+	}
+}
+
+static void ExpireProbes(TunnelMonitor* monitor, ULONGLONG now)
+{
+	for (UINT i = 0; i < MONITOR_PENDING; i++)
+	{
+		PendingProbe* pending = &monitor->Pending[i];
+		if (pending->Outstanding && now - pending->SentUs >= monitor->TimeoutUs)
+		{
+			pending->Outstanding = FALSE;
+			RecordLost(monitor);
+		}
+	}
+}
+
+// The next time the monitor has something to do: a probe to send or one to write off
+static ULONGLONG NextWakeUs(const TunnelMonitor* monitor)
+{
+	ULONGLONG wakeUs = monitor->NextSendUs;
+
+	for (UINT i = 0; i < MONITOR_PENDING; i++)
+	{
+		if (monitor->Pending[i].Outstanding)
+		{
+			wakeUs = min(wakeUs, monitor->Pending[i].SentUs + monitor->TimeoutUs);
+		}
+	}
+
+	return wakeUs;
+}
+
+static BOOL IsRegistered(const TunnelMonitor* monitor)
+{
+	for (UINT i = 0; i < MonitorCount; i++)
+	{
+		if (Monitors[i] == monitor)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static DWORD WINAPI EngineThreadFunc(LPVOID parameter)
+{
+	WSAPOLLFD pollFds[TUNNEL_MONITOR_MAX];
+	TunnelMonitor* owners[TUNNEL_MONITOR_MAX];
+
+	AcquireSRWLockExclusive(&EngineLock);
+
+	while (!EngineStopping)
+	{
+		ULONGLONG now = NowUs();
+		ULONGLONG wakeUs = now + MONITOR_TICK_MS * 1000ULL;
+		UINT fdCount = 0;
+
+		for (UINT i = 0; i < MonitorCount; i++)
+		{
+			TunnelMonitor* monitor = Monitors[i];
+
+			ExpireProbes(monitor, now);
+			if (now >= monitor->NextSendUs)
+			{
+				SendProbe(monitor, now);
+			}
+			UpdateHealth(monitor, now);
+
+			wakeUs = min(wakeUs, NextWakeUs(monitor));
+			pollFds[fdCount].fd = monitor->Socket;
+			pollFds[fdCount].events = POLLRDNORM;
+			pollFds[fdCount].revents = 0;
+			owners[fdCount++] = monitor;
+		}
+
+		ReleaseSRWLockExclusive(&EngineLock);
+
+		now = NowUs();
+		INT timeoutMs = wakeUs > now ? (INT)((wakeUs - now + 999) / 1000) : 0;
+		int ready = 0;
+
+		if (fdCount == 0)
+		{
+			Sleep(timeoutMs);
+		}
+		else
+		{
+			ready = WSAPoll(pollFds, fdCount, timeoutMs);
+			if (ready == SOCKET_ERROR)
+			{
+				NATIVELOG_WARNING("WSAPoll failed in the tunnel monitor: %d\n", WSAGetLastError());
+				Sleep(MONITOR_TICK_MS);
+			}
+		}
+
+		AcquireSRWLockExclusive(&EngineLock);
+
+		for (UINT i = 0; i < fdCount && ready > 0; i++)
+		{
+			// A monitor stopped during the wait is gone, its socket with it
+			if (pollFds[i].revents != 0 && IsRegistered(owners[i]) && owners[i]->Socket == pollFds[i].fd)
+			{
+				ReceiveReplies(owners[i]);
+				UpdateHealth(owners[i], NowUs());
+			}
+		}
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+	return 0;
+}
+
+DWORD TunnelMonitorStart(const TunnelMonitorOptions* options, TunnelMonitorCallback callback, PVOID context, HTUNNELMONITOR* monitor)
+{
+	WSADATA wsaData;
+	TunnelMonitor* created = NULL;
+	DWORD result;
+
+	if (options == NULL || options->Target == NULL || monitor == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	result = (DWORD)WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	created = (TunnelMonitor*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TunnelMonitor));
+	if (created == NULL)
+	{
+		WSACleanup();
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	InitializeSRWLock(&created->Lock);
+	created->Socket = INVALID_SOCKET;
+	created->Callback = callback;
+	created->Context = context;
+	created->IntervalUs = (options->IntervalMs != 0 ? options->IntervalMs : MONITOR_DEFAULT_INTERVAL_MS) * 1000ULL;
+	created->TimeoutUs = min((options->TimeoutMs != 0 ? options->TimeoutMs : MONITOR_DEFAULT_TIMEOUT_MS) * 1000ULL, created->IntervalUs * (MONITOR_PENDING - 1));
+	created->StalledUs = (options->StalledMs != 0 ? options->StalledMs : MONITOR_DEFAULT_STALLED_MS) * 1000ULL;
+	created->RttLimitUs = (options->DegradedRttMs != 0 ? options->DegradedRttMs : MONITOR_DEFAULT_RTT_MS) * 1000ULL;
+	created->JitterLimitUs = (options->DegradedJitterMs != 0 ? options->DegradedJitterMs : MONITOR_DEFAULT_JITTER_MS) * 1000ULL;
+	created->LossLimitPermille = options->DegradedLossPermille != 0 ? options->DegradedLossPermille : MONITOR_DEFAULT_LOSS_PERMILLE;
+	created->WindowProbes = options->WindowProbes != 0 ? min(options->WindowProbes, (UINT)TUNNEL_MONITOR_MAX_WINDOW) : MONITOR_DEFAULT_WINDOW;
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	created->Salt = (UINT32)(counter.QuadPart ^ ((UINT64)GetCurrentProcessId() << 16) ^ (UINT_PTR)created);
+
+	result = OpenProbeSocket(options, &created->Socket);
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("tunnel monitor could not open its socket: %lu\n", result);
+		HeapFree(GetProcessHeap(), 0, created);
+		WSACleanup();
+		return result;
+	}
+
+	AcquireSRWLockExclusive(&ControlLock);
+	AcquireSRWLockExclusive(&EngineLock);
+
+	if (MonitorCount == TUNNEL_MONITOR_MAX)
+	{
+		result = ERROR_TOO_MANY_SESS;
+	}
+	else
+	{
+		ULONGLONG now = NowUs();
+		created->NextSendUs = now;
+		created->LastReplyUs = now;
+		Monitors[MonitorCount++] = created;
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	if (result == ERROR_SUCCESS && EngineThread == NULL)
+	{
+		EngineStopping = FALSE;
+		EngineThread = CreateThread(NULL, 0, EngineThreadFunc, NULL, 0, NULL);
+		if (EngineThread == NULL)
+		{
+			result = GetLastError();
+
+			AcquireSRWLockExclusive(&EngineLock);
+			MonitorCount--;
+			ReleaseSRWLockExclusive(&EngineLock);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&ControlLock);
+
+	if (result != ERROR_SUCCESS)
+	{
+		closesocket(created->Socket);
+		HeapFree(GetProcessHeap(), 0, created);
+		WSACleanup();
+		return result;
+	}
+
+	*monitor = created;
+	return ERROR_SUCCESS;
+}
+
+DWORD TunnelMonitorGetSnapshot(HTUNNELMONITOR monitor, TunnelMonitorSnapshot* snapshot)
+{
+	if (monitor == NULL || snapshot == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockShared(&monitor->Lock);
+	FillSnapshot(monitor, NowUs(), snapshot);
+	ReleaseSRWLockShared(&monitor->Lock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD TunnelMonitorStop(HTUNNELMONITOR monitor)
+{
+	HANDLE thread = NULL;
+	BOOL found = FALSE;
+
+	if (monitor == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&ControlLock);
+
+	// Once EngineLock is ours the thread is waiting, not working on the monitor or inside its callback
+	AcquireSRWLockExclusive(&EngineLock);
+
+	for (UINT i = 0; i < MonitorCount; i++)
+	{
+		if (Monitors[i] == monitor)
+		{
+			Monitors[i] = Monitors[--MonitorCount];
+			found = TRUE;
+			break;
+		}
+	}
+
+	if (found && MonitorCount == 0)
+	{
+		InterlockedExchange(&EngineStopping, TRUE);
+		thread = EngineThread;
+		EngineThread = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	if (thread != NULL)
+	{
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+
+	ReleaseSRWLockExclusive(&ControlLock);
+
+	if (!found)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	closesocket(monitor->Socket);
+	HeapFree(GetProcessHeap(), 0, monitor);
+	WSACleanup();
+
+	return ERROR_SUCCESS;
+}
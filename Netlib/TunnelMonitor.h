@@ -0,0 +1,74 @@
+#pragma once
+#include <windows.h>
+
+#define TUNNEL_MONITOR_MAX 16
+// Probes the loss and latency thresholds are judged over, at most
+#define TUNNEL_MONITOR_MAX_WINDOW 256
+
+typedef struct _TunnelMonitor* HTUNNELMONITOR;
+
+typedef enum _TunnelHealth
+{
+	// No reply yet
+	TunnelHealthUnknown = 0,
+	TunnelHealthHealthy,
+	// Replies are coming back but loss, latency or jitter is over its threshold
+	TunnelHealthDegraded,
+	// Nothing has come back for StalledMs
+	TunnelHealthStalled,
+} TunnelHealth;
+
+// Zero fields take the defaults in TunnelMonitor.cpp
+typedef struct _TunnelMonitorOptions
+{
+	// A UDP echo responder (RFC 862) reachable through the tunnel, an address literal or a name
+	LPCWSTR Target;
+	// 7 when 0
+	USHORT Port;
+	// Probes leave through this interface whatever the routes say, 0 to follow the routes
+	ULONG InterfaceIndex;
+	DWORD IntervalMs;
+	// A probe not answered by then is lost, a later reply only counts as late
+	DWORD TimeoutMs;
+	UINT WindowProbes;
+	DWORD DegradedLossPermille;
+	DWORD DegradedRttMs;
+	DWORD DegradedJitterMs;
+	DWORD StalledMs;
+} TunnelMonitorOptions;
+
+// Percentiles cover everything since the monitor started, the window figures cover the last WindowProbes
+typedef struct _TunnelMonitorSnapshot
+{
+	TunnelHealth Health;
+	UINT64 Sent;
+	UINT64 Received;
+	UINT64 Lost;
+	UINT64 Late;
+	DWORD WindowLossPermille;
+	DWORD WindowRttAvgUs;
+	// RFC 3550 interarrival jitter, smoothed over the last 16 replies
+	DWORD JitterUs;
+	DWORD RttP50Us;
+	DWORD RttP90Us;
+	DWORD RttP99Us;
+	DWORD RttMaxUs;
+	DWORD JitterP50Us;
+	DWORD JitterP99Us;
+	// Consecutive probes lost together
+	DWORD LossBurstP99;
+	DWORD LossBurstMax;
+	DWORD LastReplyAgeMs;
+} TunnelMonitorSnapshot;
+
+// Runs on the monitor thread whenever the health changes. It must not call TunnelMonitorStop.
+typedef void (CALLBACK* TunnelMonitorCallback)(HTUNNELMONITOR monitor, TunnelHealth health, const TunnelMonitorSnapshot* snapshot, PVOID context);
+
+// Starts probing the target every IntervalMs. Every monitor in the process is served by one timer driven thread,
+// which starts with the first monitor and stops with the last.
+extern DWORD TunnelMonitorStart(const TunnelMonitorOptions* options, TunnelMonitorCallback callback, PVOID context, HTUNNELMONITOR* monitor);
+
+extern DWORD TunnelMonitorGetSnapshot(HTUNNELMONITOR monitor, TunnelMonitorSnapshot* snapshot);
+
+// The callback has returned for the last time once this returns
+extern DWORD TunnelMonitorStop(HTUNNELMONITOR monitor);
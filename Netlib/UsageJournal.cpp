@@ -0,0 +1,1360 @@
+#include "stdafx.h"
+#include <stdlib.h>
+#include <strsafe.h>
+#include "UsageJournal.h"
+#include "Helpers.h"
+#include "NativeLog.h"
+
+#define USAGE_SEGMENT_MAGIC 0x47455355	// "USEG"
+#define USAGE_INDEX_MAGIC 0x58445355	// "USDX"
+#define USAGE_JOURNAL_VERSION 1
+// Hourly buckets the index starts with, it doubles whenever a sample lands past the end
+#define USAGE_INDEX_INITIAL_HOURS 4096
+#define USAGE_SECONDS_PER_HOUR 3600
+#define USAGE_UNIX_EPOCH_FILETIME 116444736000000000LL
+#define USAGE_NO_SEGMENT 0xFFFFFFFF
+// Records read at a time when summing the partial hours of a query
+#define USAGE_EDGE_CHUNK_RECORDS 512
+
+#define USAGE_SEGMENT_PATTERN L"usage-*.seg"
+#define USAGE_SEGMENT_PREFIX_LENGTH 6
+
+typedef struct _UsageRecord
+{
+	UINT32 Time;
+	UINT32 ServerId;
+	UINT64 TxBytes;
+	UINT64 RxBytes;
+	// Low 32 bits of the record's position in the journal, tells a torn or stale slot from a real one
+	UINT32 Sequence;
+	UINT32 Checksum;
+} UsageRecord;
+
+// Occupies the first record slot of every segment file
+typedef struct _UsageSegmentHeader
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 Index;
+	UINT32 Capacity;
+	UINT64 FirstSequence;
+	UINT32 Reserved;
+	UINT32 Checksum;
+} UsageSegmentHeader;
+
+typedef struct _UsageBucket
+{
+	UINT64 TxBytes;
+	UINT64 RxBytes;
+	// Last record folded in, replaying a record the bucket already holds is a no-op
+	UINT64 LastSequence;
+	UINT32 Records;
+	UINT32 Checksum;
+} UsageBucket;
+
+typedef struct _UsageIndexHeader
+{
+	UINT32 Magic;
+	UINT32 Version;
+	// Hour of bucket 0 in hours since the Unix epoch, 0 until the first sample
+	UINT32 FirstHour;
+	UINT32 Capacity;
+	BYTE Reserved[12];
+	UINT32 Checksum;
+} UsageIndexHeader;
+
+static_assert(sizeof(UsageRecord) == 32, "records are fixed at 32 bytes");
+static_assert(sizeof(UsageSegmentHeader) == sizeof(UsageRecord), "the segment header takes one record slot");
+static_assert(sizeof(UsageBucket) == 32 && sizeof(UsageIndexHeader) == 32, "index entries are 32 bytes");
+
+typedef struct _UsageSegment
+{
+	UINT32 Index;
+	UINT64 FirstSequence;
+	UINT32 FirstTime;
+	UINT32 Count;
+} UsageSegment;
+
+typedef struct _UsageView
+{
+	HANDLE File;
+	HANDLE Mapping;
+	BYTE* Base;
+	SIZE_T Size;
+} UsageView;
+
+typedef struct _UsageJournal
+{
+	SRWLOCK Lock;
+	WCHAR Directory[MAX_PATH];
+	UINT MaxSegments;
+	UsageSegment* Segments;
+	UINT SegmentCount;
+	UINT SegmentCapacity;
+	// The last segment, the only one written to
+	UsageView Active;
+	// One older segment kept mapped for queries
+	UsageView Reader;
+	UINT32 ReaderIndex;
+	// Older segment the partial hours of queries are read from, plain reads are far cheaper than a new mapping
+	HANDLE EdgeFile;
+	UINT32 EdgeIndex;
+	UsageRecord* EdgeRecords;
+	UsageView Index;
+	UINT64 NextSequence;
+	UINT32 LastTime;
+	// Fenwick tree over the hourly buckets, 1-based, FenwickSize equals the index capacity
+	UsageTotals* Fenwick;
+	UINT FenwickSize;
+} UsageJournal;
+
+// CRC-32 over everything in front of the trailing checksum field
+static UINT32 Checksum(const void* data, SIZE_T size)
+{
+	return Crc32(data, size - sizeof(UINT32));
+}
+
+static BOOL RecordValid(const UsageRecord* record, UINT64 sequence)
+{
+	return record->Sequence == (UINT32)sequence && record->Checksum == Checksum(record, sizeof(UsageRecord));
+}
+
+// Buckets the index has grown into but never used are all zero
+static BOOL BucketValid(const UsageBucket* bucket)
+{
+	if (bucket->Records == 0 && bucket->Checksum == 0 && bucket->TxBytes == 0 && bucket->RxBytes == 0 && bucket->LastSequence == 0)
+	{
+		return TRUE;
+	}
+
+	return bucket->Checksum == Checksum(bucket, sizeof(UsageBucket));
+}
+
+static UINT32 NowUnix()
+{
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+
+	INT64 ticks = ((INT64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+
+	return (UINT32)((ticks - USAGE_UNIX_EPOCH_FILETIME) / 10000000);
+}
+
+static SIZE_T SegmentSize()
+{
+	return sizeof(UsageSegmentHeader) + (SIZE_T)USAGE_JOURNAL_SEGMENT_RECORDS * sizeof(UsageRecord);
+}
+
+static void SegmentPath(const UsageJournal* journal, UINT32 index, LPWSTR path)
+{
+	StringCchPrintfW(path, MAX_PATH, L"%s\\usage-%08u.seg", journal->Directory, index);
+}
+
+static void IndexPath(const UsageJournal* journal, LPWSTR path)
+{
+	StringCchPrintfW(path, MAX_PATH, L"%s\\usage.idx", journal->Directory);
+}
+
+static void UnmapFile(UsageView* view)
+{
+	if (view->Base != NULL)
+	{
+		UnmapViewOfFile(view->Base);
+	}
+	if (view->Mapping != NULL)
+	{
+		CloseHandle(view->Mapping);
+	}
+	if (view->File != NULL && view->File != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(view->File);
+	}
+
+	memset(view, 0, sizeof(UsageView));
+}
+
+// Maps size bytes of the file, growing it as needed when writable. size 0 maps the file as it is.
+static DWORD MapFile(LPCWSTR path, BOOL write, DWORD disposition, SIZE_T size, UsageView* view)
+{
+	memset(view, 0, sizeof(UsageView));
+
+	view->File = CreateFileW(path, write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (view->File == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(view->File, &fileSize))
+	{
+		DWORD result = GetLastError();
+		UnmapFile(view);
+		return result;
+	}
+
+	if (size == 0)
+	{
+		size = (SIZE_T)fileSize.QuadPart;
+	}
+	else if (!write && (ULONGLONG)fileSize.QuadPart < size)
+	{
+		UnmapFile(view);
+		return ERROR_FILE_CORRUPT;
+	}
+
+	if (size == 0)
+	{
+		UnmapFile(view);
+		return ERROR_FILE_CORRUPT;
+	}
+
+	view->Mapping = CreateFileMappingW(view->File, NULL, write ? PAGE_READWRITE : PAGE_READONLY, (DWORD)((ULONGLONG)size >> 32), (DWORD)size, NULL);
+	view->Base = view->Mapping != NULL ? (BYTE*)MapViewOfFile(view->Mapping, write ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size) : NULL;
+
+	if (view->Base == NULL)
+	{
+		DWORD result = GetLastError();
+		UnmapFile(view);
+		return result;
+	}
+
+	view->Size = size;
+
+	return ERROR_SUCCESS;
+}
+
+static UsageRecord* ViewRecords(const UsageView* view)
+{
+	return (UsageRecord*)(view->Base + sizeof(UsageSegmentHeader));
+}
+
+static UsageIndexHeader* IndexHeader(UsageJournal* journal)
+{
+	return (UsageIndexHeader*)journal->Index.Base;
+}
+
+static UsageBucket* IndexBuckets(UsageJournal* journal)
+{
+	return (UsageBucket*)(journal->Index.Base + sizeof(UsageIndexHeader));
+}
+
+// Records of segment position, mapping it through the reader view unless it's the active one
+static const UsageRecord* SegmentRecords(UsageJournal* journal, UINT position)
+{
+	if (position == journal->SegmentCount - 1)
+	{
+		return ViewRecords(&journal->Active);
+	}
+
+	UINT32 index = journal->Segments[position].Index;
+	if (journal->ReaderIndex != index)
+	{
+		WCHAR path[MAX_PATH];
+
+		UnmapFile(&journal->Reader);
+		journal->ReaderIndex = USAGE_NO_SEGMENT;
+
+		SegmentPath(journal, index, path);
+		if (MapFile(path, FALSE, OPEN_EXISTING, SegmentSize(), &journal->Reader) != ERROR_SUCCESS)
+		{
+			return NULL;
+		}
+		journal->ReaderIndex = index;
+	}
+
+	return ViewRecords(&journal->Reader);
+}
+
+static int CompareSegments(const void* a, const void* b)
+{
+	UINT32 x = ((const UsageSegment*)a)->Index;
+	UINT32 y = ((const UsageSegment*)b)->Index;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static DWORD AddSegment(UsageJournal* journal, const UsageSegment* segment)
+{
+	if (journal->SegmentCount == journal->SegmentCapacity)
+	{
+		UINT capacity = journal->SegmentCapacity == 0 ? 64 : journal->SegmentCapacity * 2;
+		UsageSegment* segments = journal->Segments == NULL
+			? (UsageSegment*)HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(UsageSegment))
+			: (UsageSegment*)HeapReAlloc(GetProcessHeap(), 0, journal->Segments, capacity * sizeof(UsageSegment));
+
+		if (segments == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		journal->Segments = segments;
+		journal->SegmentCapacity = capacity;
+	}
+
+	journal->Segments[journal->SegmentCount++] = *segment;
+
+	return ERROR_SUCCESS;
+}
+
+// Reads the header and first record of each segment file, files with a bad header are left out
+static DWORD LoadSegments(UsageJournal* journal)
+{
+	WCHAR path[MAX_PATH];
+	WIN32_FIND_DATAW found;
+
+	StringCchPrintfW(path, MAX_PATH, L"%s\\%s", journal->Directory, USAGE_SEGMENT_PATTERN);
+
+	HANDLE find = FindFirstFileW(path, &found);
+	if (find == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError() == ERROR_FILE_NOT_FOUND ? ERROR_SUCCESS : GetLastError();
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	do
+	{
+		struct
+		{
+			UsageSegmentHeader Header;
+			UsageRecord First;
+		} head;
+		DWORD read = 0;
+
+		UINT32 index = (UINT32)wcstoul(found.cFileName + USAGE_SEGMENT_PREFIX_LENGTH, NULL, 10);
+		SegmentPath(journal, index, path);
+
+		HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			continue;
+		}
+
+		BOOL ok = ReadFile(file, &head, sizeof(head), &read, NULL) && read == sizeof(head);
+		CloseHandle(file);
+
+		if (!ok || head.Header.Magic != USAGE_SEGMENT_MAGIC || head.Header.Version != USAGE_JOURNAL_VERSION || head.Header.Index != index
+			|| head.Header.Capacity != USAGE_JOURNAL_SEGMENT_RECORDS || head.Header.Checksum != Checksum(&head.Header, sizeof(UsageSegmentHeader)))
+		{
+			NATIVELOG_WARNING("usage journal: ignoring segment %u with a bad header\n", index);
+			continue;
+		}
+
+		UsageSegment segment;
+		segment.Index = index;
+		segment.FirstSequence = head.Header.FirstSequence;
+		segment.FirstTime = RecordValid(&head.First, segment.FirstSequence) ? head.First.Time : 0;
+		// Only the last segment can be partly written, LoadActive counts it
+		segment.Count = segment.FirstTime != 0 ? USAGE_JOURNAL_SEGMENT_RECORDS : 0;
+
+		result = AddSegment(journal, &segment);
+	} while (result == ERROR_SUCCESS && FindNextFileW(find, &found));
+
+	FindClose(find);
+
+	if (journal->SegmentCount > 1)
+	{
+		qsort(journal->Segments, journal->SegmentCount, sizeof(UsageSegment), CompareSegments);
+	}
+
+	return result;
+}
+
+static DWORD CreateSegment(UsageJournal* journal, UINT32 index, UINT64 firstSequence)
+{
+	WCHAR path[MAX_PATH];
+
+	SegmentPath(journal, index, path);
+
+	DWORD result = MapFile(path, TRUE, CREATE_ALWAYS, SegmentSize(), &journal->Active);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	UsageSegmentHeader* header = (UsageSegmentHeader*)journal->Active.Base;
+	header->Magic = USAGE_SEGMENT_MAGIC;
+	header->Version = USAGE_JOURNAL_VERSION;
+	header->Index = index;
+	header->Capacity = USAGE_JOURNAL_SEGMENT_RECORDS;
+	header->FirstSequence = firstSequence;
+	header->Checksum = Checksum(header, sizeof(UsageSegmentHeader));
+
+	UsageSegment segment = { index, firstSequence, 0, 0 };
+
+	return AddSegment(journal, &segment);
+}
+
+// Maps the last segment and finds where appending carries on, the first slot that doesn't hold a valid record
+static DWORD LoadActive(UsageJournal* journal)
+{
+	WCHAR path[MAX_PATH];
+	UsageSegment* last = &journal->Segments[journal->SegmentCount - 1];
+
+	SegmentPath(journal, last->Index, path);
+
+	DWORD result = MapFile(path, TRUE, OPEN_EXISTING, SegmentSize(), &journal->Active);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	const UsageRecord* records = ViewRecords(&journal->Active);
+	UINT32 previous = 0;
+	UINT32 count = 0;
+
+	while (count < USAGE_JOURNAL_SEGMENT_RECORDS && RecordValid(&records[count], last->FirstSequence + count) && records[count].Time >= previous)
+	{
+		previous = records[count++].Time;
+	}
+
+	last->Count = count;
+	last->FirstTime = count > 0 ? records[0].Time : 0;
+
+	return ERROR_SUCCESS;
+}
+
+// Adds the records with startTime <= time < endTime. ERROR_NOT_FOUND when the range starts before the oldest
+// segment still kept. lastSequence, if given, receives the sequence of the last record added.
+static DWORD ScanRange(UsageJournal* journal, UINT32 startTime, UINT32 endTime, UsageTotals* totals, UINT64* lastSequence)
+{
+	UINT first = 0;
+
+	if (journal->SegmentCount == 0 || journal->Segments[0].Count == 0)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	if (journal->Segments[0].FirstSequence != 0 && startTime < journal->Segments[0].FirstTime)
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	// Last segment starting at or before startTime
+	UINT low = 0;
+	UINT high = journal->SegmentCount;
+	while (low < high)
+	{
+		UINT middle = (low + high) / 2;
+		if (journal->Segments[middle].Count > 0 && journal->Segments[middle].FirstTime <= startTime)
+		{
+			first = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	for (UINT position = first; position < journal->SegmentCount; position++)
+	{
+		const UsageSegment* segment = &journal->Segments[position];
+		if (segment->Count == 0 || segment->FirstTime >= endTime)
+		{
+			break;
+		}
+
+		const UsageRecord* records = SegmentRecords(journal, position);
+		if (records == NULL)
+		{
+			return ERROR_FILE_CORRUPT;
+		}
+
+		UINT32 begin = 0;
+		UINT32 end = segment->Count;
+		while (begin < end)
+		{
+			UINT32 middle = (begin + end) / 2;
+			if (records[middle].Time < startTime)
+			{
+				begin = middle + 1;
+			}
+			else
+			{
+				end = middle;
+			}
+		}
+
+		UINT32 i;
+		for (i = begin; i < segment->Count && records[i].Time < endTime; i++)
+		{
+			totals->TxBytes += records[i].TxBytes;
+			totals->RxBytes += records[i].RxBytes;
+			totals->Records++;
+			if (lastSequence != NULL)
+			{
+				*lastSequence = segment->FirstSequence + i;
+			}
+		}
+
+		if (i < segment->Count)
+		{
+			break;
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static void FenwickAdd(UsageJournal* journal, UINT bucket, UINT64 txBytes, UINT64 rxBytes, UINT64 records)
+{
+	for (UINT k = bucket + 1; k <= journal->FenwickSize; k += k & (0 - k))
+	{
+		journal->Fenwick[k].TxBytes += txBytes;
+		journal->Fenwick[k].RxBytes += rxBytes;
+		journal->Fenwick[k].Records += records;
+	}
+}
+
+// Sums buckets [0, bucket)
+static void FenwickPrefix(const UsageJournal* journal, UINT bucket, UsageTotals* totals, BOOL subtract)
+{
+	for (UINT k = min(bucket, journal->FenwickSize); k > 0; k -= k & (0 - k))
+	{
+		if (subtract)
+		{
+			totals->TxBytes -= journal->Fenwick[k].TxBytes;
+			totals->RxBytes -= journal->Fenwick[k].RxBytes;
+			totals->Records -= journal->Fenwick[k].Records;
+		}
+		else
+		{
+			totals->TxBytes += journal->Fenwick[k].TxBytes;
+			totals->RxBytes += journal->Fenwick[k].RxBytes;
+			totals->Records += journal->Fenwick[k].Records;
+		}
+	}
+}
+
+// Builds the tree over the index buckets in O(n)
+static DWORD BuildFenwick(UsageJournal* journal)
+{
+	UINT size = IndexHeader(journal)->Capacity;
+	UsageTotals* tree = (UsageTotals*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ((SIZE_T)size + 1) * sizeof(UsageTotals));
+	if (tree == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	const UsageBucket* buckets = IndexBuckets(journal);
+
+	for (UINT k = 1; k <= size; k++)
+	{
+		tree[k].TxBytes += buckets[k - 1].TxBytes;
+		tree[k].RxBytes += buckets[k - 1].RxBytes;
+		tree[k].Records += buckets[k - 1].Records;
+
+		UINT parent = k + (k & (0 - k));
+		if (parent <= size)
+		{
+			tree[parent].TxBytes += tree[k].TxBytes;
+			tree[parent].RxBytes += tree[k].RxBytes;
+			tree[parent].Records += tree[k].Records;
+		}
+	}
+
+	if (journal->Fenwick != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, journal->Fenwick);
+	}
+	journal->Fenwick = tree;
+	journal->FenwickSize = size;
+
+	return ERROR_SUCCESS;
+}
+
+static void SealIndexHeader(UsageJournal* journal)
+{
+	UsageIndexHeader* header = IndexHeader(journal);
+	header->Checksum = Checksum(header, sizeof(UsageIndexHeader));
+}
+
+static DWORD GrowIndex(UsageJournal* journal, UINT needed)
+{
+	WCHAR path[MAX_PATH];
+	UINT capacity = IndexHeader(journal)->Capacity;
+
+	while (capacity < needed)
+	{
+		capacity *= 2;
+	}
+
+	IndexPath(journal, path);
+	UnmapFile(&journal->Index);
+
+	// Growing the mapping grows the file, the new buckets read as zero
+	DWORD result = MapFile(path, TRUE, OPEN_EXISTING, sizeof(UsageIndexHeader) + (SIZE_T)capacity * sizeof(UsageBucket), &journal->Index);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	IndexHeader(journal)->Capacity = capacity;
+	SealIndexHeader(journal);
+
+	return BuildFenwick(journal);
+}
+
+// Folds one record into its hourly bucket and the tree
+static DWORD IndexRecord(UsageJournal* journal, const UsageRecord* record, UINT64 sequence)
+{
+	UsageIndexHeader* header = IndexHeader(journal);
+	UINT32 hour = record->Time / USAGE_SECONDS_PER_HOUR;
+
+	if (header->FirstHour == 0)
+	{
+		header->FirstHour = hour;
+		SealIndexHeader(journal);
+	}
+
+	if (hour < header->FirstHour)
+	{
+		return ERROR_INVALID_DATA;
+	}
+
+	UINT bucket = hour - header->FirstHour;
+	if (bucket >= header->Capacity)
+	{
+		DWORD result = GrowIndex(journal, bucket + 1);
+		if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+	}
+
+	UsageBucket* entry = &IndexBuckets(journal)[bucket];
+	entry->TxBytes += record->TxBytes;
+	entry->RxBytes += record->RxBytes;
+	entry->Records++;
+	entry->LastSequence = sequence;
+	entry->Checksum = Checksum(entry, sizeof(UsageBucket));
+
+	if (journal->Fenwick != NULL)
+	{
+		FenwickAdd(journal, bucket, record->TxBytes, record->RxBytes, 1);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+// Starts the index over and folds in every record still on disk
+static DWORD RebuildIndex(UsageJournal* journal)
+{
+	WCHAR path[MAX_PATH];
+	UINT32 firstHour = journal->SegmentCount > 0 ? journal->Segments[0].FirstTime / USAGE_SECONDS_PER_HOUR : 0;
+	UINT32 lastHour = journal->LastTime / USAGE_SECONDS_PER_HOUR;
+	UINT capacity = USAGE_INDEX_INITIAL_HOURS;
+
+	while (firstHour != 0 && capacity <= lastHour - firstHour)
+	{
+		capacity *= 2;
+	}
+
+	NATIVELOG_INFO("usage journal: rebuilding the hourly index\n");
+
+	IndexPath(journal, path);
+	UnmapFile(&journal->Index);
+
+	DWORD result = MapFile(path, TRUE, CREATE_ALWAYS, sizeof(UsageIndexHeader) + (SIZE_T)capacity * sizeof(UsageBucket), &journal->Index);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	UsageIndexHeader* header = IndexHeader(journal);
+	header->Magic = USAGE_INDEX_MAGIC;
+	header->Version = USAGE_JOURNAL_VERSION;
+	header->FirstHour = firstHour;
+	header->Capacity = capacity;
+	SealIndexHeader(journal);
+
+	for (UINT position = 0; position < journal->SegmentCount && result == ERROR_SUCCESS; position++)
+	{
+		const UsageSegment* segment = &journal->Segments[position];
+		const UsageRecord* records = SegmentRecords(journal, position);
+
+		if (records == NULL)
+		{
+			continue;
+		}
+
+		for (UINT32 i = 0; i < segment->Count && result == ERROR_SUCCESS; i++)
+		{
+			result = IndexRecord(journal, &records[i], segment->FirstSequence + i);
+		}
+	}
+
+	return result;
+}
+
+// Recomputes a bucket a crash left half written
+static DWORD RepairBucket(UsageJournal* journal, UINT bucket)
+{
+	UsageTotals totals = { 0, 0, 0 };
+	UINT64 lastSequence = 0;
+	UINT32 hour = IndexHeader(journal)->FirstHour + bucket;
+
+	DWORD result = ScanRange(journal, hour * USAGE_SECONDS_PER_HOUR, (hour + 1) * USAGE_SECONDS_PER_HOUR, &totals, &lastSequence);
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_WARNING("usage journal: hour %u can't be repaired, its segment is gone\n", hour);
+	}
+
+	UsageBucket* entry = &IndexBuckets(journal)[bucket];
+	entry->TxBytes = totals.TxBytes;
+	entry->RxBytes = totals.RxBytes;
+	entry->Records = (UINT32)totals.Records;
+	entry->LastSequence = lastSequence;
+	entry->Checksum = totals.Records > 0 ? Checksum(entry, sizeof(UsageBucket)) : 0;
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD LoadIndex(UsageJournal* journal)
+{
+	WCHAR path[MAX_PATH];
+
+	IndexPath(journal, path);
+
+	if (MapFile(path, TRUE, OPEN_EXISTING, 0, &journal->Index) != ERROR_SUCCESS || journal->Index.Size < sizeof(UsageIndexHeader))
+	{
+		return RebuildIndex(journal);
+	}
+
+	UsageIndexHeader* header = IndexHeader(journal);
+	if (header->Magic != USAGE_INDEX_MAGIC || header->Version != USAGE_JOURNAL_VERSION || header->Checksum != Checksum(header, sizeof(UsageIndexHeader))
+		|| header->Capacity == 0 || journal->Index.Size < sizeof(UsageIndexHeader) + (SIZE_T)header->Capacity * sizeof(UsageBucket))
+	{
+		return RebuildIndex(journal);
+	}
+
+	UsageBucket* buckets = IndexBuckets(journal);
+	for (UINT bucket = 0; bucket < header->Capacity; bucket++)
+	{
+		// A bucket can also hold a record that was torn after the bucket was written
+		if (!BucketValid(&buckets[bucket]) || (buckets[bucket].Records > 0 && buckets[bucket].LastSequence >= journal->NextSequence))
+		{
+			RepairBucket(journal, bucket);
+		}
+	}
+
+	// A crash between writing the last record and indexing it leaves the record unindexed
+	if (journal->NextSequence > 0)
+	{
+		const UsageSegment* last = &journal->Segments[journal->SegmentCount - 1];
+		UINT position = last->Count > 0 ? journal->SegmentCount - 1 : journal->SegmentCount - 2;
+		const UsageRecord* records = SegmentRecords(journal, position);
+
+		if (records != NULL)
+		{
+			const UsageSegment* segment = &journal->Segments[position];
+			const UsageRecord* record = &records[segment->Count - 1];
+			UINT32 hour = record->Time / USAGE_SECONDS_PER_HOUR;
+			UINT bucket = hour - header->FirstHour;
+
+			if (header->FirstHour == 0 || bucket >= header->Capacity || buckets[bucket].Records == 0 || buckets[bucket].LastSequence < journal->NextSequence - 1)
+			{
+				return IndexRecord(journal, record, journal->NextSequence - 1);
+			}
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static void FreeJournal(UsageJournal* journal)
+{
+	UnmapFile(&journal->Active);
+	UnmapFile(&journal->Reader);
+	UnmapFile(&journal->Index);
+
+	if (journal->EdgeFile != NULL)
+	{
+		CloseHandle(journal->EdgeFile);
+	}
+	if (journal->EdgeRecords != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, journal->EdgeRecords);
+	}
+	if (journal->Segments != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, journal->Segments);
+	}
+	if (journal->Fenwick != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, journal->Fenwick);
+	}
+
+	HeapFree(GetProcessHeap(), 0, journal);
+}
+
+DWORD UsageJournalOpen(LPCWSTR directory, UINT maxSegments, HUSAGEJOURNAL* journal)
+{
+	if (directory == NULL || journal == NULL || maxSegments == 1)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*journal = NULL;
+
+	UsageJournal* opened = (UsageJournal*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(UsageJournal));
+	if (opened == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	InitializeSRWLock(&opened->Lock);
+	opened->MaxSegments = maxSegments;
+	opened->ReaderIndex = USAGE_NO_SEGMENT;
+	opened->EdgeIndex = USAGE_NO_SEGMENT;
+	opened->EdgeRecords = (UsageRecord*)HeapAlloc(GetProcessHeap(), 0, USAGE_EDGE_CHUNK_RECORDS * sizeof(UsageRecord));
+	if (opened->EdgeRecords == NULL)
+	{
+		FreeJournal(opened);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	DWORD result = FAILED(StringCchCopyW(opened->Directory, MAX_PATH, directory)) ? ERROR_FILENAME_EXCED_RANGE : ERROR_SUCCESS;
+
+	if (result == ERROR_SUCCESS && !CreateDirectoryW(directory, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+	{
+		result = GetLastError();
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = LoadSegments(opened);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = opened->SegmentCount == 0 ? CreateSegment(opened, 0, 0) : LoadActive(opened);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		const UsageSegment* last = &opened->Segments[opened->SegmentCount - 1];
+		opened->NextSequence = last->FirstSequence + last->Count;
+
+		if (last->Count > 0)
+		{
+			opened->LastTime = ViewRecords(&opened->Active)[last->Count - 1].Time;
+		}
+		else if (opened->SegmentCount > 1)
+		{
+			const UsageRecord* records = SegmentRecords(opened, opened->SegmentCount - 2);
+			opened->LastTime = records != NULL ? records[opened->Segments[opened->SegmentCount - 2].Count - 1].Time : 0;
+		}
+
+		result = LoadIndex(opened);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = BuildFenwick(opened);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		FreeJournal(opened);
+		return result;
+	}
+
+	*journal = opened;
+
+	return ERROR_SUCCESS;
+}
+
+// Starts the next segment and drops the oldest ones past MaxSegments
+static DWORD Rollover(UsageJournal* journal)
+{
+	UINT32 index = journal->Segments[journal->SegmentCount - 1].Index + 1;
+
+	UnmapFile(&journal->Active);
+
+	DWORD result = CreateSegment(journal, index, journal->NextSequence);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	while (journal->MaxSegments != 0 && journal->SegmentCount > journal->MaxSegments)
+	{
+		WCHAR path[MAX_PATH];
+		UINT32 oldest = journal->Segments[0].Index;
+
+		if (journal->ReaderIndex == oldest)
+		{
+			UnmapFile(&journal->Reader);
+			journal->ReaderIndex = USAGE_NO_SEGMENT;
+		}
+		if (journal->EdgeIndex == oldest)
+		{
+			CloseHandle(journal->EdgeFile);
+			journal->EdgeFile = NULL;
+			journal->EdgeIndex = USAGE_NO_SEGMENT;
+		}
+
+		SegmentPath(journal, oldest, path);
+		if (!DeleteFileW(path))
+		{
+			NATIVELOG_WARNING("usage journal: failed to delete segment %u, error %lu\n", oldest, GetLastError());
+		}
+
+		memmove(journal->Segments, journal->Segments + 1, (journal->SegmentCount - 1) * sizeof(UsageSegment));
+		journal->SegmentCount--;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD UsageJournalAppend(HUSAGEJOURNAL journal, UINT32 time, UINT32 serverId, UINT64 txBytes, UINT64 rxBytes)
+{
+	if (journal == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&journal->Lock);
+
+	DWORD result = ERROR_SUCCESS;
+	UsageSegment* last = &journal->Segments[journal->SegmentCount - 1];
+
+	if (last->Count == USAGE_JOURNAL_SEGMENT_RECORDS)
+	{
+		result = Rollover(journal);
+		last = &journal->Segments[journal->SegmentCount - 1];
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		UsageRecord* record = &ViewRecords(&journal->Active)[last->Count];
+
+		record->Time = max(time != 0 ? time : NowUnix(), journal->LastTime);
+		record->ServerId = serverId;
+		record->TxBytes = txBytes;
+		record->RxBytes = rxBytes;
+		record->Sequence = (UINT32)journal->NextSequence;
+		// The checksum goes last, it's what commits the record
+		record->Checksum = Checksum(record, sizeof(UsageRecord));
+
+		if (last->Count++ == 0)
+		{
+			last->FirstTime = record->Time;
+		}
+		journal->LastTime = record->Time;
+
+		result = IndexRecord(journal, record, journal->NextSequence++);
+	}
+
+	ReleaseSRWLockExclusive(&journal->Lock);
+
+	return result;
+}
+
+// Position of the segment holding sequence, USAGE_NO_SEGMENT when it isn't on disk
+static UINT FindSegment(const UsageJournal* journal, UINT64 sequence)
+{
+	UINT position = USAGE_NO_SEGMENT;
+	UINT low = 0;
+	UINT high = journal->SegmentCount;
+
+	while (low < high)
+	{
+		UINT middle = (low + high) / 2;
+		if (journal->Segments[middle].FirstSequence <= sequence)
+		{
+			position = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	if (position != USAGE_NO_SEGMENT && sequence >= journal->Segments[position].FirstSequence + journal->Segments[position].Count)
+	{
+		return USAGE_NO_SEGMENT;
+	}
+
+	return position;
+}
+
+// Reads count records from sequence on, at most USAGE_EDGE_CHUNK_RECORDS and all from the one segment
+static DWORD ReadRecords(UsageJournal* journal, UINT position, UINT64 sequence, UINT32 count, const UsageRecord** records)
+{
+	const UsageSegment* segment = &journal->Segments[position];
+	UINT32 slot = (UINT32)(sequence - segment->FirstSequence);
+
+	if (position == journal->SegmentCount - 1)
+	{
+		*records = ViewRecords(&journal->Active) + slot;
+		return ERROR_SUCCESS;
+	}
+
+	if (journal->EdgeIndex != segment->Index)
+	{
+		WCHAR path[MAX_PATH];
+
+		if (journal->EdgeFile != NULL)
+		{
+			CloseHandle(journal->EdgeFile);
+		}
+		journal->EdgeIndex = USAGE_NO_SEGMENT;
+
+		SegmentPath(journal, segment->Index, path);
+		journal->EdgeFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (journal->EdgeFile == INVALID_HANDLE_VALUE)
+		{
+			journal->EdgeFile = NULL;
+			return GetLastError();
+		}
+		journal->EdgeIndex = segment->Index;
+	}
+
+	OVERLAPPED overlapped;
+	ULONGLONG offset = sizeof(UsageSegmentHeader) + (ULONGLONG)slot * sizeof(UsageRecord);
+	DWORD bytes = 0;
+
+	memset(&overlapped, 0, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+	if (!ReadFile(journal->EdgeFile, journal->EdgeRecords, count * sizeof(UsageRecord), &bytes, &overlapped) || bytes != count * sizeof(UsageRecord))
+	{
+		return ERROR_FILE_CORRUPT;
+	}
+
+	*records = journal->EdgeRecords;
+
+	return ERROR_SUCCESS;
+}
+
+// Totals of the records in the bucket's hour from before time. The index says where the hour's records are, so
+// only they are read, walking in from whichever end of the hour time is nearer.
+static DWORD HourTotalsBefore(UsageJournal* journal, const UsageBucket* bucket, UINT32 hour, UINT32 time, UsageTotals* before)
+{
+	UINT32 hourStart = hour * USAGE_SECONDS_PER_HOUR;
+	UINT64 first = bucket->LastSequence + 1 - bucket->Records;
+	BOOL forward = time - hourStart <= USAGE_SECONDS_PER_HOUR / 2;
+	UsageTotals counted = { 0, 0, 0 };
+
+	memset(before, 0, sizeof(UsageTotals));
+
+	if (bucket->Records == 0 || time <= hourStart)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	if (time >= hourStart + USAGE_SECONDS_PER_HOUR)
+	{
+		before->TxBytes = bucket->TxBytes;
+		before->RxBytes = bucket->RxBytes;
+		before->Records = bucket->Records;
+		return ERROR_SUCCESS;
+	}
+
+	// Forward counts the records before time, backward the ones from time on
+	UINT64 cursor = forward ? first : bucket->LastSequence + 1;
+	BOOL done = FALSE;
+
+	while (!done && (forward ? cursor <= bucket->LastSequence : cursor > first))
+	{
+		const UsageRecord* records;
+		UINT position = FindSegment(journal, forward ? cursor : cursor - 1);
+
+		if (position == USAGE_NO_SEGMENT)
+		{
+			return ERROR_NOT_FOUND;
+		}
+
+		const UsageSegment* segment = &journal->Segments[position];
+		UINT64 chunkStart;
+		UINT32 count;
+
+		if (forward)
+		{
+			chunkStart = cursor;
+			count = (UINT32)min(min(bucket->LastSequence + 1, segment->FirstSequence + segment->Count) - cursor, (UINT64)USAGE_EDGE_CHUNK_RECORDS);
+		}
+		else
+		{
+			chunkStart = max(max(first, segment->FirstSequence), cursor - min(cursor, (UINT64)USAGE_EDGE_CHUNK_RECORDS));
+			count = (UINT32)(cursor - chunkStart);
+		}
+
+		DWORD result = ReadRecords(journal, position, chunkStart, count, &records);
+		if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+
+		for (UINT32 n = 0; n < count; n++)
+		{
+			const UsageRecord* record = &records[forward ? n : count - 1 - n];
+
+			if (forward ? record->Time >= time : record->Time < time)
+			{
+				done = TRUE;
+				break;
+			}
+
+			counted.TxBytes += record->TxBytes;
+			counted.RxBytes += record->RxBytes;
+			counted.Records++;
+		}
+
+		cursor = forward ? cursor + count : chunkStart;
+	}
+
+	if (forward)
+	{
+		*before = counted;
+	}
+	else
+	{
+		before->TxBytes = bucket->TxBytes - counted.TxBytes;
+		before->RxBytes = bucket->RxBytes - counted.RxBytes;
+		before->Records = bucket->Records - counted.Records;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+// Totals for a range within at most two hours, the partial hours at either end of a query. Hours whose records
+// are gone are counted whole.
+static DWORD EdgeTotals(UsageJournal* journal, UINT32 startTime, UINT32 endTime, UsageTotals* totals)
+{
+	const UsageIndexHeader* header = IndexHeader(journal);
+	const UsageBucket* buckets = IndexBuckets(journal);
+
+	for (UINT32 hour = startTime / USAGE_SECONDS_PER_HOUR; hour <= (endTime - 1) / USAGE_SECONDS_PER_HOUR; hour++)
+	{
+		if (hour < header->FirstHour || hour - header->FirstHour >= header->Capacity)
+		{
+			continue;
+		}
+
+		const UsageBucket* bucket = &buckets[hour - header->FirstHour];
+		UsageTotals upToStart;
+		UsageTotals upToEnd;
+
+		if (bucket->Records == 0)
+		{
+			continue;
+		}
+
+		DWORD result = HourTotalsBefore(journal, bucket, hour, startTime, &upToStart);
+		if (result == ERROR_SUCCESS)
+		{
+			result = HourTotalsBefore(journal, bucket, hour, endTime, &upToEnd);
+		}
+
+		if (result == ERROR_NOT_FOUND)
+		{
+			upToStart.TxBytes = upToStart.RxBytes = upToStart.Records = 0;
+			upToEnd.TxBytes = bucket->TxBytes;
+			upToEnd.RxBytes = bucket->RxBytes;
+			upToEnd.Records = bucket->Records;
+		}
+		else if (result != ERROR_SUCCESS)
+		{
+			return result;
+		}
+
+		totals->TxBytes += upToEnd.TxBytes - upToStart.TxBytes;
+		totals->RxBytes += upToEnd.RxBytes - upToStart.RxBytes;
+		totals->Records += upToEnd.Records - upToStart.Records;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD UsageJournalQuery(HUSAGEJOURNAL journal, UINT32 startTime, UINT32 endTime, UsageTotals* totals)
+{
+	if (journal == NULL || totals == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(totals, 0, sizeof(UsageTotals));
+
+	if (startTime >= endTime)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	AcquireSRWLockExclusive(&journal->Lock);
+
+	DWORD result = ERROR_SUCCESS;
+	UINT32 firstHour = IndexHeader(journal)->FirstHour;
+	UINT32 wholeStart = (UINT32)(((UINT64)startTime + USAGE_SECONDS_PER_HOUR - 1) / USAGE_SECONDS_PER_HOUR);
+	UINT32 wholeEnd = endTime / USAGE_SECONDS_PER_HOUR;
+
+	if (firstHour == 0)
+	{
+		// Nothing recorded yet
+	}
+	else if (wholeStart >= wholeEnd)
+	{
+		result = EdgeTotals(journal, startTime, endTime, totals);
+	}
+	else
+	{
+		UINT bucketStart = wholeStart > firstHour ? wholeStart - firstHour : 0;
+		UINT bucketEnd = wholeEnd > firstHour ? wholeEnd - firstHour : 0;
+
+		FenwickPrefix(journal, bucketEnd, totals, FALSE);
+		FenwickPrefix(journal, bucketStart, totals, TRUE);
+
+		if (startTime < wholeStart * USAGE_SECONDS_PER_HOUR)
+		{
+			result = EdgeTotals(journal, startTime, wholeStart * USAGE_SECONDS_PER_HOUR, totals);
+		}
+		if (result == ERROR_SUCCESS && wholeEnd * USAGE_SECONDS_PER_HOUR < endTime)
+		{
+			result = EdgeTotals(journal, wholeEnd * USAGE_SECONDS_PER_HOUR, endTime, totals);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&journal->Lock);
+
+	return result;
+}
+
+DWORD UsageJournalFlush(HUSAGEJOURNAL journal)
+{
+	if (journal == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&journal->Lock);
+
+	DWORD result = ERROR_SUCCESS;
+	UsageView* views[] = { &journal->Active, &journal->Index };
+
+	for (UINT i = 0; i < 2 && result == ERROR_SUCCESS; i++)
+	{
+		if (!FlushViewOfFile(views[i]->Base, 0) || !FlushFileBuffers(views[i]->File))
+		{
+			result = GetLastError();
+		}
+	}
+
+	ReleaseSRWLockExclusive(&journal->Lock);
+
+	return result;
+}
+
+DWORD UsageJournalClose(HUSAGEJOURNAL journal)
+{
+	if (journal == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	FreeJournal(journal);
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+static void DeleteJournalFiles(LPCWSTR directory)
+{
+	WCHAR path[MAX_PATH];
+	WIN32_FIND_DATAW found;
+
+	StringCchPrintfW(path, MAX_PATH, L"%s\\%s", directory, USAGE_SEGMENT_PATTERN);
+
+	HANDLE find = FindFirstFileW(path, &found);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			StringCchPrintfW(path, MAX_PATH, L"%s\\%s", directory, found.cFileName);
+			DeleteFileW(path);
+		} while (FindNextFileW(find, &found));
+
+		FindClose(find);
+	}
+
+	StringCchPrintfW(path, MAX_PATH, L"%s\\usage.idx", directory);
+	DeleteFileW(path);
+}
+
+static DOUBLE ElapsedNs(LARGE_INTEGER start, LARGE_INTEGER frequency)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	return (DOUBLE)(now.QuadPart - start.QuadPart) * 1e9 / frequency.QuadPart;
+}
+
+DWORD UsageJournalRunBenchmark(LPCWSTR directory, UINT64 samples, UINT queries, UsageJournalBenchReport* report)
+{
+	HUSAGEJOURNAL journal;
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	// 2020-01-01 00:00:00 UTC
+	const UINT32 baseTime = 1577836800;
+
+	if (directory == NULL || report == NULL || samples == 0 || samples > 0xFFFFFFFFULL - baseTime)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(report, 0, sizeof(UsageJournalBenchReport));
+	QueryPerformanceFrequency(&frequency);
+	DeleteJournalFiles(directory);
+
+	DWORD result = UsageJournalOpen(directory, 0, &journal);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	QueryPerformanceCounter(&start);
+	for (UINT64 i = 0; i < samples && result == ERROR_SUCCESS; i++)
+	{
+		result = UsageJournalAppend(journal, baseTime + (UINT32)i, (UINT32)(i % 16), 1000 + i % 7, 5000 + i % 13);
+	}
+	report->AppendNsMean = ElapsedNs(start, frequency) / samples;
+	report->Samples = samples;
+	report->Segments = journal->SegmentCount;
+
+	UINT64 random = 0x9E3779B97F4A7C15ULL;
+	UsageTotals totals;
+
+	QueryPerformanceCounter(&start);
+	for (UINT i = 0; i < queries && result == ERROR_SUCCESS; i++)
+	{
+		NextRandom(&random);
+
+		UINT32 length = 86400 + (UINT32)(random % (30 * 86400));
+		UINT32 from = baseTime + (UINT32)((random >> 20) % samples);
+
+		result = UsageJournalQuery(journal, from, from + length, &totals);
+	}
+	report->QueryNsMean = queries > 0 ? ElapsedNs(start, frequency) / queries : 0;
+
+	UsageJournalClose(journal);
+
+	if (result == ERROR_SUCCESS)
+	{
+		QueryPerformanceCounter(&start);
+		result = UsageJournalOpen(directory, 0, &journal);
+		report->OpenMs = ElapsedNs(start, frequency) / 1e6;
+
+		if (result == ERROR_SUCCESS)
+		{
+			UsageJournalClose(journal);
+		}
+	}
+
+	return result;
+}
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+#include <windows.h>
+
+// Records per segment file, about 12 days of one second samples in 32MB
+#define USAGE_JOURNAL_SEGMENT_RECORDS (1 << 20)
+
+typedef struct _UsageJournal* HUSAGEJOURNAL;
+
+typedef struct _UsageTotals
+{
+	UINT64 TxBytes;
+	UINT64 RxBytes;
+	UINT64 Records;
+} UsageTotals;
+
+// Opens or creates the journal in directory. maxSegments caps how many segment files are kept, 0 keeps all.
+// Recovery drops a record torn by a crash and repairs the hourly index from the segments.
+extern DWORD UsageJournalOpen(LPCWSTR directory, UINT maxSegments, HUSAGEJOURNAL* journal);
+
+// Appends one sample, time is Unix seconds and 0 means now. Times never go backwards in the journal, an
+// earlier time is recorded as the latest one seen.
+extern DWORD UsageJournalAppend(HUSAGEJOURNAL journal, UINT32 time, UINT32 serverId, UINT64 txBytes, UINT64 rxBytes);
+
+// Sums the samples with startTime <= time < endTime. Whole hours come from the index in O(log n), the partial
+// hours at either end are read from the segments. Once their segments have been dropped the partial hours are
+// counted whole.
+extern DWORD UsageJournalQuery(HUSAGEJOURNAL journal, UINT32 startTime, UINT32 endTime, UsageTotals* totals);
+
+// Writes mapped records and index to disk, samples are otherwise only as durable as the OS page cache
+extern DWORD UsageJournalFlush(HUSAGEJOURNAL journal);
+extern DWORD UsageJournalClose(HUSAGEJOURNAL journal);
+
+#ifdef NATIVE_BENCH
+typedef struct _UsageJournalBenchReport
+{
+	UINT64 Samples;
+	UINT Segments;
+	DOUBLE AppendNsMean;
+	DOUBLE QueryNsMean;
+	DOUBLE OpenMs;
+} UsageJournalBenchReport;
+
+// Appends samples one second apart to a fresh journal in directory, then times queries over random day to
+// month long ranges and reopening the journal. The directory's journal files are deleted first.
+extern DWORD UsageJournalRunBenchmark(LPCWSTR directory, UINT64 samples, UINT queries, UsageJournalBenchReport* report);
+#endif
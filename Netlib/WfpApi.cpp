@@ -0,0 +1,243 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <fwpmu.h>
+#include "WfpApi.h"
+#include "NativeLog.h"
+#include "Recorder.h"
+#include "Trace.h"
+
+#define WFP_API_MODULE L"fwpuclnt.dll"
+
+static SRWLOCK Lock = SRWLOCK_INIT;
+static HMODULE Module = NULL;
+static WFP_API LoadedApi;
+static LONG Holders = 0;
+static ULONGLONG LastReleaseTick = 0;
+// Set by WfpSetApi, fwpuclnt isn't loaded for calls while it is
+static const WFP_API* volatile OverrideApi = NULL;
+
+#define WFP_API_RESOLVE(field, name) ((LoadedApi.field = (decltype(LoadedApi.field))GetProcAddress(Module, name)) != NULL)
+
+// Called with the lock held exclusive
+static DWORD Load()
+{
+	Module = LoadLibraryExW(WFP_API_MODULE, NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+	if (Module == NULL)
+	{
+		DWORD error = GetLastError();
+		NATIVELOG_ERROR("failed to load fwpuclnt: %lu\n", error);
+		return error;
+	}
+
+	if (!WFP_API_RESOLVE(EngineOpen0, "FwpmEngineOpen0") ||
+		!WFP_API_RESOLVE(EngineClose0, "FwpmEngineClose0") ||
+		!WFP_API_RESOLVE(SubLayerAdd0, "FwpmSubLayerAdd0") ||
+		!WFP_API_RESOLVE(SubLayerDeleteByKey0, "FwpmSubLayerDeleteByKey0") ||
+		!WFP_API_RESOLVE(FilterAdd0, "FwpmFilterAdd0") ||
+		!WFP_API_RESOLVE(FilterDeleteByKey0, "FwpmFilterDeleteByKey0") ||
+		!WFP_API_RESOLVE(FilterGetByKey0, "FwpmFilterGetByKey0") ||
+		!WFP_API_RESOLVE(GetAppIdFromFileName0, "FwpmGetAppIdFromFileName0") ||
+		!WFP_API_RESOLVE(FreeMemory0, "FwpmFreeMemory0"))
+	{
+		NATIVELOG_ERROR("fwpuclnt is missing an entry point\n");
+		FreeLibrary(Module);
+		Module = NULL;
+		ZeroMemory(&LoadedApi, sizeof(LoadedApi));
+		return ERROR_PROC_NOT_FOUND;
+	}
+
+	NATIVELOG_INFO("loaded fwpuclnt\n");
+
+	return ERROR_SUCCESS;
+}
+
+DWORD WfpApiAcquire()
+{
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockExclusive(&Lock);
+	if (Module == NULL && OverrideApi == NULL)
+	{
+		result = Load();
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		Holders++;
+	}
+	ReleaseSRWLockExclusive(&Lock);
+
+	return result;
+}
+
+void WfpApiRelease()
+{
+	AcquireSRWLockExclusive(&Lock);
+	Holders--;
+	LastReleaseTick = GetTickCount64();
+	ReleaseSRWLockExclusive(&Lock);
+}
+
+// The table the recording wrappers call through
+static const WFP_API* Unrecorded()
+{
+	const WFP_API* api = OverrideApi;
+	return api != NULL ? api : &LoadedApi;
+}
+
+static INT64 RecordStart()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+// Filters and sublayers are identified by their keys and layers, the condition values point into the caller
+// and are left out
+static DWORD WINAPI RecordedEngineOpen0(const wchar_t* serverName, UINT32 authnService, SEC_WINNT_AUTH_IDENTITY_W* authIdentity, const FWPM_SESSION0* session, HANDLE* engineHandle)
+{
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->EngineOpen0(serverName, authnService, authIdentity, session, engineHandle);
+	RecorderRecord(TraceProbeEngineOpen, RECORDER_DIGEST_SEED, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedEngineClose0(HANDLE engineHandle)
+{
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->EngineClose0(engineHandle);
+	RecorderRecord(TraceProbeEngineClose, RECORDER_DIGEST_SEED, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedSubLayerAdd0(HANDLE engineHandle, const FWPM_SUBLAYER0* subLayer, PSECURITY_DESCRIPTOR sd)
+{
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, &subLayer->subLayerKey, sizeof(GUID));
+	digest = RecorderDigest(digest, &subLayer->flags, sizeof(subLayer->flags));
+	digest = RecorderDigest(digest, &subLayer->weight, sizeof(subLayer->weight));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->SubLayerAdd0(engineHandle, subLayer, sd);
+	RecorderRecord(TraceProbeSubLayerAdd, digest, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedSubLayerDeleteByKey0(HANDLE engineHandle, const GUID* key)
+{
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, key, sizeof(GUID));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->SubLayerDeleteByKey0(engineHandle, key);
+	RecorderRecord(TraceProbeSubLayerDelete, digest, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedFilterAdd0(HANDLE engineHandle, const FWPM_FILTER0* filter, PSECURITY_DESCRIPTOR sd, UINT64* id)
+{
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, &filter->filterKey, sizeof(GUID));
+	digest = RecorderDigest(digest, &filter->layerKey, sizeof(GUID));
+	digest = RecorderDigest(digest, &filter->action.type, sizeof(filter->action.type));
+	digest = RecorderDigest(digest, &filter->numFilterConditions, sizeof(filter->numFilterConditions));
+	for (UINT32 i = 0; i < filter->numFilterConditions; i++)
+	{
+		digest = RecorderDigest(digest, &filter->filterCondition[i].fieldKey, sizeof(GUID));
+		digest = RecorderDigest(digest, &filter->filterCondition[i].matchType, sizeof(filter->filterCondition[i].matchType));
+	}
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->FilterAdd0(engineHandle, filter, sd, id);
+	RecorderRecord(TraceProbeFilterAdd, digest, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedFilterDeleteByKey0(HANDLE engineHandle, const GUID* key)
+{
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, key, sizeof(GUID));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->FilterDeleteByKey0(engineHandle, key);
+	RecorderRecord(TraceProbeFilterDelete, digest, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedFilterGetByKey0(HANDLE engineHandle, const GUID* key, FWPM_FILTER0** filter)
+{
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, key, sizeof(GUID));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->FilterGetByKey0(engineHandle, key, filter);
+	RecorderRecord(TraceProbeFilterGet, digest, result, start);
+	return result;
+}
+
+static DWORD WINAPI RecordedGetAppIdFromFileName0(const wchar_t* fileName, FWP_BYTE_BLOB** appId)
+{
+	UINT32 digest = RecorderDigestString(RECORDER_DIGEST_SEED, fileName);
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->GetAppIdFromFileName0(fileName, appId);
+	RecorderRecord(TraceProbeAppId, digest, result, start);
+	return result;
+}
+
+static void WINAPI RecordedFreeMemory0(void** p)
+{
+	Unrecorded()->FreeMemory0(p);
+}
+
+static const WFP_API RecordedApi =
+{
+	RecordedEngineOpen0,
+	RecordedEngineClose0,
+	RecordedSubLayerAdd0,
+	RecordedSubLayerDeleteByKey0,
+	RecordedFilterAdd0,
+	RecordedFilterDeleteByKey0,
+	RecordedFilterGetByKey0,
+	RecordedGetAppIdFromFileName0,
+	RecordedFreeMemory0,
+};
+
+const WFP_API* WfpGetApi()
+{
+	return RecorderActive != 0 ? &RecordedApi : Unrecorded();
+}
+
+DWORD WfpSetApi(const WFP_API* api)
+{
+	if (api == &RecordedApi)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&Lock);
+	OverrideApi = api;
+	ReleaseSRWLockExclusive(&Lock);
+
+	return ERROR_SUCCESS;
+}
+
+BOOL WfpApiUnloadIdle(DWORD idleMs)
+{
+	BOOL unloaded = FALSE;
+
+	AcquireSRWLockExclusive(&Lock);
+	if (Module != NULL && Holders == 0 && GetTickCount64() - LastReleaseTick >= idleMs)
+	{
+		FreeLibrary(Module);
+		Module = NULL;
+		ZeroMemory(&LoadedApi, sizeof(LoadedApi));
+		unloaded = TRUE;
+	}
+	ReleaseSRWLockExclusive(&Lock);
+
+	if (unloaded)
+	{
+		NATIVELOG_INFO("unloaded fwpuclnt\n");
+	}
+
+	return unloaded;
+}
+
+BOOL WfpApiLoaded()
+{
+	AcquireSRWLockShared(&Lock);
+	BOOL loaded = Module != NULL;
+	ReleaseSRWLockShared(&Lock);
+
+	return loaded;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <winsock2.h>
+#include <windows.h>
+#include <fwpmu.h>
+
+// Table of the fwpuclnt entry points the killswitch uses. Fwpuclnt isn't linked, WfpApiAcquire loads it the first
+// time a killswitch call needs the engine and WfpApiUnloadIdle lets it go again.
+typedef struct _WFP_API
+{
+	decltype(&FwpmEngineOpen0) EngineOpen0;
+	decltype(&FwpmEngineClose0) EngineClose0;
+	decltype(&FwpmSubLayerAdd0) SubLayerAdd0;
+	decltype(&FwpmSubLayerDeleteByKey0) SubLayerDeleteByKey0;
+	decltype(&FwpmFilterAdd0) FilterAdd0;
+	decltype(&FwpmFilterDeleteByKey0) FilterDeleteByKey0;
+	decltype(&FwpmFilterGetByKey0) FilterGetByKey0;
+	decltype(&FwpmGetAppIdFromFileName0) GetAppIdFromFileName0;
+	decltype(&FwpmFreeMemory0) FreeMemory0;
+} WFP_API;
+
+// Loads fwpuclnt if it isn't and holds it loaded until the matching WfpApiRelease. Calls may nest.
+extern DWORD WfpApiAcquire();
+extern void WfpApiRelease();
+
+// The table to call through, only valid between WfpApiAcquire and WfpApiRelease. While recording (see
+// Recorder.h) this is a wrapper recording each call into the engine.
+extern const WFP_API* WfpGetApi();
+
+// Swaps fwpuclnt for another implementation, as the replayer does (see Replay.h), NULL goes back to fwpuclnt.
+// Only swap while no killswitch call is in flight.
+extern DWORD WfpSetApi(const WFP_API* api);
+
+// Unloads fwpuclnt when nothing holds it and nothing has for idleMs, returns whether it did
+extern BOOL WfpApiUnloadIdle(DWORD idleMs);
+
+extern BOOL WfpApiLoaded();
@@ -10,6 +10,13 @@
 #include <ws2ipdef.h>
 #include <iphlpapi.h>
 #include <WS2tcpip.h>
+#include "NativeLog.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "FlightRecorder.h"
+#include "PortPolicy.h"
+#include "KillswitchPolicy.h"
+#include "WfpApi.h"
 #if __MINGW
 #include "wfpm_defines.h"
 #endif
@@ -30,6 +37,11 @@ DEFINE_GUID(WFPKS_DEFAULT_FILTER_GUID, 0xcd69ac10, 0x275d, 0x43a0, 0xb3, 0x69, 0
 DEFINE_GUID(WFPKS_DEFAULT_BLOCKALL_FILTER_GUID, 0x68a634d6, 0xee7b, 0x43be, 0x85, 0x96, 0x7e, 0x66, 0x5b, 0x91, 0xe5, 0x50);
 DEFINE_GUID(WFPKS_DEFAULT_ALLOW_IP_RANGE_FILTER_GUID, 0xb984250c, 0x303b, 0x4d45, 0xb3, 0x0a, 0x29, 0xcd, 0x72, 0x4a, 0x32, 0xeb);
 DEFINE_GUID(WFPKS_DEFAULT_ALLOW_PORT_OUT_FILTER_GUID, 0x182cf284, 0xd352, 0x4642, 0x97, 0x77, 0x4a, 0xb1, 0xed, 0x63, 0x97, 0xe8);
+DEFINE_GUID(WFPKS_DEFAULT_ALLOW_PORT_TCP_OUT_FILTER_GUID, 0xe74eb24f, 0x66d9, 0x44c2, 0xab, 0x6c, 0x89, 0xfb, 0x4e, 0x0b, 0xdd, 0xdf);
+DEFINE_GUID(WFPKS_DEFAULT_ALLOW_PORT_UDP_OUT_FILTER_GUID, 0xd9e8a640, 0xcf16, 0x4e8d, 0x85, 0xe8, 0xe1, 0x0d, 0xeb, 0x3f, 0x5a, 0x05);
+DEFINE_GUID(WFPKS_DEFAULT_ALLOW_PORT_LOCAL_FILTER_GUID, 0x8b429643, 0x6d27, 0x4cda, 0x84, 0x9e, 0xa8, 0x06, 0xf6, 0xfa, 0x7f, 0xb8);
+DEFINE_GUID(WFPKS_DEFAULT_ALLOW_PORT_TCP_LOCAL_FILTER_GUID, 0x352d4d08, 0x9390, 0x4ca1, 0x8d, 0x8a, 0xf8, 0xbd, 0xbe, 0x9f, 0xad, 0x09);
+DEFINE_GUID(WFPKS_DEFAULT_ALLOW_PORT_UDP_LOCAL_FILTER_GUID, 0x1b82d18a, 0x941c, 0x406e, 0x83, 0xc7, 0xd9, 0x53, 0x31, 0x2e, 0x57, 0x7e);
 DEFINE_GUID(WFPKS_DEFAULT_ALLOW_IP_FILTER_GUID, 0x4a662297, 0x0732, 0x4447, 0x9f, 0xdd, 0x97, 0x8e, 0x21, 0xbe, 0xa7, 0x1d);
 DEFINE_GUID(WFPKS_DEFAULT_ALLOW_IP_LOCAL_FILTER_GUID, 0xc352c8f7, 0x1c3e, 0x457f, 0x99, 0x2c, 0xbd, 0x16, 0x02, 0x3b, 0xf6, 0xa4);
 DEFINE_GUID(WFPKS_DEFAULT_SUBLAYER_GUID, 0x11466786, 0xe3fe, 0x4af2, 0x94, 0x44, 0xea, 0xe7, 0xb3, 0xf3, 0xcd, 0x25);
@@ -45,6 +57,11 @@ DEFINE_GUID(WFPKS_DEFAULT_ALLOW_V6_MULTICAST_GUID, 0x079c0fe3, 0x9137, 0x4820, 0
 #define WFPKS_BLOCKALL_FILTER_GUID WFPKS_DEFAULT_BLOCKALL_FILTER_GUID
 #define WFPKS_ALLOW_IP_RANGE_FILTER_GUID WFPKS_DEFAULT_ALLOW_IP_RANGE_FILTER_GUID
 #define WFPKS_ALLOW_PORT_OUT_FILTER_GUID WFPKS_DEFAULT_ALLOW_PORT_OUT_FILTER_GUID
+#define WFPKS_ALLOW_PORT_TCP_OUT_FILTER_GUID WFPKS_DEFAULT_ALLOW_PORT_TCP_OUT_FILTER_GUID
+#define WFPKS_ALLOW_PORT_UDP_OUT_FILTER_GUID WFPKS_DEFAULT_ALLOW_PORT_UDP_OUT_FILTER_GUID
+#define WFPKS_ALLOW_PORT_LOCAL_FILTER_GUID WFPKS_DEFAULT_ALLOW_PORT_LOCAL_FILTER_GUID
+#define WFPKS_ALLOW_PORT_TCP_LOCAL_FILTER_GUID WFPKS_DEFAULT_ALLOW_PORT_TCP_LOCAL_FILTER_GUID
+#define WFPKS_ALLOW_PORT_UDP_LOCAL_FILTER_GUID WFPKS_DEFAULT_ALLOW_PORT_UDP_LOCAL_FILTER_GUID
 #define WFPKS_ALLOW_IP_FILTER_GUID WFPKS_DEFAULT_ALLOW_IP_FILTER_GUID
 #define WFPKS_ALLOW_IP_LOCAL_FILTER_GUID WFPKS_DEFAULT_ALLOW_IP_LOCAL_FILTER_GUID
 #define WFPKS_SUBLAYER_GUID WFPKS_DEFAULT_SUBLAYER_GUID
@@ -56,46 +73,87 @@ DEFINE_GUID(WFPKS_DEFAULT_ALLOW_V6_MULTICAST_GUID, 0x079c0fe3, 0x9137, 0x4820, 0
 #endif
 
 
+// Counts a call into the base filtering engine, lookups that find nothing and adds of what already exists are
+// part of the normal flow rather than errors
+static DWORD CountBfe(DWORD result)
+{
+	MetricsAdd(MetricBfeCalls, 1);
+	if (result != ERROR_SUCCESS && result != FWP_E_FILTER_NOT_FOUND && result != FWP_E_ALREADY_EXISTS)
+	{
+		MetricsAdd(MetricBfeErrors, 1);
+	}
 
-void debugPrint(const char* fmt, ...) {
-#ifndef _DEBUG
-	return;
-#endif
-	va_list argptr;
-	va_start(argptr, fmt);
-	printf(fmt, argptr);
-	va_end(argptr);
+	return result;
+}
+
+// Traces a call into the engine and counts it, evaluating to its result
+#define BFE_CALL(probe, call) CountBfe(TRACE_CALL(probe, call))
+
+// A port filter per group PortPolicyCompile can produce, by direction then any protocol, TCP, UDP. The any
+// protocol remote filter keeps the key the single port filter had.
+static const GUID* const PortFilterKeys[PORT_POLICY_MAX_GROUPS] = {
+	&WFPKS_ALLOW_PORT_OUT_FILTER_GUID,
+	&WFPKS_ALLOW_PORT_TCP_OUT_FILTER_GUID,
+	&WFPKS_ALLOW_PORT_UDP_OUT_FILTER_GUID,
+	&WFPKS_ALLOW_PORT_LOCAL_FILTER_GUID,
+	&WFPKS_ALLOW_PORT_TCP_LOCAL_FILTER_GUID,
+	&WFPKS_ALLOW_PORT_UDP_LOCAL_FILTER_GUID,
+};
+
+static const GUID* PortFilterKey(const PortPolicyGroup* group)
+{
+	UINT protocol = group->Protocol == IPPROTO_TCP ? 1 : group->Protocol == IPPROTO_UDP ? 2 : 0;
+	return PortFilterKeys[group->Direction * 3 + protocol];
+}
+
+static DWORD AddFilter(HANDLE engineHandle, const FWPM_FILTER0* filter, UINT64* filterId, INT64* filtersAdded)
+{
+	DWORD result = BFE_CALL(TraceProbeFilterAdd, WfpGetApi()->FilterAdd0(engineHandle, filter, NULL, filterId));
+	FlightRecord(FlightFilterAdd, result, result == ERROR_SUCCESS ? *filterId : 0);
+	if (result == ERROR_SUCCESS)
+	{
+		(*filtersAdded)++;
+	}
+
+	return result;
 }
 
+
+
 BOOL WfpksIsEnabled() {
 	FWPM_FILTER0* fwpmFilter = NULL;
 	HANDLE engineHandle = NULL;
-	DWORD result = ERROR_SUCCESS;
+	DWORD result = WfpApiAcquire();
+	if (result != ERROR_SUCCESS) {
+		return FALSE;
+	}
 
-	debugPrint("opening engine\n");
-	result = FwpmEngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle);
+	NATIVELOG_DEBUG("opening engine\n");
+	result = BFE_CALL(TraceProbeEngineOpen, WfpGetApi()->EngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle));
 
 	if (result == ERROR_SUCCESS) {
-		debugPrint("getting filter\n");
-		result = FwpmFilterGetByKey0(engineHandle, &WFPKS_FILTER_GUID, &fwpmFilter);
+		NATIVELOG_DEBUG("getting filter\n");
+		result = BFE_CALL(TraceProbeFilterGet, WfpGetApi()->FilterGetByKey0(engineHandle, &WFPKS_FILTER_GUID, &fwpmFilter));
 
 		if (result == FWP_E_FILTER_NOT_FOUND)
 		{
-			debugPrint("getting ikev filter\n");
-			result = FwpmFilterGetByKey0(engineHandle, &WFPKS_BLOCKALL_FILTER_GUID, &fwpmFilter);
+			NATIVELOG_DEBUG("getting ikev filter\n");
+			result = BFE_CALL(TraceProbeFilterGet, WfpGetApi()->FilterGetByKey0(engineHandle, &WFPKS_BLOCKALL_FILTER_GUID, &fwpmFilter));
 		}
 	}
 
 	if (engineHandle != NULL) {
-		debugPrint("closing engine\n");
-		FwpmEngineClose0(engineHandle);
+		NATIVELOG_DEBUG("closing engine\n");
+		BFE_CALL(TraceProbeEngineClose, WfpGetApi()->EngineClose0(engineHandle));
 	}
 
 	if (fwpmFilter != NULL) {
-		debugPrint("freeing filter\n");
-		FwpmFreeMemory0((void**)&fwpmFilter);
+		NATIVELOG_DEBUG("freeing filter\n");
+		WfpGetApi()->FreeMemory0((void**)&fwpmFilter);
 	}
 
+	WfpApiRelease();
+
 	if (result == ERROR_SUCCESS) {
 		return TRUE;
 	}
@@ -114,6 +172,11 @@ DWORD WfpksEnable(ULONG networkAdapterIndex, UINT16 port, BOOL persistReboot) {
 	FWPM_ACTION0 action;
 	UINT32 numFilterConditions = 0;
 
+	result = WfpApiAcquire();
+	if (result != ERROR_SUCCESS) {
+		return result;
+	}
+
 	fwpmFilter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
 
 	//get the luid
@@ -170,23 +233,26 @@ DWORD WfpksEnable(ULONG networkAdapterIndex, UINT16 port, BOOL persistReboot) {
 	}
 
 	if (result == ERROR_SUCCESS) {
-		result = FwpmEngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle);
+		result = BFE_CALL(TraceProbeEngineOpen, WfpGetApi()->EngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle));
 	}
 
 	if (result == ERROR_SUCCESS) {
-		result = FwpmFilterAdd0(engineHandle, fwpmFilter, NULL, &filterId);
+		result = BFE_CALL(TraceProbeFilterAdd, WfpGetApi()->FilterAdd0(engineHandle, fwpmFilter, NULL, &filterId));
+		FlightRecord(FlightFilterAdd, result, result == ERROR_SUCCESS ? filterId : 0);
 	}
 
 	//cleanup
 	if (engineHandle != NULL) {
-		FwpmEngineClose0(engineHandle);
+		BFE_CALL(TraceProbeEngineClose, WfpGetApi()->EngineClose0(engineHandle));
 	}
 
 	free(fwpmFilter);
+	WfpApiRelease();
 
 	if (result == ERROR_SUCCESS)
 	{
-		debugPrint("successfully added filter\n");
+		MetricsGaugeSet(MetricKillswitchFilters, 1);
+		NATIVELOG_DEBUG("successfully added filter\n");
 	}
 
 	return result;
@@ -194,409 +260,337 @@ DWORD WfpksEnable(ULONG networkAdapterIndex, UINT16 port, BOOL persistReboot) {
 
 DWORD WfpksEnable2(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName)
 {
-	WfpksDisable();
-	DWORD result = ERROR_SUCCESS;
-	HANDLE engineHandle = NULL;
-	FWPM_FILTER0* fwpmBlockAllFilter = NULL;
-	FWPM_FILTER0* fwpmIpRangeFilter = NULL;
-	FWPM_FILTER0* fwpmPortOutFilter = NULL;
-	FWPM_FILTER0* fwpmIpAddrFilter = NULL;
-	FWPM_FILTER0* fwpmIpAddrLocalFilter = NULL;
-
-	FWPM_FILTER0* fwpmBlockAllV6Filter = NULL;
-	FWPM_FILTER0* fwpmAllowMulticastV6 = NULL;
-	FWPM_FILTER0* fwpmAllowLinkLocalV6 = NULL;
-	FWPM_FILTER0* fwpmAllowLoopbackV6 = NULL;
-
-	FWPM_FILTER_CONDITION0 blockAllConditions[999];
-	FWPM_FILTER_CONDITION0 allowIpRangeConditions[999];
-	FWPM_FILTER_CONDITION0 allowPortOutConditions[999];
-	FWPM_FILTER_CONDITION0* allowIpConditions = NULL;
-	FWPM_FILTER_CONDITION0 allowIpLocalConditions[999];
-
-	FWPM_FILTER_CONDITION0 allowLinkLocalConditionsV6[999];
-	FWPM_FILTER_CONDITION0 allowMulticastConditionsV6[999];
-	FWPM_FILTER_CONDITION0 allowLoopbackConditionsV6[999];
-	FWPM_FILTER_CONDITION0 blockAllConditionsV6[999];
-
-	UINT32 numBlockConditions = 0;
-	UINT32 numIpRangeConditions = 0;
-	UINT32 numPortOutConditions = 0;
-	UINT32 numIpConditions = 0;
-	UINT32 numIpLocalConditions = 0;
-
-	UINT32 numLinkLocalConditionsV6 = 0;
-	UINT32 numMulticastConditionsV6 = 0;
-	UINT32 numLoopbackConditionsV6 = 0;
-	UINT32 numBlockConditionsV6 = 0;
-
-	NET_LUID adapterLuid;
-	UINT64 filterId;
-	FWP_V4_ADDR_AND_MASK* customIpsAndMasks = NULL;
-	FWP_V4_ADDR_AND_MASK* localAddrAndMasks = NULL;
-
-	FWP_V6_ADDR_AND_MASK* loopbackv6IpAndMask = NULL;
-
-	FWP_BYTE_BLOB* ovpnBlob = NULL;
-
+	return WfpksEnable3(remoteAddresses, addrCount, localAddresses, localAddrCount, PortPolicyDefaultRules, PORT_POLICY_DEFAULT_RULE_COUNT, tapAdapterIndex, ovpnBinaryPath, persistReboot, displayName);
+}
 
-	//IPV4
-	//create the main block layer to block all
-	FWPM_ACTION0 blockAction;
-	blockAction.type = FWP_ACTION_BLOCK;
-	blockAction.filterType = WFPKS_BLOCKALL_FILTER_GUID;
+DWORD WfpksEnable3(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, const WFPKS_PORT_RULE* portRules, int portRuleCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName)
+{
+	//compile first, bad arguments leave whatever is engaged in place
+	KillswitchPolicy* policy = NULL;
+	DWORD result = KillswitchPolicyCompile(remoteAddresses, addrCount, localAddresses, localAddrCount, portRules, portRuleCount, tapAdapterIndex, ovpnBinaryPath, persistReboot, displayName, &policy);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
 
-	fwpmBlockAllFilter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
+	result = WfpksEnablePolicy(policy, 0);
+	KillswitchPolicyFree(policy);
 
-	UINT64 blockWeight = 0;
+	return result;
+}
 
-	fwpmBlockAllFilter->action = blockAction;
-	fwpmBlockAllFilter->filterKey = WFPKS_BLOCKALL_FILTER_GUID;
-	fwpmBlockAllFilter->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmBlockAllFilter->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
-	fwpmBlockAllFilter->weight.type = FWP_UINT64;
-	fwpmBlockAllFilter->weight.uint64 = &blockWeight;
-	fwpmBlockAllFilter->displayData.name = const_cast<wchar_t*>(displayName);
-	fwpmBlockAllFilter->displayData.description = const_cast<wchar_t*>(L"Prevents IP leaks when unexpectedly disconnected");
+//block all, multicast, a port filter per group, remote and local addresses, then the four v6 filters
+#define WFPKS_MAX_FILTERS (PORT_POLICY_MAX_GROUPS + 8)
 
-	if (persistReboot)
+//the filters built from a policy, with everything they point at that the policy doesn't hold itself
+typedef struct _WfpksFilterSet
+{
+	FWPM_FILTER0 filters[WFPKS_MAX_FILTERS];
+	UINT32 filterCount;
+	FWPM_FILTER_CONDITION0* conditions;
+	UINT32 conditionCount;
+	FWP_RANGE0* portRanges;
+	FWP_BYTE_BLOB appId;
+	//looked up from the path for policies compiled without an app id
+	FWP_BYTE_BLOB* resolvedAppId;
+	UINT64 tapLuid;
+	UINT64 blockWeight;
+	FWP_RANGE0 multicastRange;
+	FWP_V6_ADDR_AND_MASK loopbackV6;
+	FWP_BYTE_ARRAY16 multicastLowV6, multicastHighV6;
+	FWP_RANGE0 multicastRangeV6;
+	FWP_BYTE_ARRAY16 linkLocalLowV6, linkLocalHighV6;
+	FWP_RANGE0 linkLocalRangeV6;
+} WfpksFilterSet;
+
+static FWPM_FILTER0* NextFilter(WfpksFilterSet* set, const KillswitchPolicy* policy, const GUID& key, const GUID& layer, FWP_ACTION_TYPE action, UINT8 weight)
+{
+	FWPM_FILTER0* filter = &set->filters[set->filterCount++];
+
+	filter->action.type = action;
+	filter->action.filterType = key;
+	filter->filterKey = key;
+	filter->layerKey = layer;
+	filter->subLayerKey = WFPKS_SUBLAYER_GUID;
+	filter->displayData.name = policy->DisplayName.Count > 0 ? KILLSWITCH_POLICY_SECTION(policy, DisplayName, wchar_t) : NULL;
+	if (action == FWP_ACTION_BLOCK)
 	{
-		fwpmBlockAllFilter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		filter->weight.type = FWP_UINT64;
+		filter->weight.uint64 = &set->blockWeight;
+		filter->displayData.description = const_cast<wchar_t*>(L"Prevents IP leaks when unexpectedly disconnected");
 	}
-
-	blockAllConditions[numBlockConditions].fieldKey = FWPM_CONDITION_FLAGS;
-	blockAllConditions[numBlockConditions].matchType = FWP_MATCH_FLAGS_NONE_SET;
-	blockAllConditions[numBlockConditions].conditionValue.type = FWP_UINT32;
-	blockAllConditions[numBlockConditions].conditionValue.uint32 = FWP_CONDITION_FLAG_IS_LOOPBACK;
-	numBlockConditions++;
-
-	//always allow the tap interface
-	if (tapAdapterIndex > 0 && tapAdapterIndex < 999999)
+	else
 	{
-		result = ConvertInterfaceIndexToLuid(tapAdapterIndex, &adapterLuid);
-		if (result == ERROR_SUCCESS) {
-			blockAllConditions[numBlockConditions].fieldKey = FWPM_CONDITION_IP_LOCAL_INTERFACE;
-			blockAllConditions[numBlockConditions].matchType = FWP_MATCH_NOT_EQUAL;
-			blockAllConditions[numBlockConditions].conditionValue.type = FWP_UINT64;
-			blockAllConditions[numBlockConditions].conditionValue.uint64 = (UINT64*)&adapterLuid;
-			numBlockConditions++;
-		}
+		filter->weight.type = FWP_UINT8;
+		filter->weight.uint8 = weight;
 	}
 
-	//allow the ovpn binary
-	if (wcslen(ovpnBinaryPath) > 0)
+	if (policy->Flags & KILLSWITCH_POLICY_PERSIST)
 	{
-		DWORD appIdResult = FwpmGetAppIdFromFileName0(ovpnBinaryPath, &ovpnBlob);
-		if (appIdResult == ERROR_SUCCESS)
-		{
-			blockAllConditions[numBlockConditions].fieldKey = FWPM_CONDITION_ALE_APP_ID;
-			blockAllConditions[numBlockConditions].matchType = FWP_MATCH_NOT_EQUAL;
-			blockAllConditions[numBlockConditions].conditionValue.type = FWP_BYTE_BLOB_TYPE;
-			blockAllConditions[numBlockConditions].conditionValue.byteBlob = ovpnBlob;
-			numBlockConditions++;
-		}
+		filter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
 	}
 
-	fwpmBlockAllFilter->numFilterConditions = numBlockConditions;
-	fwpmBlockAllFilter->filterCondition = blockAllConditions;
+	return filter;
+}
 
-	//inbound ports
-	fwpmIpRangeFilter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
+//filters are built one after another, so each one's conditions run on from the last one's
+static FWPM_FILTER_CONDITION0* AddCondition(WfpksFilterSet* set, FWPM_FILTER0* filter, const GUID& field, FWP_MATCH_TYPE matchType)
+{
+	FWPM_FILTER_CONDITION0* condition = &set->conditions[set->conditionCount++];
 
-	fwpmIpRangeFilter->action.type = FWP_ACTION_PERMIT;
-	fwpmIpRangeFilter->action.filterType = WFPKS_ALLOW_IP_RANGE_FILTER_GUID;
-	fwpmIpRangeFilter->filterKey = WFPKS_ALLOW_IP_RANGE_FILTER_GUID;
-	fwpmIpRangeFilter->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
-	fwpmIpRangeFilter->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmIpRangeFilter->weight.type = FWP_UINT8;
-	fwpmIpRangeFilter->weight.uint8 = 2;
-	fwpmIpRangeFilter->displayData.name = const_cast<wchar_t*>(displayName);
-	if (persistReboot)
-	{
-		fwpmIpRangeFilter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
-	}
-
-	FWP_RANGE0 range1;
-	range1.valueLow.type = FWP_UINT32;
-	range1.valueLow.uint32 = htonl(inet_addr("224.0.0.0"));
-	range1.valueHigh.type = FWP_UINT32;
-	range1.valueHigh.uint32 = htonl(inet_addr("239.255.255.255"));
-
-	allowIpRangeConditions[numIpRangeConditions].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-	allowIpRangeConditions[numIpRangeConditions].matchType = FWP_MATCH_RANGE;
-	allowIpRangeConditions[numIpRangeConditions].conditionValue.type = FWP_RANGE_TYPE;
-	allowIpRangeConditions[numIpRangeConditions].conditionValue.rangeValue = &range1;
-	numIpRangeConditions++;
-
-	fwpmIpRangeFilter->filterCondition = allowIpRangeConditions;
-	fwpmIpRangeFilter->numFilterConditions = numIpRangeConditions;
-
-	//outbound ports
-	fwpmPortOutFilter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
-
-	FWPM_ACTION0 allowOutPortAction;
-	allowOutPortAction.type = FWP_ACTION_PERMIT;
-	allowOutPortAction.filterType = WFPKS_ALLOW_PORT_OUT_FILTER_GUID;
-
-	fwpmPortOutFilter->action = allowOutPortAction;
-	fwpmPortOutFilter->filterKey = WFPKS_ALLOW_PORT_OUT_FILTER_GUID;
-	fwpmPortOutFilter->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
-	fwpmPortOutFilter->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmPortOutFilter->weight.type = FWP_UINT8;
-	fwpmPortOutFilter->weight.uint8 = 3;
-	fwpmPortOutFilter->displayData.name = const_cast<wchar_t*>(displayName);
-	if (persistReboot)
+	if (filter->numFilterConditions == 0)
 	{
-		fwpmPortOutFilter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		filter->filterCondition = condition;
 	}
+	filter->numFilterConditions++;
 
-	//ikev ports
-	UINT16 ports[] = { 67, 68, 500, 4500, 1900, 5350, 5351, 5353 };
+	condition->fieldKey = field;
+	condition->matchType = matchType;
 
-	for (UINT16 port : ports)
-	{
-		allowPortOutConditions[numPortOutConditions].fieldKey = FWPM_CONDITION_IP_REMOTE_PORT;
-		allowPortOutConditions[numPortOutConditions].matchType = FWP_MATCH_EQUAL;
-		allowPortOutConditions[numPortOutConditions].conditionValue.type = FWP_UINT16;
-		allowPortOutConditions[numPortOutConditions].conditionValue.uint16 = port;
-		numPortOutConditions++;
-	}
+	return condition;
+}
 
-	fwpmPortOutFilter->filterCondition = allowPortOutConditions;
-	fwpmPortOutFilter->numFilterConditions = numPortOutConditions;
+static void FreeFilters(WfpksFilterSet* set)
+{
+	if (set->conditions != NULL)
+		free(set->conditions);
 
-	//create a sublayer to allow the remote ip
-	fwpmIpAddrFilter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
+	if (set->portRanges != NULL)
+		free(set->portRanges);
 
-	FWPM_ACTION0 allowIpAction;
-	allowIpAction.type = FWP_ACTION_PERMIT;
-	allowIpAction.filterType = WFPKS_ALLOW_IP_FILTER_GUID;
+	if (set->resolvedAppId != NULL)
+		WfpGetApi()->FreeMemory0((void**)&set->resolvedAppId);
+}
 
-	fwpmIpAddrFilter->action = allowIpAction;
-	fwpmIpAddrFilter->filterKey = WFPKS_ALLOW_IP_FILTER_GUID;
-	fwpmIpAddrFilter->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
-	fwpmIpAddrFilter->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmIpAddrFilter->weight.type = FWP_UINT8;
-	fwpmIpAddrFilter->weight.uint8 = 3;
-	fwpmIpAddrFilter->displayData.name = const_cast<wchar_t*>(displayName);
+static DWORD BuildFilters(KillswitchPolicy* policy, ULONG tapAdapterIndex, WfpksFilterSet* set)
+{
+	memset(set, 0, sizeof(WfpksFilterSet));
 
-	if (persistReboot)
+	DWORD result = KillswitchPolicyPatchTap(policy, tapAdapterIndex);
+	if (result != ERROR_SUCCESS)
 	{
-		fwpmIpAddrFilter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		return result;
 	}
 
-	customIpsAndMasks = (FWP_V4_ADDR_AND_MASK*)calloc(addrCount, sizeof(FWP_V4_ADDR_AND_MASK));
-	allowIpConditions = (FWPM_FILTER_CONDITION0*)calloc(addrCount, sizeof(FWPM_FILTER_CONDITION0));
+	KillswitchAddrMask* remoteAddresses = KILLSWITCH_POLICY_SECTION(policy, RemoteAddresses, KillswitchAddrMask);
+	KillswitchAddrMask* localAddresses = KILLSWITCH_POLICY_SECTION(policy, LocalAddresses, KillswitchAddrMask);
+	const PortPolicyGroup* groups = KILLSWITCH_POLICY_SECTION(policy, PortGroups, const PortPolicyGroup);
+	const PortRange* ranges = KILLSWITCH_POLICY_SECTION(policy, PortRanges, const PortRange);
 
-	for (int i = 0; i < addrCount; i++)
+	//block all takes three at most, each port group one for its protocol, the v6 filters five between them
+	set->conditions = (FWPM_FILTER_CONDITION0*)calloc(9 + policy->PortGroups.Count + policy->PortRanges.Count + policy->RemoteAddresses.Count + policy->LocalAddresses.Count, sizeof(FWPM_FILTER_CONDITION0));
+	set->portRanges = (FWP_RANGE0*)calloc(policy->PortRanges.Count > 0 ? policy->PortRanges.Count : 1, sizeof(FWP_RANGE0));
+	if (set->conditions == NULL || set->portRanges == NULL)
 	{
-		customIpsAndMasks[i].addr = htonl(inet_addr(remoteAddresses[i].szIpAddr));
-		customIpsAndMasks[i].mask = htonl(inet_addr(remoteAddresses[i].szMask));
+		FreeFilters(set);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
 
-		allowIpConditions[numIpConditions].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-		allowIpConditions[numIpConditions].matchType = FWP_MATCH_EQUAL;
-		allowIpConditions[numIpConditions].conditionValue.type = FWP_V4_ADDR_MASK;
-		allowIpConditions[numIpConditions].conditionValue.v4AddrMask = &customIpsAndMasks[i];
-		numIpConditions++;
+	set->tapLuid = policy->TapLuid;
+	set->appId.size = policy->AppId.Count;
+	set->appId.data = KILLSWITCH_POLICY_SECTION(policy, AppId, UINT8);
+	if (policy->AppId.Count == 0 && policy->AppPath.Count > 0)
+	{
+		const wchar_t* appPath = KILLSWITCH_POLICY_SECTION(policy, AppPath, const wchar_t);
+		if (TRACE_CALL(TraceProbeAppId, WfpGetApi()->GetAppIdFromFileName0(appPath, &set->resolvedAppId)) != ERROR_SUCCESS)
+		{
+			set->resolvedAppId = NULL;
+		}
 	}
 
-	fwpmIpAddrFilter->numFilterConditions = numIpConditions;
-	fwpmIpAddrFilter->filterCondition = allowIpConditions;
+	//IPV4
+	//create the main block layer to block all
+	FWPM_FILTER0* blockAll = NextFilter(set, policy, WFPKS_BLOCKALL_FILTER_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWP_ACTION_BLOCK, 0);
+	FWPM_FILTER_CONDITION0* condition = AddCondition(set, blockAll, FWPM_CONDITION_FLAGS, FWP_MATCH_FLAGS_NONE_SET);
+	condition->conditionValue.type = FWP_UINT32;
+	condition->conditionValue.uint32 = FWP_CONDITION_FLAG_IS_LOOPBACK;
 
-	//local ip addresses
-	fwpmIpAddrLocalFilter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
-
-	fwpmIpAddrLocalFilter->action.type = FWP_ACTION_PERMIT;
-	fwpmIpAddrLocalFilter->action.filterType = WFPKS_ALLOW_IP_LOCAL_FILTER_GUID;
-	fwpmIpAddrLocalFilter->filterKey = WFPKS_ALLOW_IP_LOCAL_FILTER_GUID;
-	fwpmIpAddrLocalFilter->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V4;
-	fwpmIpAddrLocalFilter->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmIpAddrLocalFilter->weight.type = FWP_UINT8;
-	fwpmIpAddrLocalFilter->weight.uint8 = 4;
-	fwpmIpAddrLocalFilter->displayData.name = const_cast<wchar_t*>(displayName);
-	if (persistReboot)
+	//always allow the tap interface
+	if (set->tapLuid != 0)
 	{
-		fwpmIpAddrLocalFilter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		condition = AddCondition(set, blockAll, FWPM_CONDITION_IP_LOCAL_INTERFACE, FWP_MATCH_NOT_EQUAL);
+		condition->conditionValue.type = FWP_UINT64;
+		condition->conditionValue.uint64 = &set->tapLuid;
 	}
 
+	//allow the ovpn binary
+	FWP_BYTE_BLOB* appId = set->resolvedAppId != NULL ? set->resolvedAppId : set->appId.size > 0 ? &set->appId : NULL;
+	if (appId != NULL)
+	{
+		condition = AddCondition(set, blockAll, FWPM_CONDITION_ALE_APP_ID, FWP_MATCH_NOT_EQUAL);
+		condition->conditionValue.type = FWP_BYTE_BLOB_TYPE;
+		condition->conditionValue.byteBlob = appId;
+	}
 
-	localAddrAndMasks = (FWP_V4_ADDR_AND_MASK*)calloc(localAddrCount, sizeof(FWP_V4_ADDR_AND_MASK));
+	//multicast
+	FWPM_FILTER0* ipRange = NextFilter(set, policy, WFPKS_ALLOW_IP_RANGE_FILTER_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWP_ACTION_PERMIT, 2);
+	set->multicastRange.valueLow.type = FWP_UINT32;
+	set->multicastRange.valueLow.uint32 = htonl(inet_addr("224.0.0.0"));
+	set->multicastRange.valueHigh.type = FWP_UINT32;
+	set->multicastRange.valueHigh.uint32 = htonl(inet_addr("239.255.255.255"));
 
-	for (size_t i = 0; i < localAddrCount; i++)
+	condition = AddCondition(set, ipRange, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_RANGE);
+	condition->conditionValue.type = FWP_RANGE_TYPE;
+	condition->conditionValue.rangeValue = &set->multicastRange;
+
+	//outbound ports, a filter for each protocol and direction the rules compiled to
+	for (UINT g = 0; g < policy->PortGroups.Count; g++)
 	{
-		localAddrAndMasks[i].addr = htonl(inet_addr(localAddresses[i].szIpAddr));
-		localAddrAndMasks[i].mask = htonl(inet_addr(localAddresses[i].szMask));
+		const PortPolicyGroup* group = &groups[g];
+		FWPM_FILTER0* portFilter = NextFilter(set, policy, *PortFilterKey(group), FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWP_ACTION_PERMIT, 3);
 
-		allowIpLocalConditions[numIpLocalConditions].fieldKey = FWPM_CONDITION_IP_LOCAL_ADDRESS;
-		allowIpLocalConditions[numIpLocalConditions].matchType = FWP_MATCH_EQUAL;
-		allowIpLocalConditions[numIpLocalConditions].conditionValue.type = FWP_V4_ADDR_MASK;
-		allowIpLocalConditions[numIpLocalConditions].conditionValue.v4AddrMask = &localAddrAndMasks[i];
-		numIpLocalConditions++;
-	}
+		//conditions on different fields must all match, the port conditions share a field so any one of them will do
+		if (group->Protocol != 0)
+		{
+			condition = AddCondition(set, portFilter, FWPM_CONDITION_IP_PROTOCOL, FWP_MATCH_EQUAL);
+			condition->conditionValue.type = FWP_UINT8;
+			condition->conditionValue.uint8 = group->Protocol;
+		}
 
-	fwpmIpAddrLocalFilter->numFilterConditions = numIpLocalConditions;
-	fwpmIpAddrLocalFilter->filterCondition = allowIpLocalConditions;
-	//end ipv4 rules
+		for (UINT r = group->First; r < group->First + group->Count; r++)
+		{
+			const PortRange* range = &ranges[r];
+			const GUID& field = group->Direction == WFPKS_PORT_REMOTE ? FWPM_CONDITION_IP_REMOTE_PORT : FWPM_CONDITION_IP_LOCAL_PORT;
 
-	//ipv6 rules
-	//block all V6
-	FWPM_ACTION0 blockActionV6;
-	blockActionV6.type = FWP_ACTION_BLOCK;
-	blockActionV6.filterType = WFPKS_BLOCKALL_V6_FILTER_GUID;
-
-	fwpmBlockAllV6Filter = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
-	UINT64 blockAllV6Weight = 0;
-
-	fwpmBlockAllV6Filter->action = blockActionV6;
-	fwpmBlockAllV6Filter->filterKey = WFPKS_BLOCKALL_V6_FILTER_GUID;
-	fwpmBlockAllV6Filter->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmBlockAllV6Filter->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V6;
-	fwpmBlockAllV6Filter->weight.type = FWP_UINT64;
-	fwpmBlockAllV6Filter->weight.uint64 = &blockAllV6Weight;
-	fwpmBlockAllV6Filter->displayData.name = const_cast<wchar_t*>(displayName);
-	fwpmBlockAllV6Filter->displayData.description = const_cast<wchar_t*>(L"Prevents IP leaks when unexpectedly disconnected");
-
-	if (persistReboot)
-	{
-		fwpmBlockAllV6Filter->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+			if (range->Low == range->High)
+			{
+				condition = AddCondition(set, portFilter, field, FWP_MATCH_EQUAL);
+				condition->conditionValue.type = FWP_UINT16;
+				condition->conditionValue.uint16 = range->Low;
+			}
+			else
+			{
+				set->portRanges[r].valueLow.type = FWP_UINT16;
+				set->portRanges[r].valueLow.uint16 = range->Low;
+				set->portRanges[r].valueHigh.type = FWP_UINT16;
+				set->portRanges[r].valueHigh.uint16 = range->High;
+
+				condition = AddCondition(set, portFilter, field, FWP_MATCH_RANGE);
+				condition->conditionValue.type = FWP_RANGE_TYPE;
+				condition->conditionValue.rangeValue = &set->portRanges[r];
+			}
+		}
 	}
 
-	blockAllConditionsV6[numBlockConditionsV6].fieldKey = FWPM_CONDITION_FLAGS;
-	blockAllConditionsV6[numBlockConditionsV6].matchType = FWP_MATCH_FLAGS_NONE_SET;
-	blockAllConditionsV6[numBlockConditionsV6].conditionValue.type = FWP_UINT32;
-	blockAllConditionsV6[numBlockConditionsV6].conditionValue.uint32 = FWP_CONDITION_FLAG_IS_LOOPBACK;
-	numBlockConditionsV6++;
+	//allow the remote ips, the engine reads the addresses straight out of the policy
+	FWPM_FILTER0* ipAddr = NextFilter(set, policy, WFPKS_ALLOW_IP_FILTER_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWP_ACTION_PERMIT, 3);
+	for (UINT i = 0; i < policy->RemoteAddresses.Count; i++)
+	{
+		condition = AddCondition(set, ipAddr, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_EQUAL);
+		condition->conditionValue.type = FWP_V4_ADDR_MASK;
+		condition->conditionValue.v4AddrMask = (FWP_V4_ADDR_AND_MASK*)&remoteAddresses[i];
+	}
 
-	//always allow the tap interface
-	if (tapAdapterIndex > 0 && tapAdapterIndex < 999999)
+	//local ip addresses
+	FWPM_FILTER0* ipAddrLocal = NextFilter(set, policy, WFPKS_ALLOW_IP_LOCAL_FILTER_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWP_ACTION_PERMIT, 4);
+	for (UINT i = 0; i < policy->LocalAddresses.Count; i++)
 	{
-		result = ConvertInterfaceIndexToLuid(tapAdapterIndex, &adapterLuid);
-		if (result == ERROR_SUCCESS) {
-			blockAllConditionsV6[numBlockConditionsV6].fieldKey = FWPM_CONDITION_IP_LOCAL_INTERFACE;
-			blockAllConditionsV6[numBlockConditionsV6].matchType = FWP_MATCH_NOT_EQUAL;
-			blockAllConditionsV6[numBlockConditionsV6].conditionValue.type = FWP_UINT64;
-			blockAllConditionsV6[numBlockConditionsV6].conditionValue.uint64 = (UINT64*)&adapterLuid;
-			numBlockConditionsV6++;
-		}
+		condition = AddCondition(set, ipAddrLocal, FWPM_CONDITION_IP_LOCAL_ADDRESS, FWP_MATCH_EQUAL);
+		condition->conditionValue.type = FWP_V4_ADDR_MASK;
+		condition->conditionValue.v4AddrMask = (FWP_V4_ADDR_AND_MASK*)&localAddresses[i];
 	}
+	//end ipv4 rules
 
-	fwpmBlockAllV6Filter->numFilterConditions = numBlockConditionsV6;
-	fwpmBlockAllV6Filter->filterCondition = blockAllConditionsV6;
-	//end block all V6
+	//ipv6 rules
+	//block all V6
+	FWPM_FILTER0* blockAllV6 = NextFilter(set, policy, WFPKS_BLOCKALL_V6_FILTER_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V6, FWP_ACTION_BLOCK, 0);
+	condition = AddCondition(set, blockAllV6, FWPM_CONDITION_FLAGS, FWP_MATCH_FLAGS_NONE_SET);
+	condition->conditionValue.type = FWP_UINT32;
+	condition->conditionValue.uint32 = FWP_CONDITION_FLAG_IS_LOOPBACK;
 
-	//allow loopback v6
-	fwpmAllowLoopbackV6 = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
-
-	fwpmAllowLoopbackV6->action.type = FWP_ACTION_PERMIT;
-	fwpmAllowLoopbackV6->action.filterType = WFPKS_ALLOW_V6_LOOPBACK_GUID;
-	fwpmAllowLoopbackV6->filterKey = WFPKS_ALLOW_V6_LOOPBACK_GUID;
-	fwpmAllowLoopbackV6->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V6;
-	fwpmAllowLoopbackV6->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmAllowLoopbackV6->weight.type = FWP_UINT8;
-	fwpmAllowLoopbackV6->weight.uint8 = 4;
-	fwpmAllowLoopbackV6->displayData.name = const_cast<wchar_t*>(displayName);
-	if (persistReboot)
+	//always allow the tap interface
+	if (set->tapLuid != 0)
 	{
-		fwpmAllowLoopbackV6->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		condition = AddCondition(set, blockAllV6, FWPM_CONDITION_IP_LOCAL_INTERFACE, FWP_MATCH_NOT_EQUAL);
+		condition->conditionValue.type = FWP_UINT64;
+		condition->conditionValue.uint64 = &set->tapLuid;
 	}
 
-	loopbackv6IpAndMask = (FWP_V6_ADDR_AND_MASK*)calloc(1, sizeof(FWP_V6_ADDR_AND_MASK));
+	//allow link local v6
+	FWPM_FILTER0* linkLocalV6 = NextFilter(set, policy, WFPKS_ALLOW_V6_LINK_LOCAL_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V6, FWP_ACTION_PERMIT, 4);
+	inet_pton(AF_INET6, const_cast<char*>("fe80::"), &set->linkLocalLowV6);
+	inet_pton(AF_INET6, const_cast<char*>("fe80::ffff:ffff:ffff:ffff"), &set->linkLocalHighV6);
+	set->linkLocalRangeV6.valueLow.type = FWP_BYTE_ARRAY16_TYPE;
+	set->linkLocalRangeV6.valueLow.byteArray16 = &set->linkLocalLowV6;
+	set->linkLocalRangeV6.valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
+	set->linkLocalRangeV6.valueHigh.byteArray16 = &set->linkLocalHighV6;
+
+	condition = AddCondition(set, linkLocalV6, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_RANGE);
+	condition->conditionValue.type = FWP_RANGE_TYPE;
+	condition->conditionValue.rangeValue = &set->linkLocalRangeV6;
 
-	inet_pton(AF_INET6, const_cast<char*>("::1"), &loopbackv6IpAndMask->addr);
-	loopbackv6IpAndMask->prefixLength = 128;
+	//allow loopback v6
+	FWPM_FILTER0* loopbackV6 = NextFilter(set, policy, WFPKS_ALLOW_V6_LOOPBACK_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V6, FWP_ACTION_PERMIT, 4);
+	inet_pton(AF_INET6, const_cast<char*>("::1"), &set->loopbackV6.addr);
+	set->loopbackV6.prefixLength = 128;
 
-	allowLoopbackConditionsV6[numLoopbackConditionsV6].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-	allowLoopbackConditionsV6[numLoopbackConditionsV6].matchType = FWP_MATCH_EQUAL;
-	allowLoopbackConditionsV6[numLoopbackConditionsV6].conditionValue.type = FWP_V6_ADDR_MASK;
-	allowLoopbackConditionsV6[numLoopbackConditionsV6].conditionValue.v6AddrMask = loopbackv6IpAndMask;
-	numLoopbackConditionsV6++;
+	condition = AddCondition(set, loopbackV6, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_EQUAL);
+	condition->conditionValue.type = FWP_V6_ADDR_MASK;
+	condition->conditionValue.v6AddrMask = &set->loopbackV6;
 
-	fwpmAllowLoopbackV6->numFilterConditions = numLoopbackConditionsV6;
-	fwpmAllowLoopbackV6->filterCondition = allowLoopbackConditionsV6;
+	//allow multicast v6
+	FWPM_FILTER0* multicastV6 = NextFilter(set, policy, WFPKS_ALLOW_V6_MULTICAST_GUID, FWPM_LAYER_ALE_AUTH_CONNECT_V6, FWP_ACTION_PERMIT, 4);
+	inet_pton(AF_INET6, const_cast<char*>("ff00::"), &set->multicastLowV6);
+	inet_pton(AF_INET6, const_cast<char*>("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"), &set->multicastHighV6);
+	set->multicastRangeV6.valueLow.type = FWP_BYTE_ARRAY16_TYPE;
+	set->multicastRangeV6.valueLow.byteArray16 = &set->multicastLowV6;
+	set->multicastRangeV6.valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
+	set->multicastRangeV6.valueHigh.byteArray16 = &set->multicastHighV6;
+
+	condition = AddCondition(set, multicastV6, FWPM_CONDITION_IP_REMOTE_ADDRESS, FWP_MATCH_RANGE);
+	condition->conditionValue.type = FWP_RANGE_TYPE;
+	condition->conditionValue.rangeValue = &set->multicastRangeV6;
+	//end ipv6 rules
 
-	//end allow loopback v6
+	return ERROR_SUCCESS;
+}
 
-	//allow multicast v6
-	fwpmAllowMulticastV6 = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
-
-	fwpmAllowMulticastV6->action.type = FWP_ACTION_PERMIT;
-	fwpmAllowMulticastV6->action.filterType = WFPKS_ALLOW_V6_MULTICAST_GUID;
-	fwpmAllowMulticastV6->filterKey = WFPKS_ALLOW_V6_MULTICAST_GUID;
-	fwpmAllowMulticastV6->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V6;
-	fwpmAllowMulticastV6->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmAllowMulticastV6->weight.type = FWP_UINT8;
-	fwpmAllowMulticastV6->weight.uint8 = 4;
-	fwpmAllowMulticastV6->displayData.name = const_cast<wchar_t*>(displayName);
-	if (persistReboot)
+DWORD WfpksPrepareFilters(KillswitchPolicy* policy, ULONG tapAdapterIndex, UINT* filterCount)
+{
+	DWORD result = WfpApiAcquire();
+	if (result != ERROR_SUCCESS)
 	{
-		fwpmAllowMulticastV6->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		return result;
 	}
 
-	FWP_RANGE0 multiCastRange;
-	multiCastRange.valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
-	multiCastRange.valueLow.type = FWP_BYTE_ARRAY16_TYPE;
-	FWP_BYTE_ARRAY16 multicastHigh, multicastLow;
-	inet_pton(AF_INET6, const_cast<char*>("ff00::"), &multicastLow);
-	inet_pton(AF_INET6, const_cast<char*>("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff"), &multicastHigh);
-	multiCastRange.valueHigh.byteArray16 = &multicastHigh;
-	multiCastRange.valueLow.byteArray16 = &multicastLow;
-
-	allowMulticastConditionsV6[numMulticastConditionsV6].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-	allowMulticastConditionsV6[numMulticastConditionsV6].matchType = FWP_MATCH_RANGE;
-	allowMulticastConditionsV6[numMulticastConditionsV6].conditionValue.type = FWP_RANGE_TYPE;
-	allowMulticastConditionsV6[numMulticastConditionsV6].conditionValue.rangeValue = &multiCastRange;
-	numMulticastConditionsV6++;
-
-	fwpmAllowMulticastV6->numFilterConditions = numMulticastConditionsV6;
-	fwpmAllowMulticastV6->filterCondition = allowMulticastConditionsV6;
-
-	//end allow multicast v6
-
-	//allow link local v6
-	fwpmAllowLinkLocalV6 = (FWPM_FILTER0*)calloc(1, sizeof(FWPM_FILTER0));
-
-	fwpmAllowLinkLocalV6->action.type = FWP_ACTION_PERMIT;
-	fwpmAllowLinkLocalV6->action.filterType = WFPKS_ALLOW_V6_LINK_LOCAL_GUID;
-	fwpmAllowLinkLocalV6->layerKey = FWPM_LAYER_ALE_AUTH_CONNECT_V6;
-	fwpmAllowLinkLocalV6->filterKey = WFPKS_ALLOW_V6_LINK_LOCAL_GUID;
-	fwpmAllowLinkLocalV6->subLayerKey = WFPKS_SUBLAYER_GUID;
-	fwpmAllowLinkLocalV6->weight.type = FWP_UINT8;
-	fwpmAllowLinkLocalV6->weight.uint8 = 4;
-	fwpmAllowLinkLocalV6->displayData.name = const_cast<wchar_t*>(displayName);
-
-	if (persistReboot)
+	WfpksFilterSet set;
+	result = BuildFilters(policy, tapAdapterIndex, &set);
+	if (result == ERROR_SUCCESS)
 	{
-		fwpmAllowLinkLocalV6->flags |= FWPM_FILTER_FLAG_PERSISTENT;
+		*filterCount = set.filterCount;
+		FreeFilters(&set);
 	}
 
-	FWP_RANGE0 linklocalRange;
-	linklocalRange.valueHigh.type = FWP_BYTE_ARRAY16_TYPE;
-	linklocalRange.valueLow.type = FWP_BYTE_ARRAY16_TYPE;
-	FWP_BYTE_ARRAY16 linklocalHigh, linklocalLow;
-	inet_pton(AF_INET6, const_cast<char*>("fe80::"), &linklocalLow);
-	inet_pton(AF_INET6, const_cast<char*>("fe80::ffff:ffff:ffff:ffff"), &linklocalHigh);
-	linklocalRange.valueHigh.byteArray16 = &linklocalHigh;
-	linklocalRange.valueLow.byteArray16 = &linklocalLow;
-
+	WfpApiRelease();
 
-	allowLinkLocalConditionsV6[numLinkLocalConditionsV6].fieldKey = FWPM_CONDITION_IP_REMOTE_ADDRESS;
-	allowLinkLocalConditionsV6[numLinkLocalConditionsV6].matchType = FWP_MATCH_RANGE;
-	allowLinkLocalConditionsV6[numLinkLocalConditionsV6].conditionValue.type = FWP_RANGE_TYPE;
-	allowLinkLocalConditionsV6[numLinkLocalConditionsV6].conditionValue.rangeValue = &linklocalRange;
-	numLinkLocalConditionsV6++;
+	return result;
+}
 
-	fwpmAllowLinkLocalV6->numFilterConditions = numLinkLocalConditionsV6;
-	fwpmAllowLinkLocalV6->filterCondition = allowLinkLocalConditionsV6;
+DWORD WfpksEnablePolicy(KillswitchPolicy* policy, ULONG tapAdapterIndex)
+{
+	DWORD result = WfpApiAcquire();
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
 
-	//end allow link local v6
+	//build everything before disabling, a policy that can't be applied leaves whatever is engaged in place
+	WfpksFilterSet set;
+	result = BuildFilters(policy, tapAdapterIndex, &set);
+	if (result != ERROR_SUCCESS)
+	{
+		WfpApiRelease();
+		return result;
+	}
 
-	//end ipv6 rules
+	WfpksDisable();
+	HANDLE engineHandle = NULL;
+	UINT64 filterId;
+	INT64 filtersAdded = 0;
+	wchar_t* displayName = policy->DisplayName.Count > 0 ? KILLSWITCH_POLICY_SECTION(policy, DisplayName, wchar_t) : NULL;
 
 	//add the layers to WFP
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmEngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle);
-	}
+	result = BFE_CALL(TraceProbeEngineOpen, WfpGetApi()->EngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle));
 
 	FWPM_SUBLAYER0 fwpSubLayer;
 	memset(&fwpSubLayer, 0, sizeof(fwpSubLayer));
@@ -604,126 +598,47 @@ DWORD WfpksEnable2(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_AD
 	if (result == ERROR_SUCCESS)
 	{
 		fwpSubLayer.subLayerKey = WFPKS_SUBLAYER_GUID;
-		fwpSubLayer.displayData.name = const_cast<wchar_t*>(displayName);
+		fwpSubLayer.displayData.name = displayName;
 		fwpSubLayer.displayData.description = const_cast<wchar_t*>(L"UltraVPN Filter Sublayer");
 		fwpSubLayer.flags = 0;
 		fwpSubLayer.weight = 0x100;
-		if (persistReboot)
+		if (policy->Flags & KILLSWITCH_POLICY_PERSIST)
 		{
 			fwpSubLayer.flags |= FWPM_FILTER_FLAG_PERSISTENT;
 		}
 
-		result = FwpmSubLayerAdd0(engineHandle, &fwpSubLayer, NULL);
+		result = BFE_CALL(TraceProbeSubLayerAdd, WfpGetApi()->SubLayerAdd0(engineHandle, &fwpSubLayer, NULL));
 
 		if (result == FWP_E_ALREADY_EXISTS)
 		{
-			result = FwpmSubLayerDeleteByKey0(engineHandle, &WFPKS_SUBLAYER_GUID);
+			result = BFE_CALL(TraceProbeSubLayerDelete, WfpGetApi()->SubLayerDeleteByKey0(engineHandle, &WFPKS_SUBLAYER_GUID));
 			if (result == ERROR_SUCCESS)
 			{
-				result = FwpmSubLayerAdd0(engineHandle, &fwpSubLayer, NULL);
+				result = BFE_CALL(TraceProbeSubLayerAdd, WfpGetApi()->SubLayerAdd0(engineHandle, &fwpSubLayer, NULL));
 			}
 		}
 	}
 
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmBlockAllFilter, NULL, &filterId);
-	}
-
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmIpRangeFilter, NULL, &filterId);
-	}
-
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmPortOutFilter, NULL, &filterId);
-	}
-
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmIpAddrFilter, NULL, &filterId);
-	}
-
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmIpAddrLocalFilter, NULL, &filterId);
-	}
-	//v6
-
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmBlockAllV6Filter, NULL, &filterId);
-	}
-
-	if (result == ERROR_SUCCESS)
+	for (UINT32 i = 0; i < set.filterCount && result == ERROR_SUCCESS; i++)
 	{
-		result = FwpmFilterAdd0(engineHandle, fwpmAllowLinkLocalV6, NULL, &filterId);
+		result = AddFilter(engineHandle, &set.filters[i], &filterId, &filtersAdded);
 	}
 
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmAllowLoopbackV6, NULL, &filterId);
-	}
-
-	if (result == ERROR_SUCCESS)
-	{
-		result = FwpmFilterAdd0(engineHandle, fwpmAllowMulticastV6, NULL, &filterId);
-	}
-
-
 	//cleanup
 	if (engineHandle != NULL)
-		FwpmEngineClose0(engineHandle);
-
-	if (fwpmBlockAllFilter != NULL)
-		free(fwpmBlockAllFilter);
-
-	if (fwpmIpRangeFilter != NULL)
-		free(fwpmIpRangeFilter);
-
-	if (fwpmPortOutFilter != NULL)
-		free(fwpmPortOutFilter);
-
-	if (fwpmIpAddrFilter != NULL)
-		free(fwpmIpAddrFilter);
-
-	if (customIpsAndMasks != NULL)
-		free(customIpsAndMasks);
-
-	if (localAddrAndMasks != NULL)
-		free(localAddrAndMasks);
-
-	if (ovpnBlob != NULL)
-		FwpmFreeMemory0((void**)&ovpnBlob);
-
-	if (allowIpConditions != NULL)
-		free(allowIpConditions);
+		BFE_CALL(TraceProbeEngineClose, WfpGetApi()->EngineClose0(engineHandle));
 
-	//v6
-
-	if (fwpmBlockAllV6Filter != NULL)
-		free(fwpmBlockAllV6Filter);
-
-	if (fwpmAllowLoopbackV6 != NULL)
-		free(fwpmAllowLoopbackV6);
-
-	if (fwpmAllowLinkLocalV6 != NULL)
-		free(fwpmAllowLinkLocalV6);
-
-	if (fwpmAllowMulticastV6 != NULL)
-		free(fwpmAllowMulticastV6);
-
-	if (loopbackv6IpAndMask != NULL)
-		free(loopbackv6IpAndMask);
+	FreeFilters(&set);
+	WfpApiRelease();
 
 	if (result == ERROR_SUCCESS)
 	{
-		debugPrint("successfully added filter\n");
+		MetricsGaugeSet(MetricKillswitchFilters, filtersAdded);
+		NATIVELOG_DEBUG("successfully added filter\n");
 	}
 	else
 	{
-		debugPrint("failed to add filter\n");
+		NATIVELOG_ERROR("failed to add filter\n");
 	}
 
 	return result;
@@ -738,27 +653,38 @@ DWORD WfpksDisable() {
 	//     return ERROR_SUCCESS;
 	// }
 
-	result = FwpmEngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle);
+	result = WfpApiAcquire();
+	if (result != ERROR_SUCCESS) {
+		return result;
+	}
+
+	result = BFE_CALL(TraceProbeEngineOpen, WfpGetApi()->EngineOpen0(NULL, RPC_C_AUTHN_DEFAULT, NULL, NULL, &engineHandle));
 
 	if (result == ERROR_SUCCESS) {
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_FILTER_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_BLOCKALL_FILTER_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_IP_RANGE_FILTER_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_PORT_OUT_FILTER_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_IP_FILTER_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_IP_LOCAL_FILTER_GUID);
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_FILTER_GUID));
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_BLOCKALL_FILTER_GUID));
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_IP_RANGE_FILTER_GUID));
+		for (UINT i = 0; i < PORT_POLICY_MAX_GROUPS; i++)
+		{
+			result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, PortFilterKeys[i]));
+		}
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_IP_FILTER_GUID));
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_IP_LOCAL_FILTER_GUID));
 
 		//ipv6
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_BLOCKALL_V6_FILTER_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_V6_LINK_LOCAL_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_V6_LOOPBACK_GUID);
-		result = FwpmFilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_V6_MULTICAST_GUID);
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_BLOCKALL_V6_FILTER_GUID));
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_V6_LINK_LOCAL_GUID));
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_V6_LOOPBACK_GUID));
+		result = BFE_CALL(TraceProbeFilterDelete, WfpGetApi()->FilterDeleteByKey0(engineHandle, &WFPKS_ALLOW_V6_MULTICAST_GUID));
 	}
 
 	if (engineHandle != NULL) {
-		FwpmEngineClose0(engineHandle);
+		BFE_CALL(TraceProbeEngineClose, WfpGetApi()->EngineClose0(engineHandle));
+		MetricsGaugeSet(MetricKillswitchFilters, 0);
 	}
 
+	WfpApiRelease();
+
 	return result;
 }
 
@@ -14,9 +14,29 @@ typedef struct WFPKS_ADDR_AND_MASK_
 	const char* szMask;
 } WFPKS_ADDR_AND_MASK;
 
+// The end of the connection a port rule matches
+#define WFPKS_PORT_REMOTE 0
+#define WFPKS_PORT_LOCAL 1
+
+typedef struct WFPKS_PORT_RULE_
+{
+	// IPPROTO_TCP, IPPROTO_UDP, or 0 for any protocol
+	UINT8 protocol;
+	UINT8 direction;
+	UINT16 portLow;
+	// Inclusive, 0 for portLow alone
+	UINT16 portHigh;
+} WFPKS_PORT_RULE;
+
 [[deprecated]]
 DWORD WfpksEnable(ULONG networkAdapterIndex, UINT16 port, BOOL persistReboot);
+// WfpksEnable3 with the default port rules in PortPolicy.cpp
 DWORD WfpksEnable2(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName);
+DWORD WfpksEnable3(WFPKS_ADDR_AND_MASK* remoteAddresses, int addrCount, WFPKS_ADDR_AND_MASK* localAddresses, int localAddrCount, const WFPKS_PORT_RULE* portRules, int portRuleCount, ULONG tapAdapterIndex, const wchar_t* ovpnBinaryPath, BOOL persistReboot, const wchar_t* displayName);
+// Engages a policy from KillswitchPolicy.h, patched for tapAdapterIndex first unless it's 0
+DWORD WfpksEnablePolicy(struct _KillswitchPolicy* policy, ULONG tapAdapterIndex);
+// Builds the filters WfpksEnablePolicy would add without touching the engine
+DWORD WfpksPrepareFilters(struct _KillswitchPolicy* policy, ULONG tapAdapterIndex, UINT* filterCount);
 DWORD WfpksDisable();
 BOOL WfpksIsEnabled();
 
@@ -0,0 +1,1132 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <Ras.h>
+#include <RasError.h>
+#include <stddef.h>
+#include <strsafe.h>
+#include "Raslib.h"
+#include "RasApi.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "FlightRecorder.h"
+#include "Executor.h"
+
+#define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
+
+// DialRace::Winner holds the winning slot once claimed, or one of these
+#define RACE_RUNNING -1
+#define RACE_ABORTED -2
+#define RACE_FAILED -3
+
+// DialSession::Phase, offsets from MetricDialPhaseConnectSeconds
+#define DIAL_PHASE_CONNECT 0
+#define DIAL_PHASE_AUTHENTICATE 1
+#define DIAL_PHASE_PROJECT 2
+
+typedef struct _DialSession
+{
+	volatile LONG RefCount;
+	volatile LONG State;
+	volatile LONG HangUpRequested;
+	volatile LONG HungUp;
+	HRASCONN volatile RasConn;
+	DWORD Error;
+	HDIALSESSION Handle;
+	DialSessionCallbacks Callbacks;
+	struct _DialRace* Race;
+	UINT RaceSlot;
+	// Timer ticks, RAS notifies a connection from one thread at a time so these need no locking
+	INT64 DialStartedAt;
+	INT64 PhaseStartedAt;
+	UINT Phase;
+	// Begun by DialSessionDial and recorded by whichever transition ends the dial
+	TraceScope Trace;
+} DialSession;
+
+typedef struct _DialRace
+{
+	volatile LONG RefCount;
+	volatile LONG Winner;
+	HDIALRACE Handle;
+	SRWLOCK Lock;
+	UINT HostnameCount;
+	UINT NextHostname;
+	UINT SlotCount;
+	UINT ActiveSlots;
+	DWORD LastError;
+	HDIALSESSION Slots[RASLIB_MAX_RACE_SLOTS];
+	UINT SlotHostname[RASLIB_MAX_RACE_SLOTS];
+	WCHAR(*Hostnames)[RAS_MaxPhoneNumber + 1];
+	WCHAR DeviceName[RAS_MaxEntryName + 1];
+	WCHAR Username[UNLEN + 1];
+	WCHAR Password[PWLEN + 1];
+	DialRaceCallbacks Callbacks;
+} DialRace;
+
+typedef struct _RaceLaunchJob
+{
+	DialRace* Race;
+	UINT Slot;
+	UINT Hostname;
+} RaceLaunchJob;
+
+// Handles are (generation << 16) | (slot + 1) so a stale handle never resolves to a reused slot
+static SRWLOCK SessionLock = SRWLOCK_INIT;
+static DialSession* Sessions[RASLIB_MAX_DIAL_SESSIONS];
+static WORD SessionGenerations[RASLIB_MAX_DIAL_SESSIONS];
+
+// Races are handed out the same way as sessions
+static SRWLOCK RaceTableLock = SRWLOCK_INIT;
+static DialRace* Races[RASLIB_MAX_DIAL_RACES];
+static WORD RaceGenerations[RASLIB_MAX_DIAL_RACES];
+
+static void ReleaseRace(DialRace* race);
+static BOOL RaceClaim(DialRace* race, UINT slot);
+
+// Call with the table's lock held exclusively
+static DWORD NextHandle(WORD* generation, UINT slot)
+{
+	if (++*generation == 0)
+	{
+		*generation = 1;
+	}
+
+	return ((DWORD)*generation << 16) | (slot + 1);
+}
+
+static DialSession* AcquireSession(HDIALSESSION handle)
+{
+	UINT slot = (handle & 0xFFFF) - 1;
+	DialSession* session = NULL;
+
+	if (slot >= RASLIB_MAX_DIAL_SESSIONS)
+	{
+		return NULL;
+	}
+
+	AcquireSRWLockShared(&SessionLock);
+
+	if (Sessions[slot] != NULL && Sessions[slot]->Handle == handle)
+	{
+		session = Sessions[slot];
+		InterlockedIncrement(&session->RefCount);
+	}
+
+	ReleaseSRWLockShared(&SessionLock);
+
+	return session;
+}
+
+static void ReleaseSession(DialSession* session)
+{
+	if (InterlockedDecrement(&session->RefCount) == 0)
+	{
+		if (session->Race != NULL)
+		{
+			ReleaseRace(session->Race);
+		}
+
+		RaslibFree(session);
+	}
+}
+
+static BOOL TransitionState(DialSession* session, DialSessionState from, DialSessionState to)
+{
+	return InterlockedCompareExchange(&session->State, to, from) == from;
+}
+
+#define HANGUP_POLLS 30
+#define HANGUP_POLL_MS 100
+
+// Hang ups queued by QueueHangUp, polled on executor timers until the handle goes stale
+typedef struct _HangUpWatch
+{
+	HRASCONN RasConn;
+	INT64 Started;
+	UINT Attempts;
+} HangUpWatch;
+
+// RAS keeps the port open until the handle goes stale after a hang up
+static BOOL IsHungUp(HRASCONN rasConn)
+{
+	RASCONNSTATUS status;
+
+	memset(&status, 0, sizeof(status));
+	status.dwSize = sizeof(RASCONNSTATUS);
+
+	return RaslibGetApi()->GetConnectStatus(rasConn, &status) == ERROR_INVALID_HANDLE;
+}
+
+static DWORD BeginHangUp(HRASCONN rasConn)
+{
+	DWORD rc = RaslibGetApi()->HangUp(rasConn);
+	if (rc != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("RasHangUp failed in HangUpConnection: 0x%.8X\n", rc);
+		FlightRecord(FlightHangUp, rc, 1);
+	}
+
+	return rc;
+}
+
+static void FinishHangUp(INT64 started, BOOL hungUp, UINT attempts)
+{
+	MetricsObserveSince(MetricHangUpSeconds, started);
+	FlightRecord(FlightHangUp, hungUp ? ERROR_SUCCESS : ERROR_TIMEOUT, attempts);
+}
+
+// Hangs up and waits for the handle to go stale, for callers that need the port free when it returns
+static void HangUpConnection(HRASCONN rasConn)
+{
+	INT64 started = MetricsTimerStart();
+
+	if (BeginHangUp(rasConn) != ERROR_SUCCESS)
+	{
+		return;
+	}
+
+	BOOL hungUp = FALSE;
+	UINT attempts = 0;
+	while (!hungUp && attempts < HANGUP_POLLS)
+	{
+		if (attempts++ != 0)
+		{
+			Sleep(HANGUP_POLL_MS);
+		}
+
+		hungUp = IsHungUp(rasConn);
+	}
+
+	FinishHangUp(started, hungUp, attempts);
+}
+
+static void CALLBACK HangUpPoll(PVOID context)
+{
+	HangUpWatch* watch = (HangUpWatch*)context;
+
+	BOOL hungUp = IsHungUp(watch->RasConn);
+
+	watch->Attempts++;
+
+	if (!hungUp && watch->Attempts < HANGUP_POLLS && ExecutorSchedule(HANGUP_POLL_MS, 0, HangUpPoll, watch, NULL) == ERROR_SUCCESS)
+	{
+		return;
+	}
+
+	FinishHangUp(watch->Started, hungUp, watch->Attempts);
+	RaslibFree(watch);
+}
+
+static void CALLBACK HangUpWorker(PVOID context)
+{
+	HangUpWatch* watch = (HangUpWatch*)context;
+
+	if (BeginHangUp(watch->RasConn) != ERROR_SUCCESS)
+	{
+		RaslibFree(watch);
+		return;
+	}
+
+	HangUpPoll(watch);
+}
+
+// Hang ups wait on RAS so keep them off the RAS callback thread and the caller's thread. The wait is a chain of
+// timers rather than a thread sleeping through it.
+static void QueueHangUp(HRASCONN rasConn)
+{
+	HangUpWatch* watch = (HangUpWatch*)RaslibAlloc(sizeof(HangUpWatch));
+	if (watch == NULL)
+	{
+		HangUpConnection(rasConn);
+		return;
+	}
+
+	watch->RasConn = rasConn;
+	watch->Started = MetricsTimerStart();
+	watch->Attempts = 0;
+
+	if (ExecutorSubmit(HangUpWorker, watch, NULL) != ERROR_SUCCESS)
+	{
+		RaslibFree(watch);
+		HangUpConnection(rasConn);
+	}
+}
+
+// The connection handle arrives either from RasDial or the first notification and a hang up can be requested
+// before either, so whoever completes the pair performs the hang up exactly once
+static void TryHangUp(DialSession* session)
+{
+	HRASCONN rasConn = session->RasConn;
+
+	if (rasConn != NULL && session->HangUpRequested && InterlockedExchange(&session->HungUp, TRUE) == FALSE)
+	{
+		QueueHangUp(rasConn);
+	}
+}
+
+static void RequestHangUp(DialSession* session)
+{
+	InterlockedExchange(&session->HangUpRequested, TRUE);
+	TryHangUp(session);
+}
+
+static void SetRasConn(DialSession* session, HRASCONN rasConn)
+{
+	InterlockedCompareExchangePointer((PVOID volatile*)&session->RasConn, rasConn, NULL);
+	TryHangUp(session);
+}
+
+static UINT DialPhase(RASCONNSTATE rasconnstate)
+{
+	if (rasconnstate < RASCS_Authenticate)
+	{
+		return DIAL_PHASE_CONNECT;
+	}
+
+	return rasconnstate <= RASCS_Authenticated ? DIAL_PHASE_AUTHENTICATE : DIAL_PHASE_PROJECT;
+}
+
+// Closes the current phase when the dial moves past it, a phase RAS skips isn't recorded. Paused states wait
+// on the user and don't move it.
+static void AdvancePhase(DialSession* session, RASCONNSTATE rasconnstate)
+{
+	if (rasconnstate >= RASCS_PAUSED && rasconnstate != RASCS_Connected)
+	{
+		return;
+	}
+
+	UINT phase = rasconnstate == RASCS_Connected ? DIAL_PHASE_PROJECT + 1 : DialPhase(rasconnstate);
+
+	if (session->Phase < phase)
+	{
+		INT64 now = MetricsTimerStart();
+		MetricsObserveSince((MetricId)(MetricDialPhaseConnectSeconds + session->Phase), session->PhaseStartedAt);
+		session->PhaseStartedAt = now;
+		session->Phase = phase;
+	}
+}
+
+static DWORD WINAPI SessionDialFunc(ULONG_PTR callbackId, DWORD subEntry, HRASCONN rasConn, UINT msg, RASCONNSTATE rasconnstate, DWORD error, DWORD extendedError)
+{
+	DialSession* session = AcquireSession((HDIALSESSION)callbackId);
+	if (session == NULL)
+	{
+		// Closed sessions have already requested their hang up
+		return 0;
+	}
+
+	SetRasConn(session, rasConn);
+	FlightRecord(FlightDialState, rasconnstate, error);
+
+	UINT32 previousRequest = TraceSetRequest(session->Trace.RequestId);
+	DWORD keepNotifying = session->State == DialSessionDialing ? 1 : 0;
+
+	if (error != ERROR_SUCCESS)
+	{
+		if (TransitionState(session, DialSessionDialing, DialSessionFailed))
+		{
+			session->Error = error;
+			MetricsAdd(MetricDialFailures, 1);
+			TraceRequestRecord(&session->Trace, error);
+			NATIVELOG_WARNING("dial session 0x%.8X failed: 0x%.8X\n", session->Handle, error);
+
+			RequestHangUp(session);
+
+			if (session->Callbacks.Error != NULL)
+			{
+				TRACE_CALL_VOID(TraceProbeManagedCallback, session->Callbacks.Error(session->Handle, error, session->Callbacks.Context));
+			}
+		}
+
+		keepNotifying = 0;
+	}
+	else if (rasconnstate == RASCS_Connected)
+	{
+		if (session->Race != NULL && !RaceClaim(session->Race, session->RaceSlot))
+		{
+			// Another candidate got there first
+			if (TransitionState(session, DialSessionDialing, DialSessionAborted))
+			{
+				TraceRequestRecord(&session->Trace, ERROR_CANCELLED);
+				RequestHangUp(session);
+			}
+		}
+		else if (TransitionState(session, DialSessionDialing, DialSessionConnected))
+		{
+			AdvancePhase(session, rasconnstate);
+			MetricsObserveSince(MetricDialSeconds, session->DialStartedAt);
+			TraceRequestRecord(&session->Trace, ERROR_SUCCESS);
+
+			if (session->Callbacks.Complete != NULL)
+			{
+				TRACE_CALL_VOID(TraceProbeManagedCallback, session->Callbacks.Complete(session->Handle, session->Callbacks.Context));
+			}
+		}
+
+		keepNotifying = 0;
+	}
+	else if (session->State == DialSessionDialing)
+	{
+		AdvancePhase(session, rasconnstate);
+	}
+
+	TraceSetRequest(previousRequest);
+	ReleaseSession(session);
+
+	return keepNotifying;
+}
+
+static DWORD CreateSession(const DialSessionCallbacks* callbacks, DialRace* race, UINT raceSlot, HDIALSESSION* handle)
+{
+	DialSession* session = (DialSession*)RaslibAlloc(sizeof(DialSession));
+	if (session == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// The table holds the only reference until someone acquires the handle
+	session->RefCount = 1;
+	session->State = DialSessionIdle;
+	session->Race = race;
+	session->RaceSlot = raceSlot;
+
+	if (callbacks != NULL)
+	{
+		session->Callbacks = *callbacks;
+	}
+
+	AcquireSRWLockExclusive(&SessionLock);
+
+	for (UINT i = 0; i < RASLIB_MAX_DIAL_SESSIONS; i++)
+	{
+		if (Sessions[i] == NULL)
+		{
+			session->Handle = NextHandle(&SessionGenerations[i], i);
+			Sessions[i] = session;
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&SessionLock);
+
+	if (session->Handle == 0)
+	{
+		RaslibFree(session);
+		return ERROR_TOO_MANY_SESS;
+	}
+
+	if (race != NULL)
+	{
+		InterlockedIncrement(&race->RefCount);
+	}
+
+	*handle = session->Handle;
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD StartDial(DialSession* session, LPCWSTR deviceName, LPCWSTR username, LPCWSTR password)
+{
+	const RASLIB_API* ras = RaslibGetApi();
+	DWORD result = ERROR_SUCCESS;
+	HRASCONN RasConn = NULL;
+	BOOL PasswordReturned = false;
+
+	RASDIALPARAMS* DialParams = (RASDIALPARAMS*)RaslibAlloc(sizeof(RASDIALPARAMS));
+	if (DialParams == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// Set the size so the api knows how much memory / which version to use
+	DialParams->dwSize = sizeof(RASDIALPARAMS);
+
+	// Set the entry name to be used to our new device
+	StringCchCopy(DialParams->szEntryName, CELEMS(DialParams->szEntryName), deviceName);
+
+	// Get the default dial params for our device
+	result = ras->GetEntryDialParams(NULL, DialParams, &PasswordReturned);
+
+#if (WINVER >= 0x601)
+	if (result == ERROR_INVALID_SIZE)
+	{
+		DialParams->dwSize = offsetof(RASDIALPARAMSW, dwIfIndex);
+		result = ras->GetEntryDialParams(NULL, DialParams, &PasswordReturned);
+	}
+#endif // (WINVER >= 0x601)
+
+	if (result == ERROR_SUCCESS)
+	{
+		// Copy the credentials to the dial params
+		StringCchCopy(DialParams->szUserName, CELEMS(DialParams->szUserName), username);
+		StringCchCopy(DialParams->szPassword, CELEMS(DialParams->szPassword), password);
+
+		// Notifier type 2 hands the session handle back to us with every notification
+		DialParams->dwCallbackId = (ULONG_PTR)session->Handle;
+
+		session->DialStartedAt = MetricsTimerStart();
+		session->PhaseStartedAt = session->DialStartedAt;
+		session->Phase = DIAL_PHASE_CONNECT;
+
+		result = ras->Dial(NULL, NULL, DialParams, 2, (LPVOID)SessionDialFunc, &RasConn);
+
+		if (RasConn != NULL)
+		{
+			SetRasConn(session, RasConn);
+		}
+
+		if (result != ERROR_SUCCESS)
+		{
+			RequestHangUp(session);
+			MetricsAdd(MetricDialFailures, 1);
+			NATIVELOG_ERROR("RasDial failed in StartDial: 0x%.8X\n", result);
+		}
+	}
+	else
+	{
+		NATIVELOG_ERROR("RasGetEntryDialParams failed in StartDial: 0x%.8X\n", result);
+	}
+
+	SecureZeroMemory(DialParams, sizeof(RASDIALPARAMS));
+	RaslibFree(DialParams);
+
+	return result;
+}
+
+DWORD DialSessionCreate(const DialSessionCallbacks* callbacks, HDIALSESSION* session)
+{
+	if (session == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return CreateSession(callbacks, NULL, 0, session);
+}
+
+DWORD DialSessionDial(
+	HDIALSESSION handle,
+	LPCWSTR deviceName,
+	LPCWSTR connectionHostname,
+	LPCWSTR username,
+	LPCWSTR password
+)
+{
+	DialSession* session = AcquireSession(handle);
+	if (session == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	TraceRequestBegin(TraceOpDial, &session->Trace);
+
+	if (!TransitionState(session, DialSessionIdle, DialSessionDialing))
+	{
+		result = session->State == DialSessionAborted ? ERROR_CANCELLED : ERROR_INVALID_STATE;
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		// Create / update a device to use and dial
+		result = CreateVpnDevice(deviceName, connectionHostname);
+	}
+
+	if (result == ERROR_SUCCESS && session->State != DialSessionDialing)
+	{
+		result = ERROR_CANCELLED;
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = StartDial(session, deviceName, username, password);
+	}
+
+	// Synchronous failures are only reported through the return value
+	if (result != ERROR_SUCCESS && TransitionState(session, DialSessionDialing, DialSessionFailed))
+	{
+		session->Error = result;
+		TraceRequestRecord(&session->Trace, result);
+	}
+
+	// Otherwise the transition out of dialing on a RAS thread records the request
+	TraceRequestLeave(&session->Trace);
+
+	ReleaseSession(session);
+
+	return result;
+}
+
+DWORD DialSessionAbort(HDIALSESSION handle)
+{
+	DialSession* session = AcquireSession(handle);
+	if (session == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	if (TransitionState(session, DialSessionDialing, DialSessionAborted))
+	{
+		TraceRequestRecord(&session->Trace, ERROR_CANCELLED);
+		RequestHangUp(session);
+
+		if (session->Callbacks.Abort != NULL)
+		{
+			TRACE_CALL_VOID(TraceProbeManagedCallback, session->Callbacks.Abort(session->Handle, session->Callbacks.Context));
+		}
+	}
+	else if (!TransitionState(session, DialSessionIdle, DialSessionAborted))
+	{
+		result = ERROR_INVALID_STATE;
+	}
+
+	ReleaseSession(session);
+
+	return result;
+}
+
+DWORD DialSessionGetState(HDIALSESSION handle, DialSessionState* state, DWORD* error)
+{
+	DialSession* session = AcquireSession(handle);
+	if (session == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	if (state != NULL)
+	{
+		*state = (DialSessionState)session->State;
+	}
+
+	if (error != NULL)
+	{
+		*error = session->Error;
+	}
+
+	ReleaseSession(session);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DialSessionGetConnection(HDIALSESSION handle, HRASCONN* rasConn)
+{
+	if (rasConn == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DialSession* session = AcquireSession(handle);
+	if (session == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	*rasConn = session->RasConn;
+
+	ReleaseSession(session);
+
+	return *rasConn != NULL ? ERROR_SUCCESS : ERROR_NOT_FOUND;
+}
+
+DWORD DialSessionHangUp(HDIALSESSION handle)
+{
+	DialSession* session = AcquireSession(handle);
+	if (session == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	// Requested before looking at the handle, so SetRasConn can't miss it
+	InterlockedExchange(&session->HangUpRequested, TRUE);
+	HRASCONN rasConn = session->RasConn;
+
+	if (rasConn == NULL)
+	{
+		// SetRasConn queues the hang up once the handle arrives
+		result = ERROR_NOT_FOUND;
+	}
+	else if (InterlockedExchange(&session->HungUp, TRUE) == FALSE)
+	{
+		HangUpConnection(rasConn);
+	}
+
+	ReleaseSession(session);
+
+	return result;
+}
+
+DWORD DialSessionClose(HDIALSESSION handle)
+{
+	UINT slot = (handle & 0xFFFF) - 1;
+	DialSession* session = NULL;
+
+	if (slot >= RASLIB_MAX_DIAL_SESSIONS)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	AcquireSRWLockExclusive(&SessionLock);
+
+	if (Sessions[slot] != NULL && Sessions[slot]->Handle == handle)
+	{
+		session = Sessions[slot];
+		Sessions[slot] = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&SessionLock);
+
+	if (session == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	if (TransitionState(session, DialSessionDialing, DialSessionAborted) ||
+		TransitionState(session, DialSessionIdle, DialSessionAborted))
+	{
+		RequestHangUp(session);
+	}
+
+	// Drop the table's reference
+	ReleaseSession(session);
+
+	return ERROR_SUCCESS;
+}
+
+static DialRace* AcquireRace(HDIALRACE handle)
+{
+	UINT slot = (handle & 0xFFFF) - 1;
+	DialRace* race = NULL;
+
+	if (slot >= RASLIB_MAX_DIAL_RACES)
+	{
+		return NULL;
+	}
+
+	AcquireSRWLockShared(&RaceTableLock);
+
+	if (Races[slot] != NULL && Races[slot]->Handle == handle)
+	{
+		race = Races[slot];
+		InterlockedIncrement(&race->RefCount);
+	}
+
+	ReleaseSRWLockShared(&RaceTableLock);
+
+	return race;
+}
+
+static void ReleaseRace(DialRace* race)
+{
+	if (InterlockedDecrement(&race->RefCount) == 0)
+	{
+		SecureZeroMemory(race->Password, sizeof(race->Password));
+		RaslibFree(race->Hostnames);
+		RaslibFree(race);
+	}
+}
+
+static BOOL RaceClaim(DialRace* race, UINT slot)
+{
+	return InterlockedCompareExchange(&race->Winner, (LONG)slot, RACE_RUNNING) == RACE_RUNNING;
+}
+
+static void GetRaceEntryName(DialRace* race, UINT slot, LPWSTR entryName, DWORD entryNameLength)
+{
+	GetVpnDeviceSlotName(race->DeviceName, slot, entryName, entryNameLength);
+}
+
+// Aborts every slot except keep, pass RASLIB_MAX_RACE_SLOTS to abort them all
+static void AbortRaceSlots(DialRace* race, UINT keep)
+{
+	HDIALSESSION slots[RASLIB_MAX_RACE_SLOTS];
+
+	AcquireSRWLockShared(&race->Lock);
+	memcpy(slots, race->Slots, sizeof(slots));
+	ReleaseSRWLockShared(&race->Lock);
+
+	for (UINT i = 0; i < race->SlotCount; i++)
+	{
+		if (i != keep && slots[i] != 0)
+		{
+			DialSessionAbort(slots[i]);
+		}
+	}
+}
+
+// Called once a slot's candidate has failed. Returns TRUE with the next candidate to dial on the slot,
+// otherwise retires the slot and fails the race if it was the last one running.
+static BOOL RaceSlotFinished(DialRace* race, UINT slot, DWORD error, UINT* nextHostname)
+{
+	AcquireSRWLockExclusive(&race->Lock);
+
+	HDIALSESSION finished = race->Slots[slot];
+	race->Slots[slot] = 0;
+	race->LastError = error;
+
+	BOOL launch = race->Winner == RACE_RUNNING && race->NextHostname < race->HostnameCount;
+	if (launch)
+	{
+		*nextHostname = race->NextHostname++;
+	}
+	else
+	{
+		race->ActiveSlots--;
+	}
+
+	BOOL exhausted = !launch && race->ActiveSlots == 0;
+	DWORD lastError = race->LastError;
+
+	ReleaseSRWLockExclusive(&race->Lock);
+
+	if (finished != 0)
+	{
+		DialSessionClose(finished);
+	}
+
+	if (exhausted && InterlockedCompareExchange(&race->Winner, RACE_FAILED, RACE_RUNNING) == RACE_RUNNING)
+	{
+		NATIVELOG_WARNING("dial race failed, every candidate errored: 0x%.8X\n", lastError);
+
+		if (race->Callbacks.Error != NULL)
+		{
+			race->Callbacks.Error(race->Handle, lastError, race->Callbacks.Context);
+		}
+	}
+
+	return launch;
+}
+
+static void QueueRaceLaunch(DialRace* race, UINT slot, UINT hostname);
+
+static void _cdecl RaceSessionComplete(HDIALSESSION session, LPVOID context)
+{
+	DialRace* race = (DialRace*)context;
+	UINT winner = (UINT)race->Winner;
+
+	AcquireSRWLockShared(&race->Lock);
+	UINT hostname = race->SlotHostname[winner];
+	ReleaseSRWLockShared(&race->Lock);
+
+	NATIVELOG_INFO("dial race won by candidate %u on slot %u\n", hostname, winner);
+
+	AbortRaceSlots(race, winner);
+
+	if (race->Callbacks.Complete != NULL)
+	{
+		race->Callbacks.Complete(race->Handle, hostname, race->Callbacks.Context);
+	}
+}
+
+static void _cdecl RaceSessionError(HDIALSESSION session, DWORD error, LPVOID context)
+{
+	DialRace* race = (DialRace*)context;
+	UINT slot = RASLIB_MAX_RACE_SLOTS;
+	UINT next = 0;
+
+	AcquireSRWLockShared(&race->Lock);
+	for (UINT i = 0; i < race->SlotCount; i++)
+	{
+		if (race->Slots[i] == session)
+		{
+			slot = i;
+		}
+	}
+	ReleaseSRWLockShared(&race->Lock);
+
+	// Dialing the next candidate blocks on the phonebook so it is queued rather than run on the RAS thread
+	if (slot < RASLIB_MAX_RACE_SLOTS && RaceSlotFinished(race, slot, error, &next))
+	{
+		QueueRaceLaunch(race, slot, next);
+	}
+}
+
+static void RaceLaunch(DialRace* race, UINT slot, UINT hostname)
+{
+	WCHAR entryName[RAS_MaxEntryName + 1];
+	DialSessionCallbacks callbacks = { RaceSessionComplete, RaceSessionError, NULL, race };
+
+	GetRaceEntryName(race, slot, entryName, CELEMS(entryName));
+
+	for (;;)
+	{
+		HDIALSESSION session = 0;
+
+		DWORD result = CreateSession(&callbacks, race, slot, &session);
+		if (result == ERROR_SUCCESS)
+		{
+			// Checked under the lock so an abort or close either sees this slot or this launch sees the race is over
+			AcquireSRWLockExclusive(&race->Lock);
+			BOOL running = race->Winner == RACE_RUNNING;
+			if (running)
+			{
+				race->Slots[slot] = session;
+				race->SlotHostname[slot] = hostname;
+			}
+			ReleaseSRWLockExclusive(&race->Lock);
+
+			if (!running)
+			{
+				DialSessionClose(session);
+				return;
+			}
+
+			NATIVELOG_DEBUG("dial race slot %u dialing candidate %u\n", slot, hostname);
+			result = DialSessionDial(session, entryName, race->Hostnames[hostname], race->Username, race->Password);
+		}
+
+		// No notification follows a synchronous failure so move on to the next candidate here
+		if (result == ERROR_SUCCESS || !RaceSlotFinished(race, slot, result, &hostname))
+		{
+			return;
+		}
+	}
+}
+
+static void CALLBACK RaceLaunchWorker(PVOID context)
+{
+	RaceLaunchJob* job = (RaceLaunchJob*)context;
+
+	RaceLaunch(job->Race, job->Slot, job->Hostname);
+
+	ReleaseRace(job->Race);
+	RaslibFree(job);
+}
+
+static void QueueRaceLaunch(DialRace* race, UINT slot, UINT hostname)
+{
+	RaceLaunchJob* job = (RaceLaunchJob*)RaslibAlloc(sizeof(RaceLaunchJob));
+
+	if (job != NULL)
+	{
+		InterlockedIncrement(&race->RefCount);
+		job->Race = race;
+		job->Slot = slot;
+		job->Hostname = hostname;
+
+		if (ExecutorSubmit(RaceLaunchWorker, job, NULL) == ERROR_SUCCESS)
+		{
+			return;
+		}
+
+		ReleaseRace(race);
+		RaslibFree(job);
+	}
+
+	RaceLaunch(race, slot, hostname);
+}
+
+DWORD DialRaceStart(
+	LPCWSTR deviceName,
+	LPCWSTR* hostnames,
+	UINT hostnameCount,
+	UINT maxParallel,
+	LPCWSTR username,
+	LPCWSTR password,
+	const DialRaceCallbacks* callbacks,
+	HDIALRACE* race
+)
+{
+	if (deviceName == NULL || hostnames == NULL || hostnameCount == 0 || race == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (maxParallel == 0)
+	{
+		maxParallel = 1;
+	}
+
+	if (maxParallel > RASLIB_MAX_RACE_SLOTS)
+	{
+		maxParallel = RASLIB_MAX_RACE_SLOTS;
+	}
+
+	if (maxParallel > hostnameCount)
+	{
+		maxParallel = hostnameCount;
+	}
+
+	DialRace* newRace = (DialRace*)RaslibAlloc(sizeof(DialRace));
+	if (newRace == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	newRace->Hostnames = (WCHAR(*)[RAS_MaxPhoneNumber + 1])RaslibAlloc(hostnameCount * sizeof(*newRace->Hostnames));
+	if (newRace->Hostnames == NULL)
+	{
+		RaslibFree(newRace);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// The table's reference, dropped by DialRaceClose
+	newRace->RefCount = 1;
+	newRace->Winner = RACE_RUNNING;
+	InitializeSRWLock(&newRace->Lock);
+	newRace->HostnameCount = hostnameCount;
+	newRace->NextHostname = maxParallel;
+	newRace->SlotCount = maxParallel;
+	newRace->ActiveSlots = maxParallel;
+
+	for (UINT i = 0; i < hostnameCount; i++)
+	{
+		StringCchCopy(newRace->Hostnames[i], CELEMS(newRace->Hostnames[i]), hostnames[i]);
+	}
+
+	StringCchCopy(newRace->DeviceName, CELEMS(newRace->DeviceName), deviceName);
+	StringCchCopy(newRace->Username, CELEMS(newRace->Username), username);
+	StringCchCopy(newRace->Password, CELEMS(newRace->Password), password);
+
+	if (callbacks != NULL)
+	{
+		newRace->Callbacks = *callbacks;
+	}
+
+	AcquireSRWLockExclusive(&RaceTableLock);
+
+	for (UINT i = 0; i < RASLIB_MAX_DIAL_RACES; i++)
+	{
+		if (Races[i] == NULL)
+		{
+			newRace->Handle = NextHandle(&RaceGenerations[i], i);
+			Races[i] = newRace;
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&RaceTableLock);
+
+	if (newRace->Handle == 0)
+	{
+		ReleaseRace(newRace);
+		return ERROR_TOO_MANY_SESS;
+	}
+
+	*race = newRace->Handle;
+
+	NATIVELOG_INFO("dial race starting, %u candidates over %u slots\n", hostnameCount, maxParallel);
+
+	// Creating each slot's phonebook entry blocks, so every slot starts on the executor
+	for (UINT slot = 0; slot < maxParallel; slot++)
+	{
+		QueueRaceLaunch(newRace, slot, slot);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD DialRaceAbort(HDIALRACE handle)
+{
+	DialRace* race = AcquireRace(handle);
+	if (race == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	if (InterlockedCompareExchange(&race->Winner, RACE_ABORTED, RACE_RUNNING) == RACE_RUNNING)
+	{
+		AbortRaceSlots(race, RASLIB_MAX_RACE_SLOTS);
+
+		if (race->Callbacks.Abort != NULL)
+		{
+			race->Callbacks.Abort(race->Handle, race->Callbacks.Context);
+		}
+	}
+	else
+	{
+		result = ERROR_INVALID_STATE;
+	}
+
+	ReleaseRace(race);
+
+	return result;
+}
+
+DWORD DialRaceGetWinner(HDIALRACE handle, UINT* winner, LPWSTR entryName, DWORD entryNameLength)
+{
+	DialRace* race = AcquireRace(handle);
+	if (race == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+	LONG slot = race->Winner;
+
+	if (slot < 0)
+	{
+		result = ERROR_NOT_FOUND;
+	}
+	else
+	{
+		if (winner != NULL)
+		{
+			AcquireSRWLockShared(&race->Lock);
+			*winner = race->SlotHostname[slot];
+			ReleaseSRWLockShared(&race->Lock);
+		}
+
+		if (entryName != NULL)
+		{
+			GetRaceEntryName(race, (UINT)slot, entryName, entryNameLength);
+		}
+	}
+
+	ReleaseRace(race);
+
+	return result;
+}
+
+DWORD DialRaceClose(HDIALRACE handle)
+{
+	HDIALSESSION slots[RASLIB_MAX_RACE_SLOTS];
+	UINT tableSlot = (handle & 0xFFFF) - 1;
+	DialRace* race = NULL;
+
+	if (tableSlot >= RASLIB_MAX_DIAL_RACES)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	AcquireSRWLockExclusive(&RaceTableLock);
+
+	if (Races[tableSlot] != NULL && Races[tableSlot]->Handle == handle)
+	{
+		race = Races[tableSlot];
+		Races[tableSlot] = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&RaceTableLock);
+
+	if (race == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	InterlockedCompareExchange(&race->Winner, RACE_ABORTED, RACE_RUNNING);
+
+	AcquireSRWLockExclusive(&race->Lock);
+	memcpy(slots, race->Slots, sizeof(slots));
+	memset(race->Slots, 0, sizeof(race->Slots));
+	ReleaseSRWLockExclusive(&race->Lock);
+
+	// Closing hangs up anything still dialing and leaves the winner connected
+	for (UINT i = 0; i < race->SlotCount; i++)
+	{
+		if (slots[i] != 0)
+		{
+			DialSessionClose(slots[i]);
+		}
+	}
+
+	// Drop the table's reference, launches and sessions still running hold their own
+	ReleaseRace(race);
+
+	return ERROR_SUCCESS;
+}
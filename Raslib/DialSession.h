@@ -0,0 +1,95 @@
+#pragma once
+#include <Windows.h>
+#include <Ras.h>
+
+#define RASLIB_MAX_DIAL_SESSIONS 64
+#define RASLIB_MAX_DIAL_RACES 16
+#define RASLIB_MAX_RACE_SLOTS 8
+
+// Opaque handles to a dial session and a dial race, 0 is never a valid handle. A handle that has been closed
+// stops resolving and calls with it return ERROR_INVALID_HANDLE.
+typedef DWORD HDIALSESSION;
+typedef DWORD HDIALRACE;
+
+typedef enum _DialSessionState
+{
+	DialSessionIdle = 0,
+	DialSessionDialing = 1,
+	DialSessionConnected = 2,
+	DialSessionFailed = 3,
+	DialSessionAborted = 4,
+} DialSessionState;
+
+typedef void(_cdecl* DialSessionFuncType)(HDIALSESSION session, LPVOID context);
+typedef void(_cdecl* DialSessionErrorFuncType)(HDIALSESSION session, DWORD error, LPVOID context);
+
+// Each callback fires at most once per session and exactly one of them fires for a dial that was started.
+// Complete and Error run on the RAS callback thread, Abort runs on the thread that called DialSessionAbort.
+typedef struct _DialSessionCallbacks
+{
+	DialSessionFuncType Complete;
+	DialSessionErrorFuncType Error;
+	DialSessionFuncType Abort;
+	LPVOID Context;
+} DialSessionCallbacks;
+
+extern DWORD DialSessionCreate(const DialSessionCallbacks* callbacks, HDIALSESSION* session);
+
+// Creates / updates the phonebook entry and starts an asynchronous dial, a session can only be dialed once
+extern DWORD DialSessionDial(
+	HDIALSESSION session,
+	LPCWSTR deviceName,
+	LPCWSTR connectionHostname,
+	LPCWSTR username,
+	LPCWSTR password
+);
+
+// Cancels a dial that has not connected yet, returns ERROR_INVALID_STATE once the session has finished
+extern DWORD DialSessionAbort(HDIALSESSION session);
+extern DWORD DialSessionGetState(HDIALSESSION session, DialSessionState* state, DWORD* error);
+
+// Returns ERROR_NOT_FOUND until RAS has handed the session its connection handle, for watching the connection
+// with RasConnectionNotification. The handle is only good until the connection is hung up.
+extern DWORD DialSessionGetConnection(HDIALSESSION session, HRASCONN* rasConn);
+
+// Hangs up the session's connection, connected or not, and waits for RAS to release the port so the entry can
+// be dialed again. Returns ERROR_NOT_FOUND when RAS hasn't handed over the connection yet, it's hung up as soon
+// as it does.
+extern DWORD DialSessionHangUp(HDIALSESSION session);
+
+// Aborts the session if it is still dialing and releases the handle, an established connection is left up
+extern DWORD DialSessionClose(HDIALSESSION session);
+
+typedef void(_cdecl* DialRaceCompleteFuncType)(HDIALRACE race, UINT winner, LPVOID context);
+typedef void(_cdecl* DialRaceErrorFuncType)(HDIALRACE race, DWORD error, LPVOID context);
+typedef void(_cdecl* DialRaceAbortFuncType)(HDIALRACE race, LPVOID context);
+
+// Exactly one of the callbacks fires per race, winner is an index into the hostnames passed to DialRaceStart
+typedef struct _DialRaceCallbacks
+{
+	DialRaceCompleteFuncType Complete;
+	DialRaceErrorFuncType Error;
+	DialRaceAbortFuncType Abort;
+	LPVOID Context;
+} DialRaceCallbacks;
+
+// Dials up to maxParallel of the hostnames at once, in order, starting the next candidate whenever one fails.
+// The first to connect wins and every other attempt is hung up. Each parallel slot dials its own phonebook
+// entry: slot 0 uses deviceName, further slots use "deviceName #n".
+extern DWORD DialRaceStart(
+	LPCWSTR deviceName,
+	LPCWSTR* hostnames,
+	UINT hostnameCount,
+	UINT maxParallel,
+	LPCWSTR username,
+	LPCWSTR password,
+	const DialRaceCallbacks* callbacks,
+	HDIALRACE* race
+);
+extern DWORD DialRaceAbort(HDIALRACE race);
+
+// Returns ERROR_NOT_FOUND until a candidate has won
+extern DWORD DialRaceGetWinner(HDIALRACE race, UINT* winner, LPWSTR entryName, DWORD entryNameLength);
+
+// Aborts the race if it is still running and releases it, the winning connection is left up
+extern DWORD DialRaceClose(HDIALRACE race);
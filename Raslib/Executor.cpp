@@ -0,0 +1,1161 @@
+#include "stdafx.h"
+#include <stdlib.h>
+#include "Executor.h"
+#include "NativeLog.h"
+#include "Helpers.h"
+
+#define EXECUTOR_DEFAULT_MAX_WORKERS 4
+#define EXECUTOR_DEQUE_MASK (EXECUTOR_DEQUE_CAPACITY - 1)
+#define EXECUTOR_CACHE_LINE 64
+// Freed tasks kept for reuse, past that they go back to the heap
+#define EXECUTOR_FREE_TASKS 4096
+
+// Hierarchical timer wheel of 4 levels of 64 slots. A slot of a level covers a whole revolution of the level
+// below and is spread over it when that revolution starts, so the wheel spans 2^24 ticks, about 4.6 hours.
+// Later timers wait in the top level and go round again.
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (WHEEL_LEVELS * WHEEL_BITS))
+#define WHEEL_NO_TICK MAXULONGLONG
+
+#define BENCH_PERIODIC_TIMERS 100
+#define BENCH_PERIOD_MS 100
+#define BENCH_MAX_TIMER_DELAY_MS 250
+
+static_assert((EXECUTOR_DEQUE_CAPACITY & EXECUTOR_DEQUE_MASK) == 0, "EXECUTOR_DEQUE_CAPACITY must be a power of two");
+
+typedef struct _ExecutorToken
+{
+	volatile LONG RefCount;
+	volatile LONG Cancelled;
+	// Callbacks holding the token that are running
+	volatile LONG Running;
+} ExecutorToken;
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _ExecutorTask
+{
+	// First, freed tasks go back on an interlocked list
+	SLIST_ENTRY Entry;
+	struct _ExecutorTask* Next;
+	ExecutorCallback Callback;
+	PVOID Context;
+	ExecutorToken* Token;
+} ExecutorTask;
+
+typedef struct _ExecutorTimer
+{
+	struct _ExecutorTimer* Next;
+	UINT64 DueTick;
+	DWORD PeriodMs;
+	ExecutorCallback Callback;
+	PVOID Context;
+	ExecutorToken* Token;
+} ExecutorTimer;
+
+// A Chase-Lev deque, the worker pushes and pops at Bottom and the others steal from Top. Only the worker
+// writes the counters below Bottom.
+typedef struct _ExecutorWorker
+{
+	volatile LONG64 Top;
+	BYTE Padding[EXECUTOR_CACHE_LINE - sizeof(LONG64)];
+	volatile LONG64 Bottom;
+	UINT64 Random;
+	UINT64 TasksRun;
+	UINT64 Steals;
+	UINT64 Wakeups;
+	ExecutorTask* volatile Slots[EXECUTOR_DEQUE_CAPACITY];
+} ExecutorWorker;
+
+static SRWLOCK StartLock = SRWLOCK_INIT;
+static volatile LONG Started;
+// A failed start isn't retried, the threads that did start can't be taken back
+static DWORD StartResult = ERROR_SUCCESS;
+static ExecutorWorker* Workers;
+static UINT WorkerCount;
+static __declspec(thread) ExecutorWorker* CurrentWorker;
+static __declspec(thread) ExecutorToken* CurrentToken;
+
+static SLIST_HEADER FreeTasks;
+// Tasks submitted from outside the workers and those a full deque turned away, oldest first
+static SRWLOCK QueueLock = SRWLOCK_INIT;
+static ExecutorTask* volatile QueueHead;
+static ExecutorTask* QueueTail;
+static HANDLE WorkSemaphore;
+static volatile LONG IdleWorkers;
+// Releases of WorkSemaphore no worker has taken yet, kept below IdleWorkers so a burst doesn't bank wakeups
+static volatile LONG PendingWakes;
+
+// TimerLock guards the wheel and everything below it
+static SRWLOCK TimerLock = SRWLOCK_INIT;
+static HANDLE TimerEvent;
+// High resolution waitable timer, NULL before Windows 10 1803 where waits round to the system timer
+static HANDLE TimerHandle;
+static ExecutorTimer* Wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static UINT64 Occupied[WHEEL_LEVELS];
+// Last tick the wheel has processed
+static UINT64 CurrentTick;
+// The tick the timer thread is waiting for
+static UINT64 PlannedTick = WHEEL_NO_TICK;
+static UINT TimersArmed;
+static UINT64 TimersFired;
+static volatile LONG64 TimerWakeups;
+static INT64 StartTicks;
+static INT64 TicksPerSecond;
+
+static void AddTokenRef(ExecutorToken* token)
+{
+	if (token != NULL)
+	{
+		InterlockedIncrement(&token->RefCount);
+	}
+}
+
+static void ReleaseToken(ExecutorToken* token)
+{
+	if (token != NULL && InterlockedDecrement(&token->RefCount) == 0)
+	{
+		HeapFree(GetProcessHeap(), 0, token);
+	}
+}
+
+static ExecutorTask* AllocTask(ExecutorCallback callback, PVOID context, ExecutorToken* token)
+{
+	ExecutorTask* task = (ExecutorTask*)InterlockedPopEntrySList(&FreeTasks);
+	if (task == NULL)
+	{
+		task = (ExecutorTask*)HeapAlloc(GetProcessHeap(), 0, sizeof(ExecutorTask));
+		if (task == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	task->Next = NULL;
+	task->Callback = callback;
+	task->Context = context;
+	task->Token = token;
+	AddTokenRef(token);
+
+	return task;
+}
+
+static void FreeTask(ExecutorTask* task)
+{
+	ReleaseToken(task->Token);
+
+	if (QueryDepthSList(&FreeTasks) < EXECUTOR_FREE_TASKS)
+	{
+		InterlockedPushEntrySList(&FreeTasks, &task->Entry);
+	}
+	else
+	{
+		HeapFree(GetProcessHeap(), 0, task);
+	}
+}
+
+static BOOL PushLocal(ExecutorWorker* worker, ExecutorTask* task)
+{
+	LONG64 bottom = worker->Bottom;
+	LONG64 top = ReadAcquire64(&worker->Top);
+
+	if (bottom - top >= EXECUTOR_DEQUE_CAPACITY)
+	{
+		return FALSE;
+	}
+
+	worker->Slots[bottom & EXECUTOR_DEQUE_MASK] = task;
+	WriteRelease64(&worker->Bottom, bottom + 1);
+
+	return TRUE;
+}
+
+static ExecutorTask* PopLocal(ExecutorWorker* worker)
+{
+	LONG64 bottom = worker->Bottom - 1;
+
+	// Fenced so a thief reading Top after this sees the slot taken
+	InterlockedExchange64(&worker->Bottom, bottom);
+	LONG64 top = worker->Top;
+
+	if (top > bottom)
+	{
+		worker->Bottom = bottom + 1;
+		return NULL;
+	}
+
+	ExecutorTask* task = worker->Slots[bottom & EXECUTOR_DEQUE_MASK];
+
+	if (top == bottom)
+	{
+		// The last one, thieves may be after it too
+		if (InterlockedCompareExchange64(&worker->Top, top + 1, top) != top)
+		{
+			task = NULL;
+		}
+
+		worker->Bottom = bottom + 1;
+	}
+
+	return task;
+}
+
+static ExecutorTask* StealFrom(ExecutorWorker* victim)
+{
+	LONG64 top = ReadAcquire64(&victim->Top);
+	MemoryBarrier();
+	LONG64 bottom = ReadAcquire64(&victim->Bottom);
+
+	if (top >= bottom)
+	{
+		return NULL;
+	}
+
+	ExecutorTask* task = victim->Slots[top & EXECUTOR_DEQUE_MASK];
+
+	if (InterlockedCompareExchange64(&victim->Top, top + 1, top) != top)
+	{
+		return NULL;
+	}
+
+	return task;
+}
+
+static ExecutorTask* Steal(ExecutorWorker* worker)
+{
+	// From a random worker onwards, so thieves don't all start on the same one
+	UINT start = (UINT)(NextRandom(&worker->Random) % WorkerCount);
+
+	for (UINT i = 0; i < WorkerCount; i++)
+	{
+		ExecutorWorker* victim = &Workers[(start + i) % WorkerCount];
+		if (victim == worker)
+		{
+			continue;
+		}
+
+		ExecutorTask* task = StealFrom(victim);
+		if (task != NULL)
+		{
+			worker->Steals++;
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+// Appends the tasks linked from first to last
+static void Enqueue(ExecutorTask* first, ExecutorTask* last)
+{
+	AcquireSRWLockExclusive(&QueueLock);
+	if (QueueTail != NULL)
+	{
+		QueueTail->Next = first;
+	}
+	else
+	{
+		QueueHead = first;
+	}
+	QueueTail = last;
+	ReleaseSRWLockExclusive(&QueueLock);
+}
+
+static ExecutorTask* Dequeue()
+{
+	// Checked without the lock first, idle workers look here on every pass
+	if (QueueHead == NULL)
+	{
+		return NULL;
+	}
+
+	AcquireSRWLockExclusive(&QueueLock);
+	ExecutorTask* task = QueueHead;
+	if (task != NULL)
+	{
+		QueueHead = task->Next;
+		if (QueueHead == NULL)
+		{
+			QueueTail = NULL;
+		}
+	}
+	ReleaseSRWLockExclusive(&QueueLock);
+
+	return task;
+}
+
+// Call after queueing count tasks. Either an idle worker sees them on its last look before waiting or this sees
+// the worker idle. Workers that go idle again while this runs are left be, they look for work first.
+static void WakeWorkers(UINT count)
+{
+	MemoryBarrier();
+
+	count = min(count, (UINT)IdleWorkers);
+
+	for (UINT woken = 0; woken < count;)
+	{
+		LONG pending = PendingWakes;
+		if (pending >= IdleWorkers)
+		{
+			return;
+		}
+
+		if (InterlockedCompareExchange(&PendingWakes, pending + 1, pending) == pending)
+		{
+			ReleaseSemaphore(WorkSemaphore, 1, NULL);
+			woken++;
+		}
+	}
+}
+
+static void QueueTask(ExecutorTask* task)
+{
+	ExecutorWorker* worker = CurrentWorker;
+
+	if (worker == NULL || !PushLocal(worker, task))
+	{
+		Enqueue(task, task);
+	}
+
+	WakeWorkers(1);
+}
+
+static ExecutorTask* FindTask(ExecutorWorker* worker)
+{
+	ExecutorTask* task = PopLocal(worker);
+
+	if (task == NULL)
+	{
+		task = Dequeue();
+	}
+
+	if (task == NULL)
+	{
+		task = Steal(worker);
+	}
+
+	return task;
+}
+
+static void RunTask(ExecutorWorker* worker, ExecutorTask* task)
+{
+	ExecutorToken* token = task->Token;
+
+	if (token == NULL)
+	{
+		task->Callback(task->Context);
+	}
+	else
+	{
+		// ExecutorCancel sets Cancelled then waits for Running, so either it waits for this or this sees it
+		InterlockedIncrement(&token->Running);
+		if (!token->Cancelled)
+		{
+			CurrentToken = token;
+			task->Callback(task->Context);
+			CurrentToken = NULL;
+		}
+		InterlockedDecrement(&token->Running);
+	}
+
+	worker->TasksRun++;
+	FreeTask(task);
+}
+
+static DWORD WINAPI WorkerThreadFunc(LPVOID parameter)
+{
+	ExecutorWorker* worker = (ExecutorWorker*)parameter;
+
+	CurrentWorker = worker;
+
+	for (;;)
+	{
+		ExecutorTask* task = FindTask(worker);
+
+		if (task == NULL)
+		{
+			InterlockedIncrement(&IdleWorkers);
+
+			task = FindTask(worker);
+			if (task == NULL)
+			{
+				WaitForSingleObject(WorkSemaphore, INFINITE);
+
+				// No longer idle before the wake is taken, so WakeWorkers doesn't count this worker twice
+				InterlockedDecrement(&IdleWorkers);
+				InterlockedDecrement(&PendingWakes);
+				worker->Wakeups++;
+				continue;
+			}
+
+			InterlockedDecrement(&IdleWorkers);
+		}
+
+		RunTask(worker, task);
+	}
+}
+
+static UINT64 NowTick()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (UINT64)((now.QuadPart - StartTicks) * 1000 / TicksPerSecond) / EXECUTOR_TICK_MS;
+}
+
+// The first tick at or after delayMs from now, so a timer never fires early
+static UINT64 DueTickAfter(DWORD delayMs)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	// In thousandths of a performance counter tick
+	UINT64 due = (UINT64)(now.QuadPart - StartTicks) * 1000 + (UINT64)delayMs * TicksPerSecond;
+	UINT64 tickLength = (UINT64)TicksPerSecond * EXECUTOR_TICK_MS;
+
+	return (due + tickLength - 1) / tickLength;
+}
+
+static UINT LowestBit(UINT64 bits)
+{
+	DWORD index;
+
+	if (_BitScanForward(&index, (DWORD)bits))
+	{
+		return index;
+	}
+
+	_BitScanForward(&index, (DWORD)(bits >> 32));
+	return index + 32;
+}
+
+static UINT64 RotateRight(UINT64 bits, UINT count)
+{
+	return count == 0 ? bits : (bits >> count) | (bits << (64 - count));
+}
+
+// Puts timer in the slot of the lowest level whose revolution reaches its due tick, or on fired once it's due
+static void InsertTimer(ExecutorTimer* timer, ExecutorTimer** fired)
+{
+	if (timer->DueTick <= CurrentTick)
+	{
+		timer->Next = *fired;
+		*fired = timer;
+		return;
+	}
+
+	UINT64 due = min(timer->DueTick, CurrentTick + WHEEL_SPAN - 1);
+	UINT64 delta = due - CurrentTick;
+	UINT level = 0;
+
+	while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_BITS)))
+	{
+		level++;
+	}
+
+	UINT slot = (UINT)(due >> (level * WHEEL_BITS)) & WHEEL_MASK;
+
+	timer->Next = Wheel[level][slot];
+	Wheel[level][slot] = timer;
+	Occupied[level] |= 1ULL << slot;
+}
+
+static ExecutorTimer* TakeSlot(UINT level, UINT slot)
+{
+	ExecutorTimer* timers = Wheel[level][slot];
+
+	Wheel[level][slot] = NULL;
+	Occupied[level] &= ~(1ULL << slot);
+
+	return timers;
+}
+
+// The next tick with a timer to fire or a slot to spread, WHEEL_NO_TICK when the wheel is empty
+static UINT64 NextEventTick()
+{
+	UINT64 next = WHEEL_NO_TICK;
+
+	for (UINT level = 0; level < WHEEL_LEVELS; level++)
+	{
+		if (Occupied[level] == 0)
+		{
+			continue;
+		}
+
+		UINT shift = level * WHEEL_BITS;
+		UINT64 current = CurrentTick >> shift;
+		UINT distance = LowestBit(RotateRight(Occupied[level], (UINT)((current + 1) & WHEEL_MASK)));
+
+		next = min(next, (current + 1 + distance) << shift);
+	}
+
+	return next;
+}
+
+static void Tick(ExecutorTimer** fired)
+{
+	CurrentTick++;
+
+	for (UINT level = 1; level < WHEEL_LEVELS && (CurrentTick & ((1ULL << (level * WHEEL_BITS)) - 1)) == 0; level++)
+	{
+		ExecutorTimer* timer = TakeSlot(level, (UINT)(CurrentTick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+
+		while (timer != NULL)
+		{
+			ExecutorTimer* next = timer->Next;
+			InsertTimer(timer, fired);
+			timer = next;
+		}
+	}
+
+	ExecutorTimer* timer = TakeSlot(0, (UINT)CurrentTick & WHEEL_MASK);
+
+	while (timer != NULL)
+	{
+		ExecutorTimer* next = timer->Next;
+		timer->Next = *fired;
+		*fired = timer;
+		timer = next;
+	}
+}
+
+// Moves the wheel up to now, going straight to the ticks that have something on them
+static void AdvanceWheel(UINT64 now, ExecutorTimer** fired)
+{
+	while (CurrentTick < now)
+	{
+		UINT64 next = NextEventTick();
+		if (next > now)
+		{
+			CurrentTick = now;
+			break;
+		}
+
+		CurrentTick = next - 1;
+		Tick(fired);
+	}
+}
+
+static void FreeTimer(ExecutorTimer* timer)
+{
+	ReleaseToken(timer->Token);
+	HeapFree(GetProcessHeap(), 0, timer);
+	TimersArmed--;
+}
+
+// Queues the fired timers' tasks together so the workers are woken once for the lot
+static void FireTimers(ExecutorTimer* fired)
+{
+	ExecutorTask* first = NULL;
+	ExecutorTask* last = NULL;
+	UINT count = 0;
+
+	while (fired != NULL)
+	{
+		ExecutorTimer* timer = fired;
+		fired = timer->Next;
+
+		if (timer->Token != NULL && timer->Token->Cancelled)
+		{
+			FreeTimer(timer);
+			continue;
+		}
+
+		ExecutorTask* task = AllocTask(timer->Callback, timer->Context, timer->Token);
+		if (task != NULL)
+		{
+			if (last != NULL)
+			{
+				last->Next = task;
+			}
+			else
+			{
+				first = task;
+			}
+			last = task;
+			count++;
+		}
+		else
+		{
+			NATIVELOG_ERROR("executor dropped a timer firing, out of memory\n");
+		}
+
+		if (timer->PeriodMs == 0)
+		{
+			FreeTimer(timer);
+			continue;
+		}
+
+		// A timer that fell behind skips the runs it missed rather than firing them back to back
+		UINT64 period = (timer->PeriodMs + EXECUTOR_TICK_MS - 1) / EXECUTOR_TICK_MS;
+		timer->DueTick = timer->DueTick + period > CurrentTick ? timer->DueTick + period : CurrentTick + period;
+		InsertTimer(timer, &fired);
+	}
+
+	if (first != NULL)
+	{
+		Enqueue(first, last);
+		WakeWorkers(count);
+		TimersFired += count;
+	}
+}
+
+static void WaitForTimer(UINT64 tick)
+{
+	if (tick == WHEEL_NO_TICK)
+	{
+		WaitForSingleObject(TimerEvent, INFINITE);
+		return;
+	}
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	INT64 due = StartTicks + (INT64)(tick * EXECUTOR_TICK_MS * TicksPerSecond / 1000);
+	INT64 remaining = due - now.QuadPart;
+	if (remaining <= 0)
+	{
+		return;
+	}
+
+	if (TimerHandle != NULL)
+	{
+		HANDLE handles[2] = { TimerEvent, TimerHandle };
+		LARGE_INTEGER dueTime;
+
+		// Relative, in 100 ns units
+		dueTime.QuadPart = -(remaining * 10000000 / TicksPerSecond + 1);
+		if (SetWaitableTimer(TimerHandle, &dueTime, 0, NULL, NULL, FALSE))
+		{
+			WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+			return;
+		}
+	}
+
+	WaitForSingleObject(TimerEvent, (DWORD)((remaining * 1000 + TicksPerSecond - 1) / TicksPerSecond));
+}
+
+static DWORD WINAPI TimerThreadFunc(LPVOID parameter)
+{
+	AcquireSRWLockExclusive(&TimerLock);
+
+	for (;;)
+	{
+		ExecutorTimer* fired = NULL;
+
+		AdvanceWheel(NowTick(), &fired);
+		FireTimers(fired);
+
+		PlannedTick = NextEventTick();
+		UINT64 tick = PlannedTick;
+
+		ReleaseSRWLockExclusive(&TimerLock);
+
+		WaitForTimer(tick);
+		InterlockedIncrement64(&TimerWakeups);
+
+		AcquireSRWLockExclusive(&TimerLock);
+	}
+}
+
+static DWORD StartLocked(const ExecutorOptions* options)
+{
+	SYSTEM_INFO info;
+	LARGE_INTEGER frequency, now;
+
+	GetSystemInfo(&info);
+
+	UINT workers = options != NULL && options->Workers != 0 ? options->Workers : min(max((UINT)info.dwNumberOfProcessors, 2U), (UINT)EXECUTOR_DEFAULT_MAX_WORKERS);
+	if (workers > EXECUTOR_MAX_WORKERS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	TicksPerSecond = frequency.QuadPart;
+	StartTicks = now.QuadPart;
+	InitializeSListHead(&FreeTasks);
+
+	WorkSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	TimerEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	Workers = (ExecutorWorker*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, workers * sizeof(ExecutorWorker));
+	if (WorkSemaphore == NULL || TimerEvent == NULL || Workers == NULL)
+	{
+		return Workers == NULL ? ERROR_NOT_ENOUGH_MEMORY : GetLastError();
+	}
+
+	TimerHandle = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+	WorkerCount = workers;
+
+	for (UINT i = 0; i < workers; i++)
+	{
+		Workers[i].Random = (i + 1) * 0x9E3779B97F4A7C15ULL;
+
+		HANDLE thread = CreateThread(NULL, 0, WorkerThreadFunc, &Workers[i], 0, NULL);
+		if (thread == NULL)
+		{
+			// Its empty deque is harmless to steal from
+			return GetLastError();
+		}
+
+		CloseHandle(thread);
+	}
+
+	HANDLE thread = CreateThread(NULL, 0, TimerThreadFunc, NULL, 0, NULL);
+	if (thread == NULL)
+	{
+		return GetLastError();
+	}
+
+	CloseHandle(thread);
+
+	NATIVELOG_INFO("executor started, %u workers%s\n", workers, TimerHandle != NULL ? "" : ", timers at the system timer resolution");
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD Start(const ExecutorOptions* options, BOOL explicitStart)
+{
+	DWORD result;
+
+	if (ReadAcquire(&Started))
+	{
+		return explicitStart ? ERROR_ALREADY_EXISTS : StartResult;
+	}
+
+	AcquireSRWLockExclusive(&StartLock);
+	if (Started)
+	{
+		result = explicitStart ? ERROR_ALREADY_EXISTS : StartResult;
+	}
+	else
+	{
+		result = StartResult = StartLocked(options);
+		if (result != ERROR_SUCCESS)
+		{
+			NATIVELOG_ERROR("executor failed to start: 0x%.8X\n", result);
+		}
+
+		WriteRelease(&Started, TRUE);
+	}
+	ReleaseSRWLockExclusive(&StartLock);
+
+	return result;
+}
+
+DWORD ExecutorStart(const ExecutorOptions* options)
+{
+	return Start(options, TRUE);
+}
+
+DWORD ExecutorSubmit(ExecutorCallback callback, PVOID context, HEXECTOKEN token)
+{
+	if (callback == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DWORD result = Start(NULL, FALSE);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	if (token != NULL && token->Cancelled)
+	{
+		return ERROR_CANCELLED;
+	}
+
+	ExecutorTask* task = AllocTask(callback, context, token);
+	if (task == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	QueueTask(task);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ExecutorSchedule(DWORD delayMs, DWORD periodMs, ExecutorCallback callback, PVOID context, HEXECTOKEN token)
+{
+	if (callback == NULL || (periodMs != 0 && token == NULL))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (delayMs == 0 && periodMs == 0)
+	{
+		return ExecutorSubmit(callback, context, token);
+	}
+
+	DWORD result = Start(NULL, FALSE);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	if (token != NULL && token->Cancelled)
+	{
+		return ERROR_CANCELLED;
+	}
+
+	ExecutorTimer* timer = (ExecutorTimer*)HeapAlloc(GetProcessHeap(), 0, sizeof(ExecutorTimer));
+	if (timer == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	timer->PeriodMs = periodMs;
+	timer->Callback = callback;
+	timer->Context = context;
+	timer->Token = token;
+	AddTokenRef(token);
+
+	AcquireSRWLockExclusive(&TimerLock);
+
+	// An empty wheel isn't moved while the thread waits, there's nothing on it to catch up on
+	if (TimersArmed == 0)
+	{
+		CurrentTick = max(CurrentTick, NowTick());
+	}
+
+	timer->DueTick = max(DueTickAfter(delayMs), CurrentTick + 1);
+	TimersArmed++;
+
+	ExecutorTimer* fired = NULL;
+	InsertTimer(timer, &fired);
+
+	UINT64 next = NextEventTick();
+	if (next < PlannedTick)
+	{
+		PlannedTick = next;
+		SetEvent(TimerEvent);
+	}
+
+	ReleaseSRWLockExclusive(&TimerLock);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ExecutorCreateToken(HEXECTOKEN* token)
+{
+	if (token == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ExecutorToken* created = (ExecutorToken*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ExecutorToken));
+	if (created == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	created->RefCount = 1;
+	*token = created;
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ExecutorCancel(HEXECTOKEN token, BOOL wait)
+{
+	if (token == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	InterlockedExchange(&token->Cancelled, TRUE);
+
+	if (wait)
+	{
+		// A callback cancelling its own token is one of those running
+		LONG self = CurrentToken == token ? 1 : 0;
+
+		for (UINT spins = 0; token->Running > self; spins++)
+		{
+			Sleep(spins < 16 ? 0 : 1);
+		}
+	}
+
+	return ERROR_SUCCESS;
+}
+
+BOOL ExecutorIsCancelled(HEXECTOKEN token)
+{
+	return token != NULL && token->Cancelled;
+}
+
+DWORD ExecutorCloseToken(HEXECTOKEN token)
+{
+	if (token == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ReleaseToken(token);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD ExecutorGetStats(ExecutorStats* stats)
+{
+	if (stats == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(stats, sizeof(*stats));
+
+	if (!ReadAcquire(&Started) || StartResult != ERROR_SUCCESS)
+	{
+		return ERROR_SUCCESS;
+	}
+
+	stats->Workers = WorkerCount;
+
+	// The workers' own counters, read while they may be moving
+	for (UINT i = 0; i < WorkerCount; i++)
+	{
+		stats->TasksRun += Workers[i].TasksRun;
+		stats->Steals += Workers[i].Steals;
+		stats->Wakeups += Workers[i].Wakeups;
+	}
+
+	AcquireSRWLockShared(&TimerLock);
+	stats->TimersArmed = TimersArmed;
+	stats->TimersFired = TimersFired;
+	ReleaseSRWLockShared(&TimerLock);
+
+	stats->Wakeups += (UINT64)TimerWakeups;
+
+	return ERROR_SUCCESS;
+}
+
+#ifdef NATIVE_BENCH
+typedef struct _ExecutorBench
+{
+	HANDLE Done;
+	volatile LONG Remaining;
+	UINT FanOut;
+	INT64 QueuedTicks;
+	INT64 StartedTicks;
+	// Per timer, when it's due then how late it was
+	LONGLONG* Timers;
+} ExecutorBench;
+
+typedef struct _ExecutorBenchTimer
+{
+	ExecutorBench* Bench;
+	INT64 DueTicks;
+	LONGLONG* Lateness;
+} ExecutorBenchTimer;
+
+static void Summarise(LONGLONG* ticks, DWORD samples, ExecutorLatency* latency)
+{
+	TickSummary summary;
+	SummariseTicks(ticks, samples, TicksPerSecond, &summary);
+
+	latency->Samples = summary.Samples;
+	latency->MeanUs = summary.MeanUs;
+	latency->P50Us = summary.P50Us;
+	latency->P99Us = summary.P99Us;
+	latency->MaxUs = summary.MaxUs;
+}
+
+static INT64 BenchNow()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static void CALLBACK BenchDispatch(PVOID context)
+{
+	ExecutorBench* bench = (ExecutorBench*)context;
+
+	bench->StartedTicks = BenchNow();
+	SetEvent(bench->Done);
+}
+
+static void CALLBACK BenchLeaf(PVOID context)
+{
+	ExecutorBench* bench = (ExecutorBench*)context;
+
+	if (InterlockedDecrement(&bench->Remaining) == 0)
+	{
+		SetEvent(bench->Done);
+	}
+}
+
+// Queues the leaves on the worker running it for the others to steal
+static void CALLBACK BenchFanOut(PVOID context)
+{
+	ExecutorBench* bench = (ExecutorBench*)context;
+
+	for (UINT i = 0; i < bench->FanOut; i++)
+	{
+		if (ExecutorSubmit(BenchLeaf, bench, NULL) != ERROR_SUCCESS)
+		{
+			BenchLeaf(bench);
+		}
+	}
+}
+
+static void CALLBACK BenchTimer(PVOID context)
+{
+	ExecutorBenchTimer* timer = (ExecutorBenchTimer*)context;
+
+	*timer->Lateness = BenchNow() - timer->DueTicks;
+
+	if (InterlockedDecrement(&timer->Bench->Remaining) == 0)
+	{
+		SetEvent(timer->Bench->Done);
+	}
+}
+
+static void CALLBACK BenchNoop(PVOID context)
+{
+}
+
+static DOUBLE WakeupsPerSecond(DWORD idleMs)
+{
+	ExecutorStats before, after;
+
+	ExecutorGetStats(&before);
+	Sleep(idleMs);
+	ExecutorGetStats(&after);
+
+	return (DOUBLE)(after.Wakeups - before.Wakeups) * 1000.0 / idleMs;
+}
+
+DWORD ExecutorRunBenchmark(UINT tasks, UINT timers, DWORD idleMs, ExecutorBenchReport* report)
+{
+	ExecutorBench bench;
+	ExecutorStats stats;
+	HEXECTOKEN token = NULL;
+	LONGLONG* samples = NULL;
+	UINT64 steals;
+	INT64 started;
+	ExecutorBenchTimer* contexts = NULL;
+	DWORD result;
+
+	if (tasks == 0 || timers == 0 || idleMs == 0 || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(*report));
+	ZeroMemory(&bench, sizeof(bench));
+
+	result = Start(NULL, FALSE);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	bench.Done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	samples = (LONGLONG*)HeapAlloc(GetProcessHeap(), 0, max(tasks, timers) * sizeof(LONGLONG));
+	contexts = (ExecutorBenchTimer*)HeapAlloc(GetProcessHeap(), 0, timers * sizeof(ExecutorBenchTimer));
+	if (bench.Done == NULL || samples == NULL || contexts == NULL)
+	{
+		result = bench.Done == NULL ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+		goto Cleanup;
+	}
+
+	ExecutorGetStats(&stats);
+	report->Workers = stats.Workers;
+
+	// One at a time, so each lands on a worker that's waiting
+	for (UINT i = 0; i < tasks; i++)
+	{
+		bench.QueuedTicks = BenchNow();
+
+		result = ExecutorSubmit(BenchDispatch, &bench, NULL);
+		if (result != ERROR_SUCCESS)
+		{
+			goto Cleanup;
+		}
+
+		WaitForSingleObject(bench.Done, INFINITE);
+		samples[i] = bench.StartedTicks - bench.QueuedTicks;
+	}
+
+	Summarise(samples, tasks, &report->Dispatch);
+
+	steals = stats.Steals;
+	bench.FanOut = tasks;
+	bench.Remaining = (LONG)tasks;
+	started = BenchNow();
+
+	result = ExecutorSubmit(BenchFanOut, &bench, NULL);
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	WaitForSingleObject(bench.Done, INFINITE);
+	report->FanOutPerSecond = tasks / ((DOUBLE)(BenchNow() - started) / TicksPerSecond);
+	ExecutorGetStats(&stats);
+	report->Steals = stats.Steals - steals;
+
+	bench.Remaining = (LONG)timers;
+	for (UINT i = 0; i < timers; i++)
+	{
+		DWORD delayMs = (DWORD)(i * 7919 % BENCH_MAX_TIMER_DELAY_MS) + 1;
+
+		contexts[i].Bench = &bench;
+		contexts[i].Lateness = &samples[i];
+		contexts[i].DueTicks = BenchNow() + (INT64)delayMs * TicksPerSecond / 1000;
+
+		result = ExecutorSchedule(delayMs, 0, BenchTimer, &contexts[i], NULL);
+		if (result != ERROR_SUCCESS)
+		{
+			// The ones already scheduled still point at contexts
+			WaitForSingleObject(bench.Done, BENCH_MAX_TIMER_DELAY_MS * 4);
+			goto Cleanup;
+		}
+	}
+
+	WaitForSingleObject(bench.Done, INFINITE);
+	Summarise(samples, timers, &report->TimerLateness);
+
+	report->IdleWakeupsPerSecond = WakeupsPerSecond(idleMs);
+
+	result = ExecutorCreateToken(&token);
+	for (UINT i = 0; result == ERROR_SUCCESS && i < BENCH_PERIODIC_TIMERS; i++)
+	{
+		result = ExecutorSchedule(BENCH_PERIOD_MS, BENCH_PERIOD_MS, BenchNoop, NULL, token);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		report->PeriodicWakeupsPerSecond = WakeupsPerSecond(idleMs);
+	}
+
+Cleanup:
+	if (token != NULL)
+	{
+		ExecutorCancel(token, TRUE);
+		ExecutorCloseToken(token);
+	}
+
+	if (bench.Done != NULL)
+	{
+		CloseHandle(bench.Done);
+	}
+
+	if (samples != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, samples);
+	}
+
+	if (contexts != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, contexts);
+	}
+
+	return result;
+}
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+#include <Windows.h>
+
+// The shared executor runs Raslib's and Netlib's deferred work and timers: dial race launches, hang ups, device
+// preparation, the reconnectors and DNS cache refreshes. Work that waits on RAS or the network holds its worker
+// for the wait. Loops that block on sockets or handles keep threads of their own, as the executor can't wait on
+// them: the tunnel monitor, the DNS forwarder, the management transport, the supervisor and the metrics
+// listener. So does the native log's drain, which the executor itself logs through.
+
+#define EXECUTOR_MAX_WORKERS 64
+// Tasks a worker queues for itself before they go to the shared queue
+#define EXECUTOR_DEQUE_CAPACITY 1024
+#define EXECUTOR_TICK_MS 1
+
+typedef struct _ExecutorToken* HEXECTOKEN;
+
+typedef void (CALLBACK* ExecutorCallback)(PVOID context);
+
+// Zero fields take the defaults in Executor.cpp
+typedef struct _ExecutorOptions
+{
+	UINT Workers;
+} ExecutorOptions;
+
+// Starts the workers and the timer thread with options, ERROR_ALREADY_EXISTS once they're running. Submitting
+// or scheduling starts them with the defaults, so this is only needed to size the pool. They run until the
+// process exits, each DLL linking Raslib has its own.
+extern DWORD ExecutorStart(const ExecutorOptions* options);
+
+// Runs callback on a worker. Called from a worker it goes on that worker's own queue, where idle workers steal
+// it from. Nothing runs once token is cancelled, NULL for work that can't be.
+extern DWORD ExecutorSubmit(ExecutorCallback callback, PVOID context, HEXECTOKEN token);
+
+// Runs callback on a worker once delayMs has passed, then every periodMs until token is cancelled when periodMs
+// isn't 0. A periodic timer needs a token. A timer whose token is cancelled is dropped when it comes due.
+extern DWORD ExecutorSchedule(DWORD delayMs, DWORD periodMs, ExecutorCallback callback, PVOID context, HEXECTOKEN token);
+
+extern DWORD ExecutorCreateToken(HEXECTOKEN* token);
+
+// Stops the tasks and timers holding token from running from now on. With wait, also waits for the callbacks
+// already running to return, other than the calling one's.
+extern DWORD ExecutorCancel(HEXECTOKEN token, BOOL wait);
+
+// For a long running callback to check between steps
+extern BOOL ExecutorIsCancelled(HEXECTOKEN token);
+
+// Drops the caller's reference, the token lives on while tasks and timers hold it
+extern DWORD ExecutorCloseToken(HEXECTOKEN token);
+
+typedef struct _ExecutorStats
+{
+	UINT Workers;
+	UINT TimersArmed;
+	UINT64 TasksRun;
+	UINT64 Steals;
+	UINT64 TimersFired;
+	// Times a worker or the timer thread woke from a wait
+	UINT64 Wakeups;
+} ExecutorStats;
+
+extern DWORD ExecutorGetStats(ExecutorStats* stats);
+
+#ifdef NATIVE_BENCH
+typedef struct _ExecutorLatency
+{
+	DWORD Samples;
+	DOUBLE MeanUs;
+	DOUBLE P50Us;
+	DOUBLE P99Us;
+	DOUBLE MaxUs;
+} ExecutorLatency;
+
+typedef struct _ExecutorBenchReport
+{
+	UINT Workers;
+	// From ExecutorSubmit to the callback starting, one task at a time onto idle workers
+	ExecutorLatency Dispatch;
+	// Tasks one worker queues for itself and the others steal from it
+	DOUBLE FanOutPerSecond;
+	UINT64 Steals;
+	// How much later than asked one-shot timers of 1 to 250 ms fire
+	ExecutorLatency TimerLateness;
+	// Wakeups of the executor's threads with nothing to do, then with 100 timers every 100 ms
+	DOUBLE IdleWakeupsPerSecond;
+	DOUBLE PeriodicWakeupsPerSecond;
+} ExecutorBenchReport;
+
+// Runs on the shared executor, starting it with the defaults when it isn't running. Measures tasks task
+// dispatches and fan out, timers timers, and idleMs of each of the wakeup counts.
+extern DWORD ExecutorRunBenchmark(UINT tasks, UINT timers, DWORD idleMs, ExecutorBenchReport* report);
+#endif
@@ -0,0 +1,490 @@
+#include "stdafx.h"
+#include <strsafe.h>
+#include "FlightRecorder.h"
+#include "NativeLog.h"
+
+#define FLIGHT_TEMP_SUFFIX L".tmp"
+#define FLIGHT_PREVIOUS_SUFFIX L".previous"
+#define FLIGHT_BENCH_MAX_THREADS MAXIMUM_WAIT_OBJECTS
+
+// Orders clearing an event's Sequence ahead of its fields, x86 and x64 keep stores in order by themselves
+#if defined(_M_ARM64)
+#define FLIGHT_STORE_FENCE() __dmb(_ARM64_BARRIER_ISHST)
+#else
+#define FLIGHT_STORE_FENCE() _WriteBarrier()
+#endif
+
+volatile LONG FlightRecorderActive = 0;
+
+// Mapped once by FlightRecorderStart and never unmapped, any thread can be part way through an event
+static FlightHeader* volatile Recording = NULL;
+static SRWLOCK StartLock = SRWLOCK_INIT;
+static UINT32 EventMask = 0;
+static LPTOP_LEVEL_EXCEPTION_FILTER PreviousFilter = NULL;
+// The ring the thread records into, claimed on its first event
+static __declspec(thread) FlightRing* ThreadRing;
+
+static FlightRing* RingAt(FlightHeader* header, UINT index)
+{
+	return (FlightRing*)((BYTE*)header + sizeof(FlightHeader) + index * FLIGHT_RING_LENGTH(header->EventsPerRing));
+}
+
+static FlightEvent* RingEvents(FlightRing* ring)
+{
+	return (FlightEvent*)(ring + 1);
+}
+
+static FORCEINLINE void RecordInto(FlightRing* ring, UINT32 mask, FlightEventType type, UINT32 value, UINT64 argument)
+{
+	LARGE_INTEGER now;
+	LONG64 index;
+
+	QueryPerformanceCounter(&now);
+
+	if (ring->Flags & FLIGHT_RING_SHARED)
+	{
+		index = InterlockedIncrement64(&ring->Head) - 1;
+	}
+	else
+	{
+		// Only the owning thread writes Head
+		index = ring->Head;
+		ring->Head = index + 1;
+	}
+
+	FlightEvent* event = &RingEvents(ring)[index & mask];
+
+	// A dump copying the slot meanwhile sees the change and leaves it out
+	WriteNoFence((volatile LONG*)&event->Sequence, 0);
+	FLIGHT_STORE_FENCE();
+
+	event->Ticks = now.QuadPart;
+	event->Argument = argument;
+	event->ThreadId = GetCurrentThreadId();
+	event->Type = (UINT16)type;
+	event->Reserved = 0;
+	event->Value = value;
+
+	WriteRelease((volatile LONG*)&event->Sequence, (LONG)(UINT32)(index + 1));
+}
+
+static FlightRing* ClaimRing(FlightHeader* header)
+{
+	LONG claimed = InterlockedIncrement(&header->RingsClaimed);
+
+	// Threads past the rings handed out share the last one
+	FlightRing* ring = RingAt(header, claimed < (LONG)header->RingCount ? (UINT)claimed - 1 : header->RingCount - 1);
+	if (!(ring->Flags & FLIGHT_RING_SHARED))
+	{
+		ring->ThreadId = GetCurrentThreadId();
+	}
+
+	ThreadRing = ring;
+	return ring;
+}
+
+void FlightRecordSlow(FlightEventType type, UINT32 value, UINT64 argument)
+{
+	FlightHeader* header = Recording;
+	if (header == NULL)
+	{
+		return;
+	}
+
+	FlightRing* ring = ThreadRing;
+	if (ring == NULL)
+	{
+		ring = ClaimRing(header);
+	}
+
+	RecordInto(ring, EventMask, type, value, argument);
+}
+
+// Runs on the crashing thread with the process in whatever state it's in, so it only touches the mapping. The
+// events are already there, this adds what the process died of.
+static LONG WINAPI CrashFilter(EXCEPTION_POINTERS* exception)
+{
+	FlightHeader* header = Recording;
+
+	if (header != NULL && exception != NULL && exception->ExceptionRecord != NULL)
+	{
+		header->CrashCode = exception->ExceptionRecord->ExceptionCode;
+		FlightRecord(FlightCrash, exception->ExceptionRecord->ExceptionCode, (UINT64)(ULONG_PTR)exception->ExceptionRecord->ExceptionAddress);
+	}
+
+	return PreviousFilter != NULL ? PreviousFilter(exception) : EXCEPTION_CONTINUE_SEARCH;
+}
+
+// Maps a zeroed recording of length bytes, backed by path or by the paging file when it's NULL
+static DWORD MapRecording(LPCWSTR path, SIZE_T length, FlightHeader** header)
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+
+	if (path != NULL)
+	{
+		WCHAR previousPath[MAX_PATH];
+		if (FAILED(StringCchPrintfW(previousPath, MAX_PATH, L"%s" FLIGHT_PREVIOUS_SUFFIX, path)))
+		{
+			return ERROR_FILENAME_EXCED_RANGE;
+		}
+
+		// What the last run left is what gets asked for after a crash, there may be nothing to move
+		MoveFileExW(path, previousPath, MOVEFILE_REPLACE_EXISTING);
+
+		file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return GetLastError();
+		}
+	}
+
+	DWORD result = ERROR_SUCCESS;
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, (DWORD)((UINT64)length >> 32), (DWORD)length, NULL);
+	if (mapping == NULL)
+	{
+		result = GetLastError();
+	}
+	else
+	{
+		*header = (FlightHeader*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, length);
+		if (*header == NULL)
+		{
+			result = GetLastError();
+		}
+
+		// The view holds the mapping and the file open
+		CloseHandle(mapping);
+	}
+
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file);
+	}
+
+	if (result != ERROR_SUCCESS && path != NULL)
+	{
+		DeleteFileW(path);
+	}
+
+	return result;
+}
+
+static void InitializeHeader(FlightHeader* header, UINT rings, UINT eventsPerRing)
+{
+	LARGE_INTEGER frequency, now;
+	FILETIME time;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	GetSystemTimeAsFileTime(&time);
+
+	header->RingCount = rings;
+	header->EventsPerRing = eventsPerRing;
+	header->StartTicks = now.QuadPart;
+	header->TicksPerSecond = frequency.QuadPart;
+	header->StartTime = ((UINT64)time.dwHighDateTime << 32) | time.dwLowDateTime;
+	header->ProcessId = GetCurrentProcessId();
+	RingAt(header, rings - 1)->Flags = FLIGHT_RING_SHARED;
+
+	// Last, a decoder reading the file takes a valid magic to mean the rest is filled in
+	header->Version = FLIGHT_VERSION;
+	WriteRelease((volatile LONG*)&header->Magic, FLIGHT_MAGIC);
+}
+
+DWORD FlightRecorderStart(LPCWSTR path, UINT rings, UINT eventsPerRing)
+{
+	FlightHeader* header = NULL;
+	DWORD result;
+
+	if (rings == 0)
+	{
+		rings = FLIGHT_DEFAULT_RINGS;
+	}
+
+	if (eventsPerRing == 0)
+	{
+		eventsPerRing = FLIGHT_DEFAULT_EVENTS;
+	}
+
+	if (rings > FLIGHT_MAX_RINGS || eventsPerRing > FLIGHT_MAX_EVENTS || (eventsPerRing & (eventsPerRing - 1)) != 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&StartLock);
+	if (Recording != NULL)
+	{
+		result = ERROR_ALREADY_EXISTS;
+	}
+	else
+	{
+		result = MapRecording(path, FLIGHT_FILE_LENGTH(rings, eventsPerRing), &header);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		InitializeHeader(header, rings, eventsPerRing);
+		EventMask = eventsPerRing - 1;
+		Recording = header;
+		PreviousFilter = SetUnhandledExceptionFilter(CrashFilter);
+		InterlockedExchange(&FlightRecorderActive, 1);
+	}
+	ReleaseSRWLockExclusive(&StartLock);
+
+	if (result == ERROR_SUCCESS)
+	{
+		NATIVELOG_INFO("flight recorder started, %u rings of %u events%s\n", rings, eventsPerRing, path != NULL ? " mapped to disk" : "");
+	}
+	else if (result != ERROR_ALREADY_EXISTS)
+	{
+		NATIVELOG_ERROR("flight recorder failed to start: 0x%.8X\n", result);
+	}
+
+	return result;
+}
+
+DWORD FlightRecorderSetEnabled(BOOL enabled)
+{
+	if (Recording == NULL)
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	InterlockedExchange(&FlightRecorderActive, enabled ? 1 : 0);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD FlightRecorderMark(UINT32 value, UINT64 argument)
+{
+	FlightRecord(FlightMark, value, argument);
+
+	return ERROR_SUCCESS;
+}
+
+// Copies the events that stay the same from before to after being copied, the others are left zeroed
+static void Snapshot(FlightHeader* header, FlightHeader* copy)
+{
+	*copy = *header;
+	copy->RingsClaimed = min(header->RingsClaimed, (LONG)header->RingCount);
+
+	for (UINT i = 0; i < header->RingCount; i++)
+	{
+		FlightRing* ring = RingAt(header, i);
+		FlightRing* copyRing = RingAt(copy, i);
+		FlightEvent* events = RingEvents(ring);
+		FlightEvent* copyEvents = RingEvents(copyRing);
+
+		*copyRing = *ring;
+
+		for (UINT slot = 0; slot < header->EventsPerRing; slot++)
+		{
+			UINT32 sequence = (UINT32)ReadAcquire((volatile LONG*)&events[slot].Sequence);
+			if (sequence == 0)
+			{
+				continue;
+			}
+
+			copyEvents[slot] = events[slot];
+			MemoryBarrier();
+
+			if ((UINT32)ReadNoFence((volatile LONG*)&events[slot].Sequence) != sequence)
+			{
+				ZeroMemory(&copyEvents[slot], sizeof(FlightEvent));
+			}
+			else
+			{
+				copyEvents[slot].Sequence = sequence;
+			}
+		}
+	}
+}
+
+static DWORD Save(const FlightHeader* copy, SIZE_T length, LPCWSTR path)
+{
+	WCHAR tempPath[MAX_PATH];
+	if (FAILED(StringCchPrintfW(tempPath, MAX_PATH, L"%s" FLIGHT_TEMP_SUFFIX, path)))
+	{
+		return ERROR_FILENAME_EXCED_RANGE;
+	}
+
+	HANDLE file = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD written = 0;
+	DWORD result = ERROR_SUCCESS;
+	if (!WriteFile(file, copy, (DWORD)length, &written, NULL) || !FlushFileBuffers(file))
+	{
+		result = GetLastError();
+	}
+	else if (written != (DWORD)length)
+	{
+		result = ERROR_WRITE_FAULT;
+	}
+
+	CloseHandle(file);
+
+	if (result == ERROR_SUCCESS && !MoveFileExW(tempPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		result = GetLastError();
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		DeleteFileW(tempPath);
+	}
+
+	return result;
+}
+
+DWORD FlightRecorderDump(LPCWSTR path)
+{
+	if (path == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	FlightHeader* header = Recording;
+	if (header == NULL)
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	SIZE_T length = FLIGHT_FILE_LENGTH(header->RingCount, header->EventsPerRing);
+	FlightHeader* copy = (FlightHeader*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, length);
+	if (copy == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	Snapshot(header, copy);
+	DWORD result = Save(copy, length, path);
+
+	HeapFree(GetProcessHeap(), 0, copy);
+
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("flight recorder dump failed: 0x%.8X\n", result);
+	}
+
+	return result;
+}
+
+#ifdef NATIVE_BENCH
+typedef struct _FlightBenchThread
+{
+	FlightRing* Ring;
+	UINT32 Mask;
+	UINT Events;
+	HANDLE Start;
+	INT64 Ticks;
+} FlightBenchThread;
+
+static DWORD WINAPI BenchThreadFunc(LPVOID parameter)
+{
+	FlightBenchThread* thread = (FlightBenchThread*)parameter;
+	LARGE_INTEGER started, finished;
+
+	WaitForSingleObject(thread->Start, INFINITE);
+
+	QueryPerformanceCounter(&started);
+	for (UINT i = 0; i < thread->Events; i++)
+	{
+		RecordInto(thread->Ring, thread->Mask, FlightMark, i, i);
+	}
+	QueryPerformanceCounter(&finished);
+
+	thread->Ticks = finished.QuadPart - started.QuadPart;
+
+	return 0;
+}
+
+// Starts the threads together and returns the mean time per event each saw
+static DWORD RunBenchPass(FlightHeader* header, UINT threads, UINT events, BOOL shared, DOUBLE* nanoseconds)
+{
+	FlightBenchThread contexts[FLIGHT_BENCH_MAX_THREADS];
+	HANDLE handles[FLIGHT_BENCH_MAX_THREADS];
+	LARGE_INTEGER frequency;
+	UINT started = 0;
+	DWORD result = ERROR_SUCCESS;
+
+	HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (start == NULL)
+	{
+		return GetLastError();
+	}
+
+	for (; started < threads; started++)
+	{
+		contexts[started].Ring = RingAt(header, shared ? header->RingCount - 1 : started);
+		contexts[started].Mask = header->EventsPerRing - 1;
+		contexts[started].Events = events;
+		contexts[started].Start = start;
+		contexts[started].Ticks = 0;
+
+		handles[started] = CreateThread(NULL, 0, BenchThreadFunc, &contexts[started], 0, NULL);
+		if (handles[started] == NULL)
+		{
+			result = GetLastError();
+			break;
+		}
+	}
+
+	SetEvent(start);
+	if (started > 0)
+	{
+		WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+	}
+
+	QueryPerformanceFrequency(&frequency);
+
+	DOUBLE total = 0;
+	for (UINT i = 0; i < started; i++)
+	{
+		total += (DOUBLE)contexts[i].Ticks * 1e9 / (DOUBLE)frequency.QuadPart / events;
+		CloseHandle(handles[i]);
+	}
+
+	CloseHandle(start);
+
+	*nanoseconds = started > 0 ? total / started : 0;
+
+	return result;
+}
+
+DWORD FlightRecorderRunBenchmark(UINT eventsPerThread, UINT threads, FlightBenchReport* report)
+{
+	if (eventsPerThread == 0 || threads == 0 || threads > FLIGHT_BENCH_MAX_THREADS || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(*report));
+
+	// A ring per thread and the shared one after them
+	SIZE_T length = FLIGHT_FILE_LENGTH(threads + 1, FLIGHT_DEFAULT_EVENTS);
+	FlightHeader* header = (FlightHeader*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, length);
+	if (header == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	InitializeHeader(header, threads + 1, FLIGHT_DEFAULT_EVENTS);
+
+	DWORD result = RunBenchPass(header, threads, eventsPerThread, FALSE, &report->RecordNs);
+	if (result == ERROR_SUCCESS)
+	{
+		result = RunBenchPass(header, threads, eventsPerThread, TRUE, &report->SharedRecordNs);
+	}
+
+	HeapFree(GetProcessHeap(), 0, header);
+
+	report->Threads = threads;
+	report->Events = (UINT64)eventsPerThread * threads;
+
+	return result;
+}
+#endif
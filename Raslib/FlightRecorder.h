@@ -0,0 +1,125 @@
+#pragma once
+#include <Windows.h>
+#include <stddef.h>
+
+#define FLIGHT_MAGIC 0x54484C46
+#define FLIGHT_VERSION 1
+// Rings handed out to threads, the last one is shared by the threads that come after the others are taken
+#define FLIGHT_DEFAULT_RINGS 16
+// Events each ring keeps, older ones are overwritten
+#define FLIGHT_DEFAULT_EVENTS 4096
+#define FLIGHT_MAX_RINGS 256
+#define FLIGHT_MAX_EVENTS 65536
+#define FLIGHT_CACHE_LINE 64
+
+// FlightRing Flags
+#define FLIGHT_RING_SHARED 0x0001
+
+typedef enum _FlightEventType
+{
+	// FlightRecorderMark, Value and Argument are the caller's
+	FlightMark = 0,
+	// A RAS dial notification. Value is the RASCONNSTATE, Argument the error.
+	FlightDialState,
+	// A hang up finished. Value is the result, Argument the attempts it took.
+	FlightHangUp,
+	// Value is the result of adding a WFP filter, Argument the filter id
+	FlightFilterAdd,
+	// Reading connection statistics failed. Value is the error, Argument 0 for the status, 1 for the statistics.
+	FlightStatsAnomaly,
+	// The process died of an unhandled exception. Value is the exception code, Argument the address.
+	FlightCrash,
+	FlightEventTypeCount,
+} FlightEventType;
+
+typedef struct _FlightEvent
+{
+	// QueryPerformanceCounter reading
+	INT64 Ticks;
+	UINT64 Argument;
+	// Position of the event in its ring + 1, written last. An event whose Sequence doesn't match its slot was
+	// being written when the process died and is skipped.
+	UINT32 Sequence;
+	DWORD ThreadId;
+	UINT16 Type;
+	UINT16 Reserved;
+	UINT32 Value;
+} FlightEvent;
+
+typedef struct DECLSPEC_ALIGN(FLIGHT_CACHE_LINE) _FlightRing
+{
+	// The thread the ring was handed to, 0 while it's free and for the shared ring
+	DWORD ThreadId;
+	UINT32 Flags;
+	// Events written so far, the ring holds the last EventsPerRing of them
+	volatile LONG64 Head;
+	BYTE Reserved[FLIGHT_CACHE_LINE - 16];
+} FlightRing;
+
+typedef struct DECLSPEC_ALIGN(FLIGHT_CACHE_LINE) _FlightHeader
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 RingCount;
+	UINT32 EventsPerRing;
+	// QueryPerformanceCounter reading and system time as a FILETIME, taken together at the start
+	INT64 StartTicks;
+	INT64 TicksPerSecond;
+	UINT64 StartTime;
+	DWORD ProcessId;
+	volatile LONG RingsClaimed;
+	// The exception the process died of, 0 while it hasn't
+	DWORD CrashCode;
+	BYTE Reserved[FLIGHT_CACHE_LINE - 52];
+} FlightHeader;
+
+static_assert(sizeof(FlightEvent) == 32, "FlightEvent is part of the file format");
+static_assert(sizeof(FlightRing) == FLIGHT_CACHE_LINE && sizeof(FlightHeader) == FLIGHT_CACHE_LINE, "FlightRing and FlightHeader are part of the file format");
+
+// The header, then each ring's FlightRing followed by its events
+#define FLIGHT_RING_LENGTH(events) (sizeof(FlightRing) + (SIZE_T)(events) * sizeof(FlightEvent))
+#define FLIGHT_FILE_LENGTH(rings, events) (sizeof(FlightHeader) + (SIZE_T)(rings) * FLIGHT_RING_LENGTH(events))
+
+// Non-zero while recording, FlightRecord does nothing otherwise
+extern volatile LONG FlightRecorderActive;
+
+extern void FlightRecordSlow(FlightEventType type, UINT32 value, UINT64 argument);
+
+// Lock free, each thread writes its own ring without an interlocked operation. Safe from RAS callbacks and
+// exception filters.
+FORCEINLINE void FlightRecord(FlightEventType type, UINT32 value, UINT64 argument)
+{
+	if (FlightRecorderActive != 0)
+	{
+		FlightRecordSlow(type, value, argument);
+	}
+}
+
+// Starts recording into path, mapped into memory so the events are on disk once the process dies however it
+// dies, or into memory alone when path is NULL. A file left by the previous run is kept as <path>.previous.
+// Zero counts take the defaults. The recorder runs until the process exits, each DLL linking Raslib has its own.
+extern DWORD FlightRecorderStart(LPCWSTR path, UINT rings, UINT eventsPerRing);
+
+// Pauses or resumes recording, the events recorded so far are kept
+extern DWORD FlightRecorderSetEnabled(BOOL enabled);
+
+extern DWORD FlightRecorderMark(UINT32 value, UINT64 argument);
+
+// Writes what the rings hold to path in the same format, next to it first then renamed over. Events written
+// while they were being copied are left out.
+extern DWORD FlightRecorderDump(LPCWSTR path);
+
+#ifdef NATIVE_BENCH
+typedef struct _FlightBenchReport
+{
+	UINT Threads;
+	UINT64 Events;
+	// Per event, each thread recording into its own ring, then every thread sharing one
+	DOUBLE RecordNs;
+	DOUBLE SharedRecordNs;
+} FlightBenchReport;
+
+// Records eventsPerThread events from each of threads threads into rings of its own, the running recorder is
+// left alone
+extern DWORD FlightRecorderRunBenchmark(UINT eventsPerThread, UINT threads, FlightBenchReport* report);
+#endif
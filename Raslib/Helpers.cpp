@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <stdlib.h>
+#include "Helpers.h"
+
+static INIT_ONCE CrcInit = INIT_ONCE_STATIC_INIT;
+static UINT32 CrcTable[256];
+
+static BOOL CALLBACK BuildCrcTable(PINIT_ONCE initOnce, PVOID parameter, PVOID* context)
+{
+	for (UINT32 i = 0; i < 256; i++)
+	{
+		UINT32 crc = i;
+		for (UINT bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+		CrcTable[i] = crc;
+	}
+
+	return TRUE;
+}
+
+UINT32 Crc32(const void* data, SIZE_T size)
+{
+	const BYTE* p = (const BYTE*)data;
+	UINT32 crc = 0xFFFFFFFF;
+
+	InitOnceExecuteOnce(&CrcInit, BuildCrcTable, NULL, NULL);
+
+	for (SIZE_T i = 0; i < size; i++)
+	{
+		crc = CrcTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+UINT64 NextRandom(UINT64* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+#ifdef NATIVE_BENCH
+static int __cdecl CompareTicks(const void* a, const void* b)
+{
+	LONGLONG x = *(const LONGLONG*)a;
+	LONGLONG y = *(const LONGLONG*)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+void SummariseTicks(LONGLONG* ticks, DWORD samples, INT64 ticksPerSecond, TickSummary* summary)
+{
+	ZeroMemory(summary, sizeof(TickSummary));
+	summary->Samples = samples;
+
+	if (samples == 0)
+	{
+		return;
+	}
+
+	qsort(ticks, samples, sizeof(LONGLONG), CompareTicks);
+
+	DOUBLE toUs = 1000000.0 / (DOUBLE)ticksPerSecond;
+	DOUBLE total = 0;
+	for (DWORD i = 0; i < samples; i++)
+	{
+		total += (DOUBLE)ticks[i];
+	}
+
+	summary->MeanUs = total / samples * toUs;
+	summary->P50Us = ticks[(samples - 1) * 50 / 100] * toUs;
+	summary->P90Us = ticks[(samples - 1) * 90 / 100] * toUs;
+	summary->P99Us = ticks[(samples - 1) * 99 / 100] * toUs;
+	summary->MaxUs = ticks[samples - 1] * toUs;
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+#include <Windows.h>
+
+// Small routines shared by the Raslib and Netlib modules
+
+// CRC-32 with the reflected IEEE polynomial 0xEDB88320, as zip and PNG use
+extern UINT32 Crc32(const void* data, SIZE_T size);
+
+// xorshift64, for jitter, shuffles and benchmark data only. state must start non-zero and then never becomes 0.
+extern UINT64 NextRandom(UINT64* state);
+
+#ifdef NATIVE_BENCH
+typedef struct _TickSummary
+{
+	DWORD Samples;
+	DOUBLE MeanUs;
+	DOUBLE P50Us;
+	DOUBLE P90Us;
+	DOUBLE P99Us;
+	DOUBLE MaxUs;
+} TickSummary;
+
+// Sorts samples QueryPerformanceCounter ticks in place and summarises them in microseconds
+extern void SummariseTicks(LONGLONG* ticks, DWORD samples, INT64 ticksPerSecond, TickSummary* summary);
+#endif
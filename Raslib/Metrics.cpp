@@ -0,0 +1,419 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <stdarg.h>
+#include <strsafe.h>
+#include "Metrics.h"
+#include "NativeLog.h"
+
+#define METRICS_SHARD_COUNT 16
+#define METRICS_SHARD_MASK (METRICS_SHARD_COUNT - 1)
+// Slots per metric: the buckets, +Inf and the sum. Counters only use the first.
+#define METRICS_STRIDE (METRICS_BUCKET_COUNT + 2)
+#define METRICS_SUM_SLOT (METRICS_BUCKET_COUNT + 1)
+#define METRICS_CACHE_LINE 64
+
+static_assert((METRICS_SHARD_COUNT & METRICS_SHARD_MASK) == 0, "METRICS_SHARD_COUNT must be a power of two");
+
+typedef struct _MetricDescriptor
+{
+	const CHAR* Name;
+	// Label pair without braces, NULL for none
+	const CHAR* Label;
+	const CHAR* Help;
+	MetricType Type;
+} MetricDescriptor;
+
+static const MetricDescriptor Descriptors[MetricCount] =
+{
+	{ "utilizr_killswitch_engage_seconds", NULL, "Time to install the killswitch filters.", MetricTypeHistogram },
+	{ "utilizr_killswitch_disengage_seconds", NULL, "Time to remove the killswitch filters.", MetricTypeHistogram },
+	{ "utilizr_killswitch_filters", NULL, "WFP filters the killswitch currently has installed.", MetricTypeGauge },
+	{ "utilizr_bfe_calls_total", NULL, "Calls into the base filtering engine.", MetricTypeCounter },
+	{ "utilizr_bfe_errors_total", NULL, "Base filtering engine calls that failed.", MetricTypeCounter },
+	{ "utilizr_dial_phase_seconds", "phase=\"connect\"", "Time spent in each phase of a dial.", MetricTypeHistogram },
+	{ "utilizr_dial_phase_seconds", "phase=\"authenticate\"", NULL, MetricTypeHistogram },
+	{ "utilizr_dial_phase_seconds", "phase=\"project\"", NULL, MetricTypeHistogram },
+	{ "utilizr_dial_seconds", NULL, "Time from starting a dial to connected.", MetricTypeHistogram },
+	{ "utilizr_dial_failures_total", NULL, "Dials that ended in an error.", MetricTypeCounter },
+	{ "utilizr_hangup_seconds", NULL, "Time to hang up a connection.", MetricTypeHistogram },
+	{ "utilizr_stats_poll_seconds", NULL, "Time to read connection statistics.", MetricTypeHistogram },
+	{ "utilizr_log_dropped_total", NULL, "Native log messages dropped because the queue was full.", MetricTypeCounter },
+	{ "utilizr_tunnel_rtt_seconds", NULL, "Round trip time of the tunnel monitor's probes.", MetricTypeHistogram },
+	{ "utilizr_tunnel_probes_lost_total", NULL, "Tunnel monitor probes that went unanswered.", MetricTypeCounter },
+	{ "utilizr_reconnect_seconds", NULL, "Time from a connection dropping to the reconnector having it back up.", MetricTypeHistogram },
+	{ "utilizr_reconnect_dials_total", NULL, "Dials the reconnector has started.", MetricTypeCounter },
+	{ "utilizr_reconnect_breaker_trips_total", NULL, "Times a server failed often enough for the reconnector to stop dialing it for a while.", MetricTypeCounter },
+	{ "utilizr_route_apply_seconds", NULL, "Time to apply a route set, diffing it included.", MetricTypeHistogram },
+	{ "utilizr_routes_installed", NULL, "Routes installed by route sets.", MetricTypeGauge },
+};
+
+static const UINT64 BucketBoundsUs[METRICS_BUCKET_COUNT] =
+{
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+// Same bounds in seconds as they appear in the le label
+static const CHAR* BucketLabels[METRICS_BUCKET_COUNT + 1] =
+{
+	"0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1",
+	"2.5", "5", "10", "+Inf",
+};
+
+typedef struct DECLSPEC_ALIGN(METRICS_CACHE_LINE) _MetricsShard
+{
+	volatile LONGLONG Slots[MetricCount * METRICS_STRIDE];
+} MetricsShard;
+
+static MetricsShard Shards[METRICS_SHARD_COUNT];
+static volatile LONGLONG Gauges[MetricCount];
+static volatile LONG NextShard;
+// Shard index + 1, 0 until the thread's first update
+static __declspec(thread) LONG ThreadShard;
+static LARGE_INTEGER TimerFrequency;
+
+static MetricsShard* CurrentShard()
+{
+	LONG shard = ThreadShard;
+
+	if (shard == 0)
+	{
+		// Round robin rather than a hash of the thread id, the few threads that update metrics each get their own
+		shard = (InterlockedIncrement(&NextShard) & METRICS_SHARD_MASK) + 1;
+		ThreadShard = shard;
+	}
+
+	return &Shards[shard - 1];
+}
+
+void MetricsAdd(MetricId metric, UINT64 value)
+{
+	InterlockedExchangeAdd64(&CurrentShard()->Slots[metric * METRICS_STRIDE], (LONGLONG)value);
+}
+
+void MetricsGaugeSet(MetricId metric, INT64 value)
+{
+	InterlockedExchange64(&Gauges[metric], value);
+}
+
+void MetricsObserveUs(MetricId metric, UINT64 microseconds)
+{
+	volatile LONGLONG* slots = &CurrentShard()->Slots[metric * METRICS_STRIDE];
+	UINT bucket = 0;
+
+	while (bucket < METRICS_BUCKET_COUNT && microseconds > BucketBoundsUs[bucket])
+	{
+		bucket++;
+	}
+
+	InterlockedIncrement64(&slots[bucket]);
+	InterlockedExchangeAdd64(&slots[METRICS_SUM_SLOT], (LONGLONG)microseconds);
+}
+
+INT64 MetricsTimerStart()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+void MetricsObserveSince(MetricId metric, INT64 start)
+{
+	LARGE_INTEGER now;
+
+	if (TimerFrequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&TimerFrequency);
+	}
+
+	QueryPerformanceCounter(&now);
+	MetricsObserveUs(metric, (UINT64)((now.QuadPart - start) * 1000000 / TimerFrequency.QuadPart));
+}
+
+static UINT64 SumSlot(UINT metric, UINT slot)
+{
+	UINT64 total = 0;
+
+	for (UINT i = 0; i < METRICS_SHARD_COUNT; i++)
+	{
+		total += (UINT64)Shards[i].Slots[metric * METRICS_STRIDE + slot];
+	}
+
+	return total;
+}
+
+typedef struct _RenderState
+{
+	CHAR* Next;
+	SIZE_T Remaining;
+	BOOL Overflow;
+} RenderState;
+
+static void Emit(RenderState* state, const CHAR* format, ...)
+{
+	va_list args;
+
+	if (state->Overflow)
+	{
+		return;
+	}
+
+	va_start(args, format);
+	HRESULT hr = StringCchVPrintfExA(state->Next, state->Remaining, &state->Next, &state->Remaining, 0, format, args);
+	va_end(args);
+
+	if (FAILED(hr))
+	{
+		state->Overflow = TRUE;
+	}
+}
+
+static void EmitHistogram(RenderState* state, UINT metric)
+{
+	const MetricDescriptor* descriptor = &Descriptors[metric];
+	const CHAR* label = descriptor->Label != NULL ? descriptor->Label : "";
+	const CHAR* separator = descriptor->Label != NULL ? "," : "";
+	UINT64 count = 0;
+
+	// Buckets are cumulative in the exposition format, the shards hold per bucket counts
+	for (UINT bucket = 0; bucket <= METRICS_BUCKET_COUNT; bucket++)
+	{
+		count += SumSlot(metric, bucket);
+		Emit(state, "%s_bucket{%s%sle=\"%s\"} %llu\n", descriptor->Name, label, separator, BucketLabels[bucket], count);
+	}
+
+	UINT64 sumUs = SumSlot(metric, METRICS_SUM_SLOT);
+
+	if (descriptor->Label != NULL)
+	{
+		Emit(state, "%s_sum{%s} %llu.%06llu\n", descriptor->Name, label, sumUs / 1000000, sumUs % 1000000);
+		Emit(state, "%s_count{%s} %llu\n", descriptor->Name, label, count);
+	}
+	else
+	{
+		Emit(state, "%s_sum %llu.%06llu\n", descriptor->Name, sumUs / 1000000, sumUs % 1000000);
+		Emit(state, "%s_count %llu\n", descriptor->Name, count);
+	}
+}
+
+DWORD MetricsRender(CHAR* buffer, DWORD length, DWORD* written)
+{
+	static const CHAR* typeNames[] = { "counter", "gauge", "histogram" };
+	RenderState state;
+
+	if (buffer == NULL || written == NULL || length == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	state.Next = buffer;
+	state.Remaining = length;
+	state.Overflow = FALSE;
+
+	for (UINT metric = 0; metric < MetricCount; metric++)
+	{
+		const MetricDescriptor* descriptor = &Descriptors[metric];
+
+		// HELP and TYPE once per family, labelled series of the same name follow the first
+		if (descriptor->Help != NULL)
+		{
+			Emit(&state, "# HELP %s %s\n# TYPE %s %s\n", descriptor->Name, descriptor->Help, descriptor->Name, typeNames[descriptor->Type]);
+		}
+
+		if (descriptor->Type == MetricTypeHistogram)
+		{
+			EmitHistogram(&state, metric);
+		}
+		else
+		{
+			const CHAR* open = descriptor->Label != NULL ? "{" : "";
+			const CHAR* label = descriptor->Label != NULL ? descriptor->Label : "";
+			const CHAR* close = descriptor->Label != NULL ? "}" : "";
+
+			if (descriptor->Type == MetricTypeGauge)
+			{
+				Emit(&state, "%s%s%s%s %lld\n", descriptor->Name, open, label, close, (INT64)Gauges[metric]);
+			}
+			else
+			{
+				Emit(&state, "%s%s%s%s %llu\n", descriptor->Name, open, label, close, SumSlot(metric, 0));
+			}
+		}
+	}
+
+	if (state.Overflow)
+	{
+		*buffer = '\0';
+		*written = METRICS_RENDER_LENGTH;
+		return ERROR_INSUFFICIENT_BUFFER;
+	}
+
+	*written = (DWORD)(state.Next - buffer);
+	return ERROR_SUCCESS;
+}
+
+void MetricsReset()
+{
+	for (UINT i = 0; i < METRICS_SHARD_COUNT; i++)
+	{
+		for (UINT slot = 0; slot < MetricCount * METRICS_STRIDE; slot++)
+		{
+			InterlockedExchange64(&Shards[i].Slots[slot], 0);
+		}
+	}
+
+	for (UINT metric = 0; metric < MetricCount; metric++)
+	{
+		InterlockedExchange64(&Gauges[metric], 0);
+	}
+}
+
+#ifdef NATIVE_BENCH
+typedef struct _MetricsBenchThread
+{
+	HANDLE Start;
+	UINT64 Increments;
+	INT64 CounterTicks;
+	INT64 ObserveTicks;
+} MetricsBenchThread;
+
+static DWORD WINAPI MetricsBenchThreadFunc(LPVOID parameter)
+{
+	MetricsBenchThread* thread = (MetricsBenchThread*)parameter;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+
+	WaitForSingleObject(thread->Start, INFINITE);
+
+	QueryPerformanceCounter(&start);
+	for (UINT64 i = 0; i < thread->Increments; i++)
+	{
+		MetricsAdd(MetricBfeCalls, 1);
+	}
+	QueryPerformanceCounter(&end);
+	thread->CounterTicks = end.QuadPart - start.QuadPart;
+
+	QueryPerformanceCounter(&start);
+	for (UINT64 i = 0; i < thread->Increments; i++)
+	{
+		// Spread over the buckets so the bound search isn't always the shortest
+		MetricsObserveUs(MetricStatsPollSeconds, (i * 7919) & 0x3FFFFF);
+	}
+	QueryPerformanceCounter(&end);
+	thread->ObserveTicks = end.QuadPart - start.QuadPart;
+
+	return 0;
+}
+
+DWORD MetricsRunBenchmark(UINT threads, UINT64 increments, MetricsBenchReport* report)
+{
+	HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+	MetricsBenchThread* contexts = NULL;
+	HANDLE start = NULL;
+	CHAR* buffer = NULL;
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER renderStart;
+	LARGE_INTEGER renderEnd;
+	INT64 counterTicks = 0;
+	INT64 observeTicks = 0;
+	const UINT renders = 1000;
+	DWORD written = 0;
+	DWORD result = ERROR_SUCCESS;
+	UINT started = 0;
+
+	if (report == NULL || threads == 0 || threads > MAXIMUM_WAIT_OBJECTS || increments == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	ZeroMemory(report, sizeof(MetricsBenchReport));
+	QueryPerformanceFrequency(&frequency);
+
+	contexts = (MetricsBenchThread*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, threads * sizeof(MetricsBenchThread));
+	buffer = (CHAR*)HeapAlloc(GetProcessHeap(), 0, METRICS_RENDER_LENGTH);
+	start = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (contexts == NULL || buffer == NULL || start == NULL)
+	{
+		result = ERROR_NOT_ENOUGH_MEMORY;
+		goto Cleanup;
+	}
+
+	MetricsReset();
+
+	for (; started < threads; started++)
+	{
+		contexts[started].Start = start;
+		contexts[started].Increments = increments;
+		handles[started] = CreateThread(NULL, 0, MetricsBenchThreadFunc, &contexts[started], 0, NULL);
+
+		if (handles[started] == NULL)
+		{
+			result = GetLastError();
+			break;
+		}
+	}
+
+	SetEvent(start);
+
+	if (started > 0)
+	{
+		WaitForMultipleObjects(started, handles, TRUE, INFINITE);
+	}
+
+	for (UINT i = 0; i < started; i++)
+	{
+		CloseHandle(handles[i]);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		goto Cleanup;
+	}
+
+	for (UINT i = 0; i < threads; i++)
+	{
+		counterTicks += contexts[i].CounterTicks;
+		observeTicks += contexts[i].ObserveTicks;
+	}
+
+	if (SumSlot(MetricBfeCalls, 0) != threads * increments)
+	{
+		NATIVELOG_ERROR("MetricsRunBenchmark: counted %llu increments, expected %llu\n", SumSlot(MetricBfeCalls, 0), threads * increments);
+		result = ERROR_INVALID_DATA;
+		goto Cleanup;
+	}
+
+	QueryPerformanceCounter(&renderStart);
+	for (UINT i = 0; i < renders && result == ERROR_SUCCESS; i++)
+	{
+		result = MetricsRender(buffer, METRICS_RENDER_LENGTH, &written);
+	}
+	QueryPerformanceCounter(&renderEnd);
+
+	report->Threads = threads;
+	report->Increments = threads * increments;
+	report->CounterNsMean = counterTicks * 1e9 / frequency.QuadPart / report->Increments;
+	report->ObserveNsMean = observeTicks * 1e9 / frequency.QuadPart / report->Increments;
+	report->RenderUsMean = (renderEnd.QuadPart - renderStart.QuadPart) * 1e6 / frequency.QuadPart / renders;
+
+Cleanup:
+	MetricsReset();
+
+	if (start != NULL)
+	{
+		CloseHandle(start);
+	}
+
+	if (buffer != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, buffer);
+	}
+
+	if (contexts != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, contexts);
+	}
+
+	return result;
+}
+#endif
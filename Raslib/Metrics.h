@@ -0,0 +1,72 @@
+#pragma once
+#include <Windows.h>
+
+// Upper bounds of the histogram buckets in microseconds, +Inf is implied
+#define METRICS_BUCKET_COUNT 16
+// Enough for every metric rendered with all of its buckets
+#define METRICS_RENDER_LENGTH 32768
+
+typedef enum _MetricType
+{
+	MetricTypeCounter = 0,
+	MetricTypeGauge,
+	MetricTypeHistogram,
+} MetricType;
+
+// Order matches the descriptor table in Metrics.cpp, metrics sharing a name must be adjacent
+typedef enum _MetricId
+{
+	MetricKillswitchEngageSeconds = 0,
+	MetricKillswitchDisengageSeconds,
+	MetricKillswitchFilters,
+	MetricBfeCalls,
+	MetricBfeErrors,
+	MetricDialPhaseConnectSeconds,
+	MetricDialPhaseAuthenticateSeconds,
+	MetricDialPhaseProjectSeconds,
+	MetricDialSeconds,
+	MetricDialFailures,
+	MetricHangUpSeconds,
+	MetricStatsPollSeconds,
+	MetricLogDropped,
+	MetricTunnelRttSeconds,
+	MetricTunnelProbesLost,
+	MetricReconnectSeconds,
+	MetricReconnectDials,
+	MetricReconnectBreakerTrips,
+	MetricRouteApplySeconds,
+	MetricRoutesInstalled,
+	MetricCount,
+} MetricId;
+
+// Counters and histograms are striped over per thread shards, an update is an uncontended interlocked add on
+// a cache line the thread rarely shares. Rendering sums the shards.
+extern void MetricsAdd(MetricId metric, UINT64 value);
+extern void MetricsGaugeSet(MetricId metric, INT64 value);
+extern void MetricsObserveUs(MetricId metric, UINT64 microseconds);
+
+// QueryPerformanceCounter ticks for MetricsObserveSince
+extern INT64 MetricsTimerStart();
+extern void MetricsObserveSince(MetricId metric, INT64 start);
+
+// Writes every metric in the Prometheus text exposition format. written is the length without the
+// terminator, or the length needed when the result is ERROR_INSUFFICIENT_BUFFER.
+extern DWORD MetricsRender(CHAR* buffer, DWORD length, DWORD* written);
+
+// Clears counters, histograms and gauges
+extern void MetricsReset();
+
+#ifdef NATIVE_BENCH
+typedef struct _MetricsBenchReport
+{
+	UINT Threads;
+	UINT64 Increments;
+	DOUBLE CounterNsMean;
+	DOUBLE ObserveNsMean;
+	DOUBLE RenderUsMean;
+} MetricsBenchReport;
+
+// Times MetricsAdd and MetricsObserveUs from threads running at once, then MetricsRender. Metrics are reset
+// afterwards, don't run it alongside a dial or the killswitch.
+extern DWORD MetricsRunBenchmark(UINT threads, UINT64 increments, MetricsBenchReport* report);
+#endif
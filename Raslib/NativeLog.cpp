@@ -0,0 +1,302 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <string.h>
+#include <strsafe.h>
+#include "NativeLog.h"
+#include "Metrics.h"
+
+#define NATIVELOG_SLOT_MASK (NATIVELOG_SLOT_COUNT - 1)
+
+static_assert((NATIVELOG_SLOT_COUNT & NATIVELOG_SLOT_MASK) == 0, "NATIVELOG_SLOT_COUNT must be a power of two");
+static_assert(NATIVELOG_BATCH_LENGTH > NATIVELOG_MESSAGE_LENGTH, "a batch must hold at least one message");
+
+// Bounded ring in the style of Vyukov's MPMC queue with a single consumer. A slot is free for the producer
+// whose position equals its Sequence and readable by the drain once Sequence is position + 1.
+typedef struct _NativeLogSlot
+{
+	volatile LONG Sequence;
+	CHAR Message[NATIVELOG_MESSAGE_LENGTH];
+} NativeLogSlot;
+
+static NativeLogSlot Slots[NATIVELOG_SLOT_COUNT];
+static volatile LONG EnqueuePos;
+static volatile LONG DequeuePos;
+static volatile LONG Dropped;
+static volatile LONG DroppedTotal;
+
+static PLogCallback volatile LogCallback = NULL;
+static volatile LONG MinLevel = NATIVELOG_MIN_LEVEL;
+
+static INIT_ONCE DrainInit = INIT_ONCE_STATIC_INIT;
+static HANDLE DrainEvent = NULL;
+static volatile LONG DrainWaiting = FALSE;
+
+// Only the drain thread touches the batch buffer
+static CHAR Batch[NATIVELOG_BATCH_LENGTH];
+
+static LONG PositionDiff(LONG a, LONG b)
+{
+	return (LONG)((ULONG)a - (ULONG)b);
+}
+
+static void ResetSlots()
+{
+	for (LONG i = 0; i < NATIVELOG_SLOT_COUNT; i++)
+	{
+		Slots[i].Sequence = i;
+	}
+}
+
+static BOOL SlotReady(LONG position)
+{
+	NativeLogSlot* slot = &Slots[position & NATIVELOG_SLOT_MASK];
+	LONG sequence = slot->Sequence;
+	MemoryBarrier();
+
+	return PositionDiff(sequence, position + 1) == 0;
+}
+
+static void Deliver(PLogCallback callback, CHAR* message)
+{
+	if (callback != NULL)
+	{
+		callback(message);
+	}
+}
+
+// Moves as many ready messages as fit into the batch buffer and hands them over in one callback
+static UINT DrainBatch()
+{
+	PLogCallback callback = LogCallback;
+	size_t used = 0;
+	UINT count = 0;
+
+	for (LONG position = DequeuePos; SlotReady(position); position++)
+	{
+		NativeLogSlot* slot = &Slots[position & NATIVELOG_SLOT_MASK];
+		size_t length = strnlen(slot->Message, NATIVELOG_MESSAGE_LENGTH - 1);
+
+		if (used + length + 1 >= sizeof(Batch))
+		{
+			break;
+		}
+
+		memcpy(Batch + used, slot->Message, length);
+		used += length;
+		if (length == 0 || Batch[used - 1] != '\n')
+		{
+			Batch[used++] = '\n';
+		}
+
+		// Give the slot back to producers one lap ahead
+		MemoryBarrier();
+		slot->Sequence = position + NATIVELOG_SLOT_COUNT;
+		InterlockedExchange(&DequeuePos, position + 1);
+		count++;
+	}
+
+	if (count > 0)
+	{
+		// The final newline is dropped, single messages reach the callback as they always have
+		Batch[used - 1] = '\0';
+		Deliver(callback, Batch);
+	}
+
+	LONG dropped = InterlockedExchange(&Dropped, 0);
+	if (dropped != 0)
+	{
+		CHAR notice[64];
+		StringCchPrintfA(notice, sizeof(notice), "native log ring full, dropped %ld messages", dropped);
+		Deliver(callback, notice);
+	}
+
+	return count;
+}
+
+static DWORD WINAPI DrainThread(LPVOID parameter)
+{
+	for (;;)
+	{
+		if (DrainBatch() != 0)
+		{
+			continue;
+		}
+
+		// Producers only signal while we're parked, check once more after announcing it so nothing is missed
+		InterlockedExchange(&DrainWaiting, TRUE);
+		if (SlotReady(DequeuePos) || Dropped != 0)
+		{
+			InterlockedExchange(&DrainWaiting, FALSE);
+			continue;
+		}
+
+		WaitForSingleObject(DrainEvent, INFINITE);
+	}
+
+	return 0;
+}
+
+static BOOL CALLBACK StartDrain(PINIT_ONCE initOnce, PVOID parameter, PVOID* context)
+{
+	ResetSlots();
+
+	DrainEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (DrainEvent == NULL)
+	{
+		return FALSE;
+	}
+
+	HANDLE thread = CreateThread(NULL, 0, DrainThread, NULL, 0, NULL);
+	if (thread == NULL)
+	{
+		CloseHandle(DrainEvent);
+		DrainEvent = NULL;
+		return FALSE;
+	}
+
+	CloseHandle(thread);
+
+	return TRUE;
+}
+
+static BOOL EnsureDrain()
+{
+	return InitOnceExecuteOnce(&DrainInit, StartDrain, NULL, NULL);
+}
+
+static void WakeDrain()
+{
+	if (InterlockedExchange(&DrainWaiting, FALSE))
+	{
+		SetEvent(DrainEvent);
+	}
+}
+
+void NativeLogWriteV(NativeLogLevel level, const char* format, va_list args)
+{
+	if ((LONG)level < MinLevel)
+	{
+		return;
+	}
+
+	// Messages only ever go to the callback, without one there's nowhere to write them
+	if (LogCallback == NULL)
+	{
+		return;
+	}
+
+	if (!EnsureDrain())
+	{
+		return;
+	}
+
+	LONG position = EnqueuePos;
+	NativeLogSlot* slot;
+
+	for (;;)
+	{
+		slot = &Slots[position & NATIVELOG_SLOT_MASK];
+		LONG sequence = slot->Sequence;
+		MemoryBarrier();
+		LONG diff = PositionDiff(sequence, position);
+
+		if (diff == 0)
+		{
+			LONG claimed = InterlockedCompareExchange(&EnqueuePos, position + 1, position);
+			if (claimed == position)
+			{
+				break;
+			}
+			position = claimed;
+		}
+		else if (diff < 0)
+		{
+			// The drain is a whole lap behind, never block the caller
+			InterlockedIncrement(&Dropped);
+			InterlockedIncrement(&DroppedTotal);
+			MetricsAdd(MetricLogDropped, 1);
+			WakeDrain();
+			return;
+		}
+		else
+		{
+			position = EnqueuePos;
+		}
+	}
+
+	// Truncation is fine here, StringCchVPrintfA always terminates the slot
+	StringCchVPrintfA(slot->Message, NATIVELOG_MESSAGE_LENGTH, format, args);
+
+	MemoryBarrier();
+	slot->Sequence = position + 1;
+
+	WakeDrain();
+}
+
+void NativeLogWrite(NativeLogLevel level, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	NativeLogWriteV(level, format, args);
+	va_end(args);
+}
+
+DWORD NativeLogSetCallback(PLogCallback logCallback)
+{
+	if (!EnsureDrain())
+	{
+		return GetLastError() != ERROR_SUCCESS ? GetLastError() : ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	InterlockedExchangePointer((PVOID volatile*)&LogCallback, (PVOID)logCallback);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD NativeLogSetLevel(NativeLogLevel level)
+{
+	if (level < NativeLogDebug || level > NativeLogError)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	InterlockedExchange(&MinLevel, level < NATIVELOG_MIN_LEVEL ? NATIVELOG_MIN_LEVEL : level);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD NativeLogFlush(DWORD timeoutMs)
+{
+	if (!EnsureDrain())
+	{
+		return ERROR_NOT_READY;
+	}
+
+	LONG target = EnqueuePos;
+	ULONGLONG deadline = GetTickCount64() + timeoutMs;
+
+	while (PositionDiff(DequeuePos, target) < 0)
+	{
+		if (GetTickCount64() >= deadline)
+		{
+			return ERROR_TIMEOUT;
+		}
+
+		WakeDrain();
+		Sleep(1);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD NativeLogGetDropped(DWORD* dropped)
+{
+	if (dropped == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*dropped = (DWORD)DroppedTotal;
+
+	return ERROR_SUCCESS;
+}
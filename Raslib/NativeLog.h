@@ -0,0 +1,49 @@
+#pragma once
+#include <Windows.h>
+#include <stdarg.h>
+
+typedef void(_cdecl* PLogCallback)(const char* message);
+
+typedef enum _NativeLogLevel
+{
+	NativeLogDebug = 0,
+	NativeLogInfo = 1,
+	NativeLogWarning = 2,
+	NativeLogError = 3,
+} NativeLogLevel;
+
+// Calls below this level are compiled out, debug messages only make it into debug builds by default
+#ifndef NATIVELOG_MIN_LEVEL
+#ifdef _DEBUG
+#define NATIVELOG_MIN_LEVEL 0
+#else
+#define NATIVELOG_MIN_LEVEL 1
+#endif
+#endif
+
+// Slots are preallocated, messages longer than a slot are truncated and a full ring drops the message
+#define NATIVELOG_SLOT_COUNT 512
+#define NATIVELOG_MESSAGE_LENGTH 256
+#define NATIVELOG_BATCH_LENGTH 8192
+
+#define NATIVELOG(level, ...) do { if ((level) >= NATIVELOG_MIN_LEVEL) NativeLogWrite((level), __VA_ARGS__); } while (0)
+#define NATIVELOG_DEBUG(...) NATIVELOG(NativeLogDebug, __VA_ARGS__)
+#define NATIVELOG_INFO(...) NATIVELOG(NativeLogInfo, __VA_ARGS__)
+#define NATIVELOG_WARNING(...) NATIVELOG(NativeLogWarning, __VA_ARGS__)
+#define NATIVELOG_ERROR(...) NATIVELOG(NativeLogError, __VA_ARGS__)
+
+// Formats straight into a ring slot and returns, safe from any thread including RAS callbacks. A single
+// drain thread hands queued messages to the log callback in newline separated batches.
+extern void NativeLogWrite(NativeLogLevel level, const char* format, ...);
+extern void NativeLogWriteV(NativeLogLevel level, const char* format, va_list args);
+
+extern DWORD NativeLogSetCallback(PLogCallback logCallback);
+
+// Raises or lowers the level at runtime, it can't go below NATIVELOG_MIN_LEVEL
+extern DWORD NativeLogSetLevel(NativeLogLevel level);
+
+// Waits until everything logged before the call has been delivered, ERROR_TIMEOUT if the drain didn't catch up
+extern DWORD NativeLogFlush(DWORD timeoutMs);
+
+// Messages dropped because the ring was full, since the process started
+extern DWORD NativeLogGetDropped(DWORD* dropped);
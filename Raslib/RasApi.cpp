@@ -0,0 +1,394 @@
+#include "stdafx.h"
+#include "RasApi.h"
+#include "Trace.h"
+#include "NativeLog.h"
+#include "Recorder.h"
+
+#define RASLIB_NATIVE_MODULE L"rasapi32.dll"
+
+// Rasapi32 and its entry points, loaded the first time a call comes through the native table rather than
+// with the process. Never unloaded, RasDial notifiers and connection notifications run on threads it owns.
+static INIT_ONCE NativeLoad = INIT_ONCE_STATIC_INIT;
+static HMODULE NativeModule = NULL;
+static RASLIB_API NativeResolved;
+static DWORD NativeLoadError = ERROR_SUCCESS;
+
+#define RASLIB_RESOLVE(field, name) ((NativeResolved.field = (decltype(NativeResolved.field))GetProcAddress(NativeModule, name)) != NULL)
+
+static BOOL CALLBACK LoadNative(PINIT_ONCE initOnce, PVOID parameter, PVOID* context)
+{
+	NativeModule = LoadLibraryExW(RASLIB_NATIVE_MODULE, NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+	if (NativeModule == NULL)
+	{
+		NativeLoadError = GetLastError();
+		NATIVELOG_ERROR("failed to load rasapi32: %lu\n", NativeLoadError);
+		return TRUE;
+	}
+
+	if (!RASLIB_RESOLVE(GetEntryProperties, "RasGetEntryPropertiesW") ||
+		!RASLIB_RESOLVE(SetEntryProperties, "RasSetEntryPropertiesW") ||
+		!RASLIB_RESOLVE(ValidateEntryName, "RasValidateEntryNameW") ||
+		!RASLIB_RESOLVE(EnumDevices, "RasEnumDevicesW") ||
+		!RASLIB_RESOLVE(EnumConnections, "RasEnumConnectionsW") ||
+		!RASLIB_RESOLVE(GetEntryDialParams, "RasGetEntryDialParamsW") ||
+		!RASLIB_RESOLVE(Dial, "RasDialW") ||
+		!RASLIB_RESOLVE(HangUp, "RasHangUpW") ||
+		!RASLIB_RESOLVE(GetConnectStatus, "RasGetConnectStatusW") ||
+		!RASLIB_RESOLVE(GetConnectionStatistics, "RasGetConnectionStatistics") ||
+		!RASLIB_RESOLVE(ConnectionNotification, "RasConnectionNotificationW"))
+	{
+		NativeLoadError = ERROR_PROC_NOT_FOUND;
+		NATIVELOG_ERROR("rasapi32 is missing an entry point\n");
+		FreeLibrary(NativeModule);
+		NativeModule = NULL;
+		return TRUE;
+	}
+
+	NATIVELOG_INFO("loaded rasapi32\n");
+
+	return TRUE;
+}
+
+// Loads rasapi32 once, a failed load is remembered and returned from every call after
+static DWORD EnsureNative()
+{
+	InitOnceExecuteOnce(&NativeLoad, LoadNative, NULL, NULL);
+	return NativeLoadError;
+}
+
+static DWORD APIENTRY NativeGetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, LPDWORD entryInfoSize, LPBYTE deviceInfo, LPDWORD deviceInfoSize)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.GetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize);
+}
+
+static DWORD APIENTRY NativeSetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, DWORD entryInfoSize, LPBYTE deviceInfo, DWORD deviceInfoSize)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.SetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize);
+}
+
+static DWORD APIENTRY NativeValidateEntryName(LPCWSTR phonebook, LPCWSTR entryName)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.ValidateEntryName(phonebook, entryName);
+}
+
+static DWORD APIENTRY NativeEnumDevices(LPRASDEVINFO rasDevInfo, LPDWORD size, LPDWORD devices)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.EnumDevices(rasDevInfo, size, devices);
+}
+
+static DWORD APIENTRY NativeEnumConnections(LPRASCONN rasConn, LPDWORD size, LPDWORD connections)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.EnumConnections(rasConn, size, connections);
+}
+
+static DWORD APIENTRY NativeGetEntryDialParams(LPCWSTR phonebook, LPRASDIALPARAMS dialParams, LPBOOL passwordReturned)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.GetEntryDialParams(phonebook, dialParams, passwordReturned);
+}
+
+static DWORD APIENTRY NativeDial(LPRASDIALEXTENSIONS dialExtensions, LPCWSTR phonebook, LPRASDIALPARAMS dialParams, DWORD notifierType, LPVOID notifier, LPHRASCONN rasConn)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.Dial(dialExtensions, phonebook, dialParams, notifierType, notifier, rasConn);
+}
+
+static DWORD APIENTRY NativeHangUp(HRASCONN rasConn)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.HangUp(rasConn);
+}
+
+static DWORD APIENTRY NativeGetConnectStatus(HRASCONN rasConn, LPRASCONNSTATUS status)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.GetConnectStatus(rasConn, status);
+}
+
+static DWORD APIENTRY NativeGetConnectionStatistics(HRASCONN rasConn, RAS_STATS* stats)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.GetConnectionStatistics(rasConn, stats);
+}
+
+static DWORD APIENTRY NativeConnectionNotification(HRASCONN rasConn, HANDLE event, DWORD flags)
+{
+	DWORD result = EnsureNative();
+	return result != ERROR_SUCCESS ? result : NativeResolved.ConnectionNotification(rasConn, event, flags);
+}
+
+const RASLIB_API RaslibNativeApi =
+{
+	NativeGetEntryProperties,
+	NativeSetEntryProperties,
+	NativeValidateEntryName,
+	NativeEnumDevices,
+	NativeEnumConnections,
+	NativeGetEntryDialParams,
+	NativeDial,
+	NativeHangUp,
+	NativeGetConnectStatus,
+	NativeGetConnectionStatistics,
+	NativeConnectionNotification,
+};
+
+static const RASLIB_API* volatile ActiveApi = &RaslibNativeApi;
+static volatile LONG AllocCount = 0;
+
+// Forwards to the active table with a tracepoint around each call, only handed out while tracing is on
+static DWORD APIENTRY TracedGetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, LPDWORD entryInfoSize, LPBYTE deviceInfo, LPDWORD deviceInfoSize)
+{
+	return TRACE_CALL(TraceProbeRasGetEntryProperties, ActiveApi->GetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize));
+}
+
+static DWORD APIENTRY TracedSetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, DWORD entryInfoSize, LPBYTE deviceInfo, DWORD deviceInfoSize)
+{
+	return TRACE_CALL(TraceProbeRasSetEntryProperties, ActiveApi->SetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize));
+}
+
+static DWORD APIENTRY TracedValidateEntryName(LPCWSTR phonebook, LPCWSTR entryName)
+{
+	return TRACE_CALL(TraceProbeRasValidateEntryName, ActiveApi->ValidateEntryName(phonebook, entryName));
+}
+
+static DWORD APIENTRY TracedEnumDevices(LPRASDEVINFO rasDevInfo, LPDWORD size, LPDWORD devices)
+{
+	return TRACE_CALL(TraceProbeRasEnumDevices, ActiveApi->EnumDevices(rasDevInfo, size, devices));
+}
+
+static DWORD APIENTRY TracedEnumConnections(LPRASCONN rasConn, LPDWORD size, LPDWORD connections)
+{
+	return TRACE_CALL(TraceProbeRasEnumConnections, ActiveApi->EnumConnections(rasConn, size, connections));
+}
+
+static DWORD APIENTRY TracedGetEntryDialParams(LPCWSTR phonebook, LPRASDIALPARAMS dialParams, LPBOOL passwordReturned)
+{
+	return TRACE_CALL(TraceProbeRasGetEntryDialParams, ActiveApi->GetEntryDialParams(phonebook, dialParams, passwordReturned));
+}
+
+static DWORD APIENTRY TracedDial(LPRASDIALEXTENSIONS dialExtensions, LPCWSTR phonebook, LPRASDIALPARAMS dialParams, DWORD notifierType, LPVOID notifier, LPHRASCONN rasConn)
+{
+	return TRACE_CALL(TraceProbeRasDial, ActiveApi->Dial(dialExtensions, phonebook, dialParams, notifierType, notifier, rasConn));
+}
+
+static DWORD APIENTRY TracedHangUp(HRASCONN rasConn)
+{
+	return TRACE_CALL(TraceProbeRasHangUp, ActiveApi->HangUp(rasConn));
+}
+
+static DWORD APIENTRY TracedGetConnectStatus(HRASCONN rasConn, LPRASCONNSTATUS status)
+{
+	return TRACE_CALL(TraceProbeRasGetConnectStatus, ActiveApi->GetConnectStatus(rasConn, status));
+}
+
+static DWORD APIENTRY TracedGetConnectionStatistics(HRASCONN rasConn, RAS_STATS* stats)
+{
+	return TRACE_CALL(TraceProbeRasGetConnectionStatistics, ActiveApi->GetConnectionStatistics(rasConn, stats));
+}
+
+static DWORD APIENTRY TracedConnectionNotification(HRASCONN rasConn, HANDLE event, DWORD flags)
+{
+	return TRACE_CALL(TraceProbeRasConnectionNotification, ActiveApi->ConnectionNotification(rasConn, event, flags));
+}
+
+static const RASLIB_API TracedApi =
+{
+	TracedGetEntryProperties,
+	TracedSetEntryProperties,
+	TracedValidateEntryName,
+	TracedEnumDevices,
+	TracedEnumConnections,
+	TracedGetEntryDialParams,
+	TracedDial,
+	TracedHangUp,
+	TracedGetConnectStatus,
+	TracedGetConnectionStatistics,
+	TracedConnectionNotification,
+};
+
+// The table the recording wrappers call through, the traced one while tracing is on
+static const RASLIB_API* Unrecorded()
+{
+	return TraceActiveMask != 0 ? &TracedApi : ActiveApi;
+}
+
+static INT64 RecordStart()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+// Records each call with a digest of the arguments that identify it, only handed out while recording (see
+// Recorder.h). Handles differ from run to run and passwords mustn't be kept, neither goes into a digest.
+static DWORD APIENTRY RecordedGetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, LPDWORD entryInfoSize, LPBYTE deviceInfo, LPDWORD deviceInfoSize)
+{
+	UINT32 digest = RecorderDigestString(RecorderDigestString(RECORDER_DIGEST_SEED, phonebook), entryName);
+	BOOL sizing = rasEntry == NULL;
+	digest = RecorderDigest(digest, &sizing, sizeof(sizing));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->GetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize);
+	RecorderRecord(TraceProbeRasGetEntryProperties, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedSetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, DWORD entryInfoSize, LPBYTE deviceInfo, DWORD deviceInfoSize)
+{
+	UINT32 digest = RecorderDigestString(RecorderDigestString(RECORDER_DIGEST_SEED, phonebook), entryName);
+	digest = RecorderDigest(digest, rasEntry, rasEntry != NULL ? entryInfoSize : 0);
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->SetEntryProperties(phonebook, entryName, rasEntry, entryInfoSize, deviceInfo, deviceInfoSize);
+	RecorderRecord(TraceProbeRasSetEntryProperties, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedValidateEntryName(LPCWSTR phonebook, LPCWSTR entryName)
+{
+	UINT32 digest = RecorderDigestString(RecorderDigestString(RECORDER_DIGEST_SEED, phonebook), entryName);
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->ValidateEntryName(phonebook, entryName);
+	RecorderRecord(TraceProbeRasValidateEntryName, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedEnumDevices(LPRASDEVINFO rasDevInfo, LPDWORD size, LPDWORD devices)
+{
+	DWORD offered = rasDevInfo != NULL ? *size : 0;
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, &offered, sizeof(offered));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->EnumDevices(rasDevInfo, size, devices);
+	RecorderRecord(TraceProbeRasEnumDevices, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedEnumConnections(LPRASCONN rasConn, LPDWORD size, LPDWORD connections)
+{
+	DWORD offered = rasConn != NULL ? *size : 0;
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, &offered, sizeof(offered));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->EnumConnections(rasConn, size, connections);
+	RecorderRecord(TraceProbeRasEnumConnections, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedGetEntryDialParams(LPCWSTR phonebook, LPRASDIALPARAMS dialParams, LPBOOL passwordReturned)
+{
+	UINT32 digest = RecorderDigestString(RecorderDigestString(RECORDER_DIGEST_SEED, phonebook), dialParams != NULL ? dialParams->szEntryName : NULL);
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->GetEntryDialParams(phonebook, dialParams, passwordReturned);
+	RecorderRecord(TraceProbeRasGetEntryDialParams, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedDial(LPRASDIALEXTENSIONS dialExtensions, LPCWSTR phonebook, LPRASDIALPARAMS dialParams, DWORD notifierType, LPVOID notifier, LPHRASCONN rasConn)
+{
+	UINT32 digest = RecorderDigestString(RecorderDigestString(RECORDER_DIGEST_SEED, phonebook), dialParams != NULL ? dialParams->szEntryName : NULL);
+	digest = RecorderDigestString(digest, dialParams != NULL ? dialParams->szPhoneNumber : NULL);
+	digest = RecorderDigest(digest, &notifierType, sizeof(notifierType));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->Dial(dialExtensions, phonebook, dialParams, notifierType, notifier, rasConn);
+	RecorderRecord(TraceProbeRasDial, digest, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedHangUp(HRASCONN rasConn)
+{
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->HangUp(rasConn);
+	RecorderRecord(TraceProbeRasHangUp, RECORDER_DIGEST_SEED, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedGetConnectStatus(HRASCONN rasConn, LPRASCONNSTATUS status)
+{
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->GetConnectStatus(rasConn, status);
+	RecorderRecord(TraceProbeRasGetConnectStatus, RECORDER_DIGEST_SEED, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedGetConnectionStatistics(HRASCONN rasConn, RAS_STATS* stats)
+{
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->GetConnectionStatistics(rasConn, stats);
+	RecorderRecord(TraceProbeRasGetConnectionStatistics, RECORDER_DIGEST_SEED, result, start);
+	return result;
+}
+
+static DWORD APIENTRY RecordedConnectionNotification(HRASCONN rasConn, HANDLE event, DWORD flags)
+{
+	UINT32 digest = RecorderDigest(RECORDER_DIGEST_SEED, &flags, sizeof(flags));
+	INT64 start = RecordStart();
+	DWORD result = Unrecorded()->ConnectionNotification(rasConn, event, flags);
+	RecorderRecord(TraceProbeRasConnectionNotification, digest, result, start);
+	return result;
+}
+
+static const RASLIB_API RecordedApi =
+{
+	RecordedGetEntryProperties,
+	RecordedSetEntryProperties,
+	RecordedValidateEntryName,
+	RecordedEnumDevices,
+	RecordedEnumConnections,
+	RecordedGetEntryDialParams,
+	RecordedDial,
+	RecordedHangUp,
+	RecordedGetConnectStatus,
+	RecordedGetConnectionStatistics,
+	RecordedConnectionNotification,
+};
+
+const RASLIB_API* RaslibGetApi()
+{
+	if (RecorderActive != 0)
+	{
+		return &RecordedApi;
+	}
+
+	return TraceActiveMask != 0 ? &TracedApi : ActiveApi;
+}
+
+const RASLIB_API* RaslibGetInstalledApi()
+{
+	return ActiveApi;
+}
+
+DWORD RaslibSetApi(const RASLIB_API* api)
+{
+	if (api == &TracedApi || api == &RecordedApi)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	InterlockedExchangePointer((PVOID volatile*)&ActiveApi, (PVOID)(api != NULL ? api : &RaslibNativeApi));
+
+	return ERROR_SUCCESS;
+}
+
+LPVOID RaslibAlloc(SIZE_T size)
+{
+	InterlockedIncrement(&AllocCount);
+
+	return HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size);
+}
+
+void RaslibFree(LPVOID memory)
+{
+	HeapFree(GetProcessHeap(), 0, memory);
+}
+
+BOOL RaslibNativeLoaded()
+{
+	return NativeModule != NULL;
+}
+
+LONG RaslibGetAllocCount()
+{
+	return AllocCount;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <Windows.h>
+#include <Ras.h>
+
+// Table of the RAS entry points Raslib uses. Every RAS call in Raslib goes through the active table so the
+// real Rasapi32 implementation can be swapped for the simulator (see RasSim.h) without touching callers.
+typedef struct _RASLIB_API
+{
+	DWORD(APIENTRY* GetEntryProperties)(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, LPDWORD entryInfoSize, LPBYTE deviceInfo, LPDWORD deviceInfoSize);
+	DWORD(APIENTRY* SetEntryProperties)(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, DWORD entryInfoSize, LPBYTE deviceInfo, DWORD deviceInfoSize);
+	DWORD(APIENTRY* ValidateEntryName)(LPCWSTR phonebook, LPCWSTR entryName);
+	DWORD(APIENTRY* EnumDevices)(LPRASDEVINFO rasDevInfo, LPDWORD size, LPDWORD devices);
+	DWORD(APIENTRY* EnumConnections)(LPRASCONN rasConn, LPDWORD size, LPDWORD connections);
+	DWORD(APIENTRY* GetEntryDialParams)(LPCWSTR phonebook, LPRASDIALPARAMS dialParams, LPBOOL passwordReturned);
+	DWORD(APIENTRY* Dial)(LPRASDIALEXTENSIONS dialExtensions, LPCWSTR phonebook, LPRASDIALPARAMS dialParams, DWORD notifierType, LPVOID notifier, LPHRASCONN rasConn);
+	DWORD(APIENTRY* HangUp)(HRASCONN rasConn);
+	DWORD(APIENTRY* GetConnectStatus)(HRASCONN rasConn, LPRASCONNSTATUS status);
+	DWORD(APIENTRY* GetConnectionStatistics)(HRASCONN rasConn, RAS_STATS* stats);
+	DWORD(APIENTRY* ConnectionNotification)(HRASCONN rasConn, HANDLE event, DWORD flags);
+} RASLIB_API;
+
+// Rasapi32 backed table, active by default. Rasapi32 isn't linked, it's loaded by the first call through this
+// table and a failed load comes back as that call's result.
+extern const RASLIB_API RaslibNativeApi;
+
+// Whether a call through RaslibNativeApi has loaded rasapi32 yet
+extern BOOL RaslibNativeLoaded();
+
+// Returns the table to call through, never NULL. While tracing is on (see Trace.h) this is a wrapper putting
+// a tracepoint around each call into the active table, and while recording (see Recorder.h) one recording each
+// call before that.
+extern const RASLIB_API* RaslibGetApi();
+
+// Returns the table RaslibSetApi installed, for saving and restoring it
+extern const RASLIB_API* RaslibGetInstalledApi();
+
+// Swaps the active table, passing NULL restores RaslibNativeApi.
+// Only swap while no dial is in flight, in-flight dials keep calling back through the table they started on.
+extern DWORD RaslibSetApi(const RASLIB_API* api);
+
+// Raslib's own heap allocations go through these so the simulator benchmark can count them, memory is zeroed
+extern LPVOID RaslibAlloc(SIZE_T size);
+extern void RaslibFree(LPVOID memory);
+extern LONG RaslibGetAllocCount();
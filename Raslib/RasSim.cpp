@@ -0,0 +1,959 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <Ras.h>
+#include <RasError.h>
+#include <strsafe.h>
+#include "RasApi.h"
+#include "RasSim.h"
+
+#define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
+
+#define RASSIM_MAX_ENTRIES 64
+#define RASSIM_MAX_HOSTS 256
+#define RASSIM_MAX_CONNECTIONS 64
+
+// Simulated link speed used to grow the byte counters of connected entries
+#define RASSIM_BYTES_PER_MS 1250
+
+typedef struct _SimEntry
+{
+	BOOL InUse;
+	WCHAR Name[RAS_MaxEntryName + 1];
+	RASENTRY Entry;
+} SimEntry;
+
+typedef struct _SimHost
+{
+	WCHAR Hostname[RAS_MaxPhoneNumber + 1];
+	RasSimStep Script[RASSIM_MAX_SCRIPT_STEPS];
+	UINT ScriptLength;
+	// Dials still to fail with FailError, INFINITE fails them all
+	DWORD FailRemaining;
+	DWORD FailError;
+} SimHost;
+
+typedef struct _SimConnection
+{
+	volatile LONG RefCount;
+	volatile LONG HungUp;
+	HANDLE HangUpEvent;
+	// Set when the connection goes, registered with RasConnectionNotification and owned by the caller
+	HANDLE volatile NotifyEvent;
+	volatile LONG State;
+	DWORD Error;
+	ULONGLONG ConnectedAt;
+	WCHAR EntryName[RAS_MaxEntryName + 1];
+	WCHAR Hostname[RAS_MaxPhoneNumber + 1];
+	WCHAR DeviceName[RAS_MaxDeviceName + 1];
+	RasSimStep Script[RASSIM_MAX_SCRIPT_STEPS];
+	UINT ScriptLength;
+	DWORD NotifierType;
+	LPVOID Notifier;
+	ULONG_PTR CallbackId;
+} SimConnection;
+
+static const RASCONNSTATE DialSequence[] =
+{
+	RASCS_OpenPort,
+	RASCS_PortOpened,
+	RASCS_ConnectDevice,
+	RASCS_DeviceConnected,
+	RASCS_AllDevicesConnected,
+	RASCS_Authenticate,
+	RASCS_Authenticated,
+	RASCS_Connected,
+};
+
+static const LPCWSTR SimDevices[] =
+{
+	L"WAN Miniport (SSTP)",
+	L"WAN Miniport (IKEv2)",
+	L"WAN Miniport (L2TP)",
+	L"WAN Miniport (PPTP)",
+};
+
+static SRWLOCK SimLock = SRWLOCK_INIT;
+static SimEntry Entries[RASSIM_MAX_ENTRIES];
+static SimHost Hosts[RASSIM_MAX_HOSTS];
+static UINT HostCount = 0;
+static SimConnection* Connections[RASSIM_MAX_CONNECTIONS];
+static volatile LONG CallCounts[RasSimCallCount];
+static volatile LONG FailRemaining[RasSimCallCount];
+static volatile LONG FailError[RasSimCallCount];
+
+// Counts the call and consumes an injected failure if one is pending
+static DWORD EnterCall(RasSimCall call)
+{
+	InterlockedIncrement(&CallCounts[call]);
+
+	LONG remaining = FailRemaining[call];
+	while (remaining != 0)
+	{
+		if (remaining == (LONG)INFINITE)
+		{
+			return (DWORD)FailError[call];
+		}
+
+		LONG previous = InterlockedCompareExchange(&FailRemaining[call], remaining - 1, remaining);
+		if (previous == remaining)
+		{
+			return (DWORD)FailError[call];
+		}
+		remaining = previous;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+// The usual RASCONNSTATE walk with dialLatencyMs spread over the transitions. A failing host gets as far as
+// the last step before reporting its error, like a dial that times out.
+static UINT BuildDefaultScript(DWORD dialLatencyMs, DWORD dialError, RasSimStep* steps)
+{
+	DWORD stepMs = dialLatencyMs / (CELEMS(DialSequence) - 1);
+
+	for (UINT i = 0; i < CELEMS(DialSequence); i++)
+	{
+		steps[i].State = DialSequence[i];
+		steps[i].DelayMs = i > 0 ? stepMs : 0;
+		steps[i].Error = ERROR_SUCCESS;
+	}
+
+	if (dialError != ERROR_SUCCESS)
+	{
+		steps[CELEMS(DialSequence) - 1].State = RASCS_Authenticate;
+		steps[CELEMS(DialSequence) - 1].Error = dialError;
+	}
+
+	return CELEMS(DialSequence);
+}
+
+static void SignalDisconnection(SimConnection* conn)
+{
+	HANDLE event = InterlockedExchangePointer((PVOID volatile*)&conn->NotifyEvent, NULL);
+	if (event != NULL)
+	{
+		SetEvent(event);
+	}
+}
+
+static void ReleaseConnection(SimConnection* conn)
+{
+	if (InterlockedDecrement(&conn->RefCount) == 0)
+	{
+		CloseHandle(conn->HangUpEvent);
+		HeapFree(GetProcessHeap(), 0, conn);
+	}
+}
+
+// Looks up a live connection and takes a reference on it, must be called with SimLock held
+static SimConnection* FindConnectionLocked(HRASCONN rasConn)
+{
+	for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+	{
+		if (Connections[i] != NULL && (HRASCONN)Connections[i] == rasConn)
+		{
+			InterlockedIncrement(&Connections[i]->RefCount);
+			return Connections[i];
+		}
+	}
+
+	return NULL;
+}
+
+static SimConnection* FindConnection(HRASCONN rasConn)
+{
+	AcquireSRWLockShared(&SimLock);
+	SimConnection* conn = FindConnectionLocked(rasConn);
+	ReleaseSRWLockShared(&SimLock);
+
+	return conn;
+}
+
+static SimEntry* FindEntryLocked(LPCWSTR entryName)
+{
+	for (UINT i = 0; i < RASSIM_MAX_ENTRIES; i++)
+	{
+		if (Entries[i].InUse && lstrcmpi(Entries[i].Name, entryName) == 0)
+		{
+			return &Entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Must be called with SimLock held exclusively, a pending host failure is consumed by the dial
+static void LookupHostLocked(LPCWSTR hostname, SimConnection* conn)
+{
+	for (UINT i = 0; i < HostCount; i++)
+	{
+		if (lstrcmpi(Hosts[i].Hostname, hostname) == 0)
+		{
+			memcpy(conn->Script, Hosts[i].Script, Hosts[i].ScriptLength * sizeof(RasSimStep));
+			conn->ScriptLength = Hosts[i].ScriptLength;
+
+			if (Hosts[i].FailRemaining != 0)
+			{
+				// Fail where the script would have connected, or at its last step
+				RasSimStep* last = &conn->Script[conn->ScriptLength - 1];
+				if (last->State == RASCS_Connected)
+				{
+					last->State = RASCS_Authenticate;
+				}
+				last->Error = Hosts[i].FailError;
+
+				if (Hosts[i].FailRemaining != INFINITE)
+				{
+					Hosts[i].FailRemaining--;
+				}
+			}
+			return;
+		}
+	}
+
+	conn->ScriptLength = BuildDefaultScript(RASSIM_DEFAULT_DIAL_LATENCY_MS, ERROR_SUCCESS, conn->Script);
+}
+
+// Returns FALSE when the notifier asked for no further notifications
+static BOOL Notify(SimConnection* conn, RASCONNSTATE state, DWORD error)
+{
+	if (conn->Notifier == NULL)
+	{
+		return TRUE;
+	}
+
+	if (conn->NotifierType == 2)
+	{
+		return ((RASDIALFUNC2)conn->Notifier)(conn->CallbackId, 0, (HRASCONN)conn, RASDIALEVENT, state, error, 0) != 0;
+	}
+
+	((RASDIALFUNC1)conn->Notifier)((HRASCONN)conn, RASDIALEVENT, state, error, 0);
+	return TRUE;
+}
+
+// Walks the host's script, a hang up interrupts whichever step is waiting
+static DWORD RunDial(SimConnection* conn)
+{
+	RASCONNSTATE state = RASCS_OpenPort;
+
+	for (UINT i = 0; i < conn->ScriptLength; i++)
+	{
+		const RasSimStep* step = &conn->Script[i];
+
+		if (WaitForSingleObject(conn->HangUpEvent, step->DelayMs) == WAIT_OBJECT_0)
+		{
+			return ERROR_USER_DISCONNECTION;
+		}
+
+		state = step->State;
+
+		if (step->Error != ERROR_SUCCESS)
+		{
+			conn->Error = step->Error;
+		}
+		else if (state == RASCS_Connected)
+		{
+			conn->ConnectedAt = GetTickCount64();
+		}
+
+		InterlockedExchange(&conn->State, (LONG)state);
+
+		if (!Notify(conn, state, step->Error) || step->Error != ERROR_SUCCESS)
+		{
+			return step->Error;
+		}
+	}
+
+	// Scripted to stall, sit in the last state until hung up
+	if (state != RASCS_Connected)
+	{
+		WaitForSingleObject(conn->HangUpEvent, INFINITE);
+		return ERROR_USER_DISCONNECTION;
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD WINAPI DialThread(LPVOID param)
+{
+	SimConnection* conn = (SimConnection*)param;
+
+	RunDial(conn);
+	ReleaseConnection(conn);
+
+	return 0;
+}
+
+static DWORD APIENTRY SimGetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, LPDWORD entryInfoSize, LPBYTE deviceInfo, LPDWORD deviceInfoSize)
+{
+	DWORD injected = EnterCall(RasSimCallGetEntryProperties);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	if (entryInfoSize == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (rasEntry == NULL || *entryInfoSize < sizeof(RASENTRY))
+	{
+		*entryInfoSize = sizeof(RASENTRY);
+		return ERROR_BUFFER_TOO_SMALL;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockShared(&SimLock);
+
+	if (entryName == NULL || entryName[0] == L'\0')
+	{
+		// Default entry
+		memset(rasEntry, 0, sizeof(RASENTRY));
+		rasEntry->dwSize = sizeof(RASENTRY);
+	}
+	else
+	{
+		SimEntry* entry = FindEntryLocked(entryName);
+		if (entry != NULL)
+		{
+			memcpy(rasEntry, &entry->Entry, sizeof(RASENTRY));
+		}
+		else
+		{
+			result = ERROR_CANNOT_FIND_PHONEBOOK_ENTRY;
+		}
+	}
+
+	ReleaseSRWLockShared(&SimLock);
+
+	return result;
+}
+
+static DWORD APIENTRY SimSetEntryProperties(LPCWSTR phonebook, LPCWSTR entryName, LPRASENTRY rasEntry, DWORD entryInfoSize, LPBYTE deviceInfo, DWORD deviceInfoSize)
+{
+	DWORD injected = EnterCall(RasSimCallSetEntryProperties);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	if (entryName == NULL || entryName[0] == L'\0' || rasEntry == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (entryInfoSize < sizeof(RASENTRY))
+	{
+		return ERROR_INVALID_SIZE;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockExclusive(&SimLock);
+
+	SimEntry* entry = FindEntryLocked(entryName);
+	for (UINT i = 0; entry == NULL && i < RASSIM_MAX_ENTRIES; i++)
+	{
+		if (!Entries[i].InUse)
+		{
+			entry = &Entries[i];
+			entry->InUse = TRUE;
+			StringCchCopy(entry->Name, CELEMS(entry->Name), entryName);
+		}
+	}
+
+	if (entry != NULL)
+	{
+		memcpy(&entry->Entry, rasEntry, sizeof(RASENTRY));
+	}
+	else
+	{
+		result = ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	ReleaseSRWLockExclusive(&SimLock);
+
+	return result;
+}
+
+static DWORD APIENTRY SimValidateEntryName(LPCWSTR phonebook, LPCWSTR entryName)
+{
+	DWORD injected = EnterCall(RasSimCallValidateEntryName);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	if (entryName == NULL || entryName[0] == L'\0')
+	{
+		return ERROR_INVALID_NAME;
+	}
+
+	AcquireSRWLockShared(&SimLock);
+	BOOL exists = FindEntryLocked(entryName) != NULL;
+	ReleaseSRWLockShared(&SimLock);
+
+	return exists ? ERROR_ALREADY_EXISTS : ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimEnumDevices(LPRASDEVINFO rasDevInfo, LPDWORD size, LPDWORD devices)
+{
+	DWORD injected = EnterCall(RasSimCallEnumDevices);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	DWORD needed = sizeof(RASDEVINFO) * CELEMS(SimDevices);
+
+	*devices = CELEMS(SimDevices);
+
+	if (rasDevInfo == NULL || *size < needed)
+	{
+		*size = needed;
+		return ERROR_BUFFER_TOO_SMALL;
+	}
+
+	if (rasDevInfo->dwSize != sizeof(RASDEVINFO))
+	{
+		return ERROR_INVALID_SIZE;
+	}
+
+	for (UINT i = 0; i < CELEMS(SimDevices); i++)
+	{
+		rasDevInfo[i].dwSize = sizeof(RASDEVINFO);
+		StringCchCopy(rasDevInfo[i].szDeviceType, CELEMS(rasDevInfo[i].szDeviceType), RASDT_Vpn);
+		StringCchCopy(rasDevInfo[i].szDeviceName, CELEMS(rasDevInfo[i].szDeviceName), SimDevices[i]);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimEnumConnections(LPRASCONN rasConn, LPDWORD size, LPDWORD connections)
+{
+	DWORD injected = EnterCall(RasSimCallEnumConnections);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+	DWORD count = 0;
+
+	AcquireSRWLockShared(&SimLock);
+
+	for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+	{
+		if (Connections[i] != NULL)
+		{
+			count++;
+		}
+	}
+
+	DWORD needed = count * sizeof(RASCONN);
+	*connections = count;
+
+	if (count > 0 && (rasConn == NULL || *size < needed))
+	{
+		*size = needed;
+		result = ERROR_BUFFER_TOO_SMALL;
+	}
+	else if (count > 0 && rasConn->dwSize != sizeof(RASCONN))
+	{
+		result = ERROR_INVALID_SIZE;
+	}
+	else
+	{
+		auto item = rasConn;
+		for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+		{
+			if (Connections[i] == NULL)
+			{
+				continue;
+			}
+
+			memset(item, 0, sizeof(RASCONN));
+			item->dwSize = sizeof(RASCONN);
+			item->hrasconn = (HRASCONN)Connections[i];
+			StringCchCopy(item->szEntryName, CELEMS(item->szEntryName), Connections[i]->EntryName);
+			StringCchCopy(item->szDeviceType, CELEMS(item->szDeviceType), RASDT_Vpn);
+			StringCchCopy(item->szDeviceName, CELEMS(item->szDeviceName), Connections[i]->DeviceName);
+			item++;
+		}
+	}
+
+	ReleaseSRWLockShared(&SimLock);
+
+	return result;
+}
+
+static DWORD APIENTRY SimGetEntryDialParams(LPCWSTR phonebook, LPRASDIALPARAMS dialParams, LPBOOL passwordReturned)
+{
+	DWORD injected = EnterCall(RasSimCallGetEntryDialParams);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	if (dialParams->dwSize != sizeof(RASDIALPARAMS))
+	{
+		return ERROR_INVALID_SIZE;
+	}
+
+	AcquireSRWLockShared(&SimLock);
+	BOOL exists = FindEntryLocked(dialParams->szEntryName) != NULL;
+	ReleaseSRWLockShared(&SimLock);
+
+	if (!exists)
+	{
+		return ERROR_CANNOT_FIND_PHONEBOOK_ENTRY;
+	}
+
+	dialParams->szUserName[0] = L'\0';
+	dialParams->szPassword[0] = L'\0';
+	*passwordReturned = FALSE;
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimDial(LPRASDIALEXTENSIONS dialExtensions, LPCWSTR phonebook, LPRASDIALPARAMS dialParams, DWORD notifierType, LPVOID notifier, LPHRASCONN rasConn)
+{
+	DWORD injected = EnterCall(RasSimCallDial);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	SimConnection* conn = (SimConnection*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SimConnection));
+	if (conn == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// One reference for the connection table, one for the dial
+	conn->RefCount = 2;
+	conn->State = RASCS_OpenPort;
+	conn->NotifierType = notifierType;
+	conn->Notifier = notifier;
+	conn->CallbackId = dialParams->dwCallbackId;
+	conn->HangUpEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	StringCchCopy(conn->EntryName, CELEMS(conn->EntryName), dialParams->szEntryName);
+
+	DWORD result = conn->HangUpEvent != NULL ? ERROR_SUCCESS : GetLastError();
+
+	if (result == ERROR_SUCCESS)
+	{
+		AcquireSRWLockExclusive(&SimLock);
+
+		SimEntry* entry = FindEntryLocked(dialParams->szEntryName);
+		if (entry == NULL)
+		{
+			result = ERROR_CANNOT_FIND_PHONEBOOK_ENTRY;
+		}
+		else
+		{
+			LPCWSTR hostname = dialParams->szPhoneNumber[0] != L'\0' ? dialParams->szPhoneNumber : entry->Entry.szLocalPhoneNumber;
+			StringCchCopy(conn->Hostname, CELEMS(conn->Hostname), hostname);
+			StringCchCopy(conn->DeviceName, CELEMS(conn->DeviceName), entry->Entry.szDeviceName);
+			LookupHostLocked(conn->Hostname, conn);
+
+			result = ERROR_PORT_NOT_AVAILABLE;
+			for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+			{
+				if (Connections[i] == NULL)
+				{
+					Connections[i] = conn;
+					result = ERROR_SUCCESS;
+					break;
+				}
+			}
+		}
+
+		ReleaseSRWLockExclusive(&SimLock);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		if (conn->HangUpEvent != NULL)
+		{
+			CloseHandle(conn->HangUpEvent);
+		}
+		HeapFree(GetProcessHeap(), 0, conn);
+		return result;
+	}
+
+	*rasConn = (HRASCONN)conn;
+
+	// Without a notifier RasDial is synchronous
+	if (notifier == NULL)
+	{
+		result = RunDial(conn);
+		ReleaseConnection(conn);
+		return result;
+	}
+
+	HANDLE thread = CreateThread(NULL, 0, DialThread, conn, 0, NULL);
+	if (thread == NULL)
+	{
+		result = GetLastError();
+		ReleaseConnection(conn);
+		return result;
+	}
+
+	CloseHandle(thread);
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimHangUp(HRASCONN rasConn)
+{
+	DWORD injected = EnterCall(RasSimCallHangUp);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	SimConnection* conn = NULL;
+
+	AcquireSRWLockExclusive(&SimLock);
+
+	for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+	{
+		if (Connections[i] != NULL && (HRASCONN)Connections[i] == rasConn)
+		{
+			conn = Connections[i];
+			Connections[i] = NULL;
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&SimLock);
+
+	if (conn == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	InterlockedExchange(&conn->HungUp, TRUE);
+	InterlockedExchange(&conn->State, (LONG)RASCS_Disconnected);
+	SetEvent(conn->HangUpEvent);
+	SignalDisconnection(conn);
+
+	// Drop the connection table reference, the dial thread drops its own once it notices
+	ReleaseConnection(conn);
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimGetConnectStatus(HRASCONN rasConn, LPRASCONNSTATUS status)
+{
+	DWORD injected = EnterCall(RasSimCallGetConnectStatus);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	SimConnection* conn = FindConnection(rasConn);
+	if (conn == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	status->rasconnstate = (RASCONNSTATE)conn->State;
+	status->dwError = conn->Error;
+	StringCchCopy(status->szDeviceType, CELEMS(status->szDeviceType), RASDT_Vpn);
+	StringCchCopy(status->szDeviceName, CELEMS(status->szDeviceName), conn->DeviceName);
+	StringCchCopy(status->szPhoneNumber, CELEMS(status->szPhoneNumber), conn->Hostname);
+
+	ReleaseConnection(conn);
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimGetConnectionStatistics(HRASCONN rasConn, RAS_STATS* stats)
+{
+	DWORD injected = EnterCall(RasSimCallGetConnectionStatistics);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	SimConnection* conn = FindConnection(rasConn);
+	if (conn == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	DWORD duration = 0;
+	if (conn->State == RASCS_Connected)
+	{
+		duration = (DWORD)(GetTickCount64() - conn->ConnectedAt);
+	}
+
+	stats->dwBytesXmited = duration * (RASSIM_BYTES_PER_MS / 4);
+	stats->dwBytesRcved = duration * RASSIM_BYTES_PER_MS;
+	stats->dwBps = RASSIM_BYTES_PER_MS * 8 * 1000;
+	stats->dwConnectDuration = duration;
+
+	ReleaseConnection(conn);
+
+	return ERROR_SUCCESS;
+}
+
+static DWORD APIENTRY SimConnectionNotification(HRASCONN rasConn, HANDLE event, DWORD flags)
+{
+	DWORD injected = EnterCall(RasSimCallConnectionNotification);
+	if (injected != ERROR_SUCCESS)
+	{
+		return injected;
+	}
+
+	// Only a single connection's disconnection is simulated, not the INVALID_HANDLE_VALUE catch all
+	if (event == NULL || flags != RASCN_Disconnection)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	SimConnection* conn = FindConnection(rasConn);
+	if (conn == NULL)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	InterlockedExchangePointer((PVOID volatile*)&conn->NotifyEvent, event);
+
+	// Gone before the registration landed, signal it now rather than never
+	if (conn->State == RASCS_Disconnected)
+	{
+		SignalDisconnection(conn);
+	}
+
+	ReleaseConnection(conn);
+
+	return ERROR_SUCCESS;
+}
+
+static const RASLIB_API RasSimApi =
+{
+	SimGetEntryProperties,
+	SimSetEntryProperties,
+	SimValidateEntryName,
+	SimEnumDevices,
+	SimEnumConnections,
+	SimGetEntryDialParams,
+	SimDial,
+	SimHangUp,
+	SimGetConnectStatus,
+	SimGetConnectionStatistics,
+	SimConnectionNotification,
+};
+
+DWORD RasSimEnable(BOOL enable)
+{
+	return RaslibSetApi(enable ? &RasSimApi : NULL);
+}
+
+#ifdef RASLIB_SIMULATOR
+static DWORD SetHostScript(LPCWSTR hostname, const RasSimStep* steps, UINT stepCount)
+{
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockExclusive(&SimLock);
+
+	UINT i = 0;
+	while (i < HostCount && lstrcmpi(Hosts[i].Hostname, hostname) != 0)
+	{
+		i++;
+	}
+
+	if (i == HostCount && HostCount == RASSIM_MAX_HOSTS)
+	{
+		result = ERROR_NOT_ENOUGH_MEMORY;
+	}
+	else
+	{
+		if (i == HostCount)
+		{
+			StringCchCopy(Hosts[i].Hostname, CELEMS(Hosts[i].Hostname), hostname);
+			HostCount++;
+		}
+
+		memcpy(Hosts[i].Script, steps, stepCount * sizeof(RasSimStep));
+		Hosts[i].ScriptLength = stepCount;
+	}
+
+	ReleaseSRWLockExclusive(&SimLock);
+
+	return result;
+}
+
+// Finds or adds the host, new hosts get the default script. Must be called with SimLock held exclusively.
+static SimHost* AddHostLocked(LPCWSTR hostname)
+{
+	for (UINT i = 0; i < HostCount; i++)
+	{
+		if (lstrcmpi(Hosts[i].Hostname, hostname) == 0)
+		{
+			return &Hosts[i];
+		}
+	}
+
+	if (HostCount == RASSIM_MAX_HOSTS)
+	{
+		return NULL;
+	}
+
+	SimHost* host = &Hosts[HostCount++];
+	StringCchCopy(host->Hostname, CELEMS(host->Hostname), hostname);
+	host->ScriptLength = BuildDefaultScript(RASSIM_DEFAULT_DIAL_LATENCY_MS, ERROR_SUCCESS, host->Script);
+
+	return host;
+}
+
+DWORD RasSimSetHost(LPCWSTR hostname, DWORD dialLatencyMs, DWORD dialError)
+{
+	RasSimStep steps[RASSIM_MAX_SCRIPT_STEPS];
+	UINT stepCount = BuildDefaultScript(dialLatencyMs, dialError, steps);
+
+	return SetHostScript(hostname, steps, stepCount);
+}
+
+DWORD RasSimSetHostScript(LPCWSTR hostname, const RasSimStep* steps, UINT stepCount)
+{
+	if (hostname == NULL || steps == NULL || stepCount == 0 || stepCount > RASSIM_MAX_SCRIPT_STEPS)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	return SetHostScript(hostname, steps, stepCount);
+}
+
+DWORD RasSimFailHost(LPCWSTR hostname, DWORD error, DWORD count)
+{
+	if (hostname == NULL || (count != 0 && error == ERROR_SUCCESS))
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockExclusive(&SimLock);
+
+	SimHost* host = AddHostLocked(hostname);
+	if (host != NULL)
+	{
+		host->FailError = error;
+		host->FailRemaining = count;
+	}
+	else
+	{
+		result = ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	ReleaseSRWLockExclusive(&SimLock);
+
+	return result;
+}
+
+DWORD RasSimDropConnections(LPCWSTR hostname)
+{
+	SimConnection* dropped[RASSIM_MAX_CONNECTIONS];
+	UINT droppedCount = 0;
+
+	AcquireSRWLockShared(&SimLock);
+
+	for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+	{
+		SimConnection* conn = Connections[i];
+		if (conn == NULL || (hostname != NULL && lstrcmpi(conn->Hostname, hostname) != 0))
+		{
+			continue;
+		}
+
+		// Only connected entries drop, the dial thread has finished with them
+		if (InterlockedCompareExchange(&conn->State, (LONG)RASCS_Disconnected, (LONG)RASCS_Connected) == (LONG)RASCS_Connected)
+		{
+			conn->Error = ERROR_REMOTE_DISCONNECTION;
+			InterlockedIncrement(&conn->RefCount);
+			dropped[droppedCount++] = conn;
+		}
+	}
+
+	ReleaseSRWLockShared(&SimLock);
+
+	for (UINT i = 0; i < droppedCount; i++)
+	{
+		SignalDisconnection(dropped[i]);
+		ReleaseConnection(dropped[i]);
+	}
+
+	return droppedCount > 0 ? ERROR_SUCCESS : ERROR_NOT_FOUND;
+}
+
+DWORD RasSimFailCall(RasSimCall call, DWORD error, DWORD count)
+{
+	if (call < 0 || call >= RasSimCallCount)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	// Error first so a call that sees the count never fails with a stale error
+	InterlockedExchange(&FailError[call], (LONG)error);
+	InterlockedExchange(&FailRemaining[call], (LONG)count);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD RasSimGetCallCounts(DWORD* counts, DWORD countsLength)
+{
+	if (counts == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	for (DWORD i = 0; i < countsLength && i < RasSimCallCount; i++)
+	{
+		counts[i] = (DWORD)CallCounts[i];
+	}
+
+	return ERROR_SUCCESS;
+}
+
+#endif
+
+DWORD RasSimReset()
+{
+	HRASCONN live[RASSIM_MAX_CONNECTIONS];
+	UINT liveCount = 0;
+
+	AcquireSRWLockExclusive(&SimLock);
+
+	for (UINT i = 0; i < RASSIM_MAX_CONNECTIONS; i++)
+	{
+		if (Connections[i] != NULL)
+		{
+			live[liveCount++] = (HRASCONN)Connections[i];
+		}
+	}
+
+	memset(Entries, 0, sizeof(Entries));
+	memset(Hosts, 0, sizeof(Hosts));
+	HostCount = 0;
+
+	ReleaseSRWLockExclusive(&SimLock);
+
+	for (UINT i = 0; i < liveCount; i++)
+	{
+		SimHangUp(live[i]);
+	}
+
+	for (UINT i = 0; i < RasSimCallCount; i++)
+	{
+		InterlockedExchange(&FailRemaining[i], 0);
+		InterlockedExchange(&CallCounts[i], 0);
+	}
+
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <Windows.h>
+#include <Ras.h>
+
+// Default time a simulated dial takes to walk from RASCS_OpenPort to RASCS_Connected
+#define RASSIM_DEFAULT_DIAL_LATENCY_MS 200
+#define RASSIM_MAX_SCRIPT_STEPS 16
+
+// One step of a scripted dial: wait DelayMs, then report State with Error. A step with an error ends the dial.
+typedef struct _RasSimStep
+{
+	RASCONNSTATE State;
+	DWORD DelayMs;
+	DWORD Error;
+} RasSimStep;
+
+typedef enum _RasSimCall
+{
+	RasSimCallGetEntryProperties = 0,
+	RasSimCallSetEntryProperties,
+	RasSimCallValidateEntryName,
+	RasSimCallEnumDevices,
+	RasSimCallEnumConnections,
+	RasSimCallGetEntryDialParams,
+	RasSimCallDial,
+	RasSimCallHangUp,
+	RasSimCallGetConnectStatus,
+	RasSimCallGetConnectionStatistics,
+	RasSimCallConnectionNotification,
+	RasSimCallCount
+} RasSimCall;
+
+// In-process stand in for Rasapi32. Keeps its own phonebook, device list and connection table and walks each
+// dial through the usual RASCONNSTATE sequence on its own thread, delaying by the latency configured for the
+// dialed hostname. RasSimEnable swaps it in as the active RAS table (see RasApi.h).
+extern DWORD RasSimEnable(BOOL enable);
+
+// The controls scripting it are only built with RASLIB_SIMULATOR defined, as the test and bench projects do, so
+// they never ship. Other builds only reach the simulator through Replay.
+#ifdef RASLIB_SIMULATOR
+
+// Sets how long dials to hostname take and the error they finish with (ERROR_SUCCESS to connect)
+extern DWORD RasSimSetHost(LPCWSTR hostname, DWORD dialLatencyMs, DWORD dialError);
+
+// Replaces the whole dial sequence for hostname. A script that ends without RASCS_Connected or an error leaves
+// the dial stuck in its last state until it is hung up, which is how a server that stops responding looks.
+extern DWORD RasSimSetHostScript(LPCWSTR hostname, const RasSimStep* steps, UINT stepCount);
+
+// Fails the next count dials to hostname with error where the script would have connected, INFINITE fails
+// every dial and 0 stops failing. The host keeps its latency and script otherwise.
+extern DWORD RasSimFailHost(LPCWSTR hostname, DWORD error, DWORD count);
+
+// Drops every connected connection to hostname, or every connection when hostname is NULL, as if the server
+// went away: the connection reports RASCS_Disconnected with ERROR_REMOTE_DISCONNECTION and signals its
+// RasConnectionNotification event, but stays in the table until it is hung up. ERROR_NOT_FOUND when nothing
+// was connected.
+extern DWORD RasSimDropConnections(LPCWSTR hostname);
+
+// Fails the next count calls of the given kind with error before they reach the simulator, INFINITE fails
+// every call and 0 stops failing
+extern DWORD RasSimFailCall(RasSimCall call, DWORD error, DWORD count);
+
+// Copies how many times each RAS call reached the simulator since the last reset, indexed by RasSimCall
+extern DWORD RasSimGetCallCounts(DWORD* counts, DWORD countsLength);
+#endif
+
+// Hangs up every simulated connection and clears the phonebook, host table, failures and call counts
+extern DWORD RasSimReset();
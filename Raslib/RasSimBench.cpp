@@ -0,0 +1,626 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <Ras.h>
+#include <RasError.h>
+#include <stdlib.h>
+#include "Raslib.h"
+#include "RasApi.h"
+#include "RasSim.h"
+#include "RasSimBench.h"
+#include "Helpers.h"
+
+#if defined(RASLIB_SIMULATOR) && defined(NATIVE_BENCH)
+
+#define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
+
+#define BENCH_DEVICE L"RasSimBench"
+#define BENCH_HOST L"bench.rassim"
+#define BENCH_STALL_HOST L"stall.rassim"
+#define BENCH_PRIMARY_HOST L"primary.rassim"
+#define BENCH_BACKUP_HOST L"backup.rassim"
+#define BENCH_DIAL_TIMEOUT_MS 10000
+// Longest one reconnect may take before the benchmark gives up on it
+#define BENCH_RECONNECT_TIMEOUT_MS 120000
+
+// Dials to the stall host sit in RASCS_ConnectDevice until they are hung up
+static const RasSimStep StallScript[] =
+{
+	{ RASCS_OpenPort, 0, ERROR_SUCCESS },
+	{ RASCS_PortOpened, 0, ERROR_SUCCESS },
+	{ RASCS_ConnectDevice, 0, ERROR_SUCCESS },
+};
+
+typedef struct _BenchDial
+{
+	HANDLE Done;
+	LARGE_INTEGER FinishedAt;
+	DWORD Error;
+} BenchDial;
+
+static void Finish(BenchDial* dial, DWORD error)
+{
+	QueryPerformanceCounter(&dial->FinishedAt);
+	dial->Error = error;
+	SetEvent(dial->Done);
+}
+
+typedef struct _BenchReconnect
+{
+	HANDLE Connected;
+	LARGE_INTEGER ConnectedAt;
+	UINT Server;
+} BenchReconnect;
+
+static void CALLBACK BenchReconnectChanged(HRECONNECT reconnector, ReconnectState state, const ReconnectStatus* status, PVOID context)
+{
+	BenchReconnect* bench = (BenchReconnect*)context;
+
+	if (state == ReconnectConnected)
+	{
+		QueryPerformanceCounter(&bench->ConnectedAt);
+		bench->Server = status->Server;
+		SetEvent(bench->Connected);
+	}
+}
+
+static void _cdecl BenchDialComplete(HDIALSESSION session, LPVOID context)
+{
+	Finish((BenchDial*)context, ERROR_SUCCESS);
+}
+
+static void _cdecl BenchDialError(HDIALSESSION session, DWORD error, LPVOID context)
+{
+	Finish((BenchDial*)context, error);
+}
+
+static void _cdecl BenchDialAbort(HDIALSESSION session, LPVOID context)
+{
+	Finish((BenchDial*)context, ERROR_CANCELLED);
+}
+
+static void Summarise(LONGLONG* ticks, DWORD samples, DWORD errors, LONG allocs, UINT ops, LARGE_INTEGER frequency, RasSimLatency* latency)
+{
+	TickSummary summary;
+	SummariseTicks(ticks, samples, frequency.QuadPart, &summary);
+
+	latency->Samples = summary.Samples;
+	latency->Errors = errors;
+	latency->MeanUs = summary.MeanUs;
+	latency->P50Us = summary.P50Us;
+	latency->P90Us = summary.P90Us;
+	latency->P99Us = summary.P99Us;
+	latency->MaxUs = summary.MaxUs;
+	latency->AllocsPerOp = ops > 0 ? (DOUBLE)allocs / ops : 0;
+}
+
+// Starts a dial on a new session and waits for it to finish, *ticks is the time from DialSessionDial to the callback
+static DWORD TimedDial(BenchDial* dial, LPCWSTR hostname, HDIALSESSION* session, LONGLONG* ticks)
+{
+	DialSessionCallbacks callbacks = { BenchDialComplete, BenchDialError, BenchDialAbort, dial };
+	LARGE_INTEGER start;
+
+	ResetEvent(dial->Done);
+
+	DWORD rc = DialSessionCreate(&callbacks, session);
+	if (rc != ERROR_SUCCESS)
+	{
+		*session = 0;
+		return rc;
+	}
+
+	QueryPerformanceCounter(&start);
+
+	rc = DialSessionDial(*session, BENCH_DEVICE, hostname, L"rassim", L"rassim");
+	if (rc == ERROR_SUCCESS && WaitForSingleObject(dial->Done, BENCH_DIAL_TIMEOUT_MS) != WAIT_OBJECT_0)
+	{
+		rc = ERROR_TIMEOUT;
+	}
+
+	if (rc != ERROR_SUCCESS)
+	{
+		DialSessionClose(*session);
+		*session = 0;
+		return rc;
+	}
+
+	*ticks = dial->FinishedAt.QuadPart - start.QuadPart;
+
+	return dial->Error;
+}
+
+static DWORD RunBenchmark(UINT iterations, LONGLONG* samples[4], RasSimBenchReport* report)
+{
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+	DWORD count[4] = { 0 };
+	DWORD errors[4] = { 0 };
+	LONG allocs[4] = { 0 };
+	VpnDeviceStats stats;
+	BenchDial dial;
+
+	QueryPerformanceFrequency(&frequency);
+
+	dial.Done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (dial.Done == NULL)
+	{
+		return GetLastError();
+	}
+
+	// Dial, then query stats and disconnect while it's up
+	for (UINT i = 0; i < iterations; i++)
+	{
+		HDIALSESSION session;
+		LONGLONG ticks;
+
+		LONG allocsBefore = RaslibGetAllocCount();
+		DWORD rc = TimedDial(&dial, BENCH_HOST, &session, &ticks);
+		allocs[0] += RaslibGetAllocCount() - allocsBefore;
+
+		if (rc != ERROR_SUCCESS)
+		{
+			errors[0]++;
+			if (session != 0)
+			{
+				DialSessionClose(session);
+			}
+			continue;
+		}
+		samples[0][count[0]++] = ticks;
+
+		allocsBefore = RaslibGetAllocCount();
+		QueryPerformanceCounter(&start);
+		rc = GetVpnDeviceStatistics(BENCH_DEVICE, &stats);
+		QueryPerformanceCounter(&end);
+		allocs[3] += RaslibGetAllocCount() - allocsBefore;
+
+		if (rc == ERROR_SUCCESS && stats.Status == 1)
+		{
+			samples[3][count[3]++] = end.QuadPart - start.QuadPart;
+		}
+		else
+		{
+			errors[3]++;
+		}
+
+		allocsBefore = RaslibGetAllocCount();
+		QueryPerformanceCounter(&start);
+		rc = DisconnectVpnDevice(BENCH_DEVICE);
+		QueryPerformanceCounter(&end);
+		allocs[2] += RaslibGetAllocCount() - allocsBefore;
+
+		if (rc == ERROR_SUCCESS || rc == ERROR_INVALID_HANDLE)
+		{
+			samples[2][count[2]++] = end.QuadPart - start.QuadPart;
+		}
+		else
+		{
+			errors[2]++;
+		}
+
+		DialSessionClose(session);
+	}
+
+	// Abort dials stalled half way through the sequence
+	for (UINT i = 0; i < iterations; i++)
+	{
+		DialSessionCallbacks callbacks = { BenchDialComplete, BenchDialError, BenchDialAbort, &dial };
+		HDIALSESSION session;
+
+		ResetEvent(dial.Done);
+
+		DWORD rc = DialSessionCreate(&callbacks, &session);
+		if (rc == ERROR_SUCCESS)
+		{
+			rc = DialSessionDial(session, BENCH_DEVICE, BENCH_STALL_HOST, L"rassim", L"rassim");
+
+			LONG allocsBefore = RaslibGetAllocCount();
+			QueryPerformanceCounter(&start);
+			if (rc == ERROR_SUCCESS)
+			{
+				rc = DialSessionAbort(session);
+			}
+			QueryPerformanceCounter(&end);
+			allocs[1] += RaslibGetAllocCount() - allocsBefore;
+
+			if (rc == ERROR_SUCCESS && WaitForSingleObject(dial.Done, BENCH_DIAL_TIMEOUT_MS) == WAIT_OBJECT_0 && dial.Error == ERROR_CANCELLED)
+			{
+				samples[1][count[1]++] = end.QuadPart - start.QuadPart;
+			}
+			else
+			{
+				errors[1]++;
+			}
+
+			DialSessionClose(session);
+		}
+		else
+		{
+			errors[1]++;
+		}
+	}
+
+	CloseHandle(dial.Done);
+
+	Summarise(samples[0], count[0], errors[0], allocs[0], iterations, frequency, &report->Dial);
+	Summarise(samples[1], count[1], errors[1], allocs[1], iterations, frequency, &report->Abort);
+	Summarise(samples[2], count[2], errors[2], allocs[2], count[0], frequency, &report->Disconnect);
+	Summarise(samples[3], count[3], errors[3], allocs[3], count[0], frequency, &report->Stats);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD RasSimRunBenchmark(UINT iterations, DWORD dialLatencyMs, RasSimBenchReport* report)
+{
+	LONGLONG* samples[4] = { NULL };
+	DWORD result = ERROR_SUCCESS;
+
+	if (iterations == 0 || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(report, 0, sizeof(RasSimBenchReport));
+
+	// Sample buffers come straight from the process heap so they don't show up in the allocation counts
+	for (UINT i = 0; i < CELEMS(samples); i++)
+	{
+		samples[i] = (LONGLONG*)HeapAlloc(GetProcessHeap(), 0, iterations * sizeof(LONGLONG));
+		if (samples[i] == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		const RASLIB_API* previous = RaslibGetInstalledApi();
+
+		RasSimEnable(TRUE);
+		RasSimReset();
+		RasSimSetHost(BENCH_HOST, dialLatencyMs, ERROR_SUCCESS);
+		RasSimSetHostScript(BENCH_STALL_HOST, StallScript, CELEMS(StallScript));
+
+		result = RunBenchmark(iterations, samples, report);
+
+		RasSimReset();
+		RaslibSetApi(previous);
+	}
+
+	for (UINT i = 0; i < CELEMS(samples); i++)
+	{
+		if (samples[i] != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, samples[i]);
+		}
+	}
+
+	return result;
+}
+
+static DWORD RunStatsBenchmark(UINT deviceCount, UINT iterations, LPCWSTR* names, LONGLONG* samples[2], RasSimLatency* single, RasSimLatency* batched)
+{
+	HDIALSESSION sessions[RASSIM_BENCH_MAX_DEVICES] = { 0 };
+	VpnDeviceStats stats[RASSIM_BENCH_MAX_DEVICES];
+	DWORD results[RASSIM_BENCH_MAX_DEVICES];
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+	DWORD count[2] = { 0 };
+	DWORD errors[2] = { 0 };
+	LONG allocs[2] = { 0 };
+	DWORD result = ERROR_SUCCESS;
+	BenchDial dial;
+
+	QueryPerformanceFrequency(&frequency);
+
+	dial.Done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (dial.Done == NULL)
+	{
+		return GetLastError();
+	}
+
+	for (UINT i = 0; i < deviceCount && result == ERROR_SUCCESS; i++)
+	{
+		DialSessionCallbacks callbacks = { BenchDialComplete, BenchDialError, BenchDialAbort, &dial };
+
+		ResetEvent(dial.Done);
+
+		result = DialSessionCreate(&callbacks, &sessions[i]);
+		if (result == ERROR_SUCCESS)
+		{
+			result = DialSessionDial(sessions[i], names[i], BENCH_HOST, L"rassim", L"rassim");
+		}
+		if (result == ERROR_SUCCESS && WaitForSingleObject(dial.Done, BENCH_DIAL_TIMEOUT_MS) != WAIT_OBJECT_0)
+		{
+			result = ERROR_TIMEOUT;
+		}
+		if (result == ERROR_SUCCESS)
+		{
+			result = dial.Error;
+		}
+	}
+
+	for (UINT i = 0; i < iterations && result == ERROR_SUCCESS; i++)
+	{
+		DWORD rc = ERROR_SUCCESS;
+
+		LONG allocsBefore = RaslibGetAllocCount();
+		QueryPerformanceCounter(&start);
+		for (UINT j = 0; j < deviceCount; j++)
+		{
+			DWORD entryResult = GetVpnDeviceStatistics(names[j], &stats[j]);
+			if (entryResult != ERROR_SUCCESS || stats[j].Status != 1)
+			{
+				rc = entryResult != ERROR_SUCCESS ? entryResult : ERROR_NOT_CONNECTED;
+			}
+		}
+		QueryPerformanceCounter(&end);
+		allocs[0] += RaslibGetAllocCount() - allocsBefore;
+
+		if (rc == ERROR_SUCCESS)
+		{
+			samples[0][count[0]++] = end.QuadPart - start.QuadPart;
+		}
+		else
+		{
+			errors[0]++;
+		}
+
+		allocsBefore = RaslibGetAllocCount();
+		QueryPerformanceCounter(&start);
+		rc = GetVpnDeviceStatisticsBatch(names, deviceCount, stats, results, NULL, 0);
+		QueryPerformanceCounter(&end);
+		allocs[1] += RaslibGetAllocCount() - allocsBefore;
+
+		for (UINT j = 0; j < deviceCount && rc == ERROR_SUCCESS; j++)
+		{
+			if (results[j] != ERROR_SUCCESS || stats[j].Status != 1)
+			{
+				rc = results[j] != ERROR_SUCCESS ? results[j] : ERROR_NOT_CONNECTED;
+			}
+		}
+
+		if (rc == ERROR_SUCCESS)
+		{
+			samples[1][count[1]++] = end.QuadPart - start.QuadPart;
+		}
+		else
+		{
+			errors[1]++;
+		}
+	}
+
+	for (UINT i = 0; i < deviceCount; i++)
+	{
+		if (sessions[i] != 0)
+		{
+			DialSessionClose(sessions[i]);
+		}
+	}
+
+	CloseHandle(dial.Done);
+
+	Summarise(samples[0], count[0], errors[0], allocs[0], iterations, frequency, single);
+	Summarise(samples[1], count[1], errors[1], allocs[1], iterations, frequency, batched);
+
+	return result;
+}
+
+DWORD RasSimRunStatsBenchmark(UINT deviceCount, UINT iterations, RasSimLatency* single, RasSimLatency* batched)
+{
+	LONGLONG* samples[2] = { NULL };
+	WCHAR(*entryNames)[RAS_MaxEntryName + 1] = NULL;
+	LPCWSTR names[RASSIM_BENCH_MAX_DEVICES];
+	DWORD result = ERROR_SUCCESS;
+
+	if (deviceCount == 0 || deviceCount > RASSIM_BENCH_MAX_DEVICES || iterations == 0 || single == NULL || batched == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(single, 0, sizeof(RasSimLatency));
+	memset(batched, 0, sizeof(RasSimLatency));
+
+	entryNames = (WCHAR(*)[RAS_MaxEntryName + 1])HeapAlloc(GetProcessHeap(), 0, deviceCount * sizeof(*entryNames));
+	if (entryNames == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	for (UINT i = 0; i < deviceCount; i++)
+	{
+		GetVpnDeviceSlotName(BENCH_DEVICE, i, entryNames[i], CELEMS(entryNames[i]));
+		names[i] = entryNames[i];
+	}
+
+	for (UINT i = 0; i < CELEMS(samples); i++)
+	{
+		samples[i] = (LONGLONG*)HeapAlloc(GetProcessHeap(), 0, iterations * sizeof(LONGLONG));
+		if (samples[i] == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		const RASLIB_API* previous = RaslibGetInstalledApi();
+
+		RasSimEnable(TRUE);
+		RasSimReset();
+		RasSimSetHost(BENCH_HOST, 0, ERROR_SUCCESS);
+
+		result = RunStatsBenchmark(deviceCount, iterations, names, samples, single, batched);
+
+		RasSimReset();
+		RaslibSetApi(previous);
+	}
+
+	for (UINT i = 0; i < CELEMS(samples); i++)
+	{
+		if (samples[i] != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, samples[i]);
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, entryNames);
+
+	return result;
+}
+
+static DWORD RunReconnectBenchmark(const RasSimReconnectScenario* scenario, LONGLONG* samples[2], RasSimReconnectReport* report)
+{
+	LPCWSTR hostnames[] = { BENCH_PRIMARY_HOST, BENCH_BACKUP_HOST };
+	ReconnectOptions options;
+	ReconnectStatus status;
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER droppedAt;
+	LARGE_INTEGER backAt;
+	DWORD count[2] = { 0 };
+	HRECONNECT reconnector;
+	BenchReconnect bench;
+
+	QueryPerformanceFrequency(&frequency);
+
+	memset(&options, 0, sizeof(options));
+	options.DeviceName = BENCH_DEVICE;
+	options.Hostnames = hostnames;
+	options.HostnameCount = CELEMS(hostnames);
+	options.Username = L"rassim";
+	options.Password = L"rassim";
+	options.BaseDelayMs = scenario->BaseDelayMs;
+	options.MaxDelayMs = scenario->MaxDelayMs;
+	options.BreakerThreshold = scenario->BreakerThreshold;
+	options.BreakerCooldownMs = scenario->BreakerCooldownMs;
+	options.Seed = scenario->Seed;
+
+	bench.Connected = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (bench.Connected == NULL)
+	{
+		return GetLastError();
+	}
+
+	DWORD result = ReconnectStart(&options, BenchReconnectChanged, &bench, &reconnector);
+	if (result != ERROR_SUCCESS)
+	{
+		CloseHandle(bench.Connected);
+		return result;
+	}
+
+	if (WaitForSingleObject(bench.Connected, BENCH_RECONNECT_TIMEOUT_MS) != WAIT_OBJECT_0)
+	{
+		result = ERROR_TIMEOUT;
+	}
+
+	for (UINT i = 0; i < scenario->Drops && result == ERROR_SUCCESS; i++)
+	{
+		if (scenario->OfflineMs != 0)
+		{
+			RasSimFailHost(BENCH_PRIMARY_HOST, ERROR_VPN_TIMEOUT, INFINITE);
+			RasSimFailHost(BENCH_BACKUP_HOST, ERROR_VPN_TIMEOUT, INFINITE);
+		}
+		else
+		{
+			RasSimFailHost(BENCH_PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, scenario->FailuresPerDrop);
+		}
+
+		QueryPerformanceCounter(&droppedAt);
+		RasSimDropConnections(NULL);
+
+		if (scenario->OfflineMs != 0)
+		{
+			Sleep(scenario->OfflineMs);
+
+			RasSimFailHost(BENCH_PRIMARY_HOST, ERROR_SERVER_NOT_RESPONDING, scenario->FailuresPerDrop);
+			RasSimFailHost(BENCH_BACKUP_HOST, ERROR_SUCCESS, 0);
+			QueryPerformanceCounter(&backAt);
+
+			if (scenario->NotifyNetworkChange)
+			{
+				ReconnectNotifyNetworkChange();
+			}
+		}
+
+		if (WaitForSingleObject(bench.Connected, BENCH_RECONNECT_TIMEOUT_MS) != WAIT_OBJECT_0)
+		{
+			result = ERROR_TIMEOUT;
+			break;
+		}
+
+		samples[0][count[0]++] = bench.ConnectedAt.QuadPart - droppedAt.QuadPart;
+
+		if (scenario->OfflineMs != 0)
+		{
+			samples[1][count[1]++] = bench.ConnectedAt.QuadPart - backAt.QuadPart;
+		}
+
+		if (bench.Server != 0)
+		{
+			report->Failovers++;
+		}
+	}
+
+	if (ReconnectGetStatus(reconnector, &status) == ERROR_SUCCESS)
+	{
+		report->Dials = status.Dials;
+		report->BreakerTrips = status.BreakerTrips;
+	}
+
+	ReconnectStop(reconnector);
+	CloseHandle(bench.Connected);
+
+	Summarise(samples[0], count[0], scenario->Drops - count[0], 0, scenario->Drops, frequency, &report->Outage);
+	Summarise(samples[1], count[1], scenario->OfflineMs != 0 ? scenario->Drops - count[1] : 0, 0, scenario->Drops, frequency, &report->Recovery);
+
+	return result;
+}
+
+DWORD RasSimRunReconnectBenchmark(const RasSimReconnectScenario* scenario, RasSimReconnectReport* report)
+{
+	LONGLONG* samples[2] = { NULL };
+	DWORD result = ERROR_SUCCESS;
+
+	if (scenario == NULL || scenario->Drops == 0 || report == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	memset(report, 0, sizeof(RasSimReconnectReport));
+
+	for (UINT i = 0; i < CELEMS(samples); i++)
+	{
+		samples[i] = (LONGLONG*)HeapAlloc(GetProcessHeap(), 0, scenario->Drops * sizeof(LONGLONG));
+		if (samples[i] == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		const RASLIB_API* previous = RaslibGetInstalledApi();
+
+		RasSimEnable(TRUE);
+		RasSimReset();
+		RasSimSetHost(BENCH_PRIMARY_HOST, scenario->DialLatencyMs, ERROR_SUCCESS);
+		RasSimSetHost(BENCH_BACKUP_HOST, scenario->DialLatencyMs, ERROR_SUCCESS);
+
+		result = RunReconnectBenchmark(scenario, samples, report);
+
+		RasSimReset();
+		RaslibSetApi(previous);
+	}
+
+	for (UINT i = 0; i < CELEMS(samples); i++)
+	{
+		if (samples[i] != NULL)
+		{
+			HeapFree(GetProcessHeap(), 0, samples[i]);
+		}
+	}
+
+	return result;
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+#include <Windows.h>
+
+// Benchmarks over the RAS simulator, only built with RASLIB_SIMULATOR and NATIVE_BENCH defined as Netlib.Bench does (see RasSim.h)
+
+// Simulated connections one stats benchmark can bring up
+#define RASSIM_BENCH_MAX_DEVICES 64
+
+typedef struct _RasSimLatency
+{
+	DWORD Samples;
+	DWORD Errors;
+	DOUBLE MeanUs;
+	DOUBLE P50Us;
+	DOUBLE P90Us;
+	DOUBLE P99Us;
+	DOUBLE MaxUs;
+	DOUBLE AllocsPerOp;
+} RasSimLatency;
+
+typedef struct _RasSimBenchReport
+{
+	RasSimLatency Dial;
+	RasSimLatency Abort;
+	RasSimLatency Disconnect;
+	RasSimLatency Stats;
+} RasSimBenchReport;
+
+// Runs the public Raslib entry points against the simulator and reports their latency and heap allocations:
+//  Dial       - DialSessionDial until the complete callback fires
+//  Abort      - DialSessionAbort on a dial stalled mid-sequence
+//  Disconnect - DisconnectVpnDevice on a connected entry
+//  Stats      - GetVpnDeviceStatistics on a connected entry
+// dialLatencyMs is the simulated server time per dial, 0 measures Raslib's own overhead. The active RAS
+// table is restored afterwards, don't run it while a real dial is in flight.
+extern DWORD RasSimRunBenchmark(UINT iterations, DWORD dialLatencyMs, RasSimBenchReport* report);
+
+// Connects deviceCount simulated entries and times querying all of them per iteration, once with a
+// GetVpnDeviceStatistics call per entry and once with a single GetVpnDeviceStatisticsBatch call
+extern DWORD RasSimRunStatsBenchmark(UINT deviceCount, UINT iterations, RasSimLatency* single, RasSimLatency* batched);
+
+typedef struct _RasSimReconnectScenario
+{
+	// Connection drops to recover from
+	UINT Drops;
+	// Dials to the primary server that fail after each drop. BreakerThreshold of them moves the reconnector on
+	// to the backup server.
+	UINT FailuresPerDrop;
+	// Every dial fails for this long after each drop, as if the network went with the connection. 0 for none.
+	DWORD OfflineMs;
+	// Reports the network coming back with ReconnectNotifyNetworkChange, otherwise only the backoff finds out
+	BOOL NotifyNetworkChange;
+	DWORD DialLatencyMs;
+	// Handed to the reconnector, zero fields take its defaults
+	DWORD BaseDelayMs;
+	DWORD MaxDelayMs;
+	UINT BreakerThreshold;
+	DWORD BreakerCooldownMs;
+	UINT64 Seed;
+} RasSimReconnectScenario;
+
+typedef struct _RasSimReconnectReport
+{
+	// Drop to connected again
+	RasSimLatency Outage;
+	// Network back to connected again, only with OfflineMs
+	RasSimLatency Recovery;
+	UINT64 Dials;
+	UINT64 BreakerTrips;
+	// Reconnects that came back on the backup server
+	UINT Failovers;
+} RasSimReconnectReport;
+
+// Keeps a simulated connection up with the reconnector (see Reconnect.h) and drops it scenario->Drops times,
+// failing dials as the scenario scripts, to measure how long it takes to come back
+extern DWORD RasSimRunReconnectBenchmark(const RasSimReconnectScenario* scenario, RasSimReconnectReport* report);
@@ -4,92 +4,207 @@
 #include <RasError.h>
 #include <stddef.h>
 #include <strsafe.h>
+#include <wctype.h>
 #include <iostream>
 #include "Raslib.h"
-#pragma comment(lib, "Rasapi32.lib")
+#include "RasApi.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "FlightRecorder.h"
+#include "Executor.h"
 
 #define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
 
 
 
-PLogCallback _logCallback = NULL;
+DWORD SetLogCallback(PLogCallback logCallback)
+{
+	DWORD rc = NativeLogSetCallback(logCallback);
+	if (rc == ERROR_SUCCESS)
+	{
+		NATIVELOG_INFO("raslib log callback added");
+	}
+	return rc;
+}
 
-void OutputTraceString(const char* lpszFormatString, ...)
+// Serialises phonebook writes, CreateVpnDevice can run from a connect, a race slot and pre-provisioning at once
+static SRWLOCK PhonebookLock = SRWLOCK_INIT;
+
+// The IKEv2 miniport does not change while we run so it is only looked up once
+static SRWLOCK DeviceCacheLock = SRWLOCK_INIT;
+static WCHAR Ikev2DeviceName[RAS_MaxDeviceName + 1];
+static volatile LONG DeviceCacheEnabled = TRUE;
+
+static BOOL GetCachedIkev2Device(LPWSTR deviceName, DWORD deviceNameLength)
 {
-	va_list argptr;
-	va_start(argptr, lpszFormatString);
-	if (_logCallback != NULL)
-	{
-		size_t sLen = vsnprintf(NULL, 0, lpszFormatString, argptr);
-		char* logEntry = (char*)malloc((sLen + 1));
-		vsnprintf(logEntry, sLen, lpszFormatString, argptr);
-		_logCallback(const_cast<char*>(logEntry));
-		free(logEntry);
-	}
-#ifndef _DEBUG
-	va_end(argptr);
-	return;
-#endif
-	printf(lpszFormatString, argptr);
-	va_end(argptr);
+	AcquireSRWLockShared(&DeviceCacheLock);
+	BOOL cached = DeviceCacheEnabled && Ikev2DeviceName[0] != L'\0';
+	if (cached)
+	{
+		StringCchCopy(deviceName, deviceNameLength, Ikev2DeviceName);
+	}
+	ReleaseSRWLockShared(&DeviceCacheLock);
+
+	return cached;
 }
 
-DWORD SetLogCallback(PLogCallback logCallback)
+// Finds the IKEv2 vpn device, leaves deviceName empty if there isn't one
+static DWORD FindIkev2Device(const RASLIB_API* ras, LPWSTR deviceName, DWORD deviceNameLength)
 {
-	_logCallback = logCallback;
-	_logCallback("raslib log callback added");
-	return ERROR_SUCCESS;
+	DWORD rc;
+	DWORD dwSize = 0;
+	DWORD dwNumEntries = 0;
+	LPRASDEVINFO lpRasDevInfo = NULL;
+
+	deviceName[0] = L'\0';
+
+	if (GetCachedIkev2Device(deviceName, deviceNameLength))
+	{
+		return ERROR_SUCCESS;
+	}
+
+	// Call the method to get the size of memory needed to actually call it
+	ras->EnumDevices(NULL, &dwSize, &dwNumEntries);
+	lpRasDevInfo = (LPRASDEVINFO)RaslibAlloc(dwSize);
+
+	if (lpRasDevInfo == NULL)
+	{
+		NATIVELOG_ERROR("HeapAlloc failed in FindIkev2Device (GetLastError = 0x%.8X)\n", GetLastError());
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	lpRasDevInfo->dwSize = sizeof(RASDEVINFO);
+
+	// Get all available device types as an enum
+	rc = ras->EnumDevices(lpRasDevInfo, &dwSize, &dwNumEntries);
+
+	if (rc != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("RasEnumDevices failed in FindIkev2Device: 0x%.8X\n", rc);
+	}
+	else
+	{
+		// Iterate in a separate variable so we can clear the memory correctly
+		auto item = lpRasDevInfo;
+		for (UINT i = 0; i < dwNumEntries; i++, item++)
+		{
+			// If it's an IKEv2 vpn device type, use it for the new entry
+			if (lstrcmpi(item->szDeviceType, RASDT_Vpn) == 0 && wcsstr(item->szDeviceName, L"IKEv2") != 0)
+			{
+				StringCchCopy(deviceName, deviceNameLength, item->szDeviceName);
+				break;
+			}
+		}
+
+		if (deviceName[0] != L'\0')
+		{
+			AcquireSRWLockExclusive(&DeviceCacheLock);
+			StringCchCopy(Ikev2DeviceName, CELEMS(Ikev2DeviceName), deviceName);
+			ReleaseSRWLockExclusive(&DeviceCacheLock);
+		}
+	}
+
+	RaslibFree(lpRasDevInfo);
+
+	return rc;
+}
+
+// TRUE when the phonebook already holds deviceName exactly as CreateVpnDevice would write it
+static BOOL VpnDeviceUpToDate(const RASLIB_API* ras, LPCWSTR deviceName, LPCWSTR connectionHostname, LPCWSTR ikev2DeviceName)
+{
+	DWORD dwSize = sizeof(RASENTRY);
+	BOOL upToDate = FALSE;
+
+	RASENTRY* RasEntry = (RASENTRY*)RaslibAlloc(sizeof(RASENTRY));
+	if (RasEntry == NULL)
+	{
+		return FALSE;
+	}
+
+	RasEntry->dwSize = sizeof(RASENTRY);
+
+	// Fails with ERROR_CANNOT_FIND_PHONEBOOK_ENTRY the first time a device is used
+	if (ras->GetEntryProperties(NULL, deviceName, RasEntry, &dwSize, NULL, NULL) == ERROR_SUCCESS)
+	{
+		upToDate = lstrcmpiW(RasEntry->szLocalPhoneNumber, connectionHostname) == 0
+			&& lstrcmpiW(RasEntry->szDeviceType, RASDT_Vpn) == 0
+			&& lstrcmpiW(RasEntry->szDeviceName, ikev2DeviceName) == 0
+			&& RasEntry->dwVpnStrategy == VS_Ikev2Only;
+	}
+
+	RaslibFree(RasEntry);
+
+	return upToDate;
 }
 
 DWORD CreateVpnDevice(LPCWSTR deviceName, LPCWSTR connectionHostname)
 {
+	const RASLIB_API* ras = RaslibGetApi();
+	WCHAR ikev2DeviceName[RAS_MaxDeviceName + 1];
+	TraceScope trace;
+
+	TraceRequestBegin(TraceOpCreateDevice, &trace);
+
+	// Repeat dials to the same server only need to read the entry back
+	if (GetCachedIkev2Device(ikev2DeviceName, CELEMS(ikev2DeviceName)) &&
+		VpnDeviceUpToDate(ras, deviceName, connectionHostname, ikev2DeviceName))
+	{
+		NATIVELOG_DEBUG("create vpn device skipped, phonebook entry up to date\n");
+		TraceRequestEnd(&trace, ERROR_SUCCESS);
+		return ERROR_SUCCESS;
+	}
+
 	DWORD rc;
-	DWORD dwSize;
+	DWORD dwSize = 0;
 	DWORD result = ERROR_SUCCESS;
-	DWORD dwNumEntries;
-	LPRASDEVINFO lpRasDevInfo = NULL;
-	RASENTRY* RasEntry = (RASENTRY*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(RASENTRY));
+	RASENTRY* RasEntry = (RASENTRY*)RaslibAlloc(sizeof(RASENTRY));
+
+	if (RasEntry == NULL)
+	{
+		TraceRequestEnd(&trace, ERROR_NOT_ENOUGH_MEMORY);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	AcquireSRWLockExclusive(&PhonebookLock);
 
 	// Call the method to get the size of memory needed to actually call it
-	rc = RasGetEntryProperties(NULL, L"", NULL, &dwSize, NULL, NULL);
+	rc = ras->GetEntryProperties(NULL, L"", NULL, &dwSize, NULL, NULL);
 
 	// Expected error return code because we passed a null pointer
 	if (rc == ERROR_BUFFER_TOO_SMALL)
 	{
-		// Resize to actual size needed to hold the information
-		RasEntry = (RASENTRY*)HeapReAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, RasEntry, dwSize);
-		// Set the size so the api knows how much memory / which version to use
-		RasEntry->dwSize = dwSize;
+		// Reallocate at the actual size needed to hold the information, through RaslibAlloc so it's counted
+		RaslibFree(RasEntry);
+		RasEntry = (RASENTRY*)RaslibAlloc(dwSize);
+
+		if (RasEntry == NULL)
+		{
+			rc = ERROR_NOT_ENOUGH_MEMORY;
+		}
+		else
+		{
+			// Set the size so the api knows how much memory / which version to use
+			RasEntry->dwSize = dwSize;
 
-		// Actually get the entry and hydrate RasEntry, if it doesn't exist populate it with default values
-		rc = RasGetEntryProperties(NULL, L"", RasEntry, &dwSize, NULL, NULL);
+			// Actually get the entry and hydrate RasEntry, if it doesn't exist populate it with default values
+			rc = ras->GetEntryProperties(NULL, L"", RasEntry, &dwSize, NULL, NULL);
+		}
 	}
 
 
 	if (rc != ERROR_SUCCESS)
 	{
-		OutputTraceString("RasGetEntryProperties returned error: 0x%.8X\n", rc);
+		NATIVELOG_ERROR("RasGetEntryProperties returned error: 0x%.8X\n", rc);
 		result = rc;
 	}
 
 	if (result == ERROR_SUCCESS)
 	{
 		// Validate the format of the connection entry name.
-		rc = RasValidateEntryName(NULL, deviceName);
+		rc = ras->ValidateEntryName(NULL, deviceName);
 		if (rc == ERROR_INVALID_NAME)
 		{
-			OutputTraceString("RasValidateEntryName returned invalid name in CreateVpnDevice: 0x%.8X\n", rc);
-			result = rc;
-		}
-	}
-
-	if (rc == ERROR_SUCCESS || rc == ERROR_ALREADY_EXISTS)
-	{
-		// Get the default properties for the entry
-		rc = RasGetEntryProperties(NULL, L"", RasEntry, &dwSize, NULL, NULL);
-		if (rc != ERROR_SUCCESS)
-		{
-			OutputTraceString("RasGetEntryProperties failed in CreateVpnDevice: 0x%.8X\n", rc);
+			NATIVELOG_ERROR("RasValidateEntryName returned invalid name in CreateVpnDevice: 0x%.8X\n", rc);
 			result = rc;
 		}
 	}
@@ -103,118 +218,164 @@ DWORD CreateVpnDevice(LPCWSTR deviceName, LPCWSTR connectionHostname)
 		//set strategy to ikev only
 		RasEntry->dwVpnStrategy = VS_Ikev2Only;
 
-		dwSize = 0;
+		result = FindIkev2Device(ras, ikev2DeviceName, CELEMS(ikev2DeviceName));
+	}
 
-		// Call the method to get the size of memory needed to actually call it
-		RasEnumDevices(NULL, &dwSize, &dwNumEntries);
-		lpRasDevInfo = (LPRASDEVINFO)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSize);
+	if (result == ERROR_SUCCESS)
+	{
+		StringCchCopy(RasEntry->szDeviceName, CELEMS(RasEntry->szDeviceName), ikev2DeviceName);
 
-		if (lpRasDevInfo == NULL)
+		// Write the phonebook entry.
+		rc = ras->SetEntryProperties(NULL, deviceName, RasEntry, sizeof(RASENTRY), NULL, 0);
+		if (rc != ERROR_SUCCESS)
 		{
-			OutputTraceString("HeapAlloc failed in CreateVpnDevice (GetLastError = 0x%.8X)\n", GetLastError());
+			NATIVELOG_ERROR("RasSetEntryProperties failed in CreateVpnDevice: 0x%.8X\n", rc);
 			result = rc;
 		}
 	}
 
-	if (result == ERROR_SUCCESS)
+	ReleaseSRWLockExclusive(&PhonebookLock);
+
+	if (RasEntry)
 	{
-		lpRasDevInfo->dwSize = sizeof(RASDEVINFO);
+		RaslibFree(RasEntry);
+	}
 
-		// Get all available device types as an enum
-		rc = RasEnumDevices(lpRasDevInfo, &dwSize, &dwNumEntries);
+	NATIVELOG_INFO("create vpn device result: 0x%.8X\n", result);
+	TraceRequestEnd(&trace, result);
 
-		if (rc != ERROR_SUCCESS)
-		{
-			OutputTraceString("RasEnumDevices failed in CreateVpnDevice: 0x%.8X", rc);
-			result = rc;
-		}
+	return result;
+}
+
+DWORD SetVpnDeviceCacheEnabled(BOOL enabled)
+{
+	AcquireSRWLockExclusive(&DeviceCacheLock);
+	InterlockedExchange(&DeviceCacheEnabled, enabled ? TRUE : FALSE);
+	Ikev2DeviceName[0] = L'\0';
+	ReleaseSRWLockExclusive(&DeviceCacheLock);
+
+	return ERROR_SUCCESS;
+}
+
+void GetVpnDeviceSlotName(LPCWSTR deviceName, UINT slot, LPWSTR entryName, DWORD entryNameLength)
+{
+	if (slot == 0)
+	{
+		StringCchCopy(entryName, entryNameLength, deviceName);
+	}
+	else
+	{
+		StringCchPrintf(entryName, entryNameLength, L"%s #%u", deviceName, slot + 1);
 	}
+}
 
-	if (result == ERROR_SUCCESS)
+typedef struct _PrepareJob
+{
+	UINT HostnameCount;
+	WCHAR DeviceName[RAS_MaxEntryName + 1];
+	WCHAR Hostnames[1][RAS_MaxPhoneNumber + 1];
+} PrepareJob;
+
+static void CALLBACK PrepareVpnDevicesWorker(PVOID context)
+{
+	PrepareJob* job = (PrepareJob*)context;
+	WCHAR entryName[RAS_MaxEntryName + 1];
+
+	for (UINT i = 0; i < job->HostnameCount; i++)
 	{
-		// Iterate in a separate variable so we can clear the memory correctly
-		auto item = lpRasDevInfo;
-		for (UINT i = 1; i < dwNumEntries; i++, item++)
-		{
-			// If it's an IKEv2 vpn device type, use it for the new entry
-			if (lstrcmpi(item->szDeviceType, RASDT_Vpn) == 0 && wcsstr(item->szDeviceName, L"IKEv2") != 0)
-			{
-				StringCchCopy(RasEntry->szDeviceName, CELEMS(RasEntry->szDeviceName), item->szDeviceName);
-				break;
-			}
-		}
+		GetVpnDeviceSlotName(job->DeviceName, i, entryName, CELEMS(entryName));
+		CreateVpnDevice(entryName, job->Hostnames[i]);
+	}
 
-		// Write the phonebook entry.
-		rc = RasSetEntryProperties(NULL, deviceName, RasEntry, sizeof(RASENTRY), NULL, 0);
-		if (rc != ERROR_SUCCESS)
-		{
-			OutputTraceString("RasSetEntryProperties failed in CreateVpnDevice: 0x%.8X\n", rc);
-			result = rc;
-		}
+	NATIVELOG_INFO("prepared %u vpn device entries\n", job->HostnameCount);
+
+	RaslibFree(job);
+}
+
+DWORD PrepareVpnDevices(LPCWSTR deviceName, LPCWSTR* hostnames, UINT hostnameCount)
+{
+	if (deviceName == NULL || hostnames == NULL || hostnameCount == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
 	}
 
-	if (lpRasDevInfo)
+	SIZE_T jobSize = offsetof(PrepareJob, Hostnames) + hostnameCount * sizeof(((PrepareJob*)NULL)->Hostnames[0]);
+	PrepareJob* job = (PrepareJob*)RaslibAlloc(jobSize);
+	if (job == NULL)
 	{
-		HeapFree(GetProcessHeap(), 0, lpRasDevInfo);
+		return ERROR_NOT_ENOUGH_MEMORY;
 	}
-	
-	if (RasEntry)
+
+	job->HostnameCount = hostnameCount;
+	StringCchCopy(job->DeviceName, CELEMS(job->DeviceName), deviceName);
+
+	for (UINT i = 0; i < hostnameCount; i++)
 	{
-		HeapFree(GetProcessHeap(), 0, RasEntry);
+		StringCchCopy(job->Hostnames[i], CELEMS(job->Hostnames[i]), hostnames[i]);
 	}
 
-	OutputTraceString("create vpn device result: 0x%.8X\n", result);
+	DWORD result = ExecutorSubmit(PrepareVpnDevicesWorker, job, NULL);
+	if (result != ERROR_SUCCESS)
+	{
+		RaslibFree(job);
+		return result;
+	}
 
-	return result;
+	return ERROR_SUCCESS;
 }
 
-BOOL AbortDial = false;
+// Callbacks of the single dial driven through the legacy ConnectVpnDevice / AbortDialAttempt API
+static volatile LONG LegacySession = 0;
+static volatile LONG LegacyAbortPending = FALSE;
 DialDelegateFuncType DialCompleteFunc = NULL;
 DialDelegateFuncType DialAbortFunc = NULL;
 DialErrorFuncType DialErrorFunc = NULL;
 
-DWORD AbortDialAttempt()
+static void _cdecl LegacyDialComplete(HDIALSESSION session, LPVOID context)
 {
-	AbortDial = true;
-
-	return 0;
+	if (DialCompleteFunc != NULL)
+	{
+		DialCompleteFunc();
+	}
 }
 
-DWORD ResetAbortDial()
+static void _cdecl LegacyDialError(HDIALSESSION session, DWORD error, LPVOID context)
 {
-	AbortDial = false;
-
-	return 0;
+	if (DialErrorFunc != NULL)
+	{
+		DialErrorFunc(error);
+	}
 }
 
-void WINAPI RasDialFunc1(HRASCONN RasConn, UINT msg, RASCONNSTATE rasconnstate, DWORD error, DWORD extendedError)
+static void _cdecl LegacyDialAbort(HDIALSESSION session, LPVOID context)
 {
-	if (AbortDial)
-	{
-		RasHangUp(RasConn);
-		AbortDial = false;
-		if (DialAbortFunc != NULL)
-		{
-			DialAbortFunc();
-		}
-	}
+	InterlockedExchange(&LegacyAbortPending, FALSE);
 
-	if (error != ERROR_SUCCESS)
+	if (DialAbortFunc != NULL)
 	{
-		RasHangUp(RasConn);
-		if (DialErrorFunc != NULL)
-		{
-			DialErrorFunc(error);
-		}
+		DialAbortFunc();
 	}
-	
-	if (rasconnstate == RASCS_Connected)
+}
+
+DWORD AbortDialAttempt()
+{
+	// Also latched for a dial that has not started yet, as before sessions existed
+	InterlockedExchange(&LegacyAbortPending, TRUE);
+
+	HDIALSESSION session = (HDIALSESSION)LegacySession;
+	if (session != 0)
 	{
-		if (DialCompleteFunc != NULL)
-		{
-			DialCompleteFunc();
-		}
+		DialSessionAbort(session);
 	}
+
+	return 0;
+}
+
+DWORD ResetAbortDial()
+{
+	InterlockedExchange(&LegacyAbortPending, FALSE);
+
+	return 0;
 }
 
 DWORD ConnectVpnDevice(
@@ -227,89 +388,130 @@ DWORD ConnectVpnDevice(
 	DialDelegateFuncType abortCallback
 )
 {
-	// Create / update a device to use and dial
-	auto deviceCreated = CreateVpnDevice(deviceName, connectionHostname);
-	if (deviceCreated != ERROR_SUCCESS)
+	DialSessionCallbacks callbacks = { LegacyDialComplete, LegacyDialError, LegacyDialAbort, NULL };
+	HDIALSESSION session = 0;
+
+	auto result = DialSessionCreate(&callbacks, &session);
+	if (result != ERROR_SUCCESS)
 	{
-		return deviceCreated;
+		return result;
 	}
 
 	DialCompleteFunc = completeCallback;
 	DialErrorFunc = errorCallback;
 	DialAbortFunc = abortCallback;
 
-	auto result = ERROR_SUCCESS;
+	// Only one legacy dial is tracked, a previous one still dialing is hung up
+	HDIALSESSION previous = (HDIALSESSION)InterlockedExchange(&LegacySession, (LONG)session);
+	if (previous != 0)
+	{
+		DialSessionClose(previous);
+	}
 
-	RASDIALPARAMS* DialParams = (RASDIALPARAMS*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(RASDIALPARAMS));
-	HRASCONN RasConn = NULL;
-	BOOL PasswordReturned = false;
+	result = DialSessionDial(session, deviceName, connectionHostname, username, password);
 
-	// Set the size so the api knows how much memory / which version to use
-	DialParams->dwSize = sizeof(RASDIALPARAMS);
+	if (result == ERROR_SUCCESS && LegacyAbortPending)
+	{
+		DialSessionAbort(session);
+	}
 
-	// Set the entry name to be used to our new device
-	StringCchCopy(DialParams->szEntryName, CELEMS(DialParams->szEntryName), deviceName);
+	return result;
+}
+
+#define DISCONNECT_HANGUPS 50
+#define DISCONNECT_HANGUP_MS 100
 
-	// Get the default dial params for our device
-	result = RasGetEntryDialParams(NULL, DialParams, &PasswordReturned);
+// Hang ups repeated by HangUpUntilRefused on executor timers
+typedef struct _DisconnectWatch
+{
+	HRASCONN RasConn;
+	UINT Attempts;
+	DWORD Result;
+	HANDLE Done;
+} DisconnectWatch;
+
+static void CALLBACK DisconnectHangUp(PVOID context)
+{
+	DisconnectWatch* watch = (DisconnectWatch*)context;
 
-#if (WINVER >= 0x601)
-	if (result == ERROR_INVALID_SIZE)
+	watch->Attempts++;
+	watch->Result = RaslibGetApi()->HangUp(watch->RasConn);
+
+	if (watch->Result == ERROR_SUCCESS && watch->Attempts < DISCONNECT_HANGUPS
+		&& ExecutorSchedule(DISCONNECT_HANGUP_MS, 0, DisconnectHangUp, watch, NULL) == ERROR_SUCCESS)
 	{
-		DialParams->dwSize = offsetof(RASDIALPARAMSW, dwIfIndex);
-		result = RasGetEntryDialParams(NULL, DialParams, &PasswordReturned);
+		return;
 	}
-#endif // (WINVER >= 0x601)
 
-	if (result == ERROR_SUCCESS)
-	{
-		// Copy the credentials to the dial params
-		StringCchCopy(DialParams->szUserName, CELEMS(DialParams->szUserName), username);
-		StringCchCopy(DialParams->szPassword, CELEMS(DialParams->szPassword), password);
+	// Last, the caller's stack holds the watch
+	SetEvent(watch->Done);
+}
 
-		// Dial the connection using our vpn device
-		result = RasDial(NULL, NULL, DialParams, 1, RasDialFunc1, &RasConn);
-		if (result != ERROR_SUCCESS)
+// Each dial on an active connection requires an additional hang up, so keep hanging up until RAS refuses one or
+// we give up. The retries run on executor timers while the caller waits rather than sleeping between them.
+// Returns ERROR_SUCCESS when RAS never refused.
+static DWORD HangUpUntilRefused(HRASCONN rasConn, UINT* attempts)
+{
+	DisconnectWatch watch;
+
+	watch.RasConn = rasConn;
+	watch.Attempts = 0;
+	watch.Result = RaslibGetApi()->HangUp(rasConn);
+	watch.Done = watch.Result == ERROR_SUCCESS ? CreateEvent(NULL, FALSE, FALSE, NULL) : NULL;
+
+	if (watch.Done != NULL)
+	{
+		if (ExecutorSubmit(DisconnectHangUp, &watch, NULL) != ERROR_SUCCESS)
 		{
-			RasHangUp(RasConn);
-			OutputTraceString("RasDial failed in ConnectVpnDevice: 0x%.8X\n", result);
+			DisconnectHangUp(&watch);
 		}
-	}
-	else
-	{
-		OutputTraceString("RasGetEntryDialParams failed in ConnectVpnDevice: 0x%.8X\n", result);
+
+		WaitForSingleObject(watch.Done, INFINITE);
+		CloseHandle(watch.Done);
 	}
 
-	HeapFree(GetProcessHeap(), 0, DialParams);
+	*attempts = watch.Attempts;
 
-	return result;
+	return watch.Result;
 }
 
 DWORD DisconnectVpnDevice(LPCWSTR deviceName)
 {
+	const RASLIB_API* ras = RaslibGetApi();
 	DWORD dwSize = 0;
 	DWORD rc = ERROR_SUCCESS;
 	DWORD result = ERROR_SUCCESS;
 	DWORD dwConnections = 0;
 	LPRASCONN lpRasConn = NULL;
+	TraceScope trace;
+
+	TraceRequestBegin(TraceOpDisconnect, &trace);
+
+	// The legacy dial's session goes with its connection, otherwise its slot stays taken until the next connect
+	HDIALSESSION legacy = (HDIALSESSION)InterlockedExchange(&LegacySession, 0);
+	if (legacy != 0)
+	{
+		DialSessionClose(legacy);
+	}
 
 	// Call the method to get the size of memory needed to actually call it
-	rc = RasEnumConnections(lpRasConn, &dwSize, &dwConnections);
+	rc = ras->EnumConnections(lpRasConn, &dwSize, &dwConnections);
 
 	if (rc == ERROR_BUFFER_TOO_SMALL) 
 	{
 		// Allocate the memory needed for the array of RAS structure(s)
-		lpRasConn = (LPRASCONN)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSize);
+		lpRasConn = (LPRASCONN)RaslibAlloc(dwSize);
 		if (lpRasConn == NULL) 
 		{
-			OutputTraceString("HeapAlloc failed!\n");
+			NATIVELOG_ERROR("HeapAlloc failed!\n");
+			TraceRequestEnd(&trace, ERROR_NOT_ENOUGH_MEMORY);
 			return 0;
 		}
 		// Set the size so the api knows how much memory / which version to use
 		lpRasConn[0].dwSize = sizeof(RASCONN);
 
 		// Call RasEnumConnections to enumerate active connections
-		rc = RasEnumConnections(lpRasConn, &dwSize, &dwConnections);
+		rc = ras->EnumConnections(lpRasConn, &dwSize, &dwConnections);
 
 		if (rc == ERROR_SUCCESS)
 		{
@@ -320,21 +522,16 @@ DWORD DisconnectVpnDevice(LPCWSTR deviceName)
 				// Only hang up our own device
 				if (lstrcmpi(item->szEntryName, deviceName) == 0)
 				{
-					// Try hanging up one time, each dial on an active connection requires an additional hangup
-					rc = RasHangUp(item->hrasconn);
+					INT64 started = MetricsTimerStart();
+					UINT attempts = 0;
+					rc = HangUpUntilRefused(item->hrasconn, &attempts);
 
-					// If we hung up correctly verify this by hanging up again expecting a non-zero response
-					// Keep hanging up till we get a non-zero code or we give up
-					auto attempts = 0;
-					while (rc == 0 && attempts++ < 50)
-					{
-						rc = RasHangUp(item->hrasconn);
-						Sleep(100);
-					}
+					MetricsObserveSince(MetricHangUpSeconds, started);
+					FlightRecord(FlightHangUp, rc != 0 ? ERROR_SUCCESS : ERROR_HANGUP_FAILED, attempts);
 
 					if (rc == 0)
 					{
-						OutputTraceString("RasHangUp failed in DisconnectVpnDevice: 0x%.8X\n", rc);
+						NATIVELOG_ERROR("RasHangUp failed in DisconnectVpnDevice: 0x%.8X\n", rc);
 						result = ERROR_HANGUP_FAILED;
 					}
 				}
@@ -346,7 +543,7 @@ DWORD DisconnectVpnDevice(LPCWSTR deviceName)
 		}
 
 		// Deallocate memory for the connection buffer
-		HeapFree(GetProcessHeap(), 0, lpRasConn);
+		RaslibFree(lpRasConn);
 		lpRasConn = NULL;
 	}
 	else
@@ -354,94 +551,212 @@ DWORD DisconnectVpnDevice(LPCWSTR deviceName)
 		result = rc;
 	}
 
+	TraceRequestEnd(&trace, result);
+
 	return result;
 }
 
-DWORD GetVpnDeviceStatistics(LPCWSTR deviceName, VpnDeviceStats* returnStats)
+// Open addressing table over the requested entry names, sized to stay at most half full
+#define STATS_TABLE_SIZE (RASLIB_MAX_STATS_BATCH * 2)
+#define STATS_TABLE_EMPTY 0xFFFF
+
+// Connections most machines have, enumerated without a heap allocation
+#define STATS_STACK_CONNECTIONS 4
+
+static_assert((STATS_TABLE_SIZE & (STATS_TABLE_SIZE - 1)) == 0, "STATS_TABLE_SIZE must be a power of two");
+
+// FNV-1a of the lower cased name, entry names compare case insensitively
+static UINT HashEntryName(LPCWSTR name)
 {
-	DWORD dwSize = 0;
-	DWORD rc = ERROR_SUCCESS;
-	DWORD result = ERROR_SUCCESS;
-	DWORD dwConnections = 0;
-	LPRASCONN lpRasConn = NULL;
+	UINT hash = 2166136261U;
 
-	returnStats->Status = 0;
-	returnStats->BytesTransmitted = 0;
-	returnStats->BytesReceived = 0;
-	returnStats->Bps = 0;
-	returnStats->ConnectDuration = 0;
-	returnStats->Hostname = NULL;
+	for (LPCWSTR c = name; *c != L'\0'; c++)
+	{
+		hash ^= (UINT)towlower(*c);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
 
-	RAS_STATS* stats = (RAS_STATS*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(RAS_STATS));
-	stats->dwSize = sizeof(RAS_STATS);
+static UINT FindStatsEntry(const USHORT* table, LPCWSTR* deviceNames, LPCWSTR entryName)
+{
+	for (UINT slot = HashEntryName(entryName) & (STATS_TABLE_SIZE - 1); table[slot] != STATS_TABLE_EMPTY; slot = (slot + 1) & (STATS_TABLE_SIZE - 1))
+	{
+		if (lstrcmpi(deviceNames[table[slot]], entryName) == 0)
+		{
+			return table[slot];
+		}
+	}
+
+	return STATS_TABLE_EMPTY;
+}
+
+static void QueryConnectionStatistics(const RASLIB_API* ras, HRASCONN rasConn, VpnDeviceStats* returnStats, LPWSTR hostname, DWORD hostnameLength, DWORD* result)
+{
+	RASCONNSTATUS status;
+	RAS_STATS stats;
 
-	RASCONNSTATUS* status = (RASCONNSTATUS*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(RASCONNSTATUS));
+	memset(&status, 0, sizeof(status));
+	memset(&stats, 0, sizeof(stats));
 	// Set the size so the api knows how much memory / which version to use
-	status->dwSize = sizeof(RASCONNSTATUS);
+	status.dwSize = sizeof(RASCONNSTATUS);
+	stats.dwSize = sizeof(RAS_STATS);
 
-	// Call the method to get the size of memory needed to actually call it
-	rc = RasEnumConnections(lpRasConn, &dwSize, &dwConnections);
+	// Get the connection status using the HRASCONN device connection
+	DWORD rc = ras->GetConnectStatus(rasConn, &status);
+	if (rc != 0)
+	{
+		NATIVELOG_ERROR("RasGetConnectStatus failed in GetVpnDeviceStatisticsBatch: 0x%.8X\n", rc);
+		FlightRecord(FlightStatsAnomaly, rc, 0);
+		*result = rc;
+		return;
+	}
 
-	if (rc == ERROR_BUFFER_TOO_SMALL) 
+	// If we get the status the connection is valid so get the stats
+	if (status.rasconnstate == RASCS_Connected)
 	{
-		// Allocate the memory needed for the array of RAS structure(s)
-		lpRasConn = (LPRASCONN)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSize);
-		if (lpRasConn == NULL) {
-			OutputTraceString("HeapAlloc failed!\n");
-			return 1;
+		returnStats->Status = 1;
+	}
+
+	if (hostname != NULL)
+	{
+		StringCchCopy(hostname, hostnameLength, status.szPhoneNumber);
+		returnStats->Hostname = hostname;
+	}
+
+	// Get the connection statistics using the HRASCONN device connection
+	rc = ras->GetConnectionStatistics(rasConn, &stats);
+	if (rc != 0)
+	{
+		NATIVELOG_ERROR("RasGetConnectionStatistics failed in GetVpnDeviceStatisticsBatch: 0x%.8X\n", rc);
+		FlightRecord(FlightStatsAnomaly, rc, 1);
+		*result = rc;
+		return;
+	}
+
+	returnStats->BytesTransmitted = stats.dwBytesXmited;
+	returnStats->BytesReceived = stats.dwBytesRcved;
+	returnStats->Bps = stats.dwBps;
+	returnStats->ConnectDuration = stats.dwConnectDuration;
+}
+
+DWORD GetVpnDeviceStatisticsBatch(
+	LPCWSTR* deviceNames,
+	UINT deviceCount,
+	VpnDeviceStats* returnStats,
+	DWORD* results,
+	LPWSTR hostnames,
+	DWORD hostnameLength
+)
+{
+	const RASLIB_API* ras = RaslibGetApi();
+	USHORT table[STATS_TABLE_SIZE];
+	RASCONN stackConns[STATS_STACK_CONNECTIONS];
+	LPRASCONN lpRasConn = stackConns;
+	DWORD dwSize = sizeof(stackConns);
+	DWORD dwConnections = 0;
+	DWORD rc;
+
+	if (deviceNames == NULL || returnStats == NULL || results == NULL || deviceCount == 0 || deviceCount > RASLIB_MAX_STATS_BATCH)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	INT64 started = MetricsTimerStart();
+	TraceScope trace;
+
+	TraceRequestBegin(TraceOpStatsPoll, &trace);
+
+	memset(table, 0xFF, sizeof(table));
+
+	for (UINT i = 0; i < deviceCount; i++)
+	{
+		memset(&returnStats[i], 0, sizeof(VpnDeviceStats));
+		results[i] = ERROR_SUCCESS;
+
+		// A name asked for twice keeps its first slot, the duplicates are filled in afterwards
+		if (FindStatsEntry(table, deviceNames, deviceNames[i]) == STATS_TABLE_EMPTY)
+		{
+			UINT slot = HashEntryName(deviceNames[i]) & (STATS_TABLE_SIZE - 1);
+			while (table[slot] != STATS_TABLE_EMPTY)
+			{
+				slot = (slot + 1) & (STATS_TABLE_SIZE - 1);
+			}
+			table[slot] = (USHORT)i;
 		}
-		// Set the size so the api knows how much memory / which version to use
-		lpRasConn[0].dwSize = sizeof(RASCONN);
+	}
 
-		// Call RasEnumConnections to enumerate active connections, might not return any if disconnected
-		rc = RasEnumConnections(lpRasConn, &dwSize, &dwConnections);
+	// One enumeration for the whole batch, retried if connections come up between the size query and the call
+	memset(stackConns, 0, sizeof(stackConns));
+	lpRasConn[0].dwSize = sizeof(RASCONN);
+	rc = ras->EnumConnections(lpRasConn, &dwSize, &dwConnections);
 
-		// Iterate in a separate variable so we can clear the memory correctly
+	for (UINT attempt = 0; rc == ERROR_BUFFER_TOO_SMALL && attempt < 3; attempt++)
+	{
+		if (lpRasConn != stackConns)
+		{
+			RaslibFree(lpRasConn);
+		}
+
+		lpRasConn = (LPRASCONN)RaslibAlloc(dwSize);
+		if (lpRasConn == NULL)
+		{
+			NATIVELOG_ERROR("HeapAlloc failed!\n");
+			TraceRequestEnd(&trace, ERROR_NOT_ENOUGH_MEMORY);
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+
+		lpRasConn[0].dwSize = sizeof(RASCONN);
+		rc = ras->EnumConnections(lpRasConn, &dwSize, &dwConnections);
+	}
+
+	if (rc == ERROR_SUCCESS)
+	{
 		auto item = lpRasConn;
 		for (UINT i = 0; i < dwConnections; i++, item++)
 		{
-			// Only check our own device
-			if (lstrcmpi(item->szEntryName, deviceName) == 0)
+			UINT index = FindStatsEntry(table, deviceNames, item->szEntryName);
+			if (index != STATS_TABLE_EMPTY)
 			{
-				// Get the connection status using the HRASCONN device connection
-				rc = RasGetConnectStatus(item->hrasconn, status);
-				if (rc != 0)
-				{
-					OutputTraceString("RasGetConnectStatus failed in VpnDeviceStats* GetVpnDeviceStatistics: 0x%.8X\n", rc);
-					result = rc;
-				}
-				// If we get the status the connection is valid so get the stats
-				if (rc == 0)
-				{
-					if (status->rasconnstate == RASCS_Connected)
-					{
-						returnStats->Status = 1;
-					}
-
-					returnStats->Hostname = status->szPhoneNumber;
+				LPWSTR hostname = hostnames != NULL ? hostnames + (SIZE_T)index * hostnameLength : NULL;
+				QueryConnectionStatistics(ras, item->hrasconn, &returnStats[index], hostname, hostnameLength, &results[index]);
+			}
+		}
 
-					// Get the connection statistics using the HRASCONN device connection
-					rc = RasGetConnectionStatistics(item->hrasconn, stats);
-					if (rc != 0)
-					{
-						OutputTraceString("RasGetConnectionStatistics failed in VpnDeviceStats* GetVpnDeviceStatistics: 0x%.8X\n", rc);
-						result = rc;
-					}
-					else
-					{
-						returnStats->BytesTransmitted = stats->dwBytesXmited;
-						returnStats->BytesReceived = stats->dwBytesRcved;
-						returnStats->Bps = stats->dwBps;
-						returnStats->ConnectDuration = stats->dwConnectDuration;
-					}
-				}
+		for (UINT i = 0; i < deviceCount; i++)
+		{
+			UINT index = FindStatsEntry(table, deviceNames, deviceNames[i]);
+			if (index != i)
+			{
+				returnStats[i] = returnStats[index];
+				results[i] = results[index];
 			}
 		}
+	}
+	else
+	{
+		NATIVELOG_ERROR("RasEnumConnections failed in GetVpnDeviceStatisticsBatch: 0x%.8X\n", rc);
+	}
 
-		// Deallocate memory for the connection buffer
-		HeapFree(GetProcessHeap(), 0, lpRasConn);
-		lpRasConn = NULL;
+	if (lpRasConn != stackConns)
+	{
+		RaslibFree(lpRasConn);
 	}
 
-	return result;
+	MetricsObserveSince(MetricStatsPollSeconds, started);
+	TraceRequestEnd(&trace, rc);
+
+	return rc;
+}
+
+DWORD GetVpnDeviceStatistics(LPCWSTR deviceName, VpnDeviceStats* returnStats)
+{
+	// The hostname has to outlive the call for the caller to copy it, one buffer per thread avoids leaking it
+	static __declspec(thread) WCHAR hostname[RAS_MaxPhoneNumber + 1];
+	DWORD entryResult = ERROR_SUCCESS;
+
+	DWORD result = GetVpnDeviceStatisticsBatch(&deviceName, 1, returnStats, &entryResult, hostname, CELEMS(hostname));
+
+	return result != ERROR_SUCCESS ? result : entryResult;
 }
@@ -1,6 +1,12 @@
 ﻿#ifndef RASLIB_LIBRARY_H
 #define RASLIB_LIBRARY_H
 #include <Windows.h>
+#include "DialSession.h"
+#include "NativeLog.h"
+#include "Reconnect.h"
+
+// Most entries GetVpnDeviceStatisticsBatch takes in one call
+#define RASLIB_MAX_STATS_BATCH 256
 #endif
 
 typedef struct _VpnDeviceStats
@@ -16,10 +22,13 @@ typedef struct _VpnDeviceStats
 
 typedef void(_cdecl *DialDelegateFuncType)();
 typedef void(_cdecl *DialErrorFuncType)(DWORD error);
-typedef void(_cdecl* PLogCallback)(const char* message);
 
+// Log messages are queued and handed to logCallback in batches from a single drain thread, see NativeLog.h
 extern DWORD SetLogCallback(PLogCallback logCallback);
 extern DWORD CreateVpnDevice(LPCWSTR deviceName, LPCWSTR connectionHostname);
+extern DWORD PrepareVpnDevices(LPCWSTR deviceName, LPCWSTR* hostnames, UINT hostnameCount);
+extern DWORD SetVpnDeviceCacheEnabled(BOOL enabled);
+extern void GetVpnDeviceSlotName(LPCWSTR deviceName, UINT slot, LPWSTR entryName, DWORD entryNameLength);
 extern DWORD AbortDialAttempt();
 extern DWORD ResetAbortDial();
 extern DWORD ConnectVpnDevice(
@@ -32,4 +41,16 @@ extern DWORD ConnectVpnDevice(
 	DialDelegateFuncType abortCallback
 );
 extern DWORD DisconnectVpnDevice(LPCWSTR deviceName);
-extern DWORD GetVpnDeviceStatistics(LPCWSTR deviceName, VpnDeviceStats* returnStats);
\ No newline at end of file
+extern DWORD GetVpnDeviceStatistics(LPCWSTR deviceName, VpnDeviceStats* returnStats);
+
+// Fills returnStats[i] and results[i] for each of deviceNames from a single connection enumeration. An entry
+// without a connection reports ERROR_SUCCESS with Status 0. Each Hostname points into hostnames, which holds
+// deviceCount strings of hostnameLength characters, and is left NULL when hostnames is NULL.
+extern DWORD GetVpnDeviceStatisticsBatch(
+	LPCWSTR* deviceNames,
+	UINT deviceCount,
+	VpnDeviceStats* returnStats,
+	DWORD* results,
+	LPWSTR hostnames,
+	DWORD hostnameLength
+);
\ No newline at end of file
@@ -0,0 +1,874 @@
+#include "stdafx.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#include <Ras.h>
+#include <RasError.h>
+#include <strsafe.h>
+#include "Reconnect.h"
+#include "DialSession.h"
+#include "RasApi.h"
+#include "Metrics.h"
+#include "NativeLog.h"
+#include "Trace.h"
+#include "Helpers.h"
+#include "Executor.h"
+
+#pragma comment(lib, "iphlpapi.lib")
+
+#define CELEMS(x) ((sizeof(x))/(sizeof(x[0])))
+
+#define RECONNECT_DEFAULT_BASE_DELAY_MS 1000
+#define RECONNECT_DEFAULT_MAX_DELAY_MS 60000
+#define RECONNECT_DEFAULT_BREAKER_THRESHOLD 3
+#define RECONNECT_DEFAULT_BREAKER_COOLDOWN_MS 120000
+// How often a connection RAS won't signal the drop of is checked on
+#define RECONNECT_POLL_MS 2000
+
+// Reconnector::Outcome, set by the dial callbacks and taken by ServiceWorker
+#define OUTCOME_NONE 0
+#define OUTCOME_CONNECTED 1
+#define OUTCOME_FAILED 2
+
+typedef struct _ReconnectServer
+{
+	WCHAR Hostname[RAS_MaxPhoneNumber + 1];
+	// Failed dials in a row
+	UINT Failures;
+	// The breaker is open until then, GetTickCount64 time. 0 when closed, a time passed when half open.
+	ULONGLONG OpenUntil;
+} ReconnectServer;
+
+// One Arm, holding a reference to its reconnector until the executor runs it
+typedef struct _ReconnectTimer
+{
+	struct _Reconnector* Reconnector;
+} ReconnectTimer;
+
+typedef struct _Reconnector
+{
+	volatile LONG RefCount;
+	ReconnectCallback Callback;
+	PVOID Context;
+	WCHAR DeviceName[RAS_MaxEntryName + 1];
+	WCHAR Username[UNLEN + 1];
+	WCHAR Password[PWLEN + 1];
+	ReconnectServer Servers[RECONNECT_MAX_SERVERS];
+	UINT ServerCount;
+	DWORD BaseDelayMs;
+	DWORD MaxDelayMs;
+	UINT BreakerThreshold;
+	DWORD BreakerCooldownMs;
+	UINT MaxAttempts;
+	UINT64 Random;
+	// Registered with RasConnectionNotification while connected
+	HANDLE DropEvent;
+	// Written by the dial callbacks, which don't take EngineLock
+	volatile LONG Outcome;
+	DWORD OutcomeError;
+	// Everything below is guarded by EngineLock
+	HDIALSESSION Session;
+	BOOL HangingUp;
+	ULONGLONG DroppedAt;
+	// Waits on DropEvent while connected
+	HANDLE DropWait;
+	// A reconnector has at most one timer armed. A disarmed one still comes due and sees it isn't this one.
+	ReconnectTimer* Timer;
+	ULONGLONG DueAt;
+	ReconnectStatus Status;
+} Reconnector;
+
+// The reconnectors are driven from tasks and timers on the shared executor, each of which holds EngineLock for
+// all it does, so they run one at a time. ControlLock orders watching the network with the first reconnector
+// starting and the last stopping.
+static SRWLOCK ControlLock = SRWLOCK_INIT;
+static SRWLOCK EngineLock = SRWLOCK_INIT;
+static Reconnector* Reconnectors[RECONNECT_MAX];
+static UINT ReconnectorCount;
+// Set while a NetworkChangeWorker is queued
+static volatile LONG NetworkChanged;
+static HANDLE InterfaceNotification;
+static HANDLE AddressNotification;
+
+static void ReleaseReconnector(Reconnector* reconnector)
+{
+	if (InterlockedDecrement(&reconnector->RefCount) == 0)
+	{
+		if (reconnector->DropEvent != NULL)
+		{
+			CloseHandle(reconnector->DropEvent);
+		}
+
+		SecureZeroMemory(reconnector->Password, sizeof(reconnector->Password));
+		RaslibFree(reconnector);
+	}
+}
+
+static BOOL IsRegistered(const Reconnector* reconnector)
+{
+	for (UINT i = 0; i < ReconnectorCount; i++)
+	{
+		if (Reconnectors[i] == reconnector)
+		{
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void CALLBACK TimerWorker(PVOID context);
+
+static void Disarm(Reconnector* reconnector)
+{
+	reconnector->Timer = NULL;
+}
+
+// Fires once delayMs has passed, 0 fires as soon as a worker is free
+static DWORD Arm(Reconnector* reconnector, DWORD delayMs)
+{
+	Disarm(reconnector);
+
+	ReconnectTimer* timer = (ReconnectTimer*)RaslibAlloc(sizeof(ReconnectTimer));
+	if (timer == NULL)
+	{
+		NATIVELOG_ERROR("reconnector %p: could not arm its timer\n", reconnector);
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	timer->Reconnector = reconnector;
+	InterlockedIncrement(&reconnector->RefCount);
+
+	// Callers hold EngineLock, so the timer can't fire before it's armed
+	DWORD result = ExecutorSchedule(delayMs, 0, TimerWorker, timer, NULL);
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("reconnector %p: could not arm its timer: %lu\n", reconnector, result);
+		ReleaseReconnector(reconnector);
+		RaslibFree(timer);
+		return result;
+	}
+
+	reconnector->Timer = timer;
+	reconnector->DueAt = GetTickCount64() + delayMs;
+
+	return ERROR_SUCCESS;
+}
+
+static void FillStatus(const Reconnector* reconnector, ULONGLONG now, ReconnectStatus* status)
+{
+	*status = reconnector->Status;
+	status->NextDialMs = reconnector->Timer != NULL ? (DWORD)(reconnector->DueAt > now ? reconnector->DueAt - now : 0) : INFINITE;
+	status->OpenBreakers = 0;
+
+	for (UINT i = 0; i < reconnector->ServerCount; i++)
+	{
+		if (reconnector->Servers[i].OpenUntil > now)
+		{
+			status->OpenBreakers++;
+		}
+	}
+}
+
+static void ChangeState(Reconnector* reconnector, ReconnectState state)
+{
+	ReconnectStatus status;
+
+	reconnector->Status.State = state;
+
+	if (reconnector->Callback != NULL)
+	{
+		FillStatus(reconnector, GetTickCount64(), &status);
+		TRACE_CALL_VOID(TraceProbeManagedCallback, reconnector->Callback(reconnector, state, &status, reconnector->Context));
+	}
+}
+
+static void CALLBACK ServiceWorker(PVOID context);
+
+static void SetOutcome(Reconnector* reconnector, LONG outcome, DWORD error)
+{
+	reconnector->OutcomeError = error;
+	InterlockedExchange(&reconnector->Outcome, outcome);
+
+	// The dial's reference goes with the task
+	if (ExecutorSubmit(ServiceWorker, reconnector, NULL) != ERROR_SUCCESS)
+	{
+		ServiceWorker(reconnector);
+	}
+}
+
+static void _cdecl DialComplete(HDIALSESSION session, LPVOID context)
+{
+	SetOutcome((Reconnector*)context, OUTCOME_CONNECTED, ERROR_SUCCESS);
+}
+
+static void _cdecl DialError(HDIALSESSION session, DWORD error, LPVOID context)
+{
+	SetOutcome((Reconnector*)context, OUTCOME_FAILED, error);
+}
+
+static void _cdecl DialAbort(HDIALSESSION session, LPVOID context)
+{
+	ReleaseReconnector((Reconnector*)context);
+}
+
+static void CloseSession(Reconnector* reconnector)
+{
+	if (reconnector->Session != 0)
+	{
+		DialSessionClose(reconnector->Session);
+		reconnector->Session = 0;
+	}
+}
+
+// Equal jitter: half the capped exponential delay plus a random share of the other half, so reconnectors that
+// lost their connections together spread out without any of them coming straight back
+static DWORD BackoffMs(Reconnector* reconnector)
+{
+	UINT shift = min(reconnector->Status.Attempts - 1, 31U);
+	ULONGLONG cap = min((ULONGLONG)reconnector->BaseDelayMs << shift, (ULONGLONG)reconnector->MaxDelayMs);
+
+	return (DWORD)(cap / 2 + NextRandom(&reconnector->Random) % (cap / 2 + 1));
+}
+
+// The first server from start on with its breaker closed, or cooled down and half open
+static BOOL PickServer(const Reconnector* reconnector, UINT start, ULONGLONG now, UINT* server)
+{
+	for (UINT i = 0; i < reconnector->ServerCount; i++)
+	{
+		UINT candidate = (start + i) % reconnector->ServerCount;
+		if (reconnector->Servers[candidate].OpenUntil <= now)
+		{
+			*server = candidate;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void Dial(Reconnector* reconnector);
+
+static void DialFailed(Reconnector* reconnector, DWORD error)
+{
+	ULONGLONG now = GetTickCount64();
+	ReconnectServer* server = &reconnector->Servers[reconnector->Status.Server];
+
+	CloseSession(reconnector);
+	reconnector->Status.LastError = error;
+	reconnector->Status.Attempts++;
+
+	// Trips the breaker, or opens it again when the dial was a half open server's trial
+	if (++server->Failures >= reconnector->BreakerThreshold)
+	{
+		server->OpenUntil = now + reconnector->BreakerCooldownMs;
+		reconnector->Status.BreakerTrips++;
+		MetricsAdd(MetricReconnectBreakerTrips, 1);
+	}
+
+	NATIVELOG_WARNING("reconnector %p: dial to server %u failed: 0x%.8X, %u in a row\n", reconnector, reconnector->Status.Server, error, reconnector->Status.Attempts);
+
+	if (reconnector->MaxAttempts != 0 && reconnector->Status.Attempts >= reconnector->MaxAttempts)
+	{
+		ChangeState(reconnector, ReconnectGaveUp);
+		return;
+	}
+
+	Arm(reconnector, BackoffMs(reconnector));
+	ChangeState(reconnector, ReconnectWaiting);
+}
+
+// Dials the current server, or the next one along when its breaker is open
+static void Dial(Reconnector* reconnector)
+{
+	ULONGLONG now = GetTickCount64();
+	UINT server;
+
+	if (!PickServer(reconnector, reconnector->Status.Server, now, &server))
+	{
+		ULONGLONG reopensAt = MAXUINT64;
+		for (UINT i = 0; i < reconnector->ServerCount; i++)
+		{
+			reopensAt = min(reopensAt, reconnector->Servers[i].OpenUntil);
+		}
+
+		Arm(reconnector, (DWORD)(reopensAt - now));
+		ChangeState(reconnector, ReconnectWaiting);
+		return;
+	}
+
+	reconnector->Status.Server = server;
+	reconnector->Status.Dials++;
+	MetricsAdd(MetricReconnectDials, 1);
+	ChangeState(reconnector, ReconnectDialing);
+
+	DialSessionCallbacks callbacks = { DialComplete, DialError, DialAbort, reconnector };
+
+	DWORD result = DialSessionCreate(&callbacks, &reconnector->Session);
+	if (result == ERROR_SUCCESS)
+	{
+		InterlockedIncrement(&reconnector->RefCount);
+
+		result = DialSessionDial(reconnector->Session, reconnector->DeviceName, reconnector->Servers[server].Hostname, reconnector->Username, reconnector->Password);
+		if (result != ERROR_SUCCESS)
+		{
+			// Synchronous failures fire no callback
+			ReleaseReconnector(reconnector);
+		}
+	}
+	else
+	{
+		reconnector->Session = 0;
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		DialFailed(reconnector, result);
+	}
+}
+
+static VOID CALLBACK DropSignalled(PVOID context, BOOLEAN timedOut);
+
+// Waits for DropSignalled to return should it be running, it never takes EngineLock
+static void UnwatchDrop(Reconnector* reconnector)
+{
+	if (reconnector->DropWait != NULL)
+	{
+		UnregisterWaitEx(reconnector->DropWait, INVALID_HANDLE_VALUE);
+		reconnector->DropWait = NULL;
+	}
+}
+
+// The wait is on the system's wait thread rather than one of ours, and only hands the drop to a worker
+static DWORD WatchDrop(Reconnector* reconnector)
+{
+	UnwatchDrop(reconnector);
+
+	if (!RegisterWaitForSingleObject(&reconnector->DropWait, reconnector->DropEvent, DropSignalled, reconnector, INFINITE, WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD))
+	{
+		reconnector->DropWait = NULL;
+		return GetLastError();
+	}
+
+	return ERROR_SUCCESS;
+}
+
+static void Connected(Reconnector* reconnector)
+{
+	const RASLIB_API* ras = RaslibGetApi();
+	ULONGLONG now = GetTickCount64();
+	ReconnectServer* server = &reconnector->Servers[reconnector->Status.Server];
+	HRASCONN rasConn = NULL;
+
+	server->Failures = 0;
+	server->OpenUntil = 0;
+	reconnector->Status.Attempts = 0;
+	reconnector->Status.LastError = ERROR_SUCCESS;
+
+	if (reconnector->DroppedAt != 0)
+	{
+		reconnector->Status.LastOutageMs = (DWORD)(now - reconnector->DroppedAt);
+		reconnector->Status.Reconnects++;
+		MetricsObserveUs(MetricReconnectSeconds, (now - reconnector->DroppedAt) * 1000);
+		reconnector->DroppedAt = 0;
+	}
+
+	ResetEvent(reconnector->DropEvent);
+
+	DWORD result = DialSessionGetConnection(reconnector->Session, &rasConn);
+	if (result == ERROR_SUCCESS)
+	{
+		result = ras->ConnectionNotification(rasConn, reconnector->DropEvent, RASCN_Disconnection);
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		result = WatchDrop(reconnector);
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		NATIVELOG_WARNING("watching for the drop failed in the reconnector, polling instead: 0x%.8X\n", result);
+		Arm(reconnector, RECONNECT_POLL_MS);
+	}
+
+	ChangeState(reconnector, ReconnectConnected);
+}
+
+// RAS has let the port go, so dial again
+static void HungUp(Reconnector* reconnector)
+{
+	reconnector->HangingUp = FALSE;
+	CloseSession(reconnector);
+	Dial(reconnector);
+}
+
+static void CALLBACK HangUpWorker(PVOID context)
+{
+	Reconnector* reconnector = (Reconnector*)context;
+
+	// Waits on RAS without EngineLock, the session stays open until HungUp closes it
+	DialSessionHangUp(reconnector->Session);
+
+	AcquireSRWLockExclusive(&EngineLock);
+
+	if (IsRegistered(reconnector) && reconnector->HangingUp)
+	{
+		HungUp(reconnector);
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	ReleaseReconnector(reconnector);
+}
+
+// The drop event can be left over from an earlier connection, so ask RAS whether this one is still up
+static void CheckDropped(Reconnector* reconnector)
+{
+	const RASLIB_API* ras = RaslibGetApi();
+	RASCONNSTATUS status;
+	HRASCONN rasConn = NULL;
+
+	if (reconnector->Status.State != ReconnectConnected)
+	{
+		return;
+	}
+
+	memset(&status, 0, sizeof(status));
+	status.dwSize = sizeof(RASCONNSTATUS);
+
+	DWORD result = DialSessionGetConnection(reconnector->Session, &rasConn);
+	if (result == ERROR_SUCCESS)
+	{
+		result = ras->GetConnectStatus(rasConn, &status);
+	}
+
+	if (result == ERROR_SUCCESS && status.rasconnstate == RASCS_Connected)
+	{
+		return;
+	}
+
+	reconnector->DroppedAt = GetTickCount64();
+	reconnector->Status.LastError = result != ERROR_SUCCESS ? result : (status.dwError != ERROR_SUCCESS ? status.dwError : ERROR_REMOTE_DISCONNECTION);
+	NATIVELOG_WARNING("reconnector %p: connection to server %u dropped: 0x%.8X\n", reconnector, reconnector->Status.Server, reconnector->Status.LastError);
+
+	// RAS holds the port until the connection is hung up, which waits on RAS, so do it on another worker
+	// without EngineLock and dial again once it's done
+	reconnector->HangingUp = TRUE;
+	ChangeState(reconnector, ReconnectWaiting);
+
+	InterlockedIncrement(&reconnector->RefCount);
+	if (ExecutorSubmit(HangUpWorker, reconnector, NULL) != ERROR_SUCCESS)
+	{
+		ReleaseReconnector(reconnector);
+		DialSessionHangUp(reconnector->Session);
+		HungUp(reconnector);
+	}
+}
+
+static void Service(Reconnector* reconnector)
+{
+	LONG outcome = InterlockedExchange(&reconnector->Outcome, OUTCOME_NONE);
+
+	if (outcome == OUTCOME_CONNECTED)
+	{
+		Connected(reconnector);
+	}
+	else if (outcome == OUTCOME_FAILED)
+	{
+		DialFailed(reconnector, reconnector->OutcomeError);
+	}
+}
+
+static void CALLBACK ServiceWorker(PVOID context)
+{
+	Reconnector* reconnector = (Reconnector*)context;
+
+	AcquireSRWLockExclusive(&EngineLock);
+
+	if (IsRegistered(reconnector))
+	{
+		Service(reconnector);
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	ReleaseReconnector(reconnector);
+}
+
+static void TimerFired(Reconnector* reconnector)
+{
+	if (reconnector->Status.State != ReconnectConnected)
+	{
+		Dial(reconnector);
+		return;
+	}
+
+	// Only armed while connected when RAS wouldn't take the drop event
+	CheckDropped(reconnector);
+
+	if (reconnector->Status.State == ReconnectConnected)
+	{
+		Arm(reconnector, RECONNECT_POLL_MS);
+	}
+}
+
+static void CALLBACK TimerWorker(PVOID context)
+{
+	ReconnectTimer* timer = (ReconnectTimer*)context;
+	Reconnector* reconnector = timer->Reconnector;
+
+	AcquireSRWLockExclusive(&EngineLock);
+
+	// Stopping disarms, so the reconnector of the armed timer is still registered
+	if (reconnector->Timer == timer)
+	{
+		reconnector->Timer = NULL;
+		TimerFired(reconnector);
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	RaslibFree(timer);
+	ReleaseReconnector(reconnector);
+}
+
+static void CALLBACK DropWorker(PVOID context)
+{
+	Reconnector* reconnector = (Reconnector*)context;
+
+	AcquireSRWLockExclusive(&EngineLock);
+
+	if (IsRegistered(reconnector))
+	{
+		UnwatchDrop(reconnector);
+		CheckDropped(reconnector);
+
+		// Signalled for an earlier connection, this one is still up
+		if (reconnector->Status.State == ReconnectConnected && WatchDrop(reconnector) != ERROR_SUCCESS)
+		{
+			Arm(reconnector, RECONNECT_POLL_MS);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	ReleaseReconnector(reconnector);
+}
+
+static VOID CALLBACK DropSignalled(PVOID context, BOOLEAN timedOut)
+{
+	Reconnector* reconnector = (Reconnector*)context;
+
+	// UnwatchDrop waits for this to return, so the reconnector is still there to take a reference on
+	InterlockedIncrement(&reconnector->RefCount);
+	if (ExecutorSubmit(DropWorker, reconnector, NULL) != ERROR_SUCCESS)
+	{
+		NATIVELOG_ERROR("reconnector %p: could not queue the drop RAS signalled\n", reconnector);
+		ReleaseReconnector(reconnector);
+	}
+}
+
+static void NetworkChange()
+{
+	ULONGLONG now = GetTickCount64();
+
+	for (UINT i = 0; i < ReconnectorCount; i++)
+	{
+		Reconnector* reconnector = Reconnectors[i];
+		ReconnectState state = reconnector->Status.State;
+
+		if ((state != ReconnectWaiting || reconnector->HangingUp) && state != ReconnectGaveUp)
+		{
+			continue;
+		}
+
+		// Half open, a trial dial that fails opens the breaker again
+		for (UINT j = 0; j < reconnector->ServerCount; j++)
+		{
+			if (reconnector->Servers[j].OpenUntil > now)
+			{
+				reconnector->Servers[j].OpenUntil = now;
+			}
+		}
+
+		reconnector->Status.Attempts = 0;
+		Disarm(reconnector);
+		Dial(reconnector);
+	}
+}
+
+static void CALLBACK NetworkChangeWorker(PVOID context)
+{
+	// Cleared first, a change while this runs queues another
+	InterlockedExchange(&NetworkChanged, FALSE);
+
+	AcquireSRWLockExclusive(&EngineLock);
+	NetworkChange();
+	ReleaseSRWLockExclusive(&EngineLock);
+}
+
+static VOID WINAPI InterfaceChanged(PVOID context, PMIB_IPINTERFACE_ROW row, MIB_NOTIFICATION_TYPE type)
+{
+	if (type == MibAddInstance || type == MibParameterNotification)
+	{
+		ReconnectNotifyNetworkChange();
+	}
+}
+
+static VOID WINAPI AddressChanged(PVOID context, PMIB_UNICASTIPADDRESS_ROW row, MIB_NOTIFICATION_TYPE type)
+{
+	if (type == MibAddInstance)
+	{
+		ReconnectNotifyNetworkChange();
+	}
+}
+
+// Without the notifications reconnects still happen, only on the backoff schedule
+static void WatchNetwork()
+{
+	DWORD result = NotifyIpInterfaceChange(AF_UNSPEC, InterfaceChanged, NULL, FALSE, &InterfaceNotification);
+	if (result != NO_ERROR)
+	{
+		NATIVELOG_WARNING("NotifyIpInterfaceChange failed in the reconnector: %lu\n", result);
+		InterfaceNotification = NULL;
+	}
+
+	result = NotifyUnicastIpAddressChange(AF_UNSPEC, AddressChanged, NULL, FALSE, &AddressNotification);
+	if (result != NO_ERROR)
+	{
+		NATIVELOG_WARNING("NotifyUnicastIpAddressChange failed in the reconnector: %lu\n", result);
+		AddressNotification = NULL;
+	}
+}
+
+// Waits for callbacks in progress, so never call it holding EngineLock
+static void UnwatchNetwork()
+{
+	if (InterfaceNotification != NULL)
+	{
+		CancelMibChangeNotify2(InterfaceNotification);
+		InterfaceNotification = NULL;
+	}
+
+	if (AddressNotification != NULL)
+	{
+		CancelMibChangeNotify2(AddressNotification);
+		AddressNotification = NULL;
+	}
+}
+
+DWORD ReconnectStart(const ReconnectOptions* options, ReconnectCallback callback, PVOID context, HRECONNECT* reconnector)
+{
+	Reconnector* created = NULL;
+	DWORD result = ERROR_SUCCESS;
+
+	if (options == NULL || options->DeviceName == NULL || options->Hostnames == NULL || options->HostnameCount == 0 ||
+		options->HostnameCount > RECONNECT_MAX_SERVERS || reconnector == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	for (UINT i = 0; i < options->HostnameCount; i++)
+	{
+		if (options->Hostnames[i] == NULL)
+		{
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	created = (Reconnector*)RaslibAlloc(sizeof(Reconnector));
+	if (created == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	// The reconnector list holds the first reference
+	created->RefCount = 1;
+	created->Callback = callback;
+	created->Context = context;
+	StringCchCopy(created->DeviceName, CELEMS(created->DeviceName), options->DeviceName);
+	StringCchCopy(created->Username, CELEMS(created->Username), options->Username != NULL ? options->Username : L"");
+	StringCchCopy(created->Password, CELEMS(created->Password), options->Password != NULL ? options->Password : L"");
+
+	for (UINT i = 0; i < options->HostnameCount; i++)
+	{
+		StringCchCopy(created->Servers[i].Hostname, CELEMS(created->Servers[i].Hostname), options->Hostnames[i]);
+	}
+
+	created->ServerCount = options->HostnameCount;
+	created->BaseDelayMs = options->BaseDelayMs != 0 ? options->BaseDelayMs : RECONNECT_DEFAULT_BASE_DELAY_MS;
+	created->MaxDelayMs = max(options->MaxDelayMs != 0 ? options->MaxDelayMs : RECONNECT_DEFAULT_MAX_DELAY_MS, created->BaseDelayMs);
+	created->BreakerThreshold = options->BreakerThreshold != 0 ? options->BreakerThreshold : RECONNECT_DEFAULT_BREAKER_THRESHOLD;
+	created->BreakerCooldownMs = options->BreakerCooldownMs != 0 ? options->BreakerCooldownMs : RECONNECT_DEFAULT_BREAKER_COOLDOWN_MS;
+	created->MaxAttempts = options->MaxAttempts;
+	created->Status.State = ReconnectWaiting;
+
+	if (options->Seed != 0)
+	{
+		created->Random = options->Seed;
+	}
+	else
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		created->Random = (UINT64)counter.QuadPart ^ ((UINT64)GetCurrentProcessId() << 32) ^ (UINT_PTR)created;
+	}
+
+	// xorshift never leaves 0
+	if (created->Random == 0)
+	{
+		created->Random = 1;
+	}
+
+	created->DropEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (created->DropEvent == NULL)
+	{
+		result = GetLastError();
+		ReleaseReconnector(created);
+		return result;
+	}
+
+	AcquireSRWLockExclusive(&ControlLock);
+	AcquireSRWLockExclusive(&EngineLock);
+
+	BOOL first = ReconnectorCount == 0;
+
+	if (ReconnectorCount == RECONNECT_MAX)
+	{
+		result = ERROR_TOO_MANY_SESS;
+	}
+	else
+	{
+		// The first dial goes as soon as a worker is free
+		result = Arm(created, 0);
+		if (result == ERROR_SUCCESS)
+		{
+			Reconnectors[ReconnectorCount++] = created;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	if (result == ERROR_SUCCESS && first)
+	{
+		WatchNetwork();
+	}
+
+	ReleaseSRWLockExclusive(&ControlLock);
+
+	if (result != ERROR_SUCCESS)
+	{
+		ReleaseReconnector(created);
+		return result;
+	}
+
+	*reconnector = created;
+	return ERROR_SUCCESS;
+}
+
+DWORD ReconnectGetStatus(HRECONNECT reconnector, ReconnectStatus* status)
+{
+	DWORD result = ERROR_SUCCESS;
+
+	if (reconnector == NULL || status == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockShared(&EngineLock);
+
+	if (IsRegistered(reconnector))
+	{
+		FillStatus(reconnector, GetTickCount64(), status);
+	}
+	else
+	{
+		result = ERROR_INVALID_HANDLE;
+	}
+
+	ReleaseSRWLockShared(&EngineLock);
+
+	return result;
+}
+
+DWORD ReconnectNotifyNetworkChange()
+{
+	// Nothing to do without reconnectors, and changes come in bursts that one queued task covers
+	if (ReconnectorCount == 0 || InterlockedExchange(&NetworkChanged, TRUE))
+	{
+		return ERROR_SUCCESS;
+	}
+
+	DWORD result = ExecutorSubmit(NetworkChangeWorker, NULL, NULL);
+	if (result != ERROR_SUCCESS)
+	{
+		InterlockedExchange(&NetworkChanged, FALSE);
+	}
+
+	return result;
+}
+
+DWORD ReconnectStop(HRECONNECT reconnector)
+{
+	HDIALSESSION session = 0;
+	BOOL found = FALSE;
+	BOOL last = FALSE;
+
+	if (reconnector == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&ControlLock);
+
+	// Once EngineLock is ours no worker is working on the reconnector or inside its callback, and none will be
+	// once it's unregistered
+	AcquireSRWLockExclusive(&EngineLock);
+
+	for (UINT i = 0; i < ReconnectorCount; i++)
+	{
+		if (Reconnectors[i] == reconnector)
+		{
+			Reconnectors[i] = Reconnectors[--ReconnectorCount];
+			found = TRUE;
+			break;
+		}
+	}
+
+	if (found)
+	{
+		Disarm(reconnector);
+		UnwatchDrop(reconnector);
+		session = reconnector->Session;
+		reconnector->Session = 0;
+		last = ReconnectorCount == 0;
+	}
+
+	ReleaseSRWLockExclusive(&EngineLock);
+
+	if (last)
+	{
+		UnwatchNetwork();
+	}
+
+	ReleaseSRWLockExclusive(&ControlLock);
+
+	if (!found)
+	{
+		return ERROR_INVALID_HANDLE;
+	}
+
+	if (session != 0)
+	{
+		// Hung up here rather than by the abort so it's gone when this returns. A dial in flight ends with
+		// DialAbort or DialError, either drops the dial's reference.
+		DialSessionHangUp(session);
+		DialSessionAbort(session);
+		DialSessionClose(session);
+	}
+
+	ReleaseReconnector(reconnector);
+
+	return ERROR_SUCCESS;
+}
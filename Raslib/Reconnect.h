@@ -0,0 +1,76 @@
+#pragma once
+#include <Windows.h>
+
+#define RECONNECT_MAX 16
+#define RECONNECT_MAX_SERVERS 16
+
+typedef struct _Reconnector* HRECONNECT;
+
+typedef enum _ReconnectState
+{
+	ReconnectDialing = 0,
+	ReconnectConnected,
+	// Backing off before the next dial, or every server's breaker is open
+	ReconnectWaiting,
+	// MaxAttempts dials in a row failed, only a network change starts it again
+	ReconnectGaveUp,
+} ReconnectState;
+
+// Zero fields take the defaults in Reconnect.cpp
+typedef struct _ReconnectOptions
+{
+	LPCWSTR DeviceName;
+	// Tried in order, the reconnector stays with a server until its breaker opens
+	LPCWSTR* Hostnames;
+	UINT HostnameCount;
+	LPCWSTR Username;
+	LPCWSTR Password;
+	// The n-th failure in a row waits between half and all of min(MaxDelayMs, BaseDelayMs * 2^(n-1))
+	DWORD BaseDelayMs;
+	DWORD MaxDelayMs;
+	// Failures in a row that open a server's breaker, it isn't dialed again for BreakerCooldownMs
+	UINT BreakerThreshold;
+	DWORD BreakerCooldownMs;
+	// Failed dials in a row before giving up, 0 never gives up
+	UINT MaxAttempts;
+	// Same seed, same delays. 0 seeds from the clock.
+	UINT64 Seed;
+} ReconnectOptions;
+
+typedef struct _ReconnectStatus
+{
+	ReconnectState State;
+	// Index into Hostnames of the server being dialed or connected to
+	UINT Server;
+	// Failed dials since the last connect
+	UINT Attempts;
+	DWORD LastError;
+	// Until the next dial while waiting, INFINITE when nothing is scheduled
+	DWORD NextDialMs;
+	UINT OpenBreakers;
+	UINT64 Dials;
+	UINT64 Reconnects;
+	UINT64 BreakerTrips;
+	// Drop to connected again, for the last reconnect
+	DWORD LastOutageMs;
+} ReconnectStatus;
+
+// Runs on an executor worker on every state change, every dial included. It must not call into the reconnector.
+typedef void (CALLBACK* ReconnectCallback)(HRECONNECT reconnector, ReconnectState state, const ReconnectStatus* status, PVOID context);
+
+// Dials the first server straight away and keeps the connection up from then on. RAS signals the drop, the
+// reconnector hangs up what is left of the connection and dials again at once, then backs off with jitter
+// while dials keep failing. Every reconnector in the process is driven from timers and tasks on the shared
+// executor, one at a time, and they listen together for interfaces and addresses coming up.
+extern DWORD ReconnectStart(const ReconnectOptions* options, ReconnectCallback callback, PVOID context, HRECONNECT* reconnector);
+
+extern DWORD ReconnectGetStatus(HRECONNECT reconnector, ReconnectStatus* status);
+
+// Skips the backoff: every waiting reconnector, and every one that gave up, dials at once with its backoff
+// reset and its breakers half open. Called when an interface or address comes up, and for the caller's own
+// network change notifications.
+extern DWORD ReconnectNotifyNetworkChange();
+
+// Stops reconnecting and hangs up the connection, waiting for RAS to let it go. The callback has returned for
+// the last time once this returns.
+extern DWORD ReconnectStop(HRECONNECT reconnector);
@@ -0,0 +1,318 @@
+#include "stdafx.h"
+#include <stddef.h>
+#include <strsafe.h>
+#include "Recorder.h"
+#include "NativeLog.h"
+#include "Helpers.h"
+
+#define RECORDER_TEMP_SUFFIX L".tmp"
+#define RECORDER_FNV_PRIME 16777619u
+
+volatile LONG RecorderActive = 0;
+
+// Held shared while a call is recorded and exclusive to start and stop, so a stop never writes out a call
+// that's half filled in
+static SRWLOCK RecorderLock = SRWLOCK_INIT;
+static RecorderTrace* Recording = NULL;
+static UINT Capacity = 0;
+static volatile LONG NextSlot = 0;
+static volatile LONG Dropped = 0;
+static INT64 StartTicks = 0;
+static INT64 TicksPerSecond = 1;
+static WCHAR RecordingPath[MAX_PATH];
+
+static UINT32 Checksum(const RecorderTrace* trace)
+{
+	return Crc32(trace->Calls, (SIZE_T)trace->Count * sizeof(RecorderCall));
+}
+
+UINT32 RecorderDigest(UINT32 digest, const void* data, SIZE_T length)
+{
+	const BYTE* p = (const BYTE*)data;
+	for (SIZE_T i = 0; p != NULL && i < length; i++)
+	{
+		digest = (digest ^ p[i]) * RECORDER_FNV_PRIME;
+	}
+
+	return digest;
+}
+
+UINT32 RecorderDigestString(UINT32 digest, LPCWSTR value)
+{
+	return value != NULL ? RecorderDigest(digest, value, wcslen(value) * sizeof(WCHAR)) : digest;
+}
+
+DWORD RecorderStart(LPCWSTR path, UINT capacity)
+{
+	if (capacity > RECORDER_MAX_CAPACITY)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	if (capacity == 0)
+	{
+		capacity = RECORDER_DEFAULT_CAPACITY;
+	}
+
+	DWORD result = ERROR_SUCCESS;
+
+	AcquireSRWLockExclusive(&RecorderLock);
+	if (Recording != NULL)
+	{
+		result = ERROR_ALREADY_EXISTS;
+	}
+	else if (FAILED(StringCchCopyW(RecordingPath, MAX_PATH, path != NULL ? path : L"")))
+	{
+		result = ERROR_FILENAME_EXCED_RANGE;
+	}
+	else
+	{
+		Recording = (RecorderTrace*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, RECORDER_TRACE_LENGTH(capacity));
+		if (Recording == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	if (result == ERROR_SUCCESS)
+	{
+		LARGE_INTEGER frequency, now;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&now);
+		TicksPerSecond = frequency.QuadPart;
+		StartTicks = now.QuadPart;
+		Capacity = capacity;
+		NextSlot = 0;
+		Dropped = 0;
+		InterlockedExchange(&RecorderActive, 1);
+	}
+	ReleaseSRWLockExclusive(&RecorderLock);
+
+	if (result == ERROR_SUCCESS)
+	{
+		NATIVELOG_INFO("recording platform calls, %u at most\n", capacity);
+	}
+
+	return result;
+}
+
+static DWORD Save(const RecorderTrace* trace, LPCWSTR path)
+{
+	WCHAR tempPath[MAX_PATH];
+	if (FAILED(StringCchPrintfW(tempPath, MAX_PATH, L"%s" RECORDER_TEMP_SUFFIX, path)))
+	{
+		return ERROR_FILENAME_EXCED_RANGE;
+	}
+
+	HANDLE file = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	DWORD length = (DWORD)RECORDER_TRACE_LENGTH(trace->Count);
+	DWORD written = 0;
+	DWORD result = ERROR_SUCCESS;
+	if (!WriteFile(file, trace, length, &written, NULL) || !FlushFileBuffers(file))
+	{
+		result = GetLastError();
+	}
+	else if (written != length)
+	{
+		result = ERROR_WRITE_FAULT;
+	}
+
+	CloseHandle(file);
+
+	if (result == ERROR_SUCCESS && !MoveFileExW(tempPath, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		result = GetLastError();
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		DeleteFileW(tempPath);
+	}
+
+	return result;
+}
+
+DWORD RecorderTake(RecorderTrace** trace)
+{
+	if (trace == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	AcquireSRWLockExclusive(&RecorderLock);
+	RecorderTrace* taken = Recording;
+	Recording = NULL;
+	InterlockedExchange(&RecorderActive, 0);
+	if (taken != NULL)
+	{
+		taken->Count = NextSlot < (LONG)Capacity ? (UINT32)NextSlot : Capacity;
+		taken->Dropped = (UINT32)Dropped;
+	}
+	ReleaseSRWLockExclusive(&RecorderLock);
+
+	*trace = taken;
+	if (taken == NULL)
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	taken->Magic = RECORDER_MAGIC;
+	taken->Version = RECORDER_VERSION;
+	taken->Checksum = Checksum(taken);
+
+	return ERROR_SUCCESS;
+}
+
+DWORD RecorderStop(UINT* recorded)
+{
+	// Taken before the trace, a start racing the stop can't change it underneath
+	WCHAR path[MAX_PATH];
+	AcquireSRWLockShared(&RecorderLock);
+	StringCchCopyW(path, MAX_PATH, RecordingPath);
+	ReleaseSRWLockShared(&RecorderLock);
+
+	RecorderTrace* trace = NULL;
+	DWORD result = RecorderTake(&trace);
+	if (result != ERROR_SUCCESS)
+	{
+		return result;
+	}
+
+	result = path[0] != L'\0' ? Save(trace, path) : ERROR_INVALID_PARAMETER;
+	if (result == ERROR_SUCCESS)
+	{
+		NATIVELOG_INFO("recorded %u platform calls, dropped %u\n", trace->Count, trace->Dropped);
+	}
+	else
+	{
+		NATIVELOG_WARNING("failed to save platform call trace: %lu\n", result);
+	}
+
+	if (recorded != NULL)
+	{
+		*recorded = trace->Count;
+	}
+
+	RecorderFree(trace);
+
+	return result;
+}
+
+void RecorderRecord(TraceProbe probe, UINT32 digest, DWORD result, INT64 startTicks)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	AcquireSRWLockShared(&RecorderLock);
+	if (Recording != NULL)
+	{
+		LONG slot = InterlockedIncrement(&NextSlot) - 1;
+		if (slot < (LONG)Capacity)
+		{
+			RecorderCall* call = &Recording->Calls[slot];
+			call->Probe = (UINT16)probe;
+			call->ArgsDigest = digest;
+			call->Result = result;
+			call->LatencyUs = (UINT32)((now.QuadPart - startTicks) * 1000000 / TicksPerSecond);
+			call->StartUs = (UINT64)((startTicks - StartTicks) * 1000000 / TicksPerSecond);
+		}
+		else
+		{
+			InterlockedIncrement(&Dropped);
+		}
+	}
+	ReleaseSRWLockShared(&RecorderLock);
+}
+
+DWORD RecorderLoad(LPCWSTR path, RecorderTrace** trace)
+{
+	if (path == NULL || trace == NULL)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	*trace = NULL;
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return GetLastError();
+	}
+
+	LARGE_INTEGER fileSize;
+	DWORD result = ERROR_SUCCESS;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		result = GetLastError();
+	}
+	else if (fileSize.QuadPart < (LONGLONG)offsetof(RecorderTrace, Calls) || fileSize.QuadPart > (LONGLONG)RECORDER_TRACE_LENGTH(RECORDER_MAX_CAPACITY))
+	{
+		result = ERROR_FILE_CORRUPT;
+	}
+
+	RecorderTrace* loaded = NULL;
+	DWORD read = 0;
+	if (result == ERROR_SUCCESS)
+	{
+		// Room for one call even when there are none, so Calls is always addressable
+		loaded = (RecorderTrace*)HeapAlloc(GetProcessHeap(), 0, (SIZE_T)fileSize.QuadPart + sizeof(RecorderCall));
+		if (loaded == NULL)
+		{
+			result = ERROR_NOT_ENOUGH_MEMORY;
+		}
+		else if (!ReadFile(file, loaded, (DWORD)fileSize.QuadPart, &read, NULL))
+		{
+			result = GetLastError();
+		}
+	}
+
+	CloseHandle(file);
+
+	if (result == ERROR_SUCCESS)
+	{
+		if (read != (DWORD)fileSize.QuadPart || loaded->Magic != RECORDER_MAGIC)
+		{
+			result = ERROR_FILE_CORRUPT;
+		}
+		else if (loaded->Version != RECORDER_VERSION)
+		{
+			result = ERROR_REVISION_MISMATCH;
+		}
+		else if (loaded->Count > RECORDER_MAX_CAPACITY || RECORDER_TRACE_LENGTH(loaded->Count) != read || Checksum(loaded) != loaded->Checksum)
+		{
+			result = ERROR_FILE_CORRUPT;
+		}
+	}
+
+	for (UINT32 i = 0; result == ERROR_SUCCESS && i < loaded->Count; i++)
+	{
+		if (loaded->Calls[i].Probe >= TraceProbeCount)
+		{
+			result = ERROR_FILE_CORRUPT;
+		}
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		RecorderFree(loaded);
+		NATIVELOG_WARNING("failed to load platform call trace: %lu\n", result);
+		return result;
+	}
+
+	*trace = loaded;
+
+	return ERROR_SUCCESS;
+}
+
+void RecorderFree(RecorderTrace* trace)
+{
+	if (trace != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, trace);
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <Windows.h>
+#include <stddef.h>
+#include "Trace.h"
+
+#define RECORDER_MAGIC 0x52435055
+#define RECORDER_VERSION 1
+#define RECORDER_DEFAULT_CAPACITY 65536
+#define RECORDER_MAX_CAPACITY (1 << 22)
+#define RECORDER_DIGEST_SEED 2166136261u
+
+// One platform call. Arguments are folded into a digest rather than kept, so a trace from a user's machine
+// holds no hostnames, paths or credentials.
+typedef struct _RecorderCall
+{
+	// TraceProbe of the call
+	UINT16 Probe;
+	UINT16 Reserved;
+	UINT32 ArgsDigest;
+	DWORD Result;
+	UINT32 LatencyUs;
+	// From the start of the recording to the call
+	UINT64 StartUs;
+} RecorderCall;
+
+typedef struct _RecorderTrace
+{
+	UINT32 Magic;
+	UINT32 Version;
+	UINT32 Count;
+	// Calls made once the recording was full
+	UINT32 Dropped;
+	// CRC-32 of the calls
+	UINT32 Checksum;
+	UINT32 Reserved;
+	RecorderCall Calls[1];
+} RecorderTrace;
+
+#define RECORDER_TRACE_LENGTH(count) (offsetof(RecorderTrace, Calls) + (SIZE_T)(count) * sizeof(RecorderCall))
+
+// Non-zero while recording. The RAS and engine tables only hand out their recording wrappers while it is.
+extern volatile LONG RecorderActive;
+
+// Starts recording every RAS and engine call, capacity calls at most (RECORDER_DEFAULT_CAPACITY when 0). Nothing
+// is written until RecorderStop. path can be NULL for a recording only ever taken with RecorderTake.
+extern DWORD RecorderStart(LPCWSTR path, UINT capacity);
+
+// Stops recording and writes the trace to the path it was started with, next to it first then renamed over
+extern DWORD RecorderStop(UINT* recorded);
+
+// Stops recording and hands the trace over rather than writing it. Free it with RecorderFree.
+extern DWORD RecorderTake(RecorderTrace** trace);
+
+// Records a call that started at startTicks, a QueryPerformanceCounter reading, and has just returned result.
+// Does nothing once the recording has stopped.
+extern void RecorderRecord(TraceProbe probe, UINT32 digest, DWORD result, INT64 startTicks);
+
+// FNV-1a, folding the bytes or the string into digest. NULL folds in nothing.
+extern UINT32 RecorderDigest(UINT32 digest, const void* data, SIZE_T length);
+extern UINT32 RecorderDigestString(UINT32 digest, LPCWSTR value);
+
+// Reads and validates a trace RecorderStop wrote. Free it with RecorderFree.
+extern DWORD RecorderLoad(LPCWSTR path, RecorderTrace** trace);
+extern void RecorderFree(RecorderTrace* trace);
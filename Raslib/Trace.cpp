@@ -0,0 +1,469 @@
+#include "stdafx.h"
+#include <Windows.h>
+#include <stdlib.h>
+#include <strsafe.h>
+#include <TraceLoggingProvider.h>
+#include "Trace.h"
+
+// Upper bound of one timeline line, used to size the buffer a caller needs
+#define TRACE_TIMELINE_LINE_LENGTH 112
+
+#define TRACE_SPAN_CALL 0
+#define TRACE_SPAN_OPERATION 1
+
+// {8ed49e0a-c8e2-48a9-8906-481baf362158}
+TRACELOGGING_DEFINE_PROVIDER(
+	TraceProvider,
+	"Utilizr.Native",
+	(0x8ed49e0a, 0xc8e2, 0x48a9, 0x89, 0x06, 0x48, 0x1b, 0xaf, 0x36, 0x21, 0x58));
+
+typedef struct _TraceFrame
+{
+	UINT16 Probe;
+	INT64 Ticks;
+} TraceFrame;
+
+typedef struct _TraceSpan
+{
+	UINT32 RequestId;
+	UINT16 Probe;
+	UINT16 Kind;
+	DWORD Error;
+	DWORD ThreadId;
+	INT64 Start;
+	INT64 End;
+} TraceSpan;
+
+static const CHAR* ProbeNames[TraceProbeCount] =
+{
+	"FwpmEngineOpen0",
+	"FwpmEngineClose0",
+	"FwpmFilterGetByKey0",
+	"FwpmFilterAdd0",
+	"FwpmFilterDeleteByKey0",
+	"FwpmSubLayerAdd0",
+	"FwpmSubLayerDeleteByKey0",
+	"FwpmGetAppIdFromFileName0",
+	"RasGetEntryProperties",
+	"RasSetEntryProperties",
+	"RasValidateEntryName",
+	"RasEnumDevices",
+	"RasEnumConnections",
+	"RasGetEntryDialParams",
+	"RasDial",
+	"RasHangUp",
+	"RasGetConnectStatus",
+	"RasGetConnectionStatistics",
+	"RasConnectionNotification",
+	"ManagedCallback",
+};
+
+static const CHAR* OperationNames[TraceOpCount] =
+{
+	"engage",
+	"disengage",
+	"create-device",
+	"dial",
+	"disconnect",
+	"stats-poll",
+};
+
+volatile LONG TraceActiveMask;
+
+static volatile LONG NextRequestId;
+static __declspec(thread) UINT32 CurrentRequest;
+static __declspec(thread) UINT ThreadDepth;
+static __declspec(thread) TraceFrame ThreadFrames[TRACE_MAX_DEPTH];
+
+static SRWLOCK ProviderLock = SRWLOCK_INIT;
+static TraceProviderCallback Provider;
+static PVOID ProviderContext;
+static BOOL EtwRegistered;
+
+static SRWLOCK SpanLock = SRWLOCK_INIT;
+static TraceSpan* Spans;
+static UINT64 SpanNext;
+static UINT32 LastFinishedRequest;
+
+static INT64 Now()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+static void SetMode(LONG mode, BOOL enabled)
+{
+	if (enabled)
+	{
+		InterlockedOr(&TraceActiveMask, mode);
+	}
+	else
+	{
+		InterlockedAnd(&TraceActiveMask, ~mode);
+	}
+}
+
+static void NTAPI EtwEnableCallback(LPCGUID sourceId, ULONG isEnabled, UCHAR level, ULONGLONG matchAnyKeyword, ULONGLONG matchAllKeyword, PEVENT_FILTER_DESCRIPTOR filterData, PVOID context)
+{
+	// Capture state requests leave the session as it was
+	if (isEnabled == EVENT_CONTROL_CODE_ENABLE_PROVIDER || isEnabled == EVENT_CONTROL_CODE_DISABLE_PROVIDER)
+	{
+		SetMode(TRACE_MODE_ETW, isEnabled == EVENT_CONTROL_CODE_ENABLE_PROVIDER);
+	}
+}
+
+static void Emit(UINT32 requestId, UINT16 probe, TracePhase phase, DWORD error, INT64 ticks, INT64 durationTicks)
+{
+	LONG mode = TraceActiveMask;
+
+	if (mode & TRACE_MODE_PROVIDER)
+	{
+		TraceEvent event;
+		event.RequestId = requestId;
+		event.Probe = probe;
+		event.Phase = (UINT16)phase;
+		event.Error = error;
+		event.ThreadId = GetCurrentThreadId();
+		event.Ticks = ticks;
+
+		AcquireSRWLockShared(&ProviderLock);
+		if (Provider != NULL)
+		{
+			Provider(&event, ProviderContext);
+		}
+		ReleaseSRWLockShared(&ProviderLock);
+	}
+
+	if (mode & TRACE_MODE_ETW)
+	{
+		switch (phase)
+		{
+		case TracePhaseEnter:
+			TraceLoggingWrite(TraceProvider, "Enter",
+				TraceLoggingUInt32(requestId, "RequestId"),
+				TraceLoggingString(ProbeNames[probe], "Probe"));
+			break;
+		case TracePhaseExit:
+			TraceLoggingWrite(TraceProvider, "Exit",
+				TraceLoggingUInt32(requestId, "RequestId"),
+				TraceLoggingString(ProbeNames[probe], "Probe"),
+				TraceLoggingUInt32(error, "Error"),
+				TraceLoggingInt64(durationTicks, "DurationTicks"));
+			break;
+		case TracePhaseOperationBegin:
+			TraceLoggingWrite(TraceProvider, "OperationBegin",
+				TraceLoggingUInt32(requestId, "RequestId"),
+				TraceLoggingString(OperationNames[probe], "Operation"));
+			break;
+		case TracePhaseOperationEnd:
+			TraceLoggingWrite(TraceProvider, "OperationEnd",
+				TraceLoggingUInt32(requestId, "RequestId"),
+				TraceLoggingString(OperationNames[probe], "Operation"),
+				TraceLoggingUInt32(error, "Error"),
+				TraceLoggingInt64(durationTicks, "DurationTicks"));
+			break;
+		}
+	}
+}
+
+static void RecordSpan(UINT32 requestId, UINT16 probe, UINT16 kind, DWORD error, INT64 start, INT64 end)
+{
+	AcquireSRWLockExclusive(&SpanLock);
+
+	if (Spans != NULL)
+	{
+		TraceSpan* span = &Spans[SpanNext++ % TRACE_SPAN_CAPACITY];
+		span->RequestId = requestId;
+		span->Probe = probe;
+		span->Kind = kind;
+		span->Error = error;
+		span->ThreadId = GetCurrentThreadId();
+		span->Start = start;
+		span->End = end;
+
+		if (kind == TRACE_SPAN_OPERATION)
+		{
+			LastFinishedRequest = requestId;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&SpanLock);
+}
+
+void TraceEnterSlow(TraceProbe probe)
+{
+	INT64 now = Now();
+
+	if (ThreadDepth < TRACE_MAX_DEPTH)
+	{
+		ThreadFrames[ThreadDepth].Probe = (UINT16)probe;
+		ThreadFrames[ThreadDepth].Ticks = now;
+	}
+	ThreadDepth++;
+
+	Emit(CurrentRequest, (UINT16)probe, TracePhaseEnter, ERROR_SUCCESS, now, 0);
+}
+
+void TraceExitSlow(TraceProbe probe, DWORD error)
+{
+	INT64 now = Now();
+	INT64 start = now;
+
+	if (ThreadDepth > TRACE_MAX_DEPTH)
+	{
+		ThreadDepth--;
+	}
+	else
+	{
+		// Tracing switched on mid-call leaves an exit without its enter, match the frame by probe
+		for (UINT depth = ThreadDepth; depth > 0; depth--)
+		{
+			if (ThreadFrames[depth - 1].Probe == (UINT16)probe)
+			{
+				start = ThreadFrames[depth - 1].Ticks;
+				ThreadDepth = depth - 1;
+				break;
+			}
+		}
+	}
+
+	Emit(CurrentRequest, (UINT16)probe, TracePhaseExit, error, now, now - start);
+
+	if (TraceActiveMask & TRACE_MODE_SPANS)
+	{
+		RecordSpan(CurrentRequest, (UINT16)probe, TRACE_SPAN_CALL, error, start, now);
+	}
+}
+
+void TraceRequestBeginSlow(TraceOperation operation, TraceScope* scope)
+{
+	UINT32 requestId = (UINT32)InterlockedIncrement(&NextRequestId);
+
+	if (requestId == 0)
+	{
+		requestId = (UINT32)InterlockedIncrement(&NextRequestId);
+	}
+
+	scope->RequestId = requestId;
+	scope->PreviousId = CurrentRequest;
+	scope->Operation = (UINT16)operation;
+	scope->StartTicks = Now();
+	CurrentRequest = requestId;
+
+	Emit(requestId, (UINT16)operation, TracePhaseOperationBegin, ERROR_SUCCESS, scope->StartTicks, 0);
+}
+
+void TraceRequestRecord(const TraceScope* scope, DWORD error)
+{
+	if (scope->RequestId == 0 || TraceActiveMask == 0)
+	{
+		return;
+	}
+
+	INT64 now = Now();
+
+	Emit(scope->RequestId, scope->Operation, TracePhaseOperationEnd, error, now, now - scope->StartTicks);
+
+	if (TraceActiveMask & TRACE_MODE_SPANS)
+	{
+		RecordSpan(scope->RequestId, scope->Operation, TRACE_SPAN_OPERATION, error, scope->StartTicks, now);
+	}
+}
+
+void TraceRequestLeave(const TraceScope* scope)
+{
+	if (scope->RequestId != 0)
+	{
+		CurrentRequest = scope->PreviousId;
+	}
+}
+
+UINT32 TraceSetRequest(UINT32 requestId)
+{
+	UINT32 previous = CurrentRequest;
+	CurrentRequest = requestId;
+	return previous;
+}
+
+DWORD TraceSetSpansEnabled(BOOL enabled)
+{
+	TraceSpan* spans = NULL;
+
+	if (enabled)
+	{
+		spans = (TraceSpan*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, TRACE_SPAN_CAPACITY * sizeof(TraceSpan));
+		if (spans == NULL)
+		{
+			return ERROR_NOT_ENOUGH_MEMORY;
+		}
+	}
+
+	AcquireSRWLockExclusive(&SpanLock);
+
+	if (enabled && Spans != NULL)
+	{
+		// Already recording, keep what's there
+		ReleaseSRWLockExclusive(&SpanLock);
+		HeapFree(GetProcessHeap(), 0, spans);
+		return ERROR_SUCCESS;
+	}
+
+	TraceSpan* previous = Spans;
+	Spans = spans;
+	SpanNext = 0;
+	LastFinishedRequest = 0;
+	SetMode(TRACE_MODE_SPANS, enabled);
+
+	ReleaseSRWLockExclusive(&SpanLock);
+
+	if (previous != NULL)
+	{
+		HeapFree(GetProcessHeap(), 0, previous);
+	}
+
+	return ERROR_SUCCESS;
+}
+
+DWORD TraceSetProvider(TraceProviderCallback callback, PVOID context)
+{
+	AcquireSRWLockExclusive(&ProviderLock);
+	Provider = callback;
+	ProviderContext = context;
+	SetMode(TRACE_MODE_PROVIDER, callback != NULL);
+	ReleaseSRWLockExclusive(&ProviderLock);
+
+	return ERROR_SUCCESS;
+}
+
+static int CompareSpans(const void* left, const void* right)
+{
+	const TraceSpan* a = (const TraceSpan*)left;
+	const TraceSpan* b = (const TraceSpan*)right;
+
+	// The operation span leads, calls follow in the order they started
+	if (a->Kind != b->Kind)
+	{
+		return a->Kind == TRACE_SPAN_OPERATION ? -1 : 1;
+	}
+
+	return a->Start < b->Start ? -1 : a->Start > b->Start ? 1 : 0;
+}
+
+DWORD TraceFormatTimeline(UINT32 requestId, CHAR* buffer, DWORD length, DWORD* written)
+{
+	TraceSpan* matches = NULL;
+	UINT count = 0;
+	LARGE_INTEGER frequency;
+	DWORD result = ERROR_SUCCESS;
+
+	if (buffer == NULL || written == NULL || length == 0)
+	{
+		return ERROR_INVALID_PARAMETER;
+	}
+
+	matches = (TraceSpan*)HeapAlloc(GetProcessHeap(), 0, TRACE_SPAN_CAPACITY * sizeof(TraceSpan));
+	if (matches == NULL)
+	{
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+
+	AcquireSRWLockShared(&SpanLock);
+
+	if (Spans == NULL)
+	{
+		result = ERROR_NOT_READY;
+	}
+	else
+	{
+		UINT64 first = SpanNext > TRACE_SPAN_CAPACITY ? SpanNext - TRACE_SPAN_CAPACITY : 0;
+
+		if (requestId == 0)
+		{
+			requestId = LastFinishedRequest;
+		}
+
+		for (UINT64 i = first; i < SpanNext && requestId != 0; i++)
+		{
+			if (Spans[i % TRACE_SPAN_CAPACITY].RequestId == requestId)
+			{
+				matches[count++] = Spans[i % TRACE_SPAN_CAPACITY];
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&SpanLock);
+
+	if (result == ERROR_SUCCESS && count == 0)
+	{
+		result = ERROR_NOT_FOUND;
+	}
+
+	if (result != ERROR_SUCCESS)
+	{
+		HeapFree(GetProcessHeap(), 0, matches);
+		return result;
+	}
+
+	qsort(matches, count, sizeof(TraceSpan), CompareSpans);
+	QueryPerformanceFrequency(&frequency);
+
+	DOUBLE msPerTick = 1000.0 / frequency.QuadPart;
+	INT64 origin = matches[0].Start;
+	CHAR* next = buffer;
+	size_t remaining = length;
+	HRESULT hr;
+
+	if (matches[0].Kind == TRACE_SPAN_OPERATION)
+	{
+		hr = StringCchPrintfExA(next, remaining, &next, &remaining, 0, "request %u %s %.3f ms error %lu\n",
+			requestId, OperationNames[matches[0].Probe], (matches[0].End - matches[0].Start) * msPerTick, matches[0].Error);
+	}
+	else
+	{
+		hr = StringCchPrintfExA(next, remaining, &next, &remaining, 0, "request %u in progress\n", requestId);
+	}
+
+	for (UINT i = 0; i < count && SUCCEEDED(hr); i++)
+	{
+		if (matches[i].Kind == TRACE_SPAN_CALL)
+		{
+			hr = StringCchPrintfExA(next, remaining, &next, &remaining, 0, "%+12.3f ms %12.3f ms  %-28s error %-10lu thread %lu\n",
+				(matches[i].Start - origin) * msPerTick, (matches[i].End - matches[i].Start) * msPerTick,
+				ProbeNames[matches[i].Probe], matches[i].Error, matches[i].ThreadId);
+		}
+	}
+
+	if (FAILED(hr))
+	{
+		*buffer = '\0';
+		*written = (count + 1) * TRACE_TIMELINE_LINE_LENGTH;
+		result = ERROR_INSUFFICIENT_BUFFER;
+	}
+	else
+	{
+		*written = (DWORD)(next - buffer);
+	}
+
+	HeapFree(GetProcessHeap(), 0, matches);
+
+	return result;
+}
+
+void TraceInitialize()
+{
+	if (!EtwRegistered)
+	{
+		EtwRegistered = TraceLoggingRegisterEx(TraceProvider, EtwEnableCallback, NULL) == ERROR_SUCCESS;
+	}
+}
+
+void TraceShutdown()
+{
+	if (EtwRegistered)
+	{
+		SetMode(TRACE_MODE_ETW, FALSE);
+		TraceLoggingUnregister(TraceProvider);
+		EtwRegistered = FALSE;
+	}
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <Windows.h>
+
+// Spans the recorder keeps, older ones are overwritten
+#define TRACE_SPAN_CAPACITY 4096
+// Nested traced calls tracked per thread, a managed callback calling back into Raslib is the deepest case
+#define TRACE_MAX_DEPTH 8
+// Suggested buffer for TraceFormatTimeline, enough for a dial of a few hundred traced calls
+#define TRACE_TIMELINE_LENGTH 32768
+
+// TraceActiveMask bits, tracepoints do nothing while none are set
+#define TRACE_MODE_SPANS 0x0001
+#define TRACE_MODE_ETW 0x0002
+#define TRACE_MODE_PROVIDER 0x0004
+
+typedef enum _TraceProbe
+{
+	TraceProbeEngineOpen = 0,
+	TraceProbeEngineClose,
+	TraceProbeFilterGet,
+	TraceProbeFilterAdd,
+	TraceProbeFilterDelete,
+	TraceProbeSubLayerAdd,
+	TraceProbeSubLayerDelete,
+	TraceProbeAppId,
+	TraceProbeRasGetEntryProperties,
+	TraceProbeRasSetEntryProperties,
+	TraceProbeRasValidateEntryName,
+	TraceProbeRasEnumDevices,
+	TraceProbeRasEnumConnections,
+	TraceProbeRasGetEntryDialParams,
+	TraceProbeRasDial,
+	TraceProbeRasHangUp,
+	TraceProbeRasGetConnectStatus,
+	TraceProbeRasGetConnectionStatistics,
+	TraceProbeRasConnectionNotification,
+	TraceProbeManagedCallback,
+	TraceProbeCount,
+} TraceProbe;
+
+typedef enum _TraceOperation
+{
+	TraceOpEngage = 0,
+	TraceOpDisengage,
+	TraceOpCreateDevice,
+	TraceOpDial,
+	TraceOpDisconnect,
+	TraceOpStatsPoll,
+	TraceOpCount,
+} TraceOperation;
+
+typedef enum _TracePhase
+{
+	TracePhaseEnter = 0,
+	TracePhaseExit,
+	TracePhaseOperationBegin,
+	TracePhaseOperationEnd,
+} TracePhase;
+
+// Handed to the pluggable provider for every tracepoint hit. Probe holds a TraceOperation for the operation
+// phases. Ticks are QueryPerformanceCounter ticks.
+typedef struct _TraceEvent
+{
+	UINT32 RequestId;
+	UINT16 Probe;
+	UINT16 Phase;
+	DWORD Error;
+	DWORD ThreadId;
+	INT64 Ticks;
+} TraceEvent;
+
+typedef void (CALLBACK* TraceProviderCallback)(const TraceEvent* event, PVOID context);
+
+// One operation a request id covers, from the public entry point to its result
+typedef struct _TraceScope
+{
+	UINT32 RequestId;
+	UINT32 PreviousId;
+	UINT16 Operation;
+	INT64 StartTicks;
+} TraceScope;
+
+extern volatile LONG TraceActiveMask;
+
+extern void TraceEnterSlow(TraceProbe probe);
+extern void TraceExitSlow(TraceProbe probe, DWORD error);
+extern void TraceRequestBeginSlow(TraceOperation operation, TraceScope* scope);
+
+// A disabled tracepoint costs a load and a not taken branch
+FORCEINLINE void TraceEnter(TraceProbe probe)
+{
+	if (TraceActiveMask != 0)
+	{
+		TraceEnterSlow(probe);
+	}
+}
+
+FORCEINLINE DWORD TraceExit(TraceProbe probe, DWORD error)
+{
+	if (TraceActiveMask != 0)
+	{
+		TraceExitSlow(probe, error);
+	}
+
+	return error;
+}
+
+// Wraps a call returning a DWORD error code and evaluates to that code
+#define TRACE_CALL(probe, call) (TraceEnter(probe), TraceExit(probe, (DWORD)(call)))
+#define TRACE_CALL_VOID(probe, call) (TraceEnter(probe), (call), (void)TraceExit(probe, ERROR_SUCCESS))
+
+// Starts a request, the calling thread's tracepoints carry its id until TraceRequestLeave or TraceRequestEnd
+FORCEINLINE void TraceRequestBegin(TraceOperation operation, TraceScope* scope)
+{
+	scope->RequestId = 0;
+
+	if (TraceActiveMask != 0)
+	{
+		TraceRequestBeginSlow(operation, scope);
+	}
+}
+
+// Records the operation span, from any thread. Requests begun while tracing was off aren't recorded.
+extern void TraceRequestRecord(const TraceScope* scope, DWORD error);
+
+// Hands the calling thread back to the request it was serving before TraceRequestBegin, for an operation that
+// completes on another thread
+extern void TraceRequestLeave(const TraceScope* scope);
+
+FORCEINLINE void TraceRequestEnd(const TraceScope* scope, DWORD error)
+{
+	if (scope->RequestId != 0)
+	{
+		TraceRequestRecord(scope, error);
+		TraceRequestLeave(scope);
+	}
+}
+
+// Makes requestId the calling thread's request and returns the previous one, for callbacks on RAS threads
+extern UINT32 TraceSetRequest(UINT32 requestId);
+
+// The span recorder, off by default. Disabling it drops the recorded spans.
+extern DWORD TraceSetSpansEnabled(BOOL enabled);
+
+// Receives every tracepoint hit, for tracers other than ETW. NULL removes it. The callback runs on the thread
+// making the traced call and must not make traced calls itself.
+extern DWORD TraceSetProvider(TraceProviderCallback callback, PVOID context);
+
+// Writes the recorded spans of one request as a timeline relative to its start, requestId 0 picks the most
+// recently finished request. On ERROR_INSUFFICIENT_BUFFER written is a length that fits.
+extern DWORD TraceFormatTimeline(UINT32 requestId, CHAR* buffer, DWORD length, DWORD* written);
+
+// Registers the "Utilizr.Native" ETW provider, an ETW session enabling it switches the tracepoints on. Call
+// from DLL_PROCESS_ATTACH and TraceShutdown from DLL_PROCESS_DETACH.
+extern void TraceInitialize();
+extern void TraceShutdown();
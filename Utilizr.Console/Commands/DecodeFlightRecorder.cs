@@ -0,0 +1,168 @@
+﻿using CommandLine;
+using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace Utilizr.Console.Commands
+{
+    // Reads the files the native flight recorder maps or dumps, see Raslib/FlightRecorder.h for the layout
+    internal class DecodeFlightRecorder
+    {
+        const uint Magic = 0x54484C46;
+        const uint Version = 1;
+        const int HeaderLength = 64;
+        const int RingHeaderLength = 64;
+        const int EventLength = 32;
+        const uint SharedRing = 0x0001;
+
+        static readonly string[] TypeNames =
+        {
+            "mark",
+            "dial-state",
+            "hang-up",
+            "filter-add",
+            "stats-anomaly",
+            "crash",
+        };
+
+        struct FlightEvent
+        {
+            public long Ticks;
+            public ulong Argument;
+            public uint ThreadId;
+            public ushort Type;
+            public uint Value;
+        }
+
+        internal static void Run(DecodeFlightRecorderOptions options)
+        {
+            try
+            {
+                Decode(options);
+            }
+            catch (Exception ex)
+            {
+                System.Console.WriteLine($"Failed to decode '{options.Input}': {ex.Message}");
+            }
+        }
+
+        static void Decode(DecodeFlightRecorderOptions options)
+        {
+            // The recording process may still have the file mapped
+            using var stream = new FileStream(options.Input!, FileMode.Open, FileAccess.Read, FileShare.ReadWrite | FileShare.Delete);
+            using var reader = new BinaryReader(stream);
+
+            if (stream.Length < HeaderLength || reader.ReadUInt32() != Magic)
+                throw new InvalidDataException("Not a flight recorder file.");
+
+            var version = reader.ReadUInt32();
+            if (version != Version)
+                throw new InvalidDataException($"Unsupported version {version}.");
+
+            var ringCount = reader.ReadUInt32();
+            var eventsPerRing = reader.ReadUInt32();
+            var startTicks = reader.ReadInt64();
+            var ticksPerSecond = reader.ReadInt64();
+            var startTime = DateTime.FromFileTimeUtc(reader.ReadInt64());
+            var processId = reader.ReadUInt32();
+            var ringsClaimed = reader.ReadInt32();
+            var crashCode = reader.ReadUInt32();
+
+            var ringLength = RingHeaderLength + (long)eventsPerRing * EventLength;
+            if (ticksPerSecond <= 0 || eventsPerRing == 0 || (eventsPerRing & (eventsPerRing - 1)) != 0 || stream.Length < HeaderLength + ringCount * ringLength)
+                throw new InvalidDataException("The header doesn't match the file.");
+
+            System.Console.WriteLine($"Process {processId}, started {startTime:yyyy-MM-dd HH:mm:ss.fff}Z, {Math.Min(ringsClaimed, (int)ringCount)} of {ringCount} rings used");
+            if (crashCode != 0)
+                System.Console.WriteLine($"Crashed with exception 0x{crashCode:X8}");
+
+            var events = new List<FlightEvent>();
+            var mask = eventsPerRing - 1;
+
+            for (var ring = 0; ring < ringCount; ring++)
+            {
+                stream.Position = HeaderLength + ring * ringLength;
+                var ringThread = reader.ReadUInt32();
+                var flags = reader.ReadUInt32();
+                var head = reader.ReadInt64();
+                if (head == 0)
+                    continue;
+
+                stream.Position += RingHeaderLength - 16;
+                var kept = 0;
+
+                for (uint slot = 0; slot < eventsPerRing; slot++)
+                {
+                    var e = new FlightEvent
+                    {
+                        Ticks = reader.ReadInt64(),
+                        Argument = reader.ReadUInt64(),
+                    };
+                    var sequence = reader.ReadUInt32();
+                    e.ThreadId = reader.ReadUInt32();
+                    e.Type = reader.ReadUInt16();
+                    reader.ReadUInt16();
+                    e.Value = reader.ReadUInt32();
+
+                    // Zero or out of place when the writer died part way through the event
+                    if (sequence == 0 || ((sequence - 1) & mask) != slot)
+                        continue;
+
+                    if (options.Thread == null || options.Thread == e.ThreadId)
+                        events.Add(e);
+
+                    kept++;
+                }
+
+                var owner = (flags & SharedRing) != 0 ? "shared" : $"thread {ringThread}";
+                System.Console.WriteLine($"Ring {ring} ({owner}): {head} events written, {kept} kept");
+            }
+
+            events.Sort((a, b) => a.Ticks.CompareTo(b.Ticks));
+
+            var first = options.Last > 0 && events.Count > options.Last ? events.Count - options.Last : 0;
+            System.Console.WriteLine();
+
+            for (var i = first; i < events.Count; i++)
+            {
+                var e = events[i];
+                var time = startTime.AddTicks((long)((double)(e.Ticks - startTicks) * TimeSpan.TicksPerSecond / ticksPerSecond));
+                var type = e.Type < TypeNames.Length ? TypeNames[e.Type] : $"type-{e.Type}";
+
+                System.Console.WriteLine($"{time:HH:mm:ss.ffffff} {e.ThreadId,6} {type,-14} {FormatValue(e)}");
+            }
+        }
+
+        static string FormatValue(FlightEvent e)
+        {
+            switch (e.Type)
+            {
+                case 1:
+                    return $"state {e.Value} error {e.Argument}";
+                case 2:
+                    return $"result {e.Value} after {e.Argument} attempts";
+                case 3:
+                    return $"result 0x{e.Value:X8} filter {e.Argument}";
+                case 4:
+                    return $"error {e.Value} reading {(e.Argument == 0 ? "status" : "statistics")}";
+                case 5:
+                    return $"exception 0x{e.Value:X8} at 0x{e.Argument:X}";
+                default:
+                    return $"{e.Value} {e.Argument}";
+            }
+        }
+    }
+
+    [Verb("flight-recorder", HelpText = "Decodes a native flight recorder file, live or dumped, into a timeline.")]
+    class DecodeFlightRecorderOptions
+    {
+        [Option(Required = true, HelpText = "The flight recorder file.")]
+        public string? Input { get; set; }
+
+        [Option(HelpText = "Only the events of this thread id.")]
+        public uint? Thread { get; set; }
+
+        [Option(Default = 0, HelpText = "Only the most recent events, 0 for all of them.")]
+        public int Last { get; set; }
+    }
+}
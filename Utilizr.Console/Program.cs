@@ -25,11 +25,13 @@ namespace Utilizr.Console
                     GeneratePotFileOptions,
                     GenerateSourceListOptions,
                     ValidateLocaleOptions,
-                    FlattenResourceDictionaryOptions>(args)
+                    FlattenResourceDictionaryOptions,
+                    DecodeFlightRecorderOptions>(args)
                         .WithParsed<GeneratePotFileOptions>(GeneratePotFile.Run)
                         .WithParsed<GenerateSourceListOptions>(GenerateSourceList.Run)
                         .WithParsed<ValidateLocaleOptions>(ValidateLocales.Run)
                         .WithParsed<FlattenResourceDictionaryOptions>(FlattenResourceDictionary.Run)
+                        .WithParsed<DecodeFlightRecorderOptions>(DecodeFlightRecorder.Run)
                         .WithNotParsed(HandleParseError);
 
                 return;
@@ -37,10 +39,12 @@ namespace Utilizr.Console
                 CommandLine.Parser.Default.ParseArguments<
                     GeneratePotFileOptions,
                     GenerateSourceListOptions,
-                    ValidateLocaleOptions>(args)
+                    ValidateLocaleOptions,
+                    DecodeFlightRecorderOptions>(args)
                         .WithParsed<GeneratePotFileOptions>(GeneratePotFile.Run)
                         .WithParsed<GenerateSourceListOptions>(GenerateSourceList.Run)
                         .WithParsed<ValidateLocaleOptions>(ValidateLocales.Run)
+                        .WithParsed<DecodeFlightRecorderOptions>(DecodeFlightRecorder.Run)
                         .WithNotParsed(HandleParseError);
             }
             catch (Exception ex)
@@ -4,6 +4,11 @@
 // Windows Header Files
 #include <windows.h>
 #include "Raslib.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Recorder.h"
+#include "FlightRecorder.h"
+#include "Executor.h"
 
 
 extern "C" {
@@ -12,6 +17,14 @@ extern "C" {
 		return CreateVpnDevice(deviceName, connectionHostname);
 	}
 
+	__declspec(dllexport) DWORD RaslibPrepareIkevVpnDevices(LPCWSTR deviceName, LPCWSTR* hostnames, UINT hostnameCount) {
+		return PrepareVpnDevices(deviceName, hostnames, hostnameCount);
+	}
+
+	__declspec(dllexport) DWORD RaslibSetIkevDeviceCacheEnabled(BOOL enabled) {
+		return SetVpnDeviceCacheEnabled(enabled);
+	}
+
 	__declspec(dllexport) DWORD RaslibAbortIkevVpn() {
 		return AbortDialAttempt();
 	}
@@ -40,8 +53,143 @@ extern "C" {
 		return GetVpnDeviceStatistics(deviceName, returnStats);
 	}
 
+	__declspec(dllexport) DWORD RaslibGetIkevVpnStatisticsBatch(LPCWSTR* deviceNames, UINT deviceCount, VpnDeviceStats* returnStats, DWORD* results, LPWSTR hostnames, DWORD hostnameLength) {
+		return GetVpnDeviceStatisticsBatch(deviceNames, deviceCount, returnStats, results, hostnames, hostnameLength);
+	}
+
 	__declspec(dllexport) DWORD RaslibSetLogCallback(PLogCallback logCallback)
 	{
 		return SetLogCallback(logCallback);
 	}
+
+	__declspec(dllexport) DWORD RaslibSetLogLevel(NativeLogLevel level)
+	{
+		return NativeLogSetLevel(level);
+	}
+
+	__declspec(dllexport) DWORD RaslibFlushLog(DWORD timeoutMs)
+	{
+		return NativeLogFlush(timeoutMs);
+	}
+
+	// Dial, hang up, stats poll and log metrics of this module, the killswitch ones live in Netlib
+	__declspec(dllexport) DWORD RaslibRenderMetrics(CHAR* buffer, DWORD length, DWORD* written)
+	{
+		return MetricsRender(buffer, length, written);
+	}
+
+	__declspec(dllexport) DWORD RaslibEnableTraceSpans(BOOL enabled)
+	{
+		return TraceSetSpansEnabled(enabled);
+	}
+
+	__declspec(dllexport) DWORD RaslibSetTraceProvider(TraceProviderCallback callback, PVOID context)
+	{
+		return TraceSetProvider(callback, context);
+	}
+
+	__declspec(dllexport) DWORD RaslibFormatTraceTimeline(UINT32 requestId, CHAR* buffer, DWORD length, DWORD* written)
+	{
+		return TraceFormatTimeline(requestId, buffer, length, written);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionCreate(const DialSessionCallbacks* callbacks, HDIALSESSION* session)
+	{
+		return DialSessionCreate(callbacks, session);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionDial(
+		HDIALSESSION session,
+		LPCWSTR deviceName,
+		LPCWSTR connectionHostname,
+		LPCWSTR username,
+		LPCWSTR password
+	) {
+		return DialSessionDial(session, deviceName, connectionHostname, username, password);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionAbort(HDIALSESSION session) {
+		return DialSessionAbort(session);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionGetState(HDIALSESSION session, DialSessionState* state, DWORD* error) {
+		return DialSessionGetState(session, state, error);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialSessionClose(HDIALSESSION session) {
+		return DialSessionClose(session);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceStart(
+		LPCWSTR deviceName,
+		LPCWSTR* hostnames,
+		UINT hostnameCount,
+		UINT maxParallel,
+		LPCWSTR username,
+		LPCWSTR password,
+		const DialRaceCallbacks* callbacks,
+		HDIALRACE* race
+	) {
+		return DialRaceStart(deviceName, hostnames, hostnameCount, maxParallel, username, password, callbacks, race);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceAbort(HDIALRACE race) {
+		return DialRaceAbort(race);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceGetWinner(HDIALRACE race, UINT* winner, LPWSTR entryName, DWORD entryNameLength) {
+		return DialRaceGetWinner(race, winner, entryName, entryNameLength);
+	}
+
+	__declspec(dllexport) DWORD RaslibDialRaceClose(HDIALRACE race) {
+		return DialRaceClose(race);
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectStart(const ReconnectOptions* options, ReconnectCallback callback, PVOID context, HRECONNECT* reconnector) {
+		return ReconnectStart(options, callback, context, reconnector);
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectGetStatus(HRECONNECT reconnector, ReconnectStatus* status) {
+		return ReconnectGetStatus(reconnector, status);
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectNotifyNetworkChange() {
+		return ReconnectNotifyNetworkChange();
+	}
+
+	__declspec(dllexport) DWORD RaslibReconnectStop(HRECONNECT reconnector) {
+		return ReconnectStop(reconnector);
+	}
+
+	__declspec(dllexport) DWORD RaslibStartRecording(LPCWSTR path, UINT capacity) {
+		return RecorderStart(path, capacity);
+	}
+
+	__declspec(dllexport) DWORD RaslibStopRecording(UINT* recorded) {
+		return RecorderStop(recorded);
+	}
+
+	__declspec(dllexport) DWORD RaslibStartFlightRecorder(LPCWSTR path, UINT rings, UINT eventsPerRing) {
+		return FlightRecorderStart(path, rings, eventsPerRing);
+	}
+
+	__declspec(dllexport) DWORD RaslibSetFlightRecorderEnabled(BOOL enabled) {
+		return FlightRecorderSetEnabled(enabled);
+	}
+
+	__declspec(dllexport) DWORD RaslibMarkFlightRecorder(UINT32 value, UINT64 argument) {
+		return FlightRecorderMark(value, argument);
+	}
+
+	__declspec(dllexport) DWORD RaslibDumpFlightRecorder(LPCWSTR path) {
+		return FlightRecorderDump(path);
+	}
+
+	__declspec(dllexport) DWORD RaslibStartExecutor(const ExecutorOptions* options) {
+		return ExecutorStart(options);
+	}
+
+	__declspec(dllexport) DWORD RaslibGetExecutorStats(ExecutorStats* stats) {
+		return ExecutorGetStats(stats);
+	}
 }
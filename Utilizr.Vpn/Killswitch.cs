@@ -18,6 +18,14 @@ namespace Utilizr.Vpn
 
         const string NETLIB_DLL = "Netlib.dll";
 
+        const uint NO_TAP_ADAPTER = 999999;
+        const int ERROR_FILE_NOT_FOUND = 2;
+        const int ERROR_REVISION_MISMATCH = 1306;
+        const int ERROR_FILE_CORRUPT = 1392;
+        const int ERROR_ALREADY_EXISTS = 183;
+        const int ERROR_NOT_FOUND = 1168;
+        const ushort DNS_PORT = 53;
+
         [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
         public static extern int KillswitchEngage2(
             [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)]  ADDR_AND_MASK[] remoteAddrs,
@@ -29,6 +37,38 @@ namespace Utilizr.Vpn
             [MarshalAs(UnmanagedType.Bool)] bool persistReboot,
             [MarshalAs(UnmanagedType.LPWStr)] string displayName);
 
+        [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int KillswitchEngage3(
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)]  ADDR_AND_MASK[] remoteAddrs,
+            int addrCount,
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 3)]  ADDR_AND_MASK[] localAddrs,
+            int localAddrCount,
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 5)]  PORT_RULE[]? portRules,
+            int portRuleCount,
+            uint tapAdapterIndex,
+            [MarshalAs(UnmanagedType.LPWStr)] string ovpnBinaryPath,
+            [MarshalAs(UnmanagedType.Bool)] bool persistReboot,
+            [MarshalAs(UnmanagedType.LPWStr)] string displayName);
+
+        [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int SaveKillswitchPolicy(
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 1)]  ADDR_AND_MASK[] remoteAddrs,
+            int addrCount,
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 3)]  ADDR_AND_MASK[] localAddrs,
+            int localAddrCount,
+            [MarshalAs(UnmanagedType.LPArray, SizeParamIndex = 5)]  PORT_RULE[]? portRules,
+            int portRuleCount,
+            uint tapAdapterIndex,
+            [MarshalAs(UnmanagedType.LPWStr)] string ovpnBinaryPath,
+            [MarshalAs(UnmanagedType.Bool)] bool persistReboot,
+            [MarshalAs(UnmanagedType.LPWStr)] string displayName,
+            [MarshalAs(UnmanagedType.LPWStr)] string path);
+
+        [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int KillswitchEngagePolicy(
+            [MarshalAs(UnmanagedType.LPWStr)] string path,
+            uint tapAdapterIndex);
+
         [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
         public static extern int KillswitchDisengage();
 
@@ -36,8 +76,33 @@ namespace Utilizr.Vpn
         [return: MarshalAs(UnmanagedType.Bool)]
         public static extern bool KillswitchIsEngaged();
 
+        [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int StartDnsForwarder(
+            [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.LPWStr, SizeParamIndex = 1)] string[] upstreams,
+            uint upstreamCount,
+            ushort port,
+            IntPtr options,
+            out ushort boundPort);
+
+        [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int StopDnsForwarder();
+
+        [DllImport(NETLIB_DLL, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int SetDnsForwarderPins(
+            [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.LPWStr, SizeParamIndex = 2)] string[] hostnames,
+            [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.LPWStr, SizeParamIndex = 2)] string[] addresses,
+            uint count);
+
         readonly string _appName;
 
+        /// <summary>
+        /// When set, Engage also answers the host entries from a DNS forwarder on 127.0.0.1:53 and forwards every
+        /// other lookup to these addresses alone. They have to be in the remote addresses Engage allows. Engage leaves
+        /// the adapters' DNS servers alone, so lookups only reach the forwarder once the caller points them at
+        /// 127.0.0.1. The host entries still go in the hosts file so they resolve either way.
+        /// </summary>
+        public string[]? DnsForwarderUpstreams { get; set; }
+
         public Killswitch(string appName)
         {
             _appName = appName;
@@ -50,29 +115,35 @@ namespace Utilizr.Vpn
 
         public void Engage(HostEntry[] hostEntries, ADDR_AND_MASK[] remoteAddrs, ADDR_AND_MASK[] localAddrs, bool persistReboot, string displayName)
         {
-            uint adapter = 999999;
+            Engage(hostEntries, remoteAddrs, localAddrs, null, persistReboot, displayName);
+        }
 
-            try
-            {
-                adapter = TapInstaller.GetTapAdapterIndex();
-            }
-            catch (Exception)
-            {
-                Log.Warning(_logCat, "failed to get tap adapter index, killswitch will still be enabled");
-            }
+        /// <summary>
+        /// Engages with portRules in place of the default DHCP, IKE, SSDP, NAT-PMP and mDNS ports, when not null
+        /// </summary>
+        public void Engage(HostEntry[] hostEntries, ADDR_AND_MASK[] remoteAddrs, ADDR_AND_MASK[] localAddrs, PORT_RULE[]? portRules, bool persistReboot, string displayName)
+        {
+            uint adapter = GetTapAdapterIndex();
 
             AddHostFileEntries(hostEntries);
 
+            if (DnsForwarderUpstreams?.Length > 0)
+            {
+                ServeHostEntries(hostEntries, DnsForwarderUpstreams);
+            }
+
             Log.Info(_logCat, $"enabling killswitch for adapter:{adapter} reboot:{persistReboot}");
 #if DEBUG
             Console.WriteLine($"enabling killswitch for adapter:{adapter} reboot:{persistReboot}");
 #endif
 
-            var res = KillswitchEngage2(
+            var res = KillswitchEngage3(
                 remoteAddrs,
                 remoteAddrs.Length,
                 localAddrs,
                 localAddrs.Length,
+                portRules,
+                portRules?.Length ?? 0,
                 adapter,
                 OVPNProcess.OvpnBinaryPath,
                 persistReboot,
@@ -84,6 +155,92 @@ namespace Utilizr.Vpn
             }
         }
 
+        /// <summary>
+        /// Compiles what Engage would apply into a policy file EngagePolicy can engage from at the next start, without
+        /// waiting on the arguments to be worked out again. Null portRules takes the default ports.
+        /// </summary>
+        public void SavePolicy(ADDR_AND_MASK[] remoteAddrs, ADDR_AND_MASK[] localAddrs, PORT_RULE[]? portRules, bool persistReboot, string displayName, string path)
+        {
+            var res = SaveKillswitchPolicy(
+                remoteAddrs,
+                remoteAddrs.Length,
+                localAddrs,
+                localAddrs.Length,
+                portRules,
+                portRules?.Length ?? 0,
+                GetTapAdapterIndex(),
+                OVPNProcess.OvpnBinaryPath,
+                persistReboot,
+                displayName,
+                path);
+
+            if (res != 0)
+            {
+                throw new Win32Exception(res);
+            }
+        }
+
+        /// <summary>
+        /// Engages from a policy file SavePolicy wrote. Returns false when there's no usable policy at path, Engage
+        /// has to be used instead.
+        /// </summary>
+        public bool EngagePolicy(string path)
+        {
+            var res = KillswitchEngagePolicy(path, GetTapAdapterIndex());
+            if (res == ERROR_FILE_NOT_FOUND || res == ERROR_FILE_CORRUPT || res == ERROR_REVISION_MISMATCH)
+            {
+                Log.Info(_logCat, $"no usable killswitch policy at {path}: {res}");
+                return false;
+            }
+
+            if (res != 0)
+            {
+                throw new Win32Exception(res);
+            }
+
+            return true;
+        }
+
+        uint GetTapAdapterIndex()
+        {
+            try
+            {
+                return TapInstaller.GetTapAdapterIndex();
+            }
+            catch (Exception)
+            {
+                Log.Warning(_logCat, "failed to get tap adapter index, killswitch will still be enabled");
+                return NO_TAP_ADAPTER;
+            }
+        }
+
+        void ServeHostEntries(HostEntry[] hostEntries, string[] upstreams)
+        {
+            var res = SetDnsForwarderPins(
+                hostEntries.Select(e => e.Hostname).ToArray(),
+                hostEntries.Select(e => e.IpAddress).ToArray(),
+                (uint)hostEntries.Length);
+
+            if (res != 0)
+            {
+                throw new Win32Exception(res);
+            }
+
+            // Engaging again only changes the pins, the running forwarder picks them up
+            res = StartDnsForwarder(upstreams, (uint)upstreams.Length, DNS_PORT, IntPtr.Zero, out _);
+            if (res == ERROR_ALREADY_EXISTS)
+            {
+                return;
+            }
+
+            if (res != 0)
+            {
+                throw new Win32Exception(res);
+            }
+
+            Log.Info(_logCat, $"dns forwarder started with {hostEntries.Length} pinned hosts");
+        }
+
         void AddHostFileEntries(HostEntry[] hostsEntries)
         {
             var hostFilePath = "%windir%\\system32\\drivers\\etc\\hosts".ExpandVars();
@@ -128,6 +285,12 @@ namespace Utilizr.Vpn
 
         public void Disengage()
         {
+            var forwarderRes = StopDnsForwarder();
+            if (forwarderRes != 0 && forwarderRes != ERROR_NOT_FOUND)
+            {
+                Log.Warning(_logCat, $"failed to stop dns forwarder: {forwarderRes}");
+            }
+
             try
             {
                 DeleteHostEntries();
@@ -0,0 +1,26 @@
+﻿using System;
+using System.Runtime.InteropServices;
+
+namespace Utilizr.Vpn
+{
+    /// <summary>
+    /// A port range the killswitch lets out, WFPKS_PORT_RULE in wfp_killswitch.h
+    /// </summary>
+    [Serializable]
+    [StructLayout(LayoutKind.Sequential)]
+    public struct PORT_RULE
+    {
+        public const byte ANY_PROTOCOL = 0;
+        public const byte TCP = 6;
+        public const byte UDP = 17;
+
+        public const byte REMOTE = 0;
+        public const byte LOCAL = 1;
+
+        public byte protocol;
+        public byte direction;
+        public ushort portLow;
+        // Inclusive, 0 for portLow alone
+        public ushort portHigh;
+    }
+}